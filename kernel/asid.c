@@ -0,0 +1,227 @@
+// Address space identifiers (ASIDs).
+//
+// Every address space gets an ASID, which goes into satp alongside its page table, so that the TLB
+// can hold entries for several address spaces at once and switching between user and kernel page
+// tables doesn't need to flush it.
+//
+// ASIDs are handed out in increasing order. When they run out, a new generation starts: every
+// address space's ASID becomes stale and is replaced the next time one of its processes returns to
+// user space, and every CPU flushes its whole TLB before running a process from the new
+// generation. Within a generation, an ASID is never reused, so a CPU only needs to flush an address
+// space's entries when its page table may have changed while the CPU wasn't looking.
+//
+// A change to the page table is flushed from this CPU's TLB by whoever makes it. Threads that
+// share the address space may be running on other CPUs at the same time, so those CPUs are sent a
+// kick asking them to flush too, and the change waits for them; see asid_shootdown(). Other CPUs
+// that have run the address space before just flush when they next run it.
+//
+// If the hardware implements no ASID bits, every address space uses ASID 0 and trampoline.S
+// flushes the TLB on every switch, as before; only the threads on other CPUs need telling.
+
+#include "types.h"
+#include "param.h"
+#include "memlayout.h"
+#include "riscv.h"
+#include "spinlock.h"
+#include "sleeplock.h"
+#include "proc.h"
+#include "defs.h"
+#include "vm.h"
+
+static struct spinlock asid_lock;
+
+// The current generation. Starts at 1, so that a process with asid_gen 0 has no ASID.
+static uint64 asid_generation = 1;
+
+// The next ASID to hand out in the current generation.
+static uint asid_next = 1;
+
+// The largest ASID the hardware supports, or 0 if it has none. ASID 0 is the kernel's.
+static uint asid_max;
+
+// Find out how many ASID bits satp implements, by writing all ones to the field and reading back
+// what stuck. Must run after kvminithart() on the first hart, before any process exists.
+void
+asidinit(void)
+{
+  initlock(&asid_lock, "asid");
+
+  uint64 satp = r_satp();
+
+  w_satp(satp | ((uint64)SATP_ASID_MASK << SATP_ASID_SHIFT));
+  asid_max = (r_satp() >> SATP_ASID_SHIFT) & SATP_ASID_MASK;
+  w_satp(satp);
+  sfence_vma();
+}
+
+// Return the ASID p should run with on this CPU, giving its address space a new one if its ASID is
+// from an old generation, and flush whatever stale TLB entries this CPU may have for it. Called by
+// usertrapret() with interrupts off.
+uint
+asid_activate(struct proc *p)
+{
+  struct mm *m  = p->mm;
+  struct cpu *c = mycpu();
+  uint64 bit    = 1UL << cpuid();
+
+  // most returns to user space are to the address space this CPU was already running, as after a
+  // system call. c->mm was set and fenced then, so asid_shootdown() has been kicking this CPU for
+  // changes to m all along, and would have cleared its bit in m->cpus; with the bit still there,
+  // there is nothing to flush, and the fence and atomic update below can be skipped
+  if (asid_max != 0 && c->mm == m && c->asid_gen == m->asid_gen &&
+      m->asid_gen == __atomic_load_n(&asid_generation, __ATOMIC_ACQUIRE) &&
+      (__atomic_load_n(&m->cpus, __ATOMIC_SEQ_CST) & bit)) {
+    return m->asid;
+  }
+
+  // from here on, asid_shootdown() kicks this CPU for changes to m; it must see this before this
+  // CPU looks at m->cpus below, or a change could slip between the two unflushed
+  __atomic_store_n(&c->mm, m, __ATOMIC_RELAXED);
+  __sync_synchronize();
+
+  if (asid_max == 0) {
+    return 0;
+  }
+
+  if (m->asid_gen != __atomic_load_n(&asid_generation, __ATOMIC_ACQUIRE)) {
+    acquire(&asid_lock);
+
+    if (m->asid_gen != asid_generation) {
+      if (asid_next > asid_max) {
+        __atomic_store_n(&asid_generation, asid_generation + 1, __ATOMIC_RELEASE);
+        asid_next = 1;
+      }
+
+      m->asid     = asid_next++;
+      m->asid_gen = asid_generation;
+
+      // no CPU has run m under its new ASID yet
+      __atomic_store_n(&m->cpus, 0, __ATOMIC_RELAXED);
+    }
+
+    release(&asid_lock);
+  }
+
+  // a CPU keeps its bit in m->cpus for as long as its TLB has seen every change to m
+  int stale = (__atomic_fetch_or(&m->cpus, bit, __ATOMIC_SEQ_CST) & bit) == 0;
+
+  if (c->asid_gen != m->asid_gen) {
+    // this CPU hasn't run anything from this generation yet, so its TLB may hold entries for any
+    // of the generation's ASIDs
+    sfence_vma();
+    c->asid_gen = m->asid_gen;
+  } else if (stale) {
+    sfence_vma_asid(m->asid);
+  }
+
+  return m->asid;
+}
+
+// Flush this CPU's TLB if another CPU has asked it to in asid_shootdown(). Called with interrupts
+// off when a kick arrives, and while spinning for a lock or for other CPUs' flushes, so that two
+// CPUs never wait for each other.
+void
+asid_poll(void)
+{
+  struct cpu *c = mycpu();
+  uint64 req    = __atomic_load_n(&c->tlbreq, __ATOMIC_ACQUIRE);
+
+  if (req != c->tlbdone) {
+    sfence_vma();
+    __atomic_store_n(&c->tlbdone, req, __ATOMIC_RELEASE);
+  }
+}
+
+// Make sure no other CPU goes on using TLB entries for m from before a change to its page table
+// that the caller has just made. The other CPUs lose their bits in m->cpus, so that they flush when
+// they next run m. If m has other threads, those CPUs that may be running one right now are
+// kicked, and flush straight away, and this waits until they have. The caller's PTE change and the
+// clearing of the bits come before the look at cpus[].mm, and asid_activate() does the same in the
+// other order, so every CPU either sees the change or gets flushed.
+static void
+asid_shootdown(struct mm *m)
+{
+  uint64 want[NCPU];
+  int kicked = 0;
+
+  push_off();
+
+  int me = cpuid();
+
+  __atomic_fetch_and(&m->cpus, 1UL << me, __ATOMIC_SEQ_CST);
+
+  // if m is this process's and has no other threads, no other CPU can be running in it; swapout()
+  // changes other processes' page tables, though
+  struct proc *p = myproc();
+
+  if (p == 0 || p->mm != m || __atomic_load_n(&m->users, __ATOMIC_RELAXED) > 1) {
+    for (int i = 0; i < NCPU; i++) {
+      want[i] = 0;
+
+      if (i != me && __atomic_load_n(&cpus[i].mm, __ATOMIC_SEQ_CST) == m) {
+        want[i] = __atomic_add_fetch(&cpus[i].tlbreq, 1, __ATOMIC_ACQ_REL);
+        cpukick(i);
+        kicked++;
+      }
+    }
+  }
+
+  for (int i = 0; kicked > 0 && i < NCPU; i++) {
+    while (want[i] && __atomic_load_n(&cpus[i].tlbdone, __ATOMIC_ACQUIRE) < want[i]) {
+      asid_poll();
+    }
+  }
+
+  pop_off();
+}
+
+// The address space of the current process if pagetable is its page table, and so may be in use in
+// TLBs, or 0.
+static struct mm *
+asid_mm(pagetable_t pagetable)
+{
+  struct proc *p = myproc();
+
+  return p != 0 && p->pagetable == pagetable ? p->mm : 0;
+}
+
+// Flush this CPU's TLB entry for va in pagetable's address space, after changing or removing its
+// PTE, and have other CPUs do the same.
+void
+asid_flush_va(pagetable_t pagetable, uint64 va)
+{
+  struct mm *m = asid_mm(pagetable);
+
+  if (m == 0) {
+    return;
+  }
+
+  if (asid_max != 0 && m->asid_gen == asid_generation) {
+    sfence_vma_va_asid(va, m->asid);
+  }
+
+  asid_shootdown(m);
+}
+
+// Like asid_flush_va(), but for all of pagetable's entries.
+void
+asid_flush(pagetable_t pagetable)
+{
+  struct mm *m = asid_mm(pagetable);
+
+  if (m != 0) {
+    asid_flush_mm(m);
+  }
+}
+
+// Flush all of m's entries from every TLB, after a change to its page table made by a process that
+// may not be running in m, such as a thread's parent unmapping its trapframe in freeproc().
+void
+asid_flush_mm(struct mm *m)
+{
+  if (asid_max != 0 && m->asid_gen == asid_generation) {
+    sfence_vma_asid(m->asid);
+  }
+
+  asid_shootdown(m);
+}
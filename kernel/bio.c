@@ -1,6 +1,6 @@
 // Buffer cache.
 //
-// The buffer cache is a linked list of buf structures holding
+// The buffer cache is a hash table of buf structures holding
 // cached copies of disk block contents.  Caching disk blocks
 // in memory reduces the number of disk reads and also provides
 // a synchronization point for disk blocks used by multiple processes.
@@ -12,6 +12,13 @@
 // * Do not use the buffer after calling brelse.
 // * Only one process at a time can use a buffer,
 //     so do not keep them longer than necessary.
+//
+// binit() sizes the cache from the memory that is free at boot, and the hash table with it. When a
+// block isn't cached, bget() picks a victim with the CLOCK algorithm: every hit raises a buffer's
+// use count, up to BCACHE_MAXUSES, and the clock hand lowers it again on each pass, taking the
+// first unused buffer whose count is already zero. Blocks read over and over, like inode and bitmap
+// blocks, so survive a large file being streamed through the cache, which uses each block once. If
+// every buffer is in use, bget() sleeps until one is released.
 
 
 #include "types.h"
@@ -22,24 +29,95 @@
 #include "defs.h"
 #include "fs.h"
 #include "buf.h"
+#include "proc.h"
+#include "ktrace.h"
+
+// the buffer cache gets 1/BCACHE_SHARE of the memory that is free at boot, but never fewer than
+// NBUF buffers nor more than BCACHE_MAXBUF
+#define BCACHE_SHARE  32
+#define BCACHE_MAXBUF 4096
+
+// the hash table has about this many buffers per bucket
+#define BCACHE_LOAD 4
+
+// a buffer survives this many passes of the clock hand without being used before it is evicted
+#define BCACHE_MAXUSES 3
+
+// dev of a buffer that has never held a block, which no lookup matches
+#define NODEV 0xffffffff
+
+struct bcache_bucket {
+  struct spinlock lock;
+  struct buf     *head;
+};
 
 struct {
-  struct bcache_bucket {
-    struct spinlock lock;
-    struct buf     *head;
-  } table[13];
+  struct bcache_bucket *table;
+  int                   nbucket; // a power of two
 
+  // serializes evictions, which must hold two bucket locks at once, and protects hand and nwaiting
   struct spinlock lock;
-  struct buf      buf[NBUF];
+  struct buf     *buf;
+  int             nbuf;
+  int             hand;     // next buffer the clock will look at
+  int             nwaiting; // processes in bget() looking for a buf to evict, or waiting for one
 } bcache;
 
+static inline struct bcache_bucket *
+bhash(uint dev, uint blockno)
+{
+  return bcache.table + ((blockno * 2654435761u + dev) & (bcache.nbucket - 1));
+}
+
+// Allocate n bytes of physically contiguous memory at boot.
+static void *
+bootalloc(uint64 n)
+{
+  int order = 0;
+
+  while ((PGSIZE << order) < n) {
+    order++;
+  }
+
+  void *p = order <= KMAXORDER ? kalloc_pages(order) : 0;
+
+  if (p == 0) {
+    panic("binit: out of memory");
+  }
+
+  return p;
+}
+
 void
 binit(void)
 {
   initlock(&bcache.lock, "bcache");
 
+  int nbuf = kgetfreemem() / BCACHE_SHARE / BSIZE;
+
+  if (nbuf < NBUF) {
+    nbuf = NBUF;
+  }
+
+  if (nbuf > BCACHE_MAXBUF) {
+    nbuf = BCACHE_MAXBUF;
+  }
+
+  // round down to whole pages of block data
+  nbuf -= nbuf % (PGSIZE / BSIZE);
+
+  bcache.nbucket = 1;
+
+  while (bcache.nbucket * BCACHE_LOAD < nbuf) {
+    bcache.nbucket *= 2;
+  }
+
+  bcache.table = bootalloc(bcache.nbucket * sizeof(struct bcache_bucket));
+  bcache.buf   = bootalloc(nbuf * sizeof(struct buf));
+  bcache.nbuf  = nbuf;
+
   // initialize the sharded locks
-  for (int i = 0; i < NELEM(bcache.table); i++) {
+  for (int i = 0; i < bcache.nbucket; i++) {
     struct bcache_bucket *b = bcache.table + i;
 
     initlock(&b->lock, "bcache shard");
@@ -47,168 +125,370 @@ binit(void)
     b->head = 0;
   }
 
-  // initalize the lock for each buf, and allocate them in advance to one of the sharded locks
-  for (int i = 0; i < NELEM(bcache.buf); i++) {
+  // initialize each buf, giving it a share of a page for its data, and hash it as a distinct
+  // block of no device so that the bufs spread across the buckets
+  uchar *data = 0;
+
+  for (int i = 0; i < nbuf; i++) {
     struct buf           *buf    = bcache.buf + i;
-    struct bcache_bucket *bucket = bcache.table + (i % NELEM(bcache.table));
+    struct bcache_bucket *bucket = bhash(NODEV, i);
+
+    if (i % (PGSIZE / BSIZE) == 0 && (data = kalloc()) == 0) {
+      panic("binit: out of memory");
+    }
 
     initsleeplock(&buf->lock, "buffer");
 
+    buf->valid   = 0;
+    buf->disk    = 0;
+    buf->dev     = NODEV;
+    buf->blockno = i;
+    buf->refcnt  = 0;
+    buf->uses    = 0;
+    buf->data    = data + (i % (PGSIZE / BSIZE)) * BSIZE;
+
     buf->next    = bucket->head;
     bucket->head = buf;
   }
 }
 
-// Look through buffer cache for block on device dev.
-// If not found, allocate a buffer.
-// In either case, return locked buffer.
-static struct buf*
-bget(uint dev, uint blockno)
+// Return the buf in bucket holding the given block, or 0 if the block isn't cached. If ref is set,
+// take a reference to it for the caller. Must be called with bucket's lock held.
+static struct buf *
+blookup(struct bcache_bucket *bucket, uint dev, uint blockno, int ref)
 {
-  // grab the bucket that corresponds to the given blockno
-  struct bcache_bucket *bucket = bcache.table + (blockno % NELEM(bcache.table));
-
-  // then acquire the lock before inspecting the list
-  acquire(&bucket->lock);
-
   for (struct buf *b = bucket->head; b != 0; b = b->next) {
-    // is the buf for this block already in the list?
     if (b->dev == dev && b->blockno == blockno) {
+      if (!ref) {
+        return b;
+      }
+
       b->refcnt++;
 
-      release(&bucket->lock);
-      acquiresleep(&b->lock);
+      if (b->uses < BCACHE_MAXUSES) {
+        b->uses++;
+      }
+
       return b;
     }
   }
 
-  // since we didn't find it in the list, we'll look for a free buf in the list we already have a
-  // lock for
-  for (struct buf *b = bucket->head; b != 0; b = b->next) {
-    if (b->refcnt == 0) {
-      b->refcnt++;
+  return 0;
+}
 
-      b->dev     = dev;
-      b->blockno = blockno;
+// Advance the clock hand until it finds a buf to evict, and move that buf into bucket. Returns 0
+// if every buf is in use. Must be called with bcache.lock and bucket's lock held.
+static struct buf *
+bevict(struct bcache_bucket *bucket)
+{
+  // BCACHE_MAXUSES passes lower every use count to zero, so one more pass finds any unused buf
+  for (int n = 0; n < (BCACHE_MAXUSES + 1) * bcache.nbuf; n++) {
+    struct buf *b = bcache.buf + bcache.hand;
 
-      b->valid  = 0;
-      b->refcnt = 1;
+    if (++bcache.hand == bcache.nbuf) {
+      bcache.hand = 0;
+    }
 
-      release(&bucket->lock);
-      acquiresleep(&b->lock);
-      return b;
+    // only evictions change a buf's block, and they hold bcache.lock, so its bucket is stable
+    struct bcache_bucket *victim = bhash(b->dev, b->blockno);
+
+    if (victim != bucket) {
+      acquire(&victim->lock);
+    }
+
+    if (b->refcnt != 0 || b->uses != 0) {
+      if (b->refcnt == 0) {
+        b->uses--;
+      }
+
+      if (victim != bucket) {
+        release(&victim->lock);
+      }
+
+      continue;
+    }
+
+    // remove b from the victim bucket
+    struct buf **pp = &victim->head;
+
+    while (*pp != b) {
+      pp = &(*pp)->next;
+    }
+
+    *pp = b->next;
+
+    if (victim != bucket) {
+      release(&victim->lock);
+    }
+
+    // and add it to the target
+    b->next      = bucket->head;
+    bucket->head = b;
+
+    return b;
+  }
+
+  return 0;
+}
+
+// Look through buffer cache for block on device dev.
+// If not found, allocate a buffer.
+// In either case, return locked buffer.
+// If ahead is set, return 0 instead if the block is already
+// cached or every buffer is in use.
+static struct buf*
+bget(uint dev, uint blockno, int ahead)
+{
+  // grab the bucket that corresponds to the given block
+  struct bcache_bucket *bucket = bhash(dev, blockno);
+
+  // then acquire the lock before inspecting the list
+  acquire(&bucket->lock);
+
+  struct buf *b = blookup(bucket, dev, blockno, !ahead);
+
+  if (b) {
+    release(&bucket->lock);
+
+    if (ahead) {
+      return 0;
     }
+
+    acquiresleep(&b->lock);
+    return b;
   }
 
   // no suitable buf was found, so we have to give up the lock to let other threads proceed
   release(&bucket->lock);
 
-  // we're now going to attempt to steal a buf from a different shard, so we must first grab the
-  // "bcache" lock, which we use as a way to grant permission to hold multiple lock shards.
+  // evicting a buf from a different shard means holding two bucket locks, so we must first grab
+  // the "bcache" lock, which we use as a way to grant permission to hold multiple lock shards.
   //
   // since only one process can have this lock, we know that we can't run into a scenario where
   // process A holds lock 1, and process B holds lock 2, and they're both trying to acquire the
   // lock the other process has.
   acquire(&bcache.lock);
 
-  // grab the original bucket lock before we start our journey
-  acquire(&bucket->lock);
-
-  // the bucket we're attempting to steal from. starts at the bucket to the right of the bucket
-  // we expected to find the buf in
-  struct bcache_bucket *victim = bucket;
+  // brelse() must know to wake us before we look at whether any buf is free
+  bcache.nwaiting++;
 
   while (1) {
-    // move to the next lock shard, potentially looping around
-    if (++victim == bcache.table + NELEM(bcache.table)) {
-      victim = bcache.table;
+    acquire(&bucket->lock);
+
+    // another process may have read the block in while we weren't holding the bucket lock
+    if ((b = blookup(bucket, dev, blockno, !ahead)) != 0) {
+      release(&bucket->lock);
+
+      if (ahead) {
+        b = 0;
+      }
+
+      break;
     }
 
-    // we've looped around completely
-    if (victim == bucket) {
-      panic("bget: no buffers");
+    if ((b = bevict(bucket)) != 0) {
+      b->dev     = dev;
+      b->blockno = blockno;
+
+      b->valid  = 0;
+      b->refcnt = 1;
+
+      // a block read ahead hasn't been used yet, and is the first to go if it never is
+      b->uses = ahead ? 0 : 1;
+
+      release(&bucket->lock);
+      break;
     }
 
-    acquire(&victim->lock);
+    release(&bucket->lock);
 
-    // look for a suitable (i.e. unused) buf from the victim bucket
-    for (struct buf *curr = victim->head, *prev = 0; curr != 0; prev = curr, curr = curr->next) {
-      if (curr->refcnt == 0) {
-        curr->dev     = dev;
-        curr->blockno = blockno;
+    if (ahead) {
+      break;
+    }
 
-        curr->valid  = 0;
-        curr->refcnt = 1;
+    // every buf is in use, so wait for one to be released
+    sleep(&bcache, &bcache.lock);
+  }
 
-        // remove curr from the victim
-        if (prev) {
-          prev->next = curr->next;
-        } else {
-          victim->head = curr->next;
-        }
+  bcache.nwaiting--;
+  release(&bcache.lock);
 
-        // append cur to the target
-        curr->next   = bucket->head;
-        bucket->head = curr;
+  // nobody else can have a reference to a buf that was just evicted, so this doesn't sleep when
+  // reading ahead
+  if (b) {
+    acquiresleep(&b->lock);
+  }
 
-        release(&bucket->lock);
-        release(&victim->lock);
-        release(&bcache.lock);
+  return b;
+}
 
-        acquiresleep(&curr->lock);
+// Drop a reference to b, waking any process waiting for a buf if it was the last one.
+static void
+bput(struct buf *b)
+{
+  struct bcache_bucket *bucket = bhash(b->dev, b->blockno);
 
-        return curr;
-      }
-    }
+  acquire(&bucket->lock);
+
+  int waiting = --b->refcnt == 0 && bcache.nwaiting > 0;
 
-    release(&victim->lock);
+  release(&bucket->lock);
+
+  // bget() holds bcache.lock from looking for a free buf until it sleeps, so taking it here makes
+  // sure the wakeup isn't lost
+  if (waiting) {
+    acquire(&bcache.lock);
+    wakeup(&bcache);
+    release(&bcache.lock);
   }
 }
 
+// Charge n blocks read or written to the current process, if any.
+static void
+bcharge(int write, int n)
+{
+  struct proc *p = myproc();
+
+  if(p == 0)
+    return;
+  if(write)
+    p->ru.oublock += n;
+  else
+    p->ru.inblock += n;
+}
+
+// Read or write b on the device it belongs to.
+static void
+devrw(struct buf *b, int write)
+{
+  bcharge(write, 1);
+  if(b->dev == TMPDEV)
+    ramdiskrw(b, write);
+  else
+    virtio_disk_rw(b, write);
+}
+
 // Return a locked buf with the contents of the indicated block.
 struct buf*
 bread(uint dev, uint blockno)
 {
   struct buf *b;
 
-  b = bget(dev, blockno);
+  b = bget(dev, blockno, 0);
   if(!b->valid) {
-    virtio_disk_rw(b, 0);
+    KTRACE(KT_BIO, KT_BMISS, dev, blockno);
+    devrw(b, 0);
     b->valid = 1;
+  } else {
+    KTRACE(KT_BIO, KT_BHIT, dev, blockno);
   }
   return b;
 }
 
+// Return a locked buf for the indicated block without reading
+// it from disk, for a caller that will overwrite all of it.
+struct buf*
+bgrab(uint dev, uint blockno)
+{
+  struct buf *b;
+
+  b = bget(dev, blockno, 0);
+  b->valid = 1;
+  return b;
+}
+
+// Called by the disk driver when a read started by breadahead()
+// finishes, in interrupt context. Unlocks b and drops the
+// reference breadahead() took.
+static void
+bdone(struct buf *b)
+{
+  b->valid = 1;
+  releasesleep(&b->lock);
+  bput(b);
+}
+
+// Start reading the n blocks in blocknos into the cache,
+// skipping any already there, without waiting for the disk.
+// Runs of adjacent blocks go to the disk as one request. A
+// later bread() of a block waits for its read to finish.
+void
+breadahead(uint dev, uint *blocknos, int n)
+{
+  struct buf *bufs[READAHEAD];
+  int nbufs = 0;
+
+  if(n > READAHEAD)
+    panic("breadahead");
+  if(dev == TMPDEV)
+    return;  // reads from the RAM disk don't wait
+
+  for(int i = 0; i < n; i++){
+    struct buf *b = bget(dev, blocknos[i], 1);
+    if(b)
+      bufs[nbufs++] = b;
+  }
+
+  if(nbufs > 0){
+    bcharge(0, nbufs);
+    virtio_disk_start(bufs, nbufs, 0, bdone);
+  }
+}
+
 // Write b's contents to disk.  Must be locked.
 void
 bwrite(struct buf *b)
 {
   if(!holdingsleep(&b->lock))
     panic("bwrite");
-  virtio_disk_rw(b, 1);
+  devrw(b, 1);
+}
+
+// Write the contents of the n bufs to disk, all at once,
+// and wait for them. Bufs holding adjacent blocks are
+// written by a single request. All must be locked and on
+// the same device.
+void
+bwritev(struct buf **bufs, int n)
+{
+  for(int i = 0; i < n; i++)
+    if(!holdingsleep(&bufs[i]->lock))
+      panic("bwritev");
+  bcharge(1, n);
+  if(n > 0 && bufs[0]->dev == TMPDEV){
+    for(int i = 0; i < n; i++)
+      ramdiskrw(bufs[i], 1);
+    return;
+  }
+  virtio_disk_start(bufs, n, 1, 0);
+  for(int i = 0; i < n; i++)
+    virtio_disk_wait(bufs[i]);
 }
 
 // Release a locked buffer.
-// Move to the head of the most-recently-used list.
 void
 brelse(struct buf *b)
 {
   if(!holdingsleep(&b->lock))
     panic("brelse");
 
-  b->refcnt--;
-
   releasesleep(&b->lock);
+
+  bput(b);
 }
 
 void
 bpin(struct buf *b)
 {
+  struct bcache_bucket *bucket = bhash(b->dev, b->blockno);
+
+  acquire(&bucket->lock);
   b->refcnt++;
+  release(&bucket->lock);
 }
 
 void
 bunpin(struct buf *b)
 {
-  b->refcnt--;
+  bput(b);
 }
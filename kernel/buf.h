@@ -5,7 +5,9 @@ struct buf {
   uint blockno;
   struct sleeplock lock;
   uint refcnt;
+  uint uses;   // CLOCK use count, see bio.c
   struct buf *next;
-  uchar data[BSIZE];
+  struct buf *qnext; // next buf in the same disk request
+  uchar *data; // BSIZE bytes
 };
 
@@ -11,18 +11,37 @@ struct proc;
 struct spinlock;
 struct sleeplock;
 struct stat;
+struct statfs;
+struct dent;
 struct superblock;
 struct mbuf;
 struct sock;
-
+struct kmem_cache;
+struct page;
+struct vm_area;
+struct mm;
+struct fdtable;
+struct spawnfd;
+
+
+// asid.c
+void            asidinit(void);
+uint            asid_activate(struct proc*);
+void            asid_flush_va(pagetable_t, uint64);
+void            asid_flush(pagetable_t);
+void            asid_flush_mm(struct mm*);
+void            asid_poll(void);
 
 // bio.c
 void            binit(void);
 struct buf*     bread(uint, uint);
+struct buf*     bgrab(uint, uint);
 void            brelse(struct buf*);
 void            bwrite(struct buf*);
 void            bpin(struct buf*);
 void            bunpin(struct buf*);
+void            breadahead(uint, uint*, int);
+void            bwritev(struct buf**, int);
 
 // console.c
 void            consoleinit(void);
@@ -31,20 +50,94 @@ void            consputc(int);
 
 // exec.c
 int             exec(char*, char**);
+int             execin(struct proc*, char*, char**);
+void            execinit(void);
 
 // file.c
 struct file*    filealloc(void);
 void            fileclose(struct file*);
 struct file*    filedup(struct file*);
 void            fileinit(void);
+struct fdtable* fdtalloc(void);
+struct fdtable* fdtcopy(struct fdtable*);
+struct fdtable* fdtdup(struct fdtable*);
+void            fdtput(struct fdtable*);
+struct file*    fdtget(struct fdtable*, int);
+int             fdtset(struct fdtable*, int, struct file*);
+int             fdtlowest(struct fdtable*);
+struct file*    fget(struct fdtable*, int);
+void            fput(struct file*);
 int             fileread(struct file*, uint64, int n);
 int             filestat(struct file*, uint64 addr);
+int             filegetdents(struct file*, uint64 addr, int n, int flags);
 int             filewrite(struct file*, uint64, int n);
+int             filepread(struct file*, uint64, int n, uint off);
+int             filepwrite(struct file*, uint64, int n, uint off);
+int             filevmsplice(struct file*, uint64, int n);
+int             filefcntl(struct file*, int, int);
+int             filerecvmmsg(struct file*, uint64, int);
+int             filesendmmsg(struct file*, uint64, int);
+int             filerecvzc(struct file*, uint64, uint64);
+int             filerecvzcdone(struct file*, uint64);
+int             filepoll(struct file*);
+int             filesendfile(struct file*, struct file*, uint off, int n);
+
+// ktrace.c
+extern uint     ktrace_mask;
+void            ktraceinit(void);
+void            ktrace(int, uint64, uint64);
+// record a trace event, if its category is enabled; see ktrace.h.
+#define KTRACE(cat, type, arg0, arg1)                           \
+  do {                                                          \
+    if (__atomic_load_n(&ktrace_mask, __ATOMIC_RELAXED) & (cat)) \
+      ktrace((type), (arg0), (arg1));                           \
+  } while (0)
+
+// hpm.c
+void            hpminit(void);
+void            hpmswitch(struct proc*);
+int             ucounters(int);
+int             hpmevent(int, uint64);
+uint64          hpmread(int);
+
+// uprof.c
+int             uprof(int);
+void            uprof_tick(struct proc*);
+int             uprof_read(int, uint64, int);
+void            uprof_free(struct proc*);
+
+// kprof.c
+void            kprofinit(void);
+int             kprof(int);
+void            kprof_tick(uint64, uint64);
+int             kprof_read(uint64, int);
+
+// poll.c
+struct pollfd;
+void            pollinit(void);
+void            pollwakeup(void);
+int             poll(struct pollfd*, int, int);
+
+// timer.c
+struct timer;
+void            timerqinit(void);
+void            timer_add(struct timer*);
+void            timer_cancel(struct timer*);
+void            timer_run(void);
+int             timer_sleep(uint64);
+
+// futex.c
+void            futexinit(void);
+int             futex_wait(uint64, int);
+int             futex_wake(uint64, int);
 
 // fs.c
 void            fsinit(int);
 int             dirlink(struct inode*, char*, uint);
 struct inode*   dirlookup(struct inode*, char*, uint*);
+int             dirlist(struct inode*, uint*, struct dent*, struct inode**, int);
+void            dirstat(struct inode*, struct dent*, struct inode*);
+void            dcache_remove(struct inode*, char*);
 struct inode*   ialloc(uint, short);
 struct inode*   idup(struct inode*);
 void            iinit();
@@ -58,49 +151,95 @@ struct inode*   namei(char*);
 struct inode*   nameiparent(char*, char*);
 int             readi(struct inode*, int, uint64, uint, uint);
 void            stati(struct inode*, struct stat*);
+void            statfsi(struct inode*, struct statfs*);
 int             writei(struct inode*, int, uint64, uint, uint);
+int             writelinki(struct inode*, char*, uint);
 void            itrunc(struct inode*);
+int             ismountpoint(struct inode*);
 
 // ramdisk.c
 void            ramdiskinit(void);
-void            ramdiskintr(void);
-void            ramdiskrw(struct buf*);
+void            ramdiskrw(struct buf*, int);
 
 // kalloc.c
 void*           kalloc(void);
 void*           kcopyonwrite(const void *pa);
 void            kfree(void *);
 void            kinit(void);
+void            kinit_help(void);
 uint64          kgetfreemem(void);
 void            kincrementrefcount(void *pa);
+struct page*    pa2page(uint64);
+uint64          page2pa(struct page*);
+void*           kalloc_pages(int order);
+void*           kalloc_zeroed(void);
+int             kzeroidle(void);
+void            kfree_pages(void *pa, int order);
+int             kallocstats(char*, int);
 
 // log.c
 void            initlog(int, struct superblock*);
 void            log_write(struct buf*);
 void            begin_op(void);
 void            end_op(void);
+void            begin_opn(int);
+void            end_opn(int);
+int             log_maxop(void);
+void            log_sync(void);
+
+// pagecache.c
+void            pagecacheinit(void);
+uint64          pagecache_get(struct inode*, uint);
+int             pagecache_read(struct inode*, int, uint64, uint, uint);
+void            pagecache_write(struct inode*, void*, uint, uint);
+void            pagecache_drop(struct inode*);
+int             pagecache_reclaim(void);
+
+// swap.c
+void            swapinit(void);
+void            swapon(uint, uint, uint);
+int             swapalloc(void);
+void            swapdup(uint);
+void            swapfree(uint);
+void            swapcancel(uint);
+void            swapdone(uint);
+void            swapread(uint, uint64);
+int             swapout(void);
 
 // pipe.c
+void            pipeinit(void);
 int             pipealloc(struct file**, struct file**);
 void            pipeclose(struct pipe*, int);
-int             piperead(struct pipe*, uint64, int);
-int             pipewrite(struct pipe*, uint64, int);
+int             piperead(struct pipe*, uint64, int, int);
+int             pipewrite(struct pipe*, int, uint64, int, int, int);
+int             pipefcntl(struct pipe*, int, int);
+int             pipepoll(struct pipe*, int);
 
 // printf.c
 void            printf(char*, ...);
 void            panic(char*) __attribute__((noreturn));
 void            printfinit(void);
 void            backtrace(void);
+int             backtrace_walk(uint64, uint64*, int);
+int             klogget(void);
+
+// main.c
+extern int      ncpu;
 
 // proc.c
 int             cpuid(void);
 void            exit(int);
 int             fork(void);
-int             growproc(int);
+int             spawn(char*, char**, struct spawnfd*, int);
+int             clone(uint64, uint64, uint64);
+int             kproc(char*, void(*)(void*), void*);
+uint64          growproc(int);
 void            proc_mapstacks(pagetable_t);
-pagetable_t     proc_pagetable(struct proc *);
-void            proc_freepagetable(pagetable_t, uint64);
+struct mm*      mmcreate(struct proc *);
+void            mmexit(struct mm *);
+void            mmput(struct mm *, uint64);
 int             kill(int);
+struct proc*    procof(int);
 int             killed(struct proc*);
 void            setkilled(struct proc*);
 struct cpu*     mycpu(void);
@@ -111,13 +250,21 @@ void            scheduler(void) __attribute__((noreturn));
 void            sched(void);
 void            sleep(void*, struct spinlock*);
 void            userinit(void);
-int             wait(uint64);
+int             wait(uint64, uint64);
+int             getrusage(int, uint64);
 void            wakeup(void*);
+int             wakeupn(void*, int);
 void            yield(void);
+void            preempt(void);
+int             setpriority(int, int);
+int             setaffinity(int, uint64);
 int             either_copyout(int user_dst, uint64 dst, void *src, uint64 len);
 int             either_copyin(void *dst, int user_src, uint64 src, uint64 len);
 void            procdump(void);
 uint            proccount(void);
+uint            runcount(void);
+void            loadavg_tick(uint);
+void            getloadavg(uint64*);
 
 // swtch.S
 void            swtch(struct context*, struct context*);
@@ -125,6 +272,8 @@ void            swtch(struct context*, struct context*);
 // spinlock.c
 void            acquire(struct spinlock*);
 int             holding(struct spinlock*);
+int             holdingspin(void);
+int             tryacquire(struct spinlock*);
 void            initlock(struct spinlock*, char*);
 void            release(struct spinlock*);
 void            push_off(void);
@@ -138,12 +287,18 @@ void            releasesleep(struct sleeplock*);
 int             holdingsleep(struct sleeplock*);
 void            initsleeplock(struct sleeplock*, char*);
 
+// slab.c
+void            kmem_cache_init(struct kmem_cache*, char*, uint);
+void*           kmem_cache_alloc(struct kmem_cache*);
+void            kmem_cache_free(struct kmem_cache*, void*);
+
 // string.c
 int             memcmp(const void*, const void*, uint);
 void*           memmove(void*, const void*, uint);
 void*           memset(void*, int, uint);
 char*           safestrcpy(char*, const char*, int);
 int             strlen(const char*);
+uint            strnlen(const char*, uint);
 int             strncmp(const char*, const char*, uint);
 char*           strncpy(char*, const char*, int);
 
@@ -157,22 +312,30 @@ void            syscall();
 
 // trap.c
 extern uint     ticks;
+extern struct ushared *ushared;
 void            trapinit(void);
 void            trapinithart(void);
 extern struct spinlock tickslock;
 void            usertrapret(void);
+void            timerstop(void);
+void            timerstart(void);
+void            timerarm(uint64);
+void            cpukick(int);
+int             trapstats(char*, int);
 
 // uart.c
 void            uartinit(void);
 void            uartintr(void);
-void            uartputc(int);
+void            uartwrite(char*, int);
 void            uartputc_sync(int);
+void            uartkick(void);
 int             uartgetc(void);
 
 // vm.c
 void            kvminit(void);
 void            kvminithart(void);
 void            kvmmap(pagetable_t, uint64, uint64, uint64, int);
+void            kvmmapmega(pagetable_t, uint64, uint64, uint64, int);
 int             mappages(pagetable_t, uint64, uint64, uint64, int);
 pagetable_t     uvmcreate(void);
 void            uvmfirst(pagetable_t, uchar *, uint);
@@ -181,6 +344,15 @@ uint64          uvmdealloc(pagetable_t, uint64, uint64);
 int             uvmcopy(pagetable_t, pagetable_t, uint64);
 void            uvmfree(pagetable_t, uint64);
 pte_t *         uvmwalkcow(pagetable_t p, uint64 va, int *cow_result);
+uint64          uvmgift(struct proc*, uint64);
+int             uvmlend(struct proc*, uint64, uint64);
+int             uvmunlend(struct proc*, uint64, uint64);
+int             uvmlazy(pagetable_t, uint64, int);
+void            uvmprefault(uint64, uint64, int);
+int             uvmsplit(pagetable_t, uint64);
+int             uvmunshare(pagetable_t, uint64);
+int             uvmwsscan(struct proc*, uint64, uint64, uint64*, uint64*, int);
+int             uvmswapout(struct mm*, uint64*, uint64*, uint*, int, int*);
 void            uvmunmap(pagetable_t, uint64, uint64, int);
 void            uvmclear(pagetable_t, uint64);
 pte_t *         walk(pagetable_t, uint64, int);
@@ -189,9 +361,16 @@ int             copyout(pagetable_t, uint64, char *, uint64);
 int             copyin(pagetable_t, char *, uint64, uint64);
 int             copyinstr(pagetable_t, char *, uint64, uint64);
 uint64          mmap(struct proc *p, size_t len, int prot, int flags, int fd, off_t offset);
-void            mmap_copy(struct proc *p, struct proc *np);
+int             mmap_copy(struct mm *m, struct mm *nm);
 int             munmap(struct proc *p, uint64 addr, size_t len);
-int             munmap_all(struct proc *p);
+int             munmap_all(struct mm *m);
+struct vm_area* mmap_image(struct file *f, uint64 va, uint64 len, uint offset, int prot);
+void            mmap_image_free(struct vm_area **image, int n);
+int             mmap_exec(struct mm *m, struct vm_area **image, int n);
+int             msync(struct proc *p, uint64 addr, size_t len, int flags);
+int             madvise(struct proc *p, uint64 addr, size_t len, int advice);
+struct vm_area* vma_find(struct mm *m, uint64 addr);
+uint64          vma_lowest(struct mm *m);
 int             mmap_page_fault_handler(struct proc *p, uint64 va_page);
 void            vmprint(pagetable_t);
 
@@ -204,6 +383,8 @@ void            plic_complete(int);
 // virtio_disk.c
 void            virtio_disk_init(void);
 void            virtio_disk_rw(struct buf *, int);
+void            virtio_disk_start(struct buf **, int, int, void (*)(struct buf *));
+void            virtio_disk_wait(struct buf *);
 void            virtio_disk_intr(void);
 
 // number of elements in fixed-size array
@@ -228,22 +409,43 @@ int             snprintf(char*, int, char*, ...);
 void            kcsaninit();
 #endif
 
+#ifdef KBENCH
+// kbench.c
+void            kbenchinit(void);
+void            kbench(void);
+int             kbenchstats(char*, int);
+#endif
+
 // pci.c
 void            pci_init();
 
 // e1000.c
 void            e1000_init(uint32 *);
 void            e1000_intr(void);
-int             e1000_transmit(struct mbuf*);
+void            e1000_start(void);
+int             e1000_transmit(struct mbuf*, int);
+int             e1000_txready(void);
 
 // net.c
+void            mbufinit(void);
+void            arpinit(void);
+int             netstats(char*, int);
+unsigned short  in_cksum(const unsigned char*, int);
 void            net_rx(struct mbuf*);
-void            net_tx_udp(struct mbuf*, uint32, uint16, uint16);
+int             net_tx_udp(struct mbuf*, uint32, uint16, uint16, int);
 
 // sysnet.c
 void            sockinit(void);
 int             sockalloc(struct file **, uint32, uint16, uint16);
 void            sockclose(struct sock *);
-int             sockread(struct sock *, uint64, int);
-int             sockwrite(struct sock *, uint64, int);
+int             sockread(struct sock *, uint64, int, int);
+int             sockpoll(struct sock *);
+int             sockwrite(struct sock *, int, uint64, int, int);
+int             sockrecvmmsg(struct sock *, uint64, int, int);
+int             sockrecvzc(struct sock *, uint64, uint64, int);
+int             sockrecvzcdone(struct sock *, uint64);
+int             socksendmmsg(struct sock *, uint64, int, int);
+int             socksendi(struct sock *, struct inode *, uint, int);
+int             sockfcntl(struct sock *, int, int);
+int             sockstat(struct sock *, uint64);
 void            sockrecvudp(struct mbuf*, uint32, uint16, uint16);
@@ -7,6 +7,8 @@
 #include "defs.h"
 #include "e1000_dev.h"
 #include "net.h"
+#include "netstat.h"
+#include "ktrace.h"
 #include <stddef.h>
 
 // === transmit data structures ===
@@ -22,6 +24,15 @@ static struct mbuf *tx_mbufs[TX_RING_SIZE];
 // a spinlock that guards access to the tx_ring and E1000_TDT register
 struct spinlock e1000_tx_lock;
 
+// the oldest tx_desc whose mbuf hasn't been freed yet, once sent; guarded by e1000_tx_lock
+static int tx_clean;
+
+// Every packet that asks for checksums to be filled in is IPv4 and UDP, behind an Ethernet header,
+// so the offsets for them only need telling to the e1000 once, in a context descriptor at the start
+// of the ring. It applies to every data descriptor after it until another comes along.
+#define CSUM_IPCSS (sizeof(struct eth))
+#define CSUM_TUCSS (CSUM_IPCSS + sizeof(struct ip))
+
 // === receive data structures ===
 
 #define RX_RING_SIZE 16
@@ -35,6 +46,33 @@ static struct mbuf *rx_mbufs[RX_RING_SIZE];
 // a spinlock that guards access to the rx_ring and E1000_RDT register
 struct spinlock e1000_rx_lock;
 
+// === receive polling ===
+
+// Received packets are taken off the ring by the e1000rx kernel process, not by the interrupt
+// handler. A receive interrupt masks further ones and wakes the process, which hands the packets to
+// the network stack RX_BUDGET at a time, giving up the CPU between batches, and unmasks the
+// interrupt once the ring is empty. Under load, the e1000 then interrupts once per burst rather than
+// once per packet.
+#define RX_BUDGET 8
+
+// set by e1000_intr() for e1000_rxd(); guarded by e1000_napi_lock
+static int rx_pending;
+static struct spinlock e1000_napi_lock;
+
+// Interrupt moderation, set with make E1000_ITR=, E1000_RDTR= and E1000_RADV=. The e1000 holds a
+// receive interrupt back until RX_DELAY units of 1.024us pass with no new packet, but no longer
+// than RX_ABSDELAY after the first, and spaces any two interrupts at least ITR_INTERVAL units of
+// 256ns apart. 0 turns each off.
+#ifndef ITR_INTERVAL
+#define ITR_INTERVAL 500  // 128us, at most about 7800 interrupts a second
+#endif
+#ifndef RX_DELAY
+#define RX_DELAY 8
+#endif
+#ifndef RX_ABSDELAY
+#define RX_ABSDELAY 32
+#endif
+
 // === end ===
 
 // remember where the e1000's registers live.
@@ -50,6 +88,7 @@ e1000_init(uint32 *xregs)
 
   initlock(&e1000_tx_lock, "e1000_tx");
   initlock(&e1000_rx_lock, "e1000_rx");
+  initlock(&e1000_napi_lock, "e1000_napi");
 
   regs = xregs;
 
@@ -65,11 +104,22 @@ e1000_init(uint32 *xregs)
     tx_ring[i].status = E1000_TXD_STAT_DD;
     tx_mbufs[i] = 0;
   }
+  struct tx_ctx_desc *ctx = (struct tx_ctx_desc *)&tx_ring[0];
+  ctx->ipcss = CSUM_IPCSS;
+  ctx->ipcso = CSUM_IPCSS + offsetof(struct ip, ip_sum);
+  ctx->ipcse = CSUM_TUCSS - 1;
+  ctx->tucss = CSUM_TUCSS;
+  ctx->tucso = CSUM_TUCSS + offsetof(struct udp, sum);
+  ctx->tucse = 0;
+  ctx->dtyp = E1000_TXD_DTYP_C;
+  ctx->tucmd = E1000_TXD_TUCMD_IP | E1000_TXD_CMD_DEXT;
   regs[E1000_TDBAL] = (uint64) tx_ring;
   if(sizeof(tx_ring) % 128 != 0)
     panic("e1000");
   regs[E1000_TDLEN] = sizeof(tx_ring);
-  regs[E1000_TDH] = regs[E1000_TDT] = 0;
+  // the e1000 loads the context when it sees the tail move past it
+  regs[E1000_TDH] = 0;
+  regs[E1000_TDT] = tx_clean = 1;
 
   // [E1000 14.4] Receive initialization
   memset(rx_ring, 0, sizeof(rx_ring));
@@ -106,44 +156,117 @@ e1000_init(uint32 *xregs)
     E1000_RCTL_SZ_2048 |             // 2048-byte rx buffers
     E1000_RCTL_SECRC;                // strip CRC
 
-  // ask e1000 for receive interrupts.
-  regs[E1000_RDTR] = 0; // interrupt after every received packet (no timer)
-  regs[E1000_RADV] = 0; // interrupt after every packet (no timer)
-  regs[E1000_IMS] = (1 << 7); // RXDW -- Receiver Descriptor Write Back
+  // and check IP and UDP checksums of received packets.
+  regs[E1000_RXCSUM] = E1000_RXCSUM_IPOFL | E1000_RXCSUM_TUOFL;
+
+  // ask e1000 for receive interrupts, moderated, and for transmit ones, to free sent mbufs.
+  regs[E1000_RDTR] = RX_DELAY;
+  regs[E1000_RADV] = RX_ABSDELAY;
+  regs[E1000_ITR] = ITR_INTERVAL;
+  regs[E1000_IMS] = E1000_ICR_RXT0 | E1000_ICR_TXDW;
 }
 
+// Free the mbufs of every packet the e1000 has finished sending, oldest first, and wake senders
+// waiting for room in the ring. Must be called with e1000_tx_lock held.
+static void
+e1000_reclaim(void)
+{
+  int freed = 0;
+
+  // E1000_TXD_STAT_DD ("descriptor done") is set once the e1000 has sent a descriptor's packet,
+  // which it does in ring order
+  while (tx_mbufs[tx_clean] && (tx_ring[tx_clean].status & E1000_TXD_STAT_DD)) {
+    mbuffree(tx_mbufs[tx_clean]);
+    tx_mbufs[tx_clean] = 0;
+    tx_clean = (tx_clean + 1 == TX_RING_SIZE) ? 0 : tx_clean + 1;
+    freed++;
+  }
+
+  if (freed) {
+    wakeup(&tx_clean);
+    pollwakeup();
+  }
+}
+
+// Whether e1000_transmit() would find room in the ring now.
 int
-e1000_transmit(struct mbuf *m)
+e1000_txready(void)
 {
+  if (regs == 0) {
+    return 1;
+  }
+
   acquire(&e1000_tx_lock);
+  e1000_reclaim();
 
-  // the index of the next available transmit descriptor
-  int tx_index = regs[E1000_TDT];
+  int ready = tx_mbufs[regs[E1000_TDT]] == 0;
 
-  // the next available transmit descriptor
-  struct tx_desc *tx_desc = &tx_ring[tx_index];
+  release(&e1000_tx_lock);
 
-  // E1000_TXD_STAT_DD ("descriptor done") is set when the transmit descriptor has been sent, and
-  // if that's not set, the ring has overflowed - we've looped back to a packet in the ring that
-  // has not yet been sent
-  if ((tx_desc->status & E1000_TXD_STAT_DD) == 0) {
-    printf("e1000_transmit overflow: transmit not yet complete for tx_desc #%d", tx_index);
-    release(&e1000_tx_lock);
+  return ready;
+}
 
-    return -1;
-  }
+// Queue m to be sent, taking it over. If the ring is full, sleeps until the e1000 has sent a
+// packet if wait is set, or else returns -1, leaving m to the caller.
+int
+e1000_transmit(struct mbuf *m, int wait)
+{
+  int tx_index;
+
+  acquire(&e1000_tx_lock);
+
+  for (;;) {
+    e1000_reclaim();
+
+    // the index of the next available transmit descriptor, which is free unless it still holds an
+    // mbuf, since reclaiming frees those that have been sent
+    tx_index = regs[E1000_TDT];
 
-  // free the mbuf associated with the last sent packet, if there was one
-  if (tx_mbufs[tx_index]) {
-    mbuffree(tx_mbufs[tx_index]);
+    if (tx_mbufs[tx_index] == 0) {
+      break;
+    }
+
+    NETSTAT_ADD(tx_ringfull, 1);
+
+    if (!wait || myproc() == 0 || killed(myproc())) {
+      release(&e1000_tx_lock);
+
+      return -1;
+    }
+
+    sleep(&tx_clean, &e1000_tx_lock);
   }
 
+  // the next available transmit descriptor
+  struct tx_desc *tx_desc = &tx_ring[tx_index];
+
   tx_mbufs[tx_index] = m;
 
-  tx_desc->addr    = (uint64)m->head;
-  tx_desc->length  = m->len;
-  tx_desc->cmd    |= E1000_TXD_CMD_RS | E1000_TXD_CMD_EOP;
+  if (m->csum) {
+    // a data descriptor, to have the e1000 fill the checksums in using the context at the start
+    struct tx_data_desc *data = (struct tx_data_desc *)tx_desc;
+
+    data->addr   = (uint64)m->head;
+    data->length = m->len;
+    data->dtyp   = E1000_TXD_DTYP_D;
+    data->cmd    = E1000_TXD_CMD_RS | E1000_TXD_CMD_EOP | E1000_TXD_CMD_DEXT;
+    data->status = 0;
+    data->popts  = ((m->csum & MBUF_CSUM_IP) ? E1000_TXD_POPTS_IXSM : 0) |
+                  ((m->csum & MBUF_CSUM_UDP) ? E1000_TXD_POPTS_TXSM : 0);
+  } else {
+    tx_desc->addr   = (uint64)m->head;
+    tx_desc->length = m->len;
+    tx_desc->cso    = 0;
+    tx_desc->cmd    = E1000_TXD_CMD_RS | E1000_TXD_CMD_EOP;
+    tx_desc->status = 0;
+    tx_desc->css    = 0;
+  }
+
+  NETSTAT_ADD(tx_packets, 1);
+  NETSTAT_ADD(tx_bytes, m->len);
+  KTRACE(KT_NET, KT_NETTX, m->len, 0);
 
+  __sync_synchronize();
   regs[E1000_TDT] = (tx_index + 1 == TX_RING_SIZE) ? 0 : tx_index + 1;
 
   release(&e1000_tx_lock);
@@ -151,15 +274,18 @@ e1000_transmit(struct mbuf *m)
   return 0;
 }
 
-static void
-e1000_recv(void)
+// Hand up to budget received packets to the network stack. Returns how many there were.
+static int
+e1000_recv(int budget)
 {
+  int n = 0;
+
   acquire(&e1000_rx_lock);
 
   // the index of the last processed rx_desc in the ring
   int rx_index = regs[E1000_RDT];
 
-  while (1) {
+  while (n < budget) {
     // move on to the next entry in the ring, which may wrap around to 0
     if (++rx_index == RX_RING_SIZE) {
       rx_index = 0;
@@ -176,12 +302,35 @@ e1000_recv(void)
     // set the length of the mbuf to the length of the received packet
     rx_mbuf->len = rx_desc->length;
 
-    // and then pass it off to the rest of the networking stack
-    net_rx(rx_mbuf);
+    // note which checksums the e1000 has checked and found right, and drop the packet if one is
+    // wrong; the stack checks the rest itself
+    rx_mbuf->csum = 0;
+
+    if (!(rx_desc->status & E1000_RXD_STAT_IXSM)) {
+      if (rx_desc->status & E1000_RXD_STAT_IPCS) {
+        rx_mbuf->csum |= MBUF_CSUM_IP;
+      }
 
-    // allocate a new mbuf for this rx_desc since we've handed off the last one
-    if (!(rx_mbufs[rx_index] = mbufalloc(0))) {
-      panic("e1000_recv");
+      if (rx_desc->status & E1000_RXD_STAT_TCPCS) {
+        rx_mbuf->csum |= MBUF_CSUM_UDP;
+      }
+    }
+
+    // and then pass it off to the rest of the networking stack, with a new mbuf for this rx_desc
+    // in its place. if there's no memory for one, the packet is dropped instead, and its mbuf stays
+    struct mbuf *fresh = 0;
+
+    if (rx_mbuf->csum && (rx_desc->errors & (E1000_RXD_ERR_IPE | E1000_RXD_ERR_TCPE))) {
+      NETSTAT_ADD(rx_csum, 1);
+    } else if ((fresh = mbufalloc(0)) == 0) {
+      NETSTAT_ADD(rx_nombuf, 1);
+    } else {
+      NETSTAT_ADD(rx_packets, 1);
+      NETSTAT_ADD(rx_bytes, rx_mbuf->len);
+      NETTRACE_STAMP(rx_mbuf, 0);
+      KTRACE(KT_NET, KT_NETRX, rx_mbuf->len, 0);
+      net_rx(rx_mbuf);
+      rx_mbufs[rx_index] = fresh;
     }
 
     // point the rx_desc to this new mbuf and clear the status field so the e1000 can set it
@@ -190,9 +339,47 @@ e1000_recv(void)
 
     // mark our progress in the ring buffer
     regs[E1000_RDT] = rx_index;
+    n++;
   }
 
   release(&e1000_rx_lock);
+
+  return n;
+}
+
+// The e1000rx kernel process.
+static void
+e1000_rxd(void *arg)
+{
+  for (;;) {
+    acquire(&e1000_napi_lock);
+    while (!rx_pending) {
+      sleep(&rx_pending, &e1000_napi_lock);
+    }
+    rx_pending = 0;
+    release(&e1000_napi_lock);
+
+    while (e1000_recv(RX_BUDGET) == RX_BUDGET) {
+      yield();
+    }
+
+    // the ring is empty. a packet that arrived since it was last looked at has set RXT0 in ICR
+    // again, so it interrupts as soon as this unmasks it.
+    regs[E1000_IMS] = E1000_ICR_RXT0;
+  }
+}
+
+// Start receiving, once there is a process to be the parent of e1000rx. Called by forkret().
+void
+e1000_start(void)
+{
+  if (regs == 0) {
+    return;
+  }
+
+  if (kproc("e1000rx", e1000_rxd, 0) < 0) {
+    panic("e1000_start");
+  }
 }
 
 void
@@ -201,7 +388,22 @@ e1000_intr(void)
   // tell the e1000 we've seen this interrupt;
   // without this the e1000 won't raise any
   // further interrupts.
+  uint32 icr = regs[E1000_ICR];
   regs[E1000_ICR] = 0xffffffff;
 
-  e1000_recv();
+  if (icr & E1000_ICR_TXDW) {
+    acquire(&e1000_tx_lock);
+    e1000_reclaim();
+    release(&e1000_tx_lock);
+  }
+
+  if (icr & E1000_ICR_RXT0) {
+    // no more receive interrupts until e1000_rxd() has emptied the ring
+    regs[E1000_IMC] = E1000_ICR_RXT0;
+
+    acquire(&e1000_napi_lock);
+    rx_pending = 1;
+    wakeup(&rx_pending);
+    release(&e1000_napi_lock);
+  }
 }
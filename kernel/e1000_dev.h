@@ -6,7 +6,9 @@
 /* Registers */
 #define E1000_CTL      (0x00000/4)  /* Device Control Register - RW */
 #define E1000_ICR      (0x000C0/4)  /* Interrupt Cause Read - R */
+#define E1000_ITR      (0x000C4/4)  /* Interrupt Throttling Rate - RW */
 #define E1000_IMS      (0x000D0/4)  /* Interrupt Mask Set - RW */
+#define E1000_IMC      (0x000D8/4)  /* Interrupt Mask Clear - WO */
 #define E1000_RCTL     (0x00100/4)  /* RX Control - RW */
 #define E1000_TCTL     (0x00400/4)  /* TX Control - RW */
 #define E1000_TIPG     (0x00410/4)  /* TX Inter-packet gap -RW */
@@ -21,9 +23,14 @@
 #define E1000_TDLEN    (0x03808/4)  /* TX Descriptor Length - RW */
 #define E1000_TDH      (0x03810/4)  /* TX Descriptor Head - RW */
 #define E1000_TDT      (0x03818/4)  /* TX Descriptor Tail - RW */
+#define E1000_RXCSUM   (0x05000/4)  /* RX Checksum Control - RW */
 #define E1000_MTA      (0x05200/4)  /* Multicast Table Array - RW Array */
 #define E1000_RA       (0x05400/4)  /* Receive Address - RW Array */
 
+/* Interrupt Cause, Mask Set and Mask Clear */
+#define E1000_ICR_TXDW    0x00000001    /* transmit descriptor written back */
+#define E1000_ICR_RXT0    0x00000080    /* receive timer, or descriptor written back */
+
 /* Device Control */
 #define E1000_CTL_SLU     0x00000040    /* set link up */
 #define E1000_CTL_FRCSPD  0x00000800    /* force speed */
@@ -87,11 +94,16 @@
 #define E1000_RCTL_FLXBUF_MASK    0x78000000    /* Flexible buffer size */
 #define E1000_RCTL_FLXBUF_SHIFT   27            /* Flexible buffer shift */
 
+/* Receive Checksum Control */
+#define E1000_RXCSUM_IPOFL        0x00000100    /* IPv4 checksum offload */
+#define E1000_RXCSUM_TUOFL        0x00000200    /* TCP / UDP checksum offload */
+
 #define DATA_MAX 1518
 
 /* Transmit Descriptor command definitions [E1000 3.3.3.1] */
 #define E1000_TXD_CMD_EOP    0x01 /* End of Packet */
 #define E1000_TXD_CMD_RS     0x08 /* Report Status */
+#define E1000_TXD_CMD_DEXT   0x20 /* Descriptor extension (0 = legacy) */
 
 /* Transmit Descriptor status definitions [E1000 3.3.3.2] */
 #define E1000_TXD_STAT_DD    0x00000001 /* Descriptor Done */
@@ -108,9 +120,57 @@ struct tx_desc
   uint16 special;
 };
 
+/* Extended descriptor types, in the high nibble of dtyp [E1000 3.3.5, 3.3.7] */
+#define E1000_TXD_DTYP_C     0x00 /* Context Descriptor */
+#define E1000_TXD_DTYP_D     0x10 /* Data Descriptor */
+
+/* TCP/IP context descriptor command [E1000 3.3.6.1] */
+#define E1000_TXD_TUCMD_TCP  0x01 /* TCP, not UDP */
+#define E1000_TXD_TUCMD_IP   0x02 /* IPv4, not IPv6 */
+
+/* Data descriptor packet options [E1000 3.3.7.1] */
+#define E1000_TXD_POPTS_IXSM 0x01 /* Insert IP checksum */
+#define E1000_TXD_POPTS_TXSM 0x02 /* Insert TCP/UDP checksum */
+
+// [E1000 3.3.6] sets up the checksum offsets for the data descriptors that follow
+struct tx_ctx_desc
+{
+  uint8 ipcss;       /* IP checksum start */
+  uint8 ipcso;       /* IP checksum offset */
+  uint16 ipcse;      /* IP checksum end, inclusive */
+  uint8 tucss;       /* TCP/UDP checksum start */
+  uint8 tucso;       /* TCP/UDP checksum offset */
+  uint16 tucse;      /* TCP/UDP checksum end, inclusive, or 0 for the end of the packet */
+  uint16 paylen;
+  uint8 dtyp;
+  uint8 tucmd;
+  uint8 status;
+  uint8 hdrlen;
+  uint16 mss;
+};
+
+// [E1000 3.3.7]
+struct tx_data_desc
+{
+  uint64 addr;
+  uint16 length;
+  uint8 dtyp;
+  uint8 cmd;
+  uint8 status;
+  uint8 popts;
+  uint16 special;
+};
+
 /* Receive Descriptor bit definitions [E1000 3.2.3.1] */
 #define E1000_RXD_STAT_DD       0x01    /* Descriptor Done */
 #define E1000_RXD_STAT_EOP      0x02    /* End of Packet */
+#define E1000_RXD_STAT_IXSM     0x04    /* Ignore checksum indication */
+#define E1000_RXD_STAT_TCPCS    0x20    /* TCP/UDP checksum calculated */
+#define E1000_RXD_STAT_IPCS     0x40    /* IP checksum calculated */
+
+/* Receive Descriptor errors [E1000 3.2.3.2] */
+#define E1000_RXD_ERR_TCPE      0x20    /* TCP/UDP checksum error */
+#define E1000_RXD_ERR_IPE       0x40    /* IP checksum error */
 
 // [E1000 3.2.3]
 struct rx_desc
@@ -6,6 +6,60 @@
 #include "proc.h"
 #include "defs.h"
 #include "elf.h"
+#include "sleeplock.h"
+#include "fs.h"
+#include "file.h"
+#include "fcntl.h"
+#include "vm.h"
+
+// The most segments of a program that exec() maps from its file to
+// be paged in on demand. Any more are read in up front.
+#define NIMAGE 8
+
+// The number of recently exec()ed programs whose inodes exec() keeps
+// a reference to, so that their pages stay in the page cache after
+// the last process running them exits. Running one again, or many
+// copies of it, maps the cached pages rather than reading the disk.
+// kalloc() reclaims the pages if memory runs out.
+#define NTEXTCACHE 8
+
+static struct {
+  struct spinlock lock;
+  struct inode *ip[NTEXTCACHE]; // most recently exec()ed first
+} textcache;
+
+void
+execinit(void)
+{
+  initlock(&textcache.lock, "textcache");
+}
+
+// Make ip the most recently exec()ed program, taking a reference to
+// it if it's new, and forget the least recently exec()ed one if that
+// makes too many. Must be called inside a transaction, since
+// forgetting a program may free an unlinked inode.
+static void
+textcache_add(struct inode *ip)
+{
+  struct inode *old = 0;
+  int i;
+
+  acquire(&textcache.lock);
+  for(i = 0; i < NTEXTCACHE - 1; i++)
+    if(textcache.ip[i] == ip)
+      break;
+  if(textcache.ip[i] != ip){
+    old = textcache.ip[i];
+    idup(ip);
+  }
+  for(; i > 0; i--)
+    textcache.ip[i] = textcache.ip[i-1];
+  textcache.ip[0] = ip;
+  release(&textcache.lock);
+
+  if(old)
+    iput(old);
+}
 
 static int loadseg(pde_t *, uint64, struct inode *, uint, uint);
 
@@ -19,8 +73,27 @@ int flags2perm(int flags)
     return perm;
 }
 
+static int flags2prot(int flags)
+{
+    int prot = PROT_READ;
+    if(flags & 0x1)
+      prot |= PROT_EXEC;
+    if(flags & 0x2)
+      prot |= PROT_WRITE;
+    return prot;
+}
+
 int
 exec(char *path, char **argv)
+{
+  return execin(myproc(), path, argv);
+}
+
+// Replace p's user image with the program at path, looked up from
+// the current process's directory. p is either the current process,
+// or one that spawn() is building and that isn't running yet.
+int
+execin(struct proc *p, char *path, char **argv)
 {
   char *s, *last;
   int i, off;
@@ -28,8 +101,11 @@ exec(char *path, char **argv)
   struct elfhdr elf;
   struct inode *ip;
   struct proghdr ph;
-  pagetable_t pagetable = 0, oldpagetable;
-  struct proc *p = myproc();
+  pagetable_t pagetable = 0;
+  struct mm *mm = 0, *oldmm;
+  struct file *f = 0;
+  struct vm_area *image[NIMAGE];
+  int nimage = 0;
 
   begin_op();
 
@@ -46,8 +122,22 @@ exec(char *path, char **argv)
   if(elf.magic != ELF_MAGIC)
     goto bad;
 
-  if((pagetable = proc_pagetable(p)) == 0)
+  // The new image goes in a new address space, which only this
+  // process will use; any other threads carry on in the old one.
+  if((mm = mmcreate(p)) == 0)
     goto bad;
+  pagetable = mm->pagetable;
+
+  // The segments are mapped from the file through this, so that
+  // page faults read in only the parts the program touches. If
+  // the file table is full, they're all read in now.
+  if((f = filealloc()) != 0){
+    f->type = FD_INODE;
+    f->readable = 1;
+    f->writable = 0;
+    f->ip = idup(ip);
+    f->off = 0;
+  }
 
   // Load program into memory.
   for(i=0, off=elf.phoff; i<elf.phnum; i++, off+=sizeof(ph)){
@@ -61,20 +151,41 @@ exec(char *path, char **argv)
       goto bad;
     if(ph.vaddr % PGSIZE != 0)
       goto bad;
-    uint64 sz1;
-    if((sz1 = uvmalloc(pagetable, sz, ph.vaddr + ph.memsz, flags2perm(ph.flags))) == 0)
-      goto bad;
-    sz = sz1;
-    if(loadseg(pagetable, ph.vaddr, ip, ph.off, ph.filesz) < 0)
-      goto bad;
+    if(ph.memsz == 0)
+      continue;
+    uint64 full = PGROUNDDOWN(ph.filesz);
+    int perm = flags2perm(ph.flags);
+    if(f && nimage < NIMAGE && ph.off % PGSIZE == 0 && full > 0){
+      // the pages that hold nothing but the file's contents are
+      // mapped from it, and read in by page faults.
+      if((image[nimage] = mmap_image(f, ph.vaddr, full, ph.off, flags2prot(ph.flags))) == 0)
+        goto bad;
+      nimage++;
+      // the page with the end of the contents is read in now,
+      // since the rest of it must be zeros, not what follows in
+      // the file. beyond that, the segment is zero-filled on
+      // demand, like heap pages that sbrk() hasn't touched.
+      if(ph.filesz > full){
+        if(uvmalloc(pagetable, ph.vaddr + full, ph.vaddr + ph.filesz, perm) == 0)
+          goto bad;
+        if(loadseg(pagetable, ph.vaddr + full, ip, ph.off + full, ph.filesz - full) < 0)
+          goto bad;
+      }
+    } else {
+      if(uvmalloc(pagetable, ph.vaddr, ph.vaddr + ph.memsz, perm) == 0)
+        goto bad;
+      if(loadseg(pagetable, ph.vaddr, ip, ph.off, ph.filesz) < 0)
+        goto bad;
+    }
+    if(ph.vaddr + ph.memsz > sz)
+      sz = ph.vaddr + ph.memsz;
   }
+  if(nimage > 0)
+    textcache_add(ip);
   iunlockput(ip);
   end_op();
   ip = 0;
 
-  p = myproc();
-  uint64 oldsz = p->sz;
-
   // Allocate two pages at the next page boundary.
   // Make the first inaccessible as a stack guard.
   // Use the second as the user stack.
@@ -120,13 +231,28 @@ exec(char *path, char **argv)
       last = s+1;
   safestrcpy(p->name, last, sizeof(p->name));
 
-  // Commit to the user image.
-  oldpagetable = p->pagetable;
+  // Replace the old image's mappings, and any of the old program's
+  // mmap()s, with the new image's. This is the last thing that can
+  // fail.
+  if(mmap_exec(mm, image, nimage) < 0)
+    goto bad;
+  nimage = 0;
+  fileclose(f);
+
+  // Commit to the user image. It has its own ASID, so the TLB
+  // needs no flush for the old one.
+  // swapout() looks at p->mm under p->lock.
+  oldmm = p->mm;
+  mm->sz = sz;
+  acquire(&p->lock);
+  p->mm = mm;
   p->pagetable = pagetable;
-  p->sz = sz;
+  release(&p->lock);
   p->trapframe->epc = elf.entry;  // initial program counter = main
   p->trapframe->sp = sp; // initial stack pointer
-  proc_freepagetable(oldpagetable, oldsz);
+  p->trapframe->tp = 0;  // no thread cache in malloc() yet
+  mmexit(oldmm);
+  mmput(oldmm, p->tfva);
 
   if (p->pid == 1) {
     vmprint(p->pagetable);
@@ -135,12 +261,18 @@ exec(char *path, char **argv)
   return argc; // this ends up in a0, the first argument to main(argc, argv)
 
  bad:
-  if(pagetable)
-    proc_freepagetable(pagetable, sz);
+  if(mm){
+    mm->sz = sz;
+    mmexit(mm);
+    mmput(mm, p->tfva);
+  }
   if(ip){
     iunlockput(ip);
     end_op();
   }
+  mmap_image_free(image, nimage);
+  if(f)
+    fileclose(f);
   return -1;
 }
 
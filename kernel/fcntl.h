@@ -4,6 +4,14 @@
 #define O_CREATE   0x200
 #define O_TRUNC    0x400
 #define O_NOFOLLOW 0x800
+#define O_NONBLOCK 0x1000
+
+#define F_SETPIPE_SZ 1
+#define F_GETPIPE_SZ 2
+#define F_GETFL      3
+#define F_SETFL      4  // only O_NONBLOCK can be changed
+#define F_SETRCVBUF  5  // a socket's receive buffer limit, in bytes
+#define F_GETRCVBUF  6
 
 #define PROT_NONE       0x0
 #define PROT_READ       0x1
@@ -12,3 +20,17 @@
 
 #define MAP_SHARED      0x01
 #define MAP_PRIVATE     0x02
+
+#define MS_ASYNC        0x01
+#define MS_INVALIDATE   0x02
+#define MS_SYNC         0x04
+
+#define MADV_NORMAL     0
+#define MADV_RANDOM     1
+#define MADV_SEQUENTIAL 2
+#define MADV_WILLNEED   3
+#define MADV_DONTNEED   4
+#define MADV_GUARD      5
+
+#define WS_CLEAR_ACCESSED 0x01
+#define WS_CLEAR_DIRTY    0x02
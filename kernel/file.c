@@ -12,46 +12,261 @@
 #include "file.h"
 #include "stat.h"
 #include "proc.h"
+#include "slab.h"
+#include "fcntl.h"
+#include "poll.h"
 
 struct devsw devsw[NDEV];
-struct {
-  struct spinlock lock;
-  struct file file[NFILE];
-} ftable;
+
+// Where every struct file comes from. The cache's per-CPU
+// magazines let open() and close() mostly avoid shared locks.
+static struct kmem_cache file_cache;
+static int nfile;   // files allocated, at most NFILE
+
+// Where every process's struct fdtable comes from.
+static struct kmem_cache fdt_cache;
 
 void
 fileinit(void)
 {
-  initlock(&ftable.lock, "ftable");
+  kmem_cache_init(&file_cache, "file_cache", sizeof(struct file));
+  kmem_cache_init(&fdt_cache, "fdt_cache", sizeof(struct fdtable));
+}
+
+// Allocate an empty file descriptor table, for one process.
+// Returns 0 if out of memory.
+struct fdtable*
+fdtalloc(void)
+{
+  struct fdtable *t;
+
+  if((t = kmem_cache_alloc(&fdt_cache)) == 0)
+    return 0;
+  memset(t, 0, sizeof(*t));
+  initlock(&t->lock, "fdtable");
+  t->ref = 1;
+  t->nfd = NOFILE;
+  t->ofile = t->init;
+  return t;
+}
+
+// The index of the lowest set bit of x, which mustn't be 0.
+static int
+lowbit(uint64 x)
+{
+  int i = 0;
+
+  for(int w = 32; w > 0; w /= 2){
+    if((x & ((1L << w) - 1)) == 0){
+      x >>= w;
+      i += w;
+    }
+  }
+  return i;
+}
+
+// The kalloc_pages() order of an ofile array of n entries.
+static int
+fdtorder(int n)
+{
+  int order = 0;
+
+  while(((uint64)PGSIZE << order) < n * sizeof(struct file*))
+    order++;
+  return order;
+}
+
+// Make room in t for the fds below n. Caller must hold t->lock.
+// Returns 0, or -1 if n is too many or out of memory.
+static int
+fdtgrow(struct fdtable *t, int n)
+{
+  struct file **a;
+  int nfd;
+
+  if(n <= t->nfd)
+    return 0;
+  if(n > NOFILEMAX)
+    return -1;
+  for(nfd = PGSIZE / sizeof(struct file*); nfd < n; nfd *= 2)
+    ;
+  if((a = kalloc_pages(fdtorder(nfd))) == 0)
+    return -1;
+  memmove(a, t->ofile, t->nfd * sizeof(a[0]));
+  memset(a + t->nfd, 0, (nfd - t->nfd) * sizeof(a[0]));
+  // fdtget() may still be looking at the old array, so it is
+  // kept until t is freed. each array is bigger than the last,
+  // so there's at most one of each order.
+  if(t->ofile != t->init)
+    t->old[fdtorder(t->nfd)] = t->ofile;
+  // and it mustn't see the new size with the old array.
+  __atomic_store_n(&t->ofile, a, __ATOMIC_RELEASE);
+  __atomic_store_n(&t->nfd, nfd, __ATOMIC_RELEASE);
+  return 0;
+}
+
+// The file open as fd in t, or 0. Doesn't need t->lock, but
+// without it the file may be closed as soon as it is returned;
+// fget() holds it to take a reference.
+struct file*
+fdtget(struct fdtable *t, int fd)
+{
+  if(fd < 0 || fd >= __atomic_load_n(&t->nfd, __ATOMIC_ACQUIRE))
+    return 0;
+  return __atomic_load_n(&t->ofile[fd], __ATOMIC_ACQUIRE);
+}
+
+// Open f as fd in t, or close fd if f is 0, without closing the
+// file fd had. Caller must hold t->lock. Returns 0, or -1 if
+// fd is out of range or out of memory.
+int
+fdtset(struct fdtable *t, int fd, struct file *f)
+{
+  if(fd < 0 || fdtgrow(t, fd + 1) < 0)
+    return -1;
+  __atomic_store_n(&t->ofile[fd], f, __ATOMIC_RELEASE);
+  if(f){
+    t->open[fd/64] |= 1L << (fd%64);
+    if(t->open[fd/64] == ~0L)
+      t->full |= 1L << (fd/64);
+  } else {
+    t->open[fd/64] &= ~(1L << (fd%64));
+    t->full &= ~(1L << (fd/64));
+  }
+  return 0;
+}
+
+// The lowest fd not in use in t, or -1 if all NOFILEMAX are.
+// Caller must hold t->lock.
+int
+fdtlowest(struct fdtable *t)
+{
+  int w;
+
+  if(~t->full == 0 || (w = lowbit(~t->full)) >= NOFILEMAX/64)
+    return -1;
+  return w*64 + lowbit(~t->open[w]);
+}
+
+// Allocate a copy of file descriptor table t, for fork(), with
+// the same files open. Returns 0 if out of memory.
+struct fdtable*
+fdtcopy(struct fdtable *t)
+{
+  struct fdtable *nt;
+  int w, top, n = 0;
+
+  if((nt = fdtalloc()) == 0)
+    return 0;
+  acquire(&t->lock);
+  for(top = NOFILEMAX/64; top > 0 && t->open[top-1] == 0; top--)
+    ;
+  // room for the highest open fd
+  if(top > 0)
+    for(n = top*64; (t->open[top-1] >> ((n-1)%64) & 1) == 0; n--)
+      ;
+  if(fdtgrow(nt, n) < 0){
+    release(&t->lock);
+    fdtput(nt);
+    return 0;
+  }
+  // only the words of the bitmap with open fds need looking at.
+  for(w = 0; w < top; w++){
+    for(uint64 m = t->open[w]; m; m &= m - 1){
+      int fd = w*64 + lowbit(m);
+      nt->ofile[fd] = filedup(t->ofile[fd]);
+    }
+    nt->open[w] = t->open[w];
+  }
+  nt->full = t->full;
+  release(&t->lock);
+  return nt;
+}
+
+// Share file descriptor table t with one more process, for clone().
+struct fdtable*
+fdtdup(struct fdtable *t)
+{
+  acquire(&t->lock);
+  t->ref++;
+  release(&t->lock);
+  return t;
+}
+
+// Stop using file descriptor table t. When the last process
+// using it does, close its files and free it.
+void
+fdtput(struct fdtable *t)
+{
+  acquire(&t->lock);
+  if(--t->ref > 0){
+    release(&t->lock);
+    return;
+  }
+  release(&t->lock);
+
+  for(int w = 0; w < NOFILEMAX/64; w++){
+    for(uint64 m = t->open[w]; m; m &= m - 1){
+      int fd = w*64 + lowbit(m);
+      fileclose(t->ofile[fd]);
+      t->ofile[fd] = 0;
+    }
+    t->open[w] = 0;
+  }
+  if(t->ofile != t->init)
+    kfree_pages(t->ofile, fdtorder(t->nfd));
+  for(int i = 0; i < NELEM(t->old); i++)
+    if(t->old[i])
+      kfree_pages(t->old[i], i);
+  freelock(&t->lock);
+  kmem_cache_free(&fdt_cache, t);
+}
+
+// The file open as fd in t, with a reference added, or 0. The
+// caller drops the reference with fput(), and until then the file
+// stays usable even if another thread closes fd.
+struct file*
+fget(struct fdtable *t, int fd)
+{
+  struct file *f;
+
+  acquire(&t->lock);
+  if((f = fdtget(t, fd)) != 0)
+    filedup(f);
+  release(&t->lock);
+  return f;
+}
+
+// Drop a reference that fget() took.
+void
+fput(struct file *f)
+{
+  fileclose(f);
 }
 
 // Allocate a file structure.
+// Returns 0 if NFILE are already open, or out of memory.
 struct file*
 filealloc(void)
 {
   struct file *f;
 
-  acquire(&ftable.lock);
-  for(f = ftable.file; f < ftable.file + NFILE; f++){
-    if(f->ref == 0){
-      f->ref = 1;
-      release(&ftable.lock);
-      return f;
-    }
+  if(__atomic_add_fetch(&nfile, 1, __ATOMIC_RELAXED) > NFILE ||
+     (f = kmem_cache_alloc(&file_cache)) == 0){
+    __atomic_fetch_sub(&nfile, 1, __ATOMIC_RELAXED);
+    return 0;
   }
-  release(&ftable.lock);
-  return 0;
+  memset(f, 0, sizeof(*f));
+  f->ref = 1;
+  return f;
 }
 
 // Increment ref count for file f.
 struct file*
 filedup(struct file *f)
 {
-  acquire(&ftable.lock);
-  if(f->ref < 1)
+  if(__atomic_fetch_add(&f->ref, 1, __ATOMIC_RELAXED) < 1)
     panic("filedup");
-  f->ref++;
-  release(&ftable.lock);
   return f;
 }
 
@@ -59,29 +274,26 @@ filedup(struct file *f)
 void
 fileclose(struct file *f)
 {
-  struct file ff;
+  int ref;
 
-  acquire(&ftable.lock);
-  if(f->ref < 1)
+  // the release ordering makes this CPU's uses of f happen
+  // before whoever frees it.
+  if((ref = __atomic_sub_fetch(&f->ref, 1, __ATOMIC_ACQ_REL)) < 0)
     panic("fileclose");
-  if(--f->ref > 0){
-    release(&ftable.lock);
+  if(ref > 0)
     return;
-  }
-  ff = *f;
-  f->ref = 0;
-  f->type = FD_NONE;
-  release(&ftable.lock);
 
-  if(ff.type == FD_PIPE){
-    pipeclose(ff.pipe, ff.writable);
-  } else if(ff.type == FD_INODE || ff.type == FD_DEVICE){
+  if(f->type == FD_PIPE){
+    pipeclose(f->pipe, f->writable);
+  } else if(f->type == FD_INODE || f->type == FD_DEVICE){
     begin_op();
-    iput(ff.ip);
+    iput(f->ip);
     end_op();
-  } else if (ff.type == FD_SOCK) {
-    sockclose(ff.sock);
+  } else if (f->type == FD_SOCK) {
+    sockclose(f->sock);
   }
+  kmem_cache_free(&file_cache, f);
+  __atomic_fetch_sub(&nfile, 1, __ATOMIC_RELAXED);
 }
 
 // Get metadata about file f.
@@ -103,6 +315,61 @@ filestat(struct file *f, uint64 addr)
   return -1;
 }
 
+// Read up to n entries of directory f into the struct dent
+// array at user address addr, as many at a time as fit in a
+// small batch. Returns the number read, 0 at the end.
+#define DENTBATCH 8
+
+int
+filegetdents(struct file *f, uint64 addr, int n, int flags)
+{
+  struct proc *p = myproc();
+  struct dent d[DENTBATCH];
+  struct inode *ips[DENTBATCH];
+  int i, m, tot = 0;
+
+  if(f->readable == 0 || f->type != FD_INODE)
+    return -1;
+
+  while(tot < n){
+    ilock(f->ip);
+    if(f->ip->type != T_DIR){
+      iunlock(f->ip);
+      return -1;
+    }
+    m = dirlist(f->ip, &f->off, d, (flags & GETDENTS_STAT) ? ips : 0,
+                n - tot < DENTBATCH ? n - tot : DENTBATCH);
+    iunlock(f->ip);
+    if(m == 0)
+      break;
+    if(flags & GETDENTS_STAT){
+      begin_op();
+      for(i = 0; i < m; i++)
+        dirstat(f->ip, &d[i], ips[i]);
+      end_op();
+    }
+    if(copyout(p->pagetable, addr + tot*sizeof(d[0]), (char *)d, m*sizeof(d[0])) < 0)
+      return -1;
+    tot += m;
+  }
+  return tot;
+}
+
+// Read from inode file f at offset *off, and move *off past
+// the bytes read.
+static int
+inoderead(struct file *f, uint64 addr, int n, uint *off)
+{
+  int r;
+
+  uvmprefault(addr, n, 1);
+  ilock(f->ip);
+  if((r = readi(f->ip, 1, addr, *off, n)) > 0)
+    *off += r;
+  iunlock(f->ip);
+  return r;
+}
+
 // Read from file f.
 // addr is a user virtual address.
 int
@@ -114,18 +381,17 @@ fileread(struct file *f, uint64 addr, int n)
     return -1;
 
   if(f->type == FD_PIPE){
-    r = piperead(f->pipe, addr, n);
+    r = piperead(f->pipe, addr, n, f->nonblock);
   } else if(f->type == FD_DEVICE){
     if(f->major < 0 || f->major >= NDEV || !devsw[f->major].read)
       return -1;
+    if(f->nonblock && !(filepoll(f) & POLLIN))
+      return -1;
     r = devsw[f->major].read(1, addr, n);
   } else if(f->type == FD_INODE){
-    ilock(f->ip);
-    if((r = readi(f->ip, 1, addr, f->off, n)) > 0)
-      f->off += r;
-    iunlock(f->ip);
+    r = inoderead(f, addr, n, &f->off);
   } else if (f->type == FD_SOCK) {
-    r = sockread(f->sock, addr, n);
+    r = sockread(f->sock, addr, n, f->nonblock);
   } else {
     panic("fileread");
   }
@@ -135,50 +401,76 @@ fileread(struct file *f, uint64 addr, int n)
 
 // Write to file f.
 // addr is a user virtual address.
-int
-filewrite(struct file *f, uint64 addr, int n)
+// Log blocks that writing nblk blocks of data may modify.
+static int
+writeopblocks(int nblk)
+{
+  return 2*nblk + 1 + nblk/NINDIRECT + 1 + 2;
+}
+
+// Write to inode file f at offset *off, and move *off past
+// the bytes written. addr is a user virtual address if
+// user_src is set, or else a kernel one.
+static int
+inodewrite(struct file *f, int user_src, uint64 addr, int n, uint *off)
 {
-  int r, ret = 0;
+  int r;
+
+  // write as many blocks at a time as fit in the
+  // largest log transaction, so that a write of up to
+  // that size is atomic. reserve log space for the data
+  // blocks, an allocation block for each, the indirect
+  // blocks, the i-node, and 2 blocks of slop for
+  // non-aligned writes.
+  // this really belongs lower down, since writei()
+  // might be writing a device like the console.
+  int nblk = (log_maxop()-1-1-2) / 2;
+  while(writeopblocks(nblk) > log_maxop())
+    nblk--;
+  int max = nblk * BSIZE;
+  int i = 0;
+  while(i < n){
+    int n1 = n - i;
+    if(n1 > max)
+      n1 = max;
+
+    if(user_src)
+      uvmprefault(addr + i, n1, 0);
+    int nop = writeopblocks((n1 + BSIZE - 1) / BSIZE);
+    begin_opn(nop);
+    ilock(f->ip);
+    if ((r = writei(f->ip, user_src, addr + i, *off, n1)) > 0)
+      *off += r;
+    iunlock(f->ip);
+    end_opn(nop);
+
+    if(r != n1){
+      // error from writei
+      break;
+    }
+    i += r;
+  }
+  return i == n ? n : -1;
+}
+
+static int
+filewritefrom(struct file *f, int user_src, uint64 addr, int n)
+{
+  int ret = 0;
 
   if(f->writable == 0)
     return -1;
 
   if(f->type == FD_PIPE){
-    ret = pipewrite(f->pipe, addr, n);
+    ret = pipewrite(f->pipe, user_src, addr, n, 0, f->nonblock);
   } else if(f->type == FD_DEVICE){
     if(f->major < 0 || f->major >= NDEV || !devsw[f->major].write)
       return -1;
-    ret = devsw[f->major].write(1, addr, n);
+    ret = devsw[f->major].write(user_src, addr, n);
   } else if(f->type == FD_INODE){
-    // write a few blocks at a time to avoid exceeding
-    // the maximum log transaction size, including
-    // i-node, indirect block, allocation blocks,
-    // and 2 blocks of slop for non-aligned writes.
-    // this really belongs lower down, since writei()
-    // might be writing a device like the console.
-    int max = ((MAXOPBLOCKS-1-1-2) / 2) * BSIZE;
-    int i = 0;
-    while(i < n){
-      int n1 = n - i;
-      if(n1 > max)
-        n1 = max;
-
-      begin_op();
-      ilock(f->ip);
-      if ((r = writei(f->ip, 1, addr + i, f->off, n1)) > 0)
-        f->off += r;
-      iunlock(f->ip);
-      end_op();
-
-      if(r != n1){
-        // error from writei
-        break;
-      }
-      i += r;
-    }
-    ret = (i == n ? n : -1);
+    ret = inodewrite(f, user_src, addr, n, &f->off);
   } else if (f->type == FD_SOCK) {
-    ret = sockwrite(f->sock, addr, n);
+    ret = sockwrite(f->sock, user_src, addr, n, f->nonblock);
   } else {
     panic("filewrite");
   }
@@ -186,3 +478,161 @@ filewrite(struct file *f, uint64 addr, int n)
   return ret;
 }
 
+int
+filewrite(struct file *f, uint64 addr, int n)
+{
+  return filewritefrom(f, 1, addr, n);
+}
+
+// Read from file f at offset off, without using or moving f's
+// own offset. Only files with an offset, i.e. inodes, can do this.
+int
+filepread(struct file *f, uint64 addr, int n, uint off)
+{
+  if(f->readable == 0 || f->type != FD_INODE)
+    return -1;
+  return inoderead(f, addr, n, &off);
+}
+
+// Write to file f at offset off, without using or moving f's
+// own offset.
+int
+filepwrite(struct file *f, uint64 addr, int n, uint off)
+{
+  if(f->writable == 0 || f->type != FD_INODE)
+    return -1;
+  return inodewrite(f, 1, addr, n, &off);
+}
+
+// Write to pipe f, lending it the whole pages of the user's that
+// addr covers rather than copying them. The caller gets a copy of
+// a lent page when it next writes to it, so the pipe's reader sees
+// the data as it was.
+int
+filevmsplice(struct file *f, uint64 addr, int n)
+{
+  if(f->writable == 0 || f->type != FD_PIPE)
+    return -1;
+  return pipewrite(f->pipe, 1, addr, n, 1, f->nonblock);
+}
+
+// Receive, or send, up to n datagrams on socket f in one go; see
+// sockrecvmmsg() and socksendmmsg().
+int
+filerecvmmsg(struct file *f, uint64 addr, int n)
+{
+  if(f->readable == 0 || f->type != FD_SOCK)
+    return -1;
+  return sockrecvmmsg(f->sock, addr, n, f->nonblock);
+}
+
+int
+filesendmmsg(struct file *f, uint64 addr, int n)
+{
+  if(f->writable == 0 || f->type != FD_SOCK)
+    return -1;
+  return socksendmmsg(f->sock, addr, n, f->nonblock);
+}
+
+// Receive a datagram on socket f by borrowing the page it's in,
+// and give the page back; see sockrecvzc().
+int
+filerecvzc(struct file *f, uint64 va, uint64 dataaddr)
+{
+  if(f->readable == 0 || f->type != FD_SOCK)
+    return -1;
+  return sockrecvzc(f->sock, va, dataaddr, f->nonblock);
+}
+
+int
+filerecvzcdone(struct file *f, uint64 va)
+{
+  if(f->type != FD_SOCK)
+    return -1;
+  return sockrecvzcdone(f->sock, va);
+}
+
+// Change or report settings of file f: O_NONBLOCK, with F_SETFL
+// and F_GETFL, a pipe's capacity, with F_SETPIPE_SZ and
+// F_GETPIPE_SZ, and a socket's receive buffer, with F_SETRCVBUF
+// and F_GETRCVBUF.
+int
+filefcntl(struct file *f, int cmd, int arg)
+{
+  if(cmd == F_GETFL)
+    return f->nonblock ? O_NONBLOCK : 0;
+  if(cmd == F_SETFL){
+    f->nonblock = (arg & O_NONBLOCK) != 0;
+    return 0;
+  }
+  if(f->type == FD_SOCK)
+    return sockfcntl(f->sock, cmd, arg);
+  if(f->type != FD_PIPE)
+    return -1;
+  return pipefcntl(f->pipe, cmd, arg);
+}
+
+// What f is ready for now: POLLIN if a read wouldn't sleep,
+// POLLOUT if a write wouldn't, and POLLHUP if the other end of a
+// pipe is closed.
+int
+filepoll(struct file *f)
+{
+  int r = POLLIN | POLLOUT;
+
+  if(f->type == FD_PIPE){
+    r = pipepoll(f->pipe, f->writable);
+  } else if(f->type == FD_DEVICE){
+    if(f->major >= 0 && f->major < NDEV && devsw[f->major].poll)
+      r = devsw[f->major].poll();
+  } else if(f->type == FD_SOCK){
+    r = sockpoll(f->sock);
+  }
+  if(!f->readable)
+    r &= ~POLLIN;
+  if(!f->writable)
+    r &= ~POLLOUT;
+  return r;
+}
+
+// Copy up to n bytes of inode file in, from offset off, to out,
+// without going through user space, and without moving in's own
+// offset. A socket gets a datagram per buffer-cache read, straight
+// into its mbuf; anything else gets a page at a time through a
+// kernel buffer. Returns the number of bytes copied, which is
+// short only at the end of in or if out fails partway.
+int
+filesendfile(struct file *out, struct file *in, uint off, int n)
+{
+  char *buf = 0;
+  int r = 0, w, tot = 0;
+
+  if(in->readable == 0 || in->type != FD_INODE || out->writable == 0)
+    return -1;
+  if(out->type != FD_SOCK && (buf = kalloc()) == 0)
+    return -1;
+
+  while(tot < n){
+    if(out->type == FD_SOCK){
+      if((r = socksendi(out->sock, in->ip, off, n - tot)) <= 0)
+        break;
+    } else {
+      ilock(in->ip);
+      r = readi(in->ip, 0, (uint64)buf, off, n - tot < PGSIZE ? n - tot : PGSIZE);
+      iunlock(in->ip);
+      if(r <= 0)
+        break;
+      if((w = filewritefrom(out, 0, (uint64)buf, r)) != r){
+        if(w > 0)
+          tot += w;
+        break;
+      }
+    }
+    off += r;
+    tot += r;
+  }
+
+  if(buf)
+    kfree(buf);
+  return tot > 0 || r == 0 ? tot : -1;
+}
@@ -3,6 +3,7 @@ struct file {
   int ref; // reference count
   char readable;
   char writable;
+  char nonblock; // O_NONBLOCK: reads and writes fail rather than sleep
   struct pipe  *pipe;  // FD_PIPE
   struct inode *ip;    // FD_INODE and FD_DEVICE
   struct sock  *sock;  // FD_SOCK
@@ -14,6 +15,16 @@ struct file {
 #define minor(dev)  ((dev) & 0xFFFF)
 #define	mkdev(m,n)  ((uint)((m)<<16| (n)))
 
+#define NBMAPRUN 4
+
+// A run of len blocks of a file from block bn on, which are
+// disk blocks addr on.
+struct bmaprun {
+  uint bn;
+  uint addr;
+  uint len;
+};
+
 // in-memory copy of an inode
 struct inode {
   uint dev;           // Device number
@@ -27,16 +38,41 @@ struct inode {
   short minor;
   short nlink;
   uint  size;
-  uint  addrs[NDIRECT + 2];
+  union {
+    uint addrs[NDIRECT + 2];
+    struct {
+      struct extent extents[NEXTENT];
+      uint          extblock;
+    };
+  };
+
+  struct cpage *pcpages; // cached pages of this file, see pagecache.c
+  int npcpages;          // number of pages in pcpages
+
+  struct bmaprun bmc[NBMAPRUN]; // recent bmap() translations
+  int bmc_next;          // entry of bmc to replace next
+
+  uint ra_next;          // block after the last one readi() read, see readahead()
+  uint ra_ahead;         // block after the last one read ahead
+
+  struct inode *hnext;    // next in the itable bucket, or unused entry
+  struct inode *lru_prev; // entries with no references, see iget()
+  struct inode *lru_next;
+  int onlru;
+  struct inode *orphan_next; // next inode to free, see ifree()
 };
 
 // map major device number to device functions.
 struct devsw {
   int (*read)(int, uint64, int);
   int (*write)(int, uint64, int);
+  int (*poll)(void);  // POLLIN and POLLOUT, see poll.h; 0 means always ready
 };
 
 extern struct devsw devsw[];
 
 #define CONSOLE 1
 #define STATS   2
+#define KCSANDEV 3
+#define DMESG   4
+#define KTRACEDEV 5
@@ -22,9 +22,36 @@
 #include "file.h"
 
 #define min(a, b) ((a) < (b) ? (a) : (b))
-// there should be one superblock per disk device, but we run with
-// only one device
-struct superblock sb;
+// File system state of each device. The allocation state is
+// built by fsinit() from the bitmap and the inodes.
+struct fsdev {
+  struct superblock sb;
+  struct spinlock lock;  // protects the allocation state
+  struct agroup *group;
+  uint ngroups;
+  uint nbfree;           // free blocks, the sum of the groups' nfree
+  uint nifree;           // free inodes
+  uint ihint;            // lowest inum that may be free
+};
+
+static struct fsdev fsdev[NFSDEV];
+
+#define SB(dev) (fsdev[dev].sb)
+
+static void fsallocinit(int);
+static void dcacheinit(void);
+static void dcache_purge(struct inode*);
+static void bmc_clear(struct inode*);
+static void orphaninit(int);
+static void orphan_add(struct inode*);
+static void ifreeinode(struct inode*);
+static void tmpfsinit(void);
+static struct inode *mountcross(struct inode*);
+static int isfastlink(struct inode*);
+
+// The directory that each device's file system is mounted on,
+// or 0. Only set by tmpfsinit(), which holds the references.
+static struct inode *mountpoint[NFSDEV];
 
 // Read the super block.
 static void
@@ -40,10 +67,16 @@ readsb(int dev, struct superblock *sb)
 // Init fs
 void
 fsinit(int dev) {
-  readsb(dev, &sb);
-  if(sb.magic != FSMAGIC)
+  readsb(dev, &SB(dev));
+  if(SB(dev).magic != FSMAGIC)
     panic("invalid file system");
-  initlog(dev, &sb);
+  initlog(dev, &SB(dev));
+  if(dev == ROOTDEV)
+    swapon(dev, SB(dev).swapstart, SB(dev).nswap);
+  fsallocinit(dev);
+  dcacheinit();
+  orphaninit(dev);
+  tmpfsinit();
 }
 
 // Zero a block.
@@ -52,7 +85,7 @@ bzero(int dev, int bno)
 {
   struct buf *bp;
 
-  bp = bread(dev, bno);
+  bp = bgrab(dev, bno);
   memset(bp->data, 0, BSIZE);
   log_write(bp);
   brelse(bp);
@@ -60,28 +93,136 @@ bzero(int dev, int bno)
 
 // Blocks.
 
-// Allocate a zeroed disk block.
+// In-memory allocation state, in struct fsdev. Each bitmap block
+// covers an allocation group of BPB blocks; balloc_near() skips
+// groups with no free blocks, and starts looking in a group at its
+// hint, below which every block of the group is in use.
+struct agroup {
+  uint nfree;  // free blocks in the group
+  uint hint;   // lowest block of the group that may be free
+};
+
+// Count the free blocks and inodes, and set the hints.
+static void
+fsallocinit(int dev)
+{
+  struct fsdev *fs = &fsdev[dev];
+  struct buf *bp;
+  uint g, b;
+
+  initlock(&fs->lock, "fsalloc");
+  fs->ngroups = (fs->sb.size + BPB - 1) / BPB;
+  if(fs->ngroups > PGSIZE / sizeof(struct agroup))
+    panic("fsallocinit: too many groups");
+  if((fs->group = kalloc()) == 0)
+    panic("fsallocinit: out of memory");
+
+  fs->nbfree = 0;
+  for(g = 0; g < fs->ngroups; g++){
+    struct agroup *ag = &fs->group[g];
+    ag->nfree = 0;
+    ag->hint = (g + 1) * BPB;
+    bp = bread(dev, BBLOCK(g * BPB, fs->sb));
+    for(b = g * BPB; b < (g + 1) * BPB && b < fs->sb.size; b++){
+      uint bi = b % BPB;
+      if((bp->data[bi/8] & (1 << (bi % 8))) == 0){
+        if(ag->nfree++ == 0)
+          ag->hint = b;
+      }
+    }
+    brelse(bp);
+    fs->nbfree += ag->nfree;
+  }
+
+  fs->nifree = 0;
+  fs->ihint = fs->sb.ninodes;
+  for(uint inum = 1; inum < fs->sb.ninodes; inum++){
+    bp = bread(dev, IBLOCK(inum, fs->sb));
+    if(((struct dinode*)bp->data + inum%IPB)->type == 0){
+      if(fs->nifree++ == 0)
+        fs->ihint = inum;
+    }
+    brelse(bp);
+  }
+}
+
+// Where to put the first block of ip: the same fraction of the way
+// through the data blocks as ip is through the inodes.
+static uint
+igoal(struct inode *ip)
+{
+  struct fsdev *fs = &fsdev[ip->dev];
+  uint data = fs->sb.bmapstart + fs->ngroups;
+  return data + (uint64)(fs->sb.size - data) * ip->inum / fs->sb.ninodes;
+}
+
+// Allocate a zeroed disk block: goal, if it is free, or else the
+// block run blocks into the first run of at least 2*run free blocks
+// after goal, leaving the start of the run for whichever file ends
+// just before it to grow into. Falls back to the first free block
+// after goal, which is the block taken when run is 0.
 // returns 0 if out of disk space.
 static uint
-balloc(uint dev)
+balloc_near(uint dev, uint goal, uint run)
 {
-  int b, bi, m;
+  uint k, g, g0, b, bi, len, end, any;
+  uint start = 0;
+  struct fsdev *fs = &fsdev[dev];
   struct buf *bp;
 
-  bp = 0;
-  for(b = 0; b < sb.size; b += BPB){
-    bp = bread(dev, BBLOCK(b, sb));
-    for(bi = 0; bi < BPB && b + bi < sb.size; bi++){
-      m = 1 << (bi % 8);
-      if((bp->data[bi/8] & m) == 0){  // Is block free?
-        bp->data[bi/8] |= m;  // Mark block in use.
-        log_write(bp);
-        brelse(bp);
-        bzero(dev, b + bi);
-        return b + bi;
+  if(goal >= fs->sb.size)
+    goal = 0;
+
+  for(;;){
+    any = 0;
+    g0 = goal / BPB;
+    // look through goal's group from goal on, then every other
+    // group, and last the rest of goal's group.
+    for(k = 0; k <= fs->ngroups; k++){
+      g = (g0 + k) % fs->ngroups;
+      if(fs->group[g].nfree == 0)
+        continue;
+      b = k == 0 ? goal : g * BPB;
+      end = k == fs->ngroups ? goal : min((g + 1) * BPB, fs->sb.size);
+      if(b < fs->group[g].hint)
+        b = fs->group[g].hint;
+      if(b >= end)
+        continue;
+      bp = bread(dev, BBLOCK(b, fs->sb));
+      for(len = 0; b < end; b++){
+        bi = b % BPB;
+        if(bp->data[bi/8] & (1 << (bi % 8))){  // Is block in use?
+          len = 0;
+          continue;
+        }
+        if(any == 0)
+          any = b;
+        if(len++ == 0)
+          start = b;
+        if(b == goal || len >= 2*run){
+          b = b == goal ? goal : start + run;
+          bi = b % BPB;
+          bp->data[bi/8] |= 1 << (bi % 8);  // Mark block in use.
+          log_write(bp);
+          acquire(&fs->lock);
+          fs->group[g].nfree--;
+          fs->nbfree--;
+          if(b == fs->group[g].hint)
+            fs->group[g].hint = b + 1;
+          release(&fs->lock);
+          brelse(bp);
+          bzero(dev, b);
+          return b;
+        }
       }
+      brelse(bp);
     }
-    brelse(bp);
+    if(any == 0)
+      break;
+    // no run long enough; take the first free block, unless
+    // another process has just taken it.
+    goal = any;
+    run = fs->sb.size;
   }
   printf("balloc: out of blocks\n");
   return 0;
@@ -93,14 +234,21 @@ bfree(int dev, uint b)
 {
   struct buf *bp;
   int bi, m;
+  struct fsdev *fs = &fsdev[dev];
 
-  bp = bread(dev, BBLOCK(b, sb));
+  bp = bread(dev, BBLOCK(b, fs->sb));
   bi = b % BPB;
   m = 1 << (bi % 8);
   if((bp->data[bi/8] & m) == 0)
     panic("freeing free block");
   bp->data[bi/8] &= ~m;
   log_write(bp);
+  acquire(&fs->lock);
+  fs->group[b / BPB].nfree++;
+  fs->nbfree++;
+  if(b < fs->group[b / BPB].hint)
+    fs->group[b / BPB].hint = b;
+  release(&fs->lock);
   brelse(bp);
 }
 
@@ -129,18 +277,20 @@ bfree(int dev, uint b)
 //   is non-zero. ialloc() allocates, and iput() frees if
 //   the reference and link counts have fallen to zero.
 //
-// * Referencing in table: an entry in the inode table
-//   is free if ip->ref is zero. Otherwise ip->ref tracks
-//   the number of in-memory pointers to the entry (open
-//   files and current directories). iget() finds or
-//   creates a table entry and increments its ref; iput()
-//   decrements ref.
+// * Referencing in table: ip->ref tracks the number of
+//   in-memory pointers to a table entry (open files and
+//   current directories). iget() finds or creates a table
+//   entry and increments its ref; iput() decrements ref.
+//   An entry whose ref has fallen to zero stays in the
+//   table, still valid, so that the next iget() of it
+//   needn't read the disk, until iget() recycles it for
+//   another inode.
 //
 // * Valid: the information (type, size, &c) in an inode
 //   table entry is only correct when ip->valid is 1.
 //   ilock() reads the inode from
 //   the disk and sets ip->valid, while iput() clears
-//   ip->valid if ip->ref has fallen to zero.
+//   ip->valid when it frees the inode.
 //
 // * Locked: file system code may only examine and modify
 //   the information in an inode and its content if it
@@ -164,29 +314,167 @@ bfree(int dev, uint b)
 // have locked the inodes involved; this lets callers create
 // multi-step atomic operations.
 //
-// The itable.lock spin-lock protects the allocation of itable
-// entries. Since ip->ref indicates whether an entry is free,
-// and ip->dev and ip->inum indicate which i-node an entry
-// holds, one must hold itable.lock while using any of those fields.
+// The itable is a hash table keyed by (dev, inum). Each
+// bucket's spin-lock protects the ref and hnext fields of
+// the entries in the bucket; an entry's dev and inum only
+// change while it is in no bucket. itable.lock protects the
+// list of entries with no references, least recently used
+// first, from which iget() recycles, and the entries that
+// hold no inode. The table grows a page of entries at a time,
+// up to NINODE entries. A bucket lock must be acquired before
+// itable.lock.
 //
 // An ip->lock sleep-lock protects all ip-> fields other than ref,
-// dev, and inum.  One must hold ip->lock in order to
-// read or write that inode's ip->valid, ip->size, ip->type, &c.
+// dev, inum, and the table's links.  One must hold ip->lock in
+// order to read or write that inode's ip->valid, ip->size,
+// ip->type, &c.
+
+#define NIHASH 61
+
+struct ibucket {
+  struct spinlock lock;
+  struct inode *head;
+};
 
 struct {
   struct spinlock lock;
-  struct inode inode[NINODE];
+  struct spinlock evictlock; // serializes recycling
+  struct ibucket bucket[NIHASH];
+  struct inode *lru_head;    // entries with ref 0, least recently used first
+  struct inode *lru_tail;
+  struct inode *unused;      // entries holding no inode
+  int ninode;                // entries allocated
 } itable;
 
 void
 iinit()
 {
-  int i = 0;
-
   initlock(&itable.lock, "itable");
-  for(i = 0; i < NINODE; i++) {
-    initsleeplock(&itable.inode[i].lock, "inode");
+  initlock(&itable.evictlock, "itable evict");
+  for(int i = 0; i < NIHASH; i++)
+    initlock(&itable.bucket[i].lock, "itable bucket");
+}
+
+static struct ibucket*
+ihash(uint dev, uint inum)
+{
+  return &itable.bucket[(dev * 31 + inum) % NIHASH];
+}
+
+// Must be called with itable.lock held.
+static void
+lru_remove(struct inode *ip)
+{
+  if(ip->lru_prev)
+    ip->lru_prev->lru_next = ip->lru_next;
+  else
+    itable.lru_head = ip->lru_next;
+  if(ip->lru_next)
+    ip->lru_next->lru_prev = ip->lru_prev;
+  else
+    itable.lru_tail = ip->lru_prev;
+  ip->onlru = 0;
+}
+
+// Put ip on the list of entries with no references: last, to
+// be recycled after the others, if it still holds a valid
+// inode, or else first. Must be called with itable.lock held.
+static void
+lru_add(struct inode *ip)
+{
+  ip->onlru = 1;
+  if(ip->valid || itable.lru_head == 0){
+    ip->lru_next = 0;
+    ip->lru_prev = itable.lru_tail;
+    if(itable.lru_tail)
+      itable.lru_tail->lru_next = ip;
+    else
+      itable.lru_head = ip;
+    itable.lru_tail = ip;
+  } else {
+    ip->lru_prev = 0;
+    ip->lru_next = itable.lru_head;
+    itable.lru_head->lru_prev = ip;
+    itable.lru_head = ip;
+  }
+}
+
+// Look for the inode in bucket b, and take a reference to
+// it if it's there. Must be called with b's lock held.
+static struct inode*
+ifind(struct ibucket *b, uint dev, uint inum)
+{
+  for(struct inode *ip = b->head; ip; ip = ip->hnext){
+    if(ip->dev == dev && ip->inum == inum){
+      if(ip->ref++ == 0){
+        acquire(&itable.lock);
+        lru_remove(ip);
+        release(&itable.lock);
+      }
+      return ip;
+    }
+  }
+  return 0;
+}
+
+// Return an entry holding no inode: an unused one, one from a
+// new page of entries, or else the least recently used entry
+// with no references, which is taken out of its bucket.
+// Returns 0 if every entry is in use.
+static struct inode*
+ispare(void)
+{
+  struct inode *ip;
+
+  acquire(&itable.lock);
+  if(itable.unused == 0 && itable.ninode < NINODE){
+    struct inode *page = kalloc();
+    if(page){
+      memset(page, 0, PGSIZE);
+      for(int i = 0; i < PGSIZE / sizeof(struct inode); i++){
+        initsleeplock(&page[i].lock, "inode");
+        page[i].hnext = itable.unused;
+        itable.unused = &page[i];
+        itable.ninode++;
+      }
+    }
+  }
+  if((ip = itable.unused) != 0){
+    itable.unused = ip->hnext;
+    release(&itable.lock);
+    return ip;
+  }
+  release(&itable.lock);
+
+  // only recyclers change an entry's dev and inum, so the
+  // bucket of the entry at the head of the list is stable.
+  acquire(&itable.evictlock);
+  for(;;){
+    acquire(&itable.lock);
+    ip = itable.lru_head;
+    release(&itable.lock);
+    if(ip == 0)
+      break;
+
+    struct ibucket *b = ihash(ip->dev, ip->inum);
+    acquire(&b->lock);
+    acquire(&itable.lock);
+    if(ip->ref == 0 && ip->onlru){
+      lru_remove(ip);
+      release(&itable.lock);
+      struct inode **pp = &b->head;
+      while(*pp != ip)
+        pp = &(*pp)->hnext;
+      *pp = ip->hnext;
+      release(&b->lock);
+      break;
+    }
+    // someone took a reference to it meanwhile.
+    release(&itable.lock);
+    release(&b->lock);
   }
+  release(&itable.evictlock);
+  return ip;
 }
 
 static struct inode* iget(uint dev, uint inum);
@@ -199,16 +487,23 @@ struct inode*
 ialloc(uint dev, short type)
 {
   int inum;
+  struct fsdev *fs = &fsdev[dev];
   struct buf *bp;
   struct dinode *dip;
 
-  for(inum = 1; inum < sb.ninodes; inum++){
-    bp = bread(dev, IBLOCK(inum, sb));
+  // every inode below the hint is in use.
+  for(inum = fs->ihint; inum < fs->sb.ninodes; inum++){
+    bp = bread(dev, IBLOCK(inum, fs->sb));
     dip = (struct dinode*)bp->data + inum%IPB;
     if(dip->type == 0){  // a free inode
       memset(dip, 0, sizeof(*dip));
       dip->type = type;
       log_write(bp);   // mark it allocated on the disk
+      acquire(&fs->lock);
+      fs->nifree--;
+      if(inum == fs->ihint)
+        fs->ihint = inum + 1;
+      release(&fs->lock);
       brelse(bp);
       return iget(dev, inum);
     }
@@ -228,7 +523,7 @@ iupdate(struct inode *ip)
   struct buf *bp;
   struct dinode *dip;
 
-  bp = bread(ip->dev, IBLOCK(ip->inum, sb));
+  bp = bread(ip->dev, IBLOCK(ip->inum, SB(ip->dev)));
   dip = (struct dinode*)bp->data + ip->inum%IPB;
   dip->type = ip->type;
   dip->major = ip->major;
@@ -246,32 +541,42 @@ iupdate(struct inode *ip)
 static struct inode*
 iget(uint dev, uint inum)
 {
-  struct inode *ip, *empty;
-
-  acquire(&itable.lock);
+  struct ibucket *b = ihash(dev, inum);
+  struct inode *ip, *spare;
 
   // Is the inode already in the table?
-  empty = 0;
-  for(ip = &itable.inode[0]; ip < &itable.inode[NINODE]; ip++){
-    if(ip->ref > 0 && ip->dev == dev && ip->inum == inum){
-      ip->ref++;
-      release(&itable.lock);
-      return ip;
-    }
-    if(empty == 0 && ip->ref == 0)    // Remember empty slot.
-      empty = ip;
-  }
+  acquire(&b->lock);
+  ip = ifind(b, dev, inum);
+  release(&b->lock);
+  if(ip)
+    return ip;
 
   // Recycle an inode entry.
-  if(empty == 0)
+  if((spare = ispare()) == 0)
     panic("iget: no inodes");
 
-  ip = empty;
-  ip->dev = dev;
-  ip->inum = inum;
-  ip->ref = 1;
-  ip->valid = 0;
-  release(&itable.lock);
+  // another process may have added the inode meanwhile.
+  acquire(&b->lock);
+  if((ip = ifind(b, dev, inum)) == 0){
+    ip = spare;
+    spare = 0;
+    ip->dev = dev;
+    ip->inum = inum;
+    ip->ref = 1;
+    ip->valid = 0;
+    ip->ra_next = 0;
+    ip->ra_ahead = 0;
+    ip->hnext = b->head;
+    b->head = ip;
+  }
+  release(&b->lock);
+
+  if(spare){
+    acquire(&itable.lock);
+    spare->hnext = itable.unused;
+    itable.unused = spare;
+    release(&itable.lock);
+  }
 
   return ip;
 }
@@ -281,9 +586,11 @@ iget(uint dev, uint inum)
 struct inode*
 idup(struct inode *ip)
 {
-  acquire(&itable.lock);
+  struct ibucket *b = ihash(ip->dev, ip->inum);
+
+  acquire(&b->lock);
   ip->ref++;
-  release(&itable.lock);
+  release(&b->lock);
   return ip;
 }
 
@@ -301,7 +608,7 @@ ilock(struct inode *ip)
   acquiresleep(&ip->lock);
 
   if(ip->valid == 0){
-    bp = bread(ip->dev, IBLOCK(ip->inum, sb));
+    bp = bread(ip->dev, IBLOCK(ip->inum, SB(ip->dev)));
     dip = (struct dinode*)bp->data + ip->inum%IPB;
     ip->type = dip->type;
     ip->major = dip->major;
@@ -310,6 +617,7 @@ ilock(struct inode *ip)
     ip->size = dip->size;
     memmove(ip->addrs, dip->addrs, sizeof(ip->addrs));
     brelse(bp);
+    bmc_clear(ip);
     ip->valid = 1;
     if(ip->type == 0)
       panic("ilock: no type");
@@ -336,7 +644,9 @@ iunlock(struct inode *ip)
 void
 iput(struct inode *ip)
 {
-  acquire(&itable.lock);
+  struct ibucket *b = ihash(ip->dev, ip->inum);
+
+  acquire(&b->lock);
 
   if(ip->ref == 1 && ip->valid && ip->nlink == 0){
     // inode has no links and no other references: truncate and free.
@@ -345,20 +655,37 @@ iput(struct inode *ip)
     // so this acquiresleep() won't block (or deadlock).
     acquiresleep(&ip->lock);
 
-    release(&itable.lock);
+    release(&b->lock);
+
+    if(ip->size > NDIRECT*BSIZE){
+      // too big to free in the caller's transaction; have
+      // the truncation process do it, with this reference.
+      releasesleep(&ip->lock);
+      orphan_add(ip);
+      return;
+    }
 
+    if(ip->type == T_DIR)
+      dcache_purge(ip);
     itrunc(ip);
-    ip->type = 0;
-    iupdate(ip);
-    ip->valid = 0;
+    ifreeinode(ip);
 
     releasesleep(&ip->lock);
 
-    acquire(&itable.lock);
+    acquire(&b->lock);
   }
 
-  ip->ref--;
-  release(&itable.lock);
+  if(ip->ref == 1 && ip->npcpages > 0){
+    // the inode's slot may be reused for another file once ref hits 0.
+    pagecache_drop(ip);
+  }
+
+  if(--ip->ref == 0){
+    acquire(&itable.lock);
+    lru_add(ip);
+    release(&itable.lock);
+  }
+  release(&b->lock);
 }
 
 // Common idiom: unlock, then put.
@@ -376,12 +703,222 @@ iunlockput(struct inode *ip)
 // are listed in ip->addrs[].  The next NINDIRECT blocks are
 // listed in block ip->addrs[NDIRECT].
 
+// Each inode remembers the last few runs of blocks that bmap_alloc() looked up past the direct
+// blocks, so that reading a big file needn't walk its indirect or extent blocks for every block.
+
+// Forget ip's remembered runs, as when its blocks are freed.
+static void
+bmc_clear(struct inode *ip)
+{
+  memset(ip->bmc, 0, sizeof(ip->bmc));
+  ip->bmc_next = 0;
+}
+
+// Return the disk block holding block bn of ip if a remembered run covers it, or else 0.
+static uint
+bmc_lookup(struct inode *ip, uint bn)
+{
+  for (int i = 0; i < NBMAPRUN; i++) {
+    struct bmaprun *r = &ip->bmc[i];
+
+    if (bn - r->bn < r->len) {
+      return r->addr + (bn - r->bn);
+    }
+  }
+
+  return 0;
+}
+
+// Remember that blocks bn to bn+len-1 of ip are disk blocks addr on.
+static void
+bmc_add(struct inode *ip, uint bn, uint addr, uint len)
+{
+  struct bmaprun *r = &ip->bmc[ip->bmc_next];
+
+  r->bn        = bn;
+  r->addr      = addr;
+  r->len       = len;
+  ip->bmc_next = (ip->bmc_next + 1) % NBMAPRUN;
+}
+
+// A new extent starts in a run of free blocks at least twice this long, if there is one, so that
+// files written at the same time don't interleave their blocks.
+#define EXTENT_RUN 16
+
+// bmap_alloc() for a file system with FS_EXTENTS. Blocks are only ever added at the end of a file,
+// so the nth block can only be allocated if the file has exactly n blocks. It goes right after the
+// file's last block if that one is free, growing the last extent, or else starts a new extent.
+static uint
+emap(struct inode *ip, uint inode_bn, int alloc)
+{
+  struct buf    *block = 0;
+  struct extent *last  = 0;
+  struct extent *e     = 0;
+
+  // the file's first block of the extent being looked at
+  uint base = 0;
+  uint i;
+
+  for (i = 0; i < NEXTENT + NEXTBLOCK; i++) {
+    if (i == NEXTENT) {
+      if (ip->extblock == 0) {
+        break;
+      }
+
+      block = bread(ip->dev, ip->extblock);
+    }
+
+    e = i < NEXTENT ? &ip->extents[i] : (struct extent *)block->data + (i - NEXTENT);
+
+    if (e->len == 0) {
+      break;
+    }
+
+    if (inode_bn < base + e->len) {
+      uint device_bn = e->start + (inode_bn - base);
+
+      if (block) {
+        // the extent may still grow, but the blocks it has now stay put
+        bmc_add(ip, base, e->start, e->len);
+        brelse(block);
+      }
+
+      return device_bn;
+    }
+
+    base += e->len;
+    last  = e;
+  }
+
+  uint device_bn = 0;
+
+  if (!alloc || inode_bn != base) {
+    goto out;
+  }
+
+  uint goal = last ? last->start + last->len : igoal(ip);
+
+  if ((device_bn = balloc_near(ip->dev, goal, EXTENT_RUN)) == 0) {
+    goto out;
+  }
+
+  // the extent that changes
+  uint slot;
+
+  if (last && device_bn == goal) {
+    last->len++;
+    slot = i - 1;
+  } else if (i == NEXTENT + NEXTBLOCK) {
+    // out of extents
+    bfree(ip->dev, device_bn);
+    device_bn = 0;
+
+    goto out;
+  } else {
+    if (i == NEXTENT && ip->extblock == 0) {
+      // the first extent that doesn't fit in the inode; the extent block comes out zeroed, so the
+      // extent after this one ends the list.
+      if ((ip->extblock = balloc_near(ip->dev, device_bn, 0)) == 0) {
+        bfree(ip->dev, device_bn);
+        device_bn = 0;
+
+        goto out;
+      }
+
+      block = bread(ip->dev, ip->extblock);
+    }
+
+    e        = i < NEXTENT ? &ip->extents[i] : (struct extent *)block->data + (i - NEXTENT);
+    e->start = device_bn;
+    e->len   = 1;
+    slot     = i;
+  }
+
+  // the caller writes the inode back, but an extent in the extent block must be logged here
+  if (slot >= NEXTENT) {
+    log_write(block);
+  }
+
+out:
+  if (block) {
+    brelse(block);
+  }
+
+  return device_bn;
+}
+
+// Free at most max blocks from the end of the last extent of ip, which maps its blocks with extents.
+// Returns 1 if there may be more to free.
+static int
+etrunc_step(struct inode *ip, uint max)
+{
+  struct buf    *block   = 0;
+  struct extent *extents = ip->extents;
+  int            i       = NEXTENT - 1;
+
+  if (ip->extblock) {
+    block   = bread(ip->dev, ip->extblock);
+    extents = (struct extent *)block->data;
+    i       = NEXTBLOCK - 1;
+  }
+
+  while (i >= 0 && extents[i].len == 0) {
+    i--;
+  }
+
+  if (i < 0) {
+    // only an empty extent block is left
+    if (block) {
+      brelse(block);
+      bfree(ip->dev, ip->extblock);
+      ip->extblock = 0;
+
+      return 1;
+    }
+
+    return 0;
+  }
+
+  uint n = min(extents[i].len, max);
+
+  for (uint b = extents[i].len - n; b < extents[i].len; b++) {
+    bfree(ip->dev, extents[i].start + b);
+  }
+
+  extents[i].len -= n;
+  if (extents[i].len == 0) {
+    extents[i].start = 0;
+  }
+
+  // the caller writes the inode back, but the extent block must be logged here
+  if (block) {
+    log_write(block);
+    brelse(block);
+  }
+
+  return 1;
+}
+
 // Return the disk block address of the nth block in inode ip.
-// If there is no such block, bmap allocates one.
-// returns 0 if out of disk space.
+// If there is no such block, bmap allocates one if alloc is set.
+// returns 0 if out of disk space, or if there is no such block
+// and alloc is clear.
 static uint
-bmap(struct inode *ip, uint inode_bn)
+bmap_alloc(struct inode *ip, uint inode_bn, int alloc)
 {
+  uint cached = bmc_lookup(ip, inode_bn);
+
+  if (cached) {
+    return cached;
+  }
+
+  if (SB(ip->dev).flags & FS_EXTENTS) {
+    return emap(ip, inode_bn, alloc);
+  }
+
+  // The file's block being looked up.
+  uint bn = inode_bn;
+
   // The current level of indirection; 2 is doubly indirect, 1 is singly indirect, and 0 is no
   // indirection at all.
   uint indirection;
@@ -410,8 +947,8 @@ bmap(struct inode *ip, uint inode_bn)
 
   device_bn = ip->addrs[offset];
 
-  if (device_bn == 0) {
-    device_bn = ip->addrs[offset] = balloc(ip->dev);
+  if (device_bn == 0 && alloc) {
+    device_bn = ip->addrs[offset] = balloc_near(ip->dev, igoal(ip), 0);
   }
 
   for (; indirection > 0 && device_bn > 0; indirection--) {
@@ -438,79 +975,357 @@ bmap(struct inode *ip, uint inode_bn)
     uint *block_numbers = (uint *)block->data;
 
     // check if we need to allocate a block for this offset
-    if (block_numbers[offset] == 0 && (block_numbers[offset] = balloc(ip->dev))) {
+    if (block_numbers[offset] == 0 && alloc &&
+        (block_numbers[offset] = balloc_near(ip->dev, igoal(ip), 0))) {
       log_write(block);
     }
 
     device_bn = block_numbers[offset];
 
+    if (indirection == 1 && device_bn) {
+      // remember the run of adjacent blocks that starts here
+      uint len = 1;
+
+      while (offset + len < NINDIRECT && block_numbers[offset + len] == device_bn + len) {
+        len++;
+      }
+
+      bmc_add(ip, bn, device_bn, len);
+    }
+
     brelse(block);
   }
 
   return device_bn;
 }
 
-void
-itrunc_rec_bfree(uint dev, uint device_bn, uint indirection)
+static uint
+bmap(struct inode *ip, uint inode_bn)
 {
-  if (indirection == 0) {
-    bfree(dev, device_bn);
+  return bmap_alloc(ip, inode_bn, 1);
+}
 
+// Called by readi() as it reads block bn of ip. If ip is being read
+// sequentially, start reading up to READAHEAD of the blocks after bn
+// into the buffer cache, so that readi() finds them there. Reads are
+// started in batches of at least half that, once the blocks already
+// started run low.
+static void
+readahead(struct inode *ip, uint bn)
+{
+  // a read that continues where the last one stopped may start
+  // in the same block.
+  int sequential = bn == ip->ra_next || bn + 1 == ip->ra_next;
+
+  ip->ra_next = bn + 1;
+  if(!sequential || ip->ra_ahead < bn + 1)
+    ip->ra_ahead = bn + 1;
+  if(!sequential || ip->ra_ahead > bn + 1 + READAHEAD/2)
     return;
+
+  uint end = min(bn + 1 + READAHEAD, (ip->size + BSIZE - 1) / BSIZE);
+  uint addrs[READAHEAD];
+  int n = 0;
+
+  for(; ip->ra_ahead < end; ip->ra_ahead++){
+    uint addr = bmap_alloc(ip, ip->ra_ahead, 0);
+    if(addr == 0)
+      break;
+    addrs[n++] = addr;
   }
+  breadahead(ip->dev, addrs, n);
+}
 
-  struct buf *block         = bread(dev, device_bn);
+// Free the data blocks that the singly-indirect block bn lists, from the last, while *budget lasts,
+// counting each one against it. Returns 1 if bn lists no blocks now.
+static int
+itrunc_indirect(uint dev, uint bn, uint *budget)
+{
+  struct buf *block         = bread(dev, bn);
   uint       *block_numbers = (uint *)block->data;
+  int         i             = NINDIRECT - 1;
+  int         freed         = 0;
 
-  for (uint i = 0; i < NINDIRECT; i++) {
+  for (; i >= 0 && *budget > 0; i--) {
     if (block_numbers[i] == 0) {
       continue;
     }
 
-    itrunc_rec_bfree(dev, block_numbers[i], indirection - 1);
+    bfree(dev, block_numbers[i]);
+    block_numbers[i] = 0;
+    freed            = 1;
+    (*budget)--;
+  }
+
+  while (i >= 0 && block_numbers[i] == 0) {
+    i--;
+  }
+
+  if (freed) {
+    log_write(block);
   }
 
   brelse(block);
-  bfree(dev, device_bn);
+
+  return i < 0;
 }
 
-// Truncate inode (discard contents).
-// Caller must hold ip->lock.
-void
-itrunc(struct inode *ip)
+// Free at most max of ip's blocks, from the end of the file. Each freed block changes at most one
+// bitmap block, and besides those a step changes at most an indirect or extent block, the
+// doubly-indirect block and the inode. The blocks ip maps on disk once the caller writes it back are
+// then all allocated, so a truncation can be split across transactions. Returns 1 if there may be
+// more to free. Caller must hold ip->lock.
+static int
+itrunc_step(struct inode *ip, uint max)
 {
-  for (int i = NDIRECT + 1; i >= 0; i--) {
+  if (isfastlink(ip)) {
+    // the target is no block map.
+    memset(ip->addrs, 0, sizeof(ip->addrs));
+    return 0;
+  }
+
+  if (SB(ip->dev).flags & FS_EXTENTS) {
+    return etrunc_step(ip, max);
+  }
+
+  if (ip->addrs[NDIRECT + 1]) {
+    struct buf *block         = bread(ip->dev, ip->addrs[NDIRECT + 1]);
+    uint       *block_numbers = (uint *)block->data;
+    int         i             = NINDIRECT - 1;
+
+    while (i >= 0 && block_numbers[i] == 0) {
+      i--;
+    }
+
+    if (i >= 0) {
+      if (itrunc_indirect(ip->dev, block_numbers[i], &max) && max > 0) {
+        bfree(ip->dev, block_numbers[i]);
+        block_numbers[i] = 0;
+        log_write(block);
+        max--;
+      }
+      brelse(block);
+    } else {
+      brelse(block);
+      bfree(ip->dev, ip->addrs[NDIRECT + 1]);
+      ip->addrs[NDIRECT + 1] = 0;
+    }
+
+    return 1;
+  }
+
+  if (ip->addrs[NDIRECT]) {
+    if (!itrunc_indirect(ip->dev, ip->addrs[NDIRECT], &max) || max == 0) {
+      return 1;
+    }
+
+    bfree(ip->dev, ip->addrs[NDIRECT]);
+    ip->addrs[NDIRECT] = 0;
+    max--;
+  }
+
+  for (int i = NDIRECT - 1; i >= 0; i--) {
     if (ip->addrs[i] == 0) {
       continue;
     }
 
-    uint indirection = i >= NDIRECT ? (i - NDIRECT) + 1 : 0;
-
-    itrunc_rec_bfree(ip->dev, ip->addrs[i], indirection);
+    if (max == 0) {
+      return 1;
+    }
 
+    bfree(ip->dev, ip->addrs[i]);
     ip->addrs[i] = 0;
+    max--;
   }
 
-  ip->size = 0;
-
-  iupdate(ip);
+  return 0;
 }
 
-// Copy stat information from inode.
+// Truncate inode (discard contents).
 // Caller must hold ip->lock.
 void
-stati(struct inode *ip, struct stat *st)
+itrunc(struct inode *ip)
 {
-  st->dev = ip->dev;
-  st->ino = ip->inum;
-  st->type = ip->type;
-  st->nlink = ip->nlink;
-  st->size = ip->size;
-}
+  bmc_clear(ip);
 
-// Read data from inode.
-// Caller must hold ip->lock.
-// If user_dst==1, then dst is a user virtual address;
+  while (itrunc_step(ip, ~0U)) {
+  }
+
+  ip->size = 0;
+
+  pagecache_drop(ip);
+  iupdate(ip);
+}
+
+// Mark ip, which has no blocks, free on disk. Caller must hold ip->lock.
+static void
+ifreeinode(struct inode *ip)
+{
+  ip->type = 0;
+  iupdate(ip);
+  ip->valid = 0;
+
+  struct fsdev *fs = &fsdev[ip->dev];
+
+  acquire(&fs->lock);
+  fs->nifree++;
+  if (ip->inum < fs->ihint) {
+    fs->ihint = ip->inum;
+  }
+  release(&fs->lock);
+}
+
+// Big inodes with no links left and no references are freed by a kernel process, in transactions
+// of their own, so that the last iput() of a big file doesn't have to wait for, or log, the freeing
+// of all its blocks. Until it is freed, an inode with no links keeps its type, and nlink 0, on
+// disk, so fsinit() has this process free the ones a crash left behind.
+
+static struct {
+  struct spinlock lock;
+  struct inode   *head; // linked through orphan_next
+} orphans;
+
+// Have the truncation process free ip, handing it the caller's reference, which is ip's last.
+static void
+orphan_add(struct inode *ip)
+{
+  acquire(&orphans.lock);
+  ip->orphan_next = orphans.head;
+  orphans.head    = ip;
+  wakeup(&orphans);
+  release(&orphans.lock);
+}
+
+// Free ip's blocks, a step per transaction, and then ip.
+static void
+ifree(struct inode *ip)
+{
+  // each step frees as many blocks as fit in a transaction next to the three other blocks it
+  // may change.
+  int nblocks = log_maxop();
+  int more;
+
+  ilock(ip);
+  if (ip->type == T_DIR) {
+    dcache_purge(ip);
+  }
+  bmc_clear(ip);
+  pagecache_drop(ip);
+  iunlock(ip);
+
+  do {
+    begin_opn(nblocks);
+    ilock(ip);
+    more     = itrunc_step(ip, nblocks - 3);
+    ip->size = 0;
+    if (more) {
+      iupdate(ip);
+    } else {
+      ifreeinode(ip);
+    }
+    iunlock(ip);
+    end_opn(nblocks);
+  } while (more);
+
+  // ip is no longer valid, so this doesn't write the disk.
+  iput(ip);
+}
+
+static void
+itruncd(void *arg)
+{
+  for (;;) {
+    acquire(&orphans.lock);
+    while (orphans.head == 0) {
+      sleep(&orphans, &orphans.lock);
+    }
+    struct inode *ip = orphans.head;
+    orphans.head     = ip->orphan_next;
+    release(&orphans.lock);
+
+    ifree(ip);
+  }
+}
+
+// Queue the inodes that were left with no links by a crash, and start the truncation process.
+static void
+orphaninit(int dev)
+{
+  initlock(&orphans.lock, "orphans");
+
+  for (uint inum = 1; inum < SB(dev).ninodes; inum++) {
+    struct buf    *bp  = bread(dev, IBLOCK(inum, SB(dev)));
+    struct dinode *dip = (struct dinode *)bp->data + inum % IPB;
+    int            orphan = dip->type != 0 && dip->nlink == 0;
+
+    brelse(bp);
+    if (orphan) {
+      orphan_add(iget(dev, inum));
+    }
+  }
+
+  if (kproc("itruncd", itruncd, 0) < 0) {
+    panic("orphaninit");
+  }
+}
+
+// Copy stat information from inode.
+// Caller must hold ip->lock.
+void
+stati(struct inode *ip, struct stat *st)
+{
+  st->dev = ip->dev;
+  st->ino = ip->inum;
+  st->type = ip->type;
+  st->nlink = ip->nlink;
+  st->size = ip->size;
+}
+
+// Copy the sizes and free counts of the file system ip is on,
+// which fsinit() counted and the allocators keep up to date.
+void
+statfsi(struct inode *ip, struct statfs *st)
+{
+  struct fsdev *fs = &fsdev[ip->dev];
+
+  st->dev = ip->dev;
+  st->bsize = BSIZE;
+  st->blocks = fs->sb.nblocks;
+  st->files = fs->sb.ninodes - 1;
+  acquire(&fs->lock);
+  st->bfree = fs->nbfree;
+  st->ffree = fs->nifree;
+  release(&fs->lock);
+}
+
+// Symbolic links.
+
+// Does ip keep its target in the inode? Caller must hold ip->lock.
+static int
+isfastlink(struct inode *ip)
+{
+  return ip->type == T_SYMLINK && ip->size <= NFASTLINK;
+}
+
+// Set the target of ip, a new symbolic link, to the n bytes at
+// target, which needn't end in a NUL. Returns n, or -1. readi()
+// reads the target back, wherever it is.
+// Caller must hold ip->lock, inside a transaction.
+int
+writelinki(struct inode *ip, char *target, uint n)
+{
+  if(n <= NFASTLINK){
+    memmove(ip->addrs, target, n);
+    ip->size = n;
+    iupdate(ip);
+    return n;
+  }
+  return writei(ip, 0, (uint64)target, 0, n) == n ? n : -1;
+}
+
+// Read data from inode.
+// Caller must hold ip->lock.
+// If user_dst==1, then dst is a user virtual address;
 // otherwise, dst is a kernel address.
 int
 readi(struct inode *ip, int user_dst, uint64 dst, uint off, uint n)
@@ -523,12 +1338,26 @@ readi(struct inode *ip, int user_dst, uint64 dst, uint off, uint n)
   if(off + n > ip->size)
     n = ip->size - off;
 
+  if(isfastlink(ip))
+    return either_copyout(user_dst, dst, (char*)ip->addrs + off, n) == -1 ? -1 : n;
+
   for(tot=0; tot<n; tot+=m, off+=m, dst+=m){
+    m = min(n - tot, BSIZE - off%BSIZE);
+    if(ip->npcpages > 0){
+      // a cached page may be newer than the disk, if a MAP_SHARED mapping wrote to it.
+      int r = pagecache_read(ip, user_dst, dst, off, m);
+      if(r < 0){
+        tot = -1;
+        break;
+      }
+      if(r > 0)
+        continue;
+    }
     uint addr = bmap(ip, off/BSIZE);
     if(addr == 0)
       break;
     bp = bread(ip->dev, addr);
-    m = min(n - tot, BSIZE - off%BSIZE);
+    readahead(ip, off/BSIZE);
     if(either_copyout(user_dst, dst, bp->data + (off % BSIZE), m) == -1) {
       brelse(bp);
       tot = -1;
@@ -556,6 +1385,8 @@ writei(struct inode *ip, int user_src, uint64 src, uint off, uint n)
     return -1;
   if(off + n > MAXFILE*BSIZE)
     return -1;
+  if(isfastlink(ip) && ip->size > 0)
+    return -1;
 
   for(tot=0; tot<n; tot+=m, off+=m, src+=m){
     uint addr = bmap(ip, off/BSIZE);
@@ -567,6 +1398,8 @@ writei(struct inode *ip, int user_src, uint64 src, uint off, uint n)
       brelse(bp);
       break;
     }
+    if(ip->npcpages > 0)
+      pagecache_write(ip, bp->data + (off % BSIZE), off, m);
     log_write(bp);
     brelse(bp);
   }
@@ -590,34 +1423,391 @@ namecmp(const char *s, const char *t)
   return strncmp(s, t, DIRSIZ);
 }
 
-// Look for a directory entry in a directory.
-// If found, set *poff to byte offset of entry.
-struct inode*
-dirlookup(struct inode *dp, char *name, uint *poff)
+// Directory name cache.
+//
+// Remembers the results of dirlookup(): for a name in a
+// directory, the inum and offset of its entry, or that the
+// directory has no entry of that name (inum 0). Entries are
+// only read or changed with the directory's ip->lock held,
+// and every change to a directory's entries goes through
+// dirlink() or dcache_remove(), which keep the cache in step.
+// When a directory is freed, iput() purges its entries, since
+// its inum may be reused. dcache.lock protects the table
+// itself; entries are replaced round-robin.
+
+#define NDCACHE 256
+#define NDHASH 61
+
+struct dentry {
+  uint dev;
+  uint dinum;          // directory's inum, or 0 if this entry is unused
+  char name[DIRSIZ];
+  uint inum;           // 0 if the directory has no such entry
+  uint off;            // offset of the directory entry
+  struct dentry *hnext;
+};
+
+struct {
+  struct spinlock lock;
+  struct dentry entry[NDCACHE];
+  struct dentry *hash[NDHASH];
+  int hand;
+} dcache;
+
+static void
+dcacheinit(void)
 {
-  uint off, inum;
-  struct dirent de;
+  initlock(&dcache.lock, "dcache");
+}
 
-  if(dp->type != T_DIR)
-    panic("dirlookup not DIR");
+static struct dentry**
+dhash(uint dev, uint dinum, char *name)
+{
+  uint h = dev * 31 + dinum;
 
-  for(off = 0; off < dp->size; off += sizeof(de)){
+  for(int i = 0; i < DIRSIZ && name[i]; i++)
+    h = h * 31 + (uchar)name[i];
+  return &dcache.hash[h % NDHASH];
+}
+
+// Must be called with dcache.lock held.
+static struct dentry*
+dfind(struct inode *dp, char *name)
+{
+  for(struct dentry *d = *dhash(dp->dev, dp->inum, name); d; d = d->hnext)
+    if(d->dinum == dp->inum && d->dev == dp->dev && namecmp(d->name, name) == 0)
+      return d;
+  return 0;
+}
+
+// Must be called with dcache.lock held.
+static void
+dunhash(struct dentry *d)
+{
+  struct dentry **pp = dhash(d->dev, d->dinum, d->name);
+
+  while(*pp != d)
+    pp = &(*pp)->hnext;
+  *pp = d->hnext;
+  d->dinum = 0;
+}
+
+// Look name up in dp's cached entries. Returns 1 and sets
+// *inum and *off if the cache knows the answer.
+static int
+dcache_lookup(struct inode *dp, char *name, uint *inum, uint *off)
+{
+  struct dentry *d;
+
+  acquire(&dcache.lock);
+  if((d = dfind(dp, name)) != 0){
+    *inum = d->inum;
+    *off = d->off;
+  }
+  release(&dcache.lock);
+  return d != 0;
+}
+
+// Record that name in dp has inum at off, or no entry if
+// inum is 0.
+static void
+dcache_enter(struct inode *dp, char *name, uint inum, uint off)
+{
+  struct dentry *d;
+
+  acquire(&dcache.lock);
+  if((d = dfind(dp, name)) == 0){
+    d = &dcache.entry[dcache.hand];
+    dcache.hand = (dcache.hand + 1) % NDCACHE;
+    if(d->dinum)
+      dunhash(d);
+    d->dev = dp->dev;
+    d->dinum = dp->inum;
+    strncpy(d->name, name, DIRSIZ);
+    struct dentry **pp = dhash(d->dev, d->dinum, d->name);
+    d->hnext = *pp;
+    *pp = d;
+  }
+  d->inum = inum;
+  d->off = off;
+  release(&dcache.lock);
+}
+
+// Called after the entry for name has been cleared from dp.
+void
+dcache_remove(struct inode *dp, char *name)
+{
+  dcache_enter(dp, name, 0, 0);
+}
+
+// Forget what the cache knows of name in dp.
+static void
+dcache_forget(struct inode *dp, char *name)
+{
+  struct dentry *d;
+
+  acquire(&dcache.lock);
+  if((d = dfind(dp, name)) != 0)
+    dunhash(d);
+  release(&dcache.lock);
+}
+
+// Forget every entry of directory dp, which is being freed.
+static void
+dcache_purge(struct inode *dp)
+{
+  acquire(&dcache.lock);
+  for(struct dentry *d = dcache.entry; d < &dcache.entry[NDCACHE]; d++)
+    if(d->dinum == dp->inum && d->dev == dp->dev)
+      dunhash(d);
+  release(&dcache.lock);
+}
+
+// Look for name among the entries of dp from byte offset
+// from to byte offset to. Returns its inum, and sets *poff
+// to the offset of its entry, or returns 0 if not found.
+static uint
+dirscan(struct inode *dp, char *name, uint from, uint to, uint *poff)
+{
+  uint off;
+  struct dirent de;
+
+  for(off = from; off < to; off += sizeof(de)){
     if(readi(dp, 0, (uint64)&de, off, sizeof(de)) != sizeof(de))
       panic("dirlookup read");
     if(de.inum == 0)
       continue;
     if(namecmp(name, de.name) == 0){
       // entry matches path element
-      if(poff)
-        *poff = off;
-      inum = de.inum;
-      return iget(dp->dev, inum);
+      *poff = off;
+      return de.inum;
     }
   }
+  return 0;
+}
+
+// Return the offset of the first free entry of dp from byte
+// offset from to byte offset to, or to if there is none.
+static uint
+dirfree(struct inode *dp, uint from, uint to)
+{
+  uint off;
+  struct dirent de;
 
+  for(off = from; off < to; off += sizeof(de)){
+    if(readi(dp, 0, (uint64)&de, off, sizeof(de)) != sizeof(de))
+      panic("dirlink read");
+    if(de.inum == 0)
+      break;
+  }
+  return off;
+}
+
+// Indexed directories, see fs.h.
+
+#define DIRSLOT_LEAF(v)    ((v) & 0xfff)
+#define DIRSLOT_DEPTH(v)   ((v) >> 12)
+#define DIRSLOT(leaf, d)   ((leaf) | (d) << 12)
+#define DIRINDEXRECS       (2 + (NDIRSLOT + DIRSLOTS - 1) / DIRSLOTS)
+#define DIRLEAF0           ((DIRINDEXRECS * sizeof(struct dirindex) + BSIZE - 1) / BSIZE) // first leaf block
+
+static int
+isdotname(char *name)
+{
+  return namecmp(name, ".") == 0 || namecmp(name, "..") == 0;
+}
+
+// Index slot of name: the top DIRINDEXBITS bits of its FNV-1a hash.
+static uint
+dirhash(char *name)
+{
+  uint h = 2166136261;
+
+  for(int i = 0; i < DIRSIZ && name[i]; i++)
+    h = (h ^ (uchar)name[i]) * 16777619;
+  return h >> (32 - DIRINDEXBITS);
+}
+
+// Byte offset of index slot s in the directory.
+static uint
+dirslotoff(uint s)
+{
+  return (2 + s / DIRSLOTS) * sizeof(struct dirindex) + sizeof(ushort) * (1 + s % DIRSLOTS);
+}
+
+static uint
+dirslot(struct inode *dp, uint s)
+{
+  ushort v;
+
+  if(readi(dp, 0, (uint64)&v, dirslotoff(s), sizeof(v)) != sizeof(v))
+    panic("dirslot read");
+  return v;
+}
+
+static int
+setdirslot(struct inode *dp, uint s, uint v)
+{
+  ushort x = v;
+
+  return writei(dp, 0, (uint64)&x, dirslotoff(s), sizeof(x)) == sizeof(x) ? 0 : -1;
+}
+
+// Write index record rec, with all its slots set to v.
+static int
+dirindexrec(struct inode *dp, uint rec, uint v)
+{
+  struct dirindex r;
+
+  memset(&r, 0, sizeof(r));
+  for(int i = 0; i < DIRSLOTS; i++)
+    if((rec - 2) * DIRSLOTS + i < NDIRSLOT)
+      r.slot[i] = v;
+  return writei(dp, 0, (uint64)&r, rec * sizeof(r), sizeof(r)) == sizeof(r) ? 0 : -1;
+}
+
+// Append a block of free entries to dp, and return its number.
+static int
+dirgrow(struct inode *dp)
+{
+  struct dirent de;
+  uint off = dp->size;
+
+  if(off % BSIZE)
+    return -1;
+  memset(&de, 0, sizeof(de));
+  for(uint i = 0; i < BSIZE / sizeof(de); i++)
+    if(writei(dp, 0, (uint64)&de, off + i * sizeof(de), sizeof(de)) != sizeof(de))
+      return -1;
+  return off / BSIZE;
+}
+
+// Turn dp, a linear directory of one full block, into an
+// indexed one: the rest of block 0 and the blocks up to
+// DIRLEAF0 become the index, and the entries move to block
+// DIRLEAF0, the only leaf.
+static int
+dirindex(struct inode *dp)
+{
+  struct dirent de;
+  uint n = BSIZE / sizeof(de);
+
+  for(int b = 1; b <= DIRLEAF0; b++)
+    if(dirgrow(dp) != b)
+      return -1;
+  for(uint rec = n; rec < DIRLEAF0 * n; rec++)
+    if(dirindexrec(dp, rec, DIRSLOT(DIRLEAF0, 0)) < 0)
+      return -1;
+
+  for(uint i = 2; i < n; i++){
+    if(readi(dp, 0, (uint64)&de, i * sizeof(de), sizeof(de)) != sizeof(de))
+      panic("dirindex read");
+    if(writei(dp, 0, (uint64)&de, DIRLEAF0 * BSIZE + i * sizeof(de), sizeof(de)) != sizeof(de))
+      return -1;
+    if(dirindexrec(dp, i, DIRSLOT(DIRLEAF0, 0)) < 0)
+      return -1;
+  }
+
+  dp->major = DIR_INDEXED;
+  iupdate(dp);
+  dcache_purge(dp);
   return 0;
 }
 
+// Split the leaf that index slot s of dp maps to, whose slot
+// value is v: the entries whose next hash bit is set move to a
+// new leaf, which takes over the upper half of the leaf's slots.
+static int
+dirsplit(struct inode *dp, uint s, uint v)
+{
+  struct dirent de, zero;
+  uint leaf = DIRSLOT_LEAF(v), d = DIRSLOT_DEPTH(v);
+  uint span = NDIRSLOT >> d, base = s & ~(span - 1);
+  int nleaf;
+  uint off, noff;
+
+  if((nleaf = dirgrow(dp)) < 0)
+    return -1;
+
+  memset(&zero, 0, sizeof(zero));
+  noff = nleaf * BSIZE;
+  for(off = leaf * BSIZE; off < (leaf + 1) * BSIZE; off += sizeof(de)){
+    if(readi(dp, 0, (uint64)&de, off, sizeof(de)) != sizeof(de))
+      panic("dirsplit read");
+    if(de.inum == 0 || dirhash(de.name) < base + span / 2)
+      continue;
+    if(writei(dp, 0, (uint64)&de, noff, sizeof(de)) != sizeof(de) ||
+       writei(dp, 0, (uint64)&zero, off, sizeof(zero)) != sizeof(zero))
+      return -1;
+    dcache_enter(dp, de.name, de.inum, noff);
+    noff += sizeof(de);
+  }
+
+  for(uint i = base; i < base + span; i++)
+    if(setdirslot(dp, i, DIRSLOT(i < base + span / 2 ? leaf : nleaf, d + 1)) < 0)
+      return -1;
+  return 0;
+}
+
+// Find a free entry for name in dp, splitting its leaf if it
+// is full. Splits at most once, to keep within the blocks a
+// transaction may write. Returns its offset, or -1 if name's
+// leaf is still full, or on failure.
+static int
+dirindexfree(struct inode *dp, char *name)
+{
+  uint s = dirhash(name);
+
+  for(int split = 0; ; split++){
+    uint v = dirslot(dp, s);
+    uint leaf = DIRSLOT_LEAF(v);
+    uint off = dirfree(dp, leaf * BSIZE, (leaf + 1) * BSIZE);
+
+    if(off < (leaf + 1) * BSIZE)
+      return off;
+    if(split || DIRSLOT_DEPTH(v) == DIRINDEXBITS || dirsplit(dp, s, v) < 0)
+      return -1;
+  }
+}
+
+// Look for a directory entry in a directory.
+// If found, set *poff to byte offset of entry.
+// Caller must hold dp->lock.
+struct inode*
+dirlookup(struct inode *dp, char *name, uint *poff)
+{
+  uint off, inum;
+
+  if(dp->type != T_DIR)
+    panic("dirlookup not DIR");
+
+  if(dcache_lookup(dp, name, &inum, &off)){
+    if(inum == 0)
+      return 0;
+    if(poff)
+      *poff = off;
+    return iget(dp->dev, inum);
+  }
+
+  if(dp->major != DIR_INDEXED){
+    inum = dirscan(dp, name, 0, dp->size, &off);
+  } else if(isdotname(name)){
+    inum = dirscan(dp, name, 0, 2 * sizeof(struct dirent), &off);
+  } else {
+    uint leaf = DIRSLOT_LEAF(dirslot(dp, dirhash(name)));
+    inum = dirscan(dp, name, leaf * BSIZE, (leaf + 1) * BSIZE, &off);
+  }
+
+  if(inum == 0){
+    dcache_enter(dp, name, 0, 0);
+    return 0;
+  }
+  if(poff)
+    *poff = off;
+  dcache_enter(dp, name, inum, off);
+  return iget(dp->dev, inum);
+}
+
 // Write a new directory entry (name, inum) into the directory dp.
 // Returns 0 on success, -1 on failure (e.g. out of disk blocks).
 int
@@ -634,21 +1824,88 @@ dirlink(struct inode *dp, char *name, uint inum)
   }
 
   // Look for an empty dirent.
-  for(off = 0; off < dp->size; off += sizeof(de)){
-    if(readi(dp, 0, (uint64)&de, off, sizeof(de)) != sizeof(de))
-      panic("dirlink read");
-    if(de.inum == 0)
-      break;
+  off = -1;
+  if(dp->major != DIR_INDEXED && dp->size == BSIZE && (SB(dp->dev).flags & FS_DIRINDEX) &&
+     !isdotname(name) && dirfree(dp, 0, BSIZE) == BSIZE){
+    if(dirindex(dp) < 0)
+      return -1;
   }
+  if(dp->major == DIR_INDEXED && (off = dirindexfree(dp, name)) < 0){
+    // the leaf is full of names that hash alike; go back to
+    // a plain list of entries, which the index records join
+    // as free ones.
+    dp->major = 0;
+    iupdate(dp);
+  }
+  if(off < 0)
+    off = dirfree(dp, 0, dp->size);
 
   strncpy(de.name, name, DIRSIZ);
   de.inum = inum;
-  if(writei(dp, 0, (uint64)&de, off, sizeof(de)) != sizeof(de))
+  if(writei(dp, 0, (uint64)&de, off, sizeof(de)) != sizeof(de)){
+    // the entry may be partly written.
+    dcache_forget(dp, name);
     return -1;
+  }
+  dcache_enter(dp, name, inum, off);
 
   return 0;
 }
 
+// Copy up to n entries of directory dp, starting at byte offset
+// *off, into d, with only their inode numbers and names set, and
+// move *off past them. If ips is not 0, also get a reference to
+// each entry's inode in ips, which keeps it from being freed once
+// dp is unlocked. Returns the number of entries copied.
+// Caller must hold dp's lock.
+int
+dirlist(struct inode *dp, uint *off, struct dent *d, struct inode **ips, int n)
+{
+  struct dirent de;
+  int i = 0;
+
+  while(i < n && *off + sizeof(de) <= dp->size){
+    if(readi(dp, 0, (uint64)&de, *off, sizeof(de)) != sizeof(de))
+      panic("dirlist read");
+    *off += sizeof(de);
+    if(de.inum == 0)
+      continue;
+    memset(&d[i], 0, sizeof(d[i]));
+    d[i].ino = de.inum;
+    memmove(d[i].name, de.name, DIRSIZ);
+    if(ips)
+      ips[i] = iget(dp->dev, de.inum);
+    i++;
+  }
+  return i;
+}
+
+// Fill in the inode number, type and size of entry d of directory
+// dp from ip, the reference dirlist() got for it, as stat() of the
+// entry's path would see them, and put ip. dp need not be locked.
+// Must be called inside a transaction, in case ip was unlinked.
+void
+dirstat(struct inode *dp, struct dent *d, struct inode *ip)
+{
+  struct inode *mp;
+
+  if(namecmp(d->name, "..") == 0 && dp->inum == ROOTINO && (mp = mountpoint[dp->dev])){
+    // as in namex().
+    iput(ip);
+    ilock(mp);
+    ip = dirlookup(mp, "..", 0);
+    iunlock(mp);
+    if(ip == 0)
+      return;
+  }
+  ip = mountcross(ip);
+  ilock(ip);
+  d->ino = ip->inum;
+  d->type = ip->type;
+  d->size = ip->size;
+  iunlockput(ip);
+}
+
 // Paths
 
 // Copy the next path element from path into name.
@@ -713,12 +1970,19 @@ namex(char *path, int nameiparent, char *name)
       iunlock(ip);
       return ip;
     }
+    if(namecmp(name, "..") == 0 && ip->inum == ROOTINO && mountpoint[ip->dev]){
+      // ".." of a mounted file system's root is the one
+      // of the directory it is mounted on.
+      iunlockput(ip);
+      ip = idup(mountpoint[ip->dev]);
+      ilock(ip);
+    }
     if((next = dirlookup(ip, name, 0)) == 0){
       iunlockput(ip);
       return 0;
     }
     iunlockput(ip);
-    ip = next;
+    ip = mountcross(next);
   }
   if(nameiparent){
     iput(ip);
@@ -739,3 +2003,117 @@ nameiparent(char *path, char *name)
 {
   return namex(path, 1, name);
 }
+
+// The in-memory file system.
+//
+// The file system on TMPDEV lives in the RAM disk, formatted
+// afresh at every boot, and is mounted on /tmp if the root file
+// system has such a directory. log_write() writes its blocks
+// straight through to the RAM disk, so nothing on it is logged,
+// and nothing reaches a real disk.
+
+// Make an empty file system on the RAM disk, which starts out
+// zeroed, laid out as mkfs would, but with no log.
+static void
+tmpfsformat(void)
+{
+  uint ninodes = TMPFSSIZE / 8;
+  uint ninodeblocks = ninodes / IPB + 1;
+  uint nbitmap = TMPFSSIZE / BPB + 1;
+  uint nmeta = 2 + ninodeblocks + nbitmap;
+  struct superblock *tsb;
+  struct dinode *dip;
+  struct dirent *de;
+  struct buf *bp;
+
+  bp = bgrab(TMPDEV, 1);
+  memset(bp->data, 0, BSIZE);
+  tsb = (struct superblock*)bp->data;
+  tsb->magic = FSMAGIC;
+  tsb->size = TMPFSSIZE;
+  tsb->nblocks = TMPFSSIZE - nmeta;
+  tsb->ninodes = ninodes;
+  tsb->nlog = 0;
+  tsb->logstart = 2;
+  tsb->inodestart = 2;
+  tsb->bmapstart = 2 + ninodeblocks;
+  tsb->flags = FS_EXTENTS | FS_DIRINDEX;
+  bwrite(bp);
+  brelse(bp);
+
+  // the metadata blocks, and the root directory's block after
+  // them, are in use.
+  bp = bgrab(TMPDEV, tsb->bmapstart);
+  memset(bp->data, 0, BSIZE);
+  for(uint b = 0; b <= nmeta; b++)
+    bp->data[b/8] |= 1 << (b % 8);
+  bwrite(bp);
+  brelse(bp);
+
+  bp = bgrab(TMPDEV, 2 + ROOTINO / IPB);
+  memset(bp->data, 0, BSIZE);
+  dip = (struct dinode*)bp->data + ROOTINO % IPB;
+  dip->type = T_DIR;
+  dip->nlink = 1;
+  dip->size = 2 * sizeof(struct dirent);
+  dip->extents[0].start = nmeta;
+  dip->extents[0].len = 1;
+  bwrite(bp);
+  brelse(bp);
+
+  bp = bgrab(TMPDEV, nmeta);
+  memset(bp->data, 0, BSIZE);
+  de = (struct dirent*)bp->data;
+  de[0].inum = ROOTINO;
+  safestrcpy(de[0].name, ".", DIRSIZ);
+  de[1].inum = ROOTINO;
+  safestrcpy(de[1].name, "..", DIRSIZ);
+  bwrite(bp);
+  brelse(bp);
+}
+
+static void
+tmpfsinit(void)
+{
+  struct inode *ip;
+
+  tmpfsformat();
+  readsb(TMPDEV, &SB(TMPDEV));
+  fsallocinit(TMPDEV);
+
+  begin_op();
+  if((ip = namei("/tmp")) != 0){
+    ilock(ip);
+    if(ip->type == T_DIR && ip->dev == ROOTDEV){
+      mountpoint[TMPDEV] = ip;
+      iunlock(ip);
+    } else {
+      iunlockput(ip);
+    }
+  }
+  end_op();
+}
+
+// If ip is a directory that a file system is mounted on,
+// put it, and return that file system's root instead.
+static struct inode*
+mountcross(struct inode *ip)
+{
+  for(int dev = 0; dev < NFSDEV; dev++){
+    if(mountpoint[dev] == ip){
+      iput(ip);
+      return iget(dev, ROOTINO);
+    }
+  }
+  return ip;
+}
+
+// Is a file system mounted on ip?
+int
+ismountpoint(struct inode *ip)
+{
+  for(int dev = 0; dev < NFSDEV; dev++)
+    if(mountpoint[dev] == ip)
+      return 1;
+  return 0;
+}
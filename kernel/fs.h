@@ -20,15 +20,35 @@ struct superblock {
   uint logstart;     // Block number of first log block
   uint inodestart;   // Block number of first inode block
   uint bmapstart;    // Block number of first free map block
+  uint flags;        // FS_* flags
+  uint swapstart;    // Block number of first swap block, after the file system
+  uint nswap;        // Number of swap blocks; 0 if none
 };
 
 #define FSMAGIC 0x10203040
 
+#define FS_EXTENTS  0x1 // files map their blocks with extents, not block addresses
+#define FS_DIRINDEX 0x2 // directories that outgrow one block become indexed
+
 #define NDIRECT         (11)
 #define NINDIRECT       (BSIZE / sizeof(uint))
 #define NDOUBLEINDIRECT (NINDIRECT * NINDIRECT)
 #define MAXFILE         (NDIRECT + NINDIRECT + NDOUBLEINDIRECT)
 
+// A run of len blocks from block start on. A file's extents map its
+// blocks in order, from block 0 on, and an extent with len 0 ends them.
+struct extent {
+  uint start;
+  uint len;
+};
+
+#define NEXTENT    6                               // extents in the inode
+#define NEXTBLOCK  (BSIZE / sizeof(struct extent)) // extents in the extent block
+
+// A symbolic link whose target is at most this long keeps it in
+// place of its block map, and has no blocks.
+#define NFASTLINK  (sizeof(uint) * (NDIRECT + 2))
+
 // On-disk inode structure
 struct dinode {
   short type;               // File type
@@ -36,7 +56,13 @@ struct dinode {
   short minor;              // Minor device number (T_DEVICE only)
   short nlink;              // Number of links to inode in file system
   uint  size;               // Size of file (bytes)
-  uint  addrs[NDIRECT + 2]; // Data block addresses
+  union {
+    uint addrs[NDIRECT + 2]; // Data block addresses
+    struct {                 // or, with FS_EXTENTS,
+      struct extent extents[NEXTENT];
+      uint          extblock; // block holding extents after the first NEXTENT
+    };
+  };
 };
 
 // Inodes per block.
@@ -59,3 +85,18 @@ struct dirent {
   char name[DIRSIZ];
 };
 
+// An indexed directory has DIR_INDEXED in its major. Its first
+// blocks hold "." and ".." and then dirindex records, which look like
+// free entries to anyone reading the directory as a list of dirents.
+// Their slots map the top DIRINDEXBITS bits of a name's hash to the
+// leaf block that holds the entry, and the number of those bits that
+// all names in the leaf share. The leaves follow.
+#define DIR_INDEXED     1
+#define DIRINDEXBITS    10
+#define NDIRSLOT        (1 << DIRINDEXBITS)
+#define DIRSLOTS        7
+
+struct dirindex {
+  ushort zero;             // where a dirent has its inum
+  ushort slot[DIRSLOTS];   // leaf block | depth << 12
+};
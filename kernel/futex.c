@@ -0,0 +1,121 @@
+// Futexes: user-space words that threads can sleep on.
+//
+// A thread that finds a lock taken calls futex_wait(addr, val), which sleeps as long as the word at
+// addr still holds val, and the thread that releases it calls futex_wake(addr, n). Neither is
+// needed while a lock is uncontended, so that case never enters the kernel.
+//
+// A sleeping thread is keyed by the physical address of its word, not the virtual one, so that
+// processes that map the same page at different addresses, such as a MAP_SHARED file, find each
+// other. The word's page is copied first if it is copy-on-write, so that a forked child and its
+// parent don't share a key for words that are about to become private to each of them.
+//
+// Each key hashes to one of NFUTEX locks. futex_wait() checks the word and goes to sleep under it,
+// and futex_wake() takes it before waking, so a wake that follows a change to the word can't slip
+// in between the check and the sleep.
+
+#include "types.h"
+#include "param.h"
+#include "memlayout.h"
+#include "riscv.h"
+#include "spinlock.h"
+#include "proc.h"
+#include "defs.h"
+
+#define NFUTEX 61
+
+static struct spinlock futex_lock[NFUTEX];
+
+void
+futexinit(void)
+{
+  for (int i = 0; i < NFUTEX; i++) {
+    initlock(&futex_lock[i], "futex");
+  }
+}
+
+static inline struct spinlock *
+futexlockof(uint64 pa)
+{
+  return &futex_lock[(pa / sizeof(int)) % NFUTEX];
+}
+
+// Return the physical address of the futex word at user address addr in p, faulting its page in
+// and copying it if it's copy-on-write. Returns 0 if addr isn't an aligned, writable word.
+static uint64
+futexaddr(struct proc *p, uint64 addr)
+{
+  uint64 va = PGROUNDDOWN(addr);
+
+  if (addr % sizeof(int) != 0 || va >= MAXVA) {
+    return 0;
+  }
+
+  pte_t *pte = uvmwalkcow(p->pagetable, va, 0);
+
+  if ((pte == 0 || (*pte & PTE_V) == 0) && uvmlazy(p->pagetable, va, 1) > 0) {
+    pte = uvmwalkcow(p->pagetable, va, 0);
+  }
+
+  if (pte == 0 || (*pte & (PTE_V | PTE_U | PTE_W)) != (PTE_V | PTE_U | PTE_W)) {
+    return 0;
+  }
+
+  uint64 pa = PTE2PA(*pte);
+
+  if (*pte & PTE_MEGA) {
+    pa += va & (MEGAPGSIZE - 1);
+  }
+
+  return pa + (addr - va);
+}
+
+// Sleep until futex_wake() is called for addr, if the word there holds val. Returns 0 when woken,
+// which may also happen for no reason, so the caller must check the word again, or -1 if the word
+// didn't hold val, addr is bad, or p was killed.
+int
+futex_wait(uint64 addr, int val)
+{
+  struct proc *p = myproc();
+  uint64 pa      = futexaddr(p, addr);
+
+  if (pa == 0) {
+    return -1;
+  }
+
+  struct spinlock *lk = futexlockof(pa);
+
+  acquire(lk);
+
+  if (__atomic_load_n((int *)pa, __ATOMIC_SEQ_CST) != val || killed(p)) {
+    release(lk);
+    return -1;
+  }
+
+  sleep((void *)pa, lk);
+  release(lk);
+
+  return killed(p) ? -1 : 0;
+}
+
+// Wake at most n of the threads sleeping in futex_wait() on addr. Returns how many were woken, or
+// -1 if addr is bad.
+int
+futex_wake(uint64 addr, int n)
+{
+  uint64 pa = futexaddr(myproc(), addr);
+
+  if (pa == 0 || n < 0) {
+    return -1;
+  }
+
+  struct spinlock *lk = futexlockof(pa);
+
+  // a waiter that has checked the word is asleep by the time this gets the lock
+  acquire(lk);
+
+  int woken = wakeupn((void *)pa, n);
+
+  release(lk);
+
+  return woken;
+}
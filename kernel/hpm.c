@@ -0,0 +1,128 @@
+// Hardware performance counters for user processes.
+//
+// A process reads nothing but its own registers in user mode until ucounters(mask) lets it read
+// the counters in mask directly with rdcycle, rdtime, rdinstret and csrr hpmcounterN: bit 0 is
+// cycle, bit 1 time, bit 2 instret and bit n hpmcounter n. The mask goes into scounteren whenever
+// the process is switched to, is inherited by fork(), and survives exec().
+//
+// hpmevent(n, event) has hpmcounter n, for n from 3 to HPMLAST, count event, which is platform
+// specific, or nothing if event is 0, on every CPU. Only machine mode can write the mhpmevent
+// CSRs, so each CPU asks timervec in kernelvec.S to, with an ecall, the next time its scheduler
+// switches to a process after a change. hpmread(n) reads counter n, for n from 0 to HPMLAST, on
+// the CPU it runs on. The counters are per-CPU, so a process measuring itself should keep to one
+// CPU with sched_setaffinity().
+
+#include "types.h"
+#include "param.h"
+#include "memlayout.h"
+#include "riscv.h"
+#include "spinlock.h"
+#include "proc.h"
+#include "defs.h"
+
+#define HPMFIRST 3
+#define HPMLAST  6
+#define NHPM     (HPMLAST - HPMFIRST + 1)
+
+static struct {
+  struct spinlock lock;
+  uint64          event[NHPM];  // what each counter counts, 0 for nothing
+  uint            gen;          // changes to event, so far
+} hpm;
+
+static uint hpmgen[NCPU];       // hpm.gen each CPU last programmed its counters for
+
+void
+hpminit(void)
+{
+  initlock(&hpm.lock, "hpm");
+}
+
+// Ask machine mode to make this CPU's counter n count event, from 0.
+static void
+mhpmevent(int n, uint64 event)
+{
+  register uint64 a1 asm("a1") = n;
+  register uint64 a2 asm("a2") = event;
+
+  asm volatile("ecall" : : "r"(a1), "r"(a2) : "memory");
+}
+
+// Set up this CPU's counters for p, which it is about to switch to. Interrupts must be off.
+void
+hpmswitch(struct proc *p)
+{
+  int id = cpuid();
+
+  w_scounteren(p->counteren);
+
+  if (hpmgen[id] == __atomic_load_n(&hpm.gen, __ATOMIC_ACQUIRE)) {
+    return;
+  }
+
+  acquire(&hpm.lock);
+  for (int i = 0; i < NHPM; i++) {
+    mhpmevent(HPMFIRST + i, hpm.event[i]);
+  }
+  hpmgen[id] = hpm.gen;
+  release(&hpm.lock);
+}
+
+// Let the calling process read the counters in mask from user mode. Returns the previous mask.
+int
+ucounters(int mask)
+{
+  struct proc *p = myproc();
+  int old;
+
+  mask &= (1 << (HPMLAST + 1)) - 1;
+
+  push_off();
+  old = p->counteren;
+  p->counteren = mask;
+  w_scounteren(mask);
+  pop_off();
+
+  return old;
+}
+
+// Have counter n count event on every CPU. Returns 0, or -1 if there's no counter n.
+int
+hpmevent(int n, uint64 event)
+{
+  if (n < HPMFIRST || n > HPMLAST) {
+    return -1;
+  }
+
+  acquire(&hpm.lock);
+  hpm.event[n - HPMFIRST] = event;
+  __atomic_fetch_add(&hpm.gen, 1, __ATOMIC_RELEASE);
+  release(&hpm.lock);
+
+  // this CPU is about to be back in user mode, so set its counters up now.
+  push_off();
+  hpmswitch(myproc());
+  pop_off();
+
+  return 0;
+}
+
+// Read counter n on this CPU, or return -1 if there's no counter n.
+uint64
+hpmread(int n)
+{
+  uint64 x;
+
+  switch (n) {
+  case 0:  asm volatile("csrr %0, cycle" : "=r"(x)); break;
+  case 1:  asm volatile("csrr %0, time" : "=r"(x)); break;
+  case 2:  asm volatile("csrr %0, instret" : "=r"(x)); break;
+  case 3:  asm volatile("csrr %0, hpmcounter3" : "=r"(x)); break;
+  case 4:  asm volatile("csrr %0, hpmcounter4" : "=r"(x)); break;
+  case 5:  asm volatile("csrr %0, hpmcounter5" : "=r"(x)); break;
+  case 6:  asm volatile("csrr %0, hpmcounter6" : "=r"(x)); break;
+  default: x = -1; break;
+  }
+
+  return x;
+}
@@ -1,6 +1,19 @@
 // Physical memory allocator, for user processes,
 // kernel stacks, page-table pages,
-// and pipe buffers. Allocates whole 4096-byte pages.
+// and pipe buffers. Allocates whole 4096-byte pages,
+// or physically contiguous blocks of 2^order pages.
+//
+// All free memory belongs to a buddy allocator. Each CPU keeps a freelist of single pages that it
+// refills from (and spills back to) the buddy allocator in batches, so kalloc() and kfree() only
+// touch the buddy allocator's lock every KMEM_BATCH pages or so.
+//
+// Each CPU also keeps a pool of pages that its scheduler zeroes while it has nothing else to run,
+// so that kalloc_zeroed() can usually hand out a page without filling it first. Freed pages are
+// only filled with junk when the kernel is built with KALLOC_JUNK.
+//
+// Metadata for each allocatable page lives in a struct page array (see page.h), which kinit() puts
+// at the start of free memory. Use pa2page() and page2pa() to convert between the two. The other
+// CPUs help kinit() initialize it, through kinit_help(), while they wait for CPU 0 to boot.
 
 #include "types.h"
 #include "param.h"
@@ -8,8 +21,10 @@
 #include "spinlock.h"
 #include "riscv.h"
 #include "defs.h"
+#include "page.h"
 
 void kunchecked_free(uint cpu_core, void *pa);
+static void kinit_pages(void);
 
 extern char end[]; // first address after kernel.
                    // defined by kernel.ld.
@@ -22,9 +37,210 @@ struct cpu_mem {
   struct spinlock lock;
   struct run *freelist;
   uint64 free_count;
+  struct run *zeroed; // pages that are all zeros, apart from the next pointer in the first word
+  uint64 zeroed_count;
 } kmem[NCPU] = {};
 
-uint page_refcounts[PHYSTOP / PGSIZE] = {};
+// Allocator event counters, one cache line per CPU. Each CPU only updates its own, with interrupts
+// off, so they need no locks; readers may see slightly stale values.
+struct kmem_stats {
+  uint64 alloc;     // pages handed out
+  uint64 miss;      // kalloc() calls that found this CPU's freelist empty
+  uint64 free;      // pages freed
+  uint64 steal;     // pages stolen from other CPUs' freelists
+  uint64 cow_copy;  // kcopyonwrite() calls that had to copy the page
+  uint64 cow_reuse; // kcopyonwrite() calls that reused the page, having the last reference
+  uint64 fail;      // allocations that failed for lack of memory
+} __attribute__((aligned(64))) kstats[NCPU];
+
+// Add n to this CPU's counter for the given event.
+#define KSTAT_ADD(event, n)       \
+  do {                            \
+    push_off();                   \
+    kstats[cpuid()].event += (n); \
+    pop_off();                    \
+  } while (0)
+
+// One struct page for every page from mem_start up to PHYSTOP.
+static struct page *pages;
+static uint64 mem_start;
+static uint64 npages;
+
+// The most pages kalloc() will move from another CPU's freelist in a single steal.
+#define KMEM_STEAL_BATCH 64
+
+// The number of pages moved between a CPU's freelist and the buddy allocator at a time.
+#define KMEM_BATCH 64
+
+// A CPU gives KMEM_BATCH pages back to the buddy allocator once its freelist grows past this many
+// pages, so that freed memory can coalesce into contiguous blocks again.
+#define KMEM_HIGH (4 * KMEM_BATCH)
+
+// kinit() initializes the page array in chunks of this many entries, which CPUs claim one at a time.
+#define KINIT_CHUNK 4096
+
+static struct {
+  uint64 nchunks;  // chunks in the page array; 0 until kinit() has carved it out
+  uint64 next;     // the next chunk to claim
+  uint64 done;     // chunks initialized
+} kinit_work;
+
+// An idle CPU zeroes pages until its zeroed pool holds this many, KMEM_ZERO_BATCH pages at a time.
+#define KMEM_ZEROED_TARGET 64
+#define KMEM_ZERO_BATCH    8
+
+// A free block of 2^order pages, stored in the first page of the block itself.
+struct free_block {
+  struct free_block *next;
+  struct free_block *prev;
+};
+
+struct {
+  struct spinlock lock;
+
+  // Circular lists of free blocks, one per order. Each head is a sentinel.
+  struct free_block free_lists[KMAXORDER + 1];
+
+  // The number of free pages across all of the lists.
+  uint64 free_pages;
+} buddy;
+
+// Return the metadata for the allocatable page containing pa.
+struct page *
+pa2page(uint64 pa)
+{
+  if (pa < mem_start || pa >= PHYSTOP) {
+    panic("pa2page");
+  }
+
+  return &pages[(pa - mem_start) / PGSIZE];
+}
+
+uint64
+page2pa(struct page *pg)
+{
+  return mem_start + (uint64)(pg - pages) * PGSIZE;
+}
+
+// Whether pa is the start of a free buddy block of the given order.
+static int
+buddy_is_free(uint64 pa, int order)
+{
+  if (pa < mem_start || pa >= PHYSTOP) {
+    return 0;
+  }
+
+  struct page *pg = pa2page(pa);
+
+  return (pg->flags & PG_BUDDY) && pg->order == order;
+}
+
+static void
+list_init(struct free_block *head)
+{
+  head->next = head;
+  head->prev = head;
+}
+
+static int
+list_empty(struct free_block *head)
+{
+  return head->next == head;
+}
+
+static void
+list_push(struct free_block *head, struct free_block *b)
+{
+  b->next          = head->next;
+  b->prev          = head;
+  head->next->prev = b;
+  head->next       = b;
+}
+
+static void
+list_remove(struct free_block *b)
+{
+  b->prev->next = b->next;
+  b->next->prev = b->prev;
+}
+
+// Return the 2^order page block at pa to the buddy allocator, merging it with its buddy for as long
+// as the buddy is also free. Block addresses are aligned relative to KERNBASE, which is itself
+// aligned to the largest block size, so blocks are physically aligned too. Caller must hold
+// buddy.lock.
+static void
+buddy_free(void *pa, int order)
+{
+  uint64 block = (uint64)pa;
+
+  buddy.free_pages += 1 << order;
+
+  while (order < KMAXORDER) {
+    uint64 buddy_block = KERNBASE + ((block - KERNBASE) ^ ((uint64)PGSIZE << order));
+
+    if (buddy_block + ((uint64)PGSIZE << order) > PHYSTOP) {
+      break;
+    }
+
+    if (!buddy_is_free(buddy_block, order)) {
+      break;
+    }
+
+    // the buddy is free too, so take it off its list and merge the two into one larger block
+    list_remove((struct free_block *)buddy_block);
+    pa2page(buddy_block)->flags &= ~PG_BUDDY;
+
+    if (buddy_block < block) {
+      block = buddy_block;
+    }
+
+    order++;
+  }
+
+  struct page *pg = pa2page(block);
+
+  pg->flags |= PG_BUDDY;
+  pg->order  = order;
+  list_push(&buddy.free_lists[order], (struct free_block *)block);
+}
+
+// Allocate a block of 2^order pages, splitting a larger block if there isn't one of the right
+// size. Returns 0 if no block is large enough. Caller must hold buddy.lock.
+static void *
+buddy_alloc(int order)
+{
+  int k = order;
+
+  while (k <= KMAXORDER && list_empty(&buddy.free_lists[k])) {
+    k++;
+  }
+
+  if (k > KMAXORDER) {
+    return 0;
+  }
+
+  struct free_block *b = buddy.free_lists[k].next;
+
+  list_remove(b);
+  pa2page((uint64)b)->flags &= ~PG_BUDDY;
+
+  // give the upper half back at each level until the block is the requested size
+  while (k > order) {
+    k--;
+
+    struct free_block *upper = (struct free_block *)((uint64)b + ((uint64)PGSIZE << k));
+
+    struct page *pg = pa2page((uint64)upper);
+
+    pg->flags |= PG_BUDDY;
+    pg->order  = k;
+    list_push(&buddy.free_lists[k], upper);
+  }
+
+  buddy.free_pages -= 1 << order;
+
+  return b;
+}
 
 void
 kinit()
@@ -36,12 +252,95 @@ kinit()
     initlock(&kmem[i].lock, lock_name);
   }
 
-  for (uint64 p = PGROUNDUP((uint64)end); p + PGSIZE <= PHYSTOP; p += PGSIZE) {
-    // for simplicity's sake, give all free pages to the first CPU
-    kunchecked_free(0, (void *)p);
+  initlock(&buddy.lock, "kmem_buddy");
+
+  for (int i = 0; i <= KMAXORDER; i++) {
+    list_init(&buddy.free_lists[i]);
+  }
+
+  // Carve the page array out of the start of free memory. It only needs to describe the pages
+  // after itself, so shrink the count until both fit.
+  uint64 start = PGROUNDUP((uint64)end);
+
+  npages = (PHYSTOP - start) / PGSIZE;
+
+  while (start + PGROUNDUP(npages * sizeof(struct page)) + npages * PGSIZE > PHYSTOP) {
+    npages--;
+  }
+
+  pages     = (struct page *)start;
+  mem_start = start + PGROUNDUP(npages * sizeof(struct page));
+
+  // let the other CPUs at the page array, and wait for every chunk of it to be done.
+  __atomic_store_n(&kinit_work.nchunks, (npages + KINIT_CHUNK - 1) / KINIT_CHUNK, __ATOMIC_RELEASE);
+  kinit_pages();
+
+  while (__atomic_load_n(&kinit_work.done, __ATOMIC_ACQUIRE) < kinit_work.nchunks)
+    ;
+
+  // Hand all free memory to the buddy allocator as the largest aligned blocks it splits into, which
+  // is what freeing it a page at a time would coalesce into, without the merging. The per-CPU
+  // freelists start out empty and fill up on their first allocations.
+  acquire(&buddy.lock);
+
+  for (uint64 p = mem_start; p + PGSIZE <= PHYSTOP;) {
+    int order = 0;
+
+    while (order < KMAXORDER && ((p - KERNBASE) & (((uint64)PGSIZE << (order + 1)) - 1)) == 0 &&
+           p + ((uint64)PGSIZE << (order + 1)) <= PHYSTOP) {
+      order++;
+    }
+
+    struct page *pg = pa2page(p);
+
+    pg->flags |= PG_BUDDY;
+    pg->order  = order;
+    list_push(&buddy.free_lists[order], (struct free_block *)p);
+    buddy.free_pages += 1 << order;
+
+    p += (uint64)PGSIZE << order;
+  }
+
+  release(&buddy.lock);
+}
+
+// Initialize chunks of the page array until none are left to claim.
+static void
+kinit_pages(void)
+{
+  uint64 c;
+
+  while ((c = __atomic_fetch_add(&kinit_work.next, 1, __ATOMIC_RELAXED)) < kinit_work.nchunks) {
+    uint64 last = (c + 1) * KINIT_CHUNK;
+
+    if (last > npages) {
+      last = npages;
+    }
+
+    for (uint64 i = c * KINIT_CHUNK; i < last; i++) {
+      pages[i].refcount = 0;
+      pages[i].owner    = 0;
+      pages[i].order    = 0;
+      pages[i].flags    = 0;
+      pages[i].lru_next = PG_NONE;
+      pages[i].lru_prev = PG_NONE;
+    }
+
+    __atomic_fetch_add(&kinit_work.done, 1, __ATOMIC_RELEASE);
   }
 }
 
+// Called by the CPUs other than 0 as they start, to help kinit() initialize the page array.
+// Returns once there's nothing left to claim, whether or not kinit() has finished.
+void
+kinit_help(void)
+{
+  while (__atomic_load_n(&kinit_work.nchunks, __ATOMIC_ACQUIRE) == 0)
+    ;
+
+  kinit_pages();
+}
+
 // An "unchecked" free. It won't check alignment or refcounts, nor will it wipe the memory.
 void
 kunchecked_free(uint cpu_core, void *pa)
@@ -53,6 +352,8 @@ kunchecked_free(uint cpu_core, void *pa)
 
   acquire(&cpu_mem->lock);
 
+  pa2page((uint64)pa)->owner = cpu_core;
+
   r->next = cpu_mem->freelist;
 
   cpu_mem->freelist = r;
@@ -61,34 +362,226 @@ kunchecked_free(uint cpu_core, void *pa)
   release(&cpu_mem->lock);
 }
 
+// Detach up to n pages from the front of the given CPU's freelist, or its zeroed pool if zeroed is
+// set, returning them as a chain.
+static struct run *
+kdetach(int cpu_core, uint64 n, int zeroed)
+{
+  struct cpu_mem *cpu_mem = &kmem[cpu_core];
+
+  acquire(&cpu_mem->lock);
+
+  struct run **list = zeroed ? &cpu_mem->zeroed : &cpu_mem->freelist;
+  uint64 *count     = zeroed ? &cpu_mem->zeroed_count : &cpu_mem->free_count;
+
+  if (n > *count) {
+    n = *count;
+  }
+
+  struct run *head = *list;
+  struct run *tail = head;
+
+  for (uint64 i = 1; i < n; i++) {
+    tail = tail->next;
+  }
+
+  if (n > 0) {
+    *list      = tail->next;
+    tail->next = 0;
+  } else {
+    head = 0;
+  }
+
+  *count -= n;
+
+  release(&cpu_mem->lock);
+
+  return head;
+}
+
+// Return a chain of pages to the buddy allocator.
+static void
+kgiveback(struct run *chain)
+{
+  acquire(&buddy.lock);
+
+  while (chain) {
+    struct run *next = chain->next;
+
+    buddy_free(chain, 0);
+
+    chain = next;
+  }
+
+  release(&buddy.lock);
+}
+
+// Give a batch of pages back to the buddy allocator if the given CPU's freelist has grown too long.
+static void
+kspill(int cpu_core)
+{
+  if (kmem[cpu_core].free_count <= KMEM_HIGH) {
+    return;
+  }
+
+  kgiveback(kdetach(cpu_core, KMEM_BATCH, 0));
+}
+
 // Free the page of physical memory pointed at by pa, which normally should have been returned by a
 // call to kalloc().
 void
 kfree(void *pa)
 {
-  if (((uint64)pa % PGSIZE) != 0 || (char *)pa < end || (uint64)pa >= PHYSTOP) {
+  if (((uint64)pa % PGSIZE) != 0 || (uint64)pa < mem_start || (uint64)pa >= PHYSTOP) {
     panic("kfree");
   }
 
   // Decrement the refcount, as the caller has indicated they no longer need it.
-  uint new_refcount = __sync_sub_and_fetch(&page_refcounts[(uint64)pa / PGSIZE], 1);
+  uint new_refcount = __sync_sub_and_fetch(&pa2page((uint64)pa)->refcount, 1);
 
   // Don't actually free the page, since other processes still have references to it.
   if (new_refcount > 0) {
     return;
   }
 
-  // At this point, we know we can free the page. Fill it with junk to catch any dangling references
-  // to it.
+  // At this point, we know we can free the page.
+#ifdef KALLOC_JUNK
+  // Fill it with junk to catch any dangling references to it.
   memset(pa, '\xD', PGSIZE);
+#endif
 
   push_off();
 
   kunchecked_free(cpuid(), pa);
+  kspill(cpuid());
+  kstats[cpuid()].free++;
 
   pop_off();
 }
 
+// Pop a page off of the given CPU's freelist, or its zeroed pool if zeroed is set, returning 0 if
+// it is empty.
+static struct run *
+kpop(int cpu_core, int zeroed)
+{
+  struct cpu_mem *cpu_mem = &kmem[cpu_core];
+
+  acquire(&cpu_mem->lock);
+
+  struct run **list = zeroed ? &cpu_mem->zeroed : &cpu_mem->freelist;
+  struct run *r     = *list;
+
+  if (r) {
+    *list = r->next;
+
+    if (zeroed) {
+      cpu_mem->zeroed_count--;
+    } else {
+      cpu_mem->free_count--;
+    }
+
+    struct page *pg = pa2page((uint64)r);
+
+    pg->refcount  = 1;
+    pg->flags    &= ~PG_ZEROED;
+  }
+
+  release(&cpu_mem->lock);
+
+  return r;
+}
+
+// Move a batch of single pages from the buddy allocator onto the given CPU's freelist. Returns the
+// number of pages moved.
+static uint64
+krefill(int cpu_core)
+{
+  struct run *head = 0, *tail = 0;
+  uint64 n;
+
+  acquire(&buddy.lock);
+
+  for (n = 0; n < KMEM_BATCH; n++) {
+    struct run *r = buddy_alloc(0);
+
+    if (r == 0) {
+      break;
+    }
+
+    pa2page((uint64)r)->owner = cpu_core;
+
+    r->next = head;
+    head    = r;
+
+    if (tail == 0) {
+      tail = r;
+    }
+  }
+
+  release(&buddy.lock);
+
+  if (n == 0) {
+    return 0;
+  }
+
+  struct cpu_mem *cpu_mem = &kmem[cpu_core];
+
+  acquire(&cpu_mem->lock);
+
+  tail->next           = cpu_mem->freelist;
+  cpu_mem->freelist    = head;
+  cpu_mem->free_count += n;
+
+  release(&cpu_mem->lock);
+
+  return n;
+}
+
+// Move up to half of the victim CPU's freelist (at most KMEM_STEAL_BATCH pages) onto the thief
+// CPU's freelist. Only one kmem lock is ever held at a time, so there's no lock ordering to worry
+// about. Returns the number of pages stolen.
+static uint64
+ksteal(int thief, int victim)
+{
+  uint64 n = (kmem[victim].free_count + 1) / 2;
+
+  if (n > KMEM_STEAL_BATCH) {
+    n = KMEM_STEAL_BATCH;
+  }
+
+  struct run *head = kdetach(victim, n, 0);
+
+  if (head == 0) {
+    return 0;
+  }
+
+  // count what we actually got, since the victim may have shrunk in the meantime
+  struct run *tail = head;
+
+  for (n = 1;; n++) {
+    pa2page((uint64)tail)->owner = thief;
+
+    if (tail->next == 0) {
+      break;
+    }
+
+    tail = tail->next;
+  }
+
+  // and splice the chain onto the front of the thief's freelist
+  struct cpu_mem *thief_mem = &kmem[thief];
+
+  acquire(&thief_mem->lock);
+
+  tail->next             = thief_mem->freelist;
+  thief_mem->freelist    = head;
+  thief_mem->free_count += n;
+
+  release(&thief_mem->lock);
+
+  return n;
+}
+
 // Allocate one 4096-byte page of physical memory.
 // Returns a pointer that the kernel can use.
 // Returns 0 if the memory cannot be allocated.
@@ -97,43 +590,226 @@ kalloc(void)
 {
   push_off();
 
+  int my_cpuid  = cpuid();
+  struct run *r = kpop(my_cpuid, 0);
+
+  if (r == 0) {
+    kstats[my_cpuid].miss++;
+  }
+
+  // our freelist is empty, so grab a batch from the buddy allocator
+  if (r == 0 && krefill(my_cpuid) > 0) {
+    r = kpop(my_cpuid, 0);
+  }
+
+  // the buddy allocator is empty too, so steal a batch of pages from the other CPUs in turn; a
+  // batch means the next few allocations on this CPU won't need to touch another CPU's lock at all
+  for (int i = 1; r == 0 && i < NCPU; i++) {
+    uint64 n = ksteal(my_cpuid, (my_cpuid + i) % NCPU);
+
+    if (n > 0) {
+      kstats[my_cpuid].steal += n;
+      r = kpop(my_cpuid, 0);
+    }
+  }
+
+  // as a last resort, use up the zeroed pools, starting with our own
+  for (int i = 0; r == 0 && i < NCPU; i++) {
+    r = kpop((my_cpuid + i) % NCPU, 1);
+  }
+
+  if (r) {
+    kstats[my_cpuid].alloc++;
+  } else {
+    kstats[my_cpuid].fail++;
+  }
+
+  pop_off();
+
+  if (r == 0) {
+    // no CPUs had free memory, but the page cache may hold pages that nothing maps
+    return pagecache_reclaim() > 0 ? kalloc() : 0;
+  }
+
+#ifdef KALLOC_JUNK
+  // Fill with junk.
+  memset((char *)r, 5, PGSIZE);
+#endif
+
+  return (void *)r;
+}
+
+// Allocate one 4096-byte page of physical memory that is filled with zeros. Prefer this to kalloc()
+// followed by memset(), since the page usually comes from a pool that idle CPUs zeroed ahead of
+// time. Returns 0 if the memory cannot be allocated.
+void *
+kalloc_zeroed(void)
+{
+  push_off();
+  struct run *r = kpop(cpuid(), 1);
+
+  if (r) {
+    kstats[cpuid()].alloc++;
+  }
+
+  pop_off();
+
+  if (r) {
+    // the next pointer is the only part of a pooled page that isn't zero
+    r->next = 0;
+
+    return (void *)r;
+  }
+
+  void *pa = kalloc();
+
+  if (pa) {
+    memset(pa, 0, PGSIZE);
+  }
+
+  return pa;
+}
+
+// Zero a batch of pages from this CPU's freelist and move them to its zeroed pool, unless the pool
+// is already full. Called by the scheduler when it finds nothing to run; the scheduler never
+// migrates between CPUs, so the pages are zeroed with interrupts enabled and no locks held.
+// Returns the number of pages zeroed, so the scheduler knows when it can wait for an interrupt.
+int
+kzeroidle(void)
+{
+  push_off();
   int my_cpuid = cpuid();
-  int i        = my_cpuid;
+  pop_off();
 
-  do {
-    struct cpu_mem *cpu_mem = &kmem[i];
+  struct cpu_mem *cpu_mem = &kmem[my_cpuid];
 
-    acquire(&cpu_mem->lock);
+  if (cpu_mem->zeroed_count >= KMEM_ZEROED_TARGET) {
+    return 0;
+  }
 
-    struct run *freelist = cpu_mem->freelist;
+  struct run *chain = kdetach(my_cpuid, KMEM_ZERO_BATCH, 0);
 
-    if (!freelist) {
-      release(&cpu_mem->lock);
+  if (chain == 0 && krefill(my_cpuid) > 0) {
+    chain = kdetach(my_cpuid, KMEM_ZERO_BATCH, 0);
+  }
+
+  if (chain == 0) {
+    return 0;
+  }
 
-      // try the next CPU
-      i = (i + 1 == NCPU) ? 0 : i + 1;
+  struct run *head = 0, *tail = chain;
+  uint64 n = 0;
 
-      continue;
+  while (chain) {
+    struct run *next = chain->next;
+
+    memset(chain, 0, PGSIZE);
+
+    struct page *pg = pa2page((uint64)chain);
+
+    pg->owner  = my_cpuid;
+    pg->flags |= PG_ZEROED;
+
+    chain->next = head;
+    head        = chain;
+    chain       = next;
+
+    n++;
+  }
+
+  acquire(&cpu_mem->lock);
+
+  tail->next             = cpu_mem->zeroed;
+  cpu_mem->zeroed        = head;
+  cpu_mem->zeroed_count += n;
+
+  release(&cpu_mem->lock);
+
+  return n;
+}
+
+// Allocate 2^order physically contiguous pages, aligned to their size. Every page in the block
+// starts with a refcount of one, and the block must be returned with kfree_pages() using the same
+// order. Returns 0 if the memory cannot be allocated.
+void *
+kalloc_pages(int order)
+{
+  if (order < 0 || order > KMAXORDER) {
+    panic("kalloc_pages: order");
+  }
+
+  acquire(&buddy.lock);
+  void *pa = buddy_alloc(order);
+  release(&buddy.lock);
+
+  if (pa == 0) {
+    // Pages sitting on the per-CPU freelists may be the missing halves of a large enough block, so
+    // give them all back to the buddy allocator and try again.
+    for (int i = 0; i < NCPU; i++) {
+      kgiveback(kdetach(i, kmem[i].free_count, 0));
+      kgiveback(kdetach(i, kmem[i].zeroed_count, 1));
     }
 
-    cpu_mem->freelist = freelist->next;
-    cpu_mem->free_count--;
+    acquire(&buddy.lock);
+    pa = buddy_alloc(order);
+    release(&buddy.lock);
+  }
 
-    page_refcounts[(uint64)freelist / PGSIZE] = 1;
+  if (pa == 0) {
+    KSTAT_ADD(fail, 1);
+    return 0;
+  }
 
-    release(&cpu_mem->lock);
-    pop_off();
+  KSTAT_ADD(alloc, 1 << order);
 
-    // Fill with junk.
-    memset((char *)freelist, 5, PGSIZE);
+  struct page *pg = pa2page((uint64)pa);
 
-    return (void *)freelist;
-  } while (i != my_cpuid);
+  for (uint64 i = 0; i < (1 << order); i++) {
+    pg[i].refcount = 1;
+  }
 
-  pop_off();
+#ifdef KALLOC_JUNK
+  // Fill with junk.
+  memset(pa, 5, PGSIZE << order);
+#endif
 
-  // no CPUs had free memory
-  return 0;
+  return pa;
+}
+
+// Free a block of 2^order pages returned by kalloc_pages(order). Like kfree(), the block is only
+// freed once the refcount of its first page drops to zero.
+void
+kfree_pages(void *pa, int order)
+{
+  if (order < 0 || order > KMAXORDER) {
+    panic("kfree_pages: order");
+  }
+
+  if ((((uint64)pa - KERNBASE) % ((uint64)PGSIZE << order)) != 0 || (uint64)pa < mem_start ||
+      (uint64)pa + ((uint64)PGSIZE << order) > PHYSTOP) {
+    panic("kfree_pages");
+  }
+
+  if (__sync_sub_and_fetch(&pa2page((uint64)pa)->refcount, 1) > 0) {
+    return;
+  }
+
+  struct page *pg = pa2page((uint64)pa);
+
+  for (uint64 i = 1; i < (1 << order); i++) {
+    pg[i].refcount = 0;
+  }
+
+#ifdef KALLOC_JUNK
+  // Fill with junk to catch any dangling references.
+  memset(pa, '\xD', PGSIZE << order);
+#endif
+
+  acquire(&buddy.lock);
+  buddy_free(pa, order);
+  release(&buddy.lock);
+
+  KSTAT_ADD(free, 1 << order);
 }
 
 // Makes a copy of the given page if other pagetables have a reference to it, or returns the same
@@ -141,18 +817,20 @@ kalloc(void)
 void *
 kcopyonwrite(const void *pa)
 {
-  if (((uint64)pa % PGSIZE) != 0 || (char *)pa < end || (uint64)pa >= PHYSTOP) {
+  if (((uint64)pa % PGSIZE) != 0 || (uint64)pa < mem_start || (uint64)pa >= PHYSTOP) {
     panic("kcopyonwrite");
   }
 
   // Decrement the refcount, since we'll either use this page or make a copy.
-  uint new_refcount = __sync_sub_and_fetch(&page_refcounts[(uint64)pa / PGSIZE], 1);
+  uint new_refcount = __sync_sub_and_fetch(&pa2page((uint64)pa)->refcount, 1);
 
   // If there are no more references, we can reuse the page.
   if (new_refcount == 0) {
     // This is probably safe? No one else has a reference, so why would there be a race condition
     // when setting the refcount for this page?
-    page_refcounts[(uint64)pa / PGSIZE] = 1;
+    pa2page((uint64)pa)->refcount = 1;
+
+    KSTAT_ADD(cow_reuse, 1);
 
     return (void *)pa;
   }
@@ -167,6 +845,8 @@ kcopyonwrite(const void *pa)
   // Copy the contents of the old page to the new page before returning the new page.
   memmove(new_pa, pa, PGSIZE);
 
+  KSTAT_ADD(cow_copy, 1);
+
   return new_pa;
 }
 
@@ -176,14 +856,39 @@ kgetfreemem(void)
   uint64 total = 0;
 
   for (int i = 0; i < NCPU; i++) {
-    total += kmem[i].free_count;
+    total += kmem[i].free_count + kmem[i].zeroed_count;
   }
 
+  total += buddy.free_pages;
+
   return total * 4096;
 }
 
 void
 kincrementrefcount(void *pa)
 {
-  __sync_fetch_and_add(&page_refcounts[(uint64)pa / PGSIZE], 1);
+  __sync_fetch_and_add(&pa2page((uint64)pa)->refcount, 1);
+}
+
+// Print each CPU's allocator counters into buf, for the statistics device. Returns the number of
+// bytes written.
+int
+kallocstats(char *buf, int sz)
+{
+  int n = snprintf(buf, sz, "--- kalloc per-CPU stats\n");
+
+  for (int i = 0; i < NCPU; i++) {
+    struct kmem_stats *ks = &kstats[i];
+
+    if (ks->alloc == 0 && ks->free == 0) {
+      continue;
+    }
+
+    n += snprintf(buf + n, sz - n,
+                  "cpu %d: alloc %d miss %d free %d steal %d cow-copy %d cow-reuse %d fail %d\n", i,
+                  (int)ks->alloc, (int)ks->miss, (int)ks->free, (int)ks->steal, (int)ks->cow_copy,
+                  (int)ks->cow_reuse, (int)ks->fail);
+  }
+
+  return n;
 }
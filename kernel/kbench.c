@@ -0,0 +1,265 @@
+// In-kernel microbenchmarks, built with KBENCH=1.
+//
+// Some kernel primitives are too cheap to time from user space, where a system call costs more
+// than they do. Writing to the statistics device runs each benchmark here on the writer's CPU,
+// timed with the cycle counter, and reading it afterwards reports cycles per operation for every
+// CPU that has run them. The kbench program pins itself to each CPU in turn to fill the table.
+//
+// A benchmark runs KB_ITERS operations KB_ROUNDS times, and the fastest round is reported, so
+// that an interrupt or a cold cache in one round doesn't count. Benchmarks that can't sleep run
+// with interrupts off. The cost of the loop itself is included, and is a few cycles.
+
+#include "types.h"
+#include "param.h"
+#include "memlayout.h"
+#include "riscv.h"
+#include "spinlock.h"
+#include "sleeplock.h"
+#include "proc.h"
+#include "fs.h"
+#include "buf.h"
+#include "defs.h"
+
+#define KB_ROUNDS 5
+#define KB_ITERS  1000
+
+static void kb_lock(int);
+static void kb_kalloc(int);
+static void kb_bread(int);
+static void kb_walk(int);
+static void kb_memmove64(int);
+static void kb_memmove4k(int);
+static void kb_cksum(int);
+static void kb_swtch(int);
+
+static struct kbench {
+  char *name;
+  void (*run)(int);  // do n operations
+  int sleeps;        // may sleep, so can't run with interrupts off
+} benches[] = {
+  { "acquire",   kb_lock,      0 },
+  { "kalloc",    kb_kalloc,    0 },
+  { "bread",     kb_bread,     1 },
+  { "walk",      kb_walk,      0 },
+  { "memmove64", kb_memmove64, 0 },
+  { "memmove4k", kb_memmove4k, 0 },
+  { "cksum",     kb_cksum,     0 },
+  { "swtch",     kb_swtch,     0 },
+};
+
+#define NBENCH (sizeof(benches) / sizeof(benches[0]))
+
+static struct {
+  // held while the benchmarks run, so that two writers don't share src and dst
+  struct sleeplock lock;
+  struct spinlock  spin;  // for kb_lock(), never contended
+  char            *src;   // a page of data for memmove and cksum
+  char            *dst;
+
+  // kb_swtch() switches back and forth between each CPU's caller and a helper on its own stack
+  struct context caller[NCPU];
+  struct context helper[NCPU];
+  char          *stack[NCPU];
+
+  uint64 cycles[NCPU][NBENCH];  // per operation; 0 if not run on that CPU
+} kb;
+
+// Sink for results the compiler mustn't optimize away.
+static volatile uint64 kb_sink;
+
+void
+kbenchinit(void)
+{
+  initsleeplock(&kb.lock, "kbench");
+  initlock(&kb.spin, "kbench");
+}
+
+static void
+kb_lock(int n)
+{
+  for (int i = 0; i < n; i++) {
+    acquire(&kb.spin);
+    release(&kb.spin);
+  }
+}
+
+static void
+kb_kalloc(int n)
+{
+  for (int i = 0; i < n; i++) {
+    void *pa = kalloc();
+
+    if (pa == 0) {
+      return;
+    }
+
+    kfree(pa);
+  }
+}
+
+// A buffer cache hit: the superblock is read at boot, and stays cached while anything uses it.
+static void
+kb_bread(int n)
+{
+  for (int i = 0; i < n; i++) {
+    brelse(bread(ROOTDEV, 1));
+  }
+}
+
+// A walk of all three levels of the caller's page table, to its trapframe.
+static void
+kb_walk(int n)
+{
+  pagetable_t pagetable = myproc()->pagetable;
+
+  for (int i = 0; i < n; i++) {
+    kb_sink += (uint64)walk(pagetable, TRAPFRAME, 0);
+  }
+}
+
+static void
+kb_memmove64(int n)
+{
+  for (int i = 0; i < n; i++) {
+    memmove(kb.dst, kb.src, 64);
+  }
+}
+
+static void
+kb_memmove4k(int n)
+{
+  for (int i = 0; i < n; i++) {
+    memmove(kb.dst, kb.src, PGSIZE);
+  }
+}
+
+// The checksum of a full Ethernet payload.
+static void
+kb_cksum(int n)
+{
+  for (int i = 0; i < n; i++) {
+    kb_sink += in_cksum((unsigned char *)kb.src, 1500);
+  }
+}
+
+static void
+kb_helper(void)
+{
+  for (;;) {
+    int id = cpuid();
+
+    swtch(&kb.helper[id], &kb.caller[id]);
+  }
+}
+
+// One switch to the helper and one back, so two swtch() calls.
+static void
+kb_swtch(int n)
+{
+  int id = cpuid();
+
+  if (kb.stack[id] == 0) {
+    return;
+  }
+
+  for (int i = 0; i < n; i++) {
+    swtch(&kb.caller[id], &kb.helper[id]);
+  }
+}
+
+// Run b on this CPU, and return the fewest cycles per operation of any round.
+static uint64
+kb_time(struct kbench *b)
+{
+  uint64 best = ~0UL;
+
+  for (int r = 0; r < KB_ROUNDS; r++) {
+    if (!b->sleeps) {
+      push_off();
+    }
+
+    uint64 t0 = r_cycle();
+
+    b->run(KB_ITERS);
+
+    uint64 t = r_cycle() - t0;
+
+    if (!b->sleeps) {
+      pop_off();
+    }
+
+    if (t < best) {
+      best = t;
+    }
+  }
+
+  return best / KB_ITERS;
+}
+
+// Run the benchmarks on this CPU, for a write to the statistics device. The caller should have
+// pinned itself to the CPU with setaffinity(), or the results may be recorded for the wrong one.
+void
+kbench(void)
+{
+  uint64 cycles[NBENCH];
+
+  acquiresleep(&kb.lock);
+
+  if (kb.src == 0) {
+    kb.src = kalloc();
+    kb.dst = kalloc();
+
+    if (kb.src == 0 || kb.dst == 0) {
+      panic("kbench: no memory");
+    }
+
+    for (int i = 0; i < PGSIZE; i++) {
+      kb.src[i] = i;
+    }
+  }
+
+  push_off();
+
+  int id = cpuid();
+
+  if (kb.stack[id] == 0 && (kb.stack[id] = kalloc()) != 0) {
+    kb.helper[id].ra = (uint64)kb_helper;
+    kb.helper[id].sp = (uint64)kb.stack[id] + PGSIZE;
+  }
+
+  pop_off();
+
+  for (int i = 0; i < NBENCH; i++) {
+    cycles[i] = kb_time(&benches[i]);
+  }
+
+  push_off();
+  memmove(kb.cycles[cpuid()], cycles, sizeof(cycles));
+  pop_off();
+
+  releasesleep(&kb.lock);
+}
+
+// Print the cycles per operation of each benchmark on each CPU that has run them into buf, for
+// the statistics device. Returns the number of bytes written.
+int
+kbenchstats(char *buf, int sz)
+{
+  int n = snprintf(buf, sz, "--- kbench cycles/op\n");
+
+  for (int i = 0; i < NCPU; i++) {
+    if (kb.cycles[i][0] == 0) {
+      continue;
+    }
+
+    n += snprintf(buf + n, sz - n, "cpu %d:", i);
+
+    for (int j = 0; j < NBENCH; j++) {
+      n += snprintf(buf + n, sz - n, " %s %d", benches[j].name, (int)kb.cycles[i][j]);
+    }
+
+    n += snprintf(buf + n, sz - n, "\n");
+  }
+
+  return n;
+}
@@ -2,21 +2,33 @@
 #include "param.h"
 #include "memlayout.h"
 #include "spinlock.h"
+#include "sleeplock.h"
 #include "riscv.h"
 #include "proc.h"
+#include "fs.h"
+#include "file.h"
 #include "defs.h"
 
 //
-// Race detector using gcc's thread sanitizer. It delays all stores
-// and loads and monitors if any other CPU is using the same address.
-// If so, we have a race and print out the backtrace of the thread
-// that raced and the thread that set the watchpoint.
+// Race detector using gcc's thread sanitizer. It delays a sample
+// of stores and loads and monitors if any other CPU is using the
+// same address. If so, we have a race and record the backtrace of
+// the thread that raced and the thread that set the watchpoint.
+//
+// Every access is checked against the watchpoints that are set, but
+// a watchpoint (and its delay) is only set on one access in
+// tsan.every, counted down per CPU, so the kernel can run real
+// workloads with race detection on. Reports go to a ring that the
+// kcsan device reads out; writing a number to the device sets
+// tsan.every, with 0 turning watchpoints off.
 //
 
 //
 // To run with kcsan:
 // make clean
 // make KCSAN=1 qemu
+// and to start with one access in 1000 sampled:
+// make KCSAN=1 KCSAN_EVERY=1000 qemu
 //
 
 // The number of watch points.
@@ -28,6 +40,13 @@
 
 #define MAXTRACE 20
 
+// Reports kept until the kcsan device is read.
+#define NREPORT 16
+
+#ifndef KCSAN_EVERY
+#define KCSAN_EVERY 1
+#endif
+
 int
 trace(uint64 *trace, int maxtrace)
 {
@@ -58,13 +77,34 @@ struct watch {
   uint64 trace[MAXTRACE];
   int tracesz;
 };
+
+struct report {
+  uint64 addr;
+  int write;                  // the racing access was a store
+  struct watch w;             // the watchpoint it hit
+  uint64 trace[MAXTRACE];
+  int tracesz;
+};
   
 struct {
   struct spinlock lock;
   struct watch points[NWATCH];
+  int nwatch;                 // points in use, looked at without the lock
   int on;
+  int every;                  // set a watchpoint on one access in this many
+  struct report reports[NREPORT];
+  uint head;                  // reports[tail..head) (mod NREPORT) are unread
+  uint tail;
+  uint dropped;               // reports overwritten before they were read
 } tsan;
 
+// Per-CPU state, padded so CPUs don't share cache lines.
+struct kcpu {
+  int skip;                   // accesses until the next watchpoint
+  int busy;                   // in kcsan, whose own accesses aren't checked
+  char pad[56];
+} kcpus[NCPU];
+
 static struct watch*
 wp_lookup(uint64 addr)
 {
@@ -84,10 +124,10 @@ wp_install(uint64 addr, int write)
       w->addr = addr;
       w->write = write;
       w->tracesz = trace(w->trace, MAXTRACE);
+      tsan.nwatch++;
       return 1;
     }
   }
-  panic("wp_install");
   return 0;
 }
 
@@ -98,43 +138,28 @@ wp_remove(uint64 addr)
     if(w->addr == addr) {
       w->addr = 0;
       w->tracesz = 0;
+      tsan.nwatch--;
       return;
     }
   }
   panic("remove");
 }
 
+// Record a race with w in the ring, overwriting the oldest report if
+// it's full. Called with tsan.lock held.
 static void
-printtrace(uint64 *t, int n)
-{
-  int i;
-  
-  for(i = 0; i < n; i++) {
-    printf("%p\n", t[i]);
-  }
-}
-
-static void
-race(char *s, struct watch *w) {
-  uint64 t[MAXTRACE];
-  int n;
-  
-  n = trace(t, MAXTRACE);
-  printf("== race detected ==\n");
-  printf("backtrace for racing %s\n", s);
-  printtrace(t, n);
-  printf("backtrace for watchpoint:\n");
-  printtrace(w->trace, w->tracesz);
-  printf("==========\n");
-}
+race(int write, struct watch *w) {
+  struct report *r;
 
-// cycle counter
-static inline uint64
-r_cycle()
-{
-  uint64 x;
-  asm volatile("rdcycle %0" : "=r" (x) );
-  return x;
+  if(tsan.head - tsan.tail == NREPORT) {
+    tsan.tail++;
+    tsan.dropped++;
+  }
+  r = &tsan.reports[tsan.head++ % NREPORT];
+  r->addr = w->addr;
+  r->write = write;
+  r->w = *w;
+  r->tracesz = trace(r->trace, MAXTRACE);
 }
 
 static void delay(void) __attribute__((noinline));
@@ -146,35 +171,53 @@ static void delay() {
   }
 }
 
-static void
-kcsan_read(uint64 addr, int sz)
+// Whether an access to addr conflicts with a watchpoint. Only a hint,
+// since the points are looked at without the lock.
+static int
+wp_hit(uint64 addr, int write)
 {
-  struct watch *w;
-  
-  acquire(&tsan.lock);
-  if((w = wp_lookup(addr)) != 0) {
-    if(w->write) {
-      race("load", w);
-    }
-    release(&tsan.lock);
-    return;
+  for(struct watch *w = &tsan.points[0]; w < &tsan.points[NWATCH]; w++) {
+    if(__atomic_load_n(&w->addr, __ATOMIC_RELAXED) == addr &&
+       (write || __atomic_load_n(&w->write, __ATOMIC_RELAXED)))
+      return 1;
   }
-  release(&tsan.lock);
+  return 0;
 }
 
 static void
-kcsan_write(uint64 addr, int sz)
+kcsan_access(uint64 addr, int write)
 {
   struct watch *w;
-  
+  struct kcpu *c;
+  int every, hit, sample;
+
+  // the fast path: no watchpoint to hit, and not this CPU's turn to set one
+  c = &kcpus[r_tp()];
+  if(c->busy)
+    return;
+  hit = __atomic_load_n(&tsan.nwatch, __ATOMIC_RELAXED) > 0 && wp_hit(addr, write);
+  every = tsan.every;
+  sample = every > 0 && --c->skip <= 0;
+  if(!hit && !sample)
+    return;
+
+  // stay on this CPU, and don't check our own accesses, until done
+  push_off();
+  c = &kcpus[r_tp()];
+  c->busy = 1;
+  if(sample)
+    c->skip = every;
+
   acquire(&tsan.lock);
   if((w = wp_lookup(addr)) != 0) {
-    race("store", w);
+    if(write || w->write)
+      race(write, w);
     release(&tsan.lock);
+    goto out;
   }
 
   // no watchpoint; try to install one
-  if(wp_install(addr, 1)) {
+  if(sample && wp_install(addr, write)) {
 
     release(&tsan.lock);
 
@@ -188,6 +231,123 @@ kcsan_write(uint64 addr, int sz)
     wp_remove(addr);
   }
   release(&tsan.lock);
+
+out:
+  c->busy = 0;
+  pop_off();
+}
+
+static void
+kcsan_read(uint64 addr, int sz)
+{
+  kcsan_access(addr, 0);
+}
+
+static void
+kcsan_write(uint64 addr, int sz)
+{
+  kcsan_access(addr, 1);
+}
+
+static struct {
+  struct spinlock lock;
+  char buf[2048];
+  int sz;
+  int off;
+} kcsanbuf;
+
+static int
+printtrace(char *buf, int sz, uint64 *t, int n)
+{
+  int i, m = 0;
+  
+  for(i = 0; i < n; i++) {
+    m += snprintf(buf + m, sz - m, "%p\n", t[i]);
+  }
+  return m;
+}
+
+// Format the oldest unread report into kcsanbuf, returning 0 if there
+// isn't one.
+static int
+kcsanformat(void)
+{
+  struct report r;
+  struct kcpu *c;
+  uint dropped;
+  char *buf = kcsanbuf.buf;
+  int sz = sizeof(kcsanbuf.buf), n = 0;
+
+  // snprintf() is instrumented, so turn checks off on this CPU
+  push_off();
+  c = &kcpus[r_tp()];
+  c->busy = 1;
+
+  acquire(&tsan.lock);
+  if(tsan.tail == tsan.head) {
+    release(&tsan.lock);
+    c->busy = 0;
+    pop_off();
+    return 0;
+  }
+  r = tsan.reports[tsan.tail++ % NREPORT];
+  dropped = tsan.dropped;
+  tsan.dropped = 0;
+  release(&tsan.lock);
+
+  if(dropped)
+    n += snprintf(buf + n, sz - n, "== %d race reports dropped ==\n", dropped);
+  n += snprintf(buf + n, sz - n, "== race detected at %p ==\n", r.addr);
+  n += snprintf(buf + n, sz - n, "backtrace for racing %s\n", r.write ? "store" : "load");
+  n += printtrace(buf + n, sz - n, r.trace, r.tracesz);
+  n += snprintf(buf + n, sz - n, "backtrace for watchpoint (%s):\n", r.w.write ? "store" : "load");
+  n += printtrace(buf + n, sz - n, r.w.trace, r.w.tracesz);
+  n += snprintf(buf + n, sz - n, "==========\n");
+
+  c->busy = 0;
+  pop_off();
+  return n;
+}
+
+// Read out the race reports, oldest first.
+static int
+kcsanread(int user_dst, uint64 dst, int n)
+{
+  int m;
+
+  if(user_dst)
+    uvmprefault(dst, n < sizeof(kcsanbuf.buf) ? n : sizeof(kcsanbuf.buf), 1);
+  acquire(&kcsanbuf.lock);
+  if(kcsanbuf.off == kcsanbuf.sz) {
+    kcsanbuf.sz = kcsanformat();
+    kcsanbuf.off = 0;
+  }
+  m = kcsanbuf.sz - kcsanbuf.off;
+  if(m > n)
+    m = n;
+  if(m > 0 && either_copyout(user_dst, dst, kcsanbuf.buf + kcsanbuf.off, m) == -1)
+    m = -1;
+  else
+    kcsanbuf.off += m;
+  release(&kcsanbuf.lock);
+  return m;
+}
+
+// Set tsan.every from the decimal number written.
+static int
+kcsanwrite(int user_src, uint64 src, int n)
+{
+  char buf[16];
+  int every = 0;
+
+  if(n <= 0 || n >= sizeof(buf) || either_copyin(buf, user_src, src, n) == -1)
+    return -1;
+  for(int i = 0; i < n && buf[i] >= '0' && buf[i] <= '9'; i++)
+    every = every * 10 + buf[i] - '0';
+  tsan.every = every;
+  for(int i = 0; i < NCPU; i++)
+    kcpus[i].skip = every;
+  return n;
 }
 
 // tsan.on will only have effect with "make KCSAN=1"
@@ -195,6 +355,12 @@ void
 kcsaninit(void)
 {
   initlock(&tsan.lock, "tsan");
+  initlock(&kcsanbuf.lock, "kcsanbuf");
+  tsan.every = KCSAN_EVERY;
+  for(int i = 0; i < NCPU; i++)
+    kcpus[i].skip = KCSAN_EVERY;
+  devsw[KCSANDEV].read = kcsanread;
+  devsw[KCSANDEV].write = kcsanwrite;
   tsan.on = 1;
   __sync_synchronize();
 }
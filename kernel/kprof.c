@@ -0,0 +1,129 @@
+// Sampling profiler for the kernel.
+//
+// After kprof(interval), every interval-th clock tick that interrupts a CPU in the kernel records
+// the interrupted sepc, and the return addresses backtrace_walk() finds above it, in that CPU's
+// buffer, which keeps its oldest samples once it is full. kprofread() drains the buffers, and
+// user/kprof matches the pcs against kernel.sym.
+//
+// Only code that runs with interrupts enabled gets sampled; a tick that arrives while they are
+// off is taken, and counted, once they are turned back on.
+
+#include "types.h"
+#include "param.h"
+#include "memlayout.h"
+#include "riscv.h"
+#include "spinlock.h"
+#include "proc.h"
+#include "uprof.h"
+#include "defs.h"
+
+#define NKPROFSAMPLE 256
+
+static struct kprofbuf {
+  struct spinlock    lock;       // for kprofread() on other CPUs
+  uint               countdown;  // ticks until the next sample
+  uint               head;       // samples recorded
+  uint               tail;       // samples read
+  struct uprofsample s[NKPROFSAMPLE];
+} kprofbufs[NCPU];
+
+static uint kprof_interval;  // ticks per sample, 0 if stopped
+
+void
+kprofinit(void)
+{
+  for (int i = 0; i < NCPU; i++) {
+    initlock(&kprofbufs[i].lock, "kprof");
+  }
+}
+
+// Sample every CPU every interval clock ticks that interrupt the kernel, or stop if interval is
+// 0. Starting throws away samples that haven't been read. Returns 0, or -1 if interval is bad.
+int
+kprof(int interval)
+{
+  if (interval < 0) {
+    return -1;
+  }
+
+  __atomic_store_n(&kprof_interval, 0, __ATOMIC_RELAXED);
+
+  if (interval > 0) {
+    for (int i = 0; i < NCPU; i++) {
+      struct kprofbuf *b = &kprofbufs[i];
+
+      acquire(&b->lock);
+      b->head = b->tail = 0;
+      b->countdown      = interval;
+      release(&b->lock);
+    }
+  }
+
+  __atomic_store_n(&kprof_interval, interval, __ATOMIC_RELAXED);
+
+  return 0;
+}
+
+// Called by kerneltrap() on a clock tick, with its own frame pointer fp and the interrupted pc.
+void
+kprof_tick(uint64 sepc, uint64 fp)
+{
+  uint interval = __atomic_load_n(&kprof_interval, __ATOMIC_RELAXED);
+
+  if (interval == 0) {
+    return;
+  }
+
+  struct kprofbuf *b = &kprofbufs[cpuid()];
+
+  acquire(&b->lock);
+
+  if (--b->countdown == 0 && b->head - b->tail < NKPROFSAMPLE) {
+    struct uprofsample *s = &b->s[b->head++ % NKPROFSAMPLE];
+
+    memset(s, 0, sizeof(*s));
+    s->pc[0] = sepc;
+
+    // kerneltrap()'s caller is kernelvec, which leaves the interrupted code's fp in s0.
+    backtrace_walk(*(uint64 *)(fp - 16), &s->pc[1], UPROF_DEPTH - 1);
+  }
+
+  if (b->countdown == 0) {
+    b->countdown = interval;
+  }
+
+  release(&b->lock);
+}
+
+// Move up to n samples from the CPUs' buffers to user address dst. Returns how many.
+int
+kprof_read(uint64 dst, int n)
+{
+  struct uprofsample s;
+  int                copied = 0;
+
+  for (int i = 0; i < NCPU && copied < n; i++) {
+    struct kprofbuf *b = &kprofbufs[i];
+
+    for (;;) {
+      acquire(&b->lock);
+
+      if (b->tail == b->head || copied == n) {
+        release(&b->lock);
+
+        break;
+      }
+
+      s = b->s[b->tail++ % NKPROFSAMPLE];
+      release(&b->lock);
+
+      if (copyout(myproc()->pagetable, dst + copied * sizeof(s), (char *)&s, sizeof(s)) < 0) {
+        return -1;
+      }
+
+      copied++;
+    }
+  }
+
+  return copied;
+}
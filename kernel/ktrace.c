@@ -0,0 +1,177 @@
+// Static tracepoints.
+//
+// KTRACE(category, type, arg0, arg1) at a tracepoint records a struct ktevent, stamped with
+// mtime, in its CPU's buffer, if the category is enabled. A CPU's buffer has only one writer,
+// itself with interrupts off, so recording takes no lock: the writer fills the slot at head and
+// then advances head, and a reader copies the slot at tail and then advances tail. An event that
+// finds the buffer full is dropped and counted, and the reader hands out a KT_DROPPED event for
+// the count before the next event it reads from that buffer.
+//
+// Writing a decimal mask of KT_* categories to the ktrace device enables them, and 0 disables
+// tracing. Reading it hands out whole events, oldest first across all the CPUs, as they arrive;
+// user/ktrace prints them or saves them for offline analysis.
+
+#include "types.h"
+#include "param.h"
+#include "memlayout.h"
+#include "riscv.h"
+#include "spinlock.h"
+#include "proc.h"
+#include "defs.h"
+#include "fs.h"
+#include "sleeplock.h"
+#include "file.h"
+#include "ktrace.h"
+
+#define NKTRACE 1024  // events per CPU, a power of 2
+
+static struct ktbuf {
+  uint           head;     // events recorded
+  uint           tail;     // events read
+  uint           dropped;  // events dropped since the last read
+  struct ktevent e[NKTRACE];
+} __attribute__((aligned(64))) ktbufs[NCPU];
+
+uint ktrace_mask;           // enabled categories; see KTRACE()
+
+static struct spinlock ktrace_lock;  // one reader at a time
+
+// Record an event in this CPU's buffer; KTRACE() calls this for enabled categories.
+void
+ktrace(int type, uint64 arg0, uint64 arg1)
+{
+  push_off();
+
+  int           id = cpuid();
+  struct ktbuf *b  = &ktbufs[id];
+  struct proc  *p  = mycpu()->proc;
+
+  if (b->head - __atomic_load_n(&b->tail, __ATOMIC_ACQUIRE) == NKTRACE) {
+    __atomic_fetch_add(&b->dropped, 1, __ATOMIC_RELAXED);
+    pop_off();
+
+    return;
+  }
+
+  struct ktevent *e = &b->e[b->head % NKTRACE];
+
+  e->time = r_time();
+  e->type = type;
+  e->cpu  = id;
+  e->pid  = p ? p->pid : 0;
+  e->arg0 = arg0;
+  e->arg1 = arg1;
+
+  // the event must be complete before a reader can see it.
+  __atomic_store_n(&b->head, b->head + 1, __ATOMIC_RELEASE);
+
+  pop_off();
+}
+
+// Take the oldest event from any CPU's buffer into e. Returns 0 if there is none. Caller must hold
+// ktrace_lock.
+static int
+ktrace_next(struct ktevent *e)
+{
+  struct ktbuf *oldest = 0;
+
+  for (int i = 0; i < NCPU; i++) {
+    struct ktbuf *b = &ktbufs[i];
+    uint          dropped;
+
+    if (__atomic_load_n(&b->head, __ATOMIC_ACQUIRE) == b->tail) {
+      continue;
+    }
+
+    // report drops before the events that come after them.
+    if ((dropped = __atomic_exchange_n(&b->dropped, 0, __ATOMIC_RELAXED)) > 0) {
+      memset(e, 0, sizeof(*e));
+      e->time = b->e[b->tail % NKTRACE].time;
+      e->type = KT_DROPPED;
+      e->cpu  = i;
+      e->arg0 = dropped;
+
+      return 1;
+    }
+
+    if (oldest == 0 || b->e[b->tail % NKTRACE].time < oldest->e[oldest->tail % NKTRACE].time) {
+      oldest = b;
+    }
+  }
+
+  if (oldest == 0) {
+    return 0;
+  }
+
+  *e = oldest->e[oldest->tail % NKTRACE];
+
+  // and the copy must be done before the writer can reuse the slot.
+  __atomic_store_n(&oldest->tail, oldest->tail + 1, __ATOMIC_RELEASE);
+
+  return 1;
+}
+
+// Read as many whole events as fit in n bytes, and are there, without waiting. The events are
+// taken a page at a time into a kernel buffer under ktrace_lock, and copied out after it is
+// released, since copying out may fault a page in.
+static int
+ktraceread(int user_dst, uint64 dst, int n)
+{
+  struct ktevent *buf;
+  int             tot = 0, m;
+
+  if ((buf = kalloc()) == 0) {
+    return -1;
+  }
+
+  do {
+    acquire(&ktrace_lock);
+
+    for (m = 0; m < PGSIZE / sizeof(*buf) && tot + (m + 1) * sizeof(*buf) <= n; m++) {
+      if (!ktrace_next(&buf[m])) {
+        break;
+      }
+    }
+
+    release(&ktrace_lock);
+
+    if (m > 0 && either_copyout(user_dst, dst + tot, buf, m * sizeof(*buf)) == -1) {
+      tot = -1;
+      break;
+    }
+
+    tot += m * sizeof(*buf);
+  } while (m == PGSIZE / sizeof(*buf));
+
+  kfree(buf);
+
+  return tot;
+}
+
+// Enable the categories in the decimal mask written.
+static int
+ktracewrite(int user_src, uint64 src, int n)
+{
+  char buf[16];
+  uint mask = 0;
+
+  if (n <= 0 || n >= sizeof(buf) || either_copyin(buf, user_src, src, n) == -1) {
+    return -1;
+  }
+
+  for (int i = 0; i < n && buf[i] >= '0' && buf[i] <= '9'; i++) {
+    mask = mask * 10 + buf[i] - '0';
+  }
+
+  __atomic_store_n(&ktrace_mask, mask & KT_ALL, __ATOMIC_RELAXED);
+
+  return n;
+}
+
+void
+ktraceinit(void)
+{
+  initlock(&ktrace_lock, "ktrace");
+  devsw[KTRACEDEV].read  = ktraceread;
+  devsw[KTRACEDEV].write = ktracewrite;
+}
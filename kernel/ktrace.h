@@ -0,0 +1,39 @@
+// Kernel trace events, which tracepoints record with KTRACE() and
+// the ktrace device hands out. See ktrace.c.
+
+// Categories of events, enabled by writing a mask of them to the
+// ktrace device.
+#define KT_SCHED  (1 << 0)   // context switches
+#define KT_SLEEP  (1 << 1)   // sleep() and wakeup()
+#define KT_BIO    (1 << 2)   // buffer cache hits and misses
+#define KT_DISK   (1 << 3)   // virtio disk requests
+#define KT_NET    (1 << 4)   // e1000 packets
+#define KT_FAULT  (1 << 5)   // user page faults
+#define KT_ALL    ((1 << 6) - 1)
+
+// Types of events, and what their args are.
+enum {
+  KT_DROPPED = 1,   // arg0 events dropped while this CPU's buffer was full
+  KT_SWITCHIN,      // the scheduler switches to pid
+  KT_SWITCHOUT,     // pid switches back to the scheduler; arg0 its state
+  KT_SLEEPON,       // pid sleeps on arg0
+  KT_WAKE,          // pid wakes arg1 from sleeping on arg0
+  KT_BHIT,          // bread() finds block arg1 of device arg0 cached
+  KT_BMISS,         // bread() reads block arg1 of device arg0
+  KT_DISKSUBMIT,    // a disk request for arg1 blocks from block arg0;
+                    // bit 32 of arg1 set for a write
+  KT_DISKDONE,      // the disk request from block arg0 finishes
+  KT_NETTX,         // e1000_transmit() queues a packet of arg0 bytes
+  KT_NETRX,         // e1000_recv() receives a packet of arg0 bytes
+  KT_PGFAULT,       // a fault at user address arg0, with scause arg1
+  KT_NTYPE
+};
+
+struct ktevent {
+  uint64 time;      // mtime
+  ushort type;
+  ushort cpu;
+  int    pid;       // the process running, or 0
+  uint64 arg0;
+  uint64 arg1;
+};
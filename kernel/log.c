@@ -17,9 +17,12 @@
 //
 // A system call should call begin_op()/end_op() to mark
 // its start and end. Usually begin_op() just increments
-// the count of in-progress FS system calls and returns.
-// But if it thinks the log is close to running out, it
-// sleeps until the last outstanding end_op() commits.
+// the count of in-progress FS system calls and reserves
+// MAXOPBLOCKS blocks of log space for it. But if it thinks
+// the log is close to running out, it sleeps until the last
+// outstanding end_op() commits. An operation that writes
+// more blocks, like a large write(), reserves them with
+// begin_opn()/end_opn() instead.
 //
 // The log is a physical re-do log containing disk blocks.
 // The on-disk log format:
@@ -28,23 +31,47 @@
 //   block B
 //   block C
 //   ...
-// Log appends are synchronous.
+// Log appends are synchronous. A commit writes all the log
+// blocks at once and waits for them before it writes the
+// header block, and then writes all the home locations at
+// once and waits for them before it clears the header.
+//
+// The log is double-buffered. When the last outstanding
+// operation of a transaction ends, commit() copies the
+// transaction's blocks into private shadow buffers, which
+// takes no disk I/O, and then lets new operations start a
+// new transaction while it writes the shadows to the log and
+// to their home locations. The new transaction commits once
+// the old one is done, so many small operations from
+// parallel processes share one commit.
 
 // Contents of the header block, used for both the on-disk header block
 // and to keep track in memory of logged block# before commit.
 struct logheader {
   int n;
-  int block[LOGSIZE];
+  int block[LOGMAX];
 };
 
 struct log {
   struct spinlock lock;
   int start;
   int size;
+  int cap;         // most blocks in one transaction.
   int outstanding; // how many FS sys calls are executing.
-  int committing;  // in commit(), please wait.
+  int reserved;    // log blocks reserved by the executing calls.
+  int bigwaiting;  // calls waiting to reserve more than MAXOPBLOCKS.
+  int committing;  // a commit is writing the disk.
+  int copying;     // commit() is copying a transaction to the shadows; please wait.
+  uint64 ntaken;   // transactions commit() has taken from lh.
+  uint64 ndone;    // of those, how many have committed.
   int dev;
-  struct logheader lh;
+  struct logheader lh;  // the transaction that operations are joining.
+  struct logheader clh; // the transaction being committed.
+
+  // commit()'s copies of clh's blocks. not in the buffer cache.
+  struct buf shadow[LOGMAX];
+  struct buf *shadowp[LOGMAX];
+  struct buf *pinned[LOGMAX]; // the cache bufs of clh's blocks.
 };
 struct log log;
 
@@ -61,25 +88,43 @@ initlog(int dev, struct superblock *sb)
   log.start = sb->logstart;
   log.size = sb->nlog;
   log.dev = dev;
+  log.cap = log.size - 1;
+  if (log.cap > LOGMAX)
+    log.cap = LOGMAX;
+  if (log.cap < MAXOPBLOCKS)
+    panic("initlog: log too small");
+
+  char *data = 0;
+  for (int i = 0; i < log.cap; i++) {
+    if (i % (PGSIZE / BSIZE) == 0 && (data = kalloc()) == 0)
+      panic("initlog: out of memory");
+    initsleeplock(&log.shadow[i].lock, "log shadow");
+    log.shadow[i].dev = dev;
+    log.shadow[i].data = (uchar *) data + (i % (PGSIZE / BSIZE)) * BSIZE;
+    log.shadowp[i] = &log.shadow[i];
+  }
+
   recover_from_log();
 }
 
-// Copy committed blocks from log to their home location
+static void write_trans(int home);
+
+// Copy committed blocks from log to their home location,
+// after a crash.
 static void
-install_trans(int recovering)
+install_trans(void)
 {
   int tail;
 
-  for (tail = 0; tail < log.lh.n; tail++) {
+  for (tail = 0; tail < log.clh.n; tail++) {
     struct buf *lbuf = bread(log.dev, log.start+tail+1); // read log block
-    struct buf *dbuf = bread(log.dev, log.lh.block[tail]); // read dst
-    memmove(dbuf->data, lbuf->data, BSIZE);  // copy block to dst
-    bwrite(dbuf);  // write dst to disk
-    if(recovering == 0)
-      bunpin(dbuf);
+    acquiresleep(&log.shadow[tail].lock);
+    memmove(log.shadow[tail].data, lbuf->data, BSIZE);
     brelse(lbuf);
-    brelse(dbuf);
   }
+  write_trans(1);  // write dsts to disk, all in flight at once
+  for (tail = 0; tail < log.clh.n; tail++)
+    releasesleep(&log.shadow[tail].lock);
 }
 
 // Read the log header from disk into the in-memory log header
@@ -89,25 +134,24 @@ read_head(void)
   struct buf *buf = bread(log.dev, log.start);
   struct logheader *lh = (struct logheader *) (buf->data);
   int i;
-  log.lh.n = lh->n;
-  for (i = 0; i < log.lh.n; i++) {
-    log.lh.block[i] = lh->block[i];
+  log.clh.n = lh->n;
+  for (i = 0; i < log.clh.n; i++) {
+    log.clh.block[i] = lh->block[i];
   }
   brelse(buf);
 }
 
-// Write in-memory log header to disk.
-// This is the true point at which the
-// current transaction commits.
+// Write the header of the transaction being committed to disk.
+// This is the true point at which it commits.
 static void
 write_head(void)
 {
   struct buf *buf = bread(log.dev, log.start);
   struct logheader *hb = (struct logheader *) (buf->data);
   int i;
-  hb->n = log.lh.n;
-  for (i = 0; i < log.lh.n; i++) {
-    hb->block[i] = log.lh.block[i];
+  hb->n = log.clh.n;
+  for (i = 0; i < log.clh.n; i++) {
+    hb->block[i] = log.clh.block[i];
   }
   bwrite(buf);
   brelse(buf);
@@ -117,42 +161,73 @@ static void
 recover_from_log(void)
 {
   read_head();
-  install_trans(1); // if committed, copy from log to disk
-  log.lh.n = 0;
+  install_trans(); // if committed, copy from log to disk
+  log.clh.n = 0;
   write_head(); // clear the log
 }
 
-// called at the start of each FS system call.
+// The most blocks one operation may reserve.
+int
+log_maxop(void)
+{
+  return log.cap;
+}
+
+// called at the start of an FS system call that writes
+// at most n blocks, n <= log_maxop().
 void
-begin_op(void)
+begin_opn(int n)
 {
+  if(n > log.cap)
+    panic("begin_opn");
+
   acquire(&log.lock);
+  if(n > MAXOPBLOCKS)
+    log.bigwaiting++;
   while(1){
-    if(log.committing){
+    if(log.copying){
       sleep(&log, &log.lock);
-    } else if(log.lh.n + (log.outstanding+1)*MAXOPBLOCKS > LOGSIZE){
+    } else if(log.lh.n + log.reserved + n > log.cap){
       // this op might exhaust log space; wait for commit.
       sleep(&log, &log.lock);
+    } else if(n <= MAXOPBLOCKS && log.bigwaiting > 0){
+      // let a large op have the next transaction that
+      // has room, rather than starve behind small ones.
+      sleep(&log, &log.lock);
     } else {
+      if(n > MAXOPBLOCKS)
+        log.bigwaiting--;
       log.outstanding += 1;
+      log.reserved += n;
       release(&log.lock);
       break;
     }
   }
 }
 
-// called at the end of each FS system call.
-// commits if this was the last outstanding operation.
+// called at the start of each FS system call.
 void
-end_op(void)
+begin_op(void)
+{
+  begin_opn(MAXOPBLOCKS);
+}
+
+// called at the end of an FS system call that began
+// with begin_opn(n).
+// commits if this was the last outstanding operation,
+// unless a commit is already running, which will then
+// commit this transaction too.
+void
+end_opn(int n)
 {
   int do_commit = 0;
 
   acquire(&log.lock);
   log.outstanding -= 1;
-  if(log.committing)
-    panic("log.committing");
-  if(log.outstanding == 0){
+  log.reserved -= n;
+  if(log.copying)
+    panic("log.copying");
+  if(log.outstanding == 0 && !log.committing){
     do_commit = 1;
     log.committing = 1;
   } else {
@@ -167,44 +242,115 @@ end_op(void)
     // call commit w/o holding locks, since not allowed
     // to sleep with locks.
     commit();
-    acquire(&log.lock);
-    log.committing = 0;
-    wakeup(&log);
-    release(&log.lock);
   }
 }
 
-// Copy modified blocks from cache to log.
+// called at the end of each FS system call.
+void
+end_op(void)
+{
+  end_opn(MAXOPBLOCKS);
+}
+
+// Copy the blocks of the transaction being committed from
+// the cache to the shadows. They stay pinned in the cache
+// until the shadows have been installed, since the cache
+// copy is the only up-to-date one until then.
 static void
-write_log(void)
+copy_trans(void)
 {
   int tail;
 
-  for (tail = 0; tail < log.lh.n; tail++) {
-    struct buf *to = bread(log.dev, log.start+tail+1); // log block
-    struct buf *from = bread(log.dev, log.lh.block[tail]); // cache block
-    memmove(to->data, from->data, BSIZE);
-    bwrite(to);  // write the log
+  for (tail = 0; tail < log.clh.n; tail++) {
+    struct buf *from = bread(log.dev, log.clh.block[tail]); // cache block
+    acquiresleep(&log.shadow[tail].lock);
+    memmove(log.shadow[tail].data, from->data, BSIZE);
+    log.pinned[tail] = from;
     brelse(from);
-    brelse(to);
   }
 }
 
+// Write the shadows to the log, or to their home locations.
+static void
+write_trans(int home)
+{
+  int tail;
+
+  for (tail = 0; tail < log.clh.n; tail++)
+    log.shadow[tail].blockno = home ? log.clh.block[tail] : log.start+tail+1;
+  // the log blocks are adjacent, so the log goes to the disk as one
+  // request; the home blocks are all in flight at once.
+  bwritev(log.shadowp, log.clh.n);
+}
+
+// Commit the current transaction, and then any transaction that
+// operations started while that was being written. Called with
+// log.committing set.
 static void
 commit()
 {
-  if (log.lh.n > 0) {
-    write_log();     // Write modified blocks from cache to log
-    write_head();    // Write header to disk -- the real commit
-    install_trans(0); // Now install writes to home locations
+  while(1){
+    // take the transaction, and keep operations from changing
+    // its blocks until they are copied.
+    acquire(&log.lock);
+    if(log.outstanding > 0 || log.lh.n == 0){
+      // the last operation of the next transaction will commit it.
+      log.committing = 0;
+      wakeup(&log);
+      release(&log.lock);
+      return;
+    }
+    log.clh = log.lh;
     log.lh.n = 0;
-    write_head();    // Erase the transaction from the log
+    log.copying = 1;
+    uint64 n = ++log.ntaken;
+    release(&log.lock);
+
+    copy_trans();
+
+    // the new transaction is empty, so begin_op() can admit
+    // operations again.
+    acquire(&log.lock);
+    log.copying = 0;
+    wakeup(&log);
+    release(&log.lock);
+
+    write_trans(0); // Write the shadows to the log
+    write_head();   // Write header to disk -- the real commit
+    acquire(&log.lock);
+    log.ndone = n;
+    wakeup(&log);
+    release(&log.lock);
+    write_trans(1); // Now install writes to home locations
+    for (int tail = 0; tail < log.clh.n; tail++) {
+      releasesleep(&log.shadow[tail].lock);
+      bunpin(log.pinned[tail]);
+    }
+    log.clh.n = 0;
+    write_head();   // Erase the transaction from the log
   }
 }
 
+// Wait until every operation that has ended so far has committed.
+// A transaction commits once its last operation ends, so this may
+// wait for operations that are still running.
+void
+log_sync(void)
+{
+  acquire(&log.lock);
+  // the transaction being joined, if anything has been logged in it,
+  // or else the one that commit() may be writing.
+  uint64 n = log.lh.n > 0 ? log.ntaken + 1 : log.ntaken;
+  while(log.ndone < n)
+    sleep(&log, &log.lock);
+  release(&log.lock);
+}
+
 // Caller has modified b->data and is done with the buffer.
 // Record the block number and pin in the cache by increasing refcnt.
 // commit()/write_log() will do the disk write.
+// A block of a device other than the log's, the RAM disk, is
+// written at once instead.
 //
 // log_write() replaces bwrite(); a typical use is:
 //   bp = bread(...)
@@ -216,8 +362,14 @@ log_write(struct buf *b)
 {
   int i;
 
+  if (b->dev != log.dev) {
+    // not a logged file system; it lives in memory.
+    bwrite(b);
+    return;
+  }
+
   acquire(&log.lock);
-  if (log.lh.n >= LOGSIZE || log.lh.n >= log.size - 1)
+  if (log.lh.n >= log.cap)
     panic("too big a transaction");
   if (log.outstanding < 1)
     panic("log_write outside of trans");
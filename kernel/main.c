@@ -4,8 +4,16 @@
 #include "riscv.h"
 #include "defs.h"
 
+// CPU 0 sets paging once the kernel page table and trap and interrupt
+// setup that the other CPUs need are ready, and started once it has
+// finished booting. The other CPUs help kinit() and set themselves up
+// in the meantime.
+volatile static int paging = 0;
 volatile static int started = 0;
 
+// how many harts have started, for sysinfo().
+int ncpu;
+
 // start() jumps here in supervisor mode on all CPUs.
 void
 main()
@@ -20,32 +28,56 @@ main()
     kinit();         // physical page allocator
     kvminit();       // create kernel page table
     kvminithart();   // turn on paging
+    asidinit();      // address space IDs
     procinit();      // process table
     trapinit();      // trap vectors
     trapinithart();  // install kernel trap vector
     plicinit();      // set up interrupt controller
     plicinithart();  // ask PLIC for device interrupts
+    __sync_synchronize();
+    paging = 1;
     binit();         // buffer cache
+    ramdiskinit();   // RAM disk for /tmp
     iinit();         // inode table
+    pagecacheinit(); // file page cache
+    swapinit();      // swap space, once fsinit() finds it
+    execinit();      // recently exec()ed programs
     fileinit();      // file table
     virtio_disk_init(); // emulated hard disk
+    mbufinit();      // packet buffer pool
+    arpinit();       // ARP cache
+    pipeinit();      // pipe cache
+    futexinit();     // futex locks
+    timerqinit();    // per-CPU timer queues
+    kprofinit();     // kernel profiler buffers
+    hpminit();       // user performance counters
+    ktraceinit();    // tracepoint buffers
+    pollinit();      // poll() wakeups
     pci_init();
     sockinit();
     userinit();      // first user process
 #ifdef KCSAN
     kcsaninit();
+#endif
+#ifdef KBENCH
+    kbenchinit();    // in-kernel microbenchmarks
 #endif
     __sync_synchronize();
     started = 1;
   } else {
-    while(atomic_read4((int *) &started) == 0)
+    kinit_help();     // initialize pages alongside CPU 0
+    while(atomic_read4((int *) &paging) == 0)
       ;
     __sync_synchronize();
     printf("hart %d starting\n", cpuid());
     kvminithart();    // turn on paging
     trapinithart();   // install kernel trap vector
     plicinithart();   // ask PLIC for device interrupts
+    while(atomic_read4((int *) &started) == 0)
+      ;
+    __sync_synchronize();
   }
 
+  __sync_fetch_and_add(&ncpu, 1);
   scheduler();
 }
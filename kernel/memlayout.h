@@ -28,6 +28,7 @@
 
 // core local interruptor (CLINT), which contains the timer.
 #define CLINT 0x2000000L
+#define CLINT_MSIP(hartid) (CLINT + 4*(hartid))
 #define CLINT_MTIMECMP(hartid) (CLINT + 0x4000 + 8*(hartid))
 #define CLINT_MTIME (CLINT + 0xBFF8) // cycles since boot.
 
@@ -63,11 +64,17 @@
 //   fixed-size stack
 //   expandable heap
 //   ...
+//   mmap()ed files, from MMAPTOP down
+//   THREADFRAME(i) (p->trapframe of a clone()d proc[i])
+//   USHARED (shared with kernel, the same page in every process)
 //   USYSCALL (shared with kernel)
 //   TRAPFRAME (p->trapframe, used by the trampoline)
 //   TRAMPOLINE (the same page as in the kernel)
 #define TRAPFRAME (TRAMPOLINE - PGSIZE)
 #define USYSCALL (TRAPFRAME - PGSIZE)
+#define USHARED (USYSCALL - PGSIZE)
+#define THREADFRAME(i) (USHARED - ((i)+1)*PGSIZE)
+#define MMAPTOP THREADFRAME(NPROC)
 
 // This header file is included by trampoline.s, and originally relied
 // (potentially inadvertently) on the fact that LAB_PGTBL was not defined. I
@@ -75,8 +82,22 @@
 // instead.
 #ifndef __ASSEMBLER__
 
+// Per-address-space data that the kernel publishes to its process,
+// which reads it without a system call. Threads made by clone()
+// share it with the process that made them.
 struct usyscall {
-  int pid;  // Process ID
+  int pid;   // Process ID
+  int ppid;  // Parent's process ID
+  int cpu;   // CPU the process last started running on, or -1
+};
+
+// System-wide data that the kernel publishes to every process, which
+// reads it without a system call or a lock. The counts are refreshed
+// by every clock tick.
+struct ushared {
+  uint ticks;     // Clock ticks since boot, as returned by uptime()
+  uint nproc;     // Processes in use, as in struct sysinfo
+  uint64 freemem; // Free memory in bytes, as in struct sysinfo
 };
 
 #endif
@@ -0,0 +1,9 @@
+// recvmmsg() and sendmmsg() move many datagrams in one call.
+
+#define NMMSG 32  // most datagrams one call moves
+
+struct mmsghdr {
+  char *buf;  // the datagram's data
+  int size;   // room in buf (recvmmsg), or the datagram's length (sendmmsg)
+  int len;    // set to the bytes received or sent
+};
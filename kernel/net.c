@@ -10,6 +10,12 @@
 #include "proc.h"
 #include "net.h"
 #include "defs.h"
+#include "slab.h"
+#include "page.h"
+#include "netstat.h"
+#include <stddef.h>
+
+struct netstat netstats_cpu[NCPU];
 
 static uint32 local_ip = MAKE_IP_ADDR(10, 0, 2, 15); // qemu's idea of the guest IP
 static uint8 local_mac[ETHADDR_LEN] = { 0x52, 0x54, 0x00, 0x12, 0x34, 0x56 };
@@ -61,29 +67,150 @@ mbuftrim(struct mbuf *m, unsigned int len)
   return m->head + m->len;
 }
 
+// Packet buffers are recycled through a pool rather than going back
+// to the slab and page allocators on every free. Each CPU keeps a list
+// of free mbufs that it only touches with interrupts off, so the common
+// alloc and free take no lock at all. A CPU whose list grows past
+// MBUF_PCPU_MAX hands MBUF_BATCH of them to a shared depot, and a CPU
+// that runs dry takes a batch back, so buffers freed on one CPU (by a
+// reader) can be reused on another (by the receive thread). The pool
+// starts with NMBUF buffers, enough to fill both rings, and only asks
+// the slab for more when all of them are in flight.
+#define NMBUF         64
+#define MBUF_PCPU_MAX 32
+#define MBUF_BATCH    16
+
+static struct kmem_cache mbuf_cache;
+
+struct mbufpool {
+  struct mbuf *free;
+  int n;
+};
+
+// Indexed by cpuid(); see above.
+static struct mbufpool mbufpcpu[NCPU];
+
+static struct {
+  struct spinlock lock;
+  struct mbufpool pool;
+} mbufdepot;
+
+// Allocates a new mbuf for the pool. Its buffer is a whole page, so
+// that the page can be lent to user space without showing it any
+// other packet; see sockrecvzc(). Only the first MBUF_SIZE bytes
+// are ever written, so the rest of the page stays zero.
+static struct mbuf *
+mbufnew(void)
+{
+  struct mbuf *m;
+
+  if ((m = kmem_cache_alloc(&mbuf_cache)) == 0)
+    return 0;
+  if ((m->buf = kalloc_zeroed()) == 0) {
+    kmem_cache_free(&mbuf_cache, m);
+    return 0;
+  }
+  return m;
+}
+
+// Moves up to n mbufs from one pool to another.
+static void
+mbufmove(struct mbufpool *from, struct mbufpool *to, int n)
+{
+  struct mbuf *m;
+
+  while (n-- > 0 && (m = from->free) != 0) {
+    from->free = m->next;
+    from->n--;
+    m->next = to->free;
+    to->free = m;
+    to->n++;
+  }
+}
+
+void
+mbufinit(void)
+{
+  struct mbuf *m;
+
+  kmem_cache_init(&mbuf_cache, "mbuf_cache", sizeof(struct mbuf));
+  initlock(&mbufdepot.lock, "mbufdepot");
+  for (int i = 0; i < NMBUF; i++) {
+    if ((m = mbufnew()) == 0)
+      panic("mbufinit");
+    m->next = mbufdepot.pool.free;
+    mbufdepot.pool.free = m;
+    mbufdepot.pool.n++;
+  }
+}
+
 // Allocates a packet buffer.
 struct mbuf *
 mbufalloc(unsigned int headroom)
 {
   struct mbuf *m;
  
+  struct mbufpool *p;
+
   if (headroom > MBUF_SIZE)
     return 0;
-  m = kalloc();
-  if (m == 0)
+
+  push_off();
+  p = &mbufpcpu[cpuid()];
+  if (p->free == 0) {
+    acquire(&mbufdepot.lock);
+    mbufmove(&mbufdepot.pool, p, MBUF_BATCH);
+    release(&mbufdepot.lock);
+  }
+  if ((m = p->free) != 0) {
+    p->free = m->next;
+    p->n--;
+  }
+  pop_off();
+
+  // every buffer is in flight; grow the pool.
+  if (m == 0 && (m = mbufnew()) == 0)
     return 0;
+
+  // the buffer isn't cleared: every layer fills in the headers it
+  // pushes, and the length covers only what has been put.
   m->next = 0;
   m->head = (char *)m->buf + headroom;
   m->len = 0;
-  memset(m->buf, 0, sizeof(m->buf));
+  m->csum = 0;
   return m;
 }
 
-// Frees a packet buffer.
+// Frees a packet buffer, back to this CPU's pool.
 void
 mbuffree(struct mbuf *m)
 {
-  kfree(m);
+  struct mbufpool *p;
+
+  push_off();
+  p = &mbufpcpu[cpuid()];
+  m->next = p->free;
+  p->free = m;
+  if (++p->n > MBUF_PCPU_MAX) {
+    acquire(&mbufdepot.lock);
+    mbufmove(p, &mbufdepot.pool, MBUF_BATCH);
+    release(&mbufdepot.lock);
+  }
+  pop_off();
+}
+
+// Frees a packet buffer whose page was lent to user space. The
+// page goes back to the pool if the loan has been unmapped
+// everywhere, or else is left to whoever still maps it.
+void
+mbufreturn(struct mbuf *m)
+{
+  if (pa2page((uint64)m->buf)->refcount == 1) {
+    mbuffree(m);
+    return;
+  }
+  kfree(m->buf);
+  kmem_cache_free(&mbuf_cache, m);
 }
 
 // Pushes an mbuf to the end of the queue.
@@ -124,62 +251,302 @@ mbufq_init(struct mbufq *q)
   q->head = 0;
 }
 
-// This code is lifted from FreeBSD's ping.c, and is copyright by the Regents
-// of the University of California.
-static unsigned short
-in_cksum(const unsigned char *addr, int len)
+// Adds len bytes at addr to sum, a ones'-complement sum of 16-bit
+// words in memory order that hasn't been folded yet. Most of the
+// bytes go in as aligned 64-bit loads, each split into halves so
+// that no carry is lost, and the carries are folded in at the end
+// by cksum_fold(). addr must be even, as IP and UDP headers are.
+static uint64
+cksum_add(uint64 sum, const void *addr, int len)
 {
-  int nleft = len;
-  const unsigned short *w = (const unsigned short *)addr;
-  unsigned int sum = 0;
-  unsigned short answer = 0;
-
-  /*
-   * Our algorithm is simple, using a 32 bit accumulator (sum), we add
-   * sequential 16 bit words to it, and at the end, fold back all the
-   * carry bits from the top 16 bits into the lower 16 bits.
-   */
-  while (nleft > 1)  {
-    sum += *w++;
-    nleft -= 2;
-  }
+  const unsigned char *p = addr;
 
-  /* mop up an odd byte, if necessary */
-  if (nleft == 1) {
-    *(unsigned char *)(&answer) = *(const unsigned char *)w;
-    sum += answer;
+  while (((uint64)p & 7) && len >= 2) {
+    sum += *(const uint16 *)p;
+    p += 2;
+    len -= 2;
+  }
+  while (len >= 8) {
+    uint64 w = *(const uint64 *)p;
+    sum += (w & 0xffffffff) + (w >> 32);
+    p += 8;
+    len -= 8;
+  }
+  while (len >= 2) {
+    sum += *(const uint16 *)p;
+    p += 2;
+    len -= 2;
   }
+  // an odd byte at the end is the first of a 16-bit word.
+  if (len == 1)
+    sum += *p;
+  return sum;
+}
 
-  /* add back carry outs from top 16 bits to low 16 bits */
+// Folds a sum from cksum_add() down to 16 bits.
+static uint16
+cksum_fold(uint64 sum)
+{
+  sum = (sum & 0xffffffff) + (sum >> 32);
+  sum = (sum & 0xffffffff) + (sum >> 32);
+  sum = (sum & 0xffff) + (sum >> 16);
   sum = (sum & 0xffff) + (sum >> 16);
-  sum += (sum >> 16);
-  /* guaranteed now that the lower 16 bits of sum are correct */
+  return sum;
+}
 
-  answer = ~sum; /* truncate to 16 bits */
-  return answer;
+// The Internet checksum of len bytes at addr, which is 0 for a
+// header whose checksum is right.
+unsigned short
+in_cksum(const unsigned char *addr, int len)
+{
+  return ~cksum_fold(cksum_add(0, addr, len));
 }
 
-// sends an ethernet packet
-static void
-net_tx_eth(struct mbuf *m, uint16 ethtype)
+// The unfolded sum of the UDP pseudo-header for a datagram of ulen
+// bytes, with every field in network byte order.
+static uint64
+udp_pseudo(uint32 src, uint32 dst, uint16 ulen)
+{
+  return (uint64)src + dst + htons(IPPROTO_UDP) + ulen;
+}
+
+// sends an ethernet packet to dmac, waiting for room in the
+// transmit ring if wait is set. Returns 0, or -1 if the packet
+// was dropped, having freed it.
+static int
+net_tx_eth(struct mbuf *m, uint16 ethtype, const uint8 dmac[ETHADDR_LEN], int wait)
 {
   struct eth *ethhdr;
 
   ethhdr = mbufpushhdr(m, *ethhdr);
   memmove(ethhdr->shost, local_mac, ETHADDR_LEN);
-  // In a real networking stack, dhost would be set to the address discovered
-  // through ARP. Because we don't support enough of the ARP protocol, set it
-  // to broadcast instead.
-  memmove(ethhdr->dhost, broadcast_mac, ETHADDR_LEN);
+  memmove(ethhdr->dhost, dmac, ETHADDR_LEN);
   ethhdr->type = htons(ethtype);
-  if (e1000_transmit(m)) {
+  if (e1000_transmit(m, wait)) {
     mbuffree(m);
+    return -1;
   }
+  return 0;
 }
 
-// sends an IP packet
+// sends an ARP packet: a request for dip's address, broadcast,
+// or a reply to dip at dmac.
+static int
+net_tx_arp(uint16 op, const uint8 dmac[ETHADDR_LEN], uint32 dip)
+{
+  static const uint8 zero_mac[ETHADDR_LEN];
+  struct mbuf *m;
+  struct arp *arphdr;
+
+  m = mbufalloc(MBUF_DEFAULT_HEADROOM);
+  if (!m)
+    return -1;
+
+  // generic part of ARP header
+  arphdr = mbufputhdr(m, *arphdr);
+  arphdr->hrd = htons(ARP_HRD_ETHER);
+  arphdr->pro = htons(ETHTYPE_IP);
+  arphdr->hln = ETHADDR_LEN;
+  arphdr->pln = sizeof(uint32);
+  arphdr->op = htons(op);
+
+  // ethernet + IP part of ARP header
+  memmove(arphdr->sha, local_mac, ETHADDR_LEN);
+  arphdr->sip = htonl(local_ip);
+  memmove(arphdr->tha, op == ARP_OP_REQUEST ? zero_mac : dmac, ETHADDR_LEN);
+  arphdr->tip = htonl(dip);
+
+  // header is ready, send the packet. the receive path that
+  // replies mustn't wait for the transmit ring.
+  NETSTAT_ADD(arp_tx, 1);
+  return net_tx_eth(m, ETHTYPE_ARP,
+                    op == ARP_OP_REQUEST ? broadcast_mac : dmac, 0);
+}
+
+//
+// The ARP cache.
+//
+// IP packets go to the Ethernet address of their next hop: the
+// destination itself if it's on the local network, or else the
+// gateway. Addresses are learned from the ARP replies and
+// requests that arrive, into arptbl, which holds one address per
+// slot and keeps it for ARP_TTL ticks. A packet for a next hop
+// whose address isn't known waits in its slot, ARP_QLEN of them at
+// most, while a request goes out, again every ARP_RETRY ticks.
+//
+// Senders look addresses up without taking a lock. Changes to a
+// slot are made under arp_lock, with its seq odd meanwhile, and a
+// reader that sees seq change tries again.
+//
+
+static uint32 gateway_ip = MAKE_IP_ADDR(10, 0, 2, 2); // qemu's router
+static uint32 netmask = MAKE_IP_ADDR(255, 255, 255, 0);
+
+#define NARP      16
+#define ARP_TTL   (60 * TICKHZ)
+#define ARP_RETRY TICKHZ
+#define ARP_QLEN  4
+
+struct arpent {
+  uint seq;             // odd while the slot is changing
+  uint32 ip;            // the address the slot is for, or 0
+  uint64 mac;           // its Ethernet address, in the low 6 bytes
+  uint expires;         // ticks after which mac is stale; 0 if unknown
+
+  // the rest is guarded by arp_lock.
+  uint requested;       // ticks when the last request went out
+  struct mbufq pending; // packets waiting for mac
+  int npending;
+};
+
+static struct arpent arptbl[NARP];
+static struct spinlock arp_lock;
+
+void
+arpinit(void)
+{
+  initlock(&arp_lock, "arp");
+}
+
+static inline uint
+arpticks(void)
+{
+  return __atomic_load_n(&ticks, __ATOMIC_RELAXED);
+}
+
+static struct arpent *
+arpslot(uint32 ip)
+{
+  return &arptbl[(ip ^ (ip >> 8)) % NARP];
+}
+
+// Looks up ip's Ethernet address, without a lock. Returns 1 and
+// fills in mac if it is known and fresh, or else 0.
+static int
+arp_lookup(uint32 ip, uint8 mac[ETHADDR_LEN])
+{
+  struct arpent *e = arpslot(ip);
+  uint seq, expires;
+  uint32 eip;
+  uint64 emac;
+
+  do {
+    while ((seq = __atomic_load_n(&e->seq, __ATOMIC_ACQUIRE)) & 1)
+      ;
+    eip = __atomic_load_n(&e->ip, __ATOMIC_RELAXED);
+    emac = __atomic_load_n(&e->mac, __ATOMIC_RELAXED);
+    expires = __atomic_load_n(&e->expires, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+  } while (__atomic_load_n(&e->seq, __ATOMIC_RELAXED) != seq);
+
+  if (eip != ip || expires == 0 || (int)(expires - arpticks()) <= 0)
+    return 0;
+  memmove(mac, &emac, ETHADDR_LEN);
+  return 1;
+}
+
+// Points slot e at ip with the given address and expiry time, for
+// lockless readers. Must be called with arp_lock held.
 static void
-net_tx_ip(struct mbuf *m, uint8 proto, uint32 dip)
+arp_set(struct arpent *e, uint32 ip, uint64 mac, uint expires)
+{
+  __atomic_store_n(&e->seq, e->seq + 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  __atomic_store_n(&e->ip, ip, __ATOMIC_RELAXED);
+  __atomic_store_n(&e->mac, mac, __ATOMIC_RELAXED);
+  __atomic_store_n(&e->expires, expires, __ATOMIC_RELAXED);
+  __atomic_store_n(&e->seq, e->seq + 1, __ATOMIC_RELEASE);
+}
+
+// Makes slot e ip's, dropping the packets that waited in it for
+// another address. Must be called with arp_lock held.
+static void
+arp_claim(struct arpent *e, uint32 ip)
+{
+  struct mbuf *m;
+
+  while ((m = mbufq_pophead(&e->pending)) != 0)
+    mbuffree(m);
+  e->npending = 0;
+  e->requested = arpticks() - ARP_RETRY;
+  arp_set(e, ip, 0, 0);
+}
+
+// Records that ip is at mac, and sends the packets that were
+// waiting for it. Only updates a slot that is already ip's,
+// unless claim is set.
+static void
+arp_update(uint32 ip, const uint8 mac[ETHADDR_LEN], int claim)
+{
+  struct arpent *e = arpslot(ip);
+  struct mbufq q;
+  struct mbuf *m;
+  uint64 emac = 0;
+  uint expires;
+
+  acquire(&arp_lock);
+  if (e->ip != ip) {
+    if (!claim) {
+      release(&arp_lock);
+      return;
+    }
+    arp_claim(e, ip);
+  }
+  memmove(&emac, mac, ETHADDR_LEN);
+  if ((expires = arpticks() + ARP_TTL) == 0)
+    expires = 1;
+  arp_set(e, ip, emac, expires);
+  q = e->pending;
+  mbufq_init(&e->pending);
+  e->npending = 0;
+  release(&arp_lock);
+
+  while ((m = mbufq_pophead(&q)) != 0)
+    net_tx_eth(m, ETHTYPE_IP, mac, 0);
+}
+
+// Sends IP packet m to ip's Ethernet address, or holds on to it
+// while the address is looked up. Returns as net_tx_eth().
+static int
+arp_tx(struct mbuf *m, uint32 ip, int wait)
+{
+  struct arpent *e = arpslot(ip);
+  uint8 mac[ETHADDR_LEN];
+  int request = 0;
+
+  if (arp_lookup(ip, mac))
+    return net_tx_eth(m, ETHTYPE_IP, mac, wait);
+
+  acquire(&arp_lock);
+  // a reply may have arrived meanwhile
+  if (arp_lookup(ip, mac)) {
+    release(&arp_lock);
+    return net_tx_eth(m, ETHTYPE_IP, mac, wait);
+  }
+  if (e->ip != ip)
+    arp_claim(e, ip);
+  if (e->npending == ARP_QLEN) {
+    mbuffree(mbufq_pophead(&e->pending));
+    e->npending--;
+    NETSTAT_ADD(arp_drop, 1);
+  }
+  mbufq_pushtail(&e->pending, m);
+  e->npending++;
+  NETSTAT_ADD(arp_miss, 1);
+  if ((int)(arpticks() - e->requested) >= ARP_RETRY) {
+    e->requested = arpticks();
+    request = 1;
+  }
+  release(&arp_lock);
+
+  if (request)
+    net_tx_arp(ARP_OP_REQUEST, broadcast_mac, ip);
+  return 0;
+}
+
+// sends an IP packet
+static int
+net_tx_ip(struct mbuf *m, uint8 proto, uint32 dip, int wait)
 {
   struct ip *iphdr;
 
@@ -192,16 +559,19 @@ net_tx_ip(struct mbuf *m, uint8 proto, uint32 dip)
   iphdr->ip_dst = htonl(dip);
   iphdr->ip_len = htons(m->len);
   iphdr->ip_ttl = 100;
-  iphdr->ip_sum = in_cksum((unsigned char *)iphdr, sizeof(*iphdr));
+  // the e1000 fills in ip_sum
+  m->csum |= MBUF_CSUM_IP;
 
-  // now on to the ethernet layer
-  net_tx_eth(m, ETHTYPE_IP);
+  // now on to the ethernet layer, by way of the next hop's address
+  if ((dip & netmask) != (local_ip & netmask))
+    dip = gateway_ip;
+  return arp_tx(m, dip, wait);
 }
 
-// sends a UDP packet
-void
+// sends a UDP packet; see net_tx_eth()
+int
 net_tx_udp(struct mbuf *m, uint32 dip,
-           uint16 sport, uint16 dport)
+           uint16 sport, uint16 dport, int wait)
 {
   struct udp *udphdr;
 
@@ -210,40 +580,13 @@ net_tx_udp(struct mbuf *m, uint32 dip,
   udphdr->sport = htons(sport);
   udphdr->dport = htons(dport);
   udphdr->ulen = htons(m->len);
-  udphdr->sum = 0; // zero means no checksum is provided
+  // the e1000 sums the datagram from the UDP header on, starting
+  // from what's in sum, so seed it with the pseudo-header.
+  udphdr->sum = cksum_fold(udp_pseudo(htonl(local_ip), htonl(dip), udphdr->ulen));
+  m->csum |= MBUF_CSUM_UDP;
 
   // now on to the IP layer
-  net_tx_ip(m, IPPROTO_UDP, dip);
-}
-
-// sends an ARP packet
-static int
-net_tx_arp(uint16 op, uint8 dmac[ETHADDR_LEN], uint32 dip)
-{
-  struct mbuf *m;
-  struct arp *arphdr;
-
-  m = mbufalloc(MBUF_DEFAULT_HEADROOM);
-  if (!m)
-    return -1;
-
-  // generic part of ARP header
-  arphdr = mbufputhdr(m, *arphdr);
-  arphdr->hrd = htons(ARP_HRD_ETHER);
-  arphdr->pro = htons(ETHTYPE_IP);
-  arphdr->hln = ETHADDR_LEN;
-  arphdr->pln = sizeof(uint32);
-  arphdr->op = htons(op);
-
-  // ethernet + IP part of ARP header
-  memmove(arphdr->sha, local_mac, ETHADDR_LEN);
-  arphdr->sip = htonl(local_ip);
-  memmove(arphdr->tha, dmac, ETHADDR_LEN);
-  arphdr->tip = htonl(dip);
-
-  // header is ready, send the packet
-  net_tx_eth(m, ETHTYPE_ARP);
-  return 0;
+  return net_tx_ip(m, IPPROTO_UDP, dip, wait);
 }
 
 // receives an ARP packet
@@ -253,7 +596,9 @@ net_rx_arp(struct mbuf *m)
   struct arp *arphdr;
   uint8 smac[ETHADDR_LEN];
   uint32 sip, tip;
+  uint16 op;
 
+  NETSTAT_ADD(arp_rx, 1);
   arphdr = mbufpullhdr(m, *arphdr);
   if (!arphdr)
     goto done;
@@ -266,16 +611,20 @@ net_rx_arp(struct mbuf *m)
     goto done;
   }
 
-  // only requests are supported so far
-  // check if our IP was solicited
+  op = ntohs(arphdr->op);
   tip = ntohl(arphdr->tip); // target IP address
-  if (ntohs(arphdr->op) != ARP_OP_REQUEST || tip != local_ip)
+  memmove(smac, arphdr->sha, ETHADDR_LEN); // sender's ethernet address
+  sip = ntohl(arphdr->sip); // sender's IP address
+  if (sip == 0 || (op != ARP_OP_REQUEST && op != ARP_OP_REPLY))
     goto done;
 
-  // handle the ARP request
-  memmove(smac, arphdr->sha, ETHADDR_LEN); // sender's ethernet address
-  sip = ntohl(arphdr->sip); // sender's IP address (qemu's slirp)
-  net_tx_arp(ARP_OP_REPLY, smac, sip);
+  // learn the sender's address from anything addressed to us, and
+  // refresh it from anything else, as RFC 826 does.
+  arp_update(sip, smac, tip == local_ip);
+
+  // answer requests for our address
+  if (op == ARP_OP_REQUEST && tip == local_ip)
+    net_tx_arp(ARP_OP_REPLY, smac, sip);
 
 done:
   mbuffree(m);
@@ -294,14 +643,18 @@ net_rx_udp(struct mbuf *m, uint16 len, struct ip *iphdr)
   if (!udphdr)
     goto fail;
 
-  // TODO: validate UDP checksum
-
   // validate lengths reported in headers
   if (ntohs(udphdr->ulen) != len)
     goto fail;
   len -= sizeof(*udphdr);
   if (len > m->len)
     goto fail;
+
+  // validate UDP checksum, unless the e1000 has, or there is none.
+  if (udphdr->sum != 0 && !(m->csum & MBUF_CSUM_UDP) &&
+      cksum_fold(cksum_add(udp_pseudo(iphdr->ip_src, iphdr->ip_dst, udphdr->ulen),
+                           udphdr, sizeof(*udphdr) + len)) != 0xffff)
+    goto csum;
   // minimum packet size could be larger than the payload
   mbuftrim(m, m->len - len);
 
@@ -312,7 +665,13 @@ net_rx_udp(struct mbuf *m, uint16 len, struct ip *iphdr)
   sockrecvudp(m, sip, dport, sport);
   return;
 
+csum:
+  NETSTAT_ADD(rx_csum, 1);
+  mbuffree(m);
+  return;
+
 fail:
+  NETSTAT_ADD(rx_bad, 1);
   mbuffree(m);
 }
 
@@ -330,9 +689,9 @@ net_rx_ip(struct mbuf *m)
   // check IP version and header len
   if (iphdr->ip_vhl != ((4 << 4) | (20 >> 2)))
     goto fail;
-  // validate IP checksum
-  if (in_cksum((unsigned char *)iphdr, sizeof(*iphdr)))
-    goto fail;
+  // validate IP checksum, unless the e1000 has
+  if (!(m->csum & MBUF_CSUM_IP) && in_cksum((unsigned char *)iphdr, sizeof(*iphdr)))
+    goto csum;
   // can't support fragmented IP packets
   if (htons(iphdr->ip_off) != 0)
     goto fail;
@@ -347,7 +706,13 @@ net_rx_ip(struct mbuf *m)
   net_rx_udp(m, len, iphdr);
   return;
 
+csum:
+  NETSTAT_ADD(rx_csum, 1);
+  mbuffree(m);
+  return;
+
 fail:
+  NETSTAT_ADD(rx_bad, 1);
   mbuffree(m);
 }
 
@@ -360,6 +725,7 @@ void net_rx(struct mbuf *m)
 
   ethhdr = mbufpullhdr(m, *ethhdr);
   if (!ethhdr) {
+    NETSTAT_ADD(rx_bad, 1);
     mbuffree(m);
     return;
   }
@@ -369,6 +735,73 @@ void net_rx(struct mbuf *m)
     net_rx_ip(m);
   else if (type == ETHTYPE_ARP)
     net_rx_arp(m);
-  else
+  else {
+    NETSTAT_ADD(rx_bad, 1);
     mbuffree(m);
+  }
+}
+
+#ifdef NETTRACE
+// Records how long m took from e1000_recv() to the socket's rxq,
+// and from there to being read, which is now.
+void
+nettrace_read(struct mbuf *m)
+{
+  uint64 now = r_time();
+
+  push_off();
+  struct netstat *ns = &netstats_cpu[cpuid()];
+  ns->lat_n++;
+  ns->lat_stack += m->stamp[1] - m->stamp[0];
+  ns->lat_read += now - m->stamp[1];
+  if (now - m->stamp[0] > ns->lat_max)
+    ns->lat_max = now - m->stamp[0];
+  pop_off();
+}
+#endif
+
+// Print the network stack's counters, summed over CPUs, into buf,
+// for the statistics device. Returns the number of bytes written.
+int
+netstats(char *buf, int sz)
+{
+  static const struct {
+    char *name;
+    int off;
+  } fields[] = {
+#define F(f) { #f, offsetof(struct netstat, f) }
+    F(rx_packets), F(rx_bytes), F(rx_nombuf), F(rx_csum), F(rx_bad),
+    F(rx_noport), F(rx_sockfull), F(tx_packets), F(tx_bytes),
+    F(tx_ringfull), F(arp_rx), F(arp_tx), F(arp_miss), F(arp_drop),
+#undef F
+  };
+  int n = snprintf(buf, sz, "--- net stats\n");
+
+  for (int i = 0; i < sizeof(fields) / sizeof(fields[0]); i++) {
+    uint64 total = 0;
+
+    for (int c = 0; c < NCPU; c++)
+      total += *(uint64 *)((char *)&netstats_cpu[c] + fields[i].off);
+    n += snprintf(buf + n, sz - n, "%s %l\n", fields[i].name, total);
+  }
+
+#ifdef NETTRACE
+  uint64 cnt = 0, stack = 0, rd = 0, max = 0;
+
+  for (int c = 0; c < NCPU; c++) {
+    cnt += netstats_cpu[c].lat_n;
+    stack += netstats_cpu[c].lat_stack;
+    rd += netstats_cpu[c].lat_read;
+    if (netstats_cpu[c].lat_max > max)
+      max = netstats_cpu[c].lat_max;
+  }
+  if (cnt) {
+    // in microseconds
+    n += snprintf(buf + n, sz - n, "lat_stack_us %l\nlat_read_us %l\nlat_max_us %l\n",
+                  stack / cnt / (TIMEHZ / 1000000), rd / cnt / (TIMEHZ / 1000000),
+                  max / (TIMEHZ / 1000000));
+  }
+#endif
+
+  return n;
 }
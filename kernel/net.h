@@ -9,9 +9,19 @@ struct mbuf {
   struct mbuf  *next; // the next mbuf in the chain
   char         *head; // the current start position of the buffer
   unsigned int len;   // the length of the buffer
-  char         buf[MBUF_SIZE]; // the backing store
+  char         *buf;  // the backing store, a page of its own
+  uint64       va;    // where buf is lent to user space, see sockrecvzc()
+  unsigned int csum;  // MBUF_CSUM_ flags
+#ifdef NETTRACE
+  uint64       stamp[2]; // mtime at e1000_recv() and at the socket's rxq
+#endif
 };
 
+// Which checksums the NIC has verified, for a received packet, or
+// should fill in, for one being sent.
+#define MBUF_CSUM_IP  0x1
+#define MBUF_CSUM_UDP 0x2
+
 char *mbufpull(struct mbuf *m, unsigned int len);
 char *mbufpush(struct mbuf *m, unsigned int len);
 char *mbufput(struct mbuf *m, unsigned int len);
@@ -32,6 +42,7 @@ char *mbuftrim(struct mbuf *m, unsigned int len);
 
 struct mbuf *mbufalloc(unsigned int headroom);
 void mbuffree(struct mbuf *m);
+void mbufreturn(struct mbuf *m);
 
 struct mbufq {
   struct mbuf *head;  // the first element in the queue
@@ -0,0 +1,45 @@
+// Counters for the network stack, kept per CPU and printed by netstats() for the statistics
+// device.
+
+struct netstat {
+  uint64 rx_packets;   // frames the e1000 received and handed to the stack
+  uint64 rx_bytes;
+  uint64 rx_nombuf;    // frames dropped for want of an mbuf to refill the ring with
+  uint64 rx_csum;      // packets dropped for a bad IP or UDP checksum
+  uint64 rx_bad;       // packets dropped as malformed, or of a protocol the stack doesn't handle
+  uint64 rx_noport;    // UDP datagrams for which there is no socket
+  uint64 rx_sockfull;  // UDP datagrams dropped because their socket's rxq was full
+  uint64 tx_packets;   // frames queued on the e1000's transmit ring
+  uint64 tx_bytes;
+  uint64 tx_ringfull;  // sends that found the transmit ring full
+  uint64 arp_rx;       // ARP packets received
+  uint64 arp_tx;       // and sent
+  uint64 arp_miss;     // IP packets that had to wait for an ARP reply
+  uint64 arp_drop;     // and those dropped because too many were waiting
+#ifdef NETTRACE
+  uint64 lat_n;        // datagrams read, whose latencies are summed below, in mtime cycles
+  uint64 lat_stack;    // from e1000_recv() to the socket's rxq
+  uint64 lat_read;     // from the rxq to a read
+  uint64 lat_max;      // the longest from e1000_recv() to a read
+#endif
+} __attribute__((aligned(64)));
+
+extern struct netstat netstats_cpu[NCPU];
+
+// With NETTRACE, received packets are stamped with mtime at e1000_recv() (0) and at the socket's
+// rxq (1), and nettrace_read() adds up the latencies once they are read.
+#ifdef NETTRACE
+#define NETTRACE_STAMP(m, i) ((m)->stamp[i] = r_time())
+void nettrace_read(struct mbuf *);
+#else
+#define NETTRACE_STAMP(m, i)
+#define nettrace_read(m)
+#endif
+
+// Add n to this CPU's counter for the given event.
+#define NETSTAT_ADD(event, n)              \
+  do {                                     \
+    push_off();                            \
+    netstats_cpu[cpuid()].event += (n);    \
+    pop_off();                             \
+  } while (0)
@@ -0,0 +1,23 @@
+// Per-page metadata for allocatable physical memory. See kalloc.c.
+
+// Page flags.
+#define PG_BUDDY  0x1 // the page starts a free block in the buddy allocator; see order
+#define PG_ZEROED 0x2 // the page is in a CPU's pool of zeroed pages
+#define PG_DIRTY  0x4 // the page's contents differ from its backing store
+#define PG_PINNED 0x8 // the page must not be reclaimed or moved
+
+// Terminates an LRU list.
+#define PG_NONE 0xffffffff
+
+// There is one of these for every page from the end of the page array up to PHYSTOP, so keep it
+// small: four fit in a cache line.
+struct page {
+  uint   refcount; // Number of references, maintained with atomics
+  uchar  owner;    // CPU whose freelist or zeroed pool the page was last put on
+  uchar  order;    // Block order, if PG_BUDDY is set
+  ushort flags;    // PG_ flags
+
+  // Neighbours on an LRU list, as indices into the page array, or PG_NONE.
+  uint lru_next;
+  uint lru_prev;
+};
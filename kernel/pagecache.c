@@ -0,0 +1,256 @@
+// Page cache for file-backed mappings.
+//
+// Every page of a file that has been faulted in by mmap is kept in the cache, indexed by its
+// inode and page offset, so that all mappings of the same file range share one physical page.
+// The cache holds one reference to the page (see struct page), and every mapping holds another,
+// so a page outlives both munmap() and the cache dropping it for as long as anyone still maps it.
+//
+// A cached page is always at least as new as the disk: readi() reads through it, writei() writes
+// through it, and MAP_SHARED mappings write into it directly. MAP_PRIVATE mappings map it
+// copy-on-write.
+//
+// Pages enter the cache only through pagecache_get(), with the inode locked. They leave it when
+// the inode is truncated, when its last in-memory reference goes away, or when no mapping uses
+// them and kalloc() runs out of memory.
+
+#include "types.h"
+#include "param.h"
+#include "riscv.h"
+#include "spinlock.h"
+#include "sleeplock.h"
+#include "fs.h"
+#include "file.h"
+#include "page.h"
+#include "slab.h"
+#include "defs.h"
+
+#define NPCHASH 127
+
+struct cpage {
+  struct inode *ip;     // File this page belongs to
+  uint          pgoff;  // Page index within the file
+  uint64        pa;     // Physical page, holding one reference for the cache
+  struct cpage *hnext;  // Next page in the same hash bucket
+  struct cpage *inext;  // Next cached page of the same inode
+};
+
+static struct {
+  struct spinlock   lock;  // Protects the hash table and every inode's page list
+  struct cpage     *hash[NPCHASH];
+  struct kmem_cache cache;
+} pcache;
+
+void
+pagecacheinit(void)
+{
+  initlock(&pcache.lock, "pcache");
+  kmem_cache_init(&pcache.cache, "pcpage", sizeof(struct cpage));
+}
+
+static inline uint
+pchash(struct inode *ip, uint pgoff)
+{
+  return (((uint64)ip >> 4) ^ pgoff) % NPCHASH;
+}
+
+// Must be called with pcache.lock held.
+static struct cpage *
+pclookup(struct inode *ip, uint pgoff)
+{
+  for (struct cpage *cp = pcache.hash[pchash(ip, pgoff)]; cp; cp = cp->hnext) {
+    if (cp->ip == ip && cp->pgoff == pgoff) {
+      return cp;
+    }
+  }
+
+  return 0;
+}
+
+// Unlink cp from its hash bucket, and from its inode's list unless the caller is walking that list
+// itself. Must be called with pcache.lock held.
+static void
+pcunlink(struct cpage *cp, int from_inode)
+{
+  struct cpage **pp = &pcache.hash[pchash(cp->ip, cp->pgoff)];
+
+  while (*pp != cp) {
+    pp = &(*pp)->hnext;
+  }
+
+  *pp = cp->hnext;
+
+  if (from_inode) {
+    for (pp = &cp->ip->pcpages; *pp != cp; pp = &(*pp)->inext) {
+    }
+
+    *pp = cp->inext;
+  }
+
+  cp->ip->npcpages--;
+}
+
+// Return the physical address of page pgoff of ip, reading it from disk into the cache if it isn't
+// there yet, with a reference added for the caller. Returns 0 if out of memory. The caller must
+// hold ip's lock, which keeps two faults from filling the same page twice.
+uint64
+pagecache_get(struct inode *ip, uint pgoff)
+{
+  acquire(&pcache.lock);
+
+  struct cpage *cp = pclookup(ip, pgoff);
+
+  if (cp) {
+    kincrementrefcount((void *)cp->pa);
+    release(&pcache.lock);
+
+    return cp->pa;
+  }
+
+  release(&pcache.lock);
+
+  uint64 pa = (uint64)kalloc_zeroed();
+
+  if (pa == 0) {
+    return 0;
+  }
+
+  if ((cp = kmem_cache_alloc(&pcache.cache)) == 0) {
+    kfree((void *)pa);
+
+    return 0;
+  }
+
+  if ((uint64)pgoff * PGSIZE < ip->size) {
+    uint n = ip->size - pgoff * PGSIZE;
+
+    readi(ip, 0, pa, pgoff * PGSIZE, n > PGSIZE ? PGSIZE : n);
+  }
+
+  cp->ip    = ip;
+  cp->pgoff = pgoff;
+  cp->pa    = pa;
+
+  acquire(&pcache.lock);
+
+  uint h = pchash(ip, pgoff);
+
+  cp->hnext      = pcache.hash[h];
+  pcache.hash[h] = cp;
+  cp->inext      = ip->pcpages;
+  ip->pcpages    = cp;
+  ip->npcpages++;
+
+  // one reference for the cache, one for the caller
+  kincrementrefcount((void *)pa);
+  release(&pcache.lock);
+
+  return pa;
+}
+
+// Look up the cached page holding file offset off of ip, with a reference added for the caller so
+// that it can be used without pcache.lock. Returns 0 if the page isn't cached.
+static uint64
+pagecache_peek(struct inode *ip, uint off)
+{
+  acquire(&pcache.lock);
+
+  struct cpage *cp = pclookup(ip, off / PGSIZE);
+  uint64        pa = 0;
+
+  if (cp) {
+    pa = cp->pa;
+    kincrementrefcount((void *)pa);
+  }
+
+  release(&pcache.lock);
+
+  return pa;
+}
+
+// Copy n bytes at file offset off of ip to dst, if they are in the cache. The bytes must not cross
+// a page boundary. Returns 1 if copied, 0 if the page isn't cached, or -1 if the copy failed.
+int
+pagecache_read(struct inode *ip, int user_dst, uint64 dst, uint off, uint n)
+{
+  uint64 pa = pagecache_peek(ip, off);
+
+  if (pa == 0) {
+    return 0;
+  }
+
+  int r = either_copyout(user_dst, dst, (void *)(pa + off % PGSIZE), n) == -1 ? -1 : 1;
+
+  kfree((void *)pa);
+
+  return r;
+}
+
+// Bring the cached copy of n bytes at file offset off of ip, if there is one, up to date with src,
+// which writei() has just written to disk. The bytes must not cross a page boundary.
+void
+pagecache_write(struct inode *ip, void *src, uint off, uint n)
+{
+  uint64 pa = pagecache_peek(ip, off);
+
+  if (pa == 0) {
+    return;
+  }
+
+  memmove((void *)(pa + off % PGSIZE), src, n);
+  kfree((void *)pa);
+}
+
+// Drop every cached page of ip. Pages still mapped somewhere stay valid for those mappings, but
+// later faults will read the file afresh. Called when ip is truncated, and when its last reference
+// goes away.
+void
+pagecache_drop(struct inode *ip)
+{
+  acquire(&pcache.lock);
+
+  while (ip->pcpages) {
+    struct cpage *cp = ip->pcpages;
+
+    ip->pcpages = cp->inext;
+    pcunlink(cp, 0);
+
+    kfree((void *)cp->pa);
+    kmem_cache_free(&pcache.cache, cp);
+  }
+
+  release(&pcache.lock);
+}
+
+// Free every cached page that no mapping uses. Returns the number of pages freed.
+int
+pagecache_reclaim(void)
+{
+  int freed = 0;
+
+  acquire(&pcache.lock);
+
+  for (int h = 0; h < NPCHASH; h++) {
+    struct cpage **pp = &pcache.hash[h];
+
+    while (*pp) {
+      struct cpage *cp = *pp;
+
+      // new references are only taken under pcache.lock, so a refcount of 1 can't go back up
+      if (pa2page(cp->pa)->refcount != 1) {
+        pp = &cp->hnext;
+
+        continue;
+      }
+
+      pcunlink(cp, 1);
+
+      kfree((void *)cp->pa);
+      kmem_cache_free(&pcache.cache, cp);
+      freed++;
+    }
+  }
+
+  release(&pcache.lock);
+
+  return freed;
+}
@@ -1,15 +1,33 @@
 #define NPROC        64  // maximum number of processes (speedsup bigfile)
 #define NCPU          8  // maximum number of CPUs
-#define NOFILE       16  // open files per process
-#define NFILE       100  // open files per system
-#define NINODE       50  // maximum number of active i-nodes
+#define NPRIO         3  // scheduling priorities, see setpriority()
+#ifndef TICKHZ
+#define TICKHZ       10  // clock ticks per second; TICKHZ= in the Makefile
+#endif
+#define TIMEHZ 10000000  // rate of the time CSR and the CLINT's mtime in qemu
+#define TICKCYCLES (TIMEHZ / TICKHZ)  // timer cycles per tick
+#define SLICETICKS ((TICKHZ + 9) / 10)  // ticks per scheduling slice, about 1/10th second
+#define NOFILE       16  // open files a process's fd table starts with room for
+#define NOFILEMAX  4096  // open files per process, at most 64*64
+#ifndef NFILE
+#define NFILE      4096  // open files per system; NFILE= in the Makefile
+#endif
+#define NINODE      500  // maximum number of in-memory i-nodes
 #define NDEV         10  // maximum major device number
 #define ROOTDEV       1  // device number of file system root disk
+#define TMPDEV        2  // device number of the RAM disk mounted on /tmp
+#define NFSDEV        3  // file system devices are numbered below this
 #define MAXARG       32  // max exec arguments
 #define MAXOPBLOCKS  10  // max # of blocks any FS op writes
-#define LOGSIZE      (MAXOPBLOCKS*3)  // max data blocks in on-disk log
-#define NBUF         (MAXOPBLOCKS*3)  // size of disk block cache
+#define LOGSIZE      LOGMAX  // data blocks in on-disk log made by mkfs
+#define LOGMAX       254  // max data blocks in on-disk log; the header fills a block
+#define NBUF         (LOGSIZE*3)  // minimum size of disk block cache
 #define FSSIZE       200000  // size of file system in blocks
+#define TMPFSSIZE    2048  // size of the /tmp file system in blocks
+#define SWAPSIZE    32768  // blocks of swap space that mkfs puts after the file system
 #define MAXPATH      128   // maximum file path name
+#define KMAXORDER    10    // largest kalloc_pages() block is 2^KMAXORDER pages
+#define MMAP_FAULTAROUND 16 // most pages an mmap page fault maps at once
+#define READAHEAD    16    // most blocks read ahead of a sequential reader
 
 
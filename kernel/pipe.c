@@ -7,18 +7,47 @@
 #include "fs.h"
 #include "sleeplock.h"
 #include "file.h"
+#include "slab.h"
+#include "fcntl.h"
+#include "poll.h"
 
-#define PIPESIZE 512
+// A pipe holds its data in a ring of up to maxbuf pages, each of
+// them a pipebuf. Writes fill the last page before starting a new
+// one, and reads empty pages from the front, copying whole spans
+// at a time. vmsplice() can also queue a page of the writer's own,
+// shared copy-on-write rather than copied; see uvmgift().
+
+#define PIPEPAGES    4   // default capacity, in pages
+#define PIPEMAXPAGES 16  // most that F_SETPIPE_SZ allows
+
+struct pipebuf {
+  uint64 pa;   // the page
+  uint off;    // where its unread data starts
+  uint len;    // bytes of unread data
+  int gift;    // lent by vmsplice(), so not to be written to
+};
 
 struct pipe {
   struct spinlock lock;
-  char data[PIPESIZE];
+  struct pipebuf buf[PIPEMAXPAGES];
+  uint head;      // buf[head % PIPEMAXPAGES] is the oldest in use
+  uint nbuf;      // bufs in use
+  uint maxbuf;    // capacity, in pages
+  char *spare;    // a page kept for the next buf, if not 0
   uint nread;     // number of bytes read
   uint nwrite;    // number of bytes written
   int readopen;   // read fd is still open
   int writeopen;  // write fd is still open
 };
 
+static struct kmem_cache pipe_cache;
+
+void
+pipeinit(void)
+{
+  kmem_cache_init(&pipe_cache, "pipe_cache", sizeof(struct pipe));
+}
+
 int
 pipealloc(struct file **f0, struct file **f1)
 {
@@ -28,12 +57,16 @@ pipealloc(struct file **f0, struct file **f1)
   *f0 = *f1 = 0;
   if((*f0 = filealloc()) == 0 || (*f1 = filealloc()) == 0)
     goto bad;
-  if((pi = (struct pipe*)kalloc()) == 0)
+  if((pi = kmem_cache_alloc(&pipe_cache)) == 0)
     goto bad;
   pi->readopen = 1;
   pi->writeopen = 1;
   pi->nwrite = 0;
   pi->nread = 0;
+  pi->head = 0;
+  pi->nbuf = 0;
+  pi->maxbuf = PIPEPAGES;
+  pi->spare = 0;
   initlock(&pi->lock, "pipe");
   (*f0)->type = FD_PIPE;
   (*f0)->readable = 1;
@@ -47,7 +80,7 @@ pipealloc(struct file **f0, struct file **f1)
 
  bad:
   if(pi)
-    kfree((char*)pi);
+    kmem_cache_free(&pipe_cache, pi);
   if(*f0)
     fileclose(*f0);
   if(*f1)
@@ -66,19 +99,68 @@ pipeclose(struct pipe *pi, int writable)
     pi->readopen = 0;
     wakeup(&pi->nwrite);
   }
+  pollwakeup();
   if(pi->readopen == 0 && pi->writeopen == 0){
     release(&pi->lock);
     freelock(&pi->lock);
-    kfree((char*)pi);
+    for(uint i = 0; i < pi->nbuf; i++)
+      kfree((void*)pi->buf[(pi->head + i) % PIPEMAXPAGES].pa);
+    if(pi->spare)
+      kfree(pi->spare);
+    kmem_cache_free(&pipe_cache, pi);
   } else
     release(&pi->lock);
 }
 
+// The buf that writes go to next, if there is one.
+static struct pipebuf*
+pipelast(struct pipe *pi)
+{
+  if(pi->nbuf == 0)
+    return 0;
+  return &pi->buf[(pi->head + pi->nbuf - 1) % PIPEMAXPAGES];
+}
+
+// Add a buf for page pa, with len bytes in it.
+static void
+pipepush(struct pipe *pi, uint64 pa, uint len, int gift)
+{
+  struct pipebuf *b = &pi->buf[(pi->head + pi->nbuf++) % PIPEMAXPAGES];
+
+  b->pa = pa;
+  b->off = 0;
+  b->len = len;
+  b->gift = gift;
+  pi->nwrite += len;
+}
+
+// Whether a write to pi would find room.
+static int
+pipefull(struct pipe *pi)
+{
+  struct pipebuf *b = pipelast(pi);
+
+  if(b && !b->gift && b->off + b->len < PGSIZE)
+    return 0;
+  return pi->nbuf == pi->maxbuf;
+}
+
+// Write n bytes from addr, a user virtual address if user_src
+// is set, or else a kernel one. If gift is set, whole pages of
+// the user's are queued by reference where possible, for
+// vmsplice(). If nonblock is set, returns what fitted rather
+// than sleeping, or -1 if nothing did.
 int
-pipewrite(struct pipe *pi, uint64 addr, int n)
+pipewrite(struct pipe *pi, int user_src, uint64 addr, int n, int gift, int nonblock)
 {
   int i = 0;
   struct proc *pr = myproc();
+  struct pipebuf *b;
+
+  // the copies below are made holding pi->lock, so they can't
+  // read pages in from a file or from swap.
+  if(user_src && n > 0)
+    uvmprefault(addr, n, 0);
 
   acquire(&pi->lock);
   while(i < n){
@@ -86,46 +168,153 @@ pipewrite(struct pipe *pi, uint64 addr, int n)
       release(&pi->lock);
       return -1;
     }
-    if(pi->nwrite == pi->nread + PIPESIZE){ //DOC: pipewrite-full
+    b = pipelast(pi);
+    if(b && !b->gift && b->off + b->len < PGSIZE){
+      // copy as much as fits in the last page.
+      uint m = PGSIZE - (b->off + b->len);
+      if(m > n - i)
+        m = n - i;
+      if(either_copyin((char*)b->pa + b->off + b->len, user_src, addr + i, m) == -1)
+        break;
+      b->len += m;
+      pi->nwrite += m;
+      i += m;
+    } else if(pi->nbuf == pi->maxbuf){ //DOC: pipewrite-full
+      if(nonblock){
+        if(i == 0)
+          i = -1;
+        break;
+      }
       wakeup(&pi->nread);
+      pollwakeup();
       sleep(&pi->nwrite, &pi->lock);
+    } else if(gift && user_src && (addr + i) % PGSIZE == 0 && n - i >= PGSIZE){
+      // the TLB shootdown that lending a page may need can't
+      // wait while this holds a spinlock.
+      release(&pi->lock);
+      uint64 pa = uvmgift(pr, addr + i);
+      acquire(&pi->lock);
+      if(pa == 0){
+        gift = 0;  // copy the rest
+      } else if(pi->nbuf == pi->maxbuf || pi->readopen == 0){
+        kfree((void*)pa);  // and look again
+      } else {
+        pipepush(pi, pa, PGSIZE, 1);
+        i += PGSIZE;
+      }
     } else {
-      char ch;
-      if(copyin(pr->pagetable, &ch, addr + i, 1) == -1)
+      char *pa = pi->spare;
+      if(pa)
+        pi->spare = 0;
+      else if((pa = kalloc()) == 0)
         break;
-      pi->data[pi->nwrite++ % PIPESIZE] = ch;
-      i++;
+      pipepush(pi, (uint64)pa, 0, 0);
     }
   }
   wakeup(&pi->nread);
+  pollwakeup();
   release(&pi->lock);
 
   return i;
 }
 
+// Read up to n bytes into user address addr. If nonblock is set,
+// returns -1 rather than sleep while the pipe is empty.
 int
-piperead(struct pipe *pi, uint64 addr, int n)
+piperead(struct pipe *pi, uint64 addr, int n, int nonblock)
 {
-  int i;
+  int i = 0;
   struct proc *pr = myproc();
-  char ch;
+  struct pipebuf *b;
+
+  // as in pipewrite(); no more can be read than the pipe holds.
+  if(n > 0)
+    uvmprefault(addr, n < PIPEMAXPAGES*PGSIZE ? n : PIPEMAXPAGES*PGSIZE, 1);
 
   acquire(&pi->lock);
   while(pi->nread == pi->nwrite && pi->writeopen){  //DOC: pipe-empty
-    if(killed(pr)){
+    if(killed(pr) || nonblock){
       release(&pi->lock);
       return -1;
     }
     sleep(&pi->nread, &pi->lock); //DOC: piperead-sleep
   }
-  for(i = 0; i < n; i++){  //DOC: piperead-copy
-    if(pi->nread == pi->nwrite)
-      break;
-    ch = pi->data[pi->nread++ % PIPESIZE];
-    if(copyout(pr->pagetable, addr + i, &ch, 1) == -1)
+  while(i < n && pi->nread != pi->nwrite){  //DOC: piperead-copy
+    b = &pi->buf[pi->head % PIPEMAXPAGES];
+    uint m = b->len;
+    if(m > n - i)
+      m = n - i;
+    if(copyout(pr->pagetable, addr + i, (char*)b->pa + b->off, m) == -1)
       break;
+    b->off += m;
+    b->len -= m;
+    pi->nread += m;
+    i += m;
+    if(b->len > 0)
+      continue;
+    if(b->gift || b->off == PGSIZE){
+      // every buf but the last is full, or lent, so the data
+      // goes on in the next one.
+      if(!b->gift && pi->spare == 0)
+        pi->spare = (char*)b->pa;
+      else
+        kfree((void*)b->pa);
+      pi->head++;
+      pi->nbuf--;
+    } else {
+      // the last buf, which writes can fill from the start again.
+      b->off = 0;
+    }
   }
   wakeup(&pi->nwrite);  //DOC: piperead-wakeup
+  pollwakeup();
   release(&pi->lock);
   return i;
 }
+
+// What the read end, or the write end if writable is set, of pi
+// is ready for; see filepoll().
+int
+pipepoll(struct pipe *pi, int writable)
+{
+  int r = 0;
+
+  acquire(&pi->lock);
+  if(writable){
+    if(!pi->readopen)
+      r = POLLHUP;
+    else if(!pipefull(pi))
+      r = POLLOUT;
+  } else {
+    if(pi->nread != pi->nwrite)
+      r |= POLLIN;
+    if(!pi->writeopen)
+      r |= POLLHUP;
+  }
+  release(&pi->lock);
+  return r;
+}
+
+// fcntl() for a pipe: F_GETPIPE_SZ returns its capacity in bytes,
+// and F_SETPIPE_SZ sets it to at least arg bytes, up to
+// PIPEMAXPAGES pages, and returns the new capacity. Shrinking below
+// what the pipe holds now fails.
+int
+pipefcntl(struct pipe *pi, int cmd, int arg)
+{
+  int r = -1;
+
+  acquire(&pi->lock);
+  if(cmd == F_GETPIPE_SZ){
+    r = pi->maxbuf * PGSIZE;
+  } else if(cmd == F_SETPIPE_SZ && arg >= 0 && arg <= PIPEMAXPAGES * PGSIZE){
+    uint npages = arg <= PGSIZE ? 1 : (arg + PGSIZE - 1) / PGSIZE;
+    if(npages >= pi->nbuf){
+      pi->maxbuf = npages;
+      r = npages * PGSIZE;
+      wakeup(&pi->nwrite);
+    }
+  }
+  release(&pi->lock);
+  return r;
+}
@@ -0,0 +1,140 @@
+// Waiting for any of several files at once.
+//
+// sleep() waits for one channel, so poll() doesn't wait on the channels of the files it watches.
+// Instead, whatever may make a pipe, socket or the console ready calls pollwakeup(), which bumps
+// pollseq and wakes every process in poll(), and each of them looks at its files again. pollwakeup()
+// costs one atomic load while no one polls.
+//
+// A poller reads pollseq before it looks at its files, and sleeps only if pollseq hasn't changed
+// since, under polllock, so a file that becomes ready while it looks isn't missed.
+
+#include "types.h"
+#include "param.h"
+#include "memlayout.h"
+#include "riscv.h"
+#include "spinlock.h"
+#include "proc.h"
+#include "defs.h"
+#include "fs.h"
+#include "sleeplock.h"
+#include "file.h"
+#include "poll.h"
+
+static struct spinlock polllock;
+static uint            pollseq;   // bumped by pollwakeup(); set with polllock held
+static int             npollers;  // processes in poll()
+
+void
+pollinit(void)
+{
+  initlock(&polllock, "poll");
+}
+
+static void
+pollbump(void)
+{
+  acquire(&polllock);
+  pollseq++;
+  wakeup(&pollseq);
+  release(&polllock);
+}
+
+// Tell the processes in poll(), if any, that a file may have become ready. May be called from
+// interrupts, and with the file's own lock held.
+void
+pollwakeup(void)
+{
+  if (__atomic_load_n(&npollers, __ATOMIC_SEQ_CST) == 0) {
+    return;
+  }
+
+  pollbump();
+}
+
+static void
+polltimeout(struct timer *t)
+{
+  pollbump();
+}
+
+// Fill in the revents of the n entries of fds for p's files. Returns how many are not 0.
+static int
+pollscan(struct proc *p, struct pollfd *fds, int n)
+{
+  int ready = 0;
+
+  for (int i = 0; i < n; i++) {
+    struct file *f;
+
+    fds[i].revents = 0;
+
+    if (fds[i].fd < 0) {
+      continue;
+    }
+
+    if ((f = fget(p->fdt, fds[i].fd)) == 0) {
+      fds[i].revents = POLLNVAL;
+    } else {
+      fds[i].revents = filepoll(f) & (fds[i].events | POLLHUP);
+      fput(f);
+    }
+
+    if (fds[i].revents) {
+      ready++;
+    }
+  }
+
+  return ready;
+}
+
+// Wait until one of the n files in fds is ready for what its events ask, or until timeout
+// milliseconds have passed, or forever if timeout is negative. Fills in each entry's revents, and
+// returns how many are ready, 0 on timeout, or -1 if killed.
+int
+poll(struct pollfd *fds, int n, int timeout)
+{
+  struct proc *p  = myproc();
+  struct timer  t = {.fn = polltimeout};
+  int ready;
+
+  __atomic_fetch_add(&npollers, 1, __ATOMIC_SEQ_CST);
+
+  if (timeout > 0) {
+    t.deadline = r_time() + (uint64)timeout * (TIMEHZ / 1000);
+    timer_add(&t);
+  }
+
+  for (;;) {
+    uint seq = __atomic_load_n(&pollseq, __ATOMIC_SEQ_CST);
+
+    if ((ready = pollscan(p, fds, n)) > 0 || timeout == 0) {
+      break;
+    }
+
+    if (timeout > 0 && r_time() >= t.deadline) {
+      break;
+    }
+
+    acquire(&polllock);
+
+    if (killed(p)) {
+      release(&polllock);
+      ready = -1;
+      break;
+    }
+
+    if (pollseq == seq) {
+      sleep(&pollseq, &polllock);
+    }
+
+    release(&polllock);
+  }
+
+  if (timeout > 0) {
+    timer_cancel(&t);
+  }
+
+  __atomic_fetch_sub(&npollers, 1, __ATOMIC_SEQ_CST);
+
+  return ready;
+}
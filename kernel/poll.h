@@ -0,0 +1,14 @@
+// poll() waits until one of a set of file descriptors is ready.
+
+#define NPOLL 64  // most file descriptors one poll() takes
+
+#define POLLIN   0x01  // read won't sleep
+#define POLLOUT  0x04  // write won't sleep
+#define POLLHUP  0x10  // the other end is closed
+#define POLLNVAL 0x20  // fd isn't open
+
+struct pollfd {
+  int fd;
+  short events;   // what to wait for, POLLIN and POLLOUT
+  short revents;  // what is ready, or POLLHUP or POLLNVAL
+};
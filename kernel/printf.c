@@ -17,12 +17,146 @@
 
 volatile int panicked = 0;
 
-// lock to avoid interleaving concurrent printf's.
+// printf() goes through pr.locking's path once printfinit() has run,
+// and synchronously to the uart before that and after a panic.
 static struct {
-  struct spinlock lock;
   int locking;
 } pr;
 
+//
+// The kernel log. printf() formats into a per-CPU line buffer with
+// interrupts off, so it needs no lock, and then copies the message
+// into klog's ring at a place reserved with an atomic add. Messages
+// are committed in the order their places were reserved, so a writer
+// may wait briefly for one that reserved before it to finish copying.
+// The uart driver sends the ring out as the uart has room, and the
+// dmesg device reads it. Both readers skip what has been overwritten
+// if they fall more than KLOGSZ bytes behind.
+//
+
+#define KLOGSZ   16384          // a power of 2
+#define KLOGLINE 256            // longest message a CPU formats before committing part of it
+
+static struct {
+  char buf[KLOGSZ];
+  uint64 reserve;               // bytes reserved by writers, ever
+  uint64 commit;                // bytes written, in reservation order
+  uint64 uart;                  // bytes sent to the uart; uart_tx_lock protects it
+  uint64 dmesg;                 // bytes read through the dmesg device
+  struct spinlock dmesglock;
+} klog;
+
+static struct {
+  char buf[KLOGLINE];
+  int n;
+} klogcpu[NCPU];
+
+// Copy this CPU's line buffer into the ring. Interrupts must be off.
+static void
+klogcommit(void)
+{
+  char *s = klogcpu[cpuid()].buf;
+  int n = klogcpu[cpuid()].n;
+  uint64 pos;
+
+  if(n == 0)
+    return;
+  pos = __atomic_fetch_add(&klog.reserve, n, __ATOMIC_RELAXED);
+  for(int i = 0; i < n; i++)
+    klog.buf[(pos + i) % KLOGSZ] = s[i];
+  while(__atomic_load_n(&klog.commit, __ATOMIC_ACQUIRE) != pos)
+    ;
+  __atomic_store_n(&klog.commit, pos + n, __ATOMIC_RELEASE);
+  klogcpu[cpuid()].n = 0;
+}
+
+// Copy up to n committed bytes from *off on into dst, advancing *off
+// past them and past anything that has been overwritten. Returns how
+// many were copied.
+static int
+klogcopy(uint64 *off, char *dst, int n)
+{
+  uint64 commit = __atomic_load_n(&klog.commit, __ATOMIC_ACQUIRE);
+  int m;
+
+  for(;;){
+    if(commit - *off > KLOGSZ)
+      *off = commit - KLOGSZ;
+    m = commit - *off;
+    if(m > n)
+      m = n;
+    for(int i = 0; i < m; i++)
+      dst[i] = klog.buf[(*off + i) % KLOGSZ];
+    // a writer may have reserved the space we copied from meanwhile
+    __sync_synchronize();
+    if(__atomic_load_n(&klog.reserve, __ATOMIC_RELAXED) - *off <= KLOGSZ)
+      break;
+    commit = __atomic_load_n(&klog.commit, __ATOMIC_ACQUIRE);
+    *off = commit - KLOGSZ / 2;
+  }
+  *off += m;
+  return m;
+}
+
+// The next byte of the log for the uart, or -1 if it has sent it all.
+// The caller must hold uart_tx_lock.
+int
+klogget(void)
+{
+  char c;
+
+  if(klogcopy(&klog.uart, &c, 1) == 0)
+    return -1;
+  return c & 0xff;
+}
+
+// Send what the uart hasn't yet, synchronously, for panic().
+static void
+klogflush(void)
+{
+  int c;
+
+  while((c = klogget()) >= 0)
+    uartputc_sync(c);
+}
+
+// Read the log through the dmesg device, from where the last read
+// left off, or from the oldest message still in the ring.
+static int
+dmesgread(int user_dst, uint64 dst, int n)
+{
+  char buf[128];
+  int m, tot = 0;
+
+  if(user_dst)
+    uvmprefault(dst, n < KLOGSZ ? n : KLOGSZ, 1);
+  acquire(&klog.dmesglock);
+  while(tot < n){
+    m = klogcopy(&klog.dmesg, buf, n - tot < sizeof(buf) ? n - tot : sizeof(buf));
+    if(m == 0)
+      break;
+    if(either_copyout(user_dst, dst + tot, buf, m) == -1){
+      tot = tot ? tot : -1;
+      break;
+    }
+    tot += m;
+  }
+  release(&klog.dmesglock);
+  return tot;
+}
+
+static void
+kputc(int c)
+{
+  if(!pr.locking){
+    consputc(c);
+    return;
+  }
+  if(klogcpu[cpuid()].n == KLOGLINE)
+    klogcommit();
+  klogcpu[cpuid()].buf[klogcpu[cpuid()].n++] = c;
+}
+
 static char digits[] = "0123456789abcdef";
 
 static void
@@ -46,17 +180,17 @@ printint(int xx, int base, int sign)
     buf[i++] = '-';
 
   while(--i >= 0)
-    consputc(buf[i]);
+    kputc(buf[i]);
 }
 
 static void
 printptr(uint64 x)
 {
   int i;
-  consputc('0');
-  consputc('x');
+  kputc('0');
+  kputc('x');
   for (i = 0; i < (sizeof(uint64) * 2); i++, x <<= 4)
-    consputc(digits[x >> (sizeof(uint64) * 8 - 4)]);
+    kputc(digits[x >> (sizeof(uint64) * 8 - 4)]);
 }
 
 // Print to the console. only understands %d, %x, %p, %s.
@@ -69,7 +203,9 @@ printf(char *fmt, ...)
 
   locking = pr.locking;
   if(locking)
-    acquire(&pr.lock);
+    push_off();
+  else
+    klogflush();  // what was logged before goes out first
 
   if (fmt == 0)
     panic("null fmt");
@@ -77,7 +213,7 @@ printf(char *fmt, ...)
   va_start(ap, fmt);
   for(i = 0; (c = fmt[i] & 0xff) != 0; i++){
     if(c != '%'){
-      consputc(c);
+      kputc(c);
       continue;
     }
     c = fmt[++i] & 0xff;
@@ -97,22 +233,25 @@ printf(char *fmt, ...)
       if((s = va_arg(ap, char*)) == 0)
         s = "(null)";
       for(; *s; s++)
-        consputc(*s);
+        kputc(*s);
       break;
     case '%':
-      consputc('%');
+      kputc('%');
       break;
     default:
       // Print unknown % sequence to draw attention.
-      consputc('%');
-      consputc(c);
+      kputc('%');
+      kputc(c);
       break;
     }
   }
   va_end(ap);
 
-  if(locking)
-    release(&pr.lock);
+  if(locking){
+    klogcommit();
+    pop_off();
+    uartkick();
+  }
 }
 
 void
@@ -131,27 +270,42 @@ panic(char *s)
 void
 printfinit(void)
 {
-  initlock(&pr.lock, "pr");
+  initlock(&klog.dmesglock, "dmesg");
+  devsw[DMESG].read = dmesgread;
   pr.locking = 1;
 }
 
-void
-backtrace(void)
+// Put up to n of the return addresses found by following the frame pointers from fp into pcs,
+// innermost first, stopping at the end of fp's stack page. Returns how many.
+int
+backtrace_walk(uint64 fp, uint64 *pcs, int n)
 {
-  // the address of the current frame pointer
-  uint64 fp = r_fp();
-
   // the beginning of the stack
-  uint64 stack_page = PGROUNDDOWN((uint64)fp);
-
-  printf("backtrace:\n");
+  uint64 stack_page = PGROUNDDOWN(fp);
+  int    i          = 0;
 
-  while (fp > stack_page) {
+  while (i < n && fp > stack_page && fp <= stack_page + PGSIZE) {
     uint64 ra      = *(uint64 *)(fp - 8);
     uint64 prev_fp = *(uint64 *)(fp - 16);
 
-    printf("%p\n", ra);
+    pcs[i++] = ra;
+    fp       = prev_fp;
+  }
+
+  return i;
+}
+
+void
+backtrace(void)
+{
+  uint64 pcs[32];
+
+  // start at the current frame pointer
+  int n = backtrace_walk(r_fp(), pcs, NELEM(pcs));
+
+  printf("backtrace:\n");
 
-    fp = prev_fp;
+  for (int i = 0; i < n; i++) {
+    printf("%p\n", pcs[i]);
   }
 }
@@ -9,6 +9,11 @@
 #include "proc.h"
 #include "file.h"
 #include "fcntl.h"
+#include "vm.h"
+#include "slab.h"
+#include "spawn.h"
+#include "sysinfo.h"
+#include "ktrace.h"
 
 struct cpu cpus[NCPU];
 
@@ -21,6 +26,77 @@ struct spinlock pid_lock;
 
 extern void forkret(void);
 static void freeproc(struct proc *p);
+static int mmattach(struct proc *p, struct mm *m);
+
+// Each CPU has a queue of RUNNABLE processes, which its
+// scheduler() takes the first of. A process goes on the queue of
+// the CPU it last ran on when it becomes RUNNABLE, or on the
+// shortest queue if it is new. A CPU with nothing to run, or that
+// hasn't done so for BALANCETICKS, moves a process to its own
+// queue from the longest one, if that is longer by two or more.
+// A process only runs on the CPUs in its affinity mask, which
+// setaffinity() sets; balancing never moves it off them.
+// A CPU with nothing to run waits in wfi, and setrunnable() kicks
+// it when it queues a process there, or on a busy CPU, since an
+// idle CPU no longer looks for work on its own.
+#define BALANCETICKS (2 * SLICETICKS)
+#define ALLCPUS      ((1UL << NCPU) - 1)
+
+// With MLFQ, each queue has a list for each of NLEVEL levels, and
+// scheduler() takes the first process of the highest level that
+// has one. A process uses up QUANTUM(level) slices at its level,
+// twice as many as at the level above, and then moves down a level.
+// A slice is SLICETICKS ticks, so the quanta are about 1/10th,
+// 2/10ths, 4/10ths... of a second at any TICKHZ. Every BOOSTTICKS
+// all processes go back to their highest level, prio, which
+// setpriority() sets.
+// Without MLFQ, there is one level, and every process gets one
+// slice at a time, round robin.
+#ifdef MLFQ
+#define NLEVEL         NPRIO
+#define BOOSTTICKS     (20 * SLICETICKS)
+#define QUANTUM(level) (1 << (level))
+#else
+#define NLEVEL         1
+#endif
+
+struct runq {
+  struct spinlock lock;
+  struct {
+    struct proc *head;
+    struct proc *tail;
+  } level[NLEVEL];
+  int n;               // processes on the queue
+} __attribute__((aligned(64)));  // a cache line each
+
+static struct runq runq[NCPU];
+static uint64 online;  // CPUs that have entered scheduler()
+
+// Processes not UNUSED, kept by allocproc() and freeproc() for
+// proccount(), and the load averages loadavg_tick() keeps.
+static uint nprocs;
+static uint64 loadavg[3];
+
+// A sleeping process is on the wait queue its chan hashes to, so
+// wakeup() need only look at processes that may be sleeping on
+// its chan. Lock order is a wait queue's lock, then p->lock.
+#define NWAITQ 61
+
+struct waitq {
+  struct spinlock lock;
+  struct proc *head;   // linked through wq_next
+};
+
+static struct waitq waitq[NWAITQ];
+
+// Where every address space's struct mm comes from.
+static struct kmem_cache mm_cache;
+
+static struct waitq*
+waitqof(void *chan)
+{
+  return &waitq[((uint64)chan >> 3) % NWAITQ];
+}
 
 extern char trampoline[]; // trampoline.S
 
@@ -55,6 +131,11 @@ procinit(void)
 
   initlock(&pid_lock, "nextpid");
   initlock(&wait_lock, "wait_lock");
+  for(int i = 0; i < NCPU; i++)
+    initlock(&runq[i].lock, "runq");
+  for(int i = 0; i < NWAITQ; i++)
+    initlock(&waitq[i].lock, "waitq");
+  kmem_cache_init(&mm_cache, "mm_cache", sizeof(struct mm));
   for(p = proc; p < &proc[NPROC]; p++) {
       initlock(&p->lock, "proc");
       p->state = UNUSED;
@@ -108,10 +189,12 @@ allocpid()
 
 // Look in the process table for an UNUSED proc.
 // If found, initialize state required to run in the kernel,
-// and return with p->lock held.
+// and return with p->lock held. The proc gets a new, empty
+// address space, or, if share is set, runs in share as well,
+// with its trapframe at its own THREADFRAME().
 // If there are no free procs, or a memory allocation fails, return 0.
 static struct proc*
-allocproc(void)
+allocproc(struct mm *share)
 {
   struct proc *p;
 
@@ -126,13 +209,21 @@ allocproc(void)
   return 0;
 
 found:
+  __atomic_fetch_add(&nprocs, 1, __ATOMIC_RELAXED);
   p->pid   = allocpid();
   p->state = USED;
+  p->cpu   = -1;
+  p->affinity = ALLCPUS;
+  p->prio  = 0;
+  p->level = 0;
+  p->slice = 0;
 
   // clear sigalarm()-related fields
-  p->alarm_interval = 0;
-  p->alarm_handler  = 0;
-  p->alarm_ticks    = 0;
+  p->alarm_interval  = 0;
+  p->alarm_handler   = 0;
+  p->alarm_ticks     = 0;
+  p->alarm_due       = 0;
+  p->alarm_inhandler = 0;
 
   // Allocate a trapframe page.
   if((p->trapframe = (struct trapframe *)kalloc()) == 0){
@@ -141,23 +232,23 @@ found:
     return 0;
   }
 
-  // Allocate a usyscall page
-  if ((p->usyscall = (struct usyscall *)kalloc()) == 0) {
-    freeproc(p);
-    release(&p->lock);
-    return 0;
-  }
-
-  // An empty user page table.
-  p->pagetable = proc_pagetable(p);
-  if(p->pagetable == 0){
-    freeproc(p);
-    release(&p->lock);
-    return 0;
+  if(share){
+    p->tfva = THREADFRAME(p - proc);
+    if(mmattach(p, share) < 0){
+      freeproc(p);
+      release(&p->lock);
+      return 0;
+    }
+  } else {
+    // An empty user page table.
+    p->tfva = TRAPFRAME;
+    if((p->mm = mmcreate(p)) == 0){
+      freeproc(p);
+      release(&p->lock);
+      return 0;
+    }
   }
-
-  // Initialize all usyscall values
-  p->usyscall->pid = p->pid;
+  p->pagetable = p->mm->pagetable;
 
   // Set up new context to start executing at forkret,
   // which returns to user space.
@@ -169,40 +260,42 @@ found:
 }
 
 // free a proc structure and the data hanging from it,
-// including user pages.
+// including user pages if no other thread uses them.
 // p->lock must be held.
 static void
 freeproc(struct proc *p)
 {
-  if (p->trapframe) {
-    kfree((void*)p->trapframe);
+  // the trapframe must be unmapped before it is freed.
+  if (p->mm) {
+    mmput(p->mm, p->tfva);
   }
 
-  if (p->usyscall) {
-    kfree((void *)p->usyscall);
-  }
-
-  if (p->pagetable) {
-    proc_freepagetable(p->pagetable, p->sz);
+  if (p->trapframe) {
+    kfree((void*)p->trapframe);
   }
 
   p->trapframe = 0;
-  p->usyscall = 0;
+  p->mm = 0;
   p->pagetable = 0;
-  p->sz = 0;
   p->pid = 0;
   p->parent = 0;
   p->name[0] = 0;
   p->chan = 0;
   p->killed = 0;
   p->xstate = 0;
+  p->hugeheap = 0;
+  memset(&p->ru, 0, sizeof(p->ru));
+  memset(&p->cru, 0, sizeof(p->cru));
+  uprof_free(p);
+  if(p->state != UNUSED)
+    __atomic_fetch_sub(&nprocs, 1, __ATOMIC_RELAXED);
   p->state = UNUSED;
 }
 
 // Create a user page table for a given process, with no user memory,
-// but with trampoline, trapframe, and usyscall pages.
-pagetable_t
-proc_pagetable(struct proc *p)
+// but with trampoline, trapframe, usyscall and ushared pages.
+static pagetable_t
+proc_pagetable(struct proc *p, struct usyscall *usyscall)
 {
   pagetable_t pagetable;
 
@@ -221,9 +314,9 @@ proc_pagetable(struct proc *p)
     return 0;
   }
 
-  // map the trapframe page just below the trampoline page, for
+  // map the trapframe page below the trampoline page, for
   // trampoline.S.
-  if(mappages(pagetable, TRAPFRAME, PGSIZE,
+  if(mappages(pagetable, p->tfva, PGSIZE,
               (uint64)(p->trapframe), PTE_R | PTE_W) < 0){
     uvmunmap(pagetable, TRAMPOLINE, 1, 0);
     uvmfree(pagetable, 0);
@@ -232,9 +325,20 @@ proc_pagetable(struct proc *p)
 
   // map the usyscall page as read-only at the USYSCALL address
   // this must be PTE_U so that ulib.c can actually access the address.
-  if (mappages(pagetable, USYSCALL, PGSIZE, (uint64)(p->usyscall),
+  if (mappages(pagetable, USYSCALL, PGSIZE, (uint64)usyscall,
                PTE_R | PTE_U) < 0) {
+    uvmunmap(pagetable, p->tfva, 1, 0);
+    uvmunmap(pagetable, TRAMPOLINE, 1, 0);
+    uvmfree(pagetable, 0);
+    return 0;
+  }
+
+  // map the one ushared page, read-only, below it.
+  if(mappages(pagetable, USHARED, PGSIZE, (uint64)ushared,
+              PTE_R | PTE_U) < 0){
     uvmunmap(pagetable, USYSCALL, 1, 0);
+    uvmunmap(pagetable, p->tfva, 1, 0);
+    uvmunmap(pagetable, TRAMPOLINE, 1, 0);
     uvmfree(pagetable, 0);
     return 0;
   }
@@ -244,15 +348,101 @@ proc_pagetable(struct proc *p)
 
 // Free a process's page table, and free the
 // physical memory it refers to.
-void
-proc_freepagetable(pagetable_t pagetable, uint64 sz)
+static void
+proc_freepagetable(pagetable_t pagetable, uint64 sz, uint64 tfva)
 {
   uvmunmap(pagetable, TRAMPOLINE, 1, 0);
-  uvmunmap(pagetable, TRAPFRAME, 1, 0);
+  uvmunmap(pagetable, tfva, 1, 0);
   uvmunmap(pagetable, USYSCALL, 1, 0);
+  uvmunmap(pagetable, USHARED, 1, 0);
   uvmfree(pagetable, sz);
 }
 
+// Create a new address space for p, with p's trapframe mapped at
+// p->tfva, and nothing else but the trampoline and usyscall
+// pages. p is its only user. Returns 0 if out of memory.
+struct mm*
+mmcreate(struct proc *p)
+{
+  struct mm *m;
+
+  if((m = kmem_cache_alloc(&mm_cache)) == 0)
+    return 0;
+  memset(m, 0, sizeof(*m));
+
+  if((m->usyscall = (struct usyscall *)kalloc()) == 0){
+    kmem_cache_free(&mm_cache, m);
+    return 0;
+  }
+  m->usyscall->pid = p->pid;
+  m->usyscall->ppid = p->parent ? p->parent->pid : 0;
+  m->usyscall->cpu = p->cpu;
+
+  if((m->pagetable = proc_pagetable(p, m->usyscall)) == 0){
+    kfree((void *)m->usyscall);
+    kmem_cache_free(&mm_cache, m);
+    return 0;
+  }
+
+  initsleeplock(&m->lock, "mm");
+  initlock(&m->ptlock, "mm pt");
+  m->users = 1;
+  m->ref = 1;
+  return m;
+}
+
+// Have p, a new thread, run in address space m too, with its
+// trapframe mapped at p->tfva. Returns 0, or -1 if out of memory.
+static int
+mmattach(struct proc *p, struct mm *m)
+{
+  acquire(&m->ptlock);
+  if(mappages(m->pagetable, p->tfva, PGSIZE,
+              (uint64)(p->trapframe), PTE_R | PTE_W) < 0){
+    release(&m->ptlock);
+    return -1;
+  }
+  m->ref++;
+  __atomic_add_fetch(&m->users, 1, __ATOMIC_SEQ_CST);
+  release(&m->ptlock);
+
+  p->mm = m;
+  return 0;
+}
+
+// A process stops running in address space m, by exiting or
+// exec()ing. The last one to do so unmaps all of m's mmap()s,
+// which may write them back to their files, so this may sleep.
+void
+mmexit(struct mm *m)
+{
+  if(__atomic_sub_fetch(&m->users, 1, __ATOMIC_SEQ_CST) == 0)
+    munmap_all(m);
+}
+
+// A process whose trapframe is mapped at tfva in address space m
+// lets go of it, in freeproc() or exec(). The last one to do so
+// frees m, its page table and its memory.
+void
+mmput(struct mm *m, uint64 tfva)
+{
+  acquire(&m->ptlock);
+  if(--m->ref > 0){
+    // the other threads go on without this trapframe.
+    uvmunmap(m->pagetable, tfva, 1, 0);
+    asid_flush_mm(m);
+    release(&m->ptlock);
+    return;
+  }
+  release(&m->ptlock);
+
+  proc_freepagetable(m->pagetable, m->sz, tfva);
+  kfree((void *)m->usyscall);
+  freelock(&m->ptlock);
+  freelock(&m->lock.lk);
+  kmem_cache_free(&mm_cache, m);
+}
+
 // a user program that calls exec("/init")
 // assembled from ../user/initcode.S
 // od -t xC ../user/initcode
@@ -266,19 +456,254 @@ uchar initcode[] = {
   0x00, 0x00, 0x00, 0x00
 };
 
+static int
+runqlen(int cpu)
+{
+  return __atomic_load_n(&runq[cpu].n, __ATOMIC_RELAXED);
+}
+
+// Add p to the tail of its level's list in rq.
+// rq->lock must be held.
+static void
+runq_add(struct runq *rq, struct proc *p)
+{
+  p->rq_next = 0;
+  if(rq->level[p->level].tail)
+    rq->level[p->level].tail->rq_next = p;
+  else
+    rq->level[p->level].head = p;
+  rq->level[p->level].tail = p;
+  __atomic_store_n(&rq->n, rq->n + 1, __ATOMIC_RELAXED);
+}
+
+// Take the first process of the highest level below limit off rq,
+// or return 0. rq->lock must be held.
+static struct proc*
+runq_take(struct runq *rq, int limit)
+{
+  struct proc *p;
+
+  for(int l = 0; l < limit; l++){
+    if((p = rq->level[l].head) != 0){
+      rq->level[l].head = p->rq_next;
+      if(rq->level[l].head == 0)
+        rq->level[l].tail = 0;
+      __atomic_store_n(&rq->n, rq->n - 1, __ATOMIC_RELAXED);
+      return p;
+    }
+  }
+  return 0;
+}
+
+// Add p to the tail of cpu's run queue.
+static void
+runq_push(int cpu, struct proc *p)
+{
+  struct runq *rq = &runq[cpu];
+
+  acquire(&rq->lock);
+  runq_add(rq, p);
+  release(&rq->lock);
+}
+
+// Take the first process that may run on cpu off from's run queue,
+// or return 0.
+static struct proc*
+runq_steal(int from, int cpu)
+{
+  struct runq *rq = &runq[from];
+  struct proc *p, **pp, *prev;
+
+  acquire(&rq->lock);
+  for(int l = 0; l < NLEVEL; l++){
+    prev = 0;
+    for(pp = &rq->level[l].head; (p = *pp) != 0; pp = &p->rq_next){
+      // a stale mask is caught by scheduler().
+      if(__atomic_load_n(&p->affinity, __ATOMIC_RELAXED) & (1UL << cpu)){
+        *pp = p->rq_next;
+        if(rq->level[l].tail == p)
+          rq->level[l].tail = prev;
+        __atomic_store_n(&rq->n, rq->n - 1, __ATOMIC_RELAXED);
+        release(&rq->lock);
+        return p;
+      }
+      prev = p;
+    }
+  }
+  release(&rq->lock);
+  return 0;
+}
+
+// Take the next process to run off cpu's run queue, or return 0.
+static struct proc*
+runq_pop(int cpu)
+{
+  struct runq *rq = &runq[cpu];
+  struct proc *p;
+
+  acquire(&rq->lock);
+  p = runq_take(rq, NLEVEL);
+  release(&rq->lock);
+  return p;
+}
+
+#ifdef MLFQ
+static uint
+boostepoch(void)
+{
+  return __atomic_load_n(&ticks, __ATOMIC_RELAXED) / BOOSTTICKS;
+}
+
+// Move p back to its highest level if there has been a boost since
+// it was last there. p->lock, or its run queue's lock, must be held.
+static void
+mlfq_boost(struct proc *p, uint epoch)
+{
+  if(p->epoch != epoch){
+    p->epoch = epoch;
+    p->level = p->prio;
+    p->slice = 0;
+  }
+}
+
+// Boost the processes on cpu's run queue, if there has been a
+// boost since the last time.
+static void
+runq_boost(int cpu)
+{
+  struct runq *rq = &runq[cpu];
+  struct cpu *c = &cpus[cpu];
+  struct proc *p, *list = 0, **tail = &list;
+  uint epoch = boostepoch();
+
+  if(c->epoch == epoch)
+    return;
+  c->epoch = epoch;
+  acquire(&rq->lock);
+  while((p = runq_take(rq, NLEVEL)) != 0){
+    *tail = p;
+    tail = &p->rq_next;
+  }
+  *tail = 0;
+  while((p = list) != 0){
+    list = p->rq_next;
+    mlfq_boost(p, epoch);
+    runq_add(rq, p);
+  }
+  release(&rq->lock);
+}
+#endif
+
+// Wake an idle CPU to run the process just queued on cpu's run
+// queue: cpu itself, or if cpu is busy running something else, one
+// of the CPUs in allowed, which will steal it.
+static void
+kickidle(int cpu, uint64 allowed)
+{
+  // pairs with the barrier in idle().
+  __sync_synchronize();
+  if(__atomic_load_n(&cpus[cpu].idle, __ATOMIC_RELAXED)){
+    cpukick(cpu);
+    return;
+  }
+  // this CPU is about to run what it queued for itself.
+  if(cpu == cpuid() && runqlen(cpu) <= 1)
+    return;
+  for(int i = 0; i < NCPU; i++){
+    if(i != cpu && (allowed & (1UL << i)) &&
+       __atomic_load_n(&cpus[i].idle, __ATOMIC_RELAXED)){
+      cpukick(i);
+      return;
+    }
+  }
+}
+
+// Wait for an interrupt. Interrupts are off until the wfi, so that
+// one arriving after the check but before the wfi isn't taken
+// before it, and slept through; wfi returns if one is pending.
+// CPUs but 0, which keeps ticks, stop their timer meanwhile: only
+// a running process could want it.
+static void
+idle(struct cpu *c, int id)
+{
+  intr_off();
+  if(id != 0)
+    timerstop();
+  __atomic_store_n(&c->idle, 1, __ATOMIC_RELAXED);
+  // pairs with the barrier in kickidle().
+  __sync_synchronize();
+  if(runqlen(id) == 0)
+    asm volatile("wfi");
+  __atomic_store_n(&c->idle, 0, __ATOMIC_RELAXED);
+  if(id != 0)
+    timerstart();
+  intr_on();
+}
+
+// Make p RUNNABLE and queue it to be run.
+// p->lock must be held.
+static void
+setrunnable(struct proc *p)
+{
+  int cpu = p->cpu;
+  uint64 allowed = p->affinity & __atomic_load_n(&online, __ATOMIC_RELAXED);
+
+  if(cpu < 0 || (allowed & (1UL << cpu)) == 0){
+    // before any CPU is scheduling, CPU 0 will be first.
+    cpu = 0;
+    for(int i = 0; i < NCPU; i++)
+      if((allowed & (1UL << i)) &&
+         ((allowed & (1UL << cpu)) == 0 || runqlen(i) < runqlen(cpu)))
+        cpu = i;
+    p->cpu = cpu;
+  }
+#ifdef MLFQ
+  mlfq_boost(p, boostepoch());
+  if(p->level < p->prio)
+    p->level = p->prio;
+#endif
+  p->state = RUNNABLE;
+  runq_push(cpu, p);
+  kickidle(cpu, allowed);
+}
+
+// Move a process from the longest run queue to this CPU's, if
+// that queue is longer by at least min. Returns the number of
+// processes moved.
+static int
+runq_balance(int cpu, int min)
+{
+  int busiest = cpu;
+  struct proc *p;
+
+  for(int i = 0; i < NCPU; i++)
+    if(runqlen(i) > runqlen(busiest))
+      busiest = i;
+  if(busiest == cpu || runqlen(busiest) < runqlen(cpu) + min)
+    return 0;
+  if((p = runq_steal(busiest, cpu)) == 0)
+    return 0;
+  // p is RUNNABLE, so only this CPU can run it now; p->cpu is
+  // set when it does.
+  runq_push(cpu, p);
+  return 1;
+}
+
 // Set up first user process.
 void
 userinit(void)
 {
   struct proc *p;
 
-  p = allocproc();
+  p = allocproc(0);
   initproc = p;
 
   // allocate one user page and copy initcode's instructions
   // and data into it.
   uvmfirst(p->pagetable, initcode, sizeof(initcode));
-  p->sz = PGSIZE;
+  p->mm->sz = PGSIZE;
+  if((p->fdt = fdtalloc()) == 0)
+    panic("userinit: fdtalloc");
 
   // prepare for the very first "return" from kernel to user.
   p->trapframe->epc = 0;      // user program counter
@@ -287,29 +712,84 @@ userinit(void)
   safestrcpy(p->name, "initcode", sizeof(p->name));
   p->cwd = namei("/");
 
-  p->state = RUNNABLE;
+  setrunnable(p);
 
   release(&p->lock);
 }
 
-// Grow or shrink user memory by n bytes.
-// Return 0 on success, -1 on failure.
+// A kernel process's very first scheduling by scheduler()
+// will swtch to kprocret.
+static void
+kprocret(void)
+{
+  struct proc *p = myproc();
+
+  // Still holding p->lock from scheduler.
+  release(&p->lock);
+
+  p->kfn(p->karg);
+  panic("kproc returned");
+}
+
+// Start a kernel process, which runs fn(arg) in the kernel
+// and never returns to user space. fn must not return. Must
+// be called from a process, which becomes the parent; it is
+// given to init if that process exits.
+// Returns the new process's pid, or -1 if out of processes.
 int
+kproc(char *name, void (*fn)(void*), void *arg)
+{
+  struct proc *p, *parent = myproc();
+
+  if((p = allocproc(0)) == 0)
+    return -1;
+
+  p->kfn = fn;
+  p->karg = arg;
+  p->context.ra = (uint64)kprocret;
+  safestrcpy(p->name, name, sizeof(p->name));
+  int pid = p->pid;
+  release(&p->lock);
+
+  acquire(&wait_lock);
+  p->parent = parent;
+  release(&wait_lock);
+
+  acquire(&p->lock);
+  setrunnable(p);
+  release(&p->lock);
+
+  return pid;
+}
+
+// Grow or shrink user memory by n bytes.
+// Growing only reserves the address space; pages
+// are allocated on first touch by uvmlazy().
+// Return the old size, or -1 on failure.
+uint64
 growproc(int n)
 {
-  uint64 sz;
-  struct proc *p = myproc();
+  uint64 sz, oldsz;
+  struct mm *m = myproc()->mm;
 
-  sz = p->sz;
+  acquiresleep(&m->lock);
+  oldsz = sz = m->sz;
   if(n > 0){
-    if((sz = uvmalloc(p->pagetable, sz, sz + n, PTE_W)) == 0) {
+    // don't run into the mmap() area or the trapframes.
+    if(sz + n > vma_lowest(m)){
+      releasesleep(&m->lock);
       return -1;
     }
-  } else if(n < 0){
-    sz = uvmdealloc(p->pagetable, sz, sz + n);
+    sz += n;
   }
-  p->sz = sz;
-  return 0;
+  // other threads may be faulting in heap pages.
+  acquire(&m->ptlock);
+  if(n < 0)
+    sz = uvmdealloc(m->pagetable, sz, sz + n);
+  m->sz = sz;
+  release(&m->ptlock);
+  releasesleep(&m->lock);
+  return oldsz;
 }
 
 // Create a new process, copying the parent.
@@ -317,22 +797,41 @@ growproc(int n)
 int
 fork(void)
 {
-  int i, pid;
+  int pid;
   struct proc *np;
   struct proc *p = myproc();
+  struct mm *m = p->mm;
+
+  // keep the parent's other threads from changing its
+  // mappings while they are copied.
+  acquiresleep(&m->lock);
 
   // Allocate process.
-  if((np = allocproc()) == 0){
+  if((np = allocproc(0)) == 0){
+    releasesleep(&m->lock);
     return -1;
   }
 
   // Copy user memory from parent to child.
-  if(uvmcopy(p->pagetable, np->pagetable, p->sz) < 0){
+  acquire(&m->ptlock);
+  if(uvmcopy(p->pagetable, np->pagetable, m->sz) < 0){
+    release(&m->ptlock);
     freeproc(np);
     release(&np->lock);
+    releasesleep(&m->lock);
+    return -1;
+  }
+  np->mm->sz = m->sz;
+  release(&m->ptlock);
+
+  // copy mmap'ed VMAs, and open file descriptors.
+  if(mmap_copy(m, np->mm) < 0 || (np->fdt = fdtcopy(p->fdt)) == 0){
+    munmap_all(np->mm);
+    freeproc(np);
+    release(&np->lock);
+    releasesleep(&m->lock);
     return -1;
   }
-  np->sz = p->sz;
 
   // copy saved user registers.
   *(np->trapframe) = *(p->trapframe);
@@ -340,21 +839,74 @@ fork(void)
   // preserve trace() mask in child.
   np->trace_mask = p->trace_mask;
 
+  // and the hugepages() policy, and the scheduling priority.
+  np->hugeheap = p->hugeheap;
+  np->prio = p->prio;
+  np->affinity = p->affinity;
+  np->counteren = p->counteren;
+
   // Cause fork to return 0 in the child.
   np->trapframe->a0 = 0;
 
-  // increment reference counts on open file descriptors.
-  for(i = 0; i < NOFILE; i++)
-    if(p->ofile[i])
-      np->ofile[i] = filedup(p->ofile[i]);
   np->cwd = idup(p->cwd);
 
   safestrcpy(np->name, p->name, sizeof(p->name));
 
   pid = np->pid;
 
-  // copy mmap'ed VMAs.
-  mmap_copy(p, np);
+  release(&np->lock);
+  releasesleep(&m->lock);
+
+  acquire(&wait_lock);
+  np->parent = p;
+  np->mm->usyscall->ppid = p->pid;
+  release(&wait_lock);
+
+  acquire(&np->lock);
+  setrunnable(np);
+  release(&np->lock);
+
+  return pid;
+}
+
+// Create a thread: a new process that shares the caller's
+// address space and open files, and starts in fn(arg) on the
+// given stack. fn must not return, but call exit(). The thread
+// is a child of the caller, to be reaped by wait() like any
+// other. Returns its pid, or -1.
+int
+clone(uint64 fn, uint64 arg, uint64 stack)
+{
+  int pid;
+  struct proc *np;
+  struct proc *p = myproc();
+
+  if((np = allocproc(p->mm)) == 0)
+    return -1;
+
+  np->fdt = fdtdup(p->fdt);
+
+  // start in fn(arg), with the rest of the registers as the
+  // caller had them in clone().
+  *(np->trapframe) = *(p->trapframe);
+  np->trapframe->epc = fn;
+  np->trapframe->a0 = arg;
+  np->trapframe->sp = stack;
+  np->trapframe->ra = 0;
+  // tp finds the thread's own cache in malloc().
+  np->trapframe->tp = 0;
+
+  np->trace_mask = p->trace_mask;
+  np->hugeheap = p->hugeheap;
+  np->prio = p->prio;
+  np->affinity = p->affinity;
+  np->counteren = p->counteren;
+
+  np->cwd = idup(p->cwd);
+
+  safestrcpy(np->name, p->name, sizeof(p->name));
+
+  pid = np->pid;
 
   release(&np->lock);
 
@@ -363,12 +915,114 @@ fork(void)
   release(&wait_lock);
 
   acquire(&np->lock);
-  np->state = RUNNABLE;
+  setrunnable(np);
   release(&np->lock);
 
   return pid;
 }
 
+// Run spawn()'s file actions on t, a child's table that no one
+// else uses yet. Returns 0, or -1 if an action is bad.
+static int
+spawnfds(struct fdtable *t, struct spawnfd *acts, int n)
+{
+  for(int i = 0; i < n; i++){
+    struct spawnfd *a = &acts[i];
+    struct file *f, *old;
+    int r = 0;
+    if((f = fget(t, a->fd)) == 0)
+      return -1;
+    switch(a->op){
+    case SPAWN_DUP2:
+      if(a->newfd < 0 || a->newfd >= NOFILEMAX){
+        r = -1;
+      } else if(a->newfd != a->fd){
+        old = fdtget(t, a->newfd);
+        acquire(&t->lock);
+        r = fdtset(t, a->newfd, f);
+        release(&t->lock);
+        if(r == 0){
+          filedup(f);
+          if(old)
+            fileclose(old);
+        }
+      }
+      break;
+    case SPAWN_CLOSE:
+      acquire(&t->lock);
+      fdtset(t, a->fd, 0);
+      release(&t->lock);
+      fileclose(f);
+      break;
+    default:
+      r = -1;
+    }
+    fput(f);
+    if(r < 0)
+      return -1;
+  }
+  return 0;
+}
+
+// Start the program at path in a new child, with a copy of the
+// caller's open files changed by the n actions in acts. Nothing of
+// the caller's memory is copied, as fork() would before exec()
+// threw it away. Returns the child's pid, or -1.
+int
+spawn(char *path, char **argv, struct spawnfd *acts, int n)
+{
+  int pid, argc;
+  struct proc *np;
+  struct proc *p = myproc();
+
+  if((np = allocproc(0)) == 0)
+    return -1;
+
+  // no one else can see np until it is runnable, and loading the
+  // program sleeps.
+  release(&np->lock);
+
+  if((np->fdt = fdtcopy(p->fdt)) == 0)
+    goto bad;
+  if(spawnfds(np->fdt, acts, n) < 0)
+    goto bad;
+
+  np->trace_mask = p->trace_mask;
+  np->prio = p->prio;
+  np->affinity = p->affinity;
+  np->counteren = p->counteren;
+
+  memset(np->trapframe, 0, sizeof(*np->trapframe));
+  if((argc = execin(np, path, argv)) < 0)
+    goto bad;
+  np->trapframe->a0 = argc;
+
+  np->cwd = idup(p->cwd);
+
+  pid = np->pid;
+
+  acquire(&wait_lock);
+  np->parent = p;
+  np->mm->usyscall->ppid = p->pid;
+  release(&wait_lock);
+
+  acquire(&np->lock);
+  setrunnable(np);
+  release(&np->lock);
+
+  return pid;
+
+ bad:
+  if(np->fdt){
+    fdtput(np->fdt);
+    np->fdt = 0;
+  }
+  acquire(&np->lock);
+  freeproc(np);
+  release(&np->lock);
+  return -1;
+}
+
 // Pass p's abandoned children to init.
 // Caller must hold wait_lock.
 void
@@ -379,6 +1033,9 @@ reparent(struct proc *p)
   for(pp = proc; pp < &proc[NPROC]; pp++){
     if(pp->parent == p){
       pp->parent = initproc;
+      // a thread's usyscall page belongs to the process that made it.
+      if(pp->mm->usyscall->pid == pp->pid)
+        pp->mm->usyscall->ppid = initproc->pid;
       wakeup(initproc);
     }
   }
@@ -395,16 +1052,17 @@ exit(int status)
   if(p == initproc)
     panic("init exiting");
 
-  // Close all open files.
-  for(int fd = 0; fd < NOFILE; fd++){
-    if(p->ofile[fd]){
-      struct file *f = p->ofile[fd];
-      fileclose(f);
-      p->ofile[fd] = 0;
-    }
+  // Close all open files, unless other threads still use them.
+  if(p->fdt){
+    fdtput(p->fdt);
+    p->fdt = 0;
   }
 
-  munmap_all(p);
+  // the page table stays until wait() frees it in freeproc().
+  mmexit(p->mm);
+
+  // struct proc may be reused once it is a zombie.
+  timer_cancel(&p->alarm_timer);
 
   begin_op();
   iput(p->cwd);
@@ -431,10 +1089,60 @@ exit(int status)
   panic("zombie exit");
 }
 
-// Wait for a child process to exit and return its pid.
-// Return -1 if this process has no children.
+// Add the counts in b to a.
+static void
+rusageadd(struct rusage *a, struct rusage *b)
+{
+  a->utime += b->utime;
+  a->stime += b->stime;
+  a->minflt += b->minflt;
+  a->inblock += b->inblock;
+  a->oublock += b->oublock;
+  a->nvcsw += b->nvcsw;
+  a->nivcsw += b->nivcsw;
+}
+
+// Copy r out to user address addr in p, with its times turned
+// from mtime cycles into microseconds.
+static int
+rusageout(struct proc *p, uint64 addr, struct rusage *r)
+{
+  struct rusage ru = *r;
+
+  ru.utime /= TIMEHZ / 1000000;
+  ru.stime /= TIMEHZ / 1000000;
+  return copyout(p->pagetable, addr, (char *)&ru, sizeof(ru));
+}
+
+// Copy the resources used by the current process, or by the
+// children it has reaped, to user address addr.
 int
-wait(uint64 addr)
+getrusage(int who, uint64 addr)
+{
+  struct proc *p = myproc();
+  struct rusage ru;
+
+  if(who == RUSAGE_SELF){
+    // including the kernel time of this system call so far.
+    push_off();
+    ru = p->ru;
+    ru.stime += r_time() - p->tstamp;
+    pop_off();
+  } else if(who == RUSAGE_CHILDREN){
+    acquire(&wait_lock);
+    ru = p->cru;
+    release(&wait_lock);
+  } else {
+    return -1;
+  }
+  return rusageout(p, addr, &ru);
+}
+
+// Wait for a child process to exit and return its pid, with its
+// exit status copied to addr and its resource use to ruaddr,
+// unless they are 0. Return -1 if this process has no children.
+int
+wait(uint64 addr, uint64 ruaddr)
 {
   struct proc *pp;
   int havekids, pid;
@@ -460,6 +1168,14 @@ wait(uint64 addr)
             release(&wait_lock);
             return -1;
           }
+          // the child's own use, and that of the children it reaped.
+          rusageadd(&pp->ru, &pp->cru);
+          if(ruaddr != 0 && rusageout(p, ruaddr, &pp->ru) < 0) {
+            release(&pp->lock);
+            release(&wait_lock);
+            return -1;
+          }
+          rusageadd(&p->cru, &pp->ru);
           freeproc(pp);
           release(&pp->lock);
           release(&wait_lock);
@@ -492,30 +1208,62 @@ scheduler(void)
 {
   struct proc *p;
   struct cpu *c = mycpu();
+  int id = cpuid();
 
   c->proc = 0;
+  __atomic_or_fetch(&online, 1UL << id, __ATOMIC_RELAXED);
   for(;;){
     // The most recent process to run may have had interrupts
     // turned off; enable them to avoid a deadlock if all
     // processes are waiting.
     intr_on();
 
-    for(p = proc; p < &proc[NPROC]; p++) {
-      acquire(&p->lock);
-      if(p->state == RUNNABLE) {
-        // Switch to chosen process.  It is the process's job
-        // to release its lock and then reacquire it
-        // before jumping back to us.
-        p->state = RUNNING;
-        c->proc = p;
-        swtch(&c->context, &p->context);
-
-        // Process is done running for now.
-        // It should have changed its p->state before coming back.
-        c->proc = 0;
-      }
-      release(&p->lock);
+    uint now = __atomic_load_n(&ticks, __ATOMIC_RELAXED);
+    if(now - c->balanced >= BALANCETICKS){
+      c->balanced = now;
+      runq_balance(id, 2);
     }
+#ifdef MLFQ
+    runq_boost(id);
+#endif
+
+    if((p = runq_pop(id)) == 0 && runq_balance(id, 1))
+      p = runq_pop(id);
+    if(p == 0){
+      // Nothing to run, so zero some pages ahead of time
+      // for kalloc_zeroed(), or failing that, wait.
+      if(kzeroidle() == 0)
+        idle(c, id);
+      continue;
+    }
+
+    // p may still be on its way out of yield() on the CPU that
+    // queued it, until that CPU's scheduler releases p->lock.
+    acquire(&p->lock);
+    if(p->state == RUNNABLE && (p->affinity & (1UL << id)) == 0){
+      // p's affinity changed while it was queued here.
+      setrunnable(p);
+    } else if(p->state == RUNNABLE) {
+      // Switch to chosen process.  It is the process's job
+      // to release its lock and then reacquire it
+      // before jumping back to us.
+      p->state = RUNNING;
+      p->cpu = id;
+      p->mm->usyscall->cpu = id;
+      p->tstamp = r_time();
+      c->proc = p;
+      // p's slice starts now, not partway through the last one.
+      c->sliceticks = 0;
+      hpmswitch(p);
+      KTRACE(KT_SCHED, KT_SWITCHIN, 0, 0);
+      swtch(&c->context, &p->context);
+      KTRACE(KT_SCHED, KT_SWITCHOUT, p->state, 0);
+
+      // Process is done running for now.
+      // It should have changed its p->state before coming back.
+      c->proc = 0;
+    }
+    release(&p->lock);
   }
 }
 
@@ -541,6 +1289,14 @@ sched(void)
   if(intr_get())
     panic("sched interruptible");
 
+  // charge the time since it last started running, or came in
+  // from user space.
+  p->ru.stime += r_time() - p->tstamp;
+  if(p->state == SLEEPING)
+    p->ru.nvcsw++;
+  else if(p->state == RUNNABLE)
+    p->ru.nivcsw++;
+
   intena = mycpu()->intena;
   swtch(&p->context, &mycpu()->context);
   mycpu()->intena = intena;
@@ -552,11 +1308,114 @@ yield(void)
 {
   struct proc *p = myproc();
   acquire(&p->lock);
-  p->state = RUNNABLE;
+  setrunnable(p);
   sched();
   release(&p->lock);
 }
 
+// Called on each timer interrupt that arrives while a process is
+// running, which only counts once SLICETICKS of them have made up
+// a slice. Round robin gives up the CPU every slice. MLFQ charges
+// the slice to the process's level, and gives up the CPU once the
+// process has used up its quantum there, moving it down a level,
+// or if a process at a higher level is waiting.
+void
+preempt(void)
+{
+  struct cpu *c = mycpu();
+
+  if(++c->sliceticks < SLICETICKS)
+    return;
+  c->sliceticks = 0;
+
+#ifdef MLFQ
+  struct proc *p = myproc();
+  struct runq *rq;
+  int waiting;
+
+  acquire(&p->lock);
+  mlfq_boost(p, boostepoch());
+  if(++p->slice >= QUANTUM(p->level)){
+    if(p->level < NLEVEL - 1)
+      p->level++;
+    p->slice = 0;
+    release(&p->lock);
+    yield();
+    return;
+  }
+  rq = &runq[p->cpu];
+  acquire(&rq->lock);
+  waiting = 0;
+  for(int l = 0; l < p->level; l++)
+    if(rq->level[l].head)
+      waiting = 1;
+  release(&rq->lock);
+  release(&p->lock);
+  if(waiting)
+    yield();
+#else
+  yield();
+#endif
+}
+
+// Set the highest scheduling level of the process with the given
+// pid, or of the calling process if pid is 0, to prio: 0 is the
+// highest. Takes effect when the process next joins a run queue.
+// Round robin ignores it. Returns -1 if there is no such process
+// or priority.
+int
+setpriority(int pid, int prio)
+{
+  struct proc *p;
+
+  if(prio < 0 || prio >= NPRIO)
+    return -1;
+  if(pid == 0)
+    pid = myproc()->pid;
+  for(p = proc; p < &proc[NPROC]; p++){
+    acquire(&p->lock);
+    if(p->pid == pid){
+      p->prio = prio;
+      release(&p->lock);
+      return 0;
+    }
+    release(&p->lock);
+  }
+  return -1;
+}
+
+// Restrict the process with the given pid, or the calling process
+// if pid is 0, to the CPUs whose bits are set in mask. A process
+// on a CPU it may no longer use moves the next time it gives up
+// the CPU; the calling process does so at once. Returns -1 if
+// there is no such process, or mask has no CPU that is running.
+int
+setaffinity(int pid, uint64 mask)
+{
+  struct proc *p, *me = myproc();
+  int found = 0, move = 0;
+
+  mask &= ALLCPUS;
+  if((mask & __atomic_load_n(&online, __ATOMIC_RELAXED)) == 0)
+    return -1;
+  if(pid == 0)
+    pid = me->pid;
+  for(p = proc; p < &proc[NPROC]; p++){
+    acquire(&p->lock);
+    if(p->pid == pid && p->state != UNUSED){
+      __atomic_store_n(&p->affinity, mask, __ATOMIC_RELAXED);
+      move = p == me && (mask & (1UL << p->cpu)) == 0;
+      found = 1;
+    }
+    release(&p->lock);
+    if(found)
+      break;
+  }
+  if(move)
+    yield();
+  return found ? 0 : -1;
+}
+
 // A fork child's very first scheduling by scheduler()
 // will swtch to forkret.
 void
@@ -573,6 +1432,10 @@ forkret(void)
     // be run from main().
     fsinit(ROOTDEV);
 
+    // and so must starting the kernel processes that need one
+    // as their parent.
+    e1000_start();
+
     first = 0;
     // ensure other cores see first=0.
     __sync_synchronize();
@@ -587,20 +1450,26 @@ void
 sleep(void *chan, struct spinlock *lk)
 {
   struct proc *p = myproc();
+  struct waitq *wq = waitqof(chan);
 
   // Must acquire p->lock in order to
   // change p->state and then call sched.
-  // Once we hold p->lock, we can be
-  // guaranteed that we won't miss any wakeup
-  // (wakeup locks p->lock),
+  // Once we hold chan's wait queue lock and
+  // p->lock, we can be guaranteed that we
+  // won't miss any wakeup (wakeup locks both),
   // so it's okay to release lk.
 
+  acquire(&wq->lock);
   acquire(&p->lock);  //DOC: sleeplock1
   release(lk);
 
   // Go to sleep.
+  KTRACE(KT_SLEEP, KT_SLEEPON, (uint64)chan, 0);
   p->chan = chan;
   p->state = SLEEPING;
+  p->wq_next = wq->head;
+  wq->head = p;
+  release(&wq->lock);
 
   sched();
 
@@ -612,22 +1481,66 @@ sleep(void *chan, struct spinlock *lk)
   acquire(lk);
 }
 
+// Wake up at most max of the processes sleeping on chan, or only
+// p if p is not 0. Returns how many were woken.
+// Must be called without any p->lock.
+static int
+wakeupon(void *chan, struct proc *only, int max)
+{
+  struct waitq *wq = waitqof(chan);
+  struct proc **pp, *p;
+  int n = 0;
+
+  acquire(&wq->lock);
+  for(pp = &wq->head; (p = *pp) != 0 && n < max; ){
+    // a process on the queue is SLEEPING, though it may still
+    // be on its way into sched(), holding p->lock.
+    if(p->chan == chan && (only == 0 || p == only)){
+      acquire(&p->lock);
+      *pp = p->wq_next;
+      KTRACE(KT_SLEEP, KT_WAKE, (uint64)chan, p->pid);
+      setrunnable(p);
+      release(&p->lock);
+      n++;
+    } else {
+      pp = &p->wq_next;
+    }
+  }
+  release(&wq->lock);
+  return n;
+}
+
 // Wake up all processes sleeping on chan.
 // Must be called without any p->lock.
 void
 wakeup(void *chan)
+{
+  wakeupon(chan, 0, NPROC);
+}
+
+// Wake up at most n of the processes sleeping on chan, and
+// return how many were woken.
+// Must be called without any p->lock.
+int
+wakeupn(void *chan, int n)
+{
+  return wakeupon(chan, 0, n);
+}
+
+// Return the process with the given pid, locked, or 0 if there
+// is none.
+struct proc*
+procof(int pid)
 {
   struct proc *p;
 
-  for(p = proc; p < &proc[NPROC]; p++) {
-    if(p != myproc()){
-      acquire(&p->lock);
-      if(p->state == SLEEPING && p->chan == chan) {
-        p->state = RUNNABLE;
-      }
-      release(&p->lock);
-    }
+  for(p = proc; p < &proc[NPROC]; p++){
+    acquire(&p->lock);
+    if(p->pid == pid && p->state != UNUSED)
+      return p;
+    release(&p->lock);
   }
+  return 0;
 }
 
 // Kill the process with the given pid.
@@ -642,11 +1555,13 @@ kill(int pid)
     acquire(&p->lock);
     if(p->pid == pid){
       p->killed = 1;
-      if(p->state == SLEEPING){
-        // Wake process from sleep().
-        p->state = RUNNABLE;
-      }
+      void *chan = p->state == SLEEPING ? p->chan : 0;
       release(&p->lock);
+      if(chan){
+        // Wake process from sleep(), if it is still
+        // asleep on chan.
+        wakeupon(chan, p, 1);
+      }
       return 0;
     }
     release(&p->lock);
@@ -736,15 +1651,56 @@ procdump(void)
 uint
 proccount(void)
 {
-  uint count = 0;
+  return __atomic_load_n(&nprocs, __ATOMIC_RELAXED);
+}
 
-  for (struct proc *p = proc; p < &proc[NPROC]; p++) {
-    if (p->state == UNUSED) {
-      continue;
-    }
+// Processes running or waiting to run: those on run queues, and
+// those CPUs are running.
+uint
+runcount(void)
+{
+  uint n = 0;
 
-    count++;
+  for(int i = 0; i < NCPU; i++){
+    n += runqlen(i);
+    if(__atomic_load_n(&cpus[i].proc, __ATOMIC_RELAXED))
+      n++;
   }
+  return n;
+}
+
+// Every LOADTICKS, decay the load averages towards runcount(),
+// as Unix does: each moves 1-e^(-5s/period) of the way, with
+// these factors in fixed point with FSHIFT bits of fraction.
+#define FSHIFT    SI_LOAD_SHIFT
+#define FIXED_1   (1 << FSHIFT)
+#define LOADTICKS (5 * TICKHZ)
+static const uint64 loadexp[3] = {
+  1884,   // FIXED_1 * e^(-5/60)
+  2014,   // FIXED_1 * e^(-5/300)
+  2037,   // FIXED_1 * e^(-5/900)
+};
 
-  return count;
+// Called by clockintr() on every clock tick.
+void
+loadavg_tick(uint t)
+{
+  uint64 n;
+
+  if(t % LOADTICKS)
+    return;
+  n = (uint64)runcount() * FIXED_1;
+  for(int i = 0; i < 3; i++){
+    uint64 l = loadavg[i];
+    l = (l * loadexp[i] + n * (FIXED_1 - loadexp[i]) + FIXED_1/2) >> FSHIFT;
+    __atomic_store_n(&loadavg[i], l, __ATOMIC_RELAXED);
+  }
+}
+
+// Copy the load averages into avg[3].
+void
+getloadavg(uint64 *avg)
+{
+  for(int i = 0; i < 3; i++)
+    avg[i] = __atomic_load_n(&loadavg[i], __ATOMIC_RELAXED);
 }
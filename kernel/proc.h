@@ -1,4 +1,5 @@
 #include "defs.h"
+#include "rusage.h"
 
 // Saved registers for kernel context switches.
 struct context {
@@ -26,6 +27,15 @@ struct cpu {
   struct context context;     // swtch() here to enter scheduler().
   int noff;                   // Depth of push_off() nesting.
   int intena;                 // Were interrupts enabled before push_off()?
+  uint64 asid_gen;            // ASID generation this cpu's TLB was last flushed for.
+  uint balanced;              // ticks when scheduler() last balanced run queues.
+  uint epoch;                 // MLFQ boost epoch of this cpu's run queue.
+  int idle;                   // In wfi, waiting for cpukick() or an interrupt.
+  uint64 timerseen;           // Timer interrupts devintr() has handled.
+  int sliceticks;             // Ticks of the current scheduling slice used.
+  struct mm *mm;              // Address space whose TLB entries this cpu may be using.
+  uint64 tlbreq;              // TLB flushes other CPUs have asked this cpu for,
+  uint64 tlbdone;             // and how many of them it has done; see asid.c.
 };
 
 extern struct cpu cpus[NCPU];
@@ -83,36 +93,85 @@ struct trapframe {
 
 enum procstate { UNUSED, USED, SLEEPING, RUNNABLE, RUNNING, ZOMBIE };
 
+// A process's open files, indexed by file descriptor. The
+// threads that clone() makes share their creator's. ofile starts
+// as init and grows as needed, see fdtset(); fdtget() looks files
+// up without the lock.
+struct fdtable {
+  struct spinlock lock;  // protects what follows, for threads opening and closing at once
+  int ref;               // processes using it
+  int nfd;               // entries in ofile
+  struct file **ofile;
+  uint64 open[NOFILEMAX/64]; // bit fd%64 of open[fd/64] set if fd is in use
+  uint64 full;           // bit i set if open[i] is all ones
+  struct file **old[4];  // arrays ofile outgrew, by kalloc_pages() order
+  struct file *init[NOFILE];
+};
+
+// A function to run from the timer interrupt once the CLINT's mtime
+// reaches deadline, on the CPU whose queue timer_add() put it on.
+// See timer.c.
+struct timer {
+  uint64 deadline;             // mtime to run fn at
+  uint64 period;               // if not 0, run fn again this much later
+  void (*fn)(struct timer*);   // called with the queue's lock held
+  void *arg;                   // for fn
+  struct timerq *q;            // queue it is on, or 0
+  struct timer *next;          // next in the queue, by deadline
+};
+
 // Per-process state
 struct proc {
   struct spinlock lock;
 
   // p->lock must be held when using these:
   enum procstate state;        // Process state
-  void *chan;                  // If non-zero, sleeping on chan
+  void *chan;                  // If non-zero, sleeping on chan; also set with its wait queue's lock
   int killed;                  // If non-zero, have been killed
   int xstate;                  // Exit status to be returned to parent's wait
   int pid;                     // Process ID
+  int cpu;                     // CPU whose run queue it was last put on, or -1
+  uint64 affinity;             // CPUs it may run on, set by setaffinity()
+  int prio;                    // Highest scheduling level, set by setpriority()
+  int level;                   // Current level; also its run queue's lock while on it
+  int slice;                   // Slices run at level
+  uint epoch;                  // Boost epoch that level is for
+
+  // the lock of the run queue it is on must be held when using this:
+  struct proc *rq_next;        // Next process on the same run queue
+
+  // the lock of the wait queue it sleeps on must be held when using this:
+  struct proc *wq_next;        // Next process asleep on the same wait queue
 
   // wait_lock must be held when using this:
   struct proc *parent;         // Parent process
 
   // these are private to the process, so p->lock need not be held.
   uint64 kstack;               // Virtual address of kernel stack
-  uint64 sz;                   // Size of process memory (bytes)
-  pagetable_t pagetable;       // User page table
+  struct mm *mm;               // User address space, see vm.h
+  pagetable_t pagetable;       // mm->pagetable
   struct trapframe *trapframe; // data page for trampoline.S
+  uint64 tfva;                 // user address of trapframe
   struct context context;      // swtch() here to run process
-  struct file *ofile[NOFILE];  // Open files
+  struct fdtable *fdt;         // Open files
   struct inode *cwd;           // Current directory
   char name[16];               // Process name (debugging)
   int trace_mask;              // Mask for tracing syscalls
-  struct usyscall *usyscall;   // read-only data page for userspace sytem calls
-  struct vm_area   *vma_list;   // This process's VMAs.
+  int hugeheap;                // Back the heap with megapages where possible
+  int counteren;               // Counters it may read in user mode, see hpm.c
+  void (*kfn)(void*);          // kernel process's function, see kproc()
+  void *karg;                  // and its argument
+  struct uprof *prof;          // uprof() samples; set with p->lock held
+  struct rusage ru;            // resources used, with times in mtime cycles
+  struct rusage cru;           // and by reaped children, set under wait_lock
+  uint64 tstamp;               // mtime when its latest stretch of user or kernel time began
 
   // still private, alarm-only fields
   uint alarm_interval;               // interval requested by the process's sigalarm() call
   void (*alarm_handler)();           // pointer to process's sigalarm handler
   uint alarm_ticks;                  // number of ticks since last alarm
+  struct timer alarm_timer;          // the process's ualarm()
+  int alarm_due;                     // alarm_timer has gone off since the handler last ran
+  int alarm_inhandler;               // the ualarm() handler hasn't called sigreturn() yet
   struct trapframe alarm_prev_frame; // the trapframe before the handler was called
 };
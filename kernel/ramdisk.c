@@ -1,45 +1,45 @@
 //
-// ramdisk that uses the disk image loaded by qemu -initrd fs.img
+// RAM disk holding the file system mounted on /tmp,
+// which fs.c formats at boot.
 //
 
 #include "types.h"
 #include "riscv.h"
 #include "defs.h"
 #include "param.h"
-#include "memlayout.h"
 #include "spinlock.h"
 #include "sleeplock.h"
 #include "fs.h"
 #include "buf.h"
 
+static uchar *ramdisk;
+
 void
 ramdiskinit(void)
 {
+  int order = 0;
+
+  while((PGSIZE << order) < TMPFSSIZE * BSIZE)
+    order++;
+  if((ramdisk = kalloc_pages(order)) == 0)
+    panic("ramdiskinit");
+  memset(ramdisk, 0, PGSIZE << order);
 }
 
-// If B_DIRTY is set, write buf to disk, clear B_DIRTY, set B_VALID.
-// Else if B_VALID is not set, read buf from disk, set B_VALID.
+// Read b from the RAM disk, or write it if write is set.
+// Unlike a real disk, it's done when this returns.
 void
-ramdiskrw(struct buf *b)
+ramdiskrw(struct buf *b, int write)
 {
   if(!holdingsleep(&b->lock))
     panic("ramdiskrw: buf not locked");
-  if((b->flags & (B_VALID|B_DIRTY)) == B_VALID)
-    panic("ramdiskrw: nothing to do");
-
-  if(b->blockno >= FSSIZE)
+  if(b->blockno >= TMPFSSIZE)
     panic("ramdiskrw: blockno too big");
 
-  uint64 diskaddr = b->blockno * BSIZE;
-  char *addr = (char *)RAMDISK + diskaddr;
+  uchar *addr = ramdisk + b->blockno * BSIZE;
 
-  if(b->flags & B_DIRTY){
-    // write
+  if(write)
     memmove(addr, b->data, BSIZE);
-    b->flags &= ~B_DIRTY;
-  } else {
-    // read
+  else
     memmove(b->data, addr, BSIZE);
-    b->flags |= B_VALID;
-  }
 }
@@ -0,0 +1,42 @@
+// Submission and completion rings for ring_enter(), which runs a
+// batch of file operations for the cost of one system call.
+//
+// User space fills in sq[sqtail % RINGSIZE] and advances sqtail, then
+// calls ring_enter(). The kernel runs the entries from sqhead on, in
+// order, and posts each one's result at cq[cqtail % RINGSIZE], until
+// it catches up with sqtail or the completion ring is full. User
+// space takes completions from cqhead and advances it. Each side
+// writes only its own two indices.
+
+#define RINGSIZE 64   // entries in each ring, a power of two
+
+#define RING_NOP    0
+#define RING_READ   1   // read(fd, addr, n), also for sockets
+#define RING_WRITE  2   // write(fd, addr, n), also for sockets
+#define RING_PREAD  3   // pread(fd, addr, n, off)
+#define RING_PWRITE 4   // pwrite(fd, addr, n, off)
+#define RING_FSYNC  5   // wait until fd's writes are on disk
+
+struct sqe {
+  int op;         // RING_*
+  int fd;
+  uint64 addr;    // user buffer
+  int n;          // bytes
+  uint off;       // file offset, for RING_PREAD and RING_PWRITE
+  uint64 data;    // copied to the completion, for user space
+};
+
+struct cqe {
+  uint64 data;    // the submission's data
+  int res;        // what the system call would have returned
+  int pad;
+};
+
+struct ring {
+  uint sqhead;    // next submission to run, advanced by the kernel
+  uint sqtail;    // next free submission, advanced by user space
+  uint cqhead;    // next completion to take, advanced by user space
+  uint cqtail;    // next free completion, advanced by the kernel
+  struct sqe sq[RINGSIZE];
+  struct cqe cq[RINGSIZE];
+};
@@ -199,7 +199,10 @@ w_pmpaddr0(uint64 x)
 // use riscv's sv39 page table scheme.
 #define SATP_SV39 (8L << 60)
 
-#define MAKE_SATP(pagetable) (SATP_SV39 | (((uint64)pagetable) >> 12))
+#define SATP_ASID_SHIFT 44
+#define SATP_ASID_MASK  0xFFFF
+
+#define MAKE_SATP(pagetable, asid) (SATP_SV39 | ((uint64)(asid) << SATP_ASID_SHIFT) | (((uint64)pagetable) >> 12))
 
 // supervisor address translation and protection;
 // holds the address of the page table.
@@ -256,6 +259,21 @@ r_mcounteren()
   return x;
 }
 
+// Supervisor-mode Counter-Enable
+static inline void
+w_scounteren(uint64 x)
+{
+  asm volatile("csrw scounteren, %0" : : "r" (x));
+}
+
+static inline uint64
+r_scounteren()
+{
+  uint64 x;
+  asm volatile("csrr %0, scounteren" : "=r" (x) );
+  return x;
+}
+
 // machine-mode cycle counter
 static inline uint64
 r_time()
@@ -265,6 +283,15 @@ r_time()
   return x;
 }
 
+// this hart's cycle counter, which start() lets supervisor mode read
+static inline uint64
+r_cycle()
+{
+  uint64 x;
+  asm volatile("csrr %0, cycle" : "=r" (x) );
+  return x;
+}
+
 // enable device interrupts
 static inline void
 intr_on()
@@ -335,6 +362,20 @@ sfence_vma()
   asm volatile("sfence.vma zero, zero");
 }
 
+// flush the TLB entries for address space asid.
+static inline void
+sfence_vma_asid(uint64 asid)
+{
+  asm volatile("sfence.vma zero, %0" : : "r" (asid));
+}
+
+// flush the TLB entry for va in address space asid.
+static inline void
+sfence_vma_va_asid(uint64 va, uint64 asid)
+{
+  asm volatile("sfence.vma %0, %1" : : "r" (va), "r" (asid));
+}
+
 typedef uint64 pte_t;
 typedef uint64 *pagetable_t; // 512 PTEs
 
@@ -343,6 +384,9 @@ typedef uint64 *pagetable_t; // 512 PTEs
 #define PGSIZE 4096 // bytes per page
 #define PGSHIFT 12  // bits of offset within a page
 
+#define MEGAPGSIZE (PGSIZE * 512) // bytes per level-1 megapage
+#define MEGAPGORDER 9             // a megapage is 2^MEGAPGORDER pages
+
 #define PGROUNDUP(sz)  (((sz)+PGSIZE-1) & ~(PGSIZE-1))
 #define PGROUNDDOWN(a) (((a)) & ~(PGSIZE-1))
 
@@ -355,6 +399,16 @@ typedef uint64 *pagetable_t; // 512 PTEs
 #define PTE_A   (1L << 6) // accessed bit
 #define PTE_D   (1L << 7) // dirty bit
 #define PTE_COW (1L << 8) // the first reserved for software (RSW) bit, used to mark copy-on-write pages
+#define PTE_MEGA (1L << 9) // the second RSW bit, used to mark user megapage leaves
+
+// a level-0 PTE with PTE_SWAP but not PTE_V maps a page that has been
+// evicted to swap slot PTE2SWAP(pte), see swap.c. the hardware ignores
+// the rest of an invalid PTE, so it keeps the flags the page will be
+// mapped with again.
+#define PTE_SWAP PTE_MEGA
+#define PTE_SWAPPED(pte) (((pte) & (PTE_V | PTE_SWAP)) == PTE_SWAP)
+#define SWAP2PTE(slot) (((uint64)(slot)) << 10)
+#define PTE2SWAP(pte) ((uint)((pte) >> 10))
 
 
 
@@ -379,5 +433,6 @@ typedef uint64 *pagetable_t; // 512 PTEs
 
 // scause values
 #define SCAUSE_ECALL_UMODE      8
+#define SCAUSE_INSTR_PAGE_FAULT 12
 #define SCAUSE_READ_PAGE_FAULT  13
 #define SCAUSE_WRITE_PAGE_FAULT 15
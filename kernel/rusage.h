@@ -0,0 +1,15 @@
+// Resources used by a process, as getrusage() and waitrusage()
+// report them.
+
+#define RUSAGE_SELF      0   // the calling process
+#define RUSAGE_CHILDREN  1   // its children that wait() has reaped
+
+struct rusage {
+  uint64 utime;    // time run in user space, in microseconds
+  uint64 stime;    // time run in the kernel, in microseconds
+  uint64 minflt;   // page faults taken on user addresses
+  uint64 inblock;  // disk blocks read
+  uint64 oublock;  // disk blocks written
+  uint64 nvcsw;    // times it gave up the CPU to sleep
+  uint64 nivcsw;   // times it was preempted, or yielded
+};
@@ -0,0 +1,274 @@
+// Slab allocator for small, fixed-size kernel objects.
+//
+// A cache carves 2^order page blocks from kalloc_pages() into equally sized objects, so that many
+// objects share a page instead of each taking a whole one. Each slab begins with a struct slab
+// header, and since blocks from kalloc_pages() are aligned to their size, the header for any object
+// can be found by rounding the object's address down.
+//
+// In front of the slabs, every CPU keeps a small magazine of free objects. Allocations and frees
+// only take the cache's lock when the magazine runs empty or full, and then move half a magazine's
+// worth of objects at a time.
+//
+// Interface:
+// * Declare a struct kmem_cache and call kmem_cache_init() once at boot.
+// * kmem_cache_alloc() returns an uninitialized object, or 0 if out of memory.
+// * kmem_cache_free() returns an object to the cache it came from.
+
+#include "types.h"
+#include "param.h"
+#include "memlayout.h"
+#include "spinlock.h"
+#include "riscv.h"
+#include "defs.h"
+#include "slab.h"
+
+// The largest slab a cache will use is 2^SLAB_MAXORDER pages.
+#define SLAB_MAXORDER 3
+
+struct object {
+  struct object *next;
+};
+
+struct slab {
+  struct kmem_cache *cache;    // The cache this slab belongs to
+  struct slab       *next;     // Next slab on the cache's partial list
+  struct slab       *prev;     // Previous slab on the cache's partial list
+  uint               inuse;    // Number of allocated objects
+  struct object     *freelist; // Free objects in this slab
+};
+
+// Objects start after the header, rounded up so that they're 16-byte aligned.
+#define SLAB_HDRSIZE ((sizeof(struct slab) + 15) & ~15)
+
+#define SLAB_BYTES(c) ((uint64)PGSIZE << (c)->order)
+
+static void
+slab_push(struct slab **list, struct slab *s)
+{
+  s->prev = 0;
+  s->next = *list;
+
+  if (*list) {
+    (*list)->prev = s;
+  }
+
+  *list = s;
+}
+
+static void
+slab_remove(struct slab **list, struct slab *s)
+{
+  if (s->prev) {
+    s->prev->next = s->next;
+  } else {
+    *list = s->next;
+  }
+
+  if (s->next) {
+    s->next->prev = s->prev;
+  }
+
+  s->next = s->prev = 0;
+}
+
+// Allocate a new slab for cache c and thread all of its objects onto the slab's freelist.
+// Caller must hold c->lock.
+static struct slab *
+slab_create(struct kmem_cache *c)
+{
+  struct slab *s = kalloc_pages(c->order);
+
+  if (s == 0) {
+    return 0;
+  }
+
+  s->cache    = c;
+  s->next     = 0;
+  s->prev     = 0;
+  s->inuse    = 0;
+  s->freelist = 0;
+
+  char *objs = (char *)s + SLAB_HDRSIZE;
+
+  for (int i = c->objs_per_slab - 1; i >= 0; i--) {
+    struct object *obj = (struct object *)(objs + i * c->objsize);
+
+    obj->next   = s->freelist;
+    s->freelist = obj;
+  }
+
+  c->nslabs++;
+
+  return s;
+}
+
+// Find the slab that contains obj.
+static struct slab *
+slab_of(struct kmem_cache *c, void *obj)
+{
+  return (struct slab *)(KERNBASE + (((uint64)obj - KERNBASE) & ~(SLAB_BYTES(c) - 1)));
+}
+
+void
+kmem_cache_init(struct kmem_cache *c, char *name, uint objsize)
+{
+  objsize = (objsize + 15) & ~15;
+
+  if (objsize < sizeof(struct object)) {
+    objsize = sizeof(struct object);
+  }
+
+  // use the smallest slab that wastes no more than an eighth of itself
+  int order;
+  uint n = 0;
+
+  for (order = 0; order <= SLAB_MAXORDER; order++) {
+    uint64 avail = ((uint64)PGSIZE << order) - SLAB_HDRSIZE;
+
+    n = avail / objsize;
+
+    if (n > 0 && (avail - n * objsize) * 8 <= ((uint64)PGSIZE << order)) {
+      break;
+    }
+  }
+
+  if (order > SLAB_MAXORDER) {
+    order = SLAB_MAXORDER;
+  }
+
+  if (n == 0) {
+    panic("kmem_cache_init: object too large");
+  }
+
+  c->name          = name;
+  c->objsize       = objsize;
+  c->order         = order;
+  c->objs_per_slab = n;
+  c->partial       = 0;
+  c->empty         = 0;
+  c->nslabs        = 0;
+
+  for (int i = 0; i < NCPU; i++) {
+    c->mags[i].count = 0;
+  }
+
+  initlock(&c->lock, name);
+}
+
+// Fill the magazine halfway from the cache's slabs, allocating new slabs as needed.
+static void
+cache_refill(struct kmem_cache *c, struct magazine *m)
+{
+  acquire(&c->lock);
+
+  while (m->count < MAGAZINE_SIZE / 2) {
+    struct slab *s = c->partial;
+
+    if (s == 0) {
+      if (c->empty) {
+        s        = c->empty;
+        c->empty = 0;
+      } else if ((s = slab_create(c)) == 0) {
+        break;
+      }
+
+      slab_push(&c->partial, s);
+    }
+
+    struct object *obj = s->freelist;
+
+    s->freelist = obj->next;
+    s->inuse++;
+
+    // the slab is now full, so it doesn't belong on the partial list anymore
+    if (s->freelist == 0) {
+      slab_remove(&c->partial, s);
+    }
+
+    m->objs[m->count++] = obj;
+  }
+
+  release(&c->lock);
+}
+
+// Return n objects from the magazine to their slabs, freeing slabs that become completely unused.
+static void
+cache_flush(struct kmem_cache *c, struct magazine *m, uint n)
+{
+  acquire(&c->lock);
+
+  while (n-- > 0 && m->count > 0) {
+    struct object *obj = m->objs[--m->count];
+    struct slab   *s   = slab_of(c, obj);
+
+    // a full slab is on no list, and is about to have a free object again
+    if (s->freelist == 0) {
+      slab_push(&c->partial, s);
+    }
+
+    obj->next   = s->freelist;
+    s->freelist = obj;
+    s->inuse--;
+
+    if (s->inuse > 0) {
+      continue;
+    }
+
+    slab_remove(&c->partial, s);
+
+    // keep one empty slab around so that a cache hovering around a slab boundary doesn't keep
+    // allocating and freeing the same pages
+    if (c->empty == 0) {
+      c->empty = s;
+    } else {
+      c->nslabs--;
+      kfree_pages(s, c->order);
+    }
+  }
+
+  release(&c->lock);
+}
+
+// Allocate an object from cache c. Returns 0 if out of memory.
+void *
+kmem_cache_alloc(struct kmem_cache *c)
+{
+  void *obj = 0;
+
+  push_off();
+
+  struct magazine *m = &c->mags[cpuid()];
+
+  if (m->count == 0) {
+    cache_refill(c, m);
+  }
+
+  if (m->count > 0) {
+    obj = m->objs[--m->count];
+  }
+
+  pop_off();
+
+  return obj;
+}
+
+// Return an object to the cache it was allocated from.
+void
+kmem_cache_free(struct kmem_cache *c, void *obj)
+{
+  if (obj == 0 || slab_of(c, obj)->cache != c) {
+    panic("kmem_cache_free");
+  }
+
+  push_off();
+
+  struct magazine *m = &c->mags[cpuid()];
+
+  if (m->count == MAGAZINE_SIZE) {
+    cache_flush(c, m, MAGAZINE_SIZE / 2);
+  }
+
+  m->objs[m->count++] = obj;
+
+  pop_off();
+}
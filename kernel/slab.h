@@ -0,0 +1,25 @@
+// Object caches for small, fixed-size kernel objects. See slab.c.
+
+// The number of free objects each CPU can hold on to without touching the cache's lock.
+#define MAGAZINE_SIZE 16
+
+// A per-CPU stack of free objects.
+struct magazine {
+  uint  count;                // Number of objects in objs
+  void *objs[MAGAZINE_SIZE];  // Free objects, most recently freed last
+};
+
+struct kmem_cache {
+  char *name;                 // Name of the cache (debugging)
+  uint  objsize;              // Size of each object, rounded up for alignment
+  int   order;                // Each slab is 2^order contiguous pages
+  uint  objs_per_slab;        // Number of objects that fit in one slab
+
+  struct spinlock lock;       // Protects everything below except mags
+  struct slab    *partial;    // Slabs with both free and allocated objects
+  struct slab    *empty;      // At most one slab with no allocated objects
+  uint64          nslabs;     // Number of slabs currently allocated
+
+  // Indexed by cpuid(). Only touched by its own CPU with interrupts off, so there's no lock.
+  struct magazine mags[NCPU];
+};
@@ -0,0 +1,9 @@
+// Receive counters for a UDP socket, or for all of them; see sockstat().
+
+struct sockstat {
+  uint64 rxpackets;  // datagrams queued to be read
+  uint64 rxbytes;    // and their bytes
+  uint64 drops;      // datagrams dropped because the receive buffer was full
+  uint64 dropbytes;  // and their bytes
+  uint64 queued;     // bytes waiting to be read now
+};
@@ -0,0 +1,17 @@
+// File actions for spawn(), which starts a program in a new child
+// without copying the caller's address space the way fork() does.
+//
+// The child starts with a copy of the caller's open files, and the
+// actions then run on that copy, in order, before the program is
+// loaded. The caller's own files are never changed.
+
+#define NSPAWNACT 16  // most actions one spawn() takes
+
+#define SPAWN_DUP2  1  // newfd = dup of fd, closing newfd first
+#define SPAWN_CLOSE 2  // close fd
+
+struct spawnfd {
+  int op;     // SPAWN_*
+  int fd;
+  int newfd;  // for SPAWN_DUP2
+};
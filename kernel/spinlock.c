@@ -8,68 +8,175 @@
 #include "proc.h"
 #include "defs.h"
 
-#define NLOCK 500
+// Enough for every buffer (bio.c's BCACHE_MAXBUF), log shadow and
+// in-memory inode, each of which has a sleeplock, and the rest.
+#define NLOCK 8192
 
+// Every lock is registered here, for statslock(). Locks come and
+// go with pipes, address spaces, file tables and sockets, so each
+// remembers its slot, and freed slots are kept on a list, to make
+// registering and removing one quick.
 static struct spinlock *locks[NLOCK];
+static short lockfree[NLOCK]; // next free slot after slot i, or -1
+static int freeslot = -1;     // first free slot below nlocks, or -1
+static int nlocks;            // slots in use or on the free list
 struct spinlock lock_locks;
 
 void
 freelock(struct spinlock *lk)
 {
   acquire(&lock_locks);
-  int i;
-  for (i = 0; i < NLOCK; i++) {
-    if(locks[i] == lk) {
-      locks[i] = 0;
-      break;
-    }
+  if(lk->slot >= 0 && locks[lk->slot] == lk){
+    locks[lk->slot] = 0;
+    lockfree[lk->slot] = freeslot;
+    freeslot = lk->slot;
   }
+  lk->slot = -1;
   release(&lock_locks);
 }
 
+#ifdef LOCKPROF
+// With LOCKPROF, each acquire() call site, found by its return
+// address, counts the time its callers spent spinning and how long
+// they then held the lock, in time CSR ticks, so that
+// statslockprof() can name the sites to look at when deciding
+// which lock to split next.
+#define NLOCKSITE 512     // a power of two
+#define NHOLDHIST 16
+#define LOCKPROF_TOP 5
+
+struct lockprof {
+  uint64 pc;              // acquire()'s return address; 0 if unused
+  char *name;             // lock most recently acquired there
+  uint64 n;               // acquires
+  uint64 spins;           // looks that found the lock held
+  uint64 hold;            // total ticks held
+  uint64 maxhold;         // longest hold
+  uint64 hist[NHOLDHIST]; // holds of [2^i, 2^(i+1)) ticks, the last
+                          // one open-ended
+};
+
+static struct lockprof lockprof[NLOCKSITE];
+
+// Find or make the entry for call site pc, without a lock, since
+// this runs inside acquire(). Returns 0 if the table is full.
+static struct lockprof*
+lockprofof(uint64 pc)
+{
+  uint h = (pc >> 1) & (NLOCKSITE - 1);
+
+  for(int i = 0; i < NLOCKSITE; i++, h = (h + 1) & (NLOCKSITE - 1)){
+    uint64 cur = __atomic_load_n(&lockprof[h].pc, __ATOMIC_ACQUIRE);
+    if(cur == 0){
+      // claim it, unless another CPU just did.
+      if(__atomic_compare_exchange_n(&lockprof[h].pc, &cur, pc, 0,
+                                     __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+        return &lockprof[h];
+    }
+    if(cur == pc)
+      return &lockprof[h];
+  }
+  return 0;
+}
+
+// Charge an acquire of lk, which took spins looks, to call site pc.
+static void
+lockprof_acquired(struct spinlock *lk, uint64 pc, int spins)
+{
+  struct lockprof *s = lockprofof(pc);
+
+  lk->site = s;
+  lk->tacquired = r_time();
+  if(s == 0)
+    return;
+  s->name = lk->name;
+  __atomic_add_fetch(&s->n, 1, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&s->spins, spins, __ATOMIC_RELAXED);
+}
+
+// Charge the hold of lk that is ending to the site that acquired it.
+static void
+lockprof_released(struct spinlock *lk)
+{
+  struct lockprof *s = lk->site;
+  uint64 t = r_time() - lk->tacquired;
+  int b = 0;
+
+  if(s == 0)
+    return;
+  while(b < NHOLDHIST - 1 && (t >> (b + 1)) != 0)
+    b++;
+  __atomic_add_fetch(&s->hold, t, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&s->hist[b], 1, __ATOMIC_RELAXED);
+  uint64 max = __atomic_load_n(&s->maxhold, __ATOMIC_RELAXED);
+  while(t > max &&
+        !__atomic_compare_exchange_n(&s->maxhold, &max, t, 0,
+                                     __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+    ;
+}
+#endif
+
+// Remember lk for statslock(). If the table is full, lk works
+// but goes uncounted.
 static void
 findslot(struct spinlock *lk) {
   acquire(&lock_locks);
-  int i;
-  for (i = 0; i < NLOCK; i++) {
-    if(locks[i] == 0) {
-      locks[i] = lk;
-      release(&lock_locks);
-      return;
-    }
+  if(freeslot >= 0){
+    lk->slot = freeslot;
+    freeslot = lockfree[freeslot];
+  } else if(nlocks < NLOCK){
+    lk->slot = nlocks++;
+  } else {
+    lk->slot = -1;
   }
-  panic("findslot");
+  if(lk->slot >= 0)
+    locks[lk->slot] = lk;
+  release(&lock_locks);
 }
 
 void
 initlock(struct spinlock *lk, char *name)
 {
   lk->name = name;
-  lk->locked = 0;
+  lk->next = 0;
+  lk->owner = 0;
   lk->cpu = 0;
   lk->nts = 0;
   lk->n = 0;
   findslot(lk);
 }
 
+// A waiter that is k tickets from the front of the line waits
+// about k*BACKOFF loop iterations between looks at lk->owner,
+// roughly how long the holders ahead of it will take, so that
+// waiters don't keep pulling the lock's cache line away from the
+// holder.
+#define BACKOFF 50
+
 // Acquire the lock.
 // Loops (spins) until the lock is acquired.
 void
 acquire(struct spinlock *lk)
 {
+  uint ticket, owner;
+  int spins = 0;
+
   push_off(); // disable interrupts to avoid deadlock.
   if(holding(lk))
     panic("acquire");
 
-  __sync_fetch_and_add(&(lk->n), 1);
-
-  // On RISC-V, sync_lock_test_and_set turns into an atomic swap:
-  //   a5 = 1
-  //   s1 = &lk->locked
-  //   amoswap.w.aq a5, a5, (s1)
-  while(__sync_lock_test_and_set(&lk->locked, 1) != 0) {
-    __sync_fetch_and_add(&(lk->nts), 1);
+  // On RISC-V, this turns into an atomic add:
+  //   amoadd.w a5, a5, (s1)
+  ticket = __atomic_fetch_add(&lk->next, 1, __ATOMIC_RELAXED);
 
+  // the acquire ordering keeps the critical section's memory
+  // references from happening before the lock is acquired.
+  while((owner = __atomic_load_n(&lk->owner, __ATOMIC_ACQUIRE)) != ticket) {
+    for(volatile uint i = (ticket - owner) * BACKOFF; i > 0; i--)
+      ;
+    spins++;
+    // the holder may be waiting for this CPU to flush its TLB.
+    asid_poll();
   }
 
   // Tell the C compiler and the processor to not move loads or stores
@@ -79,7 +186,40 @@ acquire(struct spinlock *lk)
   __sync_synchronize();
 
   // Record info about lock acquisition for holding() and debugging.
+  // The counters are only updated by the holder, so they don't
+  // bounce the lock's cache line while others wait.
   lk->cpu = mycpu();
+  lk->n++;
+  lk->nts += spins;
+#ifdef LOCKPROF
+  lockprof_acquired(lk, (uint64)__builtin_return_address(0), spins);
+#endif
+}
+
+// Acquire the lock if it is free and no one is waiting for it,
+// without spinning. Returns 1 if it did, 0 if not, including when
+// this CPU already holds it.
+int
+tryacquire(struct spinlock *lk)
+{
+  uint owner;
+
+  push_off();
+  owner = __atomic_load_n(&lk->owner, __ATOMIC_RELAXED);
+  // take ticket owner only if it is the next one to be handed out
+  if(!__atomic_compare_exchange_n(&lk->next, &owner, owner + 1, 0,
+                                  __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)){
+    pop_off();
+    return 0;
+  }
+  __sync_synchronize();
+
+  lk->cpu = mycpu();
+  lk->n++;
+#ifdef LOCKPROF
+  lockprof_acquired(lk, (uint64)__builtin_return_address(0), 0);
+#endif
+  return 1;
 }
 
 // Release the lock.
@@ -89,6 +229,9 @@ release(struct spinlock *lk)
   if(!holding(lk))
     panic("release");
 
+#ifdef LOCKPROF
+  lockprof_released(lk);
+#endif
   lk->cpu = 0;
 
   // Tell the C compiler and the CPU to not move loads or stores
@@ -99,14 +242,11 @@ release(struct spinlock *lk)
   // On RISC-V, this emits a fence instruction.
   __sync_synchronize();
 
-  // Release the lock, equivalent to lk->locked = 0.
-  // This code doesn't use a C assignment, since the C standard
-  // implies that an assignment might be implemented with
-  // multiple store instructions.
-  // On RISC-V, sync_lock_release turns into an atomic swap:
-  //   s1 = &lk->locked
-  //   amoswap.w zero, zero, (s1)
-  __sync_lock_release(&lk->locked);
+  // Serve the next ticket. Only the holder writes lk->owner, but
+  // this doesn't use a C assignment, since the C standard implies
+  // that an assignment might be implemented with multiple store
+  // instructions.
+  __atomic_store_n(&lk->owner, lk->owner + 1, __ATOMIC_RELEASE);
 
   pop_off();
 }
@@ -117,7 +257,20 @@ int
 holding(struct spinlock *lk)
 {
   int r;
-  r = (lk->locked && lk->cpu == mycpu());
+  r = (lk->owner != lk->next && lk->cpu == mycpu());
+  return r;
+}
+
+// Check whether this cpu is holding any spinlock, or is otherwise
+// between push_off() and pop_off(), and so mustn't sleep.
+int
+holdingspin(void)
+{
+  int r;
+
+  push_off();
+  r = mycpu()->noff > 1;
+  pop_off();
   return r;
 }
 
@@ -172,31 +325,45 @@ int
 statslock(char *buf, int sz) {
   int n;
   int tot = 0;
+  struct spinlock shards;
+
+  // there may be a thousand bucket locks, too many to list, so
+  // they are added up on one line.
+  shards.name = "bcache shards";
+  shards.nts = 0;
+  shards.n = 0;
 
   acquire(&lock_locks);
   n = snprintf(buf, sz, "--- lock kmem/bcache stats\n");
-  for(int i = 0; i < NLOCK; i++) {
+  for(int i = 0; i < nlocks; i++) {
     if(locks[i] == 0)
-      break;
-    if(strncmp(locks[i]->name, "bcache", strlen("bcache")) == 0 ||
+      continue;
+    if(strncmp(locks[i]->name, "bcache shard", strlen("bcache shard")) == 0) {
+      tot += locks[i]->nts;
+      shards.nts += locks[i]->nts;
+      shards.n += locks[i]->n;
+    } else if(strncmp(locks[i]->name, "bcache", strlen("bcache")) == 0 ||
        strncmp(locks[i]->name, "kmem", strlen("kmem")) == 0) {
       tot += locks[i]->nts;
       n += snprint_lock(buf +n, sz-n, locks[i]);
     }
   }
+  n += snprint_lock(buf +n, sz-n, &shards);
 
   n += snprintf(buf+n, sz-n, "--- top 5 contended locks:\n");
   int last = 100000000;
   // stupid way to compute top 5 contended locks
   for(int t = 0; t < 5; t++) {
-    int top = 0;
-    for(int i = 0; i < NLOCK; i++) {
-      if(locks[i] == 0)
-        break;
-      if(locks[i]->nts > locks[top]->nts && locks[i]->nts < last) {
+    int top = -1;
+    for(int i = 0; i < nlocks; i++) {
+      if(locks[i] == 0 || locks[i]->nts >= last)
+        continue;
+      if(top < 0 || locks[i]->nts > locks[top]->nts) {
         top = i;
       }
     }
+    if(top < 0)
+      break;
     n += snprint_lock(buf+n, sz-n, locks[top]);
     last = locks[top]->nts;
   }
@@ -204,3 +371,52 @@ statslock(char *buf, int sz) {
   release(&lock_locks);
   return n;
 }
+
+#ifdef LOCKPROF
+static int
+snprint_lockprof(char *buf, int sz, struct lockprof *s)
+{
+  int n;
+
+  n = snprintf(buf, sz, "site %p: %s: #spin %d #acquire() %d hold avg %d max %d\n",
+               s->pc, s->name, (int)s->spins, (int)s->n,
+               (int)(s->n ? s->hold / s->n : 0), (int)s->maxhold);
+  n += snprintf(buf+n, sz-n, "  hold log2 ticks:");
+  for(int b = 0; b < NHOLDHIST; b++)
+    n += snprintf(buf+n, sz-n, " %d", (int)s->hist[b]);
+  n += snprintf(buf+n, sz-n, "\n");
+  return n;
+}
+
+// Report the LOCKPROF_TOP call sites that spun the most, and the
+// LOCKPROF_TOP that held their locks the longest in all, with a
+// histogram of their hold times. The counters are read without a
+// lock, so they may be a little behind.
+int
+statslockprof(char *buf, int sz)
+{
+  char seen[NLOCKSITE];
+  int n = 0;
+
+  for(int by = 0; by < 2; by++){
+    n += snprintf(buf+n, sz-n, by == 0 ? "--- top %d spinning call sites:\n" :
+                  "--- top %d holding call sites:\n", LOCKPROF_TOP);
+    memset(seen, 0, sizeof(seen));
+    for(int t = 0; t < LOCKPROF_TOP; t++){
+      int top = -1;
+      for(int i = 0; i < NLOCKSITE; i++){
+        if(lockprof[i].pc == 0 || seen[i])
+          continue;
+        uint64 v = by == 0 ? lockprof[i].spins : lockprof[i].hold;
+        if(top < 0 || v > (by == 0 ? lockprof[top].spins : lockprof[top].hold))
+          top = i;
+      }
+      if(top < 0)
+        break;
+      seen[top] = 1;
+      n += snprint_lockprof(buf+n, sz-n, &lockprof[top]);
+    }
+  }
+  return n;
+}
+#endif
@@ -1,11 +1,18 @@
-// Mutual exclusion lock.
+// Mutual exclusion lock. A ticket lock: each acquire() takes the
+// next ticket, and CPUs get the lock in the order they took them.
 struct spinlock {
-  uint locked;       // Is the lock held?
+  uint next;         // Ticket for the next acquire()
+  uint owner;        // Ticket now holding the lock; held if != next
 
   // For debugging:
   char *name;        // Name of lock.
   struct cpu *cpu;   // The cpu holding the lock.
-  int nts;
-  int n;
+  int nts;           // Times acquire() looked and found it held.
+  int n;             // Times it was acquired.
+  int slot;          // Index in spinlock.c's table, or -1.
+#ifdef LOCKPROF
+  uint64 tacquired;  // time CSR when it was acquired
+  struct lockprof *site; // acquire() call site of the holder
+#endif
 };
 
@@ -18,12 +18,14 @@ sputc(char *s, char c)
   return 1;
 }
 
+// The sprint functions write at most sz characters, and return how
+// many they wrote.
 static int
-sprintint(char *s, int xx, int base, int sign)
+sprintint(char *s, int sz, long xx, int base, int sign)
 {
-  char buf[16];
+  char buf[24];
   int i, n;
-  uint x;
+  uint64 x;
 
   if(sign && (sign = xx < 0))
     x = -xx;
@@ -39,11 +41,26 @@ sprintint(char *s, int xx, int base, int sign)
     buf[i++] = '-';
 
   n = 0;
-  while(--i >= 0)
+  while(--i >= 0 && n < sz)
     n += sputc(s+n, buf[i]);
   return n;
 }
 
+static int
+sprintptr(char *s, int sz, uint64 x)
+{
+  char buf[2 + sizeof(uint64) * 2];
+  int i, n = 0;
+
+  buf[n++] = '0';
+  buf[n++] = 'x';
+  for (i = 0; i < (sizeof(uint64) * 2); i++, x <<= 4)
+    buf[n++] = digits[x >> (sizeof(uint64) * 8 - 4)];
+  for (i = 0; i < n && i < sz; i++)
+    sputc(s+i, buf[i]);
+  return i;
+}
+
 int
 snprintf(char *buf, int sz, char *fmt, ...)
 {
@@ -66,10 +83,16 @@ snprintf(char *buf, int sz, char *fmt, ...)
       break;
     switch(c){
     case 'd':
-      off += sprintint(buf+off, va_arg(ap, int), 10, 1);
+      off += sprintint(buf+off, sz-off, va_arg(ap, int), 10, 1);
+      break;
+    case 'l':
+      off += sprintint(buf+off, sz-off, va_arg(ap, uint64), 10, 0);
       break;
     case 'x':
-      off += sprintint(buf+off, va_arg(ap, int), 16, 1);
+      off += sprintint(buf+off, sz-off, va_arg(ap, int), 16, 1);
+      break;
+    case 'p':
+      off += sprintptr(buf+off, sz-off, va_arg(ap, uint64));
       break;
     case 's':
       if((s = va_arg(ap, char*)) == 0)
@@ -83,7 +106,8 @@ snprintf(char *buf, int sz, char *fmt, ...)
     default:
       // Print unknown % sequence to draw attention.
       off += sputc(buf+off, '%');
-      off += sputc(buf+off, c);
+      if(off < sz)
+        off += sputc(buf+off, c);
       break;
     }
   }
@@ -10,3 +10,25 @@ struct stat {
   short nlink; // Number of links to file
   uint64 size; // Size of file in bytes
 };
+
+// A file system's sizes and free counts, as returned by statfs().
+struct statfs {
+  int dev;      // File system's disk device
+  uint bsize;   // Size of a block in bytes
+  uint blocks;  // Number of data blocks
+  uint bfree;   // Number of free blocks
+  uint files;   // Number of inodes
+  uint ffree;   // Number of free inodes
+};
+
+// A directory entry, as returned by getdents().
+struct dent {
+  uint ino;      // Inode number
+  short type;    // Type of file, or 0 without GETDENTS_STAT
+  short pad;
+  uint64 size;   // Size of file in bytes, or 0 without GETDENTS_STAT
+  char name[16]; // NUL-terminated
+};
+
+// getdents() flags
+#define GETDENTS_STAT 0x1  // also fill in each entry's type and size
@@ -9,7 +9,7 @@
 #include "riscv.h"
 #include "defs.h"
 
-#define BUFSZ 4096
+#define BUFSZ 8192
 static struct {
   struct spinlock lock;
   char buf[BUFSZ];
@@ -19,11 +19,20 @@ static struct {
 
 int statscopyin(char*, int);
 int statslock(char*, int);
+#ifdef LOCKPROF
+int statslockprof(char*, int);
+#endif
 
+// With KBENCH, a write runs the in-kernel benchmarks on this CPU.
 int
 statswrite(int user_src, uint64 src, int n)
 {
+#ifdef KBENCH
+  kbench();
+  return n;
+#else
   return -1;
+#endif
 }
 
 int
@@ -31,6 +40,8 @@ statsread(int user_dst, uint64 dst, int n)
 {
   int m;
 
+  if(user_dst)
+    uvmprefault(dst, n < BUFSZ ? n : BUFSZ, 1);
   acquire(&stats.lock);
 
   if(stats.sz == 0) {
@@ -38,6 +49,15 @@ statsread(int user_dst, uint64 dst, int n)
     stats.sz = statscopyin(stats.buf, BUFSZ);
 #endif
     stats.sz = statslock(stats.buf, BUFSZ);
+    stats.sz += kallocstats(stats.buf + stats.sz, BUFSZ - stats.sz);
+    stats.sz += trapstats(stats.buf + stats.sz, BUFSZ - stats.sz);
+    stats.sz += netstats(stats.buf + stats.sz, BUFSZ - stats.sz);
+#ifdef LOCKPROF
+    stats.sz += statslockprof(stats.buf + stats.sz, BUFSZ - stats.sz);
+#endif
+#ifdef KBENCH
+    stats.sz += kbenchstats(stats.buf + stats.sz, BUFSZ - stats.sz);
+#endif
   }
   m = stats.sz - stats.off;
 
@@ -41,11 +41,31 @@ memmove(void *dst, const void *src, uint n)
   if(s < d && s + n > d){
     s += n;
     d += n;
+    // copy a word at a time once d is aligned, if s lines up too.
+    if((((uint64)s ^ (uint64)d) & 7) == 0){
+      for(; n > 0 && ((uint64)d & 7); n--)
+        *--d = *--s;
+      for(; n >= 8; n -= 8){
+        s -= 8;
+        d -= 8;
+        *(uint64*)d = *(const uint64*)s;
+      }
+    }
     while(n-- > 0)
       *--d = *--s;
-  } else
+  } else {
+    if((((uint64)s ^ (uint64)d) & 7) == 0){
+      for(; n > 0 && ((uint64)d & 7); n--)
+        *d++ = *s++;
+      for(; n >= 8; n -= 8){
+        *(uint64*)d = *(const uint64*)s;
+        d += 8;
+        s += 8;
+      }
+    }
     while(n-- > 0)
       *d++ = *s++;
+  }
 
   return dst;
 }
@@ -105,3 +125,26 @@ strlen(const char *s)
   return n;
 }
 
+
+// Like strlen, but look at no more than n bytes, returning n if
+// none of them is a NUL. Reads a word at a time once s is aligned,
+// but never reads past s[n-1].
+uint
+strnlen(const char *s, uint n)
+{
+  uint i = 0;
+
+  for(; i < n && ((uint64)(s + i) & 7); i++)
+    if(s[i] == 0)
+      return i;
+  for(; i + 8 <= n; i += 8){
+    uint64 w = *(const uint64*)(s + i);
+    // nonzero if some byte of w is zero.
+    if((w - 0x0101010101010101UL) & ~w & 0x8080808080808080UL)
+      break;
+  }
+  for(; i < n; i++)
+    if(s[i] == 0)
+      return i;
+  return n;
+}
@@ -0,0 +1,270 @@
+// Swap space, where user pages go when memory runs out.
+//
+// mkfs puts a swap area after the root file system, which its superblock's swapstart and nswap
+// describe, and fsinit() hands it to swapon(). It is divided into page-sized slots, each with a
+// reference count: the PTE of a page that has been swapped out (see PTE_SWAP in riscv.h) holds a
+// reference to its slot, as does each copy of the PTE that fork() makes, and a page-table page that
+// fork() shares holds one for all its sharers. A slot is also busy while its page is being written
+// out, and a fault on the page waits for that before reading it back.
+//
+// When kalloc() fails, the page fault paths in vm.c call swapout(), which moves a CLOCK hand over
+// the processes, having uvmswapout() pick pages of each that haven't been used since the hand last
+// passed, and writes a batch of them out to swap before freeing them. The swap area is on the
+// virtio disk, and its blocks go straight to it rather than through the buffer cache.
+
+#include "types.h"
+#include "param.h"
+#include "memlayout.h"
+#include "riscv.h"
+#include "spinlock.h"
+#include "sleeplock.h"
+#include "proc.h"
+#include "fs.h"
+#include "buf.h"
+#include "defs.h"
+
+#define SLOTBLOCKS (PGSIZE / BSIZE)  // disk blocks in a slot
+#define SWAP_BATCH 16                // most pages swapout() writes out at once
+#define SWAP_BUSY  0x8000            // in swap.ref[]: the slot's page is being written out
+
+extern struct proc proc[NPROC];
+
+static struct {
+  struct spinlock lock;
+  uint            dev;
+  uint            start;   // first block of the swap area
+  uint            nslots;  // 0 if there's no swap
+  uint            nfree;
+  uint            next;    // where swapalloc() looks for a free slot first
+  ushort         *ref;     // for each slot, its references and SWAP_BUSY; 0 if free
+
+  // Held by swapout(), which runs one at a time: the CLOCK hand, the process and the address in
+  // its address space that it looks at next, and the bufs it writes pages out with.
+  struct sleeplock io;
+  int              hand;
+  uint64           handva;
+  struct buf       bufs[SWAP_BATCH * SLOTBLOCKS];
+} swap;
+
+void
+swapinit(void)
+{
+  initlock(&swap.lock, "swap");
+  initsleeplock(&swap.io, "swapio");
+}
+
+// Start swapping to the nblocks blocks of dev from start.
+void
+swapon(uint dev, uint start, uint nblocks)
+{
+  uint nslots = nblocks / SLOTBLOCKS;
+  int order   = 0;
+
+  if (nslots == 0) {
+    return;
+  }
+
+  while (order < KMAXORDER && ((uint64)PGSIZE << order) < nslots * sizeof(ushort)) {
+    order++;
+  }
+
+  if (((uint64)PGSIZE << order) < nslots * sizeof(ushort)) {
+    nslots = ((uint64)PGSIZE << order) / sizeof(ushort);
+  }
+
+  ushort *ref = kalloc_pages(order);
+
+  if (ref == 0) {
+    printf("swapon: no memory for %d slots\n", nslots);
+    return;
+  }
+
+  memset(ref, 0, (uint64)PGSIZE << order);
+
+  acquire(&swap.lock);
+  swap.dev   = dev;
+  swap.start = start;
+  swap.ref   = ref;
+  swap.nfree = nslots;
+  swap.next  = 0;
+  __atomic_store_n(&swap.nslots, nslots, __ATOMIC_RELEASE);
+  release(&swap.lock);
+}
+
+// Allocate a slot for a page that is about to be written out: busy, with one reference. Returns
+// the slot, or -1 if swap is full.
+int
+swapalloc(void)
+{
+  int s = -1;
+
+  acquire(&swap.lock);
+
+  if (swap.nfree > 0) {
+    while (swap.ref[swap.next] != 0) {
+      swap.next = (swap.next + 1) % swap.nslots;
+    }
+
+    s           = swap.next;
+    swap.ref[s] = SWAP_BUSY | 1;
+    swap.next   = (swap.next + 1) % swap.nslots;
+    swap.nfree--;
+  }
+
+  release(&swap.lock);
+
+  return s;
+}
+
+// Add a reference to slot s, for a copy of a PTE that refers to it.
+void
+swapdup(uint s)
+{
+  acquire(&swap.lock);
+  swap.ref[s]++;
+  release(&swap.lock);
+}
+
+// Drop a reference to slot s. It's free once it has none left and isn't busy.
+void
+swapfree(uint s)
+{
+  acquire(&swap.lock);
+
+  if ((swap.ref[s] & ~SWAP_BUSY) == 0) {
+    panic("swapfree");
+  }
+
+  if (--swap.ref[s] == 0) {
+    swap.nfree++;
+  }
+
+  release(&swap.lock);
+}
+
+// Give back slot s, which swapalloc() returned but no PTE came to refer to. No one can be waiting
+// for it, so unlike swapdone() this wakes no one up, and may be called with p->lock held.
+void
+swapcancel(uint s)
+{
+  acquire(&swap.lock);
+
+  if (swap.ref[s] != (SWAP_BUSY | 1)) {
+    panic("swapcancel");
+  }
+
+  swap.ref[s] = 0;
+  swap.nfree++;
+
+  release(&swap.lock);
+}
+
+// Slot s's page has been written out, so faults can read it back.
+void
+swapdone(uint s)
+{
+  acquire(&swap.lock);
+
+  swap.ref[s] &= ~SWAP_BUSY;
+
+  if (swap.ref[s] == 0) {
+    swap.nfree++;
+  }
+
+  wakeup(&swap.ref[s]);
+  release(&swap.lock);
+}
+
+// Point bufs b[0..SLOTBLOCKS) at the page pa, and at the blocks of slot s, and add them to bp.
+static void
+swapbufs(struct buf *b, struct buf **bp, uint s, uint64 pa)
+{
+  for (int i = 0; i < SLOTBLOCKS; i++) {
+    b[i].dev     = swap.dev;
+    b[i].blockno = swap.start + s * SLOTBLOCKS + i;
+    b[i].data    = (uchar *)pa + i * BSIZE;
+    bp[i]        = &b[i];
+  }
+}
+
+// Read the page in slot s into the page pa, once it has been written out. The caller must hold a
+// reference to s, so that it isn't freed and reused during the read.
+void
+swapread(uint s, uint64 pa)
+{
+  struct buf b[SLOTBLOCKS];
+  struct buf *bp[SLOTBLOCKS];
+
+  acquire(&swap.lock);
+
+  while (swap.ref[s] & SWAP_BUSY) {
+    sleep(&swap.ref[s], &swap.lock);
+  }
+
+  release(&swap.lock);
+
+  swapbufs(b, bp, s, pa);
+  virtio_disk_start(bp, SLOTBLOCKS, 0, 0);
+
+  for (int i = 0; i < SLOTBLOCKS; i++) {
+    virtio_disk_wait(bp[i]);
+  }
+}
+
+// Free up some memory by evicting a batch of user pages, to swap or, for clean pages of MAP_SHARED
+// mappings, to the page cache. Sleeps, so the caller mustn't hold any spinlocks. Returns the number
+// of pages freed, or 0 if there were none to evict.
+int
+swapout(void)
+{
+  uint64 pa[SWAP_BATCH];
+  uint slot[SWAP_BATCH];
+  struct buf *bp[SWAP_BATCH * SLOTBLOCKS];
+  int n       = 0;
+  int dropped = 0;
+
+  acquiresleep(&swap.io);
+
+  // two trips around, the first of which may only clear accessed bits
+  for (int i = 0; n + dropped < SWAP_BATCH && i <= 2 * NPROC;) {
+    struct proc *p = &proc[swap.hand];
+
+    // p->lock keeps p->mm from being freed, or replaced by exec()
+    acquire(&p->lock);
+
+    if (p->state != UNUSED && p->state != ZOMBIE && p->mm) {
+      n += uvmswapout(p->mm, &swap.handva, pa + n, slot + n, SWAP_BATCH - n, &dropped);
+    } else {
+      swap.handva = 0;
+    }
+
+    release(&p->lock);
+
+    if (swap.handva == 0) {
+      swap.hand = (swap.hand + 1) % NPROC;
+      i++;
+    }
+  }
+
+  // the pages are no longer mapped anywhere, so write them all out at once
+  for (int k = 0; k < n; k++) {
+    swapbufs(&swap.bufs[k * SLOTBLOCKS], &bp[k * SLOTBLOCKS], slot[k], pa[k]);
+  }
+
+  if (n > 0) {
+    virtio_disk_start(bp, n * SLOTBLOCKS, 1, 0);
+  }
+
+  for (int k = 0; k < n * SLOTBLOCKS; k++) {
+    virtio_disk_wait(bp[k]);
+  }
+
+  for (int k = 0; k < n; k++) {
+    swapdone(slot[k]);
+    kfree((void *)pa[k]);
+  }
+
+  releasesleep(&swap.io);
+
+  return n + (dropped > 0 ? pagecache_reclaim() : 0);
+}
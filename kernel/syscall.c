@@ -3,16 +3,19 @@
 #include "memlayout.h"
 #include "riscv.h"
 #include "spinlock.h"
+#include "sleeplock.h"
 #include "proc.h"
 #include "syscall.h"
+#include "sysprof.h"
 #include "defs.h"
+#include "vm.h"
 
 // Fetch the uint64 at addr from the current process.
 int
 fetchaddr(uint64 addr, uint64 *ip)
 {
   struct proc *p = myproc();
-  if(addr >= p->sz || addr+sizeof(uint64) > p->sz) // both tests needed, in case of overflow
+  if(addr >= p->mm->sz || addr+sizeof(uint64) > p->mm->sz) // both tests needed, in case of overflow
     return -1;
   if(copyin(p->pagetable, (char *)ip, addr, sizeof(*ip)) != 0)
     return -1;
@@ -111,6 +114,43 @@ extern uint64 sys_munmap(void);
 extern uint64 sys_connect(void);
 extern uint64 sys_pgaccess(void);
 extern uint64 sys_backtrace(void);
+extern uint64 sys_hugepages(void);
+extern uint64 sys_msync(void);
+extern uint64 sys_wsscan(void);
+extern uint64 sys_madvise(void);
+extern uint64 sys_getdents(void);
+extern uint64 sys_pread(void);
+extern uint64 sys_pwrite(void);
+extern uint64 sys_statfs(void);
+extern uint64 sys_sendfile(void);
+extern uint64 sys_setpriority(void);
+extern uint64 sys_sched_setaffinity(void);
+extern uint64 sys_clone(void);
+extern uint64 sys_futex_wait(void);
+extern uint64 sys_futex_wake(void);
+extern uint64 sys_ring_enter(void);
+extern uint64 sys_sysprof(void);
+extern uint64 sys_usleep(void);
+extern uint64 sys_ualarm(void);
+extern uint64 sys_uprof(void);
+extern uint64 sys_uprofread(void);
+extern uint64 sys_kprof(void);
+extern uint64 sys_kprofread(void);
+extern uint64 sys_spawn(void);
+extern uint64 sys_getrusage(void);
+extern uint64 sys_waitrusage(void);
+extern uint64 sys_vmsplice(void);
+extern uint64 sys_fcntl(void);
+extern uint64 sys_poll(void);
+extern uint64 sys_recvmmsg(void);
+extern uint64 sys_sendmmsg(void);
+extern uint64 sys_recvzc(void);
+extern uint64 sys_recvzcdone(void);
+extern uint64 sys_sockstat(void);
+extern uint64 sys_sigdone(void);
+extern uint64 sys_ucounters(void);
+extern uint64 sys_hpmevent(void);
+extern uint64 sys_hpmread(void);
 
 // disable clang-format for the following arrays,
 // see https://github.com/llvm/llvm-project/issues/61560)
@@ -150,6 +190,43 @@ static uint64 (*syscalls[])(void) = {
   [SYS_connect]   sys_connect,
   [SYS_pgaccess]  sys_pgaccess,
   [SYS_backtrace] sys_backtrace,
+  [SYS_hugepages] sys_hugepages,
+  [SYS_msync]     sys_msync,
+  [SYS_wsscan]    sys_wsscan,
+  [SYS_madvise]   sys_madvise,
+  [SYS_getdents]  sys_getdents,
+  [SYS_pread]     sys_pread,
+  [SYS_pwrite]    sys_pwrite,
+  [SYS_statfs]    sys_statfs,
+  [SYS_sendfile]  sys_sendfile,
+  [SYS_setpriority] sys_setpriority,
+  [SYS_sched_setaffinity] sys_sched_setaffinity,
+  [SYS_clone]     sys_clone,
+  [SYS_futex_wait] sys_futex_wait,
+  [SYS_futex_wake] sys_futex_wake,
+  [SYS_ring_enter] sys_ring_enter,
+  [SYS_sysprof]   sys_sysprof,
+  [SYS_usleep]    sys_usleep,
+  [SYS_ualarm]    sys_ualarm,
+  [SYS_uprof]     sys_uprof,
+  [SYS_uprofread] sys_uprofread,
+  [SYS_kprof]     sys_kprof,
+  [SYS_kprofread] sys_kprofread,
+  [SYS_spawn]     sys_spawn,
+  [SYS_getrusage] sys_getrusage,
+  [SYS_waitrusage] sys_waitrusage,
+  [SYS_vmsplice]  sys_vmsplice,
+  [SYS_fcntl]     sys_fcntl,
+  [SYS_poll]      sys_poll,
+  [SYS_recvmmsg]  sys_recvmmsg,
+  [SYS_sendmmsg]  sys_sendmmsg,
+  [SYS_recvzc]    sys_recvzc,
+  [SYS_recvzcdone] sys_recvzcdone,
+  [SYS_sockstat]  sys_sockstat,
+  [SYS_sigdone]   sys_sigdone,
+  [SYS_ucounters] sys_ucounters,
+  [SYS_hpmevent]  sys_hpmevent,
+  [SYS_hpmread]   sys_hpmread,
 };
 
 // An array mapping syscall numbers from syscall.h
@@ -186,10 +263,120 @@ static const char *syscall_names[] = {
   [SYS_connect]   "connect",
   [SYS_pgaccess]  "pgaccess",
   [SYS_backtrace] "backtrace",
+  [SYS_hugepages] "hugepages",
+  [SYS_msync]     "msync",
+  [SYS_wsscan]    "wsscan",
+  [SYS_madvise]   "madvise",
+  [SYS_getdents]  "getdents",
+  [SYS_pread]     "pread",
+  [SYS_pwrite]    "pwrite",
+  [SYS_statfs]    "statfs",
+  [SYS_sendfile]  "sendfile",
+  [SYS_setpriority] "setpriority",
+  [SYS_sched_setaffinity] "sched_setaffinity",
+  [SYS_clone] "clone",
+  [SYS_futex_wait] "futex_wait",
+  [SYS_futex_wake] "futex_wake",
+  [SYS_ring_enter] "ring_enter",
+  [SYS_sysprof]   "sysprof",
+  [SYS_usleep]    "usleep",
+  [SYS_ualarm]    "ualarm",
+  [SYS_uprof]     "uprof",
+  [SYS_uprofread] "uprofread",
+  [SYS_kprof]     "kprof",
+  [SYS_kprofread] "kprofread",
+  [SYS_spawn]     "spawn",
+  [SYS_getrusage] "getrusage",
+  [SYS_waitrusage] "waitrusage",
+  [SYS_vmsplice]  "vmsplice",
+  [SYS_fcntl]     "fcntl",
+  [SYS_poll]      "poll",
+  [SYS_recvmmsg]  "recvmmsg",
+  [SYS_sendmmsg]  "sendmmsg",
+  [SYS_recvzc]    "recvzc",
+  [SYS_recvzcdone] "recvzcdone",
+  [SYS_sockstat]  "sockstat",
+  [SYS_sigdone]   "sigdone",
+  [SYS_ucounters] "ucounters",
+  [SYS_hpmevent]  "hpmevent",
+  [SYS_hpmread]   "hpmread",
 };
 
 // clang-format on
 
+// Per-CPU counts of the system calls made by sysprof_pid, or by
+// every process if it is 0, or by none if it is -1.
+static struct sysprof sysprofs[NCPU][NSYSPROF] __attribute__((aligned(64)));
+static int sysprof_pid = -1;
+
+static int
+sysprofiling(struct proc *p)
+{
+  int pid = __atomic_load_n(&sysprof_pid, __ATOMIC_RELAXED);
+
+  return pid == 0 || pid == p->pid;
+}
+
+// Count a call to system call num that took t ticks.
+static void
+sysprof_add(int num, uint64 t)
+{
+  struct sysprof *s;
+  int b = 0;
+
+  while(b < NSYSHIST - 1 && (t >> (b + 1)) != 0)
+    b++;
+
+  // count it on the CPU it finished on, which can't change meanwhile.
+  push_off();
+  s = &sysprofs[cpuid()][num];
+  s->n++;
+  s->time += t;
+  s->hist[b]++;
+  pop_off();
+}
+
+// sysprof(pid, buf): copy the counts gathered so far, summed over
+// the CPUs, to the NSYSPROF struct sysprofs at buf unless it is 0.
+// Then start again from zero, counting pid's system calls, or every
+// process's if pid is 0, or stopping if pid is -1. A system call in
+// progress on another CPU meanwhile may be lost or half counted.
+uint64
+sys_sysprof(void)
+{
+  struct proc *p = myproc();
+  struct sysprof s;
+  int pid;
+  uint64 buf;
+
+  argint(0, &pid);
+  argaddr(1, &buf);
+  if(pid < -1)
+    return -1;
+
+  if(buf != 0){
+    for(int num = 0; num < NSYSPROF; num++){
+      memset(&s, 0, sizeof(s));
+      if(num < NELEM(syscall_names) && syscall_names[num])
+        safestrcpy(s.name, syscall_names[num], sizeof(s.name));
+      for(int c = 0; c < NCPU; c++){
+        struct sysprof *cs = &sysprofs[c][num];
+        s.n += cs->n;
+        s.time += cs->time;
+        for(int b = 0; b < NSYSHIST; b++)
+          s.hist[b] += cs->hist[b];
+      }
+      if(copyout(p->pagetable, buf + num * sizeof(s), (char *)&s, sizeof(s)) < 0)
+        return -1;
+    }
+  }
+
+  __atomic_store_n(&sysprof_pid, -1, __ATOMIC_RELAXED);
+  memset(sysprofs, 0, sizeof(sysprofs));
+  __atomic_store_n(&sysprof_pid, pid, __ATOMIC_RELAXED);
+  return 0;
+}
+
 void
 syscall(void)
 {
@@ -199,10 +386,16 @@ syscall(void)
   num = p->trapframe->a7;
 
   if(num > 0 && num < NELEM(syscalls) && syscalls[num]) {
+    int prof = num < NSYSPROF && sysprofiling(p);
+    uint64 t0 = prof ? r_time() : 0;
+
     // Use num to lookup the system call function for num, call it,
     // and store its return value in p->trapframe->a0
     uint64 retval = syscalls[num]();
 
+    if(prof)
+      sysprof_add(num, r_time() - t0);
+
     if (p->trace_mask & (1 << num)) {
       printf("%d: syscall %s -> %d\n", p->pid, syscall_names[num], retval);
     }
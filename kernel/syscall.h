@@ -32,3 +32,40 @@
 #define SYS_connect   29
 #define SYS_pgaccess  30
 #define SYS_backtrace 31
+#define SYS_hugepages 32
+#define SYS_msync     33
+#define SYS_wsscan    34
+#define SYS_madvise   35
+#define SYS_getdents  36
+#define SYS_pread     37
+#define SYS_pwrite    38
+#define SYS_statfs    39
+#define SYS_sendfile  40
+#define SYS_setpriority 41
+#define SYS_sched_setaffinity 42
+#define SYS_clone  43
+#define SYS_futex_wait 44
+#define SYS_futex_wake 45
+#define SYS_ring_enter 46
+#define SYS_sysprof 47
+#define SYS_usleep 48
+#define SYS_ualarm 49
+#define SYS_uprof  50
+#define SYS_uprofread 51
+#define SYS_kprof  52
+#define SYS_kprofread 53
+#define SYS_spawn 54
+#define SYS_getrusage 55
+#define SYS_waitrusage 56
+#define SYS_vmsplice 57
+#define SYS_fcntl 58
+#define SYS_poll 59
+#define SYS_recvmmsg 60
+#define SYS_sendmmsg 61
+#define SYS_recvzc 62
+#define SYS_recvzcdone 63
+#define SYS_sockstat 64
+#define SYS_sigdone 65
+#define SYS_ucounters 66
+#define SYS_hpmevent 67
+#define SYS_hpmread 68
@@ -15,9 +15,14 @@
 #include "sleeplock.h"
 #include "file.h"
 #include "fcntl.h"
+#include "ring.h"
+#include "spawn.h"
+#include "poll.h"
 
 // Fetch the nth word-sized system call argument as a file descriptor
-// and return both the descriptor and the corresponding struct file.
+// and return both the descriptor and the corresponding struct file,
+// with a reference that the caller must drop with fput(), since
+// another thread may close the descriptor meanwhile.
 static int
 argfd(int n, int *pfd, struct file **pf)
 {
@@ -25,12 +30,11 @@ argfd(int n, int *pfd, struct file **pf)
   struct file *f;
 
   argint(n, &fd);
-  if(fd < 0 || fd >= NOFILE || (f=myproc()->ofile[fd]) == 0)
+  if((f=fget(myproc()->fdt, fd)) == 0)
     return -1;
   if(pfd)
     *pfd = fd;
-  if(pf)
-    *pf = f;
+  *pf = f;
   return 0;
 }
 
@@ -40,15 +44,31 @@ static int
 fdalloc(struct file *f)
 {
   int fd;
-  struct proc *p = myproc();
+  struct fdtable *t = myproc()->fdt;
 
-  for(fd = 0; fd < NOFILE; fd++){
-    if(p->ofile[fd] == 0){
-      p->ofile[fd] = f;
-      return fd;
-    }
+  acquire(&t->lock);
+  if((fd = fdtlowest(t)) >= 0 && fdtset(t, fd, f) < 0)
+    fd = -1;
+  release(&t->lock);
+  return fd;
+}
+
+// Free file descriptor fd, if it is still open to f, since
+// another thread may have closed it. Returns 0, or -1 if not.
+// The caller closes f.
+static int
+fdfree(int fd, struct file *f)
+{
+  struct fdtable *t = myproc()->fdt;
+  int r = -1;
+
+  acquire(&t->lock);
+  if(fdtget(t, fd) == f){
+    fdtset(t, fd, 0);
+    r = 0;
   }
-  return -1;
+  release(&t->lock);
+  return r;
 }
 
 uint64
@@ -57,11 +77,11 @@ sys_dup(void)
   struct file *f;
   int fd;
 
+  // the new descriptor takes over argfd()'s reference.
   if(argfd(0, 0, &f) < 0)
     return -1;
   if((fd=fdalloc(f)) < 0)
-    return -1;
-  filedup(f);
+    fput(f);
   return fd;
 }
 
@@ -69,54 +89,374 @@ uint64
 sys_read(void)
 {
   struct file *f;
-  int n;
+  int n, r;
   uint64 p;
 
   argaddr(1, &p);
   argint(2, &n);
   if(argfd(0, 0, &f) < 0)
     return -1;
-  return fileread(f, p, n);
+  r = fileread(f, p, n);
+  fput(f);
+  return r;
 }
 
 uint64
 sys_write(void)
 {
   struct file *f;
-  int n;
+  int n, r;
+  uint64 p;
+
+  argaddr(1, &p);
+  argint(2, &n);
+  if(argfd(0, 0, &f) < 0)
+    return -1;
+  r = filewrite(f, p, n);
+  fput(f);
+  return r;
+}
+
+uint64
+sys_sendfile(void)
+{
+  struct file *out, *in;
+  int off, n, r;
+
+  argint(2, &off);
+  argint(3, &n);
+  if(off < 0 || n < 0 || argfd(0, 0, &out) < 0)
+    return -1;
+  if(argfd(1, 0, &in) < 0){
+    fput(out);
+    return -1;
+  }
+  r = filesendfile(out, in, off, n);
+  fput(in);
+  fput(out);
+  return r;
+}
+
+uint64
+sys_statfs(void)
+{
+  char path[MAXPATH];
+  struct inode *ip;
+  struct statfs st;
+  uint64 addr; // user pointer to struct statfs
+
+  argaddr(1, &addr);
+  if(argstr(0, path, MAXPATH) < 0)
+    return -1;
+  begin_op();
+  if((ip = namei(path)) == 0){
+    end_op();
+    return -1;
+  }
+  statfsi(ip, &st);
+  iput(ip);
+  end_op();
+  if(copyout(myproc()->pagetable, addr, (char *)&st, sizeof(st)) < 0)
+    return -1;
+  return 0;
+}
+
+// Read or write at an explicit offset, which must not be negative.
+uint64
+sys_pread(void)
+{
+  struct file *f;
+  int n, off, r;
+  uint64 p;
+
+  argaddr(1, &p);
+  argint(2, &n);
+  argint(3, &off);
+  if(off < 0 || argfd(0, 0, &f) < 0)
+    return -1;
+  r = filepread(f, p, n, off);
+  fput(f);
+  return r;
+}
+
+uint64
+sys_pwrite(void)
+{
+  struct file *f;
+  int n, off, r;
+  uint64 p;
+
+  argaddr(1, &p);
+  argint(2, &n);
+  argint(3, &off);
+  if(off < 0 || argfd(0, 0, &f) < 0)
+    return -1;
+  r = filepwrite(f, p, n, off);
+  fput(f);
+  return r;
+}
+
+uint64
+sys_vmsplice(void)
+{
+  struct file *f;
+  int n, r;
+  uint64 p;
+
+  argaddr(1, &p);
+  argint(2, &n);
+  if(argfd(0, 0, &f) < 0)
+    return -1;
+  r = filevmsplice(f, p, n);
+  fput(f);
+  return r;
+}
+
+uint64
+sys_recvmmsg(void)
+{
+  struct file *f;
+  int n, r;
+  uint64 p;
+
+  argaddr(1, &p);
+  argint(2, &n);
+  if(argfd(0, 0, &f) < 0)
+    return -1;
+  r = filerecvmmsg(f, p, n);
+  fput(f);
+  return r;
+}
+
+uint64
+sys_sendmmsg(void)
+{
+  struct file *f;
+  int n, r;
   uint64 p;
 
   argaddr(1, &p);
   argint(2, &n);
   if(argfd(0, 0, &f) < 0)
     return -1;
+  r = filesendmmsg(f, p, n);
+  fput(f);
+  return r;
+}
+
+uint64
+sys_recvzc(void)
+{
+  struct file *f;
+  int r;
+  uint64 va, data;
+
+  argaddr(1, &va);
+  argaddr(2, &data);
+  if(argfd(0, 0, &f) < 0)
+    return -1;
+  r = filerecvzc(f, va, data);
+  fput(f);
+  return r;
+}
+
+uint64
+sys_recvzcdone(void)
+{
+  struct file *f;
+  int r;
+  uint64 va;
+
+  argaddr(1, &va);
+  if(argfd(0, 0, &f) < 0)
+    return -1;
+  r = filerecvzcdone(f, va);
+  fput(f);
+  return r;
+}
+
+// sockstat(fd, st) copies out socket fd's receive counters, or
+// those of all sockets if fd is -1.
+uint64
+sys_sockstat(void)
+{
+  struct file *f;
+  int fd, r = -1;
+  uint64 st;
+
+  argint(0, &fd);
+  argaddr(1, &st);
+  if(fd == -1)
+    return sockstat(0, st);
+  if(argfd(0, 0, &f) < 0)
+    return -1;
+  if(f->type == FD_SOCK)
+    r = sockstat(f->sock, st);
+  fput(f);
+  return r;
+}
+
+uint64
+sys_fcntl(void)
+{
+  struct file *f;
+  int cmd, arg, r;
+
+  argint(1, &cmd);
+  argint(2, &arg);
+  if(argfd(0, 0, &f) < 0)
+    return -1;
+  r = filefcntl(f, cmd, arg);
+  fput(f);
+  return r;
+}
+
+uint64
+sys_poll(void)
+{
+  struct pollfd fds[NPOLL];
+  uint64 ufds;
+  int n, timeout, r;
+
+  argaddr(0, &ufds);
+  argint(1, &n);
+  argint(2, &timeout);
+  if(n < 0 || n > NPOLL)
+    return -1;
+  if(copyin(myproc()->pagetable, (char*)fds, ufds, n*sizeof(fds[0])) < 0)
+    return -1;
+  if((r = poll(fds, n, timeout)) < 0)
+    return -1;
+  if(copyout(myproc()->pagetable, ufds, (char*)fds, n*sizeof(fds[0])) < 0)
+    return -1;
+  return r;
+}
+
+#define RINGOFF(field) ((uint64)&((struct ring *)0)->field)
+
+// Run one ring_enter() submission.
+static int
+ringop(struct sqe *e)
+{
+  struct file *f;
+  int r = -1;
+
+  if(e->op == RING_NOP)
+    return 0;
+  if((f = fget(myproc()->fdt, e->fd)) == 0)
+    return -1;
 
-  return filewrite(f, p, n);
+  switch(e->op){
+  case RING_READ:
+    r = fileread(f, e->addr, e->n);
+    break;
+  case RING_WRITE:
+    r = filewrite(f, e->addr, e->n);
+    break;
+  case RING_PREAD:
+    r = filepread(f, e->addr, e->n, e->off);
+    break;
+  case RING_PWRITE:
+    r = filepwrite(f, e->addr, e->n, e->off);
+    break;
+  case RING_FSYNC:
+    // a write's transaction may still be open, waiting for other
+    // operations to end.
+    log_sync();
+    r = 0;
+    break;
+  }
+  fput(f);
+  return r;
+}
+
+// Run the submissions queued in the struct ring at user address
+// addr, posting a completion for each. Returns how many ran, or -1
+// if the ring can't be read.
+uint64
+sys_ring_enter(void)
+{
+  struct proc *p = myproc();
+  uint64 addr;
+  uint sqhead, sqtail, cqhead, cqtail;
+  struct sqe e;
+  struct cqe c;
+  int n = 0;
+
+  argaddr(0, &addr);
+  if(copyin(p->pagetable, (char*)&sqhead, addr + RINGOFF(sqhead), sizeof(uint)) < 0 ||
+     copyin(p->pagetable, (char*)&sqtail, addr + RINGOFF(sqtail), sizeof(uint)) < 0 ||
+     copyin(p->pagetable, (char*)&cqhead, addr + RINGOFF(cqhead), sizeof(uint)) < 0 ||
+     copyin(p->pagetable, (char*)&cqtail, addr + RINGOFF(cqtail), sizeof(uint)) < 0)
+    return -1;
+
+  while(sqhead != sqtail && cqtail - cqhead < RINGSIZE && !killed(p)){
+    if(copyin(p->pagetable, (char*)&e, addr + RINGOFF(sq[sqhead % RINGSIZE]), sizeof(e)) < 0)
+      return -1;
+    c.data = e.data;
+    c.res = ringop(&e);
+    c.pad = 0;
+    if(copyout(p->pagetable, addr + RINGOFF(cq[cqtail % RINGSIZE]), (char*)&c, sizeof(c)) < 0)
+      return -1;
+    sqhead++;
+    cqtail++;
+    n++;
+
+    // publish progress as it goes, so that a ring that becomes
+    // unreadable part way through doesn't run entries twice.
+    if(copyout(p->pagetable, addr + RINGOFF(sqhead), (char*)&sqhead, sizeof(uint)) < 0 ||
+       copyout(p->pagetable, addr + RINGOFF(cqtail), (char*)&cqtail, sizeof(uint)) < 0)
+      return -1;
+  }
+  return n;
 }
 
 uint64
 sys_close(void)
 {
-  int fd;
+  int fd, r;
   struct file *f;
 
   if(argfd(0, &fd, &f) < 0)
     return -1;
-  myproc()->ofile[fd] = 0;
-  fileclose(f);
-  return 0;
+  // drop the table's reference, if no other thread has closed fd
+  // first, and then argfd()'s.
+  if((r = fdfree(fd, f)) == 0)
+    fileclose(f);
+  fput(f);
+  return r;
 }
 
 uint64
 sys_fstat(void)
 {
   struct file *f;
+  int r;
   uint64 st; // user pointer to struct stat
 
   argaddr(1, &st);
   if(argfd(0, 0, &f) < 0)
     return -1;
-  return filestat(f, st);
+  r = filestat(f, st);
+  fput(f);
+  return r;
+}
+
+uint64
+sys_getdents(void)
+{
+  struct file *f;
+  uint64 d; // user pointer to struct dent array
+  int n, flags, r;
+
+  argaddr(1, &d);
+  argint(2, &n);
+  argint(3, &flags);
+  if(argfd(0, 0, &f) < 0)
+    return -1;
+  r = filegetdents(f, d, n, flags);
+  fput(f);
+  return r;
 }
 
 // Create the path new as a link to the same inode as old.
@@ -214,7 +554,7 @@ sys_unlink(void)
 
   if(ip->nlink < 1)
     panic("unlink: nlink < 1");
-  if(ip->type == T_DIR && !isdirempty(ip)){
+  if(ip->type == T_DIR && (!isdirempty(ip) || ismountpoint(ip))){
     iunlockput(ip);
     goto bad;
   }
@@ -222,6 +562,7 @@ sys_unlink(void)
   memset(&de, 0, sizeof(de));
   if(writei(dp, 0, (uint64)&de, off, sizeof(de)) != sizeof(de))
     panic("unlink: writei");
+  dcache_remove(dp, name);
   if(ip->type == T_DIR){
     dp->nlink--;
     iupdate(dp);
@@ -312,11 +653,14 @@ follow_symlink(struct inode *current)
     }
 
     char target[MAXPATH];
+    int  n = readi(current, 0, (uint64)target, 0, sizeof(target) - 1);
 
-    if (readi(current, 0, (uint64)target, 0, sizeof(target)) < 0) {
+    if (n < 0) {
       goto fail;
     }
 
+    target[n] = '\0';
+
     struct inode *next = namei(target);
 
     if (next == 0) {
@@ -370,6 +714,12 @@ sys_open(void)
       end_op();
       return -1;
     }
+    // a link's target is only set by symlink().
+    if(ip->type == T_SYMLINK && (omode & O_NOFOLLOW) && (omode & (O_WRONLY | O_RDWR))){
+      iunlockput(ip);
+      end_op();
+      return -1;
+    }
   }
 
   if(ip->type == T_DEVICE && (ip->major < 0 || ip->major >= NDEV)){
@@ -403,6 +753,7 @@ sys_open(void)
     f->off = 0;
   }
   f->ip = ip;
+  f->nonblock = (omode & O_NONBLOCK) != 0;
   f->readable = !(omode & O_WRONLY);
   f->writable = (omode & O_WRONLY) || (omode & O_RDWR);
 
@@ -477,20 +828,26 @@ sys_chdir(void)
   return 0;
 }
 
-uint64
-sys_exec(void)
+// Free the strings that fetchargv() copied in.
+static void
+freeargv(char **argv)
+{
+  for(int i = 0; i < MAXARG && argv[i] != 0; i++)
+    kfree(argv[i]);
+}
+
+// Copy the user's null-terminated argument array at uargv into
+// argv, one page per string. Returns 0, or -1 with nothing left to
+// free.
+static int
+fetchargv(uint64 uargv, char **argv)
 {
-  char path[MAXPATH], *argv[MAXARG];
   int i;
-  uint64 uargv, uarg;
+  uint64 uarg;
 
-  argaddr(1, &uargv);
-  if(argstr(0, path, MAXPATH) < 0) {
-    return -1;
-  }
-  memset(argv, 0, sizeof(argv));
+  memset(argv, 0, MAXARG*sizeof(char*));
   for(i=0;; i++){
-    if(i >= NELEM(argv)){
+    if(i >= MAXARG){
       goto bad;
     }
     if(fetchaddr(uargv+sizeof(uint64)*i, (uint64*)&uarg) < 0){
@@ -506,18 +863,60 @@ sys_exec(void)
     if(fetchstr(uarg, argv[i], PGSIZE) < 0)
       goto bad;
   }
+  return 0;
+
+ bad:
+  freeargv(argv);
+  return -1;
+}
+
+uint64
+sys_exec(void)
+{
+  char path[MAXPATH], *argv[MAXARG];
+  uint64 uargv;
+
+  argaddr(1, &uargv);
+  if(argstr(0, path, MAXPATH) < 0) {
+    return -1;
+  }
+  if(fetchargv(uargv, argv) < 0)
+    return -1;
 
   int ret = exec(path, argv);
 
-  for(i = 0; i < NELEM(argv) && argv[i] != 0; i++)
-    kfree(argv[i]);
+  freeargv(argv);
 
   return ret;
+}
 
- bad:
-  for(i = 0; i < NELEM(argv) && argv[i] != 0; i++)
-    kfree(argv[i]);
-  return -1;
+// spawn(path, argv, acts, nacts): start path in a new child, with
+// the caller's open files changed by the actions in acts.
+uint64
+sys_spawn(void)
+{
+  char path[MAXPATH], *argv[MAXARG];
+  struct spawnfd acts[NSPAWNACT];
+  uint64 uargv, uacts;
+  int n;
+
+  argaddr(1, &uargv);
+  argaddr(2, &uacts);
+  argint(3, &n);
+  if(argstr(0, path, MAXPATH) < 0)
+    return -1;
+  if(n < 0 || n > NSPAWNACT)
+    return -1;
+  if(n > 0 && copyin(myproc()->pagetable, (char*)acts, uacts, n*sizeof(acts[0])) < 0)
+    return -1;
+  if(fetchargv(uargv, argv) < 0)
+    return -1;
+
+  int ret = spawn(path, argv, acts, n);
+
+  freeargv(argv);
+
+  return ret;
 }
 
 uint64
@@ -534,15 +933,15 @@ sys_pipe(void)
   fd0 = -1;
   if((fd0 = fdalloc(rf)) < 0 || (fd1 = fdalloc(wf)) < 0){
     if(fd0 >= 0)
-      p->ofile[fd0] = 0;
+      fdfree(fd0, rf);
     fileclose(rf);
     fileclose(wf);
     return -1;
   }
   if(copyout(p->pagetable, fdarray, (char*)&fd0, sizeof(fd0)) < 0 ||
      copyout(p->pagetable, fdarray+sizeof(fd0), (char *)&fd1, sizeof(fd1)) < 0){
-    p->ofile[fd0] = 0;
-    p->ofile[fd1] = 0;
+    fdfree(fd0, rf);
+    fdfree(fd1, wf);
     fileclose(rf);
     fileclose(wf);
     return -1;
@@ -597,7 +996,7 @@ sys_symlink(void)
     goto cleanup;
   }
 
-  if (writei(link, 0, (uint64)target, 0, sizeof(target)) < sizeof(target)) {
+  if (writelinki(link, target, strlen(target)) < 0) {
     rv = -1;
     goto cleanup_inode;
   }
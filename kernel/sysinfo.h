@@ -1,4 +1,10 @@
+// loadavg is in units of 1/(1<<SI_LOAD_SHIFT).
+#define SI_LOAD_SHIFT 11
+
 struct sysinfo {
   uint64 freemem;   // amount of free memory (bytes)
   uint64 nproc;     // number of process
+  uint64 ncpu;      // number of CPUs that have started
+  uint64 nrun;      // processes running or waiting to run
+  uint64 loadavg[3]; // nrun averaged over 1, 5 and 15 minutes
 };
@@ -13,35 +13,99 @@
 #include "sleeplock.h"
 #include "file.h"
 #include "net.h"
+#include "slab.h"
+#include "poll.h"
+#include "mmsg.h"
+#include "fcntl.h"
+#include "sockstat.h"
+#include "netstat.h"
 
 struct sock {
-  struct sock *next; // the next socket in the list
+  struct sock *next; // the next socket in the same hash bucket
   uint32 raddr;      // the remote IPv4 address
   uint16 lport;      // the local UDP port number
   uint16 rport;      // the remote UDP port number
-  struct spinlock lock; // protects the rxq
+  struct spinlock lock; // protects the rxq, loans and counters
   struct mbufq rxq;  // a queue of packets waiting to be received
+  uint rxqsize;      // memory the rxq holds, SOCK_TRUESIZE a packet
+  uint rcvbuf;       // most memory the rxq may hold, see F_SETRCVBUF
+  struct sockstat st;
+  struct mbuf *loans; // packets whose pages are lent out, see sockrecvzc()
+  int nloan;         // the number of them
 };
 
-static struct spinlock lock;
-static struct sock *sockets;
+// A datagram that arrives when its socket's rxq holds rcvbuf bytes
+// already is dropped, so that a slow reader can't tie up all of
+// memory in mbufs. Each queued packet counts as the page its mbuf
+// takes, whatever its length.
+#define SOCK_TRUESIZE  PGSIZE
+#define SOCK_RCVBUF    (32 * SOCK_TRUESIZE)   // default
+#define SOCK_MAXRCVBUF (256 * SOCK_TRUESIZE)  // most F_SETRCVBUF allows
+
+// The counters of all sockets, kept with atomic adds.
+static struct sockstat sockstats;
+
+// The most packets one socket may have lent to user space at once,
+// which keeps a receiver that never gives them back from draining
+// the mbuf pool.
+#define NSOCKLOAN 16
+
+// The most data socksendi() puts in a datagram: what fits in one
+// 1500-byte Ethernet frame after the IP and UDP headers.
+#define SOCK_MAXDATA (1500 - sizeof(struct ip) - sizeof(struct udp))
+
+// Sockets are found by hashing (raddr, lport, rport) to one of
+// NSOCKHASH buckets, each with its own lock, so that packets for
+// different sockets are delivered in parallel.
+#define NSOCKHASH 61
+
+static struct sockbucket {
+  struct spinlock lock; // protects head and the next links
+  struct sock *head;
+} socktbl[NSOCKHASH];
+
+static struct kmem_cache sock_cache;
 
 void
 sockinit(void)
 {
-  initlock(&lock, "socktbl");
+  for (int i = 0; i < NSOCKHASH; i++)
+    initlock(&socktbl[i].lock, "socktbl");
+  kmem_cache_init(&sock_cache, "sock_cache", sizeof(struct sock));
+}
+
+static struct sockbucket *
+sockbucket(uint32 raddr, uint16 lport, uint16 rport)
+{
+  uint32 h = raddr * 2654435761U ^ ((uint32)lport << 16 | rport);
+
+  return &socktbl[h % NSOCKHASH];
+}
+
+// Find the socket for (raddr, lport, rport) in bucket b, whose lock
+// must be held.
+static struct sock *
+socklookup(struct sockbucket *b, uint32 raddr, uint16 lport, uint16 rport)
+{
+  struct sock *si;
+
+  for (si = b->head; si; si = si->next)
+    if (si->raddr == raddr && si->lport == lport && si->rport == rport)
+      return si;
+  return 0;
 }
 
 int
 sockalloc(struct file **f, uint32 raddr, uint16 lport, uint16 rport)
 {
-  struct sock *si, *pos;
+  struct sock *si;
+  struct sockbucket *b = sockbucket(raddr, lport, rport);
 
   si = 0;
   *f = 0;
   if ((*f = filealloc()) == 0)
     goto bad;
-  if ((si = (struct sock*)kalloc()) == 0)
+  if ((si = kmem_cache_alloc(&sock_cache)) == 0)
     goto bad;
 
   // initialize objects
@@ -50,45 +114,61 @@ sockalloc(struct file **f, uint32 raddr, uint16 lport, uint16 rport)
   si->rport = rport;
   initlock(&si->lock, "sock");
   mbufq_init(&si->rxq);
+  si->rxqsize = 0;
+  si->rcvbuf = SOCK_RCVBUF;
+  memset(&si->st, 0, sizeof(si->st));
+  si->loans = 0;
+  si->nloan = 0;
   (*f)->type = FD_SOCK;
   (*f)->readable = 1;
   (*f)->writable = 1;
   (*f)->sock = si;
 
-  // add to list of sockets
-  acquire(&lock);
-  pos = sockets;
-  while (pos) {
-    if (pos->raddr == raddr &&
-        pos->lport == lport &&
-	pos->rport == rport) {
-      release(&lock);
-      goto bad;
-    }
-    pos = pos->next;
+  // add to its bucket, unless the address is taken
+  acquire(&b->lock);
+  if (socklookup(b, raddr, lport, rport)) {
+    release(&b->lock);
+    goto bad;
   }
-  si->next = sockets;
-  sockets = si;
-  release(&lock);
+  si->next = b->head;
+  b->head = si;
+  release(&b->lock);
   return 0;
 
 bad:
-  if (si)
-    kfree((char*)si);
+  if (si) {
+    freelock(&si->lock);
+    kmem_cache_free(&sock_cache, si);
+  }
   if (*f)
     fileclose(*f);
   return -1;
 }
 
+// Take the oldest packet off si's rxq, which must not be empty.
+// Must be called with si->lock held.
+static struct mbuf *
+sockdequeue(struct sock *si)
+{
+  struct mbuf *m = mbufq_pophead(&si->rxq);
+
+  si->rxqsize -= SOCK_TRUESIZE;
+  si->st.queued -= m->len;
+  __atomic_fetch_sub(&sockstats.queued, m->len, __ATOMIC_RELAXED);
+  return m;
+}
+
 void
 sockclose(struct sock *si)
 {
   struct sock **pos;
   struct mbuf *m;
+  struct sockbucket *b = sockbucket(si->raddr, si->lport, si->rport);
 
-  // remove from list of sockets
-  acquire(&lock);
-  pos = &sockets;
+  // remove from its bucket; sockrecvudp() delivers to a socket
+  // only with the bucket locked, so none is using si after this.
+  acquire(&b->lock);
+  pos = &b->head;
   while (*pos) {
     if (*pos == si){
       *pos = si->next;
@@ -96,34 +176,44 @@ sockclose(struct sock *si)
     }
     pos = &(*pos)->next;
   }
-  release(&lock);
+  release(&b->lock);
 
   // free any pending mbufs
   while (!mbufq_empty(&si->rxq)) {
-    m = mbufq_pophead(&si->rxq);
+    m = sockdequeue(si);
     mbuffree(m);
   }
+  // and take back lent pages, which stay mapped in user space
+  while ((m = si->loans) != 0) {
+    si->loans = m->next;
+    mbufreturn(m);
+  }
 
-  kfree((char*)si);
+  freelock(&si->lock);
+  kmem_cache_free(&sock_cache, si);
 }
 
+// Receive one datagram, or as much of it as fits in n bytes. If
+// nonblock is set, returns -1 rather than sleep while none has
+// arrived.
 int
-sockread(struct sock *si, uint64 addr, int n)
+sockread(struct sock *si, uint64 addr, int n, int nonblock)
 {
   struct proc *pr = myproc();
   struct mbuf *m;
   int len;
 
   acquire(&si->lock);
-  while (mbufq_empty(&si->rxq) && !pr->killed) {
+  while (mbufq_empty(&si->rxq) && !pr->killed && !nonblock) {
     sleep(&si->rxq, &si->lock);
   }
-  if (pr->killed) {
+  if (pr->killed || mbufq_empty(&si->rxq)) {
     release(&si->lock);
     return -1;
   }
-  m = mbufq_pophead(&si->rxq);
+  m = sockdequeue(si);
   release(&si->lock);
+  nettrace_read(m);
 
   len = m->len;
   if (len > n)
@@ -136,24 +226,256 @@ sockread(struct sock *si, uint64 addr, int n)
   return len;
 }
 
+// Receive one datagram without copying it: map the page holding it
+// read-only at va, which must be a page of the process's heap, in
+// place of the page there, and store the datagram's address in the
+// user pointer at dataaddr. The page stays mapped until
+// sockrecvzcdone() gives it back. Returns the datagram's length, or
+// -1, without waiting if nonblock is set or NSOCKLOAN pages are
+// already lent.
 int
-sockwrite(struct sock *si, uint64 addr, int n)
+sockrecvzc(struct sock *si, uint64 va, uint64 dataaddr, int nonblock)
 {
   struct proc *pr = myproc();
   struct mbuf *m;
+  uint64 data;
+  char *end;
+  int len;
+
+  acquire(&si->lock);
+  while (mbufq_empty(&si->rxq) && !pr->killed && !nonblock &&
+         si->nloan < NSOCKLOAN) {
+    sleep(&si->rxq, &si->lock);
+  }
+  if (pr->killed || mbufq_empty(&si->rxq) || si->nloan >= NSOCKLOAN) {
+    release(&si->lock);
+    return -1;
+  }
+  m = sockdequeue(si);
+  si->nloan++;
+  release(&si->lock);
+  nettrace_read(m);
+
+  len = m->len;
+  // the rest of the page may hold an earlier packet, someone
+  // else's; past MBUF_SIZE it's still zero.
+  end = m->head + m->len;
+  memset(end, 0, m->buf + MBUF_SIZE - end);
+
+  data = va + (m->head - m->buf);
+  if (uvmlend(pr, va, (uint64)m->buf) < 0) {
+    mbuffree(m);
+    goto bad;
+  }
+  if (copyout(pr->pagetable, dataaddr, (char *)&data, sizeof(data)) == -1) {
+    uvmunlend(pr, va, (uint64)m->buf);
+    mbufreturn(m);
+    goto bad;
+  }
+
+  m->va = va;
+  acquire(&si->lock);
+  m->next = si->loans;
+  si->loans = m;
+  release(&si->lock);
+  return len;
+
+bad:
+  acquire(&si->lock);
+  si->nloan--;
+  release(&si->lock);
+  return -1;
+}
+
+// Give back the page that sockrecvzc() lent at va, unmapping it.
+// Returns 0, or -1 if no page of si's is lent there.
+int
+sockrecvzcdone(struct sock *si, uint64 va)
+{
+  struct mbuf **pm, *m;
+
+  acquire(&si->lock);
+  for (pm = &si->loans; (m = *pm) != 0; pm = &m->next) {
+    if (m->va == va) {
+      *pm = m->next;
+      si->nloan--;
+      break;
+    }
+  }
+  release(&si->lock);
+  if (m == 0)
+    return -1;
+
+  // if this fails the process keeps the page, and mbufreturn()
+  // leaves it to it.
+  uvmunlend(myproc(), va, (uint64)m->buf);
+  mbufreturn(m);
+  return 0;
+}
+
+// Receive up to n datagrams into the buffers described by the
+// array of struct mmsghdr at addr, setting each one's len. Sleeps,
+// unless nonblock is set, only until the first datagram arrives,
+// then takes as many as are queued with one trip through si->lock.
+// Returns the number received, or -1 if none was.
+int
+sockrecvmmsg(struct sock *si, uint64 addr, int n, int nonblock)
+{
+  struct proc *pr = myproc();
+  struct mmsghdr hdrs[NMMSG];
+  struct mbufq q;
+  struct mbuf *m;
+  int i, len;
+
+  if (n <= 0)
+    return -1;
+  if (n > NMMSG)
+    n = NMMSG;
+  if (copyin(pr->pagetable, (char *)hdrs, addr, n * sizeof(hdrs[0])) == -1)
+    return -1;
+
+  mbufq_init(&q);
+  acquire(&si->lock);
+  while (mbufq_empty(&si->rxq) && !pr->killed && !nonblock) {
+    sleep(&si->rxq, &si->lock);
+  }
+  if (pr->killed || mbufq_empty(&si->rxq)) {
+    release(&si->lock);
+    return -1;
+  }
+  for (i = 0; i < n && !mbufq_empty(&si->rxq); i++)
+    mbufq_pushtail(&q, sockdequeue(si));
+  release(&si->lock);
+
+  n = i;
+  for (i = 0; (m = mbufq_pophead(&q)) != 0; i++) {
+    nettrace_read(m);
+    len = m->len;
+    if (len > hdrs[i].size)
+      len = hdrs[i].size;
+    if (len < 0 ||
+        copyout(pr->pagetable, (uint64)hdrs[i].buf, m->head, len) == -1) {
+      // the datagrams not yet copied are lost, as a failed read()
+      // loses its one.
+      mbuffree(m);
+      while ((m = mbufq_pophead(&q)) != 0)
+        mbuffree(m);
+      break;
+    }
+    hdrs[i].len = len;
+    mbuffree(m);
+  }
+  if (i == 0)
+    return -1;
+  if (copyout(pr->pagetable, addr, (char *)hdrs, n * sizeof(hdrs[0])) == -1)
+    return -1;
+  return i;
+}
+
+// What si is ready for; see filepoll(). Sending waits only for
+// room in the e1000's transmit ring.
+int
+sockpoll(struct sock *si)
+{
+  int r = e1000_txready() ? POLLOUT : 0;
+
+  acquire(&si->lock);
+  if (!mbufq_empty(&si->rxq))
+    r |= POLLIN;
+  release(&si->lock);
+  return r;
+}
+
+// Send n bytes from addr, a user virtual address if user_src is
+// set, or else a kernel one, as one datagram. Waits for room to
+// send it unless nonblock is set, when it fails instead.
+int
+sockwrite(struct sock *si, int user_src, uint64 addr, int n, int nonblock)
+{
+  struct mbuf *m;
 
   m = mbufalloc(MBUF_DEFAULT_HEADROOM);
   if (!m)
     return -1;
 
-  if (copyin(pr->pagetable, mbufput(m, n), addr, n) == -1) {
+  if (either_copyin(mbufput(m, n), user_src, addr, n) == -1) {
     mbuffree(m);
     return -1;
   }
-  net_tx_udp(m, si->raddr, si->lport, si->rport);
+  if (net_tx_udp(m, si->raddr, si->lport, si->rport, !nonblock) < 0)
+    return -1;
   return n;
 }
 
+// Send up to n datagrams described by the array of struct mmsghdr
+// at addr, setting each one's len. Stops at the first that can't
+// be sent, which with nonblock set includes one that would have
+// to wait for the transmit ring. Returns the number sent, or -1 if
+// none was.
+int
+socksendmmsg(struct sock *si, uint64 addr, int n, int nonblock)
+{
+  struct proc *pr = myproc();
+  struct mmsghdr hdrs[NMMSG];
+  struct mbuf *m;
+  int i;
+
+  if (n <= 0)
+    return -1;
+  if (n > NMMSG)
+    n = NMMSG;
+  if (copyin(pr->pagetable, (char *)hdrs, addr, n * sizeof(hdrs[0])) == -1)
+    return -1;
+
+  for (i = 0; i < n; i++) {
+    if (hdrs[i].size < 0 || hdrs[i].size > SOCK_MAXDATA)
+      break;
+    if ((m = mbufalloc(MBUF_DEFAULT_HEADROOM)) == 0)
+      break;
+    if (copyin(pr->pagetable, mbufput(m, hdrs[i].size),
+               (uint64)hdrs[i].buf, hdrs[i].size) == -1) {
+      mbuffree(m);
+      break;
+    }
+    if (net_tx_udp(m, si->raddr, si->lport, si->rport, !nonblock) < 0)
+      break;
+    hdrs[i].len = hdrs[i].size;
+  }
+  if (i == 0)
+    return -1;
+  if (copyout(pr->pagetable, addr, (char *)hdrs, n * sizeof(hdrs[0])) == -1)
+    return -1;
+  return i;
+}
+
+// Send up to n bytes of ip from offset off as one datagram,
+// read from the file straight into the mbuf. Returns the number
+// of bytes sent, 0 at the end of the file, or -1.
+int
+socksendi(struct sock *si, struct inode *ip, uint off, int n)
+{
+  struct mbuf *m;
+  int r;
+
+  if (n > SOCK_MAXDATA)
+    n = SOCK_MAXDATA;
+  m = mbufalloc(MBUF_DEFAULT_HEADROOM);
+  if (!m)
+    return -1;
+
+  ilock(ip);
+  r = readi(ip, 0, (uint64)mbufput(m, n), off, n);
+  iunlock(ip);
+  if (r <= 0) {
+    mbuffree(m);
+    return r;
+  }
+  mbuftrim(m, n - r);
+  if (net_tx_udp(m, si->raddr, si->lport, si->rport, 1) < 0)
+    return -1;
+  return r;
+}
+
 // called by protocol handler layer to deliver UDP packets
 void
 sockrecvudp(struct mbuf *m, uint32 raddr, uint16 lport, uint16 rport)
@@ -164,22 +486,80 @@ sockrecvudp(struct mbuf *m, uint32 raddr, uint16 lport, uint16 rport)
   // registered to handle it.
   //
   struct sock *si;
+  struct sockbucket *b = sockbucket(raddr, lport, rport);
 
-  acquire(&lock);
-  si = sockets;
-  while (si) {
-    if (si->raddr == raddr && si->lport == lport && si->rport == rport)
-      goto found;
-    si = si->next;
+  acquire(&b->lock);
+  if ((si = socklookup(b, raddr, lport, rport)) == 0) {
+    release(&b->lock);
+    NETSTAT_ADD(rx_noport, 1);
+    mbuffree(m);
+    return;
   }
-  release(&lock);
-  mbuffree(m);
-  return;
 
-found:
   acquire(&si->lock);
+  if (si->rxqsize + SOCK_TRUESIZE > si->rcvbuf) {
+    si->st.drops++;
+    si->st.dropbytes += m->len;
+    release(&si->lock);
+    release(&b->lock);
+    __atomic_fetch_add(&sockstats.drops, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&sockstats.dropbytes, m->len, __ATOMIC_RELAXED);
+    NETSTAT_ADD(rx_sockfull, 1);
+    mbuffree(m);
+    return;
+  }
+  si->rxqsize += SOCK_TRUESIZE;
+  si->st.rxpackets++;
+  si->st.rxbytes += m->len;
+  si->st.queued += m->len;
+  __atomic_fetch_add(&sockstats.rxpackets, 1, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&sockstats.rxbytes, m->len, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&sockstats.queued, m->len, __ATOMIC_RELAXED);
+  NETTRACE_STAMP(m, 1);
   mbufq_pushtail(&si->rxq, m);
   wakeup(&si->rxq);
+  pollwakeup();
   release(&si->lock);
-  release(&lock);
+  release(&b->lock);
+}
+
+// fcntl() for a socket: F_GETRCVBUF returns its receive buffer
+// limit in bytes, and F_SETRCVBUF sets it to arg bytes, rounded up
+// to a whole number of packets, up to SOCK_MAXRCVBUF, returning
+// the new limit. Packets already queued stay even if over it.
+int
+sockfcntl(struct sock *si, int cmd, int arg)
+{
+  int r = -1;
+
+  acquire(&si->lock);
+  if (cmd == F_GETRCVBUF) {
+    r = si->rcvbuf;
+  } else if (cmd == F_SETRCVBUF && arg > 0 && arg <= SOCK_MAXRCVBUF) {
+    si->rcvbuf = (arg + SOCK_TRUESIZE - 1) / SOCK_TRUESIZE * SOCK_TRUESIZE;
+    r = si->rcvbuf;
+  }
+  release(&si->lock);
+  return r;
+}
+
+// Copy si's counters, or every socket's if si is 0, to the user's
+// struct sockstat at addr.
+int
+sockstat(struct sock *si, uint64 addr)
+{
+  struct sockstat st;
+
+  if (si) {
+    acquire(&si->lock);
+    st = si->st;
+    release(&si->lock);
+  } else {
+    st.rxpackets = __atomic_load_n(&sockstats.rxpackets, __ATOMIC_RELAXED);
+    st.rxbytes = __atomic_load_n(&sockstats.rxbytes, __ATOMIC_RELAXED);
+    st.drops = __atomic_load_n(&sockstats.drops, __ATOMIC_RELAXED);
+    st.dropbytes = __atomic_load_n(&sockstats.dropbytes, __ATOMIC_RELAXED);
+    st.queued = __atomic_load_n(&sockstats.queued, __ATOMIC_RELAXED);
+  }
+  return copyout(myproc()->pagetable, addr, (char *)&st, sizeof(st));
 }
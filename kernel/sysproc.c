@@ -6,6 +6,7 @@
 #include "spinlock.h"
 #include "proc.h"
 #include "sysinfo.h"
+#include "fcntl.h"
 #include <limits.h>
 
 uint64
@@ -34,7 +35,26 @@ sys_wait(void)
 {
   uint64 p;
   argaddr(0, &p);
-  return wait(p);
+  return wait(p, 0);
+}
+
+uint64
+sys_waitrusage(void)
+{
+  uint64 p, ru;
+  argaddr(0, &p);
+  argaddr(1, &ru);
+  return wait(p, ru);
+}
+
+uint64
+sys_getrusage(void)
+{
+  int who;
+  uint64 ru;
+  argint(0, &who);
+  argaddr(1, &ru);
+  return getrusage(who, ru);
 }
 
 uint64
@@ -44,8 +64,9 @@ sys_sbrk(void)
   int n;
 
   argint(0, &n);
-  addr = myproc()->sz;
-  if(growproc(n) < 0)
+  // growproc() reads the old size under the lock, in case
+  // another thread is growing the heap at the same time.
+  if((addr = growproc(n)) == -1)
     return -1;
   return addr;
 }
@@ -59,8 +80,8 @@ sys_sleep(void)
 
   argint(0, &n);
   acquire(&tickslock);
-  ticks0 = ticks;
-  while(ticks - ticks0 < n){
+  ticks0 = __atomic_load_n(&ticks, __ATOMIC_ACQUIRE);
+  while(__atomic_load_n(&ticks, __ATOMIC_ACQUIRE) - ticks0 < n){
     if(killed(myproc())){
       release(&tickslock);
       return -1;
@@ -95,31 +116,68 @@ sys_pgaccess(void)
   // the current process
   struct proc *proc = myproc();
 
-  // the pte_t entry for the given virtual address
-  pte_t *pte_ptr = walk(proc->pagetable, va, 0);
+  uint64 accessed = 0, dirty = 0;
+
+  // report the accessed flags and clear them, so that we can detect if a
+  // page has been accessed since the last pgaccess() call
+  if (num_pages < 0 || uvmwsscan(proc, PGROUNDDOWN(va), num_pages, &accessed, &dirty, WS_CLEAR_ACCESSED) < 0) {
+    return -1;
+  }
+
+  int bitmask = accessed;
+
+  return copyout(proc->pagetable, bitmask_addr, (char *)&bitmask,
+                 sizeof(bitmask));
+}
+
+// sys_wsscan() scans its range this many pages at a time, so that a chunk's
+// bitmaps fit on the kernel stack.
+#define WS_CHUNK 2048
+
+// Report which pages of a range have been accessed and written, as bitmaps of
+// uint64 words, in which bit i % 64 of word i / 64 stands for page i. Either
+// bitmap address may be 0. flags may ask for the bits to be cleared as they are
+// read, with WS_CLEAR_ACCESSED and WS_CLEAR_DIRTY.
+uint64
+sys_wsscan(void)
+{
+  uint64 va, abits_addr, dbits_addr;
+  int    npages, flags;
+
+  argaddr(0, &va);
+  argint(1, &npages);
+  argaddr(2, &abits_addr);
+  argaddr(3, &dbits_addr);
+  argint(4, &flags);
 
-  // we can't check past the end of the page table
-  if ((pte_ptr - proc->pagetable) + num_pages > 512) {
-    return -3;
+  if ((va % PGSIZE) != 0 || npages < 0 || (flags & ~(WS_CLEAR_ACCESSED | WS_CLEAR_DIRTY)) != 0) {
+    return -1;
   }
 
-  int bitmask = 0;
+  struct proc *p = myproc();
+  uint64 abuf[WS_CHUNK / 64], dbuf[WS_CHUNK / 64];
+
+  for (int done = 0; done < npages; done += WS_CHUNK) {
+    int    n     = npages - done < WS_CHUNK ? npages - done : WS_CHUNK;
+    uint64 bytes = (n + 63) / 64 * sizeof(uint64);
+
+    memset(abuf, 0, sizeof(abuf));
+    memset(dbuf, 0, sizeof(dbuf));
 
-  for (int i = 0; i < num_pages; i++) {
-    if (!(pte_ptr[i] & PTE_A)) {
-      continue;
+    if (uvmwsscan(p, va + (uint64)done * PGSIZE, n, abuf, dbuf, flags) < 0) {
+      return -1;
     }
 
-    // clear the accessed flag so that we can detect if a page has been
-    // accessed since the last pgaccess() call
-    pte_ptr[i] &= ~(PTE_A);
+    if (abits_addr && copyout(p->pagetable, abits_addr + done / 8, (char *)abuf, bytes) < 0) {
+      return -1;
+    }
 
-    // set the bit for this page to indicate it has been accessed
-    bitmask |= 1 << i;
+    if (dbits_addr && copyout(p->pagetable, dbits_addr + done / 8, (char *)dbuf, bytes) < 0) {
+      return -1;
+    }
   }
 
-  return copyout(proc->pagetable, bitmask_addr, (char *)&bitmask,
-                 sizeof(bitmask));
+  return 0;
 }
 
 uint64
@@ -136,12 +194,7 @@ sys_kill(void)
 uint64
 sys_uptime(void)
 {
-  uint xticks;
-
-  acquire(&tickslock);
-  xticks = ticks;
-  release(&tickslock);
-  return xticks;
+  return __atomic_load_n(&ticks, __ATOMIC_ACQUIRE);
 }
 
 uint64
@@ -163,8 +216,12 @@ sys_sysinfo(void)
   uint64 struct_sysinfo_addr;
 
   // our copy of struct sysinfo
-  struct sysinfo s = {.freemem = kgetfreemem(), .nproc = proccount()};
+  struct sysinfo s = {.freemem = kgetfreemem(),
+                      .nproc   = proccount(),
+                      .ncpu    = __atomic_load_n(&ncpu, __ATOMIC_RELAXED),
+                      .nrun    = runcount()};
 
+  getloadavg(s.loadavg);
   argaddr(0, &struct_sysinfo_addr);
 
   return copyout(myproc()->pagetable, struct_sysinfo_addr, (char *)&s,
@@ -185,6 +242,9 @@ sys_sigalarm(void)
 
   struct proc *p = myproc();
 
+  timer_cancel(&p->alarm_timer);
+  p->alarm_due = 0;
+
   p->alarm_interval = tick_interval;
   p->alarm_handler  = alarm_handler;
   p->alarm_ticks    = 0;
@@ -198,7 +258,8 @@ sys_sigreturn(void)
   struct proc *p = myproc();
 
   // clear the ticks so that the alarm can fire again
-  p->alarm_ticks = 0;
+  p->alarm_ticks     = 0;
+  p->alarm_inhandler = 0;
 
   // restore the original process's context
   memmove(p->trapframe, &p->alarm_prev_frame, sizeof(p->alarm_prev_frame));
@@ -211,6 +272,24 @@ sys_sigreturn(void)
   return p->trapframe->a0;
 }
 
+// Like sigreturn(), end the alarm handler so the alarm can fire again, but
+// don't go back to where it interrupted: return the interrupted pc instead.
+// For user-level thread packages, whose handler has saved the other
+// registers itself and switches to another thread.
+uint64
+sys_sigdone(void)
+{
+  struct proc *p = myproc();
+  uint64 epc     = p->alarm_prev_frame.epc;
+
+  p->alarm_ticks     = 0;
+  p->alarm_inhandler = 0;
+
+  memset(&p->alarm_prev_frame, 0, sizeof(p->alarm_prev_frame));
+
+  return epc;
+}
+
 uint64
 sys_backtrace(void)
 {
@@ -252,3 +331,248 @@ sys_munmap(void)
 
   return munmap(myproc(), addr, len);
 }
+
+// Write the dirty pages of shared mappings in a range back to their files.
+uint64
+sys_msync(void)
+{
+  uint64 addr  = 0;
+  size_t len   = 0;
+  int    flags = 0;
+
+  argaddr(0, &addr);
+  argint(1, (int *)&len);
+  argint(2, &flags);
+
+  return msync(myproc(), addr, len, flags);
+}
+
+// Advise the kernel how a range of memory will be used.
+uint64
+sys_madvise(void)
+{
+  uint64 addr   = 0;
+  size_t len    = 0;
+  int    advice = 0;
+
+  argaddr(0, &addr);
+  argint(1, (int *)&len);
+  argint(2, &advice);
+
+  return madvise(myproc(), addr, len, advice);
+}
+
+// Set whether untouched, 2MB-aligned parts of this process's heap are backed by megapages when they
+// are first touched. Inherited across fork() and exec().
+uint64
+sys_hugepages(void)
+{
+  int enable;
+
+  argint(0, &enable);
+
+  myproc()->hugeheap = enable != 0;
+
+  return 0;
+}
+
+// Set a process's scheduling priority, 0 being the highest.
+uint64
+sys_setpriority(void)
+{
+  int pid, prio;
+
+  argint(0, &pid);
+  argint(1, &prio);
+  return setpriority(pid, prio);
+}
+
+// Set the CPUs a process may run on, one bit per CPU.
+uint64
+sys_sched_setaffinity(void)
+{
+  int pid;
+  uint64 mask;
+
+  argint(0, &pid);
+  argaddr(1, &mask);
+  return setaffinity(pid, mask);
+}
+
+// Start a thread in fn(arg) on stack, sharing this process's
+// memory and open files.
+uint64
+sys_clone(void)
+{
+  uint64 fn, arg, stack;
+
+  argaddr(0, &fn);
+  argaddr(1, &arg);
+  argaddr(2, &stack);
+  return clone(fn, arg, stack);
+}
+
+// Sleep while the int at addr holds val.
+uint64
+sys_futex_wait(void)
+{
+  uint64 addr;
+  int val;
+
+  argaddr(0, &addr);
+  argint(1, &val);
+  return futex_wait(addr, val);
+}
+
+// Wake up to n threads sleeping on the int at addr.
+uint64
+sys_futex_wake(void)
+{
+  uint64 addr;
+  int n;
+
+  argaddr(0, &addr);
+  argint(1, &n);
+  return futex_wake(addr, n);
+}
+
+// sample the calling process's user pc every n clock ticks,
+// or stop if n is 0.
+uint64
+sys_uprof(void)
+{
+  int n;
+
+  argint(0, &n);
+  return uprof(n);
+}
+
+// move up to n samples of process pid to buf.
+uint64
+sys_uprofread(void)
+{
+  int pid, n;
+  uint64 buf;
+
+  argint(0, &pid);
+  argaddr(1, &buf);
+  argint(2, &n);
+  if(n < 0)
+    return -1;
+  return uprof_read(pid, buf, n);
+}
+
+// sample the kernel every n clock ticks on every CPU, or stop
+// if n is 0.
+uint64
+sys_kprof(void)
+{
+  int n;
+
+  argint(0, &n);
+  return kprof(n);
+}
+
+// move up to n kernel samples to buf.
+uint64
+sys_kprofread(void)
+{
+  int n;
+  uint64 buf;
+
+  argaddr(0, &buf);
+  argint(1, &n);
+  if(n < 0)
+    return -1;
+  return kprof_read(buf, n);
+}
+
+// sleep for at least the given number of microseconds, on a
+// deadline of its own rather than a count of clock ticks.
+uint64
+sys_usleep(void)
+{
+  int us;
+
+  argint(0, &us);
+  if(us < 0)
+    return -1;
+  return timer_sleep(r_time() + (uint64)us * (TIMEHZ / 1000000));
+}
+
+// ualarm()'s timer went off: have usertrap() call the handler, as
+// soon as the process is next in user space.
+static void
+ualarm_fire(struct timer *t)
+{
+  struct proc *p = t->arg;
+  int cpu;
+
+  __atomic_store_n(&p->alarm_due, 1, __ATOMIC_RELEASE);
+  cpu = __atomic_load_n(&p->cpu, __ATOMIC_RELAXED);
+  if(cpu >= 0 && cpu != cpuid())
+    cpukick(cpu);
+}
+
+// call handler every us microseconds of real time, or stop if us
+// is 0. the handler returns with sigreturn(), as for sigalarm(),
+// which ualarm() replaces.
+uint64
+sys_ualarm(void)
+{
+  struct proc *p = myproc();
+  int us;
+  uint64 handler;
+
+  argint(0, &us);
+  argaddr(1, &handler);
+  if(us < 0)
+    return -1;
+
+  timer_cancel(&p->alarm_timer);
+  p->alarm_interval = 0;
+  p->alarm_due = 0;
+  p->alarm_handler = (void (*)())handler;
+  if(us == 0)
+    return 0;
+
+  p->alarm_timer.period = (uint64)us * (TIMEHZ / 1000000);
+  p->alarm_timer.deadline = r_time() + p->alarm_timer.period;
+  p->alarm_timer.fn = ualarm_fire;
+  p->alarm_timer.arg = p;
+  timer_add(&p->alarm_timer);
+  return 0;
+}
+
+// let the calling process read the counters in mask
+// from user mode; see hpm.c.
+uint64
+sys_ucounters(void)
+{
+  int mask;
+
+  argint(0, &mask);
+  return ucounters(mask);
+}
+
+// have hpm counter n count an event, on every CPU.
+uint64
+sys_hpmevent(void)
+{
+  int n;
+  uint64 event;
+
+  argint(0, &n);
+  argaddr(1, &event);
+  return hpmevent(n, event);
+}
+
+// read counter n on this CPU.
+uint64
+sys_hpmread(void)
+{
+  int n;
+
+  argint(0, &n);
+  return hpmread(n);
+}
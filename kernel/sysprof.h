@@ -0,0 +1,12 @@
+// What sysprof() gathers about each system call number.
+
+#define NSYSPROF 64   // system call numbers counted
+#define NSYSHIST 16   // latency histogram buckets
+
+struct sysprof {
+  char name[16];          // system call name, "" if none
+  uint64 n;               // calls
+  uint64 time;            // time CSR ticks spent in them in all
+  uint64 hist[NSYSHIST];  // calls that took [2^i, 2^(i+1)) ticks,
+                          // the last one open-ended
+};
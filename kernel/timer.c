@@ -0,0 +1,188 @@
+// Per-CPU timer queues, for sleeps and alarms finer than a clock tick.
+//
+// A struct timer is queued on the CPU that calls timer_add(), in deadline order, and that CPU's
+// timer interrupt runs its function once the CLINT's mtime reaches the deadline. timerarm() asks
+// for the interrupt at the earlier of the first deadline and the next clock tick, so a timer goes
+// off at its own deadline, not at the tick after it, even on an idle CPU with its ticks stopped.
+//
+// timer_cancel() may run on any CPU, and leaves the queue's CPU armed for a deadline that may no
+// longer be there. That interrupt then finds nothing to do, and timer_run() arms it for the new
+// first deadline. timervec forgets a deadline once it is due, so a CPU that has interrupts off
+// when it arrives isn't interrupted again and again in machine mode meanwhile.
+
+#include "types.h"
+#include "param.h"
+#include "memlayout.h"
+#include "riscv.h"
+#include "spinlock.h"
+#include "proc.h"
+#include "defs.h"
+
+struct timerq {
+  struct spinlock lock;
+  struct timer   *head;  // soonest deadline first
+};
+
+static struct timerq timerq[NCPU];
+
+void
+timerqinit(void)
+{
+  for (int i = 0; i < NCPU; i++) {
+    initlock(&timerq[i].lock, "timerq");
+  }
+}
+
+// Must be called with q->lock held, on q's CPU.
+static void
+timerq_insert(struct timerq *q, struct timer *t)
+{
+  struct timer **pp = &q->head;
+
+  while (*pp && (*pp)->deadline <= t->deadline) {
+    pp = &(*pp)->next;
+  }
+
+  t->next = *pp;
+  t->q    = q;
+  *pp     = t;
+
+  if (q->head == t) {
+    timerarm(t->deadline);
+  }
+}
+
+// Must be called with q->lock held.
+static void
+timerq_remove(struct timerq *q, struct timer *t)
+{
+  struct timer **pp = &q->head;
+
+  while (*pp != t) {
+    pp = &(*pp)->next;
+  }
+
+  *pp  = t->next;
+  t->q = 0;
+}
+
+// Queue t, which must not be queued already, on this CPU.
+void
+timer_add(struct timer *t)
+{
+  push_off();
+
+  struct timerq *q = &timerq[cpuid()];
+
+  acquire(&q->lock);
+  pop_off();
+  timerq_insert(q, t);
+  release(&q->lock);
+}
+
+// Take t off its queue, if it is on one, so that its function won't run again until t is added
+// again. Its function isn't running either once this returns, so the caller may free t.
+void
+timer_cancel(struct timer *t)
+{
+  struct timerq *q;
+
+  // timer_run() leaves t->q set while t's function runs, under q->lock, and while a periodic
+  // timer goes back on the same queue, so t->q can only change to 0 meanwhile.
+  while ((q = __atomic_load_n(&t->q, __ATOMIC_ACQUIRE)) != 0) {
+    acquire(&q->lock);
+
+    if (t->q == q) {
+      timerq_remove(q, t);
+    }
+
+    release(&q->lock);
+  }
+}
+
+// Run the functions of this CPU's timers that are due, and arm the interrupt for the next one.
+// Called from devintr() with interrupts disabled.
+void
+timer_run(void)
+{
+  struct timerq *q = &timerq[cpuid()];
+
+  // a quick look that's usually enough, since most interrupts are clock ticks with no timer due,
+  // though a timer_cancel() on another CPU may have left this one armed.
+  if (__atomic_load_n(&q->head, __ATOMIC_RELAXED) == 0) {
+    timerarm(-1);
+
+    return;
+  }
+
+  uint64 now = r_time();
+
+  acquire(&q->lock);
+
+  while (q->head && q->head->deadline <= now) {
+    struct timer *t = q->head;
+    void (*fn)(struct timer *) = t->fn;
+    int periodic = t->period != 0;
+
+    // t->q stays set, so that timer_cancel() waits for q->lock, and so for fn to finish.
+    q->head = t->next;
+
+    if (periodic) {
+      t->deadline += t->period;
+
+      // don't try to catch up on periods missed while this CPU couldn't take interrupts.
+      if (t->deadline <= now) {
+        t->deadline = now + t->period;
+      }
+
+      timerq_insert(q, t);
+    }
+
+    fn(t);
+
+    if (!periodic) {
+      __atomic_store_n(&t->q, 0, __ATOMIC_RELEASE);
+    }
+  }
+
+  timerarm(q->head ? q->head->deadline : -1);
+  release(&q->lock);
+}
+
+static void
+timer_wakeup(struct timer *t)
+{
+  wakeup(t);
+}
+
+// Sleep until mtime reaches deadline. Returns 0, or -1 if killed first.
+int
+timer_sleep(uint64 deadline)
+{
+  struct proc  *p = myproc();
+  struct timer  t = {.deadline = deadline, .fn = timer_wakeup};
+
+  push_off();
+
+  struct timerq *q = &timerq[cpuid()];
+
+  acquire(&q->lock);
+  pop_off();
+  timerq_insert(q, &t);
+
+  // timer_run() clears t.q, under q->lock, once it has woken this process.
+  while (t.q) {
+    if (killed(p)) {
+      timerq_remove(q, &t);
+      release(&q->lock);
+
+      return -1;
+    }
+
+    sleep(&t, &q->lock);
+  }
+
+  release(&q->lock);
+
+  return 0;
+}
@@ -6,10 +6,16 @@
 #include "proc.h"
 #include "defs.h"
 #include "fcntl.h"
+#include "ktrace.h"
 
+// ticks is written only by clockintr() on CPU 0, so it can be read
+// at any time without a lock. tickslock is for sleeping on it.
 struct spinlock tickslock;
 uint ticks;
 
+// mapped read-only at USHARED in every process.
+struct ushared *ushared;
+
 extern char trampoline[], uservec[], userret[];
 
 // in kernelvec.S, calls kerneltrap().
@@ -17,10 +23,29 @@ void kernelvec();
 
 extern int devintr();
 
+// in start.c, shared with timervec.
+extern uint64 timer_scratch[NCPU][10];
+
+// Counts of the traps from user space each CPU has taken, by what
+// they turned out to be, one cache line per CPU. usertrap() updates
+// its own CPU's with interrupts off, so they need no locks.
+struct trapstats {
+  uint64 syscall;  // system calls
+  uint64 timer;    // timer interrupts
+  uint64 devintr;  // other interrupts: devices, and kicks from other CPUs
+  uint64 fault;    // page faults that mapped a page: heap, mmap()ed file, or swap
+  uint64 cow;      // write faults that copied a copy-on-write page
+  uint64 bad;      // faults and exceptions that killed the process
+} __attribute__((aligned(64))) tstats[NCPU];
+
+#define TSTAT_ADD(event) (tstats[cpuid()].event++)
+
 void
 trapinit(void)
 {
   initlock(&tickslock, "time");
+  if((ushared = kalloc_zeroed()) == 0)
+    panic("trapinit: ushared");
 }
 
 // set up to take exceptions and traps while in the kernel.
@@ -49,14 +74,41 @@ usertrap(void)
   // save user program counter before we do anything else
   p->trapframe->epc = r_sepc();
 
+  uint64 now = r_time();
+
+  p->ru.utime += now - p->tstamp;
+  p->tstamp    = now;
+
+  // system calls are the most common trap, so they don't wait for devintr() to find that they
+  // aren't interrupts
+  if (r_scause() == SCAUSE_ECALL_UMODE) {
+    TSTAT_ADD(syscall);
+
+    // sepc points to the ecall instruction,
+    // but we want to return to the next instruction.
+    p->trapframe->epc += 4;
+
+    // an interrupt will change sepc, scause, and sstatus,
+    // so enable only now that we're done with those registers.
+    intr_on();
+
+    syscall();
+
+    goto userspace;
+  }
+
   int device_interrupt_type;
 
   if ((device_interrupt_type = devintr())) {
     // non-timer device interrupts are handled by devintr, so we can skip to userspace
     if (device_interrupt_type != 2) {
+      TSTAT_ADD(devintr);
       goto userspace;
     }
 
+    TSTAT_ADD(timer);
+    uprof_tick(p);
+
     // if the process doesn't have an alarm interval set we should immediately yield
     if (!p->alarm_interval) {
       goto yield;
@@ -79,29 +131,22 @@ usertrap(void)
     p->trapframe->epc = (uint64)p->alarm_handler;
 
   yield:
-    yield();
+    preempt();
 
     goto userspace;
   }
 
   switch (r_scause()) {
-  case SCAUSE_ECALL_UMODE:
-    // sepc points to the ecall instruction,
-    // but we want to return to the next instruction.
-    p->trapframe->epc += 4;
-
-    // an interrupt will change sepc, scause, and sstatus,
-    // so enable only now that we're done with those registers.
-    intr_on();
-
-    syscall();
-
-    break;
-
+  // a fetch from a page of text that exec() mapped lazily is faulted in like a load, and then must
+  // turn out to be executable
+  case SCAUSE_INSTR_PAGE_FAULT:
   case SCAUSE_READ_PAGE_FAULT: {
+    uint64 scause  = r_scause();
     uint64 va      = r_stval();
     uint64 va_page = PGROUNDDOWN(va);
 
+    KTRACE(KT_FAULT, KT_PGFAULT, va, scause);
+
     if (va >= MAXVA) {
       printf("usertrap(): invalid va pid=%d\n", p->pid);
       printf("            sepc=%p stval=%p\n", r_sepc(), r_stval());
@@ -110,14 +155,22 @@ usertrap(void)
     }
 
     uint64 pa = walkaddr(p->pagetable, va_page);
+    pte_t *pte;
 
-    if (pa || (mmap_page_fault_handler(p, va_page) <= 0)) {
-      printf("usertrap(): read page fault pid=%d\n", p->pid);
+    if (pa || uvmlazy(p->pagetable, va_page, 0) <= 0 ||
+        (scause == SCAUSE_INSTR_PAGE_FAULT &&
+         ((pte = walk(p->pagetable, va_page, 0)) == 0 || (*pte & PTE_X) == 0))) {
+      printf("usertrap(): %s page fault pid=%d\n",
+             scause == SCAUSE_INSTR_PAGE_FAULT ? "instruction" : "read", p->pid);
       printf("            sepc=%p stval=%p\n", r_sepc(), r_stval());
       setkilled(p);
+      TSTAT_ADD(bad);
       goto userspace;
     }
 
+    TSTAT_ADD(fault);
+    p->ru.minflt++;
+
     break;
   }
 
@@ -125,6 +178,8 @@ usertrap(void)
     uint64 va      = r_stval();
     uint64 va_page = PGROUNDDOWN(va);
 
+    KTRACE(KT_FAULT, KT_PGFAULT, va, SCAUSE_WRITE_PAGE_FAULT);
+
     if (va >= MAXVA) {
       printf("usertrap(): invalid va pid=%d\n", p->pid);
       printf("            sepc=%p stval=%p\n", r_sepc(), r_stval());
@@ -139,20 +194,34 @@ usertrap(void)
       printf("usertrap(): OOM during copy-on-write pid=%d\n", r_scause(), p->pid);
       printf("            sepc=%p stval=%p\n", r_sepc(), r_stval());
       setkilled(p);
+      TSTAT_ADD(bad);
       goto userspace;
     }
 
-    if (pte == 0 && mmap_page_fault_handler(p, va_page) > 0) {
-      break;
+    if (pte == 0 || (*pte & PTE_V) == 0) {
+      if (uvmlazy(p->pagetable, va_page, 1) > 0) {
+        TSTAT_ADD(fault);
+        p->ru.minflt++;
+
+        break;
+      }
     }
 
-    if (pte == 0 || !(PTE_FLAGS(*pte) & PTE_W)) {
+    // a guard page has no PTE_U, even once a copy-on-write fault has made it writable
+    if (pte == 0 || !(PTE_FLAGS(*pte) & PTE_W) || !(PTE_FLAGS(*pte) & PTE_U)) {
       printf("usertrap(): write page fault pid=%d\n", p->pid);
       printf("            sepc=%p stval=%p\n", r_sepc(), r_stval());
       setkilled(p);
+      TSTAT_ADD(bad);
       goto userspace;
     }
 
+    if (cow_result) {
+      TSTAT_ADD(cow);
+    }
+
+    p->ru.minflt++;
+
     break;
   }
 
@@ -160,15 +229,26 @@ usertrap(void)
     printf("usertrap(): unexpected scause %p pid=%d\n", r_scause(), p->pid);
     printf("            sepc=%p stval=%p\n", r_sepc(), r_stval());
     setkilled(p);
+    TSTAT_ADD(bad);
     break;
   }
 
 userspace:
-  // the process may have been killed by another process calling kill() or setkilled() above
-  if (killed(p)) {
+  // the process may have been killed by another process calling kill() or setkilled() above. a
+  // kill() that this just misses is seen at the next trap, at the latest the next timer interrupt,
+  // as one that came a moment later would be, so there's no need for p->lock here
+  if (__atomic_load_n(&p->killed, __ATOMIC_ACQUIRE)) {
     exit(-1);
   }
 
+  // call the ualarm() handler if its timer has gone off, unless it is still running
+  if (__atomic_load_n(&p->alarm_due, __ATOMIC_ACQUIRE) && !p->alarm_inhandler) {
+    p->alarm_due       = 0;
+    p->alarm_inhandler = 1;
+    memmove(&p->alarm_prev_frame, p->trapframe, sizeof(p->alarm_prev_frame));
+    p->trapframe->epc = (uint64)p->alarm_handler;
+  }
+
   usertrapret();
 }
 
@@ -209,13 +289,37 @@ usertrapret(void)
   w_sepc(p->trapframe->epc);
 
   // tell trampoline.S the user page table to switch to.
-  uint64 satp = MAKE_SATP(p->pagetable);
+  uint64 satp = MAKE_SATP(p->pagetable, asid_activate(p));
+
+  // the kernel's time for this trap ends here, and user time starts.
+  uint64 now = r_time();
+  p->ru.stime += now - p->tstamp;
+  p->tstamp = now;
 
   // jump to userret in trampoline.S at the top of memory, which
   // switches to the user page table, restores user registers,
   // and switches to user mode with sret.
   uint64 trampoline_userret = TRAMPOLINE + (userret - trampoline);
-  ((void (*)(uint64))trampoline_userret)(satp);
+  ((void (*)(uint64, uint64))trampoline_userret)(satp, p->tfva);
+}
+
+// Print each CPU's trap counters into buf, for the statistics
+// device. Returns the number of bytes written.
+int
+trapstats(char *buf, int sz)
+{
+  int n = snprintf(buf, sz, "--- trap per-CPU stats\n");
+
+  for(int i = 0; i < NCPU; i++){
+    struct trapstats *ts = &tstats[i];
+
+    if(ts->syscall == 0 && ts->timer == 0 && ts->devintr == 0)
+      continue;
+    n += snprintf(buf + n, sz - n,
+                  "cpu %d: syscall %l timer %l intr %l fault %l cow %l bad %l\n", i,
+                  ts->syscall, ts->timer, ts->devintr, ts->fault, ts->cow, ts->bad);
+  }
+  return n;
 }
 
 // interrupts and exceptions from kernel code go here via kernelvec,
@@ -239,9 +343,12 @@ kerneltrap()
     panic("kerneltrap");
   }
 
+  if(which_dev == 2)
+    kprof_tick(sepc, r_fp());
+
   // give up the CPU if this is a timer interrupt.
   if(which_dev == 2 && myproc() != 0 && myproc()->state == RUNNING)
-    yield();
+    preempt();
 
   // the yield() may have caused some traps to occur,
   // so restore trap registers for use by kernelvec.S's sepc instruction.
@@ -252,12 +359,75 @@ kerneltrap()
 void
 clockintr()
 {
+  uint t = ticks + 1;
+
+  __atomic_store_n(&ticks, t, __ATOMIC_RELEASE);
+  __atomic_store_n(&ushared->ticks, t, __ATOMIC_RELEASE);
+  __atomic_store_n(&ushared->nproc, proccount(), __ATOMIC_RELAXED);
+  __atomic_store_n(&ushared->freemem, kgetfreemem(), __ATOMIC_RELAXED);
+  loadavg_tick(t);
+
+  // a sys_sleep() that has just looked at ticks holds tickslock
+  // until it is asleep, so it can't miss this wakeup.
   acquire(&tickslock);
-  ticks++;
   wakeup(&ticks);
   release(&tickslock);
 }
 
+// Ask for this CPU's next timer interrupt at the earlier of its
+// next clock tick and its first timer queue deadline, as timervec
+// does. timervec may run in between and pick a later time, so this
+// may ask for an interrupt that comes too early, but never too late;
+// timervec then counts no tick and tries again.
+static void
+timerprogram(uint64 *scratch)
+{
+  uint64 tick = __atomic_load_n(&scratch[7], __ATOMIC_RELAXED);
+  uint64 deadline = __atomic_load_n(&scratch[8], __ATOMIC_RELAXED);
+
+  *(volatile uint64*)CLINT_MTIMECMP(cpuid()) = tick < deadline ? tick : deadline;
+}
+
+// Stop this CPU's clock ticks; its timer queue still interrupts it.
+// Interrupts must be disabled.
+void
+timerstop(void)
+{
+  uint64 *scratch = timer_scratch[cpuid()];
+
+  __atomic_store_n(&scratch[7], -1, __ATOMIC_RELAXED);
+  timerprogram(scratch);
+}
+
+// Start this CPU's clock ticks again, a tick from now.
+// Interrupts must be disabled.
+void
+timerstart(void)
+{
+  uint64 *scratch = timer_scratch[cpuid()];
+
+  __atomic_store_n(&scratch[7], *(volatile uint64*)CLINT_MTIME + TICKCYCLES, __ATOMIC_RELAXED);
+  timerprogram(scratch);
+}
+
+// Ask for a timer interrupt at mtime deadline, or for none but the
+// clock ticks if it is -1, for timer.c. Interrupts must be disabled.
+void
+timerarm(uint64 deadline)
+{
+  uint64 *scratch = timer_scratch[cpuid()];
+
+  __atomic_store_n(&scratch[8], deadline, __ATOMIC_RELAXED);
+  timerprogram(scratch);
+}
+
+// Interrupt cpu, to take it out of wfi.
+void
+cpukick(int cpu)
+{
+  *(volatile uint32*)CLINT_MSIP(cpu) = 1;
+}
+
 // check if it's an external interrupt or software interrupt,
 // and handle it.
 // returns 2 if timer interrupt,
@@ -296,17 +466,30 @@ devintr()
     return 1;
   } else if(scause == 0x8000000000000001L){
     // software interrupt from a machine-mode timer interrupt,
-    // forwarded by timervec in kernelvec.S.
-
-    if(cpuid() == 0){
-      clockintr();
-    }
+    // or a cpukick(), forwarded by timervec in kernelvec.S.
+    struct cpu *c = mycpu();
+    uint64 n;
+    int timer;
 
     // acknowledge the software interrupt by clearing
-    // the SSIP bit in sip.
+    // the SSIP bit in sip, before looking at the count,
+    // so a timer interrupt after this one raises it again.
     w_sip(r_sip() & ~2);
 
-    return 2;
+    // the kick may be a request for a TLB flush.
+    asid_poll();
+
+    // or the interrupt may be for a timer in this CPU's queue.
+    timer_run();
+
+    n = __atomic_load_n(&timer_scratch[cpuid()][6], __ATOMIC_RELAXED);
+    timer = n != c->timerseen;
+    for(; c->timerseen != n; c->timerseen++){
+      if(cpuid() == 0)
+        clockintr();
+    }
+
+    return timer ? 2 : 1;
   } else {
     return 0;
   }
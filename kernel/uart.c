@@ -33,20 +33,33 @@
 #define LCR_BAUD_LATCH (1<<7) // special mode to set baud rate
 #define LSR 5                 // line status register
 #define LSR_RX_READY (1<<0)   // input is waiting to be read from RHR
-#define LSR_TX_IDLE (1<<5)    // THR can accept another character to send
+#define LSR_TX_IDLE (1<<5)    // THR can accept another character to send;
+                              // with FIFOs on, the transmit FIFO is empty
+#define UART_FIFO_SIZE 16     // bytes the transmit FIFO holds
 
 #define ReadReg(reg) (*(Reg(reg)))
 #define WriteReg(reg, v) (*(Reg(reg)) = (v))
 
 // the transmit output buffer.
 struct spinlock uart_tx_lock;
-#define UART_TX_BUF_SIZE 32
+#define UART_TX_BUF_SIZE 1024
 char uart_tx_buf[UART_TX_BUF_SIZE];
 uint64 uart_tx_w; // write next to uart_tx_buf[uart_tx_w % UART_TX_BUF_SIZE]
 uint64 uart_tx_r; // read next from uart_tx_buf[uart_tx_r % UART_TX_BUF_SIZE]
 
 extern volatile int panicked; // from printf.c
 
+// whether the uart is partway through a line of the kernel log
+// (printf.c), which output from write() must wait for.
+int uart_klog_midline;
+
+// whether the uart is partway through a line from write(), and
+// whether that output is owed a line since the kernel log last
+// sent one: the two take turns a line at a time, so that neither
+// holds the other up for long.
+int uart_tx_midline;
+int uart_tx_turn;
+
 void uartstart();
 
 void
@@ -77,34 +90,44 @@ uartinit(void)
   initlock(&uart_tx_lock, "uart");
 }
 
-// add a character to the output buffer and tell the
-// UART to start sending if it isn't already.
-// blocks if the output buffer is full.
+// add n bytes from buf to the output buffer, as many
+// at a time as fit, and tell the UART to start sending
+// if it isn't already.
+// blocks while the output buffer is full.
 // because it may block, it can't be called
 // from interrupts; it's only suitable for use
 // by write().
 void
-uartputc(int c)
+uartwrite(char *buf, int n)
 {
+  int i = 0, m;
+
   acquire(&uart_tx_lock);
 
   if(panicked){
     for(;;)
       ;
   }
-  while(uart_tx_w == uart_tx_r + UART_TX_BUF_SIZE){
-    // buffer is full.
-    // wait for uartstart() to open up space in the buffer.
-    sleep(&uart_tx_r, &uart_tx_lock);
+  while(i < n){
+    while(uart_tx_w == uart_tx_r + UART_TX_BUF_SIZE){
+      // buffer is full.
+      // wait for uartstart() to open up space in the buffer.
+      sleep(&uart_tx_r, &uart_tx_lock);
+    }
+    m = UART_TX_BUF_SIZE - (uart_tx_w - uart_tx_r);
+    if(m > n - i)
+      m = n - i;
+    for(int j = 0; j < m; j++)
+      uart_tx_buf[(uart_tx_w + j) % UART_TX_BUF_SIZE] = buf[i + j];
+    uart_tx_w += m;
+    i += m;
+    uartstart();
   }
-  uart_tx_buf[uart_tx_w % UART_TX_BUF_SIZE] = c;
-  uart_tx_w += 1;
-  uartstart();
   release(&uart_tx_lock);
 }
 
 
-// alternate version of uartputc() that doesn't 
+// alternate version of uartwrite() for one byte, that doesn't
 // use interrupts, for use by kernel printf() and
 // to echo characters. it spins waiting for the uart's
 // output register to be empty.
@@ -126,36 +149,85 @@ uartputc_sync(int c)
   pop_off();
 }
 
-// if the UART is idle, and a character is waiting
-// in the transmit buffer, send it.
+// the next byte to send, or -1 if there is none: from the
+// kernel log in the middle of one of its lines, with logonly
+// set, when the transmit buffer is empty, or at the end of a
+// line from the transmit buffer if it is the log's turn; from
+// the transmit buffer otherwise. sets *took if the byte came
+// from the transmit buffer.
+static int
+uartnext(int logonly, int *took)
+{
+  int c;
+
+  if((uart_tx_w == uart_tx_r || uart_klog_midline || logonly ||
+      (!uart_tx_midline && !uart_tx_turn)) &&
+     (c = klogget()) >= 0){
+    uart_klog_midline = (c != '\n');
+    if(c == '\n')
+      uart_tx_turn = 1;
+    return c;
+  }
+  if(logonly || uart_tx_w == uart_tx_r)
+    return -1;
+  uart_klog_midline = 0;
+  c = uart_tx_buf[uart_tx_r % UART_TX_BUF_SIZE];
+  uart_tx_r += 1;
+  uart_tx_midline = (c != '\n');
+  if(c == '\n')
+    uart_tx_turn = 0;
+  *took = 1;
+  return c;
+}
+
+// while the UART's transmit FIFO is empty, fill it with
+// up to UART_FIFO_SIZE bytes. the UART interrupts when it
+// has sent them.
 // caller must hold uart_tx_lock.
-// called from both the top- and bottom-half.
-void
-uartstart()
+static void
+uartfill(int logonly)
 {
-  while(1){
-    if(uart_tx_w == uart_tx_r){
-      // transmit buffer is empty.
-      return;
-    }
-    
-    if((ReadReg(LSR) & LSR_TX_IDLE) == 0){
-      // the UART transmit holding register is full,
-      // so we cannot give it another byte.
-      // it will interrupt when it's ready for a new byte.
-      return;
+  int c, took = 0;
+
+  while(ReadReg(LSR) & LSR_TX_IDLE){
+    for(int i = 0; i < UART_FIFO_SIZE; i++){
+      if((c = uartnext(logonly, &took)) < 0)
+        goto done;
+      WriteReg(THR, c & 0xff);
     }
-    
-    int c = uart_tx_buf[uart_tx_r % UART_TX_BUF_SIZE];
-    uart_tx_r += 1;
-    
-    // maybe uartputc() is waiting for space in the buffer.
+  }
+done:
+  if(took){
+    // maybe uartwrite() is waiting for space in the buffer.
     wakeup(&uart_tx_r);
-    
-    WriteReg(THR, c);
   }
 }
 
+// if the UART is idle, and bytes are waiting in the
+// transmit buffer or the kernel log, send a batch.
+// caller must hold uart_tx_lock.
+// called from both the top- and bottom-half.
+void
+uartstart()
+{
+  uartfill(0);
+}
+
+// send what the kernel log has for the uart, for printf().
+// printf() may be called holding any lock, so this mustn't
+// spin for uart_tx_lock or wake anyone up: if another CPU
+// holds the lock (or this one does), the holder's call to
+// uartstart(), or the interrupt after the bytes it sends,
+// sends the log instead.
+void
+uartkick(void)
+{
+  if(!tryacquire(&uart_tx_lock))
+    return;
+  uartfill(1);
+  release(&uart_tx_lock);
+}
+
 // read one input character from the UART.
 // return -1 if none is waiting.
 int
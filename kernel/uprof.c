@@ -0,0 +1,158 @@
+// Sampling profiler for user processes.
+//
+// After uprof(interval), every interval-th clock tick that interrupts the process in user space
+// records its pc, and the return addresses found by following its frame pointers, like
+// backtrace() does for the kernel. The samples go into a page that belongs to the process rather
+// than its address space, so they survive exec(), and another process such as user/uprof reads
+// and consumes them with uprofread(), until the process has been waited for.
+
+#include "types.h"
+#include "param.h"
+#include "memlayout.h"
+#include "riscv.h"
+#include "spinlock.h"
+#include "proc.h"
+#include "uprof.h"
+#include "defs.h"
+
+#define NUPROFSAMPLE ((PGSIZE - 4 * sizeof(uint)) / sizeof(struct uprofsample))
+
+// One page, freed with the process. p->lock protects head and tail. New samples are dropped while
+// it is full.
+struct uprof {
+  uint               interval;   // ticks per sample, 0 if stopped
+  uint               countdown;  // ticks until the next sample
+  uint               head;       // samples recorded
+  uint               tail;       // samples read
+  struct uprofsample s[NUPROFSAMPLE];
+};
+
+// Sample the calling process every interval clock ticks it spends in user space, or stop if
+// interval is 0. Returns 0, or -1 if out of memory.
+int
+uprof(int interval)
+{
+  struct proc  *p = myproc();
+  struct uprof *u;
+
+  if (interval < 0) {
+    return -1;
+  }
+
+  if (p->prof == 0) {
+    if ((u = kalloc_zeroed()) == 0) {
+      return -1;
+    }
+
+    acquire(&p->lock);
+    p->prof = u;
+    release(&p->lock);
+  }
+
+  u            = p->prof;
+  u->countdown = interval;
+  __atomic_store_n(&u->interval, interval, __ATOMIC_RELAXED);
+
+  return 0;
+}
+
+// Called by usertrap() on each clock tick that interrupts p in user space.
+void
+uprof_tick(struct proc *p)
+{
+  struct uprof      *u = p->prof;
+  struct uprofsample s = {0};
+
+  if (u == 0 || __atomic_load_n(&u->interval, __ATOMIC_RELAXED) == 0 || --u->countdown > 0) {
+    return;
+  }
+
+  u->countdown = u->interval;
+
+  // each frame keeps its return address at fp-8 and its caller's fp at fp-16, and callers' frames
+  // are further up the stack.
+  uint64 fp = p->trapframe->s0;
+
+  s.pc[0] = p->trapframe->epc;
+
+  for (int i = 1; i < UPROF_DEPTH && fp % 8 == 0 && fp >= 16; i++) {
+    uint64 ra, prev;
+
+    if (copyin(p->pagetable, (char *)&ra, fp - 8, sizeof(ra)) < 0 ||
+        copyin(p->pagetable, (char *)&prev, fp - 16, sizeof(prev)) < 0 || ra == 0) {
+      break;
+    }
+
+    s.pc[i] = ra;
+
+    if (prev <= fp) {
+      break;
+    }
+
+    fp = prev;
+  }
+
+  acquire(&p->lock);
+
+  if (u->head - u->tail < NUPROFSAMPLE) {
+    u->s[u->head++ % NUPROFSAMPLE] = s;
+  }
+
+  release(&p->lock);
+}
+
+// Move up to n of the samples of process pid to user address dst, oldest first. Returns how many,
+// or -1 if pid isn't being profiled, or has exited and has no samples left.
+int
+uprof_read(int pid, uint64 dst, int n)
+{
+  struct uprofsample buf[4];
+  int                copied = 0;
+
+  while (copied < n) {
+    struct proc *p = procof(pid);
+    int          k = 0;
+
+    // procof() returns p locked.
+    if (p == 0 || p->prof == 0) {
+      if (p) {
+        release(&p->lock);
+      }
+
+      return copied > 0 ? copied : -1;
+    }
+
+    struct uprof *u = p->prof;
+
+    while (k < NELEM(buf) && copied + k < n && u->tail != u->head) {
+      buf[k++] = u->s[u->tail++ % NUPROFSAMPLE];
+    }
+
+    int done = p->state == ZOMBIE;
+
+    release(&p->lock);
+
+    if (k == 0) {
+      return copied == 0 && done ? -1 : copied;
+    }
+
+    if (copyout(myproc()->pagetable, dst + copied * sizeof(buf[0]), (char *)buf,
+                k * sizeof(buf[0])) < 0) {
+      return -1;
+    }
+
+    copied += k;
+  }
+
+  return copied;
+}
+
+// Free p's samples. p->lock must be held.
+void
+uprof_free(struct proc *p)
+{
+  if (p->prof) {
+    kfree(p->prof);
+    p->prof = 0;
+  }
+}
@@ -0,0 +1,11 @@
+// Samples of a user process's program counter, taken by uprof()
+// and read with uprofread(), and of the kernel's, taken by kprof()
+// and read with kprofread().
+
+#define UPROF_DEPTH 8   // pcs per sample
+
+struct uprofsample {
+  uint64 pc[UPROF_DEPTH];  // pc, then the return addresses of
+                           // its callers, innermost first; 0 after
+                           // the last one found
+};
@@ -39,15 +39,17 @@
 // device feature bits
 #define VIRTIO_BLK_F_RO              5	/* Disk is read-only */
 #define VIRTIO_BLK_F_SCSI            7	/* Supports scsi command passthru */
+#define VIRTIO_BLK_F_FLUSH           9	/* Cache flush command support */
 #define VIRTIO_BLK_F_CONFIG_WCE     11	/* Writeback mode available in config */
 #define VIRTIO_BLK_F_MQ             12	/* support more than one vq */
 #define VIRTIO_F_ANY_LAYOUT         27
 #define VIRTIO_RING_F_INDIRECT_DESC 28
 #define VIRTIO_RING_F_EVENT_IDX     29
 
-// this many virtio descriptors.
-// must be a power of two.
-#define NUM 8
+// at most this many virtio descriptors; the disk driver uses
+// fewer if the device's queue is smaller.
+// must be a power of two, and no more than fit in a page.
+#define NUM 256
 
 // a single descriptor, from the spec.
 struct virtq_desc {
@@ -58,8 +60,12 @@ struct virtq_desc {
 };
 #define VRING_DESC_F_NEXT  1 // chained with another descriptor
 #define VRING_DESC_F_WRITE 2 // device writes (vs read)
+#define VRING_DESC_F_INDIRECT 4 // addr is a table of descriptors
 
-// the (entire) avail ring, from the spec.
+// the (entire) avail ring, from the spec. with
+// VIRTIO_RING_F_EVENT_IDX, the uint16 after the queue's
+// last ring entry is used_event: the driver wants an
+// interrupt once the device's used idx passes it.
 struct virtq_avail {
   uint16 flags; // always zero
   uint16 idx;   // driver will write ring[idx] next
@@ -74,12 +80,23 @@ struct virtq_used_elem {
   uint32 len;
 };
 
+// with VIRTIO_RING_F_EVENT_IDX, the uint16 after the queue's
+// last ring entry is avail_event: the device wants a
+// notification once the driver's avail idx passes it.
 struct virtq_used {
   uint16 flags; // always zero
   uint16 idx;   // device increments when it adds a ring[] entry
   struct virtq_used_elem ring[NUM];
 };
 
+// should the side that has moved its idx from old to new
+// tell the other side, which asked to hear once it passed event?
+static inline int
+vring_need_event(uint16 event, uint16 new, uint16 old)
+{
+  return (uint16)(new - event - 1) < (uint16)(new - old);
+}
+
 // these are specific to virtio block devices, e.g. disks,
 // described in Section 5.2 of the spec.
 
@@ -15,14 +15,24 @@
 #include "fs.h"
 #include "buf.h"
 #include "virtio.h"
+#include "ktrace.h"
 
 // the address of virtio mmio register r.
 #define R(r) ((volatile uint32 *)(VIRTIO0 + (r)))
 
+// the most bufs a single request reads or writes.
+#define MAXSEG 32
+
+// the uint16s that follow the queue's rings, with
+// VIRTIO_RING_F_EVENT_IDX. see virtio.h.
+#define USED_EVENT  (*(volatile uint16 *)&disk.avail->ring[disk.num])
+#define AVAIL_EVENT (*(volatile uint16 *)&disk.used->ring[disk.num])
+
 static struct disk {
   // a set (not a ring) of DMA descriptors, with which the
   // driver tells the device where to read and write individual
-  // disk operations. there are NUM descriptors.
+  // disk operations. there are num descriptors, as many as
+  // the device allows, up to NUM.
   // most commands consist of a "chain" (a linked list) of a couple of
   // these descriptors.
   struct virtq_desc *desc;
@@ -30,23 +40,33 @@ static struct disk {
   // a ring in which the driver writes descriptor numbers
   // that the driver would like the device to process.  it only
   // includes the head descriptor of each chain. the ring has
-  // NUM elements.
+  // num elements.
   struct virtq_avail *avail;
 
   // a ring in which the device writes descriptor numbers that
   // the device has finished processing (just the head of each chain).
-  // there are NUM used ring entries.
+  // there are num used ring entries.
   struct virtq_used *used;
 
+  // with VIRTIO_RING_F_INDIRECT_DESC, a request's descriptors
+  // go in a table of their own, which a single descriptor in
+  // desc points to, so a request takes one queue entry however
+  // many bufs it has. one table for each descriptor.
+  struct virtq_desc indirect[NUM][MAXSEG + 2];
+
   // our own book-keeping.
+  int num;         // size of the queue; a power of two.
   char free[NUM];  // is a descriptor free?
-  uint16 used_idx; // we've looked this far in used[2..NUM].
+  uint16 used_idx; // we've looked this far in used[2..num].
+  int use_indirect;  // negotiated VIRTIO_RING_F_INDIRECT_DESC?
+  int use_event_idx; // negotiated VIRTIO_RING_F_EVENT_IDX?
 
   // track info about in-flight operations,
   // for use when completion interrupt arrives.
   // indexed by first descriptor index of chain.
   struct {
-    struct buf *b;
+    struct buf *b;               // first buf, linked by qnext.
+    void (*done)(struct buf *);  // if not 0, called on each buf.
     char status;
   } info[NUM];
 
@@ -87,11 +107,18 @@ virtio_disk_init(void)
   uint64 features = *R(VIRTIO_MMIO_DEVICE_FEATURES);
   features &= ~(1 << VIRTIO_BLK_F_RO);
   features &= ~(1 << VIRTIO_BLK_F_SCSI);
+  // without flush commands the device must write through its
+  // cache, so a write is on disk once it completes, which is the
+  // ordering the log relies on.
+  features &= ~(1 << VIRTIO_BLK_F_FLUSH);
   features &= ~(1 << VIRTIO_BLK_F_CONFIG_WCE);
   features &= ~(1 << VIRTIO_BLK_F_MQ);
   features &= ~(1 << VIRTIO_F_ANY_LAYOUT);
-  features &= ~(1 << VIRTIO_RING_F_EVENT_IDX);
-  features &= ~(1 << VIRTIO_RING_F_INDIRECT_DESC);
+  // take indirect descriptors and event indexes if the device
+  // offers them; they're what let it keep a deep queue without
+  // a notification or an interrupt for every request.
+  disk.use_indirect = (features >> VIRTIO_RING_F_INDIRECT_DESC) & 1;
+  disk.use_event_idx = (features >> VIRTIO_RING_F_EVENT_IDX) & 1;
   *R(VIRTIO_MMIO_DRIVER_FEATURES) = features;
 
   // tell device that feature negotiation is complete.
@@ -114,9 +141,14 @@ virtio_disk_init(void)
   uint32 max = *R(VIRTIO_MMIO_QUEUE_NUM_MAX);
   if(max == 0)
     panic("virtio disk has no queue 0");
-  if(max < NUM)
+  if(max < 4)
     panic("virtio disk max queue too short");
 
+  // use the largest queue both the device and NUM allow.
+  disk.num = NUM;
+  while(disk.num > max)
+    disk.num /= 2;
+
   // allocate and zero queue memory.
   disk.desc = kalloc();
   disk.avail = kalloc();
@@ -128,7 +160,7 @@ virtio_disk_init(void)
   memset(disk.used, 0, PGSIZE);
 
   // set queue size.
-  *R(VIRTIO_MMIO_QUEUE_NUM) = NUM;
+  *R(VIRTIO_MMIO_QUEUE_NUM) = disk.num;
 
   // write physical addresses.
   *R(VIRTIO_MMIO_QUEUE_DESC_LOW) = (uint64)disk.desc;
@@ -141,8 +173,8 @@ virtio_disk_init(void)
   // queue is ready.
   *R(VIRTIO_MMIO_QUEUE_READY) = 0x1;
 
-  // all NUM descriptors start out unused.
-  for(int i = 0; i < NUM; i++)
+  // all descriptors start out unused.
+  for(int i = 0; i < disk.num; i++)
     disk.free[i] = 1;
 
   // tell device we're completely ready.
@@ -156,7 +188,7 @@ virtio_disk_init(void)
 static int
 alloc_desc()
 {
-  for(int i = 0; i < NUM; i++){
+  for(int i = 0; i < disk.num; i++){
     if(disk.free[i]){
       disk.free[i] = 0;
       return i;
@@ -169,7 +201,7 @@ alloc_desc()
 static void
 free_desc(int i)
 {
-  if(i >= NUM)
+  if(i >= disk.num)
     panic("free_desc 1");
   if(disk.free[i])
     panic("free_desc 2");
@@ -196,12 +228,11 @@ free_chain(int i)
   }
 }
 
-// allocate three descriptors (they need not be contiguous).
-// disk transfers always use three descriptors.
+// allocate n descriptors (they need not be contiguous).
 static int
-alloc3_desc(int *idx)
+alloc_descs(int *idx, int n)
 {
-  for(int i = 0; i < 3; i++){
+  for(int i = 0; i < n; i++){
     idx[i] = alloc_desc();
     if(idx[i] < 0){
       for(int j = 0; j < i; j++)
@@ -212,52 +243,44 @@ alloc3_desc(int *idx)
   return 0;
 }
 
-//
-// check that there are at most NBUF distinct
-// struct buf's, which the lock lab requires.
-//
-static struct buf *xbufs[NBUF];
+// hand the device one request to read or write the n bufs,
+// which hold adjacent blocks, in a single transfer. caller
+// must hold vdisk_lock.
 static void
-checkbuf(struct buf *b)
+virtio_disk_submit(struct buf **bufs, int n, int write, void (*done)(struct buf *))
 {
-  for(int i = 0; i < NBUF; i++){
-    if(xbufs[i] == b){
-      return;
-    }
-    if(xbufs[i] == 0){
-      xbufs[i] = b;
-      return;
-    }
-  }
-  panic("more than NBUF bufs");
-}
-
-void
-virtio_disk_rw(struct buf *b, int write)
-{
-  uint64 sector = b->blockno * (BSIZE / 512);
-
-  acquire(&disk.vdisk_lock);
-
-  checkbuf(b);
+  uint64 sector = bufs[0]->blockno * (BSIZE / 512);
 
   // the spec's Section 5.2 says that legacy block operations use
-  // three descriptors: one for type/reserved/sector, one for the
-  // data, one for a 1-byte status result.
-
-  // allocate the three descriptors.
-  int idx[3];
+  // a descriptor for type/reserved/sector, then one for each
+  // part of the data, then one for a 1-byte status result.
+  // with indirect descriptors they go in the table of the one
+  // queue descriptor the request takes, and idx holds their
+  // indexes in that table instead.
+  int idx[MAXSEG + 2];
+  int head;
   while(1){
-    if(alloc3_desc(idx) == 0) {
+    if(disk.use_indirect){
+      if((head = alloc_desc()) >= 0){
+        for(int i = 0; i < n + 2; i++)
+          idx[i] = i;
+        break;
+      }
+    } else if(alloc_descs(idx, n + 2) == 0) {
+      head = idx[0];
       break;
     }
+    // requests queued by the caller but not yet notified must
+    // finish to free descriptors.
+    *R(VIRTIO_MMIO_QUEUE_NOTIFY) = 0;
     sleep(&disk.free[0], &disk.vdisk_lock);
   }
 
-  // format the three descriptors.
+  // format the descriptors.
   // qemu's virtio-blk.c reads them.
 
-  struct virtio_blk_req *buf0 = &disk.ops[idx[0]];
+  struct virtq_desc *desc = disk.use_indirect ? disk.indirect[head] : disk.desc;
+  struct virtio_blk_req *buf0 = &disk.ops[head];
 
   if(write)
     buf0->type = VIRTIO_BLK_T_OUT; // write the disk
@@ -266,53 +289,109 @@ virtio_disk_rw(struct buf *b, int write)
   buf0->reserved = 0;
   buf0->sector = sector;
 
-  disk.desc[idx[0]].addr = (uint64) buf0;
-  disk.desc[idx[0]].len = sizeof(struct virtio_blk_req);
-  disk.desc[idx[0]].flags = VRING_DESC_F_NEXT;
-  disk.desc[idx[0]].next = idx[1];
+  desc[idx[0]].addr = (uint64) buf0;
+  desc[idx[0]].len = sizeof(struct virtio_blk_req);
+  desc[idx[0]].flags = VRING_DESC_F_NEXT;
+  desc[idx[0]].next = idx[1];
 
-  disk.desc[idx[1]].addr = (uint64) b->data;
-  disk.desc[idx[1]].len = BSIZE;
-  if(write)
-    disk.desc[idx[1]].flags = 0; // device reads b->data
-  else
-    disk.desc[idx[1]].flags = VRING_DESC_F_WRITE; // device writes b->data
-  disk.desc[idx[1]].flags |= VRING_DESC_F_NEXT;
-  disk.desc[idx[1]].next = idx[2];
+  for(int i = 0; i < n; i++){
+    struct buf *b = bufs[i];
+
+    desc[idx[i+1]].addr = (uint64) b->data;
+    desc[idx[i+1]].len = BSIZE;
+    if(write)
+      desc[idx[i+1]].flags = 0; // device reads b->data
+    else
+      desc[idx[i+1]].flags = VRING_DESC_F_WRITE; // device writes b->data
+    desc[idx[i+1]].flags |= VRING_DESC_F_NEXT;
+    desc[idx[i+1]].next = idx[i+2];
 
-  disk.info[idx[0]].status = 0xff; // device writes 0 on success
-  disk.desc[idx[2]].addr = (uint64) &disk.info[idx[0]].status;
-  disk.desc[idx[2]].len = 1;
-  disk.desc[idx[2]].flags = VRING_DESC_F_WRITE; // device writes the status
-  disk.desc[idx[2]].next = 0;
+    b->disk = 1;
+    b->qnext = i + 1 < n ? bufs[i+1] : 0;
+  }
+
+  disk.info[head].status = 0xff; // device writes 0 on success
+  desc[idx[n+1]].addr = (uint64) &disk.info[head].status;
+  desc[idx[n+1]].len = 1;
+  desc[idx[n+1]].flags = VRING_DESC_F_WRITE; // device writes the status
+  desc[idx[n+1]].next = 0;
+
+  // record the bufs for virtio_disk_intr().
+  disk.info[head].b = bufs[0];
+  disk.info[head].done = done;
+
+  if(disk.use_indirect){
+    disk.desc[head].addr = (uint64) desc;
+    disk.desc[head].len = (n + 2) * sizeof(struct virtq_desc);
+    disk.desc[head].flags = VRING_DESC_F_INDIRECT;
+    disk.desc[head].next = 0;
+  }
 
-  // record struct buf for virtio_disk_intr().
-  b->disk = 1;
-  disk.info[idx[0]].b = b;
+  KTRACE(KT_DISK, KT_DISKSUBMIT, bufs[0]->blockno, n | ((uint64)write << 32));
 
   // tell the device the first index in our chain of descriptors.
-  disk.avail->ring[disk.avail->idx % NUM] = idx[0];
+  disk.avail->ring[disk.avail->idx % disk.num] = head;
 
   __sync_synchronize();
 
   // tell the device another avail ring entry is available.
-  disk.avail->idx += 1; // not % NUM ...
+  disk.avail->idx += 1; // not % num ...
+}
+
+// start reading or writing the n bufs, which must all be
+// locked and on the same device, without waiting. bufs that
+// hold adjacent blocks go to the device as one request, and
+// all the requests are in flight at once. if done is 0,
+// use virtio_disk_wait() to wait for each buf; otherwise
+// virtio_disk_intr() calls done on each buf as it finishes.
+void
+virtio_disk_start(struct buf **bufs, int n, int write, void (*done)(struct buf *))
+{
+  acquire(&disk.vdisk_lock);
+
+  uint16 old = disk.avail->idx;
+  for(int i = 0; i < n; ){
+    int m = 1;
+    while(i + m < n && m < MAXSEG && (disk.use_indirect || m + 2 < disk.num) &&
+          bufs[i+m]->blockno == bufs[i]->blockno + m)
+      m++;
+    virtio_disk_submit(bufs + i, m, write, done);
+    i += m;
+  }
 
   __sync_synchronize();
 
-  *R(VIRTIO_MMIO_QUEUE_NOTIFY) = 0; // value is queue number
+  // one notification covers every request above, and
+  // with event indexes it's only needed if the device
+  // isn't already going to look at the new ones.
+  if(!disk.use_event_idx || vring_need_event(AVAIL_EVENT, disk.avail->idx, old))
+    *R(VIRTIO_MMIO_QUEUE_NOTIFY) = 0; // value is queue number
+
+  release(&disk.vdisk_lock);
+}
+
+// wait for the disk to finish with b, which
+// virtio_disk_start() was given with no done function.
+void
+virtio_disk_wait(struct buf *b)
+{
+  acquire(&disk.vdisk_lock);
 
   // Wait for virtio_disk_intr() to say request has finished.
   while(b->disk == 1) {
     sleep(b, &disk.vdisk_lock);
   }
 
-  disk.info[idx[0]].b = 0;
-  free_chain(idx[0]);
-
   release(&disk.vdisk_lock);
 }
 
+void
+virtio_disk_rw(struct buf *b, int write)
+{
+  virtio_disk_start(&b, 1, write, 0);
+  virtio_disk_wait(b);
+}
+
 void
 virtio_disk_intr()
 {
@@ -329,21 +408,45 @@ virtio_disk_intr()
   __sync_synchronize();
 
   // the device increments disk.used->idx when it
-  // adds an entry to the used ring.
-
-  while(disk.used_idx != disk.used->idx){
+  // adds an entry to the used ring. take everything
+  // it has finished so far as one batch, then, with
+  // event indexes, ask for an interrupt for the next
+  // completion and look again, in case it came in
+  // before the device could see the request.
+
+again:
+  for(uint16 last = disk.used->idx; disk.used_idx != last; ){
     __sync_synchronize();
-    int id = disk.used->ring[disk.used_idx % NUM].id;
+    int id = disk.used->ring[disk.used_idx % disk.num].id;
 
     if(disk.info[id].status != 0)
       panic("virtio_disk_intr status");
 
     struct buf *b = disk.info[id].b;
-    b->disk = 0;   // disk is done with buf
-    wakeup(b);
+    void (*done)(struct buf *) = disk.info[id].done;
+    disk.info[id].b = 0;
+    free_chain(id);
+    KTRACE(KT_DISK, KT_DISKDONE, b->blockno, 0);
+
+    while(b){
+      struct buf *next = b->qnext;
+      b->disk = 0;   // disk is done with buf
+      if(done)
+        done(b);
+      else
+        wakeup(b);
+      b = next;
+    }
 
     disk.used_idx += 1;
   }
 
+  if(disk.use_event_idx){
+    USED_EVENT = disk.used_idx;
+    __sync_synchronize();
+    if(disk.used_idx != disk.used->idx)
+      goto again;
+  }
+
   release(&disk.vdisk_lock);
 }
@@ -11,6 +11,8 @@
 #include "vm.h"
 #include "fcntl.h"
 #include "file.h"
+#include "slab.h"
+#include "page.h"
 
 /*
  * the kernel's page table.
@@ -21,8 +23,17 @@ extern char etext[];  // kernel.ld sets this to end of kernel code.
 
 extern char trampoline[]; // trampoline.S
 
-// A statically-allocated array of virtual memory areas for processes to use.
-struct vm_area vmas[NPROC] = {0};
+// Where the vm_area structs for every process's mmap()s come from.
+static struct kmem_cache vma_cache;
+
+// A page of zeros that read faults on the heap map copy-on-write, so
+// that memory which is only read never gets a page of its own. It
+// holds a reference of its own, so it is never freed or reused.
+static uint64 zeropage;
+
+static int vma_search(struct mm *, uint64);
+static int vma_fill(struct mm *, struct vm_area *, uint64, uint64);
+static int vma_advise(struct mm *, uint64, size_t, int);
 
 // Make a direct-map page table for the kernel.
 pagetable_t
@@ -30,8 +41,7 @@ kvmmake(void)
 {
   pagetable_t kpgtbl;
 
-  kpgtbl = (pagetable_t) kalloc();
-  memset(kpgtbl, 0, PGSIZE);
+  kpgtbl = (pagetable_t) kalloc_zeroed();
 
   // uart registers
   kvmmap(kpgtbl, UART0, UART0, PGSIZE, PTE_R | PTE_W);
@@ -40,19 +50,22 @@ kvmmake(void)
   kvmmap(kpgtbl, VIRTIO0, VIRTIO0, PGSIZE, PTE_R | PTE_W);
 
   // PCI-E ECAM (configuration space), for pci.c
-  kvmmap(kpgtbl, 0x30000000L, 0x30000000L, 0x10000000, PTE_R | PTE_W);
+  kvmmapmega(kpgtbl, 0x30000000L, 0x30000000L, 0x10000000, PTE_R | PTE_W);
 
   // pci.c maps the e1000's registers here.
   kvmmap(kpgtbl, 0x40000000L, 0x40000000L, 0x20000, PTE_R | PTE_W);
 
+  // CLINT, for the timer and wakeups in trap.c
+  kvmmap(kpgtbl, CLINT, CLINT, 0x10000, PTE_R | PTE_W);
+
   // PLIC
-  kvmmap(kpgtbl, PLIC, PLIC, 0x400000, PTE_R | PTE_W);
+  kvmmapmega(kpgtbl, PLIC, PLIC, 0x400000, PTE_R | PTE_W);
 
   // map kernel text executable and read-only.
   kvmmap(kpgtbl, KERNBASE, KERNBASE, (uint64)etext-KERNBASE, PTE_R | PTE_X);
 
   // map kernel data and the physical RAM we'll make use of.
-  kvmmap(kpgtbl, (uint64)etext, (uint64)etext, PHYSTOP-(uint64)etext, PTE_R | PTE_W);
+  kvmmapmega(kpgtbl, (uint64)etext, (uint64)etext, PHYSTOP-(uint64)etext, PTE_R | PTE_W);
 
   // map the trampoline for trap entry/exit to
   // the highest virtual address in the kernel.
@@ -69,6 +82,9 @@ void
 kvminit(void)
 {
   kernel_pagetable = kvmmake();
+  kmem_cache_init(&vma_cache, "vma_cache", sizeof(struct vm_area));
+  if((zeropage = (uint64) kalloc_zeroed()) == 0)
+    panic("kvminit: zeropage");
 }
 
 // Switch h/w page table register to the kernel's page table,
@@ -79,12 +95,101 @@ kvminithart()
   // wait for any previous writes to the page table memory to finish.
   sfence_vma();
 
-  w_satp(MAKE_SATP(kernel_pagetable));
+  w_satp(MAKE_SATP(kernel_pagetable, 0));
 
   // flush stale entries from the TLB.
   sfence_vma();
 }
 
+// fork() shares a child's level-0 page-table pages with its parent
+// rather than copying them, counting the sharers in the page-table
+// page's refcount. A shared page-table page is never written to; a
+// process that needs to change one of its PTEs gets its own copy
+// first. Its mapped pages have one reference for all the sharers,
+// which is dropped when the last one lets go of it.
+
+// Is the level-1 PTE pte a pointer to a shared level-0 page-table page?
+static int
+ptshared(pte_t *pte)
+{
+  if((*pte & PTE_V) == 0 || (*pte & (PTE_R|PTE_W|PTE_X)) != 0)
+    return 0;
+  return pa2page(PTE2PA(*pte))->refcount > 1;
+}
+
+// Drop a reference to a level-0 page-table page. The last reference
+// frees it, along with its references to the pages it maps.
+static void
+ptrelease(pagetable_t pt)
+{
+  if(__sync_sub_and_fetch(&pa2page((uint64)pt)->refcount, 1) > 0)
+    return;
+  for(int i = 0; i < 512; i++){
+    if(pt[i] & PTE_V)
+      kfree((void*)PTE2PA(pt[i]));
+    else if(PTE_SWAPPED(pt[i]))
+      swapfree(PTE2SWAP(pt[i]));
+  }
+  // kfree() expects to drop the last reference itself.
+  pa2page((uint64)pt)->refcount = 1;
+  kfree((void*)pt);
+}
+
+// Give the shared level-0 page-table page that the level-1 PTE pte
+// points to a private copy. The copy takes its own reference to each
+// page it maps, and swap slot it refers to, before the shared page is
+// released, so no page is freed while either of them still maps it.
+// Returns the copy, or 0 if out of memory.
+static pagetable_t
+ptunshare(pte_t *pte)
+{
+  pagetable_t old = (pagetable_t)PTE2PA(*pte);
+  pagetable_t new = (pagetable_t)kalloc();
+
+  if(new == 0)
+    return 0;
+  memmove(new, old, PGSIZE);
+  for(int i = 0; i < 512; i++){
+    if(new[i] & PTE_V)
+      kincrementrefcount((void*)PTE2PA(new[i]));
+    else if(PTE_SWAPPED(new[i]))
+      swapdup(PTE2SWAP(new[i]));
+  }
+  // the PTEs are unchanged, so the TLB can keep them.
+  *pte = PA2PTE(new) | PTE_V;
+  ptrelease(old);
+  return new;
+}
+
+// Like walk() below, but stop at the PTE for va in the page-table
+// page at the given level.
+static pte_t *
+walklevel(pagetable_t pagetable, uint64 va, int alloc, int target)
+{
+  if(va >= MAXVA)
+    panic("walk");
+
+  for(int level = 2; level > target; level--) {
+    pte_t *pte = &pagetable[PX(level, va)];
+    if(*pte & PTE_V) {
+      if(*pte & (PTE_R|PTE_W|PTE_X))
+        return pte; // a megapage leaf
+      // a caller that may add a PTE mustn't add it to a shared page.
+      if(level == 1 && alloc && ptshared(pte)){
+        if((pagetable = ptunshare(pte)) == 0)
+          return 0;
+        continue;
+      }
+      pagetable = (pagetable_t)PTE2PA(*pte);
+    } else {
+      if(!alloc || (pagetable = (pde_t*)kalloc_zeroed()) == 0)
+        return 0;
+      *pte = PA2PTE(pagetable) | PTE_V;
+    }
+  }
+  return &pagetable[PX(target, va)];
+}
+
 // Return the address of the PTE in page table pagetable
 // that corresponds to virtual address va.  If alloc!=0,
 // create any required page-table pages.
@@ -97,24 +202,71 @@ kvminithart()
 //   21..29 -- 9 bits of level-1 index.
 //   12..20 -- 9 bits of level-0 index.
 //    0..11 -- 12 bits of byte offset within the page.
+//
+// If va lies in a megapage, return the level-1 leaf PTE.
 pte_t *
 walk(pagetable_t pagetable, uint64 va, int alloc)
 {
-  if(va >= MAXVA)
-    panic("walk");
+  return walklevel(pagetable, va, alloc, 0);
+}
 
-  for(int level = 2; level > 0; level--) {
-    pte_t *pte = &pagetable[PX(level, va)];
-    if(*pte & PTE_V) {
-      pagetable = (pagetable_t)PTE2PA(*pte);
-    } else {
-      if(!alloc || (pagetable = (pde_t*)kalloc()) == 0)
-        return 0;
-      memset(pagetable, 0, PGSIZE);
-      *pte = PA2PTE(pagetable) | PTE_V;
-    }
+// Make sure the level-0 page-table page holding va's PTE, if any,
+// isn't shared with another process, so that the PTE can be changed.
+// Returns 0 on success, or -1 if out of memory.
+int
+uvmunshare(pagetable_t pagetable, uint64 va)
+{
+  pte_t *pte = walklevel(pagetable, va, 0, 1);
+
+  if(pte && ptshared(pte) && ptunshare(pte) == 0)
+    return -1;
+  return 0;
+}
+
+// Return the level-1 PTE for va if it is a megapage leaf,
+// or 0 if va isn't mapped by a megapage.
+static pte_t *
+walkmega(pagetable_t pagetable, uint64 va)
+{
+  pte_t *pte = walklevel(pagetable, va, 0, 1);
+
+  if (pte == 0 || (*pte & PTE_V) == 0 || (*pte & (PTE_R | PTE_W | PTE_X)) == 0) {
+    return 0;
+  }
+
+  return pte;
+}
+
+// Split the user megapage containing va, if there is one, into 512 ordinary PTEs with the same
+// flags, so that its pages can be unmapped or copied on write one at a time. The megapage's pages
+// are already reference counted individually, so they don't change. Returns 0 on success or -1 if
+// out of memory.
+int
+uvmsplit(pagetable_t pagetable, uint64 va)
+{
+  pte_t *pte = walkmega(pagetable, va);
+
+  if (pte == 0) {
+    return 0;
+  }
+
+  pagetable_t l0 = kalloc_zeroed();
+
+  if (l0 == 0) {
+    return -1;
+  }
+
+  uint64 pa  = PTE2PA(*pte);
+  uint flags = PTE_FLAGS(*pte) & ~PTE_MEGA;
+
+  for (int i = 0; i < 512; i++) {
+    l0[i] = PA2PTE(pa + i * PGSIZE) | flags;
   }
-  return &pagetable[PX(0, va)];
+
+  *pte = PA2PTE(l0) | PTE_V;
+  asid_flush(pagetable);
+
+  return 0;
 }
 
 // Look up a virtual address, return the physical address,
@@ -137,6 +289,8 @@ walkaddr(pagetable_t pagetable, uint64 va)
   if((*pte & PTE_U) == 0)
     return 0;
   pa = PTE2PA(*pte);
+  if(*pte & PTE_MEGA)
+    pa += PGROUNDDOWN(va) & (MEGAPGSIZE - 1);
   return pa;
 }
 
@@ -150,6 +304,35 @@ kvmmap(pagetable_t kpgtbl, uint64 va, uint64 pa, uint64 sz, int perm)
     panic("kvmmap");
 }
 
+// Like kvmmap(), but use megapages for every part of the range
+// where va and pa are both megapage-aligned, which saves
+// page-table pages and TLB entries. Only for the kernel page
+// table: user memory must stay in 4096-byte pages.
+// does not flush TLB or enable paging.
+void
+kvmmapmega(pagetable_t kpgtbl, uint64 va, uint64 pa, uint64 sz, int perm)
+{
+  uint64 end = PGROUNDUP(va + sz);
+  pte_t *pte;
+
+  va = PGROUNDDOWN(va);
+  while(va < end){
+    if(va % MEGAPGSIZE == 0 && pa % MEGAPGSIZE == 0 && end - va >= MEGAPGSIZE){
+      if((pte = walklevel(kpgtbl, va, 1, 1)) == 0)
+        panic("kvmmapmega");
+      if(*pte & PTE_V)
+        panic("kvmmapmega: remap");
+      *pte = PA2PTE(pa) | perm | PTE_V;
+      va += MEGAPGSIZE;
+      pa += MEGAPGSIZE;
+    } else {
+      kvmmap(kpgtbl, va, pa, PGSIZE, perm);
+      va += PGSIZE;
+      pa += PGSIZE;
+    }
+  }
+}
+
 // Create PTEs for virtual addresses starting at va that refer to
 // physical addresses starting at pa. va and size might not
 // be page-aligned. Returns 0 on success, -1 if walk() couldn't
@@ -179,6 +362,293 @@ mappages(pagetable_t pagetable, uint64 va, uint64 size, uint64 pa, int perm)
   return 0;
 }
 
+// Map a fresh zeroed megapage over the 2MB-aligned region containing va, if all of that region is
+// below sz and none of it has been mapped yet. Returns 1 if a megapage was mapped, or 0 if not, in
+// which case the caller should fall back to an ordinary page.
+static int
+uvmlazymega(pagetable_t pagetable, uint64 va, uint64 sz)
+{
+  uint64 base = va & ~(MEGAPGSIZE - 1);
+
+  if (base + MEGAPGSIZE > sz) {
+    return 0;
+  }
+
+  pte_t *pte = walklevel(pagetable, base, 1, 1);
+
+  // a valid level-1 PTE means some of the region is already mapped with ordinary pages
+  if (pte == 0 || (*pte & PTE_V)) {
+    return 0;
+  }
+
+  void *mem = kalloc_pages(MEGAPGORDER);
+
+  if (mem == 0) {
+    return 0;
+  }
+
+  memset(mem, 0, MEGAPGSIZE);
+
+  *pte = PA2PTE(mem) | PTE_R | PTE_W | PTE_U | PTE_V | PTE_MEGA;
+  asid_flush(pagetable);
+
+  return 1;
+}
+
+// The part of uvmlazy() for the heap, called with m->ptlock held.
+static int
+uvmlazyheap(struct proc *p, struct mm *m, uint64 va, int write)
+{
+  if (va >= m->sz) {
+    return 0;
+  }
+
+  // a megapage mustn't cover any of the program image that hasn't been read in
+  uint64 base = va & ~(MEGAPGSIZE - 1);
+  int i       = vma_search(m, base);
+
+  if (p->hugeheap && (i == m->nvma || m->vmas[i]->vm_start >= base + MEGAPGSIZE) &&
+      uvmlazymega(m->pagetable, va, m->sz) > 0) {
+    return 1;
+  }
+
+  // anything already mapped below m->sz (such as the stack guard page, or a page another thread
+  // has just faulted in) isn't a lazy page
+  pte_t *pte = walk(m->pagetable, va, 0);
+
+  if (pte && (*pte & PTE_V)) {
+    return (*pte & PTE_U) ? 1 : 0;
+  }
+
+  // a page that is only read so far is the zero page, and walkcow() gives it a page of its own on
+  // the first write
+  if (!write) {
+    if (mappages(m->pagetable, va, PGSIZE, zeropage, PTE_R | PTE_U | PTE_COW) != 0) {
+      return -1;
+    }
+
+    kincrementrefcount((void *)zeropage);
+    asid_flush_va(m->pagetable, va);
+
+    return 1;
+  }
+
+  char *mem = kalloc_zeroed();
+
+  if (mem == 0) {
+    return -1;
+  }
+
+  if (mappages(m->pagetable, va, PGSIZE, (uint64)mem, PTE_R | PTE_W | PTE_U) != 0) {
+    kfree(mem);
+    return -1;
+  }
+
+  asid_flush_va(m->pagetable, va);
+
+  return 1;
+}
+
+// Read the page that was swapped out of va in m, whose PTE was pte, back in from swap and map it
+// again. The caller holds a reference to the page's slot, taken with swapdup(), which this drops.
+// Returns 1 if va is mapped afterwards, 0 if it has been unmapped in the meantime, or -1 if out of
+// memory.
+static int
+uvmswapin(struct mm *m, uint64 va, pte_t pte)
+{
+  char *mem;
+
+  while ((mem = kalloc()) == 0) {
+    if (swapout() == 0) {
+      swapfree(PTE2SWAP(pte));
+      return -1;
+    }
+  }
+
+  swapread(PTE2SWAP(pte), (uint64)mem);
+  swapfree(PTE2SWAP(pte));
+
+  acquire(&m->ptlock);
+
+  // another thread may have read the page in first, or unmapped it
+  pte_t *now = walk(m->pagetable, va, 0);
+  int r      = now && ((*now & PTE_V) || PTE_SWAPPED(*now)) ? 1 : 0;
+
+  if (now && *now == pte) {
+    if (uvmunshare(m->pagetable, va) == 0) {
+      now  = walk(m->pagetable, va, 0);
+      *now = PA2PTE(mem) | (PTE_FLAGS(pte) & ~PTE_SWAP) | PTE_V;
+      asid_flush_va(m->pagetable, va);
+      swapfree(PTE2SWAP(pte));
+      mem = 0;
+    } else {
+      r = -1;
+    }
+  }
+
+  release(&m->ptlock);
+
+  if (mem) {
+    kfree(mem);
+  }
+
+  return r;
+}
+
+// The body of uvmlazy().
+static int
+uvmfault(struct proc *p, struct mm *m, uint64 va, int write)
+{
+  acquire(&m->ptlock);
+
+  // a page that swapout() evicted is read back in, whatever kind of page it was
+  pte_t *pte = walk(m->pagetable, va, 0);
+
+  if (pte && PTE_SWAPPED(*pte)) {
+    pte_t swapped = *pte;
+
+    // reading it sleeps, which a copy under a spinlock can't; those callers prefault with
+    // uvmprefault() first, so this only refuses a page evicted since
+    if (holdingspin()) {
+      release(&m->ptlock);
+      return -1;
+    }
+
+    // the slot mustn't be freed and reused while it's read, should the page be unmapped meanwhile
+    swapdup(PTE2SWAP(swapped));
+    release(&m->ptlock);
+
+    return uvmswapin(m, va, swapped);
+  }
+
+  // pages of mmap()ed files, including the program's text and data, are read in from the file,
+  // which sleeps too
+  if (vma_find(m, va)) {
+    release(&m->ptlock);
+    return holdingspin() ? -1 : mmap_page_fault_handler(p, va);
+  }
+
+  int r = uvmlazyheap(p, m, va, write);
+
+  release(&m->ptlock);
+
+  return r;
+}
+
+// Map a fresh zeroed page at va if it's part of the current process's heap that sbrk() grew
+// without mapping, or read it back in if it was swapped out. Unless write is set, the heap page is
+// the shared zero page, mapped copy-on-write. Returns 1 if a page was mapped, 0 if va isn't such a
+// page, or -1 if out of memory even after evicting other pages to swap. Other threads may be
+// faulting in the same page, so it is looked up and mapped under ptlock.
+int
+uvmlazy(pagetable_t pagetable, uint64 va, int write)
+{
+  struct proc *p = myproc();
+
+  va = PGROUNDDOWN(va);
+
+  if (p == 0 || p->pagetable != pagetable) {
+    return 0;
+  }
+
+  int r;
+
+  while ((r = uvmfault(p, p->mm, va, write)) < 0 && !holdingspin() && swapout() > 0)
+    ;
+
+  return r;
+}
+
+// Fault in the page at va, for writing if write is set: map it if it's lazy or swapped out, and
+// copy it if it's copy-on-write.
+static void
+uvmfaultpage(pagetable_t pagetable, uint64 va, int write)
+{
+  if (write) {
+    pte_t *pte = uvmwalkcow(pagetable, va, 0);
+
+    if ((pte == 0 || (*pte & PTE_V) == 0) && uvmlazy(pagetable, va, 1) > 0) {
+      uvmwalkcow(pagetable, va, 0);
+    }
+  } else if (walkaddr(pagetable, va) == 0) {
+    uvmlazy(pagetable, va, 0);
+  }
+}
+
+// Fault in the current process's pages from va to va+len, for writing if write is set, so that a
+// copyin() or copyout() made while holding a spinlock or an inode's lock, under which pages can't
+// be read in from a file or swap, finds them mapped. Call it before taking the lock. Pages that
+// can't be faulted in are left for the copy to fail on.
+void
+uvmprefault(uint64 va, uint64 len, int write)
+{
+  pagetable_t pagetable = myproc()->pagetable;
+
+  for (uint64 a = PGROUNDDOWN(va); a < va + len && a < MAXVA; a += PGSIZE) {
+    uvmfaultpage(pagetable, a, write);
+  }
+}
+
+// Pin the user page at va for a copy by the kernel: take a reference to it under ptlock, so that
+// swapout() can't evict and free it mid-copy, and mark it accessed, and dirty if write is set,
+// since the kernel reaches it through the direct map, which doesn't set PTE_A or PTE_D. Returns
+// its physical address, to be passed to kfree() after the copy, or 0 if va isn't mapped for the
+// user, or isn't writable if write is set.
+static uint64
+uvmpin(pagetable_t pagetable, uint64 va, int write)
+{
+  struct proc *p = myproc();
+  struct mm *m   = (p && p->pagetable == pagetable) ? p->mm : 0;
+  uint64 pa      = 0;
+  pte_t *pte;
+
+  if (va >= MAXVA) {
+    return 0;
+  }
+
+  if (m) {
+    acquire(&m->ptlock);
+  }
+
+  pte = walk(pagetable, va, 0);
+
+  if (pte && (*pte & (PTE_V | PTE_U)) == (PTE_V | PTE_U) && (!write || (*pte & PTE_W))) {
+    pa = PTE2PA(*pte);
+
+    // a megapage's pages are reference counted one by one
+    if (*pte & PTE_MEGA) {
+      pa += va & (MEGAPGSIZE - 1);
+    }
+
+    kincrementrefcount((void *)pa);
+    __sync_fetch_and_or(pte, write ? PTE_A | PTE_D : PTE_A);
+  }
+
+  if (m) {
+    release(&m->ptlock);
+  }
+
+  return pa;
+}
+
+// Fault in and pin the user page at va, for writing if write is set. swapout() may evict the page
+// again between the fault and the pin, so this tries twice. Returns its physical address, or 0.
+static uint64
+uvmpinfault(pagetable_t pagetable, uint64 va, int write)
+{
+  uint64 pa;
+
+  for (int i = 0; (pa = uvmpin(pagetable, va, write)) == 0 && i < 2; i++) {
+    uvmfaultpage(pagetable, va, write);
+  }
+
+  return pa;
+}
+
+// uvmunmap() flushes ranges of up to this many pages from the TLB
+// one page at a time, and larger ones all at once.
+#define UVM_FLUSH_PAGES 8
+
 // Remove npages of mappings starting from va. va must be
 // page-aligned. The mappings must exist.
 // Optionally free the physical memory.
@@ -192,12 +662,47 @@ uvmunmap(pagetable_t pagetable, uint64 va, uint64 npages, int do_free)
     panic("uvmunmap: not aligned");
 
   for(a = va; a < va + npages*PGSIZE; a += PGSIZE){
-    if((pte = walk(pagetable, a, 0)) == 0)
-      panic("uvmunmap: walk");
-    if((*pte & PTE_V) == 0) {
-      printf("va=%p pte=%p\n", a, *pte);
-      panic("uvmunmap: not mapped");
+    // let go of a whole level-0 page-table page that fork() shared,
+    // or get a private copy if only part of it is being unmapped.
+    if((pte = walklevel(pagetable, a, 0, 1)) != 0 && ptshared(pte)){
+      if(do_free && a % MEGAPGSIZE == 0 && a + MEGAPGSIZE <= va + npages*PGSIZE){
+        ptrelease((pagetable_t)PTE2PA(*pte));
+        *pte = 0;
+        asid_flush(pagetable);
+        a += MEGAPGSIZE - PGSIZE;
+        continue;
+      }
+      if(ptunshare(pte) == 0)
+        panic("uvmunmap: unshare");
+    }
+
+    // unmap a whole megapage in one go, or split it first if
+    // only part of it is being unmapped.
+    if((pte = walkmega(pagetable, a)) != 0){
+      if(a % MEGAPGSIZE == 0 && a + MEGAPGSIZE <= va + npages*PGSIZE){
+        if(do_free){
+          for(int i = 0; i < 512; i++)
+            kfree((void*)(PTE2PA(*pte) + i*PGSIZE));
+        }
+        *pte = 0;
+        asid_flush(pagetable);
+        a += MEGAPGSIZE - PGSIZE;
+        continue;
+      }
+      if(uvmsplit(pagetable, a) != 0)
+        panic("uvmunmap: split");
     }
+
+    // sbrk() maps heap pages lazily, so there may be holes, and
+    // pages may have been swapped out.
+    if((pte = walk(pagetable, a, 0)) != 0 && PTE_SWAPPED(*pte)){
+      if(do_free)
+        swapfree(PTE2SWAP(*pte));
+      *pte = 0;
+      continue;
+    }
+    if(pte == 0 || (*pte & PTE_V) == 0)
+      continue;
     if(PTE_FLAGS(*pte) == PTE_V)
       panic("uvmunmap: not a leaf");
     if(do_free){
@@ -205,22 +710,36 @@ uvmunmap(pagetable_t pagetable, uint64 va, uint64 npages, int do_free)
       kfree((void*)pa);
     }
     *pte = 0;
+    if(npages <= UVM_FLUSH_PAGES)
+      asid_flush_va(pagetable, a);
   }
+  if(npages > UVM_FLUSH_PAGES)
+    asid_flush(pagetable);
 }
 
-// Return the address of the PTE in page table p that corresponds to the virtual address given. If
-// the PTE has the PTE_COW bit set, the page is copied and the PTE is remapped to a new physical
-// page.
-pte_t *
-uvmwalkcow(pagetable_t pagetable, uint64 va, int *cow_result)
+// The body of uvmwalkcow(), called with the address space's ptlock held if it has one.
+static pte_t *
+walkcow(pagetable_t pagetable, uint64 va, int *cow_result)
 {
   if ((va % PGSIZE) != 0) {
     panic("uvmwalkcow: va not page-aligned");
   }
 
+  // a copy-on-write megapage gets split, so that only the page being written to is copied
+  pte_t *mega = walkmega(pagetable, va);
+
+  if (mega && (*mega & PTE_COW) && uvmsplit(pagetable, va) != 0) {
+    if (cow_result) {
+      *cow_result = 1;
+    }
+
+    return 0;
+  }
+
   pte_t *pte = walk(pagetable, va, 0);
 
-  if (pte == 0) {
+  // a swapped-out page keeps its PTE_COW, but uvmlazy() has to read it back in first
+  if (pte == 0 || (*pte & PTE_V) == 0) {
     return pte;
   }
 
@@ -234,8 +753,24 @@ uvmwalkcow(pagetable_t pagetable, uint64 va, int *cow_result)
     *cow_result = 1;
   }
 
+  // the PTE is about to change, so it can't stay in a page-table page shared with another process
+  if (uvmunshare(pagetable, va) != 0) {
+    return 0;
+  }
+
+  pte = walk(pagetable, va, 0);
+
   uint64 old_pa = PTE2PA(*pte);
-  uint64 new_pa = (uint64)kcopyonwrite((const void *)old_pa);
+  uint64 new_pa;
+
+  // there's no need to copy the zero page, since kalloc_zeroed() often has one ready
+  if (old_pa == zeropage) {
+    if ((new_pa = (uint64)kalloc_zeroed()) != 0) {
+      kfree((void *)zeropage);
+    }
+  } else {
+    new_pa = (uint64)kcopyonwrite((const void *)old_pa);
+  }
 
   if (new_pa == 0) {
     return 0;
@@ -247,20 +782,143 @@ uvmwalkcow(pagetable_t pagetable, uint64 va, int *cow_result)
 
   // remap the PTE with a new physical address and writable flags
   *pte = PA2PTE(new_pa) | flags;
+  asid_flush_va(pagetable, va);
 
   return pte;
 }
 
-// create an empty user page table.
-// returns 0 if out of memory.
-pagetable_t
-uvmcreate()
+// Return the address of the PTE in page table p that corresponds to the virtual address given. If
+// the PTE has the PTE_COW bit set, the page is copied and the PTE is remapped to a new physical
+// page. If pagetable is the current process's, its other threads may be doing the same, so this
+// holds ptlock, and if there's no memory for the copy, it evicts other pages to swap and tries
+// again.
+pte_t *
+uvmwalkcow(pagetable_t pagetable, uint64 va, int *cow_result)
+{
+  struct proc *p = myproc();
+
+  if (p == 0 || p->pagetable != pagetable) {
+    return walkcow(pagetable, va, cow_result);
+  }
+
+  for (;;) {
+    int cow = 0;
+
+    acquire(&p->mm->ptlock);
+
+    pte_t *pte = walkcow(pagetable, va, &cow);
+
+    release(&p->mm->ptlock);
+
+    if (pte || !cow || holdingspin() || swapout() == 0) {
+      if (cow_result && cow) {
+        *cow_result = 1;
+      }
+
+      return pte;
+    }
+  }
+}
+
+// Lend the page at user address va of p to the kernel, for vmsplice(): make it copy-on-write, so
+// that p's next write to it gets a copy, and return its physical address with a reference added.
+// Returns 0 if va isn't a page of p's heap or stack that p could write to just now, in which case
+// the caller should copy the data instead.
+uint64
+uvmgift(struct proc *p, uint64 va)
+{
+  struct mm *m = p->mm;
+  uint64 pa    = 0;
+
+  if (va % PGSIZE != 0 || va + PGSIZE > m->sz) {
+    return 0;
+  }
+
+  acquire(&m->ptlock);
+
+  // a writable PTE is never in a shared page-table page, nor is its page shared
+  pte_t *pte = walkmega(m->pagetable, va) ? 0 : walk(m->pagetable, va, 0);
+
+  if (pte && (*pte & (PTE_V | PTE_U | PTE_W)) == (PTE_V | PTE_U | PTE_W)) {
+    pa   = PTE2PA(*pte);
+    *pte = (*pte & ~PTE_W) | PTE_COW;
+    kincrementrefcount((void *)pa);
+    asid_flush_va(m->pagetable, va);
+  }
+
+  release(&m->ptlock);
+
+  return pa;
+}
+
+// Lend page pa to p for reading, at user address va of its heap or stack: map it there
+// copy-on-write, in place of whatever page was there, with a reference added. Since the lender
+// keeps its own reference, a write by p always gets a copy, and the page never changes under the
+// lender. Returns 0, or -1 if va isn't a page below p's sz or out of memory.
+int
+uvmlend(struct proc *p, uint64 va, uint64 pa)
+{
+  struct mm *m = p->mm;
+  int r        = -1;
+
+  if (va % PGSIZE != 0 || va + PGSIZE > m->sz) {
+    return -1;
+  }
+
+  acquire(&m->ptlock);
+
+  if (uvmunshare(m->pagetable, va) == 0 && uvmsplit(m->pagetable, va) == 0) {
+    uvmunmap(m->pagetable, va, 1, 1);
+
+    if (mappages(m->pagetable, va, PGSIZE, pa, PTE_R | PTE_U | PTE_COW) == 0) {
+      kincrementrefcount((void *)pa);
+      r = 0;
+    }
+  }
+
+  release(&m->ptlock);
+
+  return r;
+}
+
+// End p's loan of page pa at user address va, unmapping it if p still maps it there. Afterwards
+// the heap page at va is faulted in afresh. Returns 0, or -1 if out of memory.
+int
+uvmunlend(struct proc *p, uint64 va, uint64 pa)
+{
+  struct mm *m = p->mm;
+  int r        = 0;
+
+  if (va % PGSIZE != 0 || va >= MAXVA) {
+    return 0;
+  }
+
+  acquire(&m->ptlock);
+
+  pte_t *pte = walkmega(m->pagetable, va) ? 0 : walk(m->pagetable, va, 0);
+
+  if (pte && (*pte & PTE_V) && PTE2PA(*pte) == pa) {
+    if (uvmunshare(m->pagetable, va) == 0) {
+      uvmunmap(m->pagetable, va, 1, 1);
+    } else {
+      r = -1;
+    }
+  }
+
+  release(&m->ptlock);
+
+  return r;
+}
+
+// create an empty user page table.
+// returns 0 if out of memory.
+pagetable_t
+uvmcreate()
 {
   pagetable_t pagetable;
-  pagetable = (pagetable_t) kalloc();
+  pagetable = (pagetable_t) kalloc_zeroed();
   if(pagetable == 0)
     return 0;
-  memset(pagetable, 0, PGSIZE);
   return pagetable;
 }
 
@@ -274,8 +932,7 @@ uvmfirst(pagetable_t pagetable, uchar *src, uint sz)
 
   if(sz >= PGSIZE)
     panic("uvmfirst: more than a page");
-  mem = kalloc();
-  memset(mem, 0, PGSIZE);
+  mem = kalloc_zeroed();
   mappages(pagetable, 0, PGSIZE, (uint64)mem, PTE_W|PTE_R|PTE_X|PTE_U);
   memmove(mem, src, sz);
 }
@@ -293,12 +950,12 @@ uvmalloc(pagetable_t pagetable, uint64 oldsz, uint64 newsz, int xperm)
 
   oldsz = PGROUNDUP(oldsz);
   for(a = oldsz; a < newsz; a += PGSIZE){
-    mem = kalloc();
+    while((mem = kalloc_zeroed()) == 0 && swapout() > 0)
+      ;
     if(mem == 0){
       uvmdealloc(pagetable, a, oldsz);
       return 0;
     }
-    memset(mem, 0, PGSIZE);
     if(mappages(pagetable, a, PGSIZE, (uint64)mem, PTE_R|PTE_U|xperm) != 0){
       kfree(mem);
       uvmdealloc(pagetable, a, oldsz);
@@ -337,6 +994,13 @@ freewalk(pagetable_t pagetable)
     if((pte & PTE_V) && (pte & (PTE_R|PTE_W|PTE_X)) == 0){
       // this PTE points to a lower-level page table.
       uint64 child = PTE2PA(pte);
+      if(pa2page(child)->refcount > 1){
+        // a level-0 page shared by fork(); its leaves belong to
+        // the other sharers now.
+        ptrelease((pagetable_t)child);
+        pagetable[i] = 0;
+        continue;
+      }
       freewalk((pagetable_t)child);
       pagetable[i] = 0;
     } else if(pte & PTE_V){
@@ -358,8 +1022,9 @@ uvmfree(pagetable_t pagetable, uint64 sz)
 
 // Given a parent process's page table, copy
 // its memory into a child's page table.
-// Copies both the page table and the
-// physical memory.
+// Shares the physical memory copy-on-write,
+// and each level-0 page-table page that lies
+// wholly below sz.
 // returns 0 on success, -1 on failure.
 // frees any allocated pages on failure.
 int
@@ -370,12 +1035,78 @@ uvmcopy(pagetable_t old, pagetable_t new, uint64 sz)
   for (i = 0; i < sz; i += PGSIZE) {
     pte_t *pte;
 
-    if ((pte = walk(old, i, 0)) == 0) {
-      panic("uvmcopy: pte should exist");
+    // share a whole level-0 page-table page, after making its writable pages copy-on-write, which
+    // saves copying its PTEs and taking a reference to each of its pages
+    if (i % MEGAPGSIZE == 0 && i + MEGAPGSIZE <= sz && (pte = walklevel(old, i, 0, 1)) != 0 &&
+        (*pte & PTE_V) && (*pte & (PTE_R | PTE_W | PTE_X)) == 0) {
+      pagetable_t l0 = (pagetable_t)PTE2PA(*pte);
+
+      // a page that's already shared is already read-only, and mustn't be written to anyway
+      for (int j = 0; j < 512; j++) {
+        if (l0[j] & PTE_W) {
+          l0[j] = (l0[j] & ~PTE_W) | PTE_COW;
+        }
+      }
+
+      pte_t *new_pte = walklevel(new, i, 1, 1);
+
+      if (new_pte == 0) {
+        goto err;
+      }
+
+      *new_pte = *pte;
+      kincrementrefcount(l0);
+
+      i += MEGAPGSIZE - PGSIZE;
+
+      continue;
     }
 
-    if ((*pte & PTE_V) == 0) {
-      panic("uvmcopy: page not present");
+    // share a whole megapage at once, copy-on-write like any other page
+    if ((pte = walkmega(old, i)) != 0) {
+      uint64 pa  = PTE2PA(*pte);
+      uint flags = PTE_FLAGS(*pte);
+
+      if (flags & PTE_W) {
+        flags &= ~PTE_W;
+        flags |= PTE_COW;
+        *pte   = PA2PTE(pa) | flags;
+      }
+
+      pte_t *new_pte = walklevel(new, i, 1, 1);
+
+      if (new_pte == 0) {
+        goto err;
+      }
+
+      *new_pte = PA2PTE(pa) | flags;
+
+      for (int j = 0; j < 512; j++) {
+        kincrementrefcount((void *)(pa + j * PGSIZE));
+      }
+
+      i += MEGAPGSIZE - PGSIZE;
+
+      continue;
+    }
+
+    // a swapped-out page stays in swap, with the child's PTE taking another reference to its slot
+    if ((pte = walk(old, i, 0)) != 0 && PTE_SWAPPED(*pte)) {
+      pte_t *new_pte = walk(new, i, 1);
+
+      if (new_pte == 0) {
+        goto err;
+      }
+
+      *new_pte = *pte;
+      swapdup(PTE2SWAP(*pte));
+
+      continue;
+    }
+
+    // skip heap pages that haven't been touched yet; the child will fault them in itself
+    if (pte == 0 || (*pte & PTE_V) == 0) {
+      continue;
     }
 
     uint64 pa  = PTE2PA(*pte);
@@ -402,6 +1133,9 @@ uvmcopy(pagetable_t old, pagetable_t new, uint64 sz)
     kincrementrefcount((void *)pa);
   }
 
+  // the parent's writable pages are now read-only
+  asid_flush(old);
+
   return 0;
 
  err:
@@ -429,24 +1163,12 @@ int
 copyout(pagetable_t pagetable, uint64 dstva, char *src, uint64 len)
 {
   uint64 n, va0, pa0;
-  pte_t *pte;
 
   while(len > 0){
     va0 = PGROUNDDOWN(dstva);
 
-    if (va0 >= MAXVA) {
-      return -1;
-    }
-
-    pte = uvmwalkcow(pagetable, va0, 0);
-
-    if (pte == 0 || (*pte & PTE_V) == 0 || (*pte & PTE_U) == 0) {
-      return -1;
-    }
-
-    pa0 = PTE2PA(*pte);
-
-    if ((*pte & PTE_W) == 0) {
+    // the page may be faulted in copy-on-write, if it's part of a private file mapping
+    if ((pa0 = uvmpinfault(pagetable, va0, 1)) == 0) {
       return -1;
     }
 
@@ -454,6 +1176,7 @@ copyout(pagetable_t pagetable, uint64 dstva, char *src, uint64 len)
     if(n > len)
       n = len;
     memmove((void *)(pa0 + (dstva - va0)), src, n);
+    kfree((void *)pa0);
 
     len -= n;
     src += n;
@@ -472,13 +1195,13 @@ copyin(pagetable_t pagetable, char *dst, uint64 srcva, uint64 len)
 
   while(len > 0){
     va0 = PGROUNDDOWN(srcva);
-    pa0 = walkaddr(pagetable, va0);
-    if(pa0 == 0)
+    if((pa0 = uvmpinfault(pagetable, va0, 0)) == 0)
       return -1;
     n = PGSIZE - (srcva - va0);
     if(n > len)
       n = len;
     memmove(dst, (void *)(pa0 + (srcva - va0)), n);
+    kfree((void *)pa0);
 
     len -= n;
     dst += n;
@@ -499,26 +1222,23 @@ copyinstr(pagetable_t pagetable, char *dst, uint64 srcva, uint64 max)
 
   while(got_null == 0 && max > 0){
     va0 = PGROUNDDOWN(srcva);
-    pa0 = walkaddr(pagetable, va0);
-    if(pa0 == 0)
+    if((pa0 = uvmpinfault(pagetable, va0, 0)) == 0)
       return -1;
     n = PGSIZE - (srcva - va0);
     if(n > max)
       n = max;
 
+    // find the end of the string within this page, then copy
+    // up to it in bulk.
     char *p = (char *) (pa0 + (srcva - va0));
-    while(n > 0){
-      if(*p == '\0'){
-        *dst = '\0';
-        got_null = 1;
-        break;
-      } else {
-        *dst = *p;
-      }
-      --n;
-      --max;
-      p++;
-      dst++;
+    uint64 len = strnlen(p, n);
+    memmove(dst, p, len);
+    kfree((void *)pa0);
+    dst += len;
+    max -= len;
+    if(len < n){
+      *dst = '\0';
+      got_null = 1;
     }
 
     srcva = va0 + PGSIZE;
@@ -530,216 +1250,786 @@ copyinstr(pagetable_t pagetable, char *dst, uint64 srcva, uint64 max)
   }
 }
 
-struct vm_area *
-vma_alloc()
+// Allocate a vm_area from the slab cache. Returns 0 if out of memory.
+static struct vm_area *
+vma_alloc(void)
+{
+  return kmem_cache_alloc(&vma_cache);
+}
+
+// Return the index of the first of m's VMAs that ends after addr, or m->nvma if there is none.
+// The caller must hold m->lock or m->ptlock.
+static int
+vma_search(struct mm *m, uint64 addr)
 {
-  for (int i = 0; i < NELEM(vmas); i++) {
-    if (__sync_bool_compare_and_swap(&vmas[i].used, 0, 1)) {
-      return &vmas[i];
+  int lo = 0, hi = m->nvma;
+
+  while (lo < hi) {
+    int mid = (lo + hi) / 2;
+
+    if (m->vmas[mid]->vm_end <= addr) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
     }
   }
 
-  panic("vma_alloc: no free vmas\n");
+  return lo;
 }
 
-// Find a vm_area that contains the address within the linked list. If **prev is non-null, it will
-// keep track of the previous linked list node.
+// Find the vm_area of m that contains the address, or 0 if there is none. The caller must hold
+// m->lock or m->ptlock.
 struct vm_area *
-vma_find(struct vm_area *list, uint64 addr, struct vm_area **prev)
+vma_find(struct mm *m, uint64 addr)
 {
-  for (struct vm_area *vma = list; vma != 0; vma = vma->vm_next) {
-    if (addr >= vma->vm_start && addr < vma->vm_end) {
-      return vma;
-    }
+  int i = vma_search(m, addr);
 
-    if (prev) {
-      *prev = vma;
-    }
+  if (i < m->nvma && m->vmas[i]->vm_start <= addr) {
+    return m->vmas[i];
+  }
+
+  return 0;
+}
+
+// Move m's index to a block of pages twice the size, or to its first page. Returns 0 on success,
+// or -1 if out of memory.
+static int
+vma_grow(struct mm *m)
+{
+  int order = 0;
+
+  while (order < KMAXORDER && ((uint64)PGSIZE << order) / sizeof(struct vm_area *) <= m->vma_cap) {
+    order++;
+  }
+
+  if (((uint64)PGSIZE << order) / sizeof(struct vm_area *) <= m->vma_cap) {
+    return -1;
+  }
+
+  struct vm_area **vmas = kalloc_pages(order);
+
+  if (vmas == 0) {
+    return -1;
+  }
+
+  if (m->vmas) {
+    memmove(vmas, m->vmas, m->nvma * sizeof(struct vm_area *));
+    kfree_pages(m->vmas, m->vma_order);
+  }
+
+  m->vmas      = vmas;
+  m->vma_order = order;
+  m->vma_cap   = ((uint64)PGSIZE << order) / sizeof(struct vm_area *);
+
+  return 0;
+}
+
+// Insert vma into m's index, keeping it sorted, and growing it if it's full. Returns 0 on success,
+// or -1 if out of memory. If other processes may be using m, the caller must hold m->lock and
+// m->ptlock.
+static int
+vma_insert(struct mm *m, struct vm_area *vma)
+{
+  if (m->nvma == m->vma_cap && vma_grow(m) != 0) {
+    return -1;
   }
 
+  int i = vma_search(m, vma->vm_start);
+
+  memmove(&m->vmas[i + 1], &m->vmas[i], (m->nvma - i) * sizeof(struct vm_area *));
+
+  m->vmas[i] = vma;
+  m->nvma++;
+
   return 0;
 }
 
+// Remove the i'th of m's VMAs from its index, under the same locks as vma_insert().
+static void
+vma_remove(struct mm *m, int i)
+{
+  memmove(&m->vmas[i], &m->vmas[i + 1], (m->nvma - i - 1) * sizeof(struct vm_area *));
+
+  m->nvma--;
+}
+
+// The lowest address used by any of m's VMAs, which is as far as the heap can grow.
+uint64
+vma_lowest(struct mm *m)
+{
+  // the program image's mappings lie below the heap, and sort first
+  for (int i = 0; i < m->nvma; i++) {
+    if (!(m->vmas[i]->vm_flags & VMA_IMAGE)) {
+      return m->vmas[i]->vm_start;
+    }
+  }
+
+  return MMAPTOP;
+}
+
 // Map len bytes of the file fd in the process's address space.
 uint64
 mmap(struct proc *p, size_t len, int prot, int flags, int fd, off_t offset)
 {
-  // Ensure the proc is not trying to map a read-only file with writable permissions if it expects
-  // writes to be shared with the underlying file.
-  if (p->ofile[fd]->writable == 0 && (prot & PROT_WRITE) && (flags & MAP_SHARED)) {
+  // Offset must be page-aligned.
+  if (offset % PGSIZE != 0) {
     return ~0;
   }
 
-  // Ensure the proc is not trying to map a non-readable file as readable.
-  if (p->ofile[fd]->readable == 0 && (prot & PROT_READ)) {
+  if (len == 0) {
     return ~0;
   }
 
-  // Offset must be page-aligned.
-  if (offset % PGSIZE != 0) {
+  // The mapping keeps this reference to the file, since another thread may close fd meanwhile.
+  struct file *f = fget(p->fdt, fd);
+
+  if (f == 0) {
+    return ~0;
+  }
+
+  // Ensure the proc is not trying to map a read-only file with writable permissions if it expects
+  // writes to be shared with the underlying file. Ensure the proc is not trying to map a
+  // non-readable file as readable.
+  if ((f->writable == 0 && (prot & PROT_WRITE) && (flags & MAP_SHARED)) ||
+      (f->readable == 0 && (prot & PROT_READ))) {
+    fput(f);
     return ~0;
   }
 
   struct vm_area *vma = vma_alloc();
 
-  // Work backwards from the last VMA for this proc, or the top of the address space.
-  uint64 max_va = p->vma_list ? p->vma_list->vm_start : USYSCALL;
+  if (vma == 0) {
+    fput(f);
+    return ~0;
+  }
 
-  vma->vm_start = PGROUNDDOWN(max_va - len);
-  vma->vm_end   = vma->vm_start + len;
+  struct mm *m = p->mm;
 
-  vma->vm_prot        = prot;
-  vma->vm_flags       = flags;
-  vma->vm_file        = filedup(p->ofile[fd]);
-  vma->vm_file_offset = offset;
-  vma->vm_next        = p->vma_list;
+  acquiresleep(&m->lock);
 
-  p->vma_list = vma;
+  // Find the highest hole below the top of the address space that's big enough, working down from
+  // the highest VMA. Below the lowest VMA, the mapping must stay above the heap.
+  uint64 size = PGROUNDUP(len);
+  uint64 top  = MMAPTOP;
+
+  for (int i = m->nvma - 1; i >= 0; i--) {
+    if (top - PGROUNDUP(m->vmas[i]->vm_end) >= size) {
+      break;
+    }
+
+    top = m->vmas[i]->vm_start;
+  }
+
+  if (top < size || top - size < PGROUNDUP(m->sz)) {
+    releasesleep(&m->lock);
+    kmem_cache_free(&vma_cache, vma);
+    fput(f);
+    return ~0;
+  }
+
+  vma->vm_start = top - size;
+  vma->vm_end   = vma->vm_start + len;
+
+  vma->vm_prot         = prot;
+  vma->vm_flags        = flags;
+  vma->vm_file         = f;
+  vma->vm_file_offset  = offset;
+  vma->vm_fault_next   = 0;
+  vma->vm_fault_window = 1;
+  vma->vm_advice       = MADV_NORMAL;
+
+  acquire(&m->ptlock);
+  int r = vma_insert(m, vma);
+  release(&m->ptlock);
+  releasesleep(&m->lock);
+
+  if (r != 0) {
+    fileclose(vma->vm_file);
+    kmem_cache_free(&vma_cache, vma);
+    return ~0;
+  }
 
   return vma->vm_start;
 }
 
-// Copy the mmap'd vma_area structs from process *p to *np.
-void
-mmap_copy(struct proc *p, struct proc *np)
+// Copy the mmap'd vm_area structs of address space m to nm, which no process is using yet. The
+// caller must hold m->lock. Returns 0 on success, or -1 if out of memory, in which case nm may hold
+// some of the copies.
+int
+mmap_copy(struct mm *m, struct mm *nm)
 {
-  for (struct vm_area *vma = p->vma_list; vma; vma = vma->vm_next) {
+  for (int i = 0; i < m->nvma; i++) {
     struct vm_area *copy = vma_alloc();
 
-    *copy = *vma;
+    if (copy == 0) {
+      return -1;
+    }
+
+    *copy = *m->vmas[i];
 
-    copy->vm_next = np->vma_list;
-    np->vma_list  = copy;
+    if (vma_insert(nm, copy) != 0) {
+      kmem_cache_free(&vma_cache, copy);
+      return -1;
+    }
 
     filedup(copy->vm_file);
   }
+
+  return 0;
 }
 
-// "Free" a given vm_area struct by writing any changes to disk if it was mappped with MAP_SHARED,
-// and by unmapping the vm_area from the process. Returns the next vm_area struct in the list.
-struct vm_area *
-vma_free(struct proc *p, struct vm_area *prev, struct vm_area *vma)
+// vma_writeback() writes this many contiguous dirty pages per log transaction, which is as many as
+// fit in MAXOPBLOCKS alongside the inode block.
+#define MMAP_SYNC_PAGES ((MAXOPBLOCKS - 1) / (PGSIZE / BSIZE))
+
+// Return the physical address of the page mapped at va in m if it has been written to since it was
+// mapped or its dirty bit was cleared, or 0 if it is clean or unmapped. If clean is set, clear its
+// dirty bit, so that writes from here on, by any of m's threads, dirty it again.
+static uint64
+vma_dirty(struct mm *m, uint64 va, int clean)
 {
-  uint offset     = vma->vm_file_offset;
-  uint bytes_left = vma->vm_end - vma->vm_start;
+  uint64 pa = 0;
 
-  for (uint64 page = vma->vm_start; page < vma->vm_end; page += PGSIZE) {
-    pte_t *pte = walk(p->pagetable, page, 0);
+  acquire(&m->ptlock);
 
-    // if we haven't yet mapped the page, there's nothing to do here
-    if (pte == 0 || (PTE_FLAGS(*pte) & PTE_V) == 0) {
-      continue;
+  pte_t *pte = walk(m->pagetable, va, 0);
+
+  if (pte && (*pte & (PTE_V | PTE_D)) == (PTE_V | PTE_D)) {
+    pa = PTE2PA(*pte);
+
+    if (clean) {
+      // the hardware may be setting bits in this PTE at the same time
+      __sync_fetch_and_and(pte, ~PTE_D);
+      asid_flush_va(m->pagetable, va);
     }
+  }
+
+  release(&m->ptlock);
 
-    uint length = bytes_left > PGSIZE ? PGSIZE : bytes_left;
+  return pa;
+}
 
-    if ((vma->vm_flags & MAP_SHARED) && (PTE_FLAGS(*pte) & PTE_D)) {
-      begin_op();
-      ilock(vma->vm_file->ip);
+// If vma is a MAP_SHARED mapping, write the pages of it in [start, end) that have been written to
+// since they were mapped or last written back to its file, and clear their dirty bits. Runs of
+// contiguous dirty pages are batched, MMAP_SYNC_PAGES to a transaction. start and end must be
+// page-aligned. Bytes past the end of the file aren't written back. The caller must hold m->lock,
+// which keeps the pages mapped.
+static void
+vma_writeback(struct mm *m, struct vm_area *vma, uint64 start, uint64 end)
+{
+  if (!(vma->vm_flags & MAP_SHARED)) {
+    return;
+  }
 
-      writei(vma->vm_file->ip, 0, PTE2PA(*pte), offset, length);
+  struct inode *ip = vma->vm_file->ip;
+  uint64        a  = start;
 
-      iunlock(vma->vm_file->ip);
-      end_op();
+  while (a < end) {
+    // clean or unmapped pages need no I/O at all
+    if (vma_dirty(m, a, 0) == 0) {
+      a += PGSIZE;
+      continue;
     }
 
-    offset     += PGSIZE;
-    bytes_left -= length;
+    begin_op();
+    ilock(ip);
+
+    for (int n = 0; n < MMAP_SYNC_PAGES && a < end; n++, a += PGSIZE) {
+      uint64 pa = vma_dirty(m, a, 1);
+
+      if (pa == 0) {
+        break;
+      }
+
+      uint offset = vma->vm_file_offset + (a - vma->vm_start);
+      uint length = vma->vm_end - a > PGSIZE ? PGSIZE : vma->vm_end - a;
 
-    uvmunmap(p->pagetable, page, 1, 1);
+      if (offset < ip->size) {
+        writei(ip, 0, pa, offset, ip->size - offset < length ? ip->size - offset : length);
+      }
+    }
+
+    iunlock(ip);
+    end_op();
   }
+}
+
+// "Free" the i'th of m's VMAs by writing any changes to disk if it was mappped with MAP_SHARED, and
+// by unmapping it from the address space. The caller must hold m->lock, unless no process is using
+// m any more.
+static void
+vma_free(struct mm *m, int i)
+{
+  struct vm_area *vma = m->vmas[i];
+  uint64          end = PGROUNDUP(vma->vm_end);
+
+  vma_writeback(m, vma, vma->vm_start, end);
+
+  acquire(&m->ptlock);
+
+  // pages that were never faulted in are skipped
+  uvmunmap(m->pagetable, vma->vm_start, (end - vma->vm_start) / PGSIZE, 1);
+  vma_remove(m, i);
+
+  release(&m->ptlock);
 
   fileclose(vma->vm_file);
+  kmem_cache_free(&vma_cache, vma);
+}
 
-  struct vm_area *next = vma->vm_next;
+// Split m's i'th VMA at addr, which must lie strictly inside it, so that the part from addr onward
+// becomes a VMA of its own. The caller must hold m->lock. Returns 0 on success, or -1 if out of
+// memory.
+static int
+vma_split(struct mm *m, int i, uint64 addr)
+{
+  struct vm_area *vma = m->vmas[i];
+  struct vm_area *new = vma_alloc();
 
-  if (prev) {
-    prev->vm_next = next;
-  } else {
-    p->vma_list = next;
+  if (new == 0) {
+    return -1;
+  }
+
+  *new = *vma;
+
+  new->vm_start       = addr;
+  new->vm_file_offset = vma->vm_file_offset + (addr - vma->vm_start);
+
+  acquire(&m->ptlock);
+
+  vma->vm_end = addr;
+
+  int r = vma_insert(m, new);
+
+  if (r != 0) {
+    vma->vm_end = new->vm_end;
+  }
+
+  release(&m->ptlock);
+
+  if (r != 0) {
+    kmem_cache_free(&vma_cache, new);
+    return -1;
   }
 
-  // "Free" the vm_area
-  *vma = (const struct vm_area){0};
+  filedup(new->vm_file);
 
-  return next;
+  return 0;
+}
+
+// Unmap any vm_area structs of m in the range specified by [addr, addr + len]. The caller must hold
+// m->lock.
+static int
+vma_unmap(struct mm *m, uint64 addr, size_t len)
+{
+  uint64 unmap_start = PGROUNDDOWN((uint64)addr);
+  uint64 unmap_end   = PGROUNDUP(unmap_start + len);
+
+  int i = vma_search(m, unmap_start);
+
+  // "If there are no mappings in the specified address range, then munmap() has no effect."
+  while (i < m->nvma && m->vmas[i]->vm_start < unmap_end) {
+    struct vm_area *vma = m->vmas[i];
+
+    // We may have unmap_start > vma->vm_start, which means we need to split the vma into:
+    //
+    //   - vma [start, unmap_start]
+    //   - new [unmap_start, end]
+    //
+    // and carry on with the new one.
+    if (unmap_start > vma->vm_start) {
+      if (vma_split(m, i, unmap_start) != 0) {
+        return -1;
+      }
+
+      i++;
+      continue;
+    }
+
+    // We may have unmap_end < end, which means we need to split the vma (potentially for the second
+    // time) into:
+    //
+    //   - vma [start, unmap_end]
+    //   - new [unmap_end, end]
+    if (unmap_end < vma->vm_end && vma_split(m, i, unmap_end) != 0) {
+      return -1;
+    }
+
+    vma_free(m, i);
+  }
+
+  return 0;
 }
 
 // Unmap any vm_area structs in the range specified by [addr, addr + len].
 int
 munmap(struct proc *p, uint64 addr, size_t len)
 {
-  uint64 unmap_start = PGROUNDDOWN((uint64)addr);
-  uint64 unmap_end   = PGROUNDUP(unmap_start + len);
+  acquiresleep(&p->mm->lock);
+
+  int r = vma_unmap(p->mm, addr, len);
+
+  releasesleep(&p->mm->lock);
+
+  return r;
+}
+
+// Write the dirty pages of MAP_SHARED mappings in [addr, addr + len) back to their files. Every
+// write is synchronous, so MS_ASYNC behaves like MS_SYNC, and the page cache keeps mappings coherent
+// with the file, so MS_INVALIDATE has nothing to do. Returns 0, or -1 if addr isn't page-aligned,
+// flags are invalid, or part of the range isn't mapped.
+int
+msync(struct proc *p, uint64 addr, size_t len, int flags)
+{
+  if ((addr % PGSIZE) != 0 || (flags & ~(MS_ASYNC | MS_SYNC | MS_INVALIDATE)) != 0 ||
+      ((flags & MS_ASYNC) && (flags & MS_SYNC))) {
+    return -1;
+  }
+
+  struct mm *m      = p->mm;
+  uint64     end    = PGROUNDUP(addr + len);
+  uint64     a      = addr;
+  int        result = 0;
+
+  acquiresleep(&m->lock);
+
+  for (int i = vma_search(m, addr); i < m->nvma && m->vmas[i]->vm_start < end; i++) {
+    struct vm_area *vma = m->vmas[i];
+
+    if (vma->vm_start > a) {
+      result = -1;
+    }
+
+    uint64 from = a > vma->vm_start ? a : vma->vm_start;
+    uint64 to   = end < PGROUNDUP(vma->vm_end) ? end : PGROUNDUP(vma->vm_end);
+
+    vma_writeback(m, vma, from, to);
 
-  struct vm_area *prev = 0;
-  struct vm_area *vma  = vma_find(p->vma_list, unmap_start, &prev);
+    a = to;
+  }
+
+  releasesleep(&m->lock);
+
+  return a < end ? -1 : result;
+}
+
+// Make a private mapping of len bytes of f, starting at the page-aligned offset, at va, for one
+// segment of the program that exec() is loading. The mapping belongs to no address space until
+// mmap_exec() installs it. Returns 0 if out of memory.
+struct vm_area *
+mmap_image(struct file *f, uint64 va, uint64 len, uint offset, int prot)
+{
+  struct vm_area *vma = vma_alloc();
 
   if (vma == 0) {
-    // "If there are no mappings in the specified address range, then munmap() has no effect.""
     return 0;
   }
 
-  // We may have unmap_start > vma_start->vm_start, which means we need to split the vma into:
-  //
-  //   - vma [start, unmap_start]
-  //   - new [unmap_start, end]
-  if (unmap_start > vma->vm_start) {
-    struct vm_area *new = vma_alloc();
+  vma->vm_start        = va;
+  vma->vm_end          = va + len;
+  vma->vm_prot         = prot;
+  vma->vm_flags        = MAP_PRIVATE | VMA_IMAGE;
+  vma->vm_file         = filedup(f);
+  vma->vm_file_offset  = offset;
+  vma->vm_fault_next   = 0;
+  vma->vm_fault_window = 1;
+  vma->vm_advice       = MADV_NORMAL;
+
+  return vma;
+}
 
-    new->vm_start       = unmap_start;
-    new->vm_end         = vma->vm_end;
-    new->vm_prot        = vma->vm_prot;
-    new->vm_flags       = vma->vm_flags;
-    new->vm_next        = vma->vm_next;
-    new->vm_file        = filedup(vma->vm_file);
-    new->vm_file_offset = vma->vm_file_offset + (unmap_start - vma->vm_start);
+// Free n mappings made by mmap_image() that were never installed, because exec() failed.
+void
+mmap_image_free(struct vm_area **image, int n)
+{
+  for (int i = 0; i < n; i++) {
+    fileclose(image[i]->vm_file);
+    kmem_cache_free(&vma_cache, image[i]);
+  }
+}
 
-    vma->vm_end  = unmap_start;
-    vma->vm_next = new;
+// Install the n mappings of a new program image, made by mmap_image() in ascending order of
+// address, in m, the empty address space exec() is building for it. Returns 0, or -1 if out of
+// memory, in which case nothing has changed.
+int
+mmap_exec(struct mm *m, struct vm_area **image, int n)
+{
+  if (n > m->vma_cap && vma_grow(m) != 0) {
+    return -1;
+  }
 
-    prev = vma;
-    vma  = new;
+  for (int i = 0; i < n; i++) {
+    m->vmas[i] = image[i];
   }
 
-  do {
-    // We may have unmap_end < end, which means we need to split the vma (potentially for the second
-    // time) into:
-    //
-    //   - vma [start, unmap_end]
-    //   - new [unmap_end, end]
-    if (unmap_end < vma->vm_end) {
-      struct vm_area *new = vma_alloc();
+  m->nvma = n;
+
+  return 0;
+}
+
+// Take advice on how [addr, addr + len) will be used. MADV_NORMAL, MADV_RANDOM and MADV_SEQUENTIAL
+// are kept in the mappings in the range, splitting them if needed, and set how much page faults map
+// at once. MADV_WILLNEED reads in and maps every page of the file mappings in the range now, since
+// there's no kernel thread to do it in the background. MADV_DONTNEED writes back dirty pages of
+// MAP_SHARED mappings, then unmaps and frees every page in the range, so that file pages are read
+// in again and heap pages come back zeroed the next time they're touched. MADV_GUARD turns heap
+// pages into guard pages like the one below the stack, which fault instead of being filled in, for
+// thread stacks carved out of the heap. Returns 0, or -1 if addr isn't page-aligned, advice is
+// unknown, part of the range is neither mapped nor heap, a guard page was asked for outside the
+// heap, or out of memory.
+int
+madvise(struct proc *p, uint64 addr, size_t len, int advice)
+{
+  if ((addr % PGSIZE) != 0 || advice < MADV_NORMAL || advice > MADV_GUARD) {
+    return -1;
+  }
+
+  acquiresleep(&p->mm->lock);
+
+  int r = vma_advise(p->mm, addr, len, advice);
+
+  releasesleep(&p->mm->lock);
+
+  return r;
+}
+
+// Make the heap page at va a guard page: mapped, so that uvmlazy() won't fill it in, but without
+// PTE_U, so that user accesses fault and copyin()/copyout() refuse it. Called with m->ptlock held.
+static int
+vma_guard(struct mm *m, uint64 va)
+{
+  if (uvmsplit(m->pagetable, va) != 0) {
+    return -1;
+  }
 
-      new->vm_start       = unmap_end;
-      new->vm_end         = vma->vm_end;
-      new->vm_prot        = vma->vm_prot;
-      new->vm_flags       = vma->vm_flags;
-      new->vm_next        = vma->vm_next;
-      new->vm_file        = filedup(vma->vm_file);
-      new->vm_file_offset = vma->vm_file_offset + (unmap_end - vma->vm_start);
+  pte_t *pte = walk(m->pagetable, va, 0);
 
-      vma->vm_end  = unmap_end;
-      vma->vm_next = new;
+  if (pte && (*pte & PTE_V)) {
+    if ((*pte & PTE_U) == 0) {
+      return 0;
+    }
+
+    uvmunmap(m->pagetable, va, 1, 1);
+  } else if (pte && PTE_SWAPPED(*pte)) {
+    uvmunmap(m->pagetable, va, 1, 1);
+  }
+
+  char *mem = kalloc_zeroed();
+
+  if (mem == 0) {
+    return -1;
+  }
+
+  if (mappages(m->pagetable, va, PGSIZE, (uint64)mem, PTE_R | PTE_W) != 0) {
+    kfree(mem);
+    return -1;
+  }
+
+  asid_flush_va(m->pagetable, va);
+
+  return 0;
+}
+
+// The body of madvise(), for m, whose lock the caller holds.
+static int
+vma_advise(struct mm *m, uint64 addr, size_t len, int advice)
+{
+  uint64 end = PGROUNDUP(addr + len);
+  int i      = vma_search(m, addr);
+
+  // the parts of the range in the heap, below the program's mappings, can only be let go of
+  for (uint64 a = addr; a < end; a = PGROUNDUP(m->vmas[i]->vm_end), i++) {
+    uint64 next = i < m->nvma && m->vmas[i]->vm_start < end ? m->vmas[i]->vm_start : end;
+
+    if (a < next) {
+      if (next > m->sz) {
+        return -1;
+      }
+
+      acquire(&m->ptlock);
+
+      for (; advice == MADV_DONTNEED && a < next; a += PGSIZE) {
+        pte_t *pte = walk(m->pagetable, a, 0);
+
+        // the stack guard page stays mapped, so that it still guards
+        if (pte && (((*pte & PTE_V) && (*pte & PTE_U)) || PTE_SWAPPED(*pte))) {
+          uvmunmap(m->pagetable, a, 1, 1);
+        }
+      }
+
+      for (; advice == MADV_GUARD && a < next; a += PGSIZE) {
+        if (vma_guard(m, a) != 0) {
+          release(&m->ptlock);
+          return -1;
+        }
+      }
+
+      release(&m->ptlock);
+    }
+
+    if (next == end) {
+      break;
+    }
+
+    // only the heap can have guard pages
+    if (advice == MADV_GUARD) {
+      return -1;
+    }
+
+    if (advice <= MADV_SEQUENTIAL) {
+      // split off the parts of the mapping outside the range, so that the advice covers only it
+      if (m->vmas[i]->vm_start < addr) {
+        if (vma_split(m, i, addr) != 0) {
+          return -1;
+        }
+
+        i++;
+      }
+
+      if (end < m->vmas[i]->vm_end && vma_split(m, i, end) != 0) {
+        return -1;
+      }
+
+      m->vmas[i]->vm_advice = advice;
+      continue;
+    }
+
+    struct vm_area *vma = m->vmas[i];
+    uint64 from         = addr > vma->vm_start ? addr : vma->vm_start;
+    uint64 to           = end < PGROUNDUP(vma->vm_end) ? end : PGROUNDUP(vma->vm_end);
+
+    if (advice == MADV_WILLNEED) {
+      if (vma_fill(m, vma, from, to) != 0) {
+        return -1;
+      }
+
+      continue;
     }
 
-    vma = vma_free(p, prev, vma);
-  } while (vma && (unmap_end > vma->vm_start));
+    vma_writeback(m, vma, from, to);
+
+    acquire(&m->ptlock);
+    uvmunmap(m->pagetable, from, (to - from) / PGSIZE, 1);
+    release(&m->ptlock);
+  }
 
   return 0;
 }
 
-// Unmap all vm_area structs for the process *p.
+// Unmap all vm_area structs of m, and free its VMA index. No process may be using m any more.
 int
-munmap_all(struct proc *p)
+munmap_all(struct mm *m)
 {
-  for (struct vm_area *vma = p->vma_list; vma; vma = vma_free(p, 0, vma)) {}
+  while (m->nvma > 0) {
+    vma_free(m, m->nvma - 1);
+  }
+
+  if (m->vmas) {
+    kfree_pages(m->vmas, m->vma_order);
+  }
+
+  m->vmas    = 0;
+  m->vma_cap = 0;
 
   return 0;
 }
 
-// If the address va is within the process's mmap'd address space, allocates a physical page and
-// copies the file contents for the vm_area struct that va intersects.
+// Whether vma, which may be a copy made without m->lock, still maps the same page of the same file
+// at va as the VMA of m that covers va now. Must be called with m->ptlock held.
+static int
+vma_current(struct mm *m, struct vm_area *vma, uint64 va)
+{
+  struct vm_area *now = vma_find(m, va);
+
+  return now && now->vm_file == vma->vm_file && now->vm_prot == vma->vm_prot &&
+         now->vm_flags == vma->vm_flags &&
+         now->vm_file_offset + (va - now->vm_start) == vma->vm_file_offset + (va - vma->vm_start);
+}
+
+// Map the pages of vma in [va, end) that aren't mapped yet, reading them from the file through the
+// page cache, all under one ilock. va and end must be page-aligned. vma may be a copy of one of m's
+// VMAs, in which case pages that another thread has unmapped in the meantime are skipped. Returns
+// 0, or -1 if out of memory before they were all mapped.
+static int
+vma_fill(struct mm *m, struct vm_area *vma, uint64 va, uint64 end)
+{
+  int perm = ((vma->vm_prot & PROT_READ) ? PTE_R : 0) | ((vma->vm_prot & PROT_WRITE) ? PTE_W : 0) |
+             ((vma->vm_prot & PROT_EXEC) ? PTE_X : 0) | PTE_U;
+
+  // a private mapping shares the cached page until it writes to it
+  if ((vma->vm_flags & MAP_PRIVATE) && (perm & PTE_W)) {
+    perm = (perm & ~PTE_W) | PTE_COW;
+  }
+
+  struct inode *ip = vma->vm_file->ip;
+  int result       = 0;
+
+  // read() and write() fault their buffers in before they lock the file, so a copy under ilock
+  // finds the pages mapped; one that was evicted again in between is refused, not waited for
+  if (holdingsleep(&ip->lock)) {
+    return -1;
+  }
+
+  ilock(ip);
+
+  for (uint64 a = va; a < end; a += PGSIZE) {
+    acquire(&m->ptlock);
+
+    // a private copy that has been swapped out is read back from swap, not the file
+    pte_t *pte = walk(m->pagetable, a, 0);
+    int mapped = pte && ((*pte & PTE_V) || PTE_SWAPPED(*pte));
+
+    release(&m->ptlock);
+
+    if (mapped) {
+      continue;
+    }
+
+    // every mapping of this page of the file shares the cache's physical page
+    uint64 pa = pagecache_get(ip, (vma->vm_file_offset + (a - vma->vm_start)) / PGSIZE);
+
+    if (pa == 0) {
+      result = -1;
+      break;
+    }
+
+    // another thread may have faulted the page in, or unmapped it, while it was being read
+    acquire(&m->ptlock);
+
+    if (!vma_current(m, vma, a) ||
+        ((pte = walk(m->pagetable, a, 0)) && ((*pte & PTE_V) || PTE_SWAPPED(*pte)))) {
+      release(&m->ptlock);
+      kfree((void *)pa);
+      continue;
+    }
+
+    if (mappages(m->pagetable, a, PGSIZE, pa, perm) < 0) {
+      release(&m->ptlock);
+      kfree((void *)pa);
+      result = -1;
+      break;
+    }
+
+    asid_flush_va(m->pagetable, a);
+    release(&m->ptlock);
+  }
+
+  iunlock(ip);
+
+  return result;
+}
+
+// If the address va is within the process's mmap'd address space, allocates physical pages and
+// copies in the file contents for va and up to a window of the pages after it in the same vm_area
+// that aren't mapped yet, so that scanning a mapping doesn't take a fault per page. The window
+// doubles, up to MMAP_FAULTAROUND pages, for as long as each fault lands just past the previous
+// window, and goes back to one page otherwise. madvise() can pin it at one page with MADV_RANDOM,
+// or at the most with MADV_SEQUENTIAL. Returns 1 if va was mapped, 0 if it isn't in a vm_area, or
+// -1 if out of memory.
+//
+// Faults don't take p->mm->lock, since another thread may hold it while waiting for an inode lock
+// that this one holds. The VMA is copied under ptlock instead, with a reference to its file, and
+// vma_fill() checks each page against the VMAs as they are by then.
 int
 mmap_page_fault_handler(struct proc *p, uint64 va)
 {
@@ -747,37 +2037,280 @@ mmap_page_fault_handler(struct proc *p, uint64 va)
     panic("mmap_page_fault_handler: va not page-aligned");
   }
 
-  struct vm_area *vma = vma_find(p->vma_list, va, 0);
+  struct mm *m = p->mm;
+
+  acquire(&m->ptlock);
+
+  struct vm_area *vma = vma_find(m, va);
 
   if (vma == 0) {
+    release(&m->ptlock);
     return 0;
   }
 
-  uint64 pa = (uint64)kalloc();
+  if (vma->vm_advice == MADV_RANDOM) {
+    vma->vm_fault_window = 1;
+  } else if (vma->vm_advice == MADV_SEQUENTIAL) {
+    vma->vm_fault_window = MMAP_FAULTAROUND;
+  } else if (va == vma->vm_fault_next && vma->vm_fault_window < MMAP_FAULTAROUND) {
+    vma->vm_fault_window *= 2;
+  } else if (va != vma->vm_fault_next) {
+    vma->vm_fault_window = 1;
+  }
+
+  uint64 end = va + (uint64)vma->vm_fault_window * PGSIZE;
 
-  if (pa == 0) {
-    panic("mmap_page_fault_handler: no free mem\n");
+  if (end > PGROUNDUP(vma->vm_end)) {
+    end = PGROUNDUP(vma->vm_end);
   }
 
-  memset((void *)pa, 0, PGSIZE);
+  vma->vm_fault_next = end;
 
-  uint offset = vma->vm_file_offset + (va - vma->vm_start);
-  uint length = vma->vm_end - offset > PGSIZE ? PGSIZE : vma->vm_end - offset;
+  struct vm_area copy = *vma;
 
-  ilock(vma->vm_file->ip);
-  readi(vma->vm_file->ip, 0, pa, offset, length);
-  iunlock(vma->vm_file->ip);
+  filedup(copy.vm_file);
+  release(&m->ptlock);
 
-  int perm = ((vma->vm_prot && PROT_READ) * PTE_R) | ((vma->vm_prot && PROT_WRITE) * PTE_W) |
-             ((vma->vm_prot && PROT_EXEC) * PTE_X) | PTE_U;
+  vma_fill(m, &copy, va, end);
+  fileclose(copy.vm_file);
 
-  if (mappages(p->pagetable, va, PGSIZE, pa, perm) < 0) {
-    return -1;
+  // the window is filled in order, so running out of memory may still have left va mapped
+  acquire(&m->ptlock);
+
+  pte_t *pte = walk(m->pagetable, va, 0);
+  int r      = pte && (*pte & PTE_V) ? 1 : -1;
+
+  release(&m->ptlock);
+
+  return r;
+}
+
+// Clear the accessed and dirty bits of the PTE mapping va that flags ask for, returning 1 if any were
+// set. The dirty bits of pages in MAP_SHARED file mappings are left alone, since writing them back
+// depends on them.
+static int
+wsclear(struct mm *m, pte_t *pte, uint64 va, int flags)
+{
+  pte_t clear = 0;
+
+  if (flags & WS_CLEAR_ACCESSED) {
+    clear |= *pte & PTE_A;
   }
 
+  if ((flags & WS_CLEAR_DIRTY) && (*pte & PTE_D)) {
+    struct vm_area *vma = vma_find(m, va);
+
+    if (vma == 0 || !(vma->vm_flags & MAP_SHARED)) {
+      clear |= PTE_D;
+    }
+  }
+
+  if (clear == 0) {
+    return 0;
+  }
+
+  // the hardware may be setting bits in this PTE at the same time
+  __sync_fetch_and_and(pte, ~clear);
+
   return 1;
 }
 
+// Set bit i of abits and dbits for each page i of the npages pages of p's address space starting at
+// the page-aligned va that has been accessed or written since its bits were last cleared, and clear
+// the bits that flags ask for. Both bitmaps must be zeroed. Unmapped level-2 and level-1 subtrees
+// are skipped whole, so the cost depends on how much of the range is mapped rather than on its
+// size. Returns 0, or -1 if out of memory.
+int
+uvmwsscan(struct proc *p, uint64 va, uint64 npages, uint64 *abits, uint64 *dbits, int flags)
+{
+  struct mm *m          = p->mm;
+  pagetable_t pagetable = m->pagetable;
+  uint64 end            = va + npages * PGSIZE;
+  int cleared           = 0;
+
+  acquire(&m->ptlock);
+
+  for (uint64 a = va; a < end && a < MAXVA;) {
+    uint64 giga = (a + (1L << 30)) & ~((1L << 30) - 1);
+    uint64 mega = (a + MEGAPGSIZE) & ~(MEGAPGSIZE - 1);
+
+    if ((pagetable[PX(2, a)] & PTE_V) == 0) {
+      a = giga;
+      continue;
+    }
+
+    pte_t *l1 = walklevel(pagetable, a, 0, 1);
+
+    if ((*l1 & PTE_V) == 0) {
+      a = mega;
+      continue;
+    }
+
+    // a megapage's bits stand for each of its pages
+    if (*l1 & (PTE_R | PTE_W | PTE_X)) {
+      pte_t bits = *l1;
+
+      cleared += wsclear(m, l1, a, flags);
+
+      for (; a < end && a < mega; a += PGSIZE) {
+        uint64 i = (a - va) / PGSIZE;
+
+        abits[i / 64] |= (uint64)((bits & PTE_A) != 0) << (i % 64);
+        dbits[i / 64] |= (uint64)((bits & PTE_D) != 0) << (i % 64);
+      }
+
+      continue;
+    }
+
+    // clearing bits mustn't touch a page-table page that fork() shares with another process
+    if (flags && ptshared(l1) && ptunshare(l1) == 0) {
+      if (cleared > 0) {
+        asid_flush(pagetable);
+      }
+      release(&m->ptlock);
+      return -1;
+    }
+
+    pagetable_t l0 = (pagetable_t)PTE2PA(*l1);
+
+    for (; a < end && a < mega; a += PGSIZE) {
+      pte_t *pte = &l0[PX(0, a)];
+      pte_t bits = *pte;
+      uint64 i   = (a - va) / PGSIZE;
+
+      if ((bits & PTE_V) == 0) {
+        continue;
+      }
+
+      abits[i / 64] |= (uint64)((bits & PTE_A) != 0) << (i % 64);
+      dbits[i / 64] |= (uint64)((bits & PTE_D) != 0) << (i % 64);
+
+      cleared += wsclear(m, pte, a, flags);
+    }
+  }
+
+  // the TLB may still hold PTEs with the bits set, in which case the hardware wouldn't set them again
+  if (cleared > 0) {
+    asid_flush(pagetable);
+  }
+
+  release(&m->ptlock);
+
+  return 0;
+}
+
+// uvmswapout() looks at no more than this many PTEs at a time, to bound how long it holds ptlock.
+#define SWAP_SCAN 1024
+
+// Pick pages of m for swapout() to evict, moving its CLOCK hand over m's page table from *va. A
+// page that has been used since the hand last passed it just has its accessed bit cleared, and one
+// that hasn't is unmapped. An anonymous page, or a private copy of a page of a file, gets a swap
+// slot, which its PTE records, and its physical address and slot go in pa[] and slot[], for the
+// caller to write out and then free. A clean page of a MAP_SHARED mapping is just unmapped, since
+// the page cache still has it, and counted in *dropped; dirty ones are left for msync() and
+// munmap() to write back. Pages that are shared, executable, in megapages, or in page-table pages
+// that fork() shares are left alone too. Stops after n pages, SWAP_SCAN PTEs, or at the end of the address
+// space, setting *va to where to carry on, which is 0 at the end. The caller holds p->lock for a
+// process p running in m, so that m stays put. Returns the number of pages put in pa[].
+int
+uvmswapout(struct mm *m, uint64 *va, uint64 *pa, uint *slot, int n, int *dropped)
+{
+  pagetable_t pagetable = m->pagetable;
+  uint64 a              = *va;
+  int found             = 0;
+  int changed           = 0;
+  int scanned           = 0;
+  int full              = 0;
+
+  acquire(&m->ptlock);
+
+  while (a < MAXVA && found + *dropped < n && scanned < SWAP_SCAN) {
+    uint64 giga = (a + (1L << 30)) & ~((1L << 30) - 1);
+    uint64 mega = (a + MEGAPGSIZE) & ~(MEGAPGSIZE - 1);
+
+    if ((pagetable[PX(2, a)] & PTE_V) == 0) {
+      a = giga;
+      continue;
+    }
+
+    pte_t *l1 = walklevel(pagetable, a, 0, 1);
+
+    if ((*l1 & PTE_V) == 0 || (*l1 & (PTE_R | PTE_W | PTE_X)) || ptshared(l1)) {
+      a = mega;
+      continue;
+    }
+
+    pagetable_t l0 = (pagetable_t)PTE2PA(*l1);
+
+    for (; a < mega && found + *dropped < n && scanned < SWAP_SCAN; a += PGSIZE, scanned++) {
+      pte_t *pte = &l0[PX(0, a)];
+      pte_t old  = *pte;
+
+      if ((old & (PTE_V | PTE_U)) != (PTE_V | PTE_U)) {
+        continue;
+      }
+
+      // the hardware may be setting bits in this PTE at the same time, hence the atomics
+      if (old & PTE_A) {
+        __sync_fetch_and_and(pte, ~PTE_A);
+        changed++;
+        continue;
+      }
+
+      uint64 p            = PTE2PA(old);
+      struct vm_area *vma = vma_find(m, a);
+
+      if (vma && (vma->vm_flags & MAP_SHARED)) {
+        if ((old & PTE_D) == 0 && __sync_bool_compare_and_swap(pte, old, 0)) {
+          kfree((void *)p);
+          (*dropped)++;
+          changed++;
+        }
+        continue;
+      }
+
+      struct page *pg = pa2page(p);
+
+      // text is small and in constant use, so it isn't worth a slot
+      if (full || (old & PTE_X) || pg->refcount != 1 || (pg->flags & PG_PINNED) ||
+          p == (uint64)m->usyscall) {
+        continue;
+      }
+
+      int s = swapalloc();
+
+      if (s < 0) {
+        full = 1;
+        continue;
+      }
+
+      pte_t swapped = SWAP2PTE(s) | (old & (PTE_R | PTE_W | PTE_U | PTE_COW)) | PTE_SWAP;
+
+      // a write that sets PTE_D first means the page is in use after all
+      if (!__sync_bool_compare_and_swap(pte, old, swapped)) {
+        swapcancel(s);
+        continue;
+      }
+
+      pa[found]   = p;
+      slot[found] = s;
+      found++;
+      changed++;
+    }
+  }
+
+  // no TLB may go on using the pages, nor keep the accessed bits set, once ptlock is released
+  if (changed > 0) {
+    asid_flush_mm(m);
+  }
+
+  release(&m->ptlock);
+
+  *va = a < MAXVA ? a : 0;
+
+  return found;
+}
+
 void
 vmprint_rec(pagetable_t pagetable, int indent)
 {
@@ -1,9 +1,40 @@
 #include "types.h"
 #include "defs.h"
 
+// vm_flags bit for the mappings exec() makes of a program's segments, which lie below p->sz rather
+// than above the heap.
+#define VMA_IMAGE 0x100
+
+// A user address space. The threads that clone() makes share their creator's. Changes to its
+// layout, by sbrk(), mmap() and the like, hold lock throughout; page faults, which can happen
+// wherever the kernel touches user memory, only hold ptlock while they change PTEs, so that they
+// don't need to sleep while holding it. Anything that changes PTEs or vmas holds ptlock.
+struct mm {
+  struct sleeplock lock;
+  struct spinlock  ptlock;
+
+  int users;  // Processes running in it; the last to exit() or exec() tears down its mappings
+  int ref;    // Processes holding it, until freeproc(); the last frees the page table
+
+  pagetable_t      pagetable;
+  uint64           sz;        // Size of the program and heap (bytes)
+  struct usyscall *usyscall;  // Read-only data page for userspace system calls
+
+  // The VMAs, sorted by vm_start, in a kalloc_pages() block of order vma_order with room for
+  // vma_cap of them.
+  struct vm_area **vmas;
+  int              nvma;
+  int              vma_cap;
+  int              vma_order;
+
+  uint   asid;      // Address space ID, see asid.c
+  uint64 asid_gen;  // Generation of asid; 0 if none
+  uint64 cpus;      // CPUs whose TLBs may hold entries for asid; see asid_activate()
+};
+
 struct vm_area {
-  // The starting address within the process's virtual memory address space. A value of 0 means
-  // this is not in use. Guaranteed to be page-aligned.
+  // The starting address within the process's virtual memory address space. Guaranteed to be
+  // page-aligned.
   uint64 vm_start;
 
   // The first byte after the end address within the virtual memory address space. May not be
@@ -13,19 +44,21 @@ struct vm_area {
   // Permissions, see fcntl.h.
   uint64 vm_prot;
 
-  // Flags, see fcntl.h
+  // Flags, see fcntl.h, and VMA_IMAGE below.
   uint64 vm_flags;
 
-  // List of VMAs for the process, sorted by vm_start.
-  struct vm_area *vm_next;
-
   // The file this VMA is mapping.
   struct file *vm_file;
 
   // The offset within the file, in multiples of PGSIZE.
   uint vm_file_offset;
 
-  // Since we're using a statically-allocated array of vm_area structs, this indicates if the
-  // struct is "in use".
-  uint used;
+  // Where the last page fault's fault-around window ended, and how many pages it covered. A fault
+  // at vm_fault_next means the mapping is being read sequentially. See mmap_page_fault_handler().
+  uint64 vm_fault_next;
+  uint vm_fault_window;
+
+  // The last madvise() advice about how the mapping will be used, one of MADV_NORMAL, MADV_RANDOM or
+  // MADV_SEQUENTIAL. See fcntl.h.
+  int vm_advice;
 };
@@ -18,28 +18,39 @@
 #define NINODES 200
 
 // Disk layout:
-// [ boot block | sb block | log | inode blocks | free bit map | data blocks ]
-
-int nbitmap = FSSIZE/(BSIZE*8) + 1;
-int ninodeblocks = NINODES / IPB + 1;
-int nlog = LOGSIZE;
+// [ boot block | sb block | log | inode blocks | free bit map | data blocks | swap ]
+//
+// The files go in the data blocks in the order they are named on
+// the command line, each in one run of blocks, after the root
+// directory's blocks, so that reading them in that order is
+// sequential.
+
+int fssize = FSSIZE;     // size of the file system in blocks
+int nswap = SWAPSIZE;    // blocks of swap space after it
+int ninodes = NINODES;
+int nbitmap;
+int ninodeblocks;
+int nlog = LOGSIZE + 1;  // header block and data blocks
+int extents = 1;         // files map their blocks with extents
+int dirindex = 1;        // directories that outgrow a block become indexed
 int nmeta;    // Number of meta blocks (boot, sb, nlog, inode, bitmap)
 int nblocks;  // Number of data blocks
 
 int fsfd;
 struct superblock sb;
-char zeroes[BSIZE];
 uint freeinode = 1;
 uint freeblock;
 
 
 void balloc(int);
+int optnum(char *, char *);
 void wsect(uint, void*);
 void winode(uint, struct dinode*);
 void rinode(uint inum, struct dinode *ip);
 void rsect(uint sec, void *buf);
 uint ialloc(ushort type);
 void iappend(uint inum, void *p, int n);
+uint emap(struct dinode *din, uint fbn);
 void die(const char *);
 
 // convert to riscv byte order
@@ -69,7 +80,7 @@ int
 main(int argc, char *argv[])
 {
   int i, cc, fd;
-  uint rootino, inum, off;
+  uint rootino, tmpino, inum, off, first;
   struct dirent de;
   char buf[BSIZE];
   struct dinode din;
@@ -77,8 +88,46 @@ main(int argc, char *argv[])
 
   static_assert(sizeof(int) == 4, "Integers must be 4 bytes!");
 
+  while(argc > 1 && argv[1][0] == '-'){
+    if(argc > 2 && strcmp(argv[1], "-l") == 0){
+      nlog = optnum(argv[1], argv[2]);
+      argc--;
+      argv++;
+    } else if(argc > 2 && strcmp(argv[1], "-s") == 0){
+      fssize = optnum(argv[1], argv[2]);
+      argc--;
+      argv++;
+    } else if(argc > 2 && strcmp(argv[1], "-w") == 0){
+      nswap = optnum(argv[1], argv[2]);
+      argc--;
+      argv++;
+    } else if(argc > 2 && strcmp(argv[1], "-i") == 0){
+      ninodes = optnum(argv[1], argv[2]);
+      argc--;
+      argv++;
+    } else if(strcmp(argv[1], "-b") == 0){
+      extents = 0;
+    } else if(strcmp(argv[1], "-d") == 0){
+      dirindex = 0;
+    } else {
+      break;
+    }
+    argc--;
+    argv++;
+  }
+
   if(argc < 2){
-    fprintf(stderr, "Usage: mkfs fs.img files...\n");
+    fprintf(stderr, "Usage: mkfs [-s size] [-w nswap] [-i ninodes] [-l nlog] [-b] [-d] fs.img files...\n");
+    exit(1);
+  }
+
+  if(nlog < MAXOPBLOCKS + 1 || nlog > LOGMAX + 1){
+    fprintf(stderr, "mkfs: nlog must be between %d and %d\n", MAXOPBLOCKS + 1, LOGMAX + 1);
+    exit(1);
+  }
+  // inode numbers must fit in a dirent.
+  if(ninodes <= argc || ninodes > 65536){
+    fprintf(stderr, "mkfs: ninodes must be between %d and 65536\n", argc + 1);
     exit(1);
   }
 
@@ -90,25 +139,35 @@ main(int argc, char *argv[])
     die(argv[1]);
 
   // 1 fs block = 1 disk sector
+  nbitmap = fssize/(BSIZE*8) + 1;
+  ninodeblocks = ninodes / IPB + 1;
   nmeta = 2 + nlog + ninodeblocks + nbitmap;
-  nblocks = FSSIZE - nmeta;
+  nblocks = fssize - nmeta;
+  if(nblocks < 2){
+    fprintf(stderr, "mkfs: size must be more than %d\n", nmeta + 1);
+    exit(1);
+  }
 
   sb.magic = FSMAGIC;
-  sb.size = xint(FSSIZE);
+  sb.size = xint(fssize);
   sb.nblocks = xint(nblocks);
-  sb.ninodes = xint(NINODES);
+  sb.ninodes = xint(ninodes);
   sb.nlog = xint(nlog);
   sb.logstart = xint(2);
   sb.inodestart = xint(2+nlog);
   sb.bmapstart = xint(2+nlog+ninodeblocks);
+  sb.flags = xint((extents ? FS_EXTENTS : 0) | (dirindex ? FS_DIRINDEX : 0));
+  sb.swapstart = xint(fssize);
+  sb.nswap = xint(nswap);
 
-  printf("nmeta %d (boot, super, log blocks %u inode blocks %u, bitmap blocks %u) blocks %d total %d\n",
-         nmeta, nlog, ninodeblocks, nbitmap, nblocks, FSSIZE);
+  printf("nmeta %d (boot, super, log blocks %u inode blocks %u, bitmap blocks %u) blocks %d total %d swap %d\n",
+         nmeta, nlog, ninodeblocks, nbitmap, nblocks, fssize, nswap);
 
   freeblock = nmeta;     // the first free block that we can allocate
 
-  for(i = 0; i < FSSIZE; i++)
-    wsect(i, zeroes);
+  // the image starts out all zeroes.
+  if(ftruncate(fsfd, 0) < 0 || ftruncate(fsfd, (off_t)(fssize + nswap) * BSIZE) < 0)
+    die("ftruncate");
 
   memset(buf, 0, sizeof(buf));
   memmove(buf, &sb, sizeof(sb));
@@ -127,19 +186,39 @@ main(int argc, char *argv[])
   strcpy(de.name, "..");
   iappend(rootino, &de, sizeof(de));
 
+  // the RAM disk's file system is mounted on /tmp.
+  tmpino = ialloc(T_DIR);
+
+  bzero(&de, sizeof(de));
+  de.inum = xshort(tmpino);
+  strcpy(de.name, ".");
+  iappend(tmpino, &de, sizeof(de));
+
+  bzero(&de, sizeof(de));
+  de.inum = xshort(rootino);
+  strcpy(de.name, "..");
+  iappend(tmpino, &de, sizeof(de));
+
+  bzero(&de, sizeof(de));
+  de.inum = xshort(tmpino);
+  strcpy(de.name, "tmp");
+  iappend(rootino, &de, sizeof(de));
+
+  // make every file's inode and directory entry first, so that
+  // the root directory's blocks don't land between files' blocks.
+  first = freeinode;
   for(i = 2; i < argc; i++){
-    // get rid of "user/"
+    // get rid of "user/", or "kernel/" for kernel.sym
     char *shortname;
     if(strncmp(argv[i], "user/", 5) == 0)
       shortname = argv[i] + 5;
+    else if(strncmp(argv[i], "kernel/", 7) == 0)
+      shortname = argv[i] + 7;
     else
       shortname = argv[i];
     
     assert(index(shortname, '/') == 0);
 
-    if((fd = open(argv[i], 0)) < 0)
-      die(argv[i]);
-
     // Skip leading _ in name when writing to file system.
     // The binaries are named _rm, _cat, etc. to keep the
     // build operating system from trying to execute them
@@ -153,6 +232,22 @@ main(int argc, char *argv[])
     de.inum = xshort(inum);
     strncpy(de.name, shortname, DIRSIZ);
     iappend(rootino, &de, sizeof(de));
+  }
+
+  for(i = 2, inum = first; i < argc; i++, inum++){
+    if((fd = open(argv[i], 0)) < 0)
+      die(argv[i]);
+
+    // a file that needs its indirect block gets it ahead of its
+    // data, which then isn't split around it.
+    off_t size = lseek(fd, 0, SEEK_END);
+    if(size < 0 || lseek(fd, 0, SEEK_SET) != 0)
+      die(argv[i]);
+    if(!extents && size > NDIRECT * BSIZE){
+      rinode(inum, &din);
+      din.addrs[NDIRECT] = xint(freeblock++);
+      winode(inum, &din);
+    }
 
     while((cc = read(fd, buf, sizeof(buf))) > 0)
       iappend(inum, buf, cc);
@@ -165,6 +260,7 @@ main(int argc, char *argv[])
   off = xint(din.size);
   off = ((off/BSIZE) + 1) * BSIZE;
   din.size = xint(off);
+  din.nlink = xshort(xshort(din.nlink) + 1);  // for tmp's ".."
   winode(rootino, &din);
 
   balloc(freeblock);
@@ -235,20 +331,65 @@ void
 balloc(int used)
 {
   uchar buf[BSIZE];
-  int i;
+  int i, b;
 
   printf("balloc: first %d blocks have been allocated\n", used);
-  assert(used < BSIZE*8);
-  bzero(buf, BSIZE);
-  for(i = 0; i < used; i++){
-    buf[i/8] = buf[i/8] | (0x1 << (i%8));
+  if(used > fssize){
+    fprintf(stderr, "mkfs: the files need %d blocks, more than the size %d\n", used, fssize);
+    exit(1);
+  }
+  for(b = 0; b * BPB < used; b++){
+    bzero(buf, BSIZE);
+    for(i = b * BPB; i < used && i < (b + 1) * BPB; i++){
+      buf[i%BPB/8] = buf[i%BPB/8] | (0x1 << (i%8));
+    }
+    printf("balloc: write bitmap block at sector %d\n", sb.bmapstart + b);
+    wsect(sb.bmapstart + b, buf);
+  }
+}
+
+// Parse the number given to option opt.
+int
+optnum(char *opt, char *s)
+{
+  char *end;
+  long n = strtol(s, &end, 0);
+
+  if(*s == 0 || *end != 0 || n <= 0 || n > 0x7fffffff){
+    fprintf(stderr, "mkfs: bad number %s for %s\n", s, opt);
+    exit(1);
   }
-  printf("balloc: write bitmap block at sector %d\n", sb.bmapstart);
-  wsect(sb.bmapstart, buf);
+  return n;
 }
 
 #define min(a, b) ((a) < (b) ? (a) : (b))
 
+// Return the block holding block fbn of din, which maps its blocks
+// with extents, allocating it if it is the block after the last.
+uint
+emap(struct dinode *din, uint fbn)
+{
+  uint base = 0;
+  int i;
+
+  for(i = 0; i < NEXTENT && din->extents[i].len != 0; i++){
+    uint start = xint(din->extents[i].start);
+    uint len = xint(din->extents[i].len);
+    if(fbn < base + len)
+      return start + (fbn - base);
+    base += len;
+  }
+  assert(fbn == base);
+  if(i > 0 && xint(din->extents[i-1].start) + xint(din->extents[i-1].len) == freeblock){
+    din->extents[i-1].len = xint(xint(din->extents[i-1].len) + 1);
+  } else {
+    assert(i < NEXTENT);
+    din->extents[i].start = xint(freeblock);
+    din->extents[i].len = xint(1);
+  }
+  return freeblock++;
+}
+
 void
 iappend(uint inum, void *xp, int n)
 {
@@ -265,7 +406,9 @@ iappend(uint inum, void *xp, int n)
   while(n > 0){
     fbn = off / BSIZE;
     assert(fbn < MAXFILE);
-    if(fbn < NDIRECT){
+    if(extents){
+      x = emap(&din, fbn);
+    } else if(fbn < NDIRECT){
       if(xint(din.addrs[fbn]) == 0){
         din.addrs[fbn] = xint(freeblock++);
       }
@@ -3,6 +3,9 @@
 #include <stdio.h>
 #include <assert.h>
 #include <pthread.h>
+#include <sched.h>
+#include <string.h>
+#include <sys/time.h>
 
 static int nthread = 1;
 static int round = 0;
@@ -50,6 +53,129 @@ barrier()
   pthread_mutex_unlock(&bstate.barrier_mutex);
 }
 
+// Spin while waiting at a barrier, yielding now and then in case the
+// thread we're waiting for shares our CPU.
+static void
+spin(int *n)
+{
+  if (++*n % 128 == 0)
+    sched_yield();
+}
+
+//
+// A sense-reversing barrier: threads count themselves in with an atomic
+// add, and the last one resets the count and flips the shared sense,
+// which the others spin on. Each thread's own sense tells it which
+// value of the shared sense means its round is over.
+//
+
+struct {
+  int count;
+  int sense;
+} sbstate;
+
+static __thread int mysense;
+
+static void
+sense_barrier(void)
+{
+  int n = 0;
+
+  mysense = !mysense;
+  if (__atomic_add_fetch(&sbstate.count, 1, __ATOMIC_ACQ_REL) == nthread) {
+    sbstate.count = 0;
+    bstate.round++;
+    __atomic_store_n(&sbstate.sense, mysense, __ATOMIC_RELEASE);
+  } else {
+    while (__atomic_load_n(&sbstate.sense, __ATOMIC_ACQUIRE) != mysense)
+      spin(&n);
+  }
+}
+
+//
+// A combining-tree barrier: threads arrive at a leaf in groups of up to
+// TREE_FANIN, and the last to arrive at each node goes on up to its
+// parent, so no counter is shared by more than TREE_FANIN threads. The
+// last at the root ends the round, and the news goes back down as each
+// node's last arrival flips its sense for the threads spinning there.
+//
+
+#define TREE_FANIN 4
+
+struct node {
+  int count;
+  int k;              // arrivals that complete this node
+  int sense;
+  struct node *parent;
+};
+
+static struct node *tree;
+static int ntree;
+
+static void
+tree_init(void)
+{
+  int first = 0, n = nthread;
+
+  // each level has a node per TREE_FANIN nodes (or threads) of the one below
+  tree = calloc(2 * nthread + 1, sizeof(struct node));
+  ntree = 0;
+  do {
+    int nnode = (n + TREE_FANIN - 1) / TREE_FANIN;
+    for (int i = 0; i < nnode; i++) {
+      tree[ntree + i].k = (i == nnode - 1) ? n - i * TREE_FANIN : TREE_FANIN;
+      tree[ntree + i].parent = 0;
+    }
+    if (ntree > 0) {
+      for (int i = first; i < ntree; i++)
+        tree[i].parent = &tree[ntree + (i - first) / TREE_FANIN];
+    }
+    first = ntree;
+    ntree += nnode;
+    n = nnode;
+  } while (n > 1);
+}
+
+static void
+tree_arrive(struct node *nd, int sense)
+{
+  int n = 0;
+
+  if (__atomic_add_fetch(&nd->count, 1, __ATOMIC_ACQ_REL) == nd->k) {
+    if (nd->parent)
+      tree_arrive(nd->parent, sense);
+    else
+      bstate.round++;
+    nd->count = 0;
+    __atomic_store_n(&nd->sense, sense, __ATOMIC_RELEASE);
+  } else {
+    while (__atomic_load_n(&nd->sense, __ATOMIC_ACQUIRE) != sense)
+      spin(&n);
+  }
+}
+
+static __thread long myid;
+
+static void
+tree_barrier(void)
+{
+  mysense = !mysense;
+  tree_arrive(&tree[myid / TREE_FANIN], mysense);
+}
+
+struct {
+  char *name;
+  void (*fn)(void);
+} kinds[] = {
+  { "mutex", barrier },
+  { "sense", sense_barrier },
+  { "tree", tree_barrier },
+};
+
+#define NKIND ((int)(sizeof(kinds) / sizeof(kinds[0])))
+
+static void (*barrier_fn)(void) = barrier;
+
 static void *
 thread(void *xa)
 {
@@ -57,39 +183,107 @@ thread(void *xa)
   long delay;
   int i;
 
+  myid = n;
   for (i = 0; i < 20000; i++) {
     int t = bstate.round;
     assert (i == t);
-    barrier();
+    barrier_fn();
     usleep(random() % 100);
   }
 
   return 0;
 }
 
+#define BENCH_ROUNDS 20000
+
+static void *
+bench_thread(void *xa)
+{
+  myid = (long) xa;
+  for (int i = 0; i < BENCH_ROUNDS; i++)
+    barrier_fn();
+  return 0;
+}
+
+static double
+now()
+{
+ struct timeval tv;
+ gettimeofday(&tv, 0);
+ return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+// Start nthread threads in fn, and wait for them all to finish.
+static void
+run(void *(*fn)(void *))
+{
+  pthread_t *tha = malloc(sizeof(pthread_t) * nthread);
+  void *value;
+
+  bstate.round = 0;
+  bstate.nthread = 0;
+  sbstate.count = 0;
+  tree_init();
+  for(long i = 0; i < nthread; i++) {
+    assert(pthread_create(&tha[i], NULL, fn, (void *) i) == 0);
+  }
+  for(long i = 0; i < nthread; i++) {
+    assert(pthread_join(tha[i], &value) == 0);
+  }
+  free(tree);
+  free(tha);
+}
+
+static void
+usage(char *argv0)
+{
+  fprintf(stderr, "%s: %s [-k mutex|sense|tree] nthread\n", argv0, argv0);
+  fprintf(stderr, "%s: %s -b maxthread\n", argv0, argv0);
+  exit(-1);
+}
+
 int
 main(int argc, char *argv[])
 {
-  pthread_t *tha;
-  void *value;
-  long i;
-  double t1, t0;
+  int k, bench = 0;
 
-  if (argc < 2) {
-    fprintf(stderr, "%s: %s nthread\n", argv[0], argv[0]);
-    exit(-1);
+  if (argc == 4 && strcmp(argv[1], "-k") == 0) {
+    for (k = 0; k < NKIND; k++)
+      if (strcmp(argv[2], kinds[k].name) == 0)
+        break;
+    if (k == NKIND)
+      usage(argv[0]);
+    barrier_fn = kinds[k].fn;
+  } else if (argc == 3 && strcmp(argv[1], "-b") == 0) {
+    bench = 1;
+  } else if (argc != 2) {
+    usage(argv[0]);
   }
-  nthread = atoi(argv[1]);
-  tha = malloc(sizeof(pthread_t) * nthread);
+  nthread = atoi(argv[argc-1]);
+  if (nthread < 1)
+    usage(argv[0]);
   srandom(0);
 
   barrier_init();
 
-  for(i = 0; i < nthread; i++) {
-    assert(pthread_create(&tha[i], NULL, thread, (void *) i) == 0);
+  if (!bench) {
+    run(thread);
+    printf("OK; passed\n");
+    return 0;
   }
-  for(i = 0; i < nthread; i++) {
-    assert(pthread_join(tha[i], &value) == 0);
+
+  // rounds per second of each kind of barrier with 1 to maxthread threads
+  int maxthread = nthread;
+
+  for (k = 0; k < NKIND; k++) {
+    barrier_fn = kinds[k].fn;
+    for (nthread = 1; nthread <= maxthread; nthread++) {
+      double t0 = now();
+      run(bench_thread);
+      double t1 = now();
+      printf("bench barrier=%s threads=%d rounds/s=%.0f\n", kinds[k].name, nthread,
+             BENCH_ROUNDS / (t1 - t0));
+    }
   }
-  printf("OK; passed\n");
+  return 0;
 }
@@ -1,4 +1,5 @@
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 #include <stdio.h>
 #include <assert.h>
@@ -23,6 +24,8 @@ struct table table;
 
 int keys[NKEYS];
 int nthread = 1;
+int lockfree;   // use lftable rather than table
+int quiet;      // print only the sweep's lines
 
 
 double
@@ -86,14 +89,173 @@ get(int key)
   return e;
 }
 
+//
+// A lock-free table, for ph -l and ph -s: a split-ordered list
+// (Shalev and Shavit). All the entries are kept in one linked list
+// sorted by their hash with its bits reversed, and bucket b points at
+// a sentinel entry in that list, ahead of the entries whose hashes end
+// in b. Doubling the number of buckets then splits each bucket's part
+// of the list in two without moving anything; the new buckets' sentinels
+// are put in lazily, the first time each bucket is used, so the table
+// grows incrementally. Entries are never removed, so get() just walks
+// the list, and put() links new entries in with a compare-and-swap.
+//
+
+#define LF_SEGSZ   1024                    // buckets per segment of the bucket array
+#define LF_MAXSEG  4096                    // so at most 4M buckets
+#define LF_LOAD    2                       // entries per bucket before the table doubles
+
+struct lfentry {
+  unsigned long so;                        // the split-order key, odd for real entries
+  int key;
+  int value;
+  struct lfentry *next;
+};
+
+struct lftable {
+  struct lfentry **segs[LF_MAXSEG];        // allocated as buckets are first used
+  unsigned long size;                      // buckets in use, a power of 2
+  unsigned long count;                     // entries
+  struct lfentry head;                     // bucket 0's sentinel
+};
+
+struct lftable lftable;
+
+// A hash that's one-to-one on 32-bit keys, so equal hashes mean equal keys.
+static unsigned int
+lf_hash(int key)
+{
+  return (unsigned int)key * 2654435761u;
+}
+
+static unsigned long
+lf_reverse(unsigned int x)
+{
+  x = ((x >> 1) & 0x55555555) | ((x & 0x55555555) << 1);
+  x = ((x >> 2) & 0x33333333) | ((x & 0x33333333) << 2);
+  x = ((x >> 4) & 0x0f0f0f0f) | ((x & 0x0f0f0f0f) << 4);
+  x = ((x >> 8) & 0x00ff00ff) | ((x & 0x00ff00ff) << 8);
+  return (x >> 16) | (x << 16);
+}
+
+// Link e into the list after start, unless an entry with e's
+// split-order key is already there. Returns the entry in the list.
+static struct lfentry *
+lf_insert(struct lfentry *start, struct lfentry *e)
+{
+  struct lfentry *prev = start, *cur;
+
+  for (;;) {
+    cur = __atomic_load_n(&prev->next, __ATOMIC_ACQUIRE);
+    while (cur && cur->so < e->so) {
+      prev = cur;
+      cur = __atomic_load_n(&prev->next, __ATOMIC_ACQUIRE);
+    }
+    if (cur && cur->so == e->so)
+      return cur;
+    e->next = cur;
+    // entries are only ever added, so on failure prev is still a good place to start
+    if (__atomic_compare_exchange_n(&prev->next, &cur, e, 0, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+      return e;
+  }
+}
+
+static struct lfentry **
+lf_slot(unsigned long b)
+{
+  struct lfentry ***seg = &lftable.segs[b / LF_SEGSZ];
+  struct lfentry **s = __atomic_load_n(seg, __ATOMIC_ACQUIRE);
+
+  if (s == 0) {
+    struct lfentry **n = calloc(LF_SEGSZ, sizeof(struct lfentry *));
+    if (__atomic_compare_exchange_n(seg, &s, n, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+      s = n;
+    else
+      free(n);
+  }
+  return &s[b % LF_SEGSZ];
+}
+
+// The sentinel of bucket b, putting it in after its parent bucket's
+// (b without its top bit) if this is b's first use.
+static struct lfentry *
+lf_bucket(unsigned long b)
+{
+  struct lfentry **slot, *e, *s;
+
+  if (b == 0)
+    return &lftable.head;
+  slot = lf_slot(b);
+  if ((s = __atomic_load_n(slot, __ATOMIC_ACQUIRE)) != 0)
+    return s;
+
+  e = malloc(sizeof(struct lfentry));
+  e->so = lf_reverse(b) << 1;
+  e->key = 0;
+  e->value = 0;
+  s = lf_insert(lf_bucket(b & ~(1UL << (63 - __builtin_clzl(b)))), e);
+  if (s != e)
+    free(e);
+  __atomic_store_n(slot, s, __ATOMIC_RELEASE);
+  return s;
+}
+
+static struct lfentry *
+lf_find(struct lfentry *start, unsigned long so)
+{
+  struct lfentry *e = __atomic_load_n(&start->next, __ATOMIC_ACQUIRE);
+
+  while (e && e->so < so)
+    e = __atomic_load_n(&e->next, __ATOMIC_ACQUIRE);
+  return (e && e->so == so) ? e : 0;
+}
+
+static void
+lf_put(int key, int value)
+{
+  unsigned int h = lf_hash(key);
+  unsigned long so = (lf_reverse(h) << 1) | 1;
+  unsigned long size = __atomic_load_n(&lftable.size, __ATOMIC_ACQUIRE);
+  struct lfentry *start = lf_bucket(h & (size - 1));
+  struct lfentry *e = lf_find(start, so);
+
+  if (e == 0) {
+    struct lfentry *n = malloc(sizeof(struct lfentry));
+    n->so = so;
+    n->key = key;
+    n->value = value;
+    if ((e = lf_insert(start, n)) == n) {
+      unsigned long count = __atomic_add_fetch(&lftable.count, 1, __ATOMIC_RELAXED);
+      if (count > size * LF_LOAD && size * 2 <= (unsigned long)LF_SEGSZ * LF_MAXSEG)
+        __atomic_compare_exchange_n(&lftable.size, &size, size * 2, 0,
+                                    __ATOMIC_RELEASE, __ATOMIC_RELAXED);
+      return;
+    }
+    free(n);
+  }
+  __atomic_store_n(&e->value, value, __ATOMIC_RELAXED);
+}
+
+static struct lfentry *
+lf_get(int key)
+{
+  unsigned int h = lf_hash(key);
+  unsigned long size = __atomic_load_n(&lftable.size, __ATOMIC_ACQUIRE);
+
+  return lf_find(lf_bucket(h & (size - 1)), (lf_reverse(h) << 1) | 1);
+}
+
 static void *
 put_thread(void *xa)
 {
   int n = (int) (long) xa; // thread number
-  int b = NKEYS/nthread;
+  int b = NKEYS*n/nthread, e = NKEYS*(n+1)/nthread;
 
-  for (int i = 0; i < b; i++) {
-    put(keys[b*n + i], n);
+  for (int i = b; i < e; i++) {
+    if (lockfree)
+      lf_put(keys[i], n);
+    else
+      put(keys[i], n);
   }
 
   return NULL;
@@ -106,36 +268,52 @@ get_thread(void *xa)
   int missing = 0;
 
   for (int i = 0; i < NKEYS; i++) {
-    struct entry *e = get(keys[i]);
-    if (e == 0) missing++;
+    int found = lockfree ? lf_get(keys[i]) != 0 : get(keys[i]) != 0;
+    if (!found) missing++;
   }
-  printf("%d: %d keys missing\n", n, missing);
-  return NULL;
+  if (!quiet)
+    printf("%d: %d keys missing\n", n, missing);
+  return (void *) (long) missing;
 }
 
-int
-main(int argc, char *argv[])
+// Empty both tables, for the next run of a sweep.
+static void
+reset(void)
 {
-  pthread_t *tha;
-  void *value;
-  double t1, t0;
+  struct entry *e, *next;
+  struct lfentry *l, *lnext;
 
-  if (argc < 2) {
-    fprintf(stderr, "Usage: %s nthreads\n", argv[0]);
-    exit(-1);
-  }
-  nthread = atoi(argv[1]);
-  tha = malloc(sizeof(pthread_t) * nthread);
-  srandom(0);
-  assert(NKEYS % nthread == 0);
-  for (int i = 0; i < NKEYS; i++) {
-    keys[i] = random();
+  for (int i = 0; i < NBUCKET; i++) {
+    for (e = table.buckets[i]; e != 0; e = next) {
+      next = e->next;
+      free(e);
+    }
+    table.buckets[i] = 0;
   }
 
-  // initialize the table
-  for (int i = 0; i < sizeof(table.locks) / sizeof(pthread_mutex_t); i++) {
-    pthread_mutex_init(&table.locks[i], NULL);
+  for (l = lftable.head.next; l != 0; l = lnext) {
+    lnext = l->next;
+    free(l);
   }
+  for (int i = 0; i < LF_MAXSEG; i++) {
+    free(lftable.segs[i]);
+    lftable.segs[i] = 0;
+  }
+  lftable.head.next = 0;
+  lftable.size = 1;
+  lftable.count = 0;
+}
+
+// Run the puts and then the gets with nthread threads, returning how
+// many puts and gets there were per second, and how many keys were
+// missing in all.
+static int
+run(double *puts, double *gets)
+{
+  pthread_t *tha = malloc(sizeof(pthread_t) * nthread);
+  void *value;
+  double t1, t0;
+  int missing = 0;
 
   //
   // first the puts
@@ -148,9 +326,11 @@ main(int argc, char *argv[])
     assert(pthread_join(tha[i], &value) == 0);
   }
   t1 = now();
+  *puts = NKEYS / (t1 - t0);
 
-  printf("%d puts, %.3f seconds, %.0f puts/second\n",
-         NKEYS, t1 - t0, NKEYS / (t1 - t0));
+  if (!quiet)
+    printf("%d puts, %.3f seconds, %.0f puts/second\n",
+           NKEYS, t1 - t0, NKEYS / (t1 - t0));
 
   //
   // now the gets
@@ -161,9 +341,73 @@ main(int argc, char *argv[])
   }
   for(int i = 0; i < nthread; i++) {
     assert(pthread_join(tha[i], &value) == 0);
+    missing += (int) (long) value;
   }
   t1 = now();
+  *gets = (NKEYS*nthread) / (t1 - t0);
+
+  if (!quiet)
+    printf("%d gets, %.3f seconds, %.0f gets/second\n",
+           NKEYS*nthread, t1 - t0, (NKEYS*nthread) / (t1 - t0));
+
+  free(tha);
+  return missing;
+}
+
+static void
+usage(char *argv0)
+{
+  fprintf(stderr, "Usage: %s [-l] nthreads\n       %s -s maxthreads\n", argv0, argv0);
+  exit(-1);
+}
+
+int
+main(int argc, char *argv[])
+{
+  double puts, gets;
+  int sweep = 0;
+
+  if (argc == 3 && strcmp(argv[1], "-l") == 0) {
+    lockfree = 1;
+  } else if (argc == 3 && strcmp(argv[1], "-s") == 0) {
+    sweep = 1;
+  } else if (argc != 2) {
+    usage(argv[0]);
+  }
+  nthread = atoi(argv[argc-1]);
+  if (nthread < 1)
+    usage(argv[0]);
+  srandom(0);
+  if (!sweep)
+    assert(NKEYS % nthread == 0);
+  for (int i = 0; i < NKEYS; i++) {
+    keys[i] = random();
+  }
+
+  // initialize the tables
+  for (int i = 0; i < NBUCKET; i++) {
+    pthread_mutex_init(&table.locks[i], NULL);
+  }
+  lftable.size = 1;
 
-  printf("%d gets, %.3f seconds, %.0f gets/second\n",
-         NKEYS*nthread, t1 - t0, (NKEYS*nthread) / (t1 - t0));
+  if (!sweep) {
+    run(&puts, &gets);
+    return 0;
+  }
+
+  //
+  // the sweep: both tables with 1 to maxthreads threads, a line each
+  //
+  int maxthread = nthread;
+
+  quiet = 1;
+  for (lockfree = 0; lockfree <= 1; lockfree++) {
+    for (nthread = 1; nthread <= maxthread; nthread++) {
+      int missing = run(&puts, &gets);
+      printf("sweep table=%s threads=%d puts/s=%.0f gets/s=%.0f missing=%d\n",
+             lockfree ? "lockfree" : "mutex", nthread, puts, gets, missing);
+      reset();
+    }
+  }
+  return 0;
 }
@@ -4,18 +4,26 @@
 #include "kernel/stat.h"
 #include "kernel/riscv.h"
 #include "kernel/fs.h"
+#include "kernel/sysinfo.h"
 #include "user/user.h"
 
 void test0();
 void test1();
 void test2();
+void sweep(void);
 
 #define SZ 4096
+#define SWEEPTICKS (2*TICKHZ)
+#define SWEEPBLOCKS 8
 char buf[SZ];
 
 int
 main(int argc, char *argv[])
 {
+  if(argc == 2 && strcmp(argv[1], "-s") == 0){
+    sweep();
+    exit(0);
+  }
   test0();
   test1();
   test2();
@@ -316,3 +324,89 @@ test2()
     printf("test2 failed\n");
   }
 }
+
+//
+// Sweep mode (bcachetest -s): for 1 to ncpu workers, each pinned to a
+// CPU of its own, read blocks of a SWEEPBLOCKS-block file of its own,
+// which stay in the buffer cache, for SWEEPTICKS, and print a line per
+// worker count:
+//   sweep bcache ncpu=<workers> ops=<total> ops/s=<total per second> tas/kop=<spins>
+// where tas/kop is test-and-set spins on the bcache locks per
+// thousand operations.
+//
+void
+sweep(void)
+{
+  struct sysinfo si;
+  int ncpu = NCPU;
+  uint64 n, total;
+  char file[3];
+  char b[BSIZE];
+
+  if(sysinfo(&si) == 0 && si.ncpu > 0)
+    ncpu = si.ncpu;
+  file[0] = 'S';
+  file[2] = '\0';
+  for(int i = 0; i < ncpu; i++){
+    file[1] = '0' + i;
+    unlink(file);
+    createfile(file, SWEEPBLOCKS);
+  }
+  for(int w = 1; w <= ncpu; w++){
+    int go[2], res[2];
+
+    if(pipe(go) < 0 || pipe(res) < 0){
+      printf("pipe failed\n");
+      exit(-1);
+    }
+    for(int i = 0; i < w; i++){
+      int pid = fork();
+      if(pid < 0){
+        printf("fork failed\n");
+        exit(-1);
+      }
+      if(pid == 0){
+        char c;
+
+        sched_setaffinity(getpid(), 1L << i);
+        close(go[1]);
+        // wait for the parent to close go, starting every worker at once
+        read(go[0], &c, 1);
+        file[1] = '0' + i;
+        int fd = open(file, O_RDONLY);
+        if(fd < 0){
+          printf("open %s failed\n", file);
+          exit(-1);
+        }
+        uint end = uuptime() + SWEEPTICKS;
+        for(n = 0; uuptime() < end; n += 100)
+          for(int k = 0; k < 100; k++)
+            pread(fd, b, BSIZE, (k % SWEEPBLOCKS) * BSIZE);
+        write(res[1], &n, sizeof(n));
+        exit(0);
+      }
+    }
+    close(go[0]);
+    close(res[1]);
+    int m = ntas(0);
+    close(go[1]);
+    total = 0;
+    for(int i = 0; i < w; i++){
+      if(read(res[0], &n, sizeof(n)) != sizeof(n)){
+        printf("sweep: worker failed\n");
+        exit(-1);
+      }
+      total += n;
+    }
+    for(int i = 0; i < w; i++)
+      wait(0);
+    int t = ntas(0) - m;
+    close(res[0]);
+    printf("sweep bcache ncpu=%d ops=%l ops/s=%l tas/kop=%l\n", w, total,
+           total * TICKHZ / SWEEPTICKS, total ? (uint64)t * 1000 / total : 0);
+  }
+  for(int i = 0; i < ncpu; i++){
+    file[1] = '0' + i;
+    unlink(file);
+  }
+}
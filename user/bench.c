@@ -0,0 +1,529 @@
+//
+// Microbenchmarks of system calls, processes, faults, pipes, files
+// and the network. Each benchmark is run NRUN times and the fastest
+// run reported, in cycles, instructions and nanoseconds per operation
+// (from the cycle, instret and time counters) and in clock ticks for
+// the whole run.
+//
+// usage: bench [-e event] [name ...]
+//
+// With no names, runs all but udp, which needs the server from
+// "make server" running on the host. With -e, hpm counter 3 counts
+// event, a platform-specific number, such as cache misses, and its
+// count per operation is reported too. The counters are per-CPU, so
+// the counts of benchmarks that move between CPUs are approximate.
+//
+
+#include "kernel/param.h"
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "kernel/fcntl.h"
+#include "kernel/riscv.h"
+#include "user/user.h"
+
+#define NRUN   3
+#define BSZ    4096
+#define FILESZ (256*BSZ)
+
+static char *argv0;
+static char buf[BSZ];
+
+static inline uint64
+rdcycle(void)
+{
+  uint64 x;
+  asm volatile("rdcycle %0" : "=r" (x));
+  return x;
+}
+
+static inline uint64
+rdtime(void)
+{
+  uint64 x;
+  asm volatile("rdtime %0" : "=r" (x));
+  return x;
+}
+
+static inline uint64
+rdinstret(void)
+{
+  uint64 x;
+  asm volatile("rdinstret %0" : "=r" (x));
+  return x;
+}
+
+static inline uint64
+rdhpm3(void)
+{
+  uint64 x;
+  asm volatile("csrr %0, hpmcounter3" : "=r" (x));
+  return x;
+}
+
+// The time taken by the timed parts of a run.
+struct acc {
+  uint64 cycles;
+  uint64 instret;
+  uint64 events;    // counted by hpm counter 3, with -e
+  uint64 time;
+  uint64 ticks;
+  uint64 bytes;     // moved, for benchmarks of throughput
+};
+
+static struct acc acc;
+static uint64 c0, i0, e0, t0, k0;
+static int event;   // -e was given
+
+static void
+start(void)
+{
+  k0 = uptime();
+  t0 = rdtime();
+  if(event)
+    e0 = rdhpm3();
+  i0 = rdinstret();
+  c0 = rdcycle();
+}
+
+static void
+stop(void)
+{
+  acc.cycles += rdcycle() - c0;
+  acc.instret += rdinstret() - i0;
+  if(event)
+    acc.events += rdhpm3() - e0;
+  acc.time += rdtime() - t0;
+  acc.ticks += uptime() - k0;
+}
+
+static void
+fail(char *name, char *what)
+{
+  fprintf(2, "bench %s: %s failed\n", name, what);
+  exit(1);
+}
+
+static void
+mkfile(char *name, int size)
+{
+  int fd;
+
+  if((fd = open(name, O_CREATE|O_TRUNC|O_WRONLY)) < 0)
+    fail(name, "create");
+  memset(buf, 'b', sizeof(buf));
+  for(int off = 0; off < size; off += BSZ)
+    if(write(fd, buf, BSZ) != BSZ)
+      fail(name, "write");
+  close(fd);
+}
+
+static uint64 rnd = 1;
+
+static uint64
+random(void)
+{
+  rnd = rnd * 6364136223846793005UL + 1442695040888963407UL;
+  return rnd >> 33;
+}
+
+// Each benchmark returns how many operations it timed.
+
+static int
+null(void)
+{
+  int n = 10000;
+
+  start();
+  for(int i = 0; i < n; i++)
+    getpid();
+  stop();
+  return n;
+}
+
+static int
+forkwait(void)
+{
+  int n = 100;
+
+  start();
+  for(int i = 0; i < n; i++){
+    int pid = fork();
+    if(pid < 0)
+      fail("fork", "fork");
+    if(pid == 0)
+      exit(0);
+    wait(0);
+  }
+  stop();
+  return n;
+}
+
+static int
+forkexec(void)
+{
+  char *args[] = { argv0, "-exit", 0 };
+  int n = 50;
+
+  start();
+  for(int i = 0; i < n; i++){
+    int pid = fork();
+    if(pid < 0)
+      fail("exec", "fork");
+    if(pid == 0){
+      exec(argv0, args);
+      fail("exec", "exec");
+    }
+    wait(0);
+  }
+  stop();
+  return n;
+}
+
+// Time the copy-on-write faults of a child writing to every page of
+// its parent's heap, in the child, which sends its times back.
+static int
+cow(void)
+{
+  int n = 10, npages = 64, fds[2];
+  char *p;
+  struct acc a;
+
+  if((p = sbrk(npages * PGSIZE)) == (char*)-1)
+    fail("cow", "sbrk");
+  for(int j = 0; j < npages; j++)
+    p[j * PGSIZE] = 1;
+  if(pipe(fds) < 0)
+    fail("cow", "pipe");
+
+  for(int i = 0; i < n; i++){
+    int pid = fork();
+    if(pid < 0)
+      fail("cow", "fork");
+    if(pid == 0){
+      // the child's copy of acc holds what the children before it
+      // sent; it must send back only its own.
+      memset(&acc, 0, sizeof(acc));
+      start();
+      for(int j = 0; j < npages; j++)
+        p[j * PGSIZE] = 2;
+      stop();
+      write(fds[1], &acc, sizeof(acc));
+      exit(0);
+    }
+    if(read(fds[0], &a, sizeof(a)) != sizeof(a))
+      fail("cow", "read");
+    acc.cycles += a.cycles;
+    acc.instret += a.instret;
+    acc.events += a.events;
+    acc.time += a.time;
+    acc.ticks += a.ticks;
+    wait(0);
+  }
+
+  close(fds[0]);
+  close(fds[1]);
+  sbrk(-npages * PGSIZE);
+  return n * npages;
+}
+
+static int
+pipethru(void)
+{
+  int n = 512, fds[2], pid;
+
+  if(pipe(fds) < 0)
+    fail("pipe", "pipe");
+  start();
+  if((pid = fork()) < 0)
+    fail("pipe", "fork");
+  if(pid == 0){
+    close(fds[0]);
+    for(int i = 0; i < n; i++)
+      if(write(fds[1], buf, BSZ) != BSZ)
+        fail("pipe", "write");
+    exit(0);
+  }
+  close(fds[1]);
+  for(int got = 0, cc; got < n * BSZ; got += cc)
+    if((cc = read(fds[0], buf, BSZ)) <= 0)
+      fail("pipe", "read");
+  stop();
+  close(fds[0]);
+  wait(0);
+  acc.bytes = n * BSZ;
+  return n;
+}
+
+static int
+seqwrite(void)
+{
+  int fd;
+
+  if((fd = open("benchfile", O_CREATE|O_TRUNC|O_WRONLY)) < 0)
+    fail("seqwrite", "create");
+  start();
+  for(int off = 0; off < FILESZ; off += BSZ)
+    if(write(fd, buf, BSZ) != BSZ)
+      fail("seqwrite", "write");
+  stop();
+  close(fd);
+  unlink("benchfile");
+  acc.bytes = FILESZ;
+  return FILESZ / BSZ;
+}
+
+static int
+seqread(void)
+{
+  int fd;
+
+  mkfile("benchfile", FILESZ);
+  if((fd = open("benchfile", O_RDONLY)) < 0)
+    fail("seqread", "open");
+  start();
+  for(int off = 0; off < FILESZ; off += BSZ)
+    if(read(fd, buf, BSZ) != BSZ)
+      fail("seqread", "read");
+  stop();
+  close(fd);
+  unlink("benchfile");
+  acc.bytes = FILESZ;
+  return FILESZ / BSZ;
+}
+
+static int
+randwrite(void)
+{
+  int fd;
+
+  mkfile("benchfile", FILESZ);
+  if((fd = open("benchfile", O_WRONLY)) < 0)
+    fail("randwrite", "open");
+  start();
+  for(int i = 0; i < FILESZ / BSZ; i++)
+    if(pwrite(fd, buf, BSZ, random() % (FILESZ / BSZ) * BSZ) != BSZ)
+      fail("randwrite", "pwrite");
+  stop();
+  close(fd);
+  unlink("benchfile");
+  acc.bytes = FILESZ;
+  return FILESZ / BSZ;
+}
+
+static int
+randread(void)
+{
+  int fd;
+
+  mkfile("benchfile", FILESZ);
+  if((fd = open("benchfile", O_RDONLY)) < 0)
+    fail("randread", "open");
+  start();
+  for(int i = 0; i < FILESZ / BSZ; i++)
+    if(pread(fd, buf, BSZ, random() % (FILESZ / BSZ) * BSZ) != BSZ)
+      fail("randread", "pread");
+  stop();
+  close(fd);
+  unlink("benchfile");
+  acc.bytes = FILESZ;
+  return FILESZ / BSZ;
+}
+
+static void
+fname(char *name, int i)
+{
+  strcpy(name, "benchdir/f");
+  name[10] = '0' + i / 100;
+  name[11] = '0' + i / 10 % 10;
+  name[12] = '0' + i % 10;
+  name[13] = '\0';
+}
+
+static int
+dircreate(void)
+{
+  int n = 100, fd;
+  char name[16];
+
+  if(mkdir("benchdir") < 0)
+    fail("dircreate", "mkdir");
+  start();
+  for(int i = 0; i < n; i++){
+    fname(name, i);
+    if((fd = open(name, O_CREATE|O_WRONLY)) < 0)
+      fail("dircreate", "create");
+    close(fd);
+  }
+  stop();
+  for(int i = 0; i < n; i++){
+    fname(name, i);
+    unlink(name);
+  }
+  unlink("benchdir");
+  return n;
+}
+
+static int
+dirlookup(void)
+{
+  int n = 100, fd;
+  char name[16];
+  struct stat st;
+
+  if(mkdir("benchdir") < 0)
+    fail("dirlookup", "mkdir");
+  for(int i = 0; i < n; i++){
+    fname(name, i);
+    if((fd = open(name, O_CREATE|O_WRONLY)) < 0)
+      fail("dirlookup", "create");
+    close(fd);
+  }
+  start();
+  for(int i = 0; i < n; i++){
+    fname(name, (i * 37) % n);
+    if(stat(name, &st) < 0)
+      fail("dirlookup", "stat");
+  }
+  stop();
+  for(int i = 0; i < n; i++){
+    fname(name, i);
+    unlink(name);
+  }
+  unlink("benchdir");
+  return n;
+}
+
+static int
+mmapfault(void)
+{
+  int fd;
+  char *p;
+  volatile char c;
+
+  mkfile("benchfile", FILESZ);
+  if((fd = open("benchfile", O_RDONLY)) < 0)
+    fail("mmap", "open");
+  if((p = mmap(0, FILESZ, PROT_READ, MAP_PRIVATE, fd, 0)) == (char*)-1)
+    fail("mmap", "mmap");
+  start();
+  for(int off = 0; off < FILESZ; off += PGSIZE)
+    c = p[off];
+  stop();
+  (void)c;
+  munmap(p, FILESZ);
+  close(fd);
+  unlink("benchfile");
+  return FILESZ / PGSIZE;
+}
+
+static int
+udp(void)
+{
+#ifdef NET_TESTS_PORT
+  int n = 20, fd;
+  char *obuf = "a message from xv6!";
+  uint32 dst = (10 << 24) | (0 << 16) | (2 << 8) | (2 << 0);
+
+  if((fd = connect(dst, 2300, NET_TESTS_PORT)) < 0)
+    fail("udp", "connect");
+  start();
+  for(int i = 0; i < n; i++){
+    if(write(fd, obuf, strlen(obuf)) < 0)
+      fail("udp", "send");
+    if(read(fd, buf, sizeof(buf)) <= 0)
+      fail("udp", "recv");
+  }
+  stop();
+  close(fd);
+  return n;
+#else
+  fprintf(2, "bench udp: built without NET_TESTS_PORT\n");
+  return 0;
+#endif
+}
+
+struct bench {
+  char *name;
+  int (*fn)(void);
+  int all;          // run when no names are given
+} benches[] = {
+  { "null",      null,      1 },
+  { "fork",      forkwait,  1 },
+  { "exec",      forkexec,  1 },
+  { "cow",       cow,       1 },
+  { "pipe",      pipethru,  1 },
+  { "seqwrite",  seqwrite,  1 },
+  { "seqread",   seqread,   1 },
+  { "randwrite", randwrite, 1 },
+  { "randread",  randread,  1 },
+  { "dircreate", dircreate, 1 },
+  { "dirlookup", dirlookup, 1 },
+  { "mmap",      mmapfault, 1 },
+  { "udp",       udp,       0 },
+};
+
+static void
+run(struct bench *b)
+{
+  struct acc best = { 0 };
+  int ops = 0;
+
+  for(int r = 0; r < NRUN; r++){
+    memset(&acc, 0, sizeof(acc));
+    ops = b->fn();
+    if(ops == 0)
+      return;
+    if(r == 0 || acc.cycles < best.cycles)
+      best = acc;
+  }
+
+  printf("%s: %d ops, %l cycles/op, %l instret/op, %l ns/op, %l ticks", b->name, ops,
+         best.cycles / ops, best.instret / ops, best.time * (1000000000 / TIMEHZ) / ops,
+         best.ticks);
+  if(event)
+    printf(", %l events/op", best.events / ops);
+  if(best.bytes > 0 && best.time > 0)
+    printf(", %l KB/s", best.bytes * TIMEHZ / best.time / 1024);
+  printf("\n");
+}
+
+int
+main(int argc, char *argv[])
+{
+  int i, j;
+
+  argv0 = argv[0];
+  if(argc == 2 && strcmp(argv[1], "-exit") == 0)
+    exit(0);
+
+  // read the counters directly, rather than with a system call.
+  ucounters(0x7f);
+  if(argc >= 3 && strcmp(argv[1], "-e") == 0){
+    if(hpmevent(3, atoi(argv[2])) < 0){
+      fprintf(2, "bench: no hpm counter 3\n");
+      exit(1);
+    }
+    event = 1;
+    argc -= 2;
+    argv += 2;
+  }
+
+  if(argc == 1){
+    for(j = 0; j < sizeof(benches) / sizeof(benches[0]); j++)
+      if(benches[j].all)
+        run(&benches[j]);
+    exit(0);
+  }
+
+  for(i = 1; i < argc; i++){
+    for(j = 0; j < sizeof(benches) / sizeof(benches[0]); j++)
+      if(strcmp(argv[i], benches[j].name) == 0)
+        break;
+    if(j == sizeof(benches) / sizeof(benches[0])){
+      fprintf(2, "bench: no benchmark %s\n", argv[i]);
+      exit(1);
+    }
+    run(&benches[j]);
+  }
+  exit(0);
+}
@@ -3,15 +3,19 @@
 #include "kernel/fcntl.h"
 #include "user/user.h"
 
-char buf[512];
-
 void
 cat(int fd)
 {
+  struct stream *s;
+  char *p;
   int n;
 
-  while((n = read(fd, buf, sizeof(buf))) > 0) {
-    if (write(1, buf, n) != n) {
+  if((s = sopen(fd)) == 0){
+    fprintf(2, "cat: out of memory\n");
+    exit(1);
+  }
+  while((n = sread(s, &p)) > 0) {
+    if (write(1, p, n) != n) {
       fprintf(2, "cat: write error\n");
       exit(1);
     }
@@ -20,6 +24,7 @@ cat(int fd)
     fprintf(2, "cat: read error\n");
     exit(1);
   }
+  sclose(s);
 }
 
 int
@@ -41,18 +41,19 @@ recurse_directory(int dir_fd, char *path, int path_len, char *name)
   // a buffer to hold the path to a directory entry
   char buf[512];
 
-  // an entry in the directory
-  struct dirent entry;
+  // a batch of entries in the directory, with their types; kept small,
+  // since every level of recursion has its own on the one-page stack
+  struct dent entries[8];
 
-  // the result of the last read() call
-  int bytes_read;
+  // the number of entries the last getdents() call returned
+  int nentries;
 
   // if an entry is a subdirectory, this will be an fd for that directory
   int subdir_fd;
 
   // if the length of (path + '/' + DIRSIZE + NULL) is larger than the buffer,
   // we can't continue, because we can't fit new path into the buffer
-  if (path_len + 1 + sizeof(entry.name) + 1 > sizeof buf) {
+  if (path_len + 1 + DIRSIZ + 1 > sizeof buf) {
     fprintf(2, "error: path '%s' is too long to continue searching");
     return -1;
   }
@@ -66,48 +67,50 @@ recurse_directory(int dir_fd, char *path, int path_len, char *name)
   // basename points to after the trailing slash in *path
   char *basename = buf + path_len + 1;
 
-  while ((bytes_read = read(dir_fd, &entry, sizeof entry)) > 0) {
-    // skip free directory entries
-    if (entry.inum == 0) {
-      continue;
-    }
-
-    // skip the current and parent directories to prevent an infinite loop
-    if (strcmp(entry.name, ".") == 0 || strcmp(entry.name, "..") == 0) {
-      continue;
-    }
+  while ((nentries = getdents(dir_fd, entries, sizeof entries / sizeof entries[0],
+                              GETDENTS_STAT)) > 0) {
+    for (int i = 0; i < nentries; i++) {
+      struct dent *entry = &entries[i];
 
-    // copy the current entry name into the buffer after the trailing slash
-    memmove(basename, entry.name, sizeof entry.name);
+      // skip the current and parent directories to prevent an infinite loop
+      if (strcmp(entry->name, ".") == 0 || strcmp(entry->name, "..") == 0) {
+        continue;
+      }
 
-    // it may be shorter than DIRSIZE, but we need to null-terminate it here
-    // in case it isn't
-    basename[sizeof entry.name] = '\0';
+      // copy the current entry name into the buffer after the trailing
+      // slash; getdents() has already null-terminated it
+      strcpy(basename, entry->name);
 
-    // calculate the new path length with the guaranteed trailing NULL
-    int new_path_len = (basename - buf) + strlen(basename);
+      // calculate the new path length with the guaranteed trailing NULL
+      int new_path_len = (basename - buf) + strlen(basename);
 
-    // we've found a match
-    if (strcmp(basename, name) == 0) {
-      printf("%s\n", buf);
-    }
+      // we've found a match
+      if (strcmp(basename, name) == 0) {
+        printf("%s\n", buf);
+      }
 
-    if ((subdir_fd = is_directory(buf)) > 0) {
-      // we're passing 'buf' here, which is stack-allocated; this is only safe
-      // so long as 'buf'outlives the recurse_directory call
-      if (recurse_directory(subdir_fd, buf, new_path_len, name) < 0) {
-        close(subdir_fd);
-        return -1;
+      // getdents() told us the type, so only directories need opening
+      if (entry->type != T_DIR) {
+        continue;
       }
 
-      if (close(subdir_fd) < 0) {
-        fprintf(2, "error: could not close subdirectory fd for '%s'", buf);
+      if ((subdir_fd = is_directory(buf)) < 0) {
         return -1;
       }
-    }
 
-    if (subdir_fd < 0) {
-      return -1;
+      if (subdir_fd > 0) {
+        // we're passing 'buf' here, which is stack-allocated; this is only
+        // safe so long as 'buf'outlives the recurse_directory call
+        if (recurse_directory(subdir_fd, buf, new_path_len, name) < 0) {
+          close(subdir_fd);
+          return -1;
+        }
+
+        if (close(subdir_fd) < 0) {
+          fprintf(2, "error: could not close subdirectory fd for '%s'", buf);
+          return -1;
+        }
+      }
     }
   }
 
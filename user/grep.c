@@ -1,53 +1,265 @@
 // Simple grep.  Only supports ^ . * $ operators.
+//
+// The pattern is compiled into a list of items, each a character or
+// '.', optionally starred, and matched a line at a time by a DFA that
+// is built lazily from sets of items, as in Thompson's construction,
+// so that each character of input costs one table lookup. If every
+// match must contain some literal character, lines without it are
+// skipped by scanning for that character eight bytes at a time.
+// Input comes whole lines at a time from a stream (stream.c).
 
 #include "kernel/types.h"
 #include "kernel/stat.h"
 #include "kernel/fcntl.h"
 #include "user/user.h"
 
-char buf[1024];
-int match(char*, char*);
+#define OUTSZ   4096
+#define MAXITEM 63          // items in a pattern, one bit each below the accept bit
+#define NSTATE  128         // DFA states kept at once
+
+char out[OUTSZ];
+int nout;
+
+// The compiled pattern. Bit i of a set stands for "items before i
+// matched"; bit nitem for the whole pattern matched.
+int nitem;
+uint64 cmask[256];          // bit i set if item i matches the character
+uint64 star;                // bit i set if item i is starred
+int anchored;               // ^: a match must start at the start of the line
+int dollar;                 // $: a match must end at the end of the line
+int need = -1;              // a character every match contains, or -1
+
+// The DFA: state 0 is the start of a line.
+uint64 dset[NSTATE];
+short dnext[NSTATE][256];   // next state, or -1 if not worked out yet
+char daccept[NSTATE];
+int ndstate;
 
 void
-grep(char *pattern, int fd)
+compile(char *re)
 {
-  int n, m;
-  char *p, *q;
-
-  m = 0;
-  while((n = read(fd, buf+m, sizeof(buf)-m-1)) > 0){
-    m += n;
-    buf[m] = '\0';
-    p = buf;
-    while((q = strchr(p, '\n')) != 0){
-      *q = 0;
-      if(match(pattern, p)){
-        *q = '\n';
-        write(1, p, q+1 - p);
-      }
-      p = q+1;
+  uint64 bit;
+  int c;
+
+  if(re[0] == '^'){
+    anchored = 1;
+    re++;
+  }
+  while(re[0] != '\0'){
+    if(re[0] == '$' && re[1] == '\0'){
+      dollar = 1;
+      break;
     }
-    if(m > 0){
-      m -= p - buf;
-      memmove(buf, p, m);
+    if(nitem == MAXITEM){
+      fprintf(2, "grep: pattern too long\n");
+      exit(1);
     }
+    bit = 1L << nitem++;
+    c = re[0] & 0xff;
+    if(c == '.'){
+      for(int i = 0; i < 256; i++)
+        if(i != '\n')
+          cmask[i] |= bit;
+    } else {
+      cmask[c] |= bit;
+    }
+    if(re[1] == '*'){
+      star |= bit;
+      re += 2;
+    } else {
+      if(need < 0 && c != '.')
+        need = c;
+      re++;
+    }
+  }
+}
+
+// Add the items that starred items before them can be skipped to.
+uint64
+closure(uint64 set)
+{
+  uint64 prev;
+
+  do{
+    prev = set;
+    set |= (set & star) << 1;
+  }while(set != prev);
+  return set;
+}
+
+// The DFA state for set, making it if need be. When the cache is full
+// it starts again from just the start state, so the caller must not
+// hold on to other state numbers.
+int
+dstate(uint64 set)
+{
+  int s;
+
+  for(s = 0; s < ndstate; s++)
+    if(dset[s] == set)
+      return s;
+  if(ndstate == NSTATE){
+    ndstate = 1;
+    memset(dnext[0], 0xff, sizeof(dnext[0]));
+    if(set == dset[0])
+      return 0;
   }
+  s = ndstate++;
+  dset[s] = set;
+  daccept[s] = (set >> nitem) & 1;
+  memset(dnext[s], 0xff, sizeof(dnext[s]));
+  return s;
+}
+
+// Work out where state s goes on character c.
+int
+dstep(int s, int c)
+{
+  uint64 from = dset[s];
+  uint64 set = from & cmask[c];
+  int n;
+
+  set = ((set & ~star) << 1) | (set & star);
+  if(!anchored)
+    set |= 1;
+  n = dstate(closure(set));
+  // the cache may have been emptied, taking s with it
+  if(s < ndstate && dset[s] == from)
+    dnext[s][c] = n;
+  return n;
+}
+
+void
+dinit(void)
+{
+  dstate(closure(1));
+}
+
+// Whether the pattern matches somewhere in [p, end), a line without
+// its newline.
+int
+matchline(char *p, char *end)
+{
+  int s = 0, n;
+
+  if(daccept[0] && !dollar)
+    return 1;
+  for(; p < end; p++){
+    if((n = dnext[s][(uchar)*p]) < 0)
+      n = dstep(s, (uchar)*p);
+    s = n;
+    if(daccept[s] && !dollar)
+      return 1;
+  }
+  return daccept[s];
+}
+
+// The first c in [p, end), or 0. Once p is aligned it looks at eight
+// bytes at a time, for a byte that is zero once xored with c.
+char*
+findc(char *p, char *end, int c)
+{
+  uint64 rep = 0x0101010101010101L * (uchar)c;
+
+  for(; p < end && ((uint64)p & 7); p++)
+    if(*p == c)
+      return p;
+  for(; p + 8 <= end; p += 8){
+    uint64 x = *(uint64*)p ^ rep;
+    if((x - 0x0101010101010101L) & ~x & 0x8080808080808080L)
+      break;
+  }
+  for(; p < end; p++)
+    if(*p == c)
+      return p;
+  return 0;
+}
+
+void
+flushout(void)
+{
+  if(nout > 0)
+    write(1, out, nout);
+  nout = 0;
+}
+
+// Print [p, end) and a newline.
+void
+printline(char *p, char *end)
+{
+  int n = end - p;
+
+  if(nout + n + 1 > OUTSZ){
+    flushout();
+    if(n + 1 > OUTSZ){
+      write(1, p, n);
+      write(1, "\n", 1);
+      return;
+    }
+  }
+  memmove(out + nout, p, n);
+  nout += n;
+  out[nout++] = '\n';
+}
+
+// Match the lines in [p, end), the last of which may have no newline.
+void
+greplines(char *p, char *end)
+{
+  char *q, *nl;
+
+  while(p < end){
+    if(need >= 0){
+      // skip the lines without the needed character
+      if((q = findc(p, end, need)) == 0)
+        break;
+      while(q > p && q[-1] != '\n')
+        q--;
+      p = q;
+    }
+    if((nl = findc(p, end, '\n')) == 0)
+      nl = end;
+    if(matchline(p, nl))
+      printline(p, nl);
+    p = nl + 1;
+  }
+}
+
+void
+grep(int fd)
+{
+  struct stream *s;
+  char *p;
+  int n;
+
+  if((s = sopen(fd)) == 0){
+    fprintf(2, "grep: out of memory\n");
+    exit(1);
+  }
+  while((n = sreadln(s, &p)) > 0)
+    greplines(p, p + n);
+  if(n < 0){
+    fprintf(2, "grep: read error\n");
+    exit(1);
+  }
+  sclose(s);
+  flushout();
 }
 
 int
 main(int argc, char *argv[])
 {
   int fd, i;
-  char *pattern;
 
   if(argc <= 1){
     fprintf(2, "usage: grep pattern [file ...]\n");
     exit(1);
   }
-  pattern = argv[1];
+  compile(argv[1]);
+  dinit();
 
   if(argc <= 2){
-    grep(pattern, 0);
+    grep(0);
     exit(0);
   }
 
@@ -56,52 +268,8 @@ main(int argc, char *argv[])
       printf("grep: cannot open %s\n", argv[i]);
       exit(1);
     }
-    grep(pattern, fd);
+    grep(fd);
     close(fd);
   }
   exit(0);
 }
-
-// Regexp matcher from Kernighan & Pike,
-// The Practice of Programming, Chapter 9, or
-// https://www.cs.princeton.edu/courses/archive/spr09/cos333/beautiful.html
-
-int matchhere(char*, char*);
-int matchstar(int, char*, char*);
-
-int
-match(char *re, char *text)
-{
-  if(re[0] == '^')
-    return matchhere(re+1, text);
-  do{  // must look at empty string
-    if(matchhere(re, text))
-      return 1;
-  }while(*text++ != '\0');
-  return 0;
-}
-
-// matchhere: search for re at beginning of text
-int matchhere(char *re, char *text)
-{
-  if(re[0] == '\0')
-    return 1;
-  if(re[1] == '*')
-    return matchstar(re[0], re+2, text);
-  if(re[0] == '$' && re[1] == '\0')
-    return *text == '\0';
-  if(*text!='\0' && (re[0]=='.' || re[0]==*text))
-    return matchhere(re+1, text+1);
-  return 0;
-}
-
-// matchstar: search for c*re at beginning of text
-int matchstar(int c, char *re, char *text)
-{
-  do{  // a * matches zero or more instances
-    if(matchhere(re, text))
-      return 1;
-  }while(*text!='\0' && (*text++==c || c=='.'));
-  return 0;
-}
-
@@ -19,6 +19,9 @@ main(void)
   if(open("console", O_RDWR) < 0){
     mknod("console", CONSOLE, 0);
     mknod("statistics", STATS, 0);
+    mknod("kcsan", KCSANDEV, 0);
+    mknod("dmesg", DMESG, 0);
+    mknod("ktrace", KTRACEDEV, 0);
     open("console", O_RDWR);
   }
   dup(0);  // stdout
@@ -4,20 +4,27 @@
 #include "kernel/riscv.h"
 #include "kernel/memlayout.h"
 #include "kernel/fcntl.h"
+#include "kernel/sysinfo.h"
 #include "user/user.h"
 
 #define NCHILD 2
 #define N 100000
 #define SZ 4096
+#define SWEEPTICKS (2*TICKHZ)
 
 void test1(void);
 void test2(void);
 void test3(void);
+void sweep(void);
 char buf[SZ];
 
 int
 main(int argc, char *argv[])
 {
+  if(argc == 2 && strcmp(argv[1], "-s") == 0){
+    sweep();
+    exit(0);
+  }
   test1();
   test2();
   test3();
@@ -45,7 +52,10 @@ void test1(void)
   void *a, *a1;
   int n, m;
   printf("start test1\n");  
-  m = ntas(0);
+  // the kmem_N lines in the statistics output are per-CPU, so printing them both before and
+  // after shows how the contention is spread across the freelists
+  printf("test1 per-CPU contention before:\n");
+  m = ntas(1);
   for(int i = 0; i < NCHILD; i++){
     int pid = fork();
     if(pid < 0){
@@ -69,7 +79,7 @@ void test1(void)
   for(int i = 0; i < NCHILD; i++){
     wait(0);
   }
-  printf("test1 results:\n");
+  printf("test1 results (per-CPU contention after):\n");
   n = ntas(1);
   if(n-m < 10) 
     printf("test1 OK\n");
@@ -127,6 +137,8 @@ void test3(void)
 {
   void *a, *a1;
   printf("start test3\n");  
+  printf("test3 per-CPU contention before:\n");
+  ntas(1);
   for(int i = 0; i < NCHILD; i++){
     int pid = fork();
     if(pid < 0){
@@ -157,5 +169,83 @@ void test3(void)
   for(int i = 0; i < NCHILD; i++){
     wait(0);
   }
+  printf("test3 per-CPU contention after:\n");
+  ntas(1);
   printf("test3 OK\n");
 }
+
+// One page allocated, touched and freed.
+void
+kallocop(void)
+{
+  char *a = sbrk(4096);
+
+  *(int *)(a+4) = 1;
+  sbrk(-4096);
+}
+
+//
+// Sweep mode (kalloctest -s): for 1 to ncpu workers, each pinned to a
+// CPU of its own, run kallocop() for SWEEPTICKS, and print a line per
+// worker count:
+//   sweep kalloc ncpu=<workers> ops=<total> ops/s=<total per second> tas/kop=<spins>
+// where tas/kop is test-and-set spins on the kmem locks per
+// thousand operations.
+//
+void
+sweep(void)
+{
+  struct sysinfo si;
+  int ncpu = NCPU;
+  uint64 n, total;
+
+  if(sysinfo(&si) == 0 && si.ncpu > 0)
+    ncpu = si.ncpu;
+  for(int w = 1; w <= ncpu; w++){
+    int go[2], res[2];
+
+    if(pipe(go) < 0 || pipe(res) < 0){
+      printf("pipe failed\n");
+      exit(-1);
+    }
+    for(int i = 0; i < w; i++){
+      int pid = fork();
+      if(pid < 0){
+        printf("fork failed\n");
+        exit(-1);
+      }
+      if(pid == 0){
+        char c;
+
+        sched_setaffinity(getpid(), 1L << i);
+        close(go[1]);
+        // wait for the parent to close go, starting every worker at once
+        read(go[0], &c, 1);
+        uint end = uuptime() + SWEEPTICKS;
+        for(n = 0; uuptime() < end; n += 100)
+          for(int k = 0; k < 100; k++)
+            kallocop();
+        write(res[1], &n, sizeof(n));
+        exit(0);
+      }
+    }
+    close(go[0]);
+    close(res[1]);
+    int m = ntas(0);
+    close(go[1]);
+    total = 0;
+    for(int i = 0; i < w; i++){
+      if(read(res[0], &n, sizeof(n)) != sizeof(n)){
+        printf("sweep: worker failed\n");
+        exit(-1);
+      }
+      total += n;
+    }
+    for(int i = 0; i < w; i++)
+      wait(0);
+    int t = ntas(0) - m;
+    close(res[0]);
+    printf("sweep kalloc ncpu=%d ops=%l ops/s=%l tas/kop=%l\n", w, total,
+           total * TICKHZ / SWEEPTICKS, total ? (uint64)t * 1000 / total : 0);
+  }
+}
@@ -0,0 +1,57 @@
+//
+// Run the in-kernel microbenchmarks (kernel/kbench.c) on every CPU
+// and print their cycles per operation. The kernel must have been
+// built with KBENCH=1.
+//
+// usage: kbench
+//
+
+#include "kernel/types.h"
+#include "kernel/fcntl.h"
+#include "kernel/sysinfo.h"
+#include "user/user.h"
+
+#define SZ 8192
+
+static char buf[SZ];
+
+int
+main(int argc, char *argv[])
+{
+  struct sysinfo si;
+  int fd, n, i;
+  char *p;
+
+  if(sysinfo(&si) < 0){
+    fprintf(2, "kbench: sysinfo failed\n");
+    exit(1);
+  }
+  if((fd = open("statistics", O_RDWR)) < 0){
+    fprintf(2, "kbench: can't open statistics\n");
+    exit(1);
+  }
+
+  // a write runs the benchmarks on the writer's CPU.
+  for(i = 0; i < si.ncpu; i++){
+    if(sched_setaffinity(0, 1UL << i) < 0)
+      continue;
+    if(write(fd, "x", 1) != 1){
+      fprintf(2, "kbench: kernel built without KBENCH=1\n");
+      exit(1);
+    }
+  }
+  close(fd);
+
+  // print just the benchmarks' part of the statistics.
+  n = statistics(buf, SZ - 1);
+  buf[n] = 0;
+  for(p = buf; *p; p++)
+    if(memcmp(p, "--- kbench", 10) == 0)
+      break;
+  if(*p == 0){
+    fprintf(2, "kbench: no results\n");
+    exit(1);
+  }
+  printf("%s", p);
+  exit(0);
+}
@@ -0,0 +1,182 @@
+//
+// Kernel tracing with the ktrace device (kernel/ktrace.c).
+//
+// usage: ktrace categories
+//        ktrace [-r] dump
+//        ktrace [-r] categories cmd [arg ...]
+//
+// categories is a comma-separated list of sched, sleep, bio, disk,
+// net, fault and all, or off. The first form just enables them. dump
+// prints the events buffered so far. The last form enables them,
+// runs cmd, prints events as they arrive until it exits, and then
+// disables tracing. With -r, events are written as raw struct
+// ktevents instead of text, for offline analysis.
+//
+
+#include "kernel/types.h"
+#include "kernel/fcntl.h"
+#include "kernel/poll.h"
+#include "kernel/ktrace.h"
+#include "user/user.h"
+
+#define NEV 64
+
+static char *cats[] = { "sched", "sleep", "bio", "disk", "net", "fault" };
+
+static char *types[KT_NTYPE] = {
+  [KT_DROPPED]    "dropped",
+  [KT_SWITCHIN]   "switchin",
+  [KT_SWITCHOUT]  "switchout",
+  [KT_SLEEPON]    "sleep",
+  [KT_WAKE]       "wake",
+  [KT_BHIT]       "bhit",
+  [KT_BMISS]      "bmiss",
+  [KT_DISKSUBMIT] "disksubmit",
+  [KT_DISKDONE]   "diskdone",
+  [KT_NETTX]      "nettx",
+  [KT_NETRX]      "netrx",
+  [KT_PGFAULT]    "pgfault",
+};
+
+static int raw;
+static struct ktevent ev[NEV];
+
+static void
+usage(void)
+{
+  fprintf(2, "usage: ktrace categories\n"
+             "       ktrace [-r] dump\n"
+             "       ktrace [-r] categories cmd [arg ...]\n");
+  exit(1);
+}
+
+// The mask for a list like "sched,disk", or -1 if it's bad.
+static int
+parsecats(char *s)
+{
+  int mask = 0, i, n;
+
+  if(strcmp(s, "off") == 0)
+    return 0;
+  while(*s){
+    for(n = 0; s[n] && s[n] != ','; n++)
+      ;
+    if(n == 3 && memcmp(s, "all", 3) == 0){
+      mask |= KT_ALL;
+    } else {
+      for(i = 0; i < sizeof(cats)/sizeof(cats[0]); i++)
+        if(strlen(cats[i]) == n && memcmp(s, cats[i], n) == 0)
+          break;
+      if(i == sizeof(cats)/sizeof(cats[0]))
+        return -1;
+      mask |= 1 << i;
+    }
+    s += n;
+    if(*s == ',')
+      s++;
+  }
+  return mask;
+}
+
+static void
+enable(int fd, int mask)
+{
+  char buf[16];
+  int i = sizeof(buf);
+
+  do {
+    buf[--i] = '0' + mask % 10;
+  } while((mask /= 10) != 0);
+  if(write(fd, buf + i, sizeof(buf) - i) != sizeof(buf) - i){
+    fprintf(2, "ktrace: can't set categories\n");
+    exit(1);
+  }
+}
+
+// Print what the device has now; returns how many events.
+static int
+drain(int fd)
+{
+  int n, total = 0;
+
+  while((n = read(fd, ev, sizeof(ev))) > 0){
+    n /= sizeof(ev[0]);
+    total += n;
+    if(raw){
+      write(1, ev, n * sizeof(ev[0]));
+      continue;
+    }
+    for(int i = 0; i < n; i++){
+      struct ktevent *e = &ev[i];
+      char *t = e->type < KT_NTYPE && types[e->type] ? types[e->type] : "?";
+      printf("%l %d %d %s %p %p\n", e->time, e->cpu, e->pid, t, e->arg0, e->arg1);
+    }
+  }
+  return total;
+}
+
+int
+main(int argc, char *argv[])
+{
+  int fd, mask, pid, p[2];
+  struct pollfd pfd;
+
+  if(argc > 1 && strcmp(argv[1], "-r") == 0){
+    raw = 1;
+    argc--;
+    argv++;
+  }
+  if(argc < 2)
+    usage();
+  if((fd = open("ktrace", O_RDWR)) < 0){
+    fprintf(2, "ktrace: can't open the ktrace device\n");
+    exit(1);
+  }
+
+  if(strcmp(argv[1], "dump") == 0){
+    drain(fd);
+    exit(0);
+  }
+  if((mask = parsecats(argv[1])) < 0)
+    usage();
+  if(argc == 2){
+    if(raw)
+      usage();
+    enable(fd, mask);
+    exit(0);
+  }
+
+  // cmd holds the write end of p, so p reads end of file once
+  // cmd has exited.
+  if(pipe(p) < 0){
+    fprintf(2, "ktrace: pipe failed\n");
+    exit(1);
+  }
+  enable(fd, mask);
+  if((pid = fork()) < 0){
+    fprintf(2, "ktrace: fork failed\n");
+    exit(1);
+  }
+  if(pid == 0){
+    close(fd);
+    close(p[0]);
+    exec(argv[2], argv + 2);
+    fprintf(2, "ktrace: exec %s failed\n", argv[2]);
+    exit(1);
+  }
+  close(p[1]);
+
+  pfd.fd = p[0];
+  pfd.events = POLLIN;
+  // look for cmd's exit every time round, since a busy cmd may keep
+  // the device from ever running dry; wait a little only if it did.
+  for(;;){
+    int n = drain(fd);
+    if(poll(&pfd, 1, n > 0 ? 0 : 10) > 0)
+      break;
+  }
+  enable(fd, 0);
+  drain(fd);
+  wait(0);
+  exit(0);
+}
@@ -8,6 +8,10 @@
 
 void mmap_test();
 void fork_test();
+void many_test();
+void shared_test();
+void msync_test();
+void madvise_test();
 char buf[BSIZE];
 
 #define MAP_FAILED ((char *) -1)
@@ -17,6 +21,10 @@ main(int argc, char *argv[])
 {
   mmap_test();
   fork_test();
+  many_test();
+  shared_test();
+  msync_test();
+  madvise_test();
   printf("mmaptest: all tests succeeded\n");
   exit(0);
 }
@@ -302,3 +310,271 @@ fork_test(void)
 
   printf("fork_test OK\n");
 }
+
+//
+// map the same file many more times than the system used to
+// allow in total, unmap every other mapping, and check that new
+// mappings fill the holes that leaves.
+//
+void
+many_test(void)
+{
+  enum { N = 200 };
+  static char *maps[N];
+  int fd, i;
+  const char * const f = "mmap.many";
+
+  printf("many_test starting\n");
+  testname = "many_test";
+
+  makefile(f);
+  if ((fd = open(f, O_RDONLY)) == -1)
+    err("open");
+  if (unlink(f) == -1)
+    err("unlink");
+
+  for (i = 0; i < N; i++) {
+    maps[i] = mmap(0, PGSIZE, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (maps[i] == MAP_FAILED)
+      err("mmap");
+  }
+  for (i = 0; i < N; i++) {
+    if (maps[i][0] != 'A')
+      err("mismatch");
+  }
+
+  for (i = 0; i < N; i += 2) {
+    if (munmap(maps[i], PGSIZE) == -1)
+      err("munmap");
+  }
+  for (i = 0; i < N; i += 2) {
+    char *p = mmap(0, PGSIZE, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (p == MAP_FAILED)
+      err("mmap into hole");
+    if (p < maps[N-1])
+      err("mmap didn't reuse a hole");
+    if (p[0] != 'A')
+      err("mismatch in hole");
+  }
+
+  for (i = 1; i < N; i += 2) {
+    if (munmap(maps[i], PGSIZE) == -1)
+      err("munmap");
+  }
+  close(fd);
+
+  printf("many_test OK\n");
+}
+
+//
+// map a file MAP_SHARED in a parent and a child, and check that
+// the child's writes show up in the parent's already-mapped page
+// and in read(), before anything is unmapped.
+//
+void
+shared_test(void)
+{
+  int fd, pid, i;
+  int fds[2];
+  char c;
+  const char * const f = "mmap.shared";
+
+  printf("shared_test starting\n");
+  testname = "shared_test";
+
+  makefile(f);
+  if ((fd = open(f, O_RDWR)) == -1)
+    err("open");
+  char *p = mmap(0, PGSIZE*2, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (p == MAP_FAILED)
+    err("mmap");
+  char *q = mmap(0, PGSIZE*2, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+  if (q == MAP_FAILED)
+    err("mmap private");
+
+  // fault both pages in before forking.
+  _v1(p);
+  _v1(q);
+
+  if (pipe(fds) < 0)
+    err("pipe");
+  if ((pid = fork()) < 0)
+    err("fork");
+  if (pid == 0) {
+    for (i = 0; i < PGSIZE; i++)
+      p[i] = 'Y';
+    if (write(fds[1], "x", 1) != 1)
+      err("pipe write");
+    if (read(fds[0], &c, 1) != 1)
+      err("pipe read");
+    exit(0);
+  }
+
+  if (read(fds[0], &c, 1) != 1)
+    err("pipe read");
+  for (i = 0; i < PGSIZE; i++) {
+    if (p[i] != 'Y')
+      err("parent doesn't see child's write");
+  }
+  if (read(fd, buf, BSIZE) != BSIZE)
+    err("read");
+  for (i = 0; i < BSIZE; i++) {
+    if (buf[i] != 'Y')
+      err("read() doesn't see child's write");
+  }
+
+  // writing a private mapping must copy the page, not change the file.
+  q[0] = 'P';
+  if (p[0] != 'Y')
+    err("private write leaked into shared mapping");
+
+  if (write(fds[1], "x", 1) != 1)
+    err("pipe write");
+  wait(0);
+
+  if (munmap(p, PGSIZE*2) == -1 || munmap(q, PGSIZE*2) == -1)
+    err("munmap");
+  close(fds[0]);
+  close(fds[1]);
+  close(fd);
+  unlink(f);
+
+  printf("shared_test OK\n");
+}
+
+//
+// write to a MAP_SHARED mapping, flush it with msync(), and
+// check msync()'s argument checking.
+//
+void
+msync_test(void)
+{
+  int fd, i;
+  const char * const f = "mmap.sync";
+
+  printf("msync_test starting\n");
+  testname = "msync_test";
+
+  makefile(f);
+  if ((fd = open(f, O_RDWR)) == -1)
+    err("open");
+  char *p = mmap(0, PGSIZE*2, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (p == MAP_FAILED)
+    err("mmap");
+
+  for (i = 0; i < PGSIZE; i++)
+    p[i] = 'S';
+  if (msync(p, PGSIZE*2, MS_SYNC) != 0)
+    err("msync");
+  // nothing is dirty any more, so this is a no-op.
+  if (msync(p, PGSIZE*2, MS_ASYNC) != 0)
+    err("msync (2)");
+
+  if (msync(p + 1, PGSIZE, MS_SYNC) != -1)
+    err("msync of unaligned address");
+  if (msync(p, PGSIZE, MS_SYNC | MS_ASYNC) != -1)
+    err("msync with bad flags");
+  if (msync(p, PGSIZE*3, MS_SYNC) != -1)
+    err("msync past the mapping");
+
+  if (read(fd, buf, BSIZE) != BSIZE)
+    err("read");
+  for (i = 0; i < BSIZE; i++) {
+    if (buf[i] != 'S')
+      err("file does not contain synced data");
+  }
+
+  if (munmap(p, PGSIZE*2) == -1)
+    err("munmap");
+  close(fd);
+
+  // the file itself, reopened with nothing cached, must have the data.
+  if ((fd = open(f, O_RDONLY)) == -1)
+    err("open (2)");
+  if (read(fd, buf, BSIZE) != BSIZE)
+    err("read (2)");
+  for (i = 0; i < BSIZE; i++) {
+    if (buf[i] != 'S')
+      err("file lost synced data");
+  }
+  close(fd);
+  unlink(f);
+
+  printf("msync_test OK\n");
+}
+
+//
+// check that madvise() hints leave mappings working, and that
+// MADV_DONTNEED writes back shared pages and zeroes heap pages, and
+// that MADV_GUARD heap pages fault.
+//
+void
+madvise_test(void)
+{
+  int fd, i;
+  const char * const f = "mmap.advise";
+
+  printf("madvise_test starting\n");
+  testname = "madvise_test";
+
+  makefile(f);
+  if ((fd = open(f, O_RDWR)) == -1)
+    err("open");
+  char *p = mmap(0, PGSIZE*2, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (p == MAP_FAILED)
+    err("mmap");
+
+  // advice for just the second page splits the mapping.
+  if (madvise(p + PGSIZE, PGSIZE, MADV_SEQUENTIAL) != 0)
+    err("madvise sequential");
+  if (madvise(p, PGSIZE*2, MADV_WILLNEED) != 0)
+    err("madvise willneed");
+  _v1(p);
+
+  for (i = 0; i < PGSIZE; i++)
+    p[i] = 'D';
+  if (madvise(p, PGSIZE*2, MADV_DONTNEED) != 0)
+    err("madvise dontneed");
+  if (p[0] != 'D' || p[PGSIZE-1] != 'D' || p[PGSIZE] != 'A')
+    err("shared page lost after dontneed");
+  if (munmap(p, PGSIZE*2) == -1)
+    err("munmap");
+
+  if (madvise(p, PGSIZE, MADV_RANDOM) != -1)
+    err("madvise of unmapped range");
+  if (madvise(sbrk(0) - PGSIZE, PGSIZE, 17) != -1)
+    err("madvise with bad advice");
+
+  // heap pages come back zeroed.
+  char *h = (char *)PGROUNDUP((uint64)sbrk(2*PGSIZE));
+  h[0] = 'h';
+  if (madvise(h, PGSIZE, MADV_DONTNEED) != 0)
+    err("madvise dontneed heap");
+  if (h[0] != 0)
+    err("heap page not zeroed after dontneed");
+  sbrk(-2*PGSIZE);
+
+  // a guard page faults rather than being filled in, and only the heap has them.
+  h = (char *)PGROUNDUP((uint64)sbrk(2*PGSIZE));
+  if (madvise(h, PGSIZE, MADV_GUARD) != 0)
+    err("madvise guard");
+  if (madvise(sbrk(0) + PGSIZE, PGSIZE, MADV_GUARD) != -1)
+    err("madvise guard past the heap");
+  int pid = fork();
+  if (pid < 0)
+    err("fork");
+  if (pid == 0) {
+    h[0] = 'g';
+    exit(0);
+  }
+  int xstatus;
+  wait(&xstatus);
+  if (xstatus != -1)
+    err("guard page didn't fault");
+  sbrk(-2*PGSIZE);
+
+  close(fd);
+  unlink(f);
+
+  printf("madvise_test OK\n");
+}
@@ -0,0 +1,40 @@
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "user/user.h"
+
+// Print the network stack's counters, the "--- net stats" section
+// of the statistics device.
+
+#define SZ 8192
+char buf[SZ + 1];
+
+static char *
+find(char *s, char *sub)
+{
+  int n = strlen(sub);
+
+  for (; *s; s++)
+    if (memcmp(s, sub, n) == 0)
+      return s;
+  return 0;
+}
+
+int
+main(void)
+{
+  char *p, *end;
+  int n;
+
+  n = statistics(buf, SZ);
+  buf[n < 0 ? 0 : n] = 0;
+
+  if ((p = find(buf, "--- net stats\n")) == 0) {
+    fprintf(2, "netstat: no net stats\n");
+    exit(1);
+  }
+  p += strlen("--- net stats\n");
+  if ((end = find(p, "---")) != 0)
+    *end = 0;
+  write(1, p, strlen(p));
+  exit(0);
+}
@@ -1,6 +1,9 @@
 #include "kernel/types.h"
 #include "kernel/net.h"
 #include "kernel/stat.h"
+#include "kernel/mmsg.h"
+#include "kernel/fcntl.h"
+#include "kernel/sockstat.h"
 #include "user/user.h"
 
 //
@@ -48,6 +51,141 @@ ping(uint16 sport, uint16 dport, int attempts)
   }
 }
 
+//
+// send n pings with one sendmmsg(), and collect the responses
+// with recvmmsg().
+//
+static void
+mping(uint16 sport, uint16 dport, int n)
+{
+  int fd, got, cc;
+  char *obuf = "a message from xv6!";
+  static char ibuf[8][128];
+  struct mmsghdr msgs[8];
+  uint32 dst;
+
+  dst = (10 << 24) | (0 << 16) | (2 << 8) | (2 << 0);
+  if((fd = connect(dst, sport, dport)) < 0){
+    fprintf(2, "mping: connect() failed\n");
+    exit(1);
+  }
+
+  for(int i = 0; i < n; i++){
+    msgs[i].buf = obuf;
+    msgs[i].size = strlen(obuf);
+    msgs[i].len = 0;
+  }
+  if(sendmmsg(fd, msgs, n) != n || msgs[n-1].len != strlen(obuf)){
+    fprintf(2, "mping: sendmmsg() failed\n");
+    exit(1);
+  }
+
+  for(got = 0; got < n; got += cc){
+    for(int i = 0; i < n - got; i++){
+      msgs[i].buf = ibuf[i];
+      msgs[i].size = sizeof(ibuf[i]) - 1;
+    }
+    if((cc = recvmmsg(fd, msgs, n - got)) <= 0){
+      fprintf(2, "mping: recvmmsg() failed\n");
+      exit(1);
+    }
+    for(int i = 0; i < cc; i++){
+      ibuf[i][msgs[i].len] = '\0';
+      if(strcmp(ibuf[i], "this is the host!") != 0){
+        fprintf(2, "mping didn't receive correct payload\n");
+        exit(1);
+      }
+    }
+  }
+
+  close(fd);
+}
+
+//
+// send a ping, and receive the response in a page lent by the
+// kernel rather than copied.
+//
+static void
+zcping(uint16 sport, uint16 dport)
+{
+  int fd, cc;
+  char *obuf = "a message from xv6!";
+  char *page, *data;
+  uint32 dst;
+
+  // a page-aligned page of the heap to borrow into
+  page = sbrk(2*4096);
+  page += (4096 - (uint64)page % 4096) % 4096;
+
+  dst = (10 << 24) | (0 << 16) | (2 << 8) | (2 << 0);
+  if((fd = connect(dst, sport, dport)) < 0){
+    fprintf(2, "zcping: connect() failed\n");
+    exit(1);
+  }
+  if(write(fd, obuf, strlen(obuf)) < 0){
+    fprintf(2, "zcping: send() failed\n");
+    exit(1);
+  }
+  if((cc = recvzc(fd, page, &data)) < 0){
+    fprintf(2, "zcping: recvzc() failed\n");
+    exit(1);
+  }
+  if(data < page || data + cc > page + 4096 ||
+     cc != strlen("this is the host!") ||
+     memcmp(data, "this is the host!", cc) != 0){
+    fprintf(2, "zcping didn't receive correct payload\n");
+    exit(1);
+  }
+  if(recvzcdone(fd, page) != 0 || recvzcdone(fd, page) != -1){
+    fprintf(2, "zcping: recvzcdone() failed\n");
+    exit(1);
+  }
+  // the heap page is back, and writable
+  page[0] = 1;
+  close(fd);
+}
+
+//
+// send several pings to a socket with room for one response, and
+// check that the others are counted as dropped.
+//
+static void
+rcvbufping(uint16 sport, uint16 dport)
+{
+  int fd;
+  char *obuf = "a message from xv6!";
+  struct sockstat st;
+  uint32 dst;
+
+  dst = (10 << 24) | (0 << 16) | (2 << 8) | (2 << 0);
+  if((fd = connect(dst, sport, dport)) < 0){
+    fprintf(2, "rcvbufping: connect() failed\n");
+    exit(1);
+  }
+  if(fcntl(fd, F_SETRCVBUF, 1) != 4096 || fcntl(fd, F_GETRCVBUF, 0) != 4096){
+    fprintf(2, "rcvbufping: F_SETRCVBUF failed\n");
+    exit(1);
+  }
+  for(int i = 0; i < 4; i++){
+    if(write(fd, obuf, strlen(obuf)) < 0){
+      fprintf(2, "rcvbufping: send() failed\n");
+      exit(1);
+    }
+  }
+  // give the host time to answer them all
+  sleep(10);
+  if(sockstat(fd, &st) < 0 || st.rxpackets != 1 || st.drops != 3 ||
+     st.queued != strlen("this is the host!")){
+    fprintf(2, "rcvbufping: wrong counters\n");
+    exit(1);
+  }
+  close(fd);
+  if(sockstat(-1, &st) < 0 || st.drops < 3){
+    fprintf(2, "rcvbufping: wrong global counters\n");
+    exit(1);
+  }
+}
+
 // Encode a DNS name
 static void
 encode_qname(char *qn, char *host)
@@ -273,6 +411,18 @@ main(int argc, char *argv[])
     ping(2000, dport, 1);
   printf("OK\n");
   
+  printf("testing batched pings: ");
+  mping(2000, dport, 8);
+  printf("OK\n");
+
+  printf("testing zero-copy ping: ");
+  zcping(2000, dport);
+  printf("OK\n");
+
+  printf("testing receive buffer limit: ");
+  rcvbufping(2000, dport);
+  printf("OK\n");
+
   printf("testing multi-process pings: ");
   for (i = 0; i < 10; i++){
     int pid = fork();
@@ -6,12 +6,14 @@
 
 void ugetpid_test();
 void pgaccess_test();
+void wsscan_test();
 
 int
 main(int argc, char *argv[])
 {
   ugetpid_test();
   pgaccess_test();
+  wsscan_test();
   printf("pgtbltest: all tests succeeded\n");
   exit(0);
 }
@@ -68,3 +70,57 @@ pgaccess_test()
   free(buf);
   printf("pgaccess_test: OK\n");
 }
+
+void
+wsscan_test()
+{
+  enum { N = 20000 };
+  static uint64 abits[N/64 + 1], dbits[N/64 + 1];
+  char *buf, *top;
+  int i;
+  volatile char c;
+
+  printf("wsscan_test starting\n");
+  testname = "wsscan_test";
+  top = sbrk(0);
+  buf = (char *)(((uint64)top + PGSIZE - 1) & ~(uint64)(PGSIZE - 1));
+  if (sbrk(buf - top + N * PGSIZE) == (char *)-1)
+    err("sbrk failed");
+
+  // nothing in the range has been touched yet.
+  if (wsscan(buf, N, abits, dbits, 0) < 0)
+    err("wsscan failed");
+  for (i = 0; i < N/64 + 1; i++) {
+    if (abits[i] || dbits[i])
+      err("untouched pages reported");
+  }
+
+  c = buf[PGSIZE * 5];
+  buf[PGSIZE * 7000] = 1;
+  buf[PGSIZE * (N - 1)] = 1;
+  (void)c;
+  if (wsscan(buf, N, abits, dbits, WS_CLEAR_ACCESSED | WS_CLEAR_DIRTY) < 0)
+    err("wsscan failed");
+  for (i = 0; i < N; i++) {
+    int a = (abits[i / 64] >> (i % 64)) & 1;
+    int d = (dbits[i / 64] >> (i % 64)) & 1;
+    if (a != (i == 5 || i == 7000 || i == N - 1))
+      err("incorrect accessed bits");
+    if (d != (i == 7000 || i == N - 1))
+      err("incorrect dirty bits");
+  }
+
+  // the bits were cleared as they were read.
+  if (wsscan(buf, N, abits, 0, 0) < 0)
+    err("wsscan failed");
+  for (i = 0; i < N/64 + 1; i++) {
+    if (abits[i])
+      err("accessed bits not cleared");
+  }
+
+  if (wsscan(buf + 1, 1, abits, dbits, 0) != -1)
+    err("wsscan allowed an unaligned address");
+
+  sbrk(-(sbrk(0) - top));
+  printf("wsscan_test: OK\n");
+}
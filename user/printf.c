@@ -1,15 +1,158 @@
 #include "kernel/types.h"
 #include "kernel/stat.h"
+#include "kernel/param.h"
 #include "user/user.h"
 
 #include <stdarg.h>
 
 static char digits[] = "0123456789ABCDEF";
 
+// Buffered output, one buffer per fd, so that printf() makes one
+// write() per line or per buffer rather than one per character. A
+// device such as the console is flushed at the end of each printf()
+// that printed a newline, fd 2 at the end of every printf(), and
+// anything else when its buffer fills. fork(), exec(), spawn() and
+// exit() call flushall() first, so nothing is printed twice or lost.
+// How an fd is buffered is decided the first time it is printed to,
+// and close() flushes the buffer and forgets it, so that whatever is
+// opened in the fd's place next is buffered as suits it.
+//
+// Threads made with clone() share the buffers, so each has a lock,
+// held for a whole printf(), which also keeps two threads' lines
+// from being mixed up. With uthread's preemptive threads, preemption
+// is off while it is held, as in malloc().
+#define OBUFSZ 1024
+
+#define OBUF_NONE 1   // flushed after every printf()
+#define OBUF_LINE 2   // flushed after a printf() with a newline
+#define OBUF_FULL 3   // flushed when full
+
+static struct obuf {
+  int  lock;          // 0 free, 1 held, 2 held with waiters
+  int  mode;          // OBUF_*, or 0 until the fd is first printed to
+  int  n;             // bytes in buf
+  int  nl;            // buf holds a newline
+  char buf[OBUFSZ];
+} obufs[NOFILE];
+
+// uthread's, if the program has it.
+extern void thread_preempt_off(void) __attribute__((weak));
+extern void thread_preempt_on(void) __attribute__((weak));
+
+static void
+obuflock(struct obuf *b)
+{
+  int c;
+
+  if(thread_preempt_off)
+    thread_preempt_off();
+  if((c = __sync_val_compare_and_swap(&b->lock, 0, 1)) == 0)
+    return;
+  if(c != 2)
+    c = __sync_lock_test_and_set(&b->lock, 2);
+  while(c != 0){
+    futex_wait(&b->lock, 2);
+    c = __sync_lock_test_and_set(&b->lock, 2);
+  }
+}
+
+static void
+obufunlock(struct obuf *b)
+{
+  if(__sync_fetch_and_sub(&b->lock, 1) != 1){
+    __atomic_store_n(&b->lock, 0, __ATOMIC_RELEASE);
+    futex_wake(&b->lock, 1);
+  }
+  if(thread_preempt_on)
+    thread_preempt_on();
+}
+
+// Write out b, fd's buffer, whose lock the caller holds.
+static void
+obufflush(int fd, struct obuf *b)
+{
+  int off, cc;
+
+  for(off = 0; off < b->n; off += cc){
+    if((cc = write(fd, b->buf + off, b->n - off)) <= 0)
+      break;
+  }
+  b->n = 0;
+  b->nl = 0;
+}
+
+void
+fflush(int fd)
+{
+  struct obuf *b;
+
+  if(fd < 0 || fd >= NOFILE)
+    return;
+  b = &obufs[fd];
+  obuflock(b);
+  obufflush(fd, b);
+  obufunlock(b);
+}
+
+void
+flushall(void)
+{
+  for(int fd = 0; fd < NOFILE; fd++)
+    if(__atomic_load_n(&obufs[fd].n, __ATOMIC_RELAXED))
+      fflush(fd);
+}
+
+// Called by close() before it closes fd.
+void
+obufclose(int fd)
+{
+  struct obuf *b;
+
+  if(fd < 0 || fd >= NOFILE)
+    return;
+  b = &obufs[fd];
+  obuflock(b);
+  obufflush(fd, b);
+  b->mode = 0;
+  obufunlock(b);
+}
+
 static void
 putc(int fd, char c)
 {
-  write(fd, &c, 1);
+  struct obuf *b;
+  struct stat st;
+
+  if(fd < 0 || fd >= NOFILE){
+    write(fd, &c, 1);
+    return;
+  }
+
+  b = &obufs[fd];
+  if(b->mode == 0){
+    if(fd == 2 || fstat(fd, &st) < 0)
+      b->mode = OBUF_NONE;
+    else
+      b->mode = st.type == T_DEVICE ? OBUF_LINE : OBUF_FULL;
+  }
+  if(b->n >= OBUFSZ)
+    obufflush(fd, b);
+  b->buf[b->n++] = c;
+  if(c == '\n')
+    b->nl = 1;
+}
+
+// The end of a printf() to fd.
+static void
+putend(int fd)
+{
+  struct obuf *b;
+
+  if(fd < 0 || fd >= NOFILE)
+    return;
+  b = &obufs[fd];
+  if(b->mode == OBUF_NONE || (b->mode == OBUF_LINE && b->nl))
+    obufflush(fd, b);
 }
 
 static void
@@ -54,6 +197,8 @@ vprintf(int fd, const char *fmt, va_list ap)
   char *s;
   int c, i, state;
 
+  if(fd >= 0 && fd < NOFILE)
+    obuflock(&obufs[fd]);
   state = 0;
   for(i = 0; fmt[i]; i++){
     c = fmt[i] & 0xff;
@@ -92,6 +237,61 @@ vprintf(int fd, const char *fmt, va_list ap)
       state = 0;
     }
   }
+  putend(fd);
+  if(fd >= 0 && fd < NOFILE)
+    obufunlock(&obufs[fd]);
+}
+
+// Buffered input, for reading a file a character or a line at a time
+// without a read() for each character. Each fd's buffer reads ahead,
+// so a program shouldn't mix these with read() on the same fd.
+#define IBUFSZ 512
+
+static struct ibuf {
+  int  n;             // bytes in buf
+  int  off;           // of which this many have been handed out
+  char buf[IBUFSZ];
+} ibufs[NOFILE];
+
+// The next character from fd, or -1 at end of file or on an error.
+int
+fgetc(int fd)
+{
+  struct ibuf *b;
+  char c;
+
+  if(fd < 0 || fd >= NOFILE)
+    return read(fd, &c, 1) == 1 ? (uchar)c : -1;
+
+  b = &ibufs[fd];
+  if(b->off == b->n){
+    // a prompt may still be waiting in an output buffer
+    flushall();
+    if((b->n = read(fd, b->buf, IBUFSZ)) <= 0){
+      b->n = b->off = 0;
+      return -1;
+    }
+    b->off = 0;
+  }
+  return (uchar)b->buf[b->off++];
+}
+
+// Read a line from fd into buf, like gets(), keeping the newline.
+// Returns buf, or 0 at end of file with nothing read.
+char*
+fgets(char *buf, int max, int fd)
+{
+  int i, c;
+
+  for(i = 0; i+1 < max; ){
+    if((c = fgetc(fd)) < 0)
+      break;
+    buf[i++] = c;
+    if(c == '\n' || c == '\r')
+      break;
+  }
+  buf[i] = '\0';
+  return i > 0 ? buf : 0;
 }
 
 void
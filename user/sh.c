@@ -3,6 +3,7 @@
 #include "kernel/types.h"
 #include "user/user.h"
 #include "kernel/fcntl.h"
+#include "kernel/spawn.h"
 
 // Parsed command representation
 #define EXEC  1
@@ -53,6 +54,8 @@ int fork1(void);  // Fork but panics on failure.
 void panic(char*);
 struct cmd *parsecmd(char*);
 void runcmd(struct cmd*) __attribute__((noreturn));
+int spawncmd(struct cmd*, struct spawnfd*, int);
+int simplecmd(char*);
 
 // Execute cmd.  Never returns.
 void
@@ -102,14 +105,20 @@ runcmd(struct cmd *cmd)
     pcmd = (struct pipecmd*)cmd;
     if(pipe(p) < 0)
       panic("pipe");
-    if(fork1() == 0){
+    struct spawnfd left[] = {
+      {SPAWN_DUP2, p[1], 1}, {SPAWN_CLOSE, p[0]}, {SPAWN_CLOSE, p[1]},
+    };
+    struct spawnfd right[] = {
+      {SPAWN_DUP2, p[0], 0}, {SPAWN_CLOSE, p[0]}, {SPAWN_CLOSE, p[1]},
+    };
+    if(!spawncmd(pcmd->left, left, 3) && fork1() == 0){
       close(1);
       dup(p[1]);
       close(p[0]);
       close(p[1]);
       runcmd(pcmd->left);
     }
-    if(fork1() == 0){
+    if(!spawncmd(pcmd->right, right, 3) && fork1() == 0){
       close(0);
       dup(p[0]);
       close(p[0]);
@@ -165,7 +174,12 @@ main(void)
         fprintf(2, "cannot cd %s\n", buf+3);
       continue;
     }
-    if(fork1() == 0)
+    if(simplecmd(buf)){
+      // no need to copy the shell just to replace the copy.
+      struct cmd *cmd = parsecmd(buf);
+      spawncmd(cmd, 0, 0);
+      free(cmd);
+    } else if(fork1() == 0)
       runcmd(parsecmd(buf));
     wait(0);
   }
@@ -190,6 +204,25 @@ fork1(void)
   return pid;
 }
 
+// Start cmd with spawn() rather than fork() and exec(), if it is a
+// plain command, with the file actions in acts. Returns 1 if it was
+// plain, whether or not it could be started, and 0 if it needs
+// runcmd() in a child instead.
+int
+spawncmd(struct cmd *cmd, struct spawnfd *acts, int n)
+{
+  struct execcmd *ecmd;
+
+  if(cmd == 0 || cmd->type != EXEC)
+    return 0;
+  ecmd = (struct execcmd*)cmd;
+  if(ecmd->argv[0] == 0)
+    return 1;
+  if(spawn(ecmd->argv[0], ecmd->argv, acts, n) < 0)
+    fprintf(2, "exec %s failed\n", ecmd->argv[0]);
+  return 1;
+}
+
 //PAGEBREAK!
 // Constructors
 
@@ -263,6 +296,23 @@ backcmd(struct cmd *subcmd)
 char whitespace[] = " \t\r\n\v";
 char symbols[] = "<|>&;()";
 
+// Whether buf is a plain command, which parsecmd() can't fail on,
+// so that the shell itself can parse it without risk of exiting.
+int
+simplecmd(char *buf)
+{
+  int words = 0;
+  char *s;
+
+  for(s = buf; *s; s++){
+    if(strchr(symbols, *s))
+      return 0;
+    if(!strchr(whitespace, *s) && (s == buf || strchr(whitespace, s[-1])))
+      words++;
+  }
+  return words < MAXARGS;
+}
+
 int
 gettoken(char **ps, char *es, char **q, char **eq)
 {
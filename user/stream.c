@@ -0,0 +1,171 @@
+// Streaming input for programs that scan their input once, like
+// cat, wc and grep. A regular file bigger than the read buffer is
+// mapped a window at a time, so scanning it costs page faults
+// rather than a read() per buffer; small files, pipes and the
+// console are read into a buffer. Either way the caller is handed
+// contiguous spans that it must not write to, and that last until
+// its next call.
+//
+// A mapped file is read from its start, whatever fd's offset, and
+// fd's offset is left alone.
+
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "kernel/fcntl.h"
+#include "kernel/riscv.h"
+#include "user/user.h"
+
+#define SBUFSZ  (64*1024)       // read buffer, and the smallest file mapped
+#define SWINDOW (1024*1024)     // bytes of a file mapped at a time
+
+struct stream {
+  int fd;
+  int map;                      // whether fd is mapped rather than read
+  uint64 size;                  // size of a mapped file
+  uint64 off;                   // file offset of the next byte to hand out
+  char *win;                    // the mapped window, or 0
+  uint64 winlen;
+  char *buf;                    // the read buffer
+  int n;                        // bytes in buf
+  int pos;                      // bytes of buf handed out
+  int eof;
+};
+
+struct stream*
+sopen(int fd)
+{
+  struct stream *s;
+  struct stat st;
+
+  if((s = malloc(sizeof(*s))) == 0)
+    return 0;
+  memset(s, 0, sizeof(*s));
+  s->fd = fd;
+  if(fstat(fd, &st) == 0 && st.type == T_FILE && st.size > SBUFSZ){
+    s->map = 1;
+    s->size = st.size;
+  }
+  return s;
+}
+
+// Map the window starting at the page holding s->off, and hand out
+// from s->off to its end, or with lines to just after its last
+// newline, unless that would leave nothing.
+static int
+mapspan(struct stream *s, char **p, int lines)
+{
+  uint64 start, len;
+  char *w, *e, *q;
+
+  if(s->win)
+    munmap(s->win, s->winlen);
+  s->win = 0;
+  if(s->off >= s->size)
+    return 0;
+
+  start = PGROUNDDOWN(s->off);
+  len = s->size - start;
+  if(len > SWINDOW)
+    len = SWINDOW;
+  w = mmap(0, len, PROT_READ, MAP_PRIVATE, s->fd, start);
+  if(w == (char*)-1)
+    return -1;
+  madvise(w, len, MADV_SEQUENTIAL);
+  s->win = w;
+  s->winlen = len;
+
+  *p = w + (s->off - start);
+  e = w + len;
+  if(lines && start + len < s->size){
+    for(q = e; q > *p && q[-1] != '\n'; q--)
+      ;
+    if(q > *p)
+      e = q;
+  }
+  s->off += e - *p;
+  return e - *p;
+}
+
+// Read into the buffer after what is left from last time, until
+// there's a span to hand out, the buffer is full, or end of file.
+static int
+readspan(struct stream *s, char **p, int lines)
+{
+  int r;
+  char *q;
+
+  if(s->buf == 0 && (s->buf = malloc(SBUFSZ)) == 0)
+    return -1;
+  if(s->pos > 0){
+    memmove(s->buf, s->buf + s->pos, s->n - s->pos);
+    s->n -= s->pos;
+    s->pos = 0;
+  }
+
+  for(;;){
+    if(s->n > 0 && !lines){
+      s->pos = s->n;
+      break;
+    }
+    if(s->n > 0){
+      for(q = s->buf + s->n; q > s->buf && q[-1] != '\n'; q--)
+        ;
+      if(q > s->buf){
+        s->pos = q - s->buf;
+        break;
+      }
+    }
+    if(s->eof || s->n == SBUFSZ){
+      s->pos = s->n;
+      break;
+    }
+    if((r = read(s->fd, s->buf + s->n, SBUFSZ - s->n)) < 0)
+      return -1;
+    if(r == 0)
+      s->eof = 1;
+    s->n += r;
+  }
+
+  *p = s->buf;
+  return s->pos;
+}
+
+static int
+span(struct stream *s, char **p, int lines)
+{
+  int n;
+
+  if(s->map){
+    // the file can only be read instead if none of it was mapped
+    if((n = mapspan(s, p, lines)) >= 0 || s->off > 0)
+      return n;
+    s->map = 0;
+  }
+  return readspan(s, p, lines);
+}
+
+// The next span of input, returning its length, 0 at end of file,
+// or -1 on error.
+int
+sread(struct stream *s, char **p)
+{
+  return span(s, p, 0);
+}
+
+// Like sread(), but the span ends just after a newline unless it
+// ends the file, or a line is too long to fit in one span.
+int
+sreadln(struct stream *s, char **p)
+{
+  return span(s, p, 1);
+}
+
+// Free s, without closing its file.
+void
+sclose(struct stream *s)
+{
+  if(s->win)
+    munmap(s->win, s->winlen);
+  free(s->buf);
+  free(s);
+}
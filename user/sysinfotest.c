@@ -1,4 +1,5 @@
 #include "kernel/types.h"
+#include "kernel/param.h"
 #include "kernel/riscv.h"
 #include "kernel/sysinfo.h"
 #include "user/user.h"
@@ -141,6 +142,28 @@ void testbad() {
   }
 }
 
+// the caller is running, so it counts in nrun, and after a busy
+// stretch longer than the 5 seconds between load average updates,
+// the 1-minute average can't be 0.
+void testload() {
+  struct sysinfo info;
+  uint t0;
+
+  sinfo(&info);
+  if(info.nrun < 1){
+    printf("sysinfotest: FAIL nrun is %d\n", info.nrun);
+    exit(1);
+  }
+  t0 = uptime();
+  while(uptime() - t0 < 6*TICKHZ)
+    ;
+  sinfo(&info);
+  if(info.loadavg[0] == 0){
+    printf("sysinfotest: FAIL loadavg is 0 after a busy loop\n");
+    exit(1);
+  }
+}
+
 int
 main(int argc, char *argv[])
 {
@@ -148,6 +171,7 @@ main(int argc, char *argv[])
   testcall();
   testmem();
   testproc();
+  testload();
   printf("sysinfotest: OK\n");
   exit(0);
 }
@@ -0,0 +1,64 @@
+#include "kernel/param.h"
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "kernel/sysprof.h"
+#include "user/user.h"
+
+// sysprof [-a] command: run command, then print how many of each
+// system call it made and how long they took, most time first. With
+// -a, count every process's system calls while command runs.
+
+struct sysprof st[NSYSPROF];
+
+int
+main(int argc, char *argv[])
+{
+  int all = 0, pid, xstatus;
+  char **nargv;
+
+  if(argc > 1 && strcmp(argv[1], "-a") == 0)
+    all = 1;
+  nargv = argv + 1 + all;
+  if(nargv[0] == 0){
+    fprintf(2, "Usage: %s [-a] command\n", argv[0]);
+    exit(1);
+  }
+
+  if(all && sysprof(0, 0) < 0){
+    fprintf(2, "%s: sysprof failed\n", argv[0]);
+    exit(1);
+  }
+  if((pid = fork()) < 0){
+    fprintf(2, "%s: fork failed\n", argv[0]);
+    exit(1);
+  }
+  if(pid == 0){
+    if(!all)
+      sysprof(getpid(), 0);
+    exec(nargv[0], nargv);
+    fprintf(2, "%s: exec %s failed\n", argv[0], nargv[0]);
+    exit(1);
+  }
+  wait(&xstatus);
+  if(sysprof(-1, st) < 0){
+    fprintf(2, "%s: sysprof failed\n", argv[0]);
+    exit(1);
+  }
+
+  printf("syscall          calls    ticks  avg  log2 ticks histogram\n");
+  for(;;){
+    struct sysprof *top = 0;
+    for(int i = 0; i < NSYSPROF; i++)
+      if(st[i].n > 0 && (top == 0 || st[i].time > top->time))
+        top = &st[i];
+    if(top == 0)
+      break;
+    printf("%s\t%d\t%d\t%d\t", top->name, (int)top->n, (int)top->time,
+           (int)(top->time / top->n));
+    for(int b = 0; b < NSYSHIST; b++)
+      printf(" %d", (int)top->hist[b]);
+    printf("\n");
+    top->n = 0;
+  }
+  exit(xstatus);
+}
@@ -0,0 +1,37 @@
+#include "kernel/param.h"
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "kernel/rusage.h"
+#include "user/user.h"
+
+// time command: run command, then print the time it took and the
+// resources it and its children used.
+
+int
+main(int argc, char *argv[])
+{
+  struct rusage ru;
+  int pid, xstatus;
+
+  if(argc < 2){
+    fprintf(2, "Usage: %s command\n", argv[0]);
+    exit(1);
+  }
+
+  uint t0 = uptime();
+  if((pid = spawn(argv[1], argv + 1, 0, 0)) < 0){
+    fprintf(2, "%s: cannot run %s\n", argv[0], argv[1]);
+    exit(1);
+  }
+  if(waitrusage(&xstatus, &ru) != pid){
+    fprintf(2, "%s: waitrusage failed\n", argv[0]);
+    exit(1);
+  }
+  uint t1 = uptime();
+
+  printf("real %dms user %dms sys %dms\n", (t1 - t0) * 1000 / TICKHZ,
+         (int)(ru.utime / 1000), (int)(ru.stime / 1000));
+  printf("faults %d in %d out %d blocks, switches %d voluntary %d involuntary\n",
+         (int)ru.minflt, (int)ru.inblock, (int)ru.oublock, (int)ru.nvcsw, (int)ru.nivcsw);
+  exit(xstatus);
+}
@@ -66,12 +66,18 @@ strchr(const char *s, char c)
   return 0;
 }
 
+// printf.c's, if the program has it.
+extern void flushall(void) __attribute__((weak));
+
 char*
 gets(char *buf, int max)
 {
   int i, cc;
   char c;
 
+  // a prompt may still be waiting in printf()'s buffers
+  if(flushall)
+    flushall();
   for(i=0; i+1 < max; ){
     cc = read(0, &c, 1);
     if(cc < 1)
@@ -155,3 +161,43 @@ ugetpid(void)
   struct usyscall *u = (struct usyscall *)USYSCALL;
   return u->pid;
 }
+
+int
+ugetppid(void)
+{
+  struct usyscall *u = (struct usyscall *)USYSCALL;
+  return u->ppid;
+}
+
+// The CPU this process last started running on, which it may
+// already have left.
+int
+ugetcpu(void)
+{
+  struct usyscall *u = (struct usyscall *)USYSCALL;
+  return u->cpu;
+}
+
+// uptime() without a system call.
+uint
+uuptime(void)
+{
+  struct ushared *u = (struct ushared *)USHARED;
+  return __atomic_load_n(&u->ticks, __ATOMIC_ACQUIRE);
+}
+
+// sysinfo()'s freemem and nproc without a system call, as of the
+// last clock tick.
+uint64
+ufreemem(void)
+{
+  struct ushared *u = (struct ushared *)USHARED;
+  return __atomic_load_n(&u->freemem, __ATOMIC_RELAXED);
+}
+
+int
+unproc(void)
+{
+  struct ushared *u = (struct ushared *)USHARED;
+  return __atomic_load_n(&u->nproc, __ATOMIC_RELAXED);
+}
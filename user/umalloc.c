@@ -3,88 +3,387 @@
 #include "user/user.h"
 #include "kernel/param.h"
 
-// Memory allocator by Kernighan and Ritchie,
-// The C programming Language, 2nd ed.  Section 8.7.
+// Memory allocator.
+//
+// Blocks of up to MAXSMALL bytes are rounded up to one of NCLASS
+// size classes and carved out of slabs, runs of SLABPAGES pages
+// that each hold blocks of one class only, by bumping a pointer
+// through the slab. A freed small block goes on a free list for
+// its class, and is handed out again before more of a slab is.
+//
+// Each thread has a cache of such free lists of its own, found
+// through its tp register, which nothing else in user space uses;
+// exec() and clone() start a thread with tp zero. Small blocks
+// come from and go back to the cache without a lock, and only a
+// cache list that runs empty or grows past TCACHE_MAX moves a
+// batch of blocks to or from the shared lists, under heap.lock.
+//
+// Bigger blocks are runs of whole pages, with a header in their
+// first LARGEHDR bytes. Free runs are kept in address order, so
+// that neighbours merge, as in the allocator by Kernighan and
+// Ritchie, The C Programming Language, 2nd ed., Section 8.7.
+// Slabs are taken from the same runs, and all pages come from
+// sbrk().
+//
+// pagekind[] records for each heap page whether it holds small
+// blocks, and of which class, so that those need no header.
+//
+// A program with uthread's preemptive threads runs several threads
+// on one kernel thread, and so with one tp and one cache. malloc()
+// and free() turn preemption off, so that another of them can't
+// find the cache half-changed, or wait for heap.lock on the kernel
+// thread that the holder needs.
 
-typedef long Align;
+#define PAGE        4096
+#define MAXHEAP     (256*1024*1024)  // most heap that malloc() manages
+#define NPAGEKIND   (MAXHEAP / PAGE)
+#define MINGROW     16               // fewest pages to sbrk() at once
+#define MAXSMALL    2048
+#define NCLASS      24
+#define SLABPAGES   4
+#define BATCH       16               // blocks to move to or from a cache at once
+#define TCACHE_MAX  64               // most free blocks of a class in a cache
+#define NTCACHE     NPROC
+#define LARGEHDR    16               // keeps large blocks 16-byte aligned
 
-union header {
-  struct {
-    union header *ptr;
-    uint size;
-  } s;
-  Align x;
+#define KIND_NONE   0     // not the first page of a block
+#define KIND_LARGE  0xff  // first page of a large block
+                          // otherwise 1 + the class of a slab page
+
+static const ushort classsize[NCLASS] = {
+  16, 32, 48, 64, 80, 96, 112, 128,
+  160, 192, 224, 256, 320, 384, 448, 512,
+  640, 768, 896, 1024, 1280, 1536, 1792, 2048,
 };
 
-typedef union header Header;
+struct block {
+  struct block *next;
+};
 
-static Header base;
-static Header *freep;
+// A free run of pages, or the header of a large block.
+struct run {
+  struct run *next;
+  uint64 npages;
+};
 
-void
-free(void *ap)
+struct tcache {
+  struct block *free[NCLASS];
+  int n[NCLASS];
+};
+
+static struct {
+  int lock;                  // 0 free, 1 held, 2 held with waiters
+  uchar *pagekind;           // one entry per page from base on
+  char *base;                // the first page malloc() got
+  struct run *runs;          // free runs, in address order
+  struct block *free[NCLASS];
+  char *bump[NCLASS];        // next unused block of the class's slab
+  char *end[NCLASS];         // end of that slab
+} heap;
+
+static struct tcache tcaches[NTCACHE];
+static int ntcache;
+
+static void
+lock(void)
+{
+  int c;
+
+  if((c = __sync_val_compare_and_swap(&heap.lock, 0, 1)) == 0)
+    return;
+  if(c != 2)
+    c = __sync_lock_test_and_set(&heap.lock, 2);
+  while(c != 0){
+    futex_wait(&heap.lock, 2);
+    c = __sync_lock_test_and_set(&heap.lock, 2);
+  }
+}
+
+static void
+unlock(void)
 {
-  Header *bp, *p;
-
-  bp = (Header*)ap - 1;
-  for(p = freep; !(bp > p && bp < p->s.ptr); p = p->s.ptr)
-    if(p >= p->s.ptr && (bp > p || bp < p->s.ptr))
-      break;
-  if(bp + bp->s.size == p->s.ptr){
-    bp->s.size += p->s.ptr->s.size;
-    bp->s.ptr = p->s.ptr->s.ptr;
-  } else
-    bp->s.ptr = p->s.ptr;
-  if(p + p->s.size == bp){
-    p->s.size += bp->s.size;
-    p->s.ptr = bp->s.ptr;
-  } else
-    p->s.ptr = bp;
-  freep = p;
+  if(__sync_fetch_and_sub(&heap.lock, 1) != 1){
+    __atomic_store_n(&heap.lock, 0, __ATOMIC_RELEASE);
+    futex_wake(&heap.lock, 1);
+  }
 }
 
-static Header*
-morecore(uint nu)
+// uthread's, if the program has it.
+extern void thread_preempt_off(void) __attribute__((weak));
+extern void thread_preempt_on(void) __attribute__((weak));
+
+// The calling thread's cache, or 0 if there are
+// more threads than caches.
+static struct tcache*
+mycache(void)
 {
-  char *p;
-  Header *hp;
+  struct tcache *tc;
+  int i;
 
-  if(nu < 4096)
-    nu = 4096;
-  p = sbrk(nu * sizeof(Header));
-  if(p == (char*)-1)
+  asm volatile("mv %0, tp" : "=r" (tc));
+  if(tc >= tcaches && tc < tcaches + NTCACHE)
+    return tc;
+  if(__atomic_load_n(&ntcache, __ATOMIC_RELAXED) >= NTCACHE)
     return 0;
-  hp = (Header*)p;
-  hp->s.size = nu;
-  free((void*)(hp + 1));
-  return freep;
+  if((i = __sync_fetch_and_add(&ntcache, 1)) >= NTCACHE)
+    return 0;
+  tc = &tcaches[i];
+  asm volatile("mv tp, %0" : : "r" (tc));
+  return tc;
 }
 
-void*
-malloc(uint nbytes)
+static int
+sizeclass(uint nbytes)
+{
+  int c;
+
+  if(nbytes <= 128)
+    return nbytes == 0 ? 0 : (nbytes - 1) / 16;
+  for(c = 8; classsize[c] < nbytes; c++)
+    ;
+  return c;
+}
+
+static uchar*
+kindof(void *p)
+{
+  return &heap.pagekind[((char*)p - heap.base) / PAGE];
+}
+
+// Put the n pages at p on the free runs, merging them
+// with their neighbours.
+static void
+pagefree(char *p, uint64 n)
+{
+  struct run *r, *prev, **pp;
+
+  r = (struct run*)p;
+  prev = 0;
+  for(pp = &heap.runs; *pp && *pp < r; pp = &(*pp)->next)
+    prev = *pp;
+  r->npages = n;
+  r->next = *pp;
+  if(r->next && p + n * PAGE == (char*)r->next){
+    r->npages += r->next->npages;
+    r->next = r->next->next;
+  }
+  *pp = r;
+  if(prev && (char*)prev + prev->npages * PAGE == p){
+    prev->npages += r->npages;
+    prev->next = r->next;
+  }
+}
+
+// sbrk() n more pages, page aligned. Returns 0 if
+// the kernel or pagekind[] has no room for them.
+static char*
+growheap(uint64 n)
 {
-  Header *p, *prevp;
-  uint nunits;
+  char *p;
+  uint64 pad;
 
-  nunits = (nbytes + sizeof(Header) - 1)/sizeof(Header) + 1;
-  if((prevp = freep) == 0){
-    base.s.ptr = freep = prevp = &base;
-    base.s.size = 0;
+  if(heap.pagekind == 0){
+    // sbrk() maps pages lazily, so only the
+    // parts of pagekind[] in use take memory.
+    if((p = sbrk(NPAGEKIND)) == (char*)-1)
+      return 0;
+    heap.pagekind = (uchar*)p;
+    heap.base = p + NPAGEKIND + (-(uint64)(p + NPAGEKIND) % PAGE);
   }
-  for(p = prevp->s.ptr; ; prevp = p, p = p->s.ptr){
-    if(p->s.size >= nunits){
-      if(p->s.size == nunits)
-        prevp->s.ptr = p->s.ptr;
-      else {
-        p->s.size -= nunits;
-        p += p->s.size;
-        p->s.size = nunits;
+  p = sbrk(0);
+  pad = -(uint64)p % PAGE;
+  if(p + pad < heap.base || (p + pad - heap.base) / PAGE + n > NPAGEKIND)
+    return 0;
+  if(sbrk(pad + n * PAGE) == (char*)-1)
+    return 0;
+  return p + pad;
+}
+
+// Get at least n more pages onto the free runs.
+static int
+morecore(uint64 n)
+{
+  char *p;
+
+  if(n < MINGROW && (p = growheap(MINGROW)) != 0)
+    n = MINGROW;
+  else if((p = growheap(n)) == 0)
+    return -1;
+  pagefree(p, n);
+  return 0;
+}
+
+// Take n pages off the free runs. Called with heap.lock held.
+static char*
+pagealloc(uint64 n)
+{
+  struct run *r, **pp;
+
+  for(;;){
+    for(pp = &heap.runs; (r = *pp) != 0; pp = &r->next){
+      if(r->npages >= n){
+        if(r->npages == n)
+          *pp = r->next;
+        else {
+          r->npages -= n;
+          r = (struct run*)((char*)r + r->npages * PAGE);
+        }
+        return (char*)r;
       }
-      freep = prevp;
-      return (void*)(p + 1);
     }
-    if(p == freep)
-      if((p = morecore(nunits)) == 0)
-        return 0;
+    if(morecore(n) < 0)
+      return 0;
+  }
+}
+
+// Take up to want free blocks of class c onto *list, from
+// the shared free list or else from the class's slab.
+// Returns how many. Called with heap.lock held.
+static int
+refill(int c, struct block **list, int want)
+{
+  struct block *b;
+  char *p;
+  int got, i;
+
+  for(got = 0; got < want && heap.free[c]; got++){
+    b = heap.free[c];
+    heap.free[c] = b->next;
+    b->next = *list;
+    *list = b;
+  }
+  if(got > 0)
+    return got;
+
+  if(heap.bump[c] + classsize[c] > heap.end[c]){
+    if((p = pagealloc(SLABPAGES)) == 0)
+      return 0;
+    for(i = 0; i < SLABPAGES; i++)
+      *kindof(p + i * PAGE) = 1 + c;
+    heap.bump[c] = p;
+    heap.end[c] = p + SLABPAGES * PAGE;
+  }
+  for(; got < want && heap.bump[c] + classsize[c] <= heap.end[c]; got++){
+    b = (struct block*)heap.bump[c];
+    heap.bump[c] += classsize[c];
+    b->next = *list;
+    *list = b;
+  }
+  return got;
+}
+
+static void*
+largealloc(uint nbytes)
+{
+  struct run *r;
+
+  lock();
+  r = (struct run*)pagealloc(((uint64)nbytes + LARGEHDR + PAGE - 1) / PAGE);
+  if(r){
+    r->npages = ((uint64)nbytes + LARGEHDR + PAGE - 1) / PAGE;
+    *kindof(r) = KIND_LARGE;
+  }
+  unlock();
+  return r ? (char*)r + LARGEHDR : 0;
+}
+
+static void
+freeblock(void *ap)
+{
+  struct tcache *tc;
+  struct block *b, *last;
+  struct run *r;
+  int c, i;
+
+  if(*kindof(ap) == KIND_LARGE){
+    r = (struct run*)((char*)ap - LARGEHDR);
+    lock();
+    *kindof(r) = KIND_NONE;
+    pagefree((char*)r, r->npages);
+    unlock();
+    return;
+  }
+
+  c = *kindof(ap) - 1;
+  b = (struct block*)ap;
+  if((tc = mycache()) == 0){
+    lock();
+    b->next = heap.free[c];
+    heap.free[c] = b;
+    unlock();
+    return;
   }
+
+  b->next = tc->free[c];
+  tc->free[c] = b;
+  if(++tc->n[c] <= TCACHE_MAX)
+    return;
+
+  // give the blocks other threads may be short of back.
+  last = b;
+  for(i = 1; i < TCACHE_MAX / 2; i++)
+    last = last->next;
+  tc->free[c] = last->next;
+  tc->n[c] -= TCACHE_MAX / 2;
+  lock();
+  last->next = heap.free[c];
+  heap.free[c] = b;
+  unlock();
+}
+
+static void*
+allocblock(uint nbytes)
+{
+  struct tcache *tc;
+  struct block *b;
+  int c;
+
+  if(nbytes > MAXSMALL)
+    return largealloc(nbytes);
+
+  c = sizeclass(nbytes);
+  if((tc = mycache()) == 0){
+    b = 0;
+    lock();
+    refill(c, &b, 1);
+    unlock();
+    return b;
+  }
+
+  if(tc->free[c] == 0){
+    lock();
+    tc->n[c] = refill(c, &tc->free[c], BATCH);
+    unlock();
+    if(tc->n[c] == 0)
+      return 0;
+  }
+  b = tc->free[c];
+  tc->free[c] = b->next;
+  tc->n[c]--;
+  return b;
+}
+
+void
+free(void *ap)
+{
+  if(ap == 0)
+    return;
+  if(thread_preempt_off)
+    thread_preempt_off();
+  freeblock(ap);
+  if(thread_preempt_on)
+    thread_preempt_on();
+}
+
+void*
+malloc(uint nbytes)
+{
+  void *p;
+
+  if(thread_preempt_off)
+    thread_preempt_off();
+  p = allocblock(nbytes);
+  if(thread_preempt_on)
+    thread_preempt_on();
+  return p;
 }
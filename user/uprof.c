@@ -0,0 +1,217 @@
+#include "kernel/param.h"
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "kernel/uprof.h"
+#include "user/user.h"
+
+// uprof [-k] [-i ticks] command: run command, sampling its user pc
+// every ticks clock ticks (1 by default), then print the pcs seen
+// most, both where it was running ("self") and anywhere in the call
+// stack ("total"). Look the pcs up in the program's .asm file.
+//
+// With -k, sample the kernel on every CPU instead, while command
+// runs, and name the kernel function of each pc from /kernel.sym.
+
+#define NPC  512
+#define NTOP 10
+
+struct pccount {
+  uint64 pc;
+  int self;
+  int total;
+} counts[NPC];
+
+struct uprofsample samples[32];
+int nsamples;
+int kernel;
+
+static struct pccount*
+lookup(uint64 pc)
+{
+  uint h = (pc >> 1) % NPC;
+
+  for(int i = 0; i < NPC; i++, h = (h + 1) % NPC){
+    if(counts[h].pc == pc)
+      return &counts[h];
+    if(counts[h].pc == 0){
+      counts[h].pc = pc;
+      return &counts[h];
+    }
+  }
+  return 0;
+}
+
+static void
+count(struct uprofsample *s)
+{
+  struct pccount *c;
+
+  nsamples++;
+  for(int i = 0; i < UPROF_DEPTH && s->pc[i]; i++){
+    // a recursive function counts once per sample in total.
+    int seen = 0;
+    for(int j = 0; j < i; j++)
+      if(s->pc[j] == s->pc[i])
+        seen = 1;
+    if((c = lookup(s->pc[i])) == 0)
+      continue;
+    if(i == 0)
+      c->self++;
+    if(!seen)
+      c->total++;
+  }
+}
+
+// Find the name of the kernel symbol at or below pc in /kernel.sym,
+// whose lines are "address name", in no particular order.
+static void
+ksymof(uint64 pc, char *name, int n)
+{
+  static char buf[512];
+  char line[64];
+  uint64 best = 0;
+  int fd, m, len = 0;
+
+  strcpy(name, "?");
+  if((fd = open("/kernel.sym", 0)) < 0)
+    return;
+  while((m = read(fd, buf, sizeof(buf))) > 0){
+    for(int i = 0; i < m; i++){
+      if(buf[i] != '\n'){
+        if(len < sizeof(line) - 1)
+          line[len++] = buf[i];
+        continue;
+      }
+      line[len] = 0;
+      len = 0;
+
+      uint64 addr = 0;
+      char *s = line;
+      for(; *s && *s != ' '; s++){
+        int d = *s >= 'a' ? *s - 'a' + 10 : *s - '0';
+        addr = addr * 16 + d;
+      }
+      if(*s == ' ' && addr <= pc && addr > best){
+        best = addr;
+        strcpy(name, "");
+        for(int j = 0; j < n - 1 && s[j+1]; j++){
+          name[j] = s[j+1];
+          name[j+1] = 0;
+        }
+      }
+    }
+  }
+  close(fd);
+}
+
+static void
+top(char *what, int self)
+{
+  printf("--- top pcs by %s samples, of %d:\n", what, nsamples);
+  for(int t = 0; t < NTOP; t++){
+    struct pccount *best = 0;
+    for(int i = 0; i < NPC; i++){
+      int v = self ? counts[i].self : counts[i].total;
+      if(v > 0 && (best == 0 || v > (self ? best->self : best->total)))
+        best = &counts[i];
+    }
+    if(best == 0)
+      break;
+    if(kernel){
+      char name[32];
+      ksymof(best->pc, name, sizeof(name));
+      printf("%p %d %s\n", best->pc, self ? best->self : best->total, name);
+    } else {
+      printf("%p %d\n", best->pc, self ? best->self : best->total);
+    }
+    // take it out of the running until the next list.
+    if(self)
+      best->self = -best->self;
+    else
+      best->total = -best->total;
+  }
+  for(int i = 0; i < NPC; i++){
+    if(counts[i].self < 0)
+      counts[i].self = -counts[i].self;
+    if(counts[i].total < 0)
+      counts[i].total = -counts[i].total;
+  }
+}
+
+int
+main(int argc, char *argv[])
+{
+  int interval = 1, pid, n, fds[2];
+  char **nargv = argv + 1, c;
+
+  if(nargv[0] && strcmp(nargv[0], "-k") == 0){
+    kernel = 1;
+    nargv++;
+  }
+  if(nargv[0] && nargv[1] && strcmp(nargv[0], "-i") == 0){
+    interval = atoi(nargv[1]);
+    nargv += 2;
+  }
+  if(nargv[0] == 0 || interval <= 0){
+    fprintf(2, "Usage: %s [-k] [-i ticks] command\n", argv[0]);
+    exit(1);
+  }
+
+  if(kernel){
+    if(kprof(interval) < 0){
+      fprintf(2, "%s: kprof failed\n", argv[0]);
+      exit(1);
+    }
+    if((pid = fork()) == 0){
+      exec(nargv[0], nargv);
+      fprintf(2, "%s: exec %s failed\n", argv[0], nargv[0]);
+      exit(1);
+    }
+    wait(0);
+    kprof(0);
+    while((n = kprofread(samples, sizeof(samples) / sizeof(samples[0]))) > 0)
+      for(int i = 0; i < n; i++)
+        count(&samples[i]);
+    top("self", 1);
+    top("total", 0);
+    exit(0);
+  }
+
+  if(pipe(fds) < 0 || (pid = fork()) < 0){
+    fprintf(2, "%s: fork failed\n", argv[0]);
+    exit(1);
+  }
+  if(pid == 0){
+    close(fds[0]);
+    if(uprof(interval) < 0){
+      fprintf(2, "%s: uprof failed\n", argv[0]);
+      exit(1);
+    }
+    // tell the parent there are samples to read from now on.
+    write(fds[1], "x", 1);
+    close(fds[1]);
+    exec(nargv[0], nargv);
+    fprintf(2, "%s: exec %s failed\n", argv[0], nargv[0]);
+    exit(1);
+  }
+  close(fds[1]);
+  if(read(fds[0], &c, 1) != 1){
+    wait(0);
+    exit(1);
+  }
+  close(fds[0]);
+
+  // read samples as they come, until the command has exited and
+  // none are left.
+  while((n = uprofread(pid, samples, sizeof(samples) / sizeof(samples[0]))) >= 0){
+    for(int i = 0; i < n; i++)
+      count(&samples[i]);
+    if(n == 0)
+      sleep(1);
+  }
+  wait(0);
+
+  top("self", 1);
+  top("total", 0);
+  exit(0);
+}
@@ -1,7 +1,18 @@
 typedef unsigned long size_t;
 typedef long int      off_t;
 struct stat;
+struct statfs;
+struct dent;
 struct sysinfo;
+struct ring;
+struct sysprof;
+struct uprofsample;
+struct spawnfd;
+struct rusage;
+struct pollfd;
+struct mmsghdr;
+struct sockstat;
+struct stream;
 
 // system calls
 int fork(void);
@@ -35,6 +46,43 @@ int   munmap(void *addr, size_t len);
 int connect(uint32, uint16, uint16);
 int pgaccess(void *base, int len, void *mask);
 int backtrace(void);
+int hugepages(int enable);
+int msync(void *addr, size_t len, int flags);
+int wsscan(void *addr, int npages, uint64 *accessed, uint64 *dirty, int flags);
+int madvise(void *addr, size_t len, int advice);
+int getdents(int fd, struct dent *d, int n, int flags);
+int pread(int fd, void *buf, int n, off_t off);
+int pwrite(int fd, const void *buf, int n, off_t off);
+int statfs(const char *path, struct statfs *st);
+int sendfile(int out_fd, int in_fd, off_t off, int n);
+int setpriority(int pid, int prio);
+int sched_setaffinity(int pid, uint64 mask);
+int clone(void (*fn)(void*), void *arg, void *stack);
+int futex_wait(int *addr, int val);
+int futex_wake(int *addr, int n);
+int ring_enter(struct ring*);
+int sysprof(int pid, struct sysprof*);
+int usleep(int us);
+int ualarm(int us, void (*handler)());
+int uprof(int ticks);
+int uprofread(int pid, struct uprofsample*, int n);
+int kprof(int ticks);
+int kprofread(struct uprofsample*, int n);
+int spawn(const char*, char**, struct spawnfd*, int);
+int getrusage(int, struct rusage*);
+int waitrusage(int*, struct rusage*);
+int vmsplice(int, const void*, int);
+int fcntl(int, int, int);
+int poll(struct pollfd*, int, int);
+int recvmmsg(int, struct mmsghdr*, int);
+int sendmmsg(int, struct mmsghdr*, int);
+int recvzc(int, void*, char**);
+int recvzcdone(int, void*);
+int sockstat(int, struct sockstat*);
+uint64 sigdone(void);
+int ucounters(int mask);
+int hpmevent(int counter, uint64 event);
+uint64 hpmread(int counter);
 
 // ulib.c
 int stat(const char*, struct stat*);
@@ -44,6 +92,10 @@ char* strchr(const char*, char c);
 int strcmp(const char*, const char*);
 void fprintf(int, const char*, ...);
 void printf(const char*, ...);
+void fflush(int);
+void flushall(void);
+int fgetc(int);
+char* fgets(char*, int max, int);
 char* gets(char*, int max);
 uint strlen(const char*);
 void* memset(void*, int, uint);
@@ -54,3 +106,14 @@ int memcmp(const void *, const void *, uint);
 void *memcpy(void *, const void *, uint);
 int statistics(void*, int);
 int ugetpid(void);
+int ugetppid(void);
+int ugetcpu(void);
+uint uuptime(void);
+uint64 ufreemem(void);
+int unproc(void);
+
+// stream.c
+struct stream* sopen(int);
+int sread(struct stream*, char**);
+int sreadln(struct stream*, char**);
+void sclose(struct stream*);
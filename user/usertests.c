@@ -7,6 +7,13 @@
 #include "kernel/syscall.h"
 #include "kernel/memlayout.h"
 #include "kernel/riscv.h"
+#include "kernel/ring.h"
+#include "kernel/sysprof.h"
+#include "kernel/uprof.h"
+#include "kernel/spawn.h"
+#include "kernel/rusage.h"
+#include "kernel/poll.h"
+#include "kernel/sysinfo.h"
 
 //
 // Tests xv6 system calls.  usertests without arguments runs them all
@@ -994,221 +1001,1786 @@ forkfork(char *s)
   }
 }
 
+// more runnable processes than CPUs, some computing and some
+// yielding through pipes, so that run queues get long and
+// processes move between them; every one must get to finish.
+void
+runqueues(char *s)
+{
+  enum { N=12, ROUNDS=100 };
+  int fds[2], xstatus;
+  char c;
+
+  if(pipe(fds) != 0){
+    printf("%s: pipe failed\n", s);
+    exit(1);
+  }
+  for(int i = 0; i < N; i++){
+    int pid = fork();
+    if(pid < 0){
+      printf("%s: fork failed\n", s);
+      exit(1);
+    }
+    if(pid == 0){
+      if(i % 2){
+        volatile uint x = 0;
+        for(int j = 0; j < 2000000; j++)
+          x += j;
+      } else {
+        // pass a byte around those that ping-pong.
+        for(int j = 0; j < ROUNDS; j++){
+          if(write(fds[1], "x", 1) != 1 || read(fds[0], &c, 1) != 1)
+            exit(1);
+        }
+      }
+      exit(0);
+    }
+  }
+  for(int i = 0; i < N; i++){
+    wait(&xstatus);
+    if(xstatus != 0){
+      printf("%s: child failed\n", s);
+      exit(1);
+    }
+  }
+  close(fds[0]);
+  close(fds[1]);
+}
+
+// a low-priority compute job still finishes while a high-priority
+// one runs on the same CPU, and bad priorities are refused. with
+// MLFQ, the high-priority job gets more of the CPU, so it is the
+// first to be done with the same amount of work.
+void
+priorities(char *s)
+{
+  // each job runs for this many scheduling slices of CPU time.
+  enum { SLICES = 5 };
+  uint64 work = (uint64)SLICES * SLICETICKS * 1000000 / TICKHZ;
+  int pid[2], fds[2], xstatus, first = -1;
+  char c;
+#ifdef MLFQ
+  int mlfq = 1;
+#else
+  int mlfq = 0;
+#endif
+
+  if(setpriority(0, NPRIO) != -1 || setpriority(0, -1) != -1 || setpriority(1 << 30, 0) != -1){
+    printf("%s: setpriority accepted a bad argument\n", s);
+    exit(1);
+  }
+  if(pipe(fds) != 0){
+    printf("%s: pipe failed\n", s);
+    exit(1);
+  }
+  for(int i = 0; i < 2; i++){
+    if((pid[i] = fork()) < 0){
+      printf("%s: fork failed\n", s);
+      exit(1);
+    }
+    if(pid[i] == 0){
+      struct rusage ru;
+      volatile uint x = 0;
+
+      close(fds[1]);
+      if(setpriority(0, i == 0 ? NPRIO - 1 : 0) != 0 || sched_setaffinity(0, 1) != 0)
+        exit(1);
+      // start when the parent closes the pipe, so that neither
+      // job gets a head start.
+      read(fds[0], &c, 1);
+      do {
+        for(int j = 0; j < 10000; j++)
+          x += j;
+        getrusage(RUSAGE_SELF, &ru);
+      } while(ru.utime < work);
+      exit(0);
+    }
+  }
+  close(fds[0]);
+  close(fds[1]);
+  for(int i = 0; i < 2; i++){
+    int w = wait(&xstatus);
+    if(xstatus != 0){
+      printf("%s: child failed\n", s);
+      exit(1);
+    }
+    if(i == 0)
+      first = w;
+  }
+  if(mlfq && first != pid[1]){
+    printf("%s: low-priority job finished first\n", s);
+    exit(1);
+  }
+}
+
+// processes pinned to one CPU each, and one allowed on
+// two, all finish; masks with no running CPU are refused.
+void
+affinity(char *s)
+{
+  int xstatus;
+
+  if(sched_setaffinity(0, 0) != -1 || sched_setaffinity(0, 1UL << NCPU) != -1 ||
+     sched_setaffinity(1 << 30, 1) != -1){
+    printf("%s: sched_setaffinity accepted a bad argument\n", s);
+    exit(1);
+  }
+  for(int i = 0; i <= NCPU; i++){
+    int pid = fork();
+    if(pid < 0){
+      printf("%s: fork failed\n", s);
+      exit(1);
+    }
+    if(pid == 0){
+      if(sched_setaffinity(0, i < NCPU ? 1UL << i : 0x3) != 0)
+        exit(i == 0 ? 1 : 0);  // only CPU 0 need be running
+      volatile uint x = 0;
+      for(int j = 0; j < 1000000; j++)
+        x += j;
+      exit(0);
+    }
+  }
+  for(int i = 0; i <= NCPU; i++){
+    wait(&xstatus);
+    if(xstatus != 0){
+      printf("%s: child failed\n", s);
+      exit(1);
+    }
+  }
+}
+
+// processes that sleep on otherwise idle CPUs get woken up
+// on time, though those CPUs stop their timers.
+void
+idlewakeup(char *s)
+{
+  enum { N=4, ROUNDS=5 };
+  int xstatus, start;
+
+  start = uptime();
+  for(int i = 0; i < N; i++){
+    int pid = fork();
+    if(pid < 0){
+      printf("%s: fork failed\n", s);
+      exit(1);
+    }
+    if(pid == 0){
+      for(int j = 0; j < ROUNDS; j++)
+        sleep(1);
+      exit(0);
+    }
+  }
+  for(int i = 0; i < N; i++){
+    wait(&xstatus);
+    if(xstatus != 0){
+      printf("%s: child failed\n", s);
+      exit(1);
+    }
+  }
+  if(uptime() - start > 4 * ROUNDS){
+    printf("%s: sleeps took %d ticks\n", s, uptime() - start);
+    exit(1);
+  }
+}
+
+static volatile int clonecount;
+static volatile int clonefd;
+static char * volatile clonebrk;
+
+static void
+clonethread(void *arg)
+{
+  int id = (int)(uint64)arg;
+
+  for(int i = 0; i < 1000; i++)
+    __sync_fetch_and_add(&clonecount, 1);
+  if(id == 0){
+    clonefd = open("clonefile", O_CREATE|O_RDWR);
+  } else if(id == 1){
+    char *p = sbrk(PGSIZE);
+    if(p != (char*)-1){
+      p[0] = 'x';
+      clonebrk = p;
+    }
+  }
+  exit(0);
+}
+
+// threads made by clone() share memory, including what sbrk()
+// adds, and open files.
+void
+clonetest(char *s)
+{
+  enum { N=4 };
+  char *stacks[N];
+  int xstatus;
+
+  clonecount = 0;
+  clonefd = -1;
+  clonebrk = 0;
+  for(int i = 0; i < N; i++){
+    if((stacks[i] = malloc(PGSIZE)) == 0){
+      printf("%s: malloc failed\n", s);
+      exit(1);
+    }
+  }
+  for(int i = 0; i < N; i++){
+    if(clone(clonethread, (void*)(uint64)i, stacks[i] + PGSIZE) < 0){
+      printf("%s: clone failed\n", s);
+      exit(1);
+    }
+  }
+  for(int i = 0; i < N; i++){
+    if(wait(&xstatus) < 0 || xstatus != 0){
+      printf("%s: thread failed\n", s);
+      exit(1);
+    }
+  }
+  if(clonecount != N * 1000){
+    printf("%s: count %d, not %d\n", s, clonecount, N * 1000);
+    exit(1);
+  }
+  if(clonefd < 0 || write(clonefd, "a", 1) != 1){
+    printf("%s: file a thread opened isn't open\n", s);
+    exit(1);
+  }
+  close(clonefd);
+  unlink("clonefile");
+  if(clonebrk == 0 || clonebrk[0] != 'x'){
+    printf("%s: a thread's sbrk() isn't shared\n", s);
+    exit(1);
+  }
+  for(int i = 0; i < N; i++)
+    free(stacks[i]);
+}
+
+static int futexword;
+
+static void
+futexthread(void *arg)
+{
+  while(__atomic_load_n(&futexword, __ATOMIC_SEQ_CST) == 0)
+    futex_wait(&futexword, 0);
+  exit(0);
+}
+
+// threads sleeping in futex_wait() are woken by futex_wake(),
+// and a futex_wait() on a word that has changed returns at once.
+void
+futextest(char *s)
+{
+  enum { N=3 };
+  char *stacks[N];
+  int xstatus;
+
+  futexword = 0;
+  if(futex_wait(&futexword, 1) != -1){
+    printf("%s: futex_wait() slept on a changed word\n", s);
+    exit(1);
+  }
+  if(futex_wait((int*)((char*)&futexword + 1), 0) != -1){
+    printf("%s: futex_wait() accepted an unaligned word\n", s);
+    exit(1);
+  }
+  for(int i = 0; i < N; i++){
+    if((stacks[i] = malloc(PGSIZE)) == 0){
+      printf("%s: malloc failed\n", s);
+      exit(1);
+    }
+  }
+  for(int i = 0; i < N; i++){
+    if(clone(futexthread, 0, stacks[i] + PGSIZE) < 0){
+      printf("%s: clone failed\n", s);
+      exit(1);
+    }
+  }
+  // give the threads time to go to sleep.
+  sleep(2);
+  __atomic_store_n(&futexword, 1, __ATOMIC_SEQ_CST);
+  if(futex_wake(&futexword, N) < 0){
+    printf("%s: futex_wake failed\n", s);
+    exit(1);
+  }
+  for(int i = 0; i < N; i++){
+    if(wait(&xstatus) < 0 || xstatus != 0){
+      printf("%s: thread failed\n", s);
+      exit(1);
+    }
+  }
+  for(int i = 0; i < N; i++)
+    free(stacks[i]);
+}
+
+enum { MALLOCTHREADS=4, MALLOCLIVE=32 };
+static char *mallocblocks[MALLOCTHREADS][MALLOCLIVE];
+static uint mallocsizes[MALLOCTHREADS][MALLOCLIVE];
+
+static int
+mallocok(char *p, uint n, int c)
+{
+  for(uint i = 0; i < n; i++)
+    if(p[i] != c)
+      return 0;
+  return 1;
+}
+
+static void
+mallocthread(void *arg)
+{
+  int t = (int)(uint64)arg;
+  uint rnd = t + 1;
+
+  for(int i = 0; i < 2000; i++){
+    int k = i % MALLOCLIVE;
+    char *p = mallocblocks[t][k];
+
+    if(p){
+      if(!mallocok(p, mallocsizes[t][k], 'a' + t))
+        exit(1);
+      free(p);
+    }
+    rnd = rnd * 1103515245 + 12345;
+    uint n = (rnd >> 16) % (i % 8 == 0 ? 10000 : 600);
+    if((p = malloc(n)) == 0 || (uint64)p % 16 != 0)
+      exit(1);
+    memset(p, 'a' + t, n);
+    mallocblocks[t][k] = p;
+    mallocsizes[t][k] = n;
+  }
+  exit(0);
+}
+
+// threads malloc() and free() blocks of many sizes at once
+// without handing out the same memory twice, and may free
+// each other's blocks.
+void
+malloctest(char *s)
+{
+  char *stacks[MALLOCTHREADS];
+  int xstatus;
+
+  for(int i = 0; i < MALLOCTHREADS; i++){
+    if((stacks[i] = malloc(PGSIZE)) == 0){
+      printf("%s: malloc failed\n", s);
+      exit(1);
+    }
+  }
+  for(int i = 0; i < MALLOCTHREADS; i++){
+    if(clone(mallocthread, (void*)(uint64)i, stacks[i] + PGSIZE) < 0){
+      printf("%s: clone failed\n", s);
+      exit(1);
+    }
+  }
+  for(int i = 0; i < MALLOCTHREADS; i++){
+    if(wait(&xstatus) < 0 || xstatus != 0){
+      printf("%s: a thread's blocks were overwritten\n", s);
+      exit(1);
+    }
+  }
+  for(int t = 0; t < MALLOCTHREADS; t++){
+    for(int k = 0; k < MALLOCLIVE; k++){
+      if(!mallocok(mallocblocks[t][k], mallocsizes[t][k], 'a' + t)){
+        printf("%s: block overwritten\n", s);
+        exit(1);
+      }
+      free(mallocblocks[t][k]);
+    }
+  }
+  for(int i = 0; i < MALLOCTHREADS; i++)
+    free(stacks[i]);
+}
+
+// printf() to a file is buffered, and must all reach the file by
+// exit(); fgets() reads it back a line at a time.
+void
+printfbuf(char *s)
+{
+  enum { N=500 };
+  char line[32];
+  int fd, pid, xstatus, n;
+
+  unlink("printfbuf");
+  pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0){
+    close(1);
+    if(open("printfbuf", O_CREATE|O_WRONLY) != 1)
+      exit(1);
+    for(int i = 0; i < N; i++)
+      printf("line %d\n", i);
+    exit(0);
+  }
+  wait(&xstatus);
+  if(xstatus != 0){
+    printf("%s: child failed\n", s);
+    exit(1);
+  }
+
+  if((fd = open("printfbuf", O_RDONLY)) < 0){
+    printf("%s: open failed\n", s);
+    exit(1);
+  }
+  for(n = 0; fgets(line, sizeof(line), fd) != 0; n++){
+    if(memcmp(line, "line ", 5) != 0 || atoi(line + 5) != n){
+      printf("%s: line %d is %s\n", s, n, line);
+      exit(1);
+    }
+  }
+  close(fd);
+  unlink("printfbuf");
+  if(n != N){
+    printf("%s: %d lines, not %d\n", s, n, N);
+    exit(1);
+  }
+}
+
+// uuptime() reads the ticks the kernel publishes at USHARED,
+// which must keep up with uptime().
+void
+uuptimetest(char *s)
+{
+  uint t0 = uptime();
+  uint u = uuptime();
+  uint t1 = uptime();
+
+  if(u < t0 || u > t1){
+    printf("%s: uuptime %d not in [%d, %d]\n", s, u, t0, t1);
+    exit(1);
+  }
+  sleep(2);
+  if(uuptime() < t1 + 2){
+    printf("%s: uuptime didn't advance\n", s);
+    exit(1);
+  }
+}
+
+// the no-syscall accessors must agree with the system calls.
+void
+usyscalltest(char *s)
+{
+  int ppid = getpid();
+  int pid = fork();
+
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0){
+    if(ugetpid() != getpid() || ugetppid() != ppid){
+      printf("%s: ugetpid %d ugetppid %d\n", s, ugetpid(), ugetppid());
+      exit(1);
+    }
+    if(ugetcpu() < 0 || ugetcpu() >= NCPU){
+      printf("%s: ugetcpu %d\n", s, ugetcpu());
+      exit(1);
+    }
+    // wait for a tick to count this process.
+    sleep(1);
+    if(unproc() < 2 || ufreemem() == 0){
+      printf("%s: unproc %d ufreemem %d\n", s, unproc(), (int)ufreemem());
+      exit(1);
+    }
+    exit(0);
+  }
+  int xstatus;
+  wait(&xstatus);
+  if(xstatus != 0)
+    exit(1);
+}
+
+// queue several file operations and run them with one ring_enter().
+void
+ringtest(char *s)
+{
+  static struct ring r;
+  char out[8] = "ringabc", in[8];
+  int fd;
+
+  unlink("ringfile");
+  fd = open("ringfile", O_CREATE|O_RDWR);
+  if(fd < 0){
+    printf("%s: open failed\n", s);
+    exit(1);
+  }
+
+  struct sqe ops[] = {
+    {RING_WRITE, fd, (uint64)out, sizeof(out), 0, 1},
+    {RING_FSYNC, fd, 0, 0, 0, 2},
+    {RING_PREAD, fd, (uint64)in, sizeof(in), 0, 3},
+    {RING_READ, 99, (uint64)in, sizeof(in), 0, 4},
+    {RING_NOP, 0, 0, 0, 0, 5},
+  };
+  int want[] = {sizeof(out), 0, sizeof(in), -1, 0};
+  int n = sizeof(ops) / sizeof(ops[0]);
+
+  for(int i = 0; i < n; i++)
+    r.sq[r.sqtail++ % RINGSIZE] = ops[i];
+  if(ring_enter(&r) != n || r.sqhead != r.sqtail || r.cqtail != n){
+    printf("%s: ring_enter didn't run every submission\n", s);
+    exit(1);
+  }
+  for(int i = 0; i < n; i++){
+    struct cqe *c = &r.cq[r.cqhead++ % RINGSIZE];
+    if(c->data != i + 1 || c->res != want[i]){
+      printf("%s: completion %d: data %d res %d\n", s, i, (int)c->data, c->res);
+      exit(1);
+    }
+  }
+  if(memcmp(in, out, sizeof(in)) != 0){
+    printf("%s: pread got the wrong data\n", s);
+    exit(1);
+  }
+  if(ring_enter(&r) != 0 || ring_enter((struct ring *)0xffffffffffffff00ULL) != -1){
+    printf("%s: ring_enter of an empty or bad ring\n", s);
+    exit(1);
+  }
+  close(fd);
+  unlink("ringfile");
+}
+
+// sysprof() must count this process's system calls, and only those.
+void
+sysproftest(char *s)
+{
+  static struct sysprof st[NSYSPROF];
+  int pid;
+
+  if(sysprof(getpid(), 0) < 0){
+    printf("%s: sysprof failed\n", s);
+    exit(1);
+  }
+  for(int i = 0; i < 10; i++)
+    getpid();
+  if((pid = fork()) == 0){
+    for(int i = 0; i < 10; i++)
+      uptime();
+    exit(0);
+  }
+  wait(0);
+  if(sysprof(-1, st) < 0){
+    printf("%s: sysprof failed\n", s);
+    exit(1);
+  }
+  if(st[SYS_getpid].n != 10 || st[SYS_uptime].n != 0 || strcmp(st[SYS_getpid].name, "getpid") != 0){
+    printf("%s: getpid %d uptime %d\n", s, (int)st[SYS_getpid].n, (int)st[SYS_uptime].n);
+    exit(1);
+  }
+  uint64 total = 0;
+  for(int b = 0; b < NSYSHIST; b++)
+    total += st[SYS_getpid].hist[b];
+  if(total != 10){
+    printf("%s: histogram holds %d calls\n", s, (int)total);
+    exit(1);
+  }
+}
+
+// usleep() must sleep to its own deadline, not to whole clock ticks.
+void
+usleeptest(char *s)
+{
+  uint t0 = uptime();
+
+  for(int i = 0; i < 10; i++){
+    if(usleep(20000) < 0){
+      printf("%s: usleep failed\n", s);
+      exit(1);
+    }
+  }
+  // 200ms; sleeping a tick at a time would take ten ticks or more.
+  uint t = uptime() - t0;
+  if(t < 1 || t >= 10){
+    printf("%s: 10 usleep(20000)s took %d ticks\n", s, t);
+    exit(1);
+  }
+  if(usleep(-1) != -1){
+    printf("%s: usleep(-1) succeeded\n", s);
+    exit(1);
+  }
+}
+
+static volatile int ualarms;
+
+static void
+ualarmhandler(void)
+{
+  ualarms++;
+  sigreturn();
+}
+
+// a periodic ualarm() must keep calling its handler, and stop when
+// turned off.
+void
+ualarmtest(char *s)
+{
+  uint t0 = uptime();
+
+  ualarms = 0;
+  if(ualarm(10000, ualarmhandler) < 0){
+    printf("%s: ualarm failed\n", s);
+    exit(1);
+  }
+  while(ualarms < 5 && uptime() - t0 < 50)
+    ;
+  ualarm(0, 0);
+  if(ualarms < 5){
+    printf("%s: %d alarms in %d ticks\n", s, ualarms, uptime() - t0);
+    exit(1);
+  }
+  int n = ualarms;
+  usleep(50000);
+  if(ualarms != n){
+    printf("%s: alarm after ualarm(0)\n", s);
+    exit(1);
+  }
+}
+
+static int __attribute__((noinline))
+uprofspin(void)
+{
+  volatile int x = 0;
+  uint t0 = uptime();
+
+  while(uptime() - t0 < 5)
+    x++;
+  return x;
+}
+
+// uprof() must sample this process's pc while it runs in user
+// space, with the caller found through the frame pointer.
+void
+uproftest(char *s)
+{
+  static struct uprofsample samples[16];
+  int n, found = 0;
+
+  if(uprof(1) < 0){
+    printf("%s: uprof failed\n", s);
+    exit(1);
+  }
+  uprofspin();
+  uprof(0);
+  n = uprofread(getpid(), samples, 16);
+  if(n <= 0){
+    printf("%s: no samples\n", s);
+    exit(1);
+  }
+  for(int i = 0; i < n; i++){
+    // uprofspin() or uptime() is running, called from here.
+    for(int d = 1; d < UPROF_DEPTH; d++)
+      if(samples[i].pc[d] >= (uint64)uproftest && samples[i].pc[d] < (uint64)uproftest + 512)
+        found = 1;
+  }
+  if(!found){
+    printf("%s: no sample with uproftest() as a caller\n", s);
+    exit(1);
+  }
+  if(uprofread(getpid(), samples, 16) != 0 || uprofread(-1, samples, 16) != -1){
+    printf("%s: uprofread of read or missing samples\n", s);
+    exit(1);
+  }
+}
+
+// kprof() must sample kernel pcs while this process keeps the
+// kernel busy.
+void
+kproftest(char *s)
+{
+  static struct uprofsample samples[16];
+  int n;
+
+  if(kprof(1) < 0){
+    printf("%s: kprof failed\n", s);
+    exit(1);
+  }
+  uint t0 = uptime();
+  while(uptime() - t0 < 5)
+    getpid();
+  kprof(0);
+  n = kprofread(samples, 16);
+  if(n <= 0){
+    printf("%s: no samples\n", s);
+    exit(1);
+  }
+  for(int i = 0; i < n; i++){
+    if(samples[i].pc[0] < KERNBASE){
+      printf("%s: sample pc %p isn't in the kernel\n", s, samples[i].pc[0]);
+      exit(1);
+    }
+  }
+  // drain what's left for the next user.
+  while(kprofread(samples, 16) > 0)
+    ;
+}
+
+// spawn() must start the program with its file actions applied,
+// and leave the caller's own files alone.
+void
+spawntest(char *s)
+{
+  char *args[] = { "echo", "spawned", 0 };
+  char buf[16];
+  int fds[2], pid, xstatus, n;
+
+  if(pipe(fds) < 0){
+    printf("%s: pipe failed\n", s);
+    exit(1);
+  }
+  struct spawnfd acts[] = {
+    {SPAWN_DUP2, fds[1], 1}, {SPAWN_CLOSE, fds[0]}, {SPAWN_CLOSE, fds[1]},
+  };
+  struct spawnfd bad[] = { {SPAWN_CLOSE, 99} };
+
+  if(spawn("nosuchprog", args, 0, 0) != -1 || spawn("echo", args, bad, 1) != -1){
+    printf("%s: spawn of a bad program or action succeeded\n", s);
+    exit(1);
+  }
+  if(wait(0) != -1){
+    printf("%s: failed spawn left a child\n", s);
+    exit(1);
+  }
+  if((pid = spawn("echo", args, acts, 3)) < 0){
+    printf("%s: spawn failed\n", s);
+    exit(1);
+  }
+  close(fds[1]);
+  n = read(fds[0], buf, sizeof(buf));
+  if(n != 8 || memcmp(buf, "spawned\n", 8) != 0){
+    printf("%s: wrong output from spawned echo\n", s);
+    exit(1);
+  }
+  if(wait(&xstatus) != pid || xstatus != 0){
+    printf("%s: wait for spawned child failed\n", s);
+    exit(1);
+  }
+  close(fds[0]);
+}
+
+// A pipe must hold as much as F_SETPIPE_SZ asks for, and a page
+// given to vmsplice() must reach the reader as it was, even if the
+// writer changes it afterwards.
+void
+pipesizetest(char *s)
+{
+  static char page[PGSIZE] __attribute__((aligned(PGSIZE)));
+  int fds[2], n, fd;
+  char *big;
+
+  if(pipe(fds) < 0){
+    printf("%s: pipe failed\n", s);
+    exit(1);
+  }
+  if(fcntl(fds[1], F_GETPIPE_SZ, 0) < PGSIZE || fcntl(fds[1], F_SETPIPE_SZ, 65536) != 65536 ||
+     fcntl(fds[0], F_GETPIPE_SZ, 0) != 65536 || fcntl(fds[1], F_SETPIPE_SZ, 65537) != -1){
+    printf("%s: F_SETPIPE_SZ didn't set the size\n", s);
+    exit(1);
+  }
+  if((fd = open("README", O_RDONLY)) < 0 || fcntl(fd, F_GETPIPE_SZ, 0) != -1){
+    printf("%s: fcntl of a file succeeded\n", s);
+    exit(1);
+  }
+  close(fd);
+
+  // a full pipe's worth needs no reader to take it.
+  if((big = malloc(65536)) == 0){
+    printf("%s: malloc failed\n", s);
+    exit(1);
+  }
+  for(int i = 0; i < 65536; i++)
+    big[i] = i % 251;
+  if(write(fds[1], big, 65536) != 65536){
+    printf("%s: write of 64KB failed\n", s);
+    exit(1);
+  }
+  memset(big, 0, 65536);
+  for(n = 0; n < 65536; ){
+    int r = read(fds[0], big + n, 65536 - n);
+    if(r <= 0){
+      printf("%s: read failed\n", s);
+      exit(1);
+    }
+    n += r;
+  }
+  for(int i = 0; i < 65536; i++){
+    if(big[i] != (char)(i % 251)){
+      printf("%s: wrong byte at %d\n", s, i);
+      exit(1);
+    }
+  }
+  free(big);
+
+  memset(page, 'a', PGSIZE);
+  if(vmsplice(fds[1], page, PGSIZE) != PGSIZE){
+    printf("%s: vmsplice failed\n", s);
+    exit(1);
+  }
+  memset(page, 'b', PGSIZE);
+  if(read(fds[0], buf, PGSIZE) != PGSIZE){
+    printf("%s: read of spliced page failed\n", s);
+    exit(1);
+  }
+  for(int i = 0; i < PGSIZE; i++){
+    if(buf[i] != 'a'){
+      printf("%s: spliced page changed after vmsplice()\n", s);
+      exit(1);
+    }
+  }
+  close(fds[0]);
+  close(fds[1]);
+}
+
+// poll() must report which of several pipes is ready, wait for
+// one, and time out; O_NONBLOCK reads of an empty pipe must fail.
+void
+polltest(char *s)
+{
+  int a[2], b[2], pid;
+  char c;
+
+  if(pipe(a) < 0 || pipe(b) < 0){
+    printf("%s: pipe failed\n", s);
+    exit(1);
+  }
+  struct pollfd fds[] = {
+    {a[0], POLLIN, 0}, {b[0], POLLIN, 0}, {b[1], POLLOUT, 0}, {99, POLLIN, 0},
+  };
+
+  if(poll(fds, 2, 0) != 0){
+    printf("%s: poll of empty pipes found one ready\n", s);
+    exit(1);
+  }
+  write(b[1], "x", 1);
+  if(poll(fds, 4, 0) != 3 || fds[0].revents != 0 || fds[1].revents != POLLIN ||
+     fds[2].revents != POLLOUT || fds[3].revents != POLLNVAL){
+    printf("%s: wrong revents %d %d %d %d\n", s, fds[0].revents, fds[1].revents,
+           fds[2].revents, fds[3].revents);
+    exit(1);
+  }
+  read(b[0], &c, 1);
+
+  uint t0 = uptime();
+  if(poll(fds, 2, 200) != 0 || uptime() - t0 < 1){
+    printf("%s: poll didn't time out\n", s);
+    exit(1);
+  }
+
+  pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0){
+    sleep(2);
+    write(a[1], "y", 1);
+    exit(0);
+  }
+  if(poll(fds, 2, -1) != 1 || fds[0].revents != POLLIN){
+    printf("%s: poll didn't wake for the child's write\n", s);
+    exit(1);
+  }
+  wait(0);
+  read(a[0], &c, 1);
+
+  if(fcntl(a[0], F_SETFL, O_NONBLOCK) != 0 || fcntl(a[0], F_GETFL, 0) != O_NONBLOCK ||
+     read(a[0], &c, 1) != -1){
+    printf("%s: O_NONBLOCK read of an empty pipe didn't fail\n", s);
+    exit(1);
+  }
+  close(a[0]);
+  fds[0].fd = a[1];
+  fds[0].events = POLLOUT;
+  if(poll(fds, 1, 0) != 1 || fds[0].revents != POLLHUP){
+    printf("%s: no POLLHUP for a pipe with no reader\n", s);
+    exit(1);
+  }
+  close(a[1]);
+  close(b[0]);
+  close(b[1]);
+}
+
+// getrusage() and waitrusage() must count what a process did.
+void
+rusagetest(char *s)
+{
+  struct rusage r0, r1, cr, c;
+  static char data[BSIZE];
+  int fd, pid, xstatus;
+
+  getrusage(RUSAGE_SELF, &r0);
+  unlink("rusagefile");
+  fd = open("rusagefile", O_CREATE|O_WRONLY);
+  if(fd < 0 || write(fd, data, sizeof(data)) != sizeof(data)){
+    printf("%s: write failed\n", s);
+    exit(1);
+  }
+  close(fd);
+  unlink("rusagefile");
+  getrusage(RUSAGE_SELF, &r1);
+  if(r1.oublock <= r0.oublock){
+    printf("%s: writing a file wrote no blocks\n", s);
+    exit(1);
+  }
+
+  pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0){
+    // a copy-on-write fault, a sleep, and a tick of user time.
+    data[0] = 1;
+    sleep(1);
+    uint t0 = uptime();
+    while(uptime() - t0 < 2)
+      ;
+    exit(0);
+  }
+  if(waitrusage(&xstatus, &cr) != pid || xstatus != 0){
+    printf("%s: waitrusage failed\n", s);
+    exit(1);
+  }
+  if(cr.minflt == 0 || cr.nvcsw == 0 || cr.utime == 0){
+    printf("%s: child used faults %d sleeps %d utime %d\n", s,
+           (int)cr.minflt, (int)cr.nvcsw, (int)cr.utime);
+    exit(1);
+  }
+  if(getrusage(RUSAGE_CHILDREN, &c) < 0 || c.utime < cr.utime || c.minflt < cr.minflt){
+    printf("%s: children's use wasn't added up\n", s);
+    exit(1);
+  }
+  if(getrusage(5, &c) != -1){
+    printf("%s: getrusage of a bad who succeeded\n", s);
+    exit(1);
+  }
+}
+
 void
 forkforkfork(char *s)
 {
-  unlink("stopforking");
+  unlink("stopforking");
+
+  int pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed", s);
+    exit(1);
+  }
+  if(pid == 0){
+    while(1){
+      int fd = open("stopforking", 0);
+      if(fd >= 0){
+        exit(0);
+      }
+      if(fork() < 0){
+        close(open("stopforking", O_CREATE|O_RDWR));
+      }
+    }
+
+    exit(0);
+  }
+
+  sleep(20); // two seconds
+  close(open("stopforking", O_CREATE|O_RDWR));
+  wait(0);
+  sleep(10); // one second
+}
+
+// regression test. does reparent() violate the parent-then-child
+// locking order when giving away a child to init, so that exit()
+// deadlocks against init's wait()? also used to trigger a "panic:
+// release" due to exit() releasing a different p->parent->lock than
+// it acquired.
+void
+reparent2(char *s)
+{
+  for(int i = 0; i < 800; i++){
+    int pid1 = fork();
+    if(pid1 < 0){
+      printf("fork failed\n");
+      exit(1);
+    }
+    if(pid1 == 0){
+      fork();
+      fork();
+      exit(0);
+    }
+    wait(0);
+  }
+
+  exit(0);
+}
+
+// allocate all mem, free it, and allocate again
+void
+mem(char *s)
+{
+  void *m1, *m2;
+  int pid;
+
+  if((pid = fork()) == 0){
+    m1 = 0;
+    while((m2 = malloc(10001)) != 0){
+      *(char**)m2 = m1;
+      m1 = m2;
+    }
+    while(m1){
+      m2 = *(char**)m1;
+      free(m1);
+      m1 = m2;
+    }
+    m1 = malloc(1024*20);
+    if(m1 == 0){
+      printf("couldn't allocate mem?!!\n", s);
+      exit(1);
+    }
+    free(m1);
+    exit(0);
+  } else {
+    int xstatus;
+    wait(&xstatus);
+    if(xstatus == -1){
+      // probably page fault, so might be lazy lab,
+      // so OK.
+      exit(0);
+    }
+    exit(xstatus);
+  }
+}
+
+// More file system tests
+
+// two processes write to the same file descriptor
+// is the offset shared? does inode locking work?
+void
+sharedfd(char *s)
+{
+  int fd, pid, i, n, nc, np;
+  enum { N = 1000, SZ=10};
+  char buf[SZ];
+
+  unlink("sharedfd");
+  fd = open("sharedfd", O_CREATE|O_RDWR);
+  if(fd < 0){
+    printf("%s: cannot open sharedfd for writing", s);
+    exit(1);
+  }
+  pid = fork();
+  memset(buf, pid==0?'c':'p', sizeof(buf));
+  for(i = 0; i < N; i++){
+    if(write(fd, buf, sizeof(buf)) != sizeof(buf)){
+      printf("%s: write sharedfd failed\n", s);
+      exit(1);
+    }
+  }
+  if(pid == 0) {
+    exit(0);
+  } else {
+    int xstatus;
+    wait(&xstatus);
+    if(xstatus != 0)
+      exit(xstatus);
+  }
+
+  close(fd);
+  fd = open("sharedfd", 0);
+  if(fd < 0){
+    printf("%s: cannot open sharedfd for reading\n", s);
+    exit(1);
+  }
+  nc = np = 0;
+  while((n = read(fd, buf, sizeof(buf))) > 0){
+    for(i = 0; i < sizeof(buf); i++){
+      if(buf[i] == 'c')
+        nc++;
+      if(buf[i] == 'p')
+        np++;
+    }
+  }
+  close(fd);
+  unlink("sharedfd");
+  if(nc == N*SZ && np == N*SZ){
+    exit(0);
+  } else {
+    printf("%s: nc/np test fails\n", s);
+    exit(1);
+  }
+}
+
+// a process can have many more than NOFILE fds open, which
+// are handed out lowest first and copied by fork().
+void
+manyfds(char *s)
+{
+  enum { N = 1000 };
+  struct stat st;
+  int fd, xstatus;
+
+  for(int i = 3; i < N; i++){
+    if((fd = dup(0)) != i){
+      printf("%s: dup returned %d, not %d\n", s, fd, i);
+      exit(1);
+    }
+  }
+  close(500);
+  if((fd = dup(0)) != 500){
+    printf("%s: dup returned %d, not 500\n", s, fd);
+    exit(1);
+  }
 
   int pid = fork();
   if(pid < 0){
-    printf("%s: fork failed", s);
+    printf("%s: fork failed\n", s);
     exit(1);
   }
   if(pid == 0){
-    while(1){
-      int fd = open("stopforking", 0);
-      if(fd >= 0){
-        exit(0);
+    if(fstat(N-1, &st) < 0 || fstat(500, &st) < 0)
+      exit(1);
+    exit(0);
+  }
+  wait(&xstatus);
+  if(xstatus != 0){
+    printf("%s: child lost fds\n", s);
+    exit(1);
+  }
+
+  for(int i = 3; i < N; i++)
+    close(i);
+  if((fd = dup(0)) != 3){
+    printf("%s: dup returned %d, not 3\n", s, fd);
+    exit(1);
+  }
+  close(fd);
+}
+
+// four processes write different files at the same
+// time, to test block allocation.
+void
+fourfiles(char *s)
+{
+  int fd, pid, i, j, n, total, pi;
+  char *names[] = { "f0", "f1", "f2", "f3" };
+  char *fname;
+  enum { N=12, NCHILD=4, SZ=500 };
+
+  for(pi = 0; pi < NCHILD; pi++){
+    fname = names[pi];
+    unlink(fname);
+
+    pid = fork();
+    if(pid < 0){
+      printf("fork failed\n", s);
+      exit(1);
+    }
+
+    if(pid == 0){
+      fd = open(fname, O_CREATE | O_RDWR);
+      if(fd < 0){
+        printf("create failed\n", s);
+        exit(1);
       }
-      if(fork() < 0){
-        close(open("stopforking", O_CREATE|O_RDWR));
+
+      memset(buf, '0'+pi, SZ);
+      for(i = 0; i < N; i++){
+        if((n = write(fd, buf, SZ)) != SZ){
+          printf("write failed %d\n", n);
+          exit(1);
+        }
       }
+      exit(0);
     }
+  }
 
-    exit(0);
+  int xstatus;
+  for(pi = 0; pi < NCHILD; pi++){
+    wait(&xstatus);
+    if(xstatus != 0)
+      exit(xstatus);
   }
 
-  sleep(20); // two seconds
-  close(open("stopforking", O_CREATE|O_RDWR));
-  wait(0);
-  sleep(10); // one second
+  for(i = 0; i < NCHILD; i++){
+    fname = names[i];
+    fd = open(fname, 0);
+    total = 0;
+    while((n = read(fd, buf, sizeof(buf))) > 0){
+      for(j = 0; j < n; j++){
+        if(buf[j] != '0'+i){
+          printf("wrong char\n", s);
+          exit(1);
+        }
+      }
+      total += n;
+    }
+    close(fd);
+    if(total != N*SZ){
+      printf("wrong length %d\n", total);
+      exit(1);
+    }
+    unlink(fname);
+  }
 }
 
-// regression test. does reparent() violate the parent-then-child
-// locking order when giving away a child to init, so that exit()
-// deadlocks against init's wait()? also used to trigger a "panic:
-// release" due to exit() releasing a different p->parent->lock than
-// it acquired.
+// write two files a block at a time, alternating between them,
+// so that each keeps running into the other's blocks, and
+// check that they read back intact.
 void
-reparent2(char *s)
+interleave(char *s)
 {
-  for(int i = 0; i < 800; i++){
-    int pid1 = fork();
-    if(pid1 < 0){
-      printf("fork failed\n");
+  enum { NBLK=200 };
+  char *names[] = { "il0", "il1" };
+  int fds[2], i, j, k, n;
+
+  for(k = 0; k < 2; k++){
+    unlink(names[k]);
+    fds[k] = open(names[k], O_CREATE | O_RDWR);
+    if(fds[k] < 0){
+      printf("%s: create %s failed\n", s, names[k]);
       exit(1);
     }
-    if(pid1 == 0){
-      fork();
-      fork();
-      exit(0);
+  }
+
+  for(i = 0; i < NBLK; i++){
+    for(k = 0; k < 2; k++){
+      memset(buf, 'a' + (i + k) % 26, BSIZE);
+      if(write(fds[k], buf, BSIZE) != BSIZE){
+        printf("%s: write %s failed\n", s, names[k]);
+        exit(1);
+      }
     }
-    wait(0);
   }
 
-  exit(0);
+  for(k = 0; k < 2; k++){
+    close(fds[k]);
+    fds[k] = open(names[k], O_RDONLY);
+    for(i = 0; i < NBLK; i++){
+      if((n = read(fds[k], buf, BSIZE)) != BSIZE){
+        printf("%s: read %s block %d returned %d\n", s, names[k], i, n);
+        exit(1);
+      }
+      for(j = 0; j < BSIZE; j++){
+        if(buf[j] != 'a' + (i + k) % 26){
+          printf("%s: %s block %d has wrong data\n", s, names[k], i);
+          exit(1);
+        }
+      }
+    }
+    if(read(fds[k], buf, 1) != 0){
+      printf("%s: %s too long\n", s, names[k]);
+      exit(1);
+    }
+    close(fds[k]);
+    unlink(names[k]);
+  }
 }
 
-// allocate all mem, free it, and allocate again
+// a short symbolic link keeps its target in the inode, and takes
+// no block; a long one still works.
 void
-mem(char *s)
+fastsymlink(char *s)
 {
-  void *m1, *m2;
-  int pid;
+  char *longt = "/tmp/a-target-name-long-enough-not-to-fit-in-an-inode";
+  struct statfs a, b;
+  struct stat st;
+  char t[64];
+  int fd, n;
 
-  if((pid = fork()) == 0){
-    m1 = 0;
-    while((m2 = malloc(10001)) != 0){
-      *(char**)m2 = m1;
-      m1 = m2;
+  unlink("/tmp/fsl");
+  unlink("/tmp/fsl2");
+  fd = open(longt, O_CREATE | O_RDWR);
+  if(fd < 0 || write(fd, "x", 1) != 1){
+    printf("%s: create target failed\n", s);
+    exit(1);
+  }
+  close(fd);
+
+  if(statfs("/tmp", &a) < 0 || symlink(longt, "/tmp/fsl2") != 0 ||
+     symlink("fsl2", "/tmp/fsl") != 0 || statfs("/tmp", &b) < 0){
+    printf("%s: symlink failed\n", s);
+    exit(1);
+  }
+  if(b.ffree != a.ffree - 2 || b.bfree != a.bfree - 1){
+    printf("%s: links took %d blocks\n", s, a.bfree - b.bfree);
+    exit(1);
+  }
+
+  // fsl is relative to the current directory, as before.
+  if(chdir("/tmp") != 0){
+    printf("%s: chdir failed\n", s);
+    exit(1);
+  }
+  fd = open("fsl", O_RDONLY);
+  if(fd < 0 || read(fd, t, 1) != 1 || t[0] != 'x'){
+    printf("%s: open through links failed\n", s);
+    exit(1);
+  }
+  close(fd);
+
+  fd = open("fsl", O_RDONLY | O_NOFOLLOW);
+  if(fd < 0 || fstat(fd, &st) != 0 || st.type != T_SYMLINK || st.size != 4 ||
+     (n = read(fd, t, sizeof(t))) != 4 || memcmp(t, "fsl2", 4) != 0){
+    printf("%s: reading the short link failed\n", s);
+    exit(1);
+  }
+  close(fd);
+  fd = open("fsl2", O_RDONLY | O_NOFOLLOW);
+  if(fd < 0 || (n = read(fd, t, sizeof(t))) != strlen(longt) || memcmp(t, longt, n) != 0){
+    printf("%s: reading the long link failed\n", s);
+    exit(1);
+  }
+  close(fd);
+  if(open("fsl", O_RDWR | O_NOFOLLOW) >= 0){
+    printf("%s: opened a link for writing\n", s);
+    exit(1);
+  }
+
+  if(chdir("/") != 0 || unlink("/tmp/fsl") != 0 || unlink("/tmp/fsl2") != 0 || unlink(longt) != 0){
+    printf("%s: unlink failed\n", s);
+    exit(1);
+  }
+}
+
+// sendfile() copies a file to a pipe and to another file from
+// an offset, without moving the source's offset.
+void
+sendfiletest(char *s)
+{
+  enum { SZ = 3*BSIZE + 100, OFF = 50 };
+  int in, out, fds[2], i, n, pid, xstatus;
+  char c;
+
+  unlink("sfin");
+  unlink("sfout");
+  in = open("sfin", O_CREATE | O_RDWR);
+  if(in < 0){
+    printf("%s: create failed\n", s);
+    exit(1);
+  }
+  for(i = 0; i < SZ; i++)
+    buf[i] = i % 251;
+  if(write(in, buf, SZ) != SZ){
+    printf("%s: write failed\n", s);
+    exit(1);
+  }
+
+  // to another file, from OFF to the end.
+  out = open("sfout", O_CREATE | O_RDWR);
+  if(sendfile(out, in, OFF, SZ) != SZ - OFF){
+    printf("%s: sendfile to a file failed\n", s);
+    exit(1);
+  }
+  close(out);
+  out = open("sfout", O_RDONLY);
+  memset(buf, 0, SZ);
+  if(read(out, buf, SZ) != SZ - OFF){
+    printf("%s: sfout has the wrong size\n", s);
+    exit(1);
+  }
+  for(i = 0; i < SZ - OFF; i++){
+    if((uchar)buf[i] != (i + OFF) % 251){
+      printf("%s: sfout wrong at %d\n", s, i);
+      exit(1);
     }
-    while(m1){
-      m2 = *(char**)m1;
-      free(m1);
-      m1 = m2;
+  }
+  close(out);
+
+  // to a pipe, more than the pipe holds.
+  if(pipe(fds) != 0){
+    printf("%s: pipe failed\n", s);
+    exit(1);
+  }
+  pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0){
+    close(fds[0]);
+    if(sendfile(fds[1], in, 0, SZ) != SZ)
+      exit(1);
+    exit(0);
+  }
+  close(fds[1]);
+  for(i = 0; (n = read(fds[0], &c, 1)) == 1; i++){
+    if((uchar)c != i % 251){
+      printf("%s: pipe data wrong at %d\n", s, i);
+      exit(1);
     }
-    m1 = malloc(1024*20);
-    if(m1 == 0){
-      printf("couldn't allocate mem?!!\n", s);
+  }
+  wait(&xstatus);
+  if(i != SZ || xstatus != 0){
+    printf("%s: read %d bytes from the pipe\n", s, i);
+    exit(1);
+  }
+
+  // in's own offset is still at the end, and a pipe can't be read from.
+  if(read(in, &c, 1) != 0 || sendfile(in, fds[0], 0, 1) != -1){
+    printf("%s: sendfile moved the offset or read a pipe\n", s);
+    exit(1);
+  }
+  close(fds[0]);
+  close(in);
+  unlink("sfin");
+  unlink("sfout");
+}
+
+// statfs() counts the blocks and inode a new file takes, and
+// gives them back when it is removed.
+void
+statfstest(char *s)
+{
+  struct statfs a, b, c;
+  struct stat st;
+  int fd;
+
+  if(statfs("/tmp", &a) < 0 || stat("/tmp", &st) < 0){
+    printf("%s: statfs failed\n", s);
+    exit(1);
+  }
+  if(a.dev != st.dev || a.bsize != BSIZE || a.bfree > a.blocks || a.ffree > a.files){
+    printf("%s: statfs gave nonsense\n", s);
+    exit(1);
+  }
+
+  unlink("/tmp/sf");
+  if((fd = open("/tmp/sf", O_CREATE | O_RDWR)) < 0){
+    printf("%s: create failed\n", s);
+    exit(1);
+  }
+  for(int i = 0; i < 5; i++){
+    if(write(fd, buf, BSIZE) != BSIZE){
+      printf("%s: write failed\n", s);
       exit(1);
     }
-    free(m1);
-    exit(0);
-  } else {
-    int xstatus;
-    wait(&xstatus);
-    if(xstatus == -1){
-      // probably page fault, so might be lazy lab,
-      // so OK.
-      exit(0);
-    }
-    exit(xstatus);
   }
-}
+  close(fd);
+  if(statfs("/tmp", &b) < 0 || b.ffree != a.ffree - 1 || b.bfree > a.bfree - 5){
+    printf("%s: free counts before %d/%d after %d/%d\n", s, a.bfree, a.ffree, b.bfree, b.ffree);
+    exit(1);
+  }
+  unlink("/tmp/sf");
+  if(statfs("/tmp", &c) < 0 || c.ffree != a.ffree || c.bfree != a.bfree){
+    printf("%s: free counts not restored\n", s);
+    exit(1);
+  }
 
-// More file system tests
+  if(statfs("/", &b) < 0 || b.dev == a.dev || statfs("nosuchfile", &c) != -1){
+    printf("%s: statfs of / or a missing file\n", s);
+    exit(1);
+  }
+}
 
-// two processes write to the same file descriptor
-// is the offset shared? does inode locking work?
+// pread() and pwrite() at offsets of their own, from several
+// processes sharing one descriptor, leave its offset alone.
 void
-sharedfd(char *s)
+preadwrite(char *s)
 {
-  int fd, pid, i, n, nc, np;
-  enum { N = 1000, SZ=10};
-  char buf[SZ];
+  enum { NCHILD = 4, NREC = 32, RECSZ = 64 };
+  char rec[RECSZ];
+  int fd, i, j, pid, xstatus;
 
-  unlink("sharedfd");
-  fd = open("sharedfd", O_CREATE|O_RDWR);
+  unlink("prwfile");
+  fd = open("prwfile", O_CREATE | O_RDWR);
   if(fd < 0){
-    printf("%s: cannot open sharedfd for writing", s);
+    printf("%s: create failed\n", s);
     exit(1);
   }
-  pid = fork();
-  memset(buf, pid==0?'c':'p', sizeof(buf));
-  for(i = 0; i < N; i++){
-    if(write(fd, buf, sizeof(buf)) != sizeof(buf)){
-      printf("%s: write sharedfd failed\n", s);
+  // each child writes its own records, in reverse order.
+  for(i = 0; i < NCHILD; i++){
+    if((pid = fork()) < 0){
+      printf("%s: fork failed\n", s);
       exit(1);
     }
+    if(pid == 0){
+      for(j = NREC - 1; j >= 0; j--){
+        if(j % NCHILD != i)
+          continue;
+        memset(rec, 'a' + j % 26, RECSZ);
+        if(pwrite(fd, rec, RECSZ, j * RECSZ) != RECSZ){
+          printf("%s: pwrite failed\n", s);
+          exit(1);
+        }
+      }
+      exit(0);
+    }
   }
-  if(pid == 0) {
-    exit(0);
-  } else {
-    int xstatus;
+  for(i = 0; i < NCHILD; i++){
     wait(&xstatus);
     if(xstatus != 0)
       exit(xstatus);
   }
 
-  close(fd);
-  fd = open("sharedfd", 0);
-  if(fd < 0){
-    printf("%s: cannot open sharedfd for reading\n", s);
+  // the shared offset hasn't moved.
+  if(write(fd, "z", 1) != 1 || pread(fd, rec, 1, 0) != 1 || rec[0] != 'z'){
+    printf("%s: pwrite moved the file offset\n", s);
     exit(1);
   }
-  nc = np = 0;
-  while((n = read(fd, buf, sizeof(buf))) > 0){
-    for(i = 0; i < sizeof(buf); i++){
-      if(buf[i] == 'c')
-        nc++;
-      if(buf[i] == 'p')
-        np++;
+
+  for(i = 0; i < NCHILD; i++){
+    if((pid = fork()) == 0){
+      for(j = 1; j < NREC; j++){
+        int k = (j * 7 + i) % (NREC - 1) + 1;
+        if(pread(fd, rec, RECSZ, k * RECSZ) != RECSZ){
+          printf("%s: pread failed\n", s);
+          exit(1);
+        }
+        for(int b = 0; b < RECSZ; b++){
+          if(rec[b] != 'a' + k % 26){
+            printf("%s: record %d is wrong\n", s, k);
+            exit(1);
+          }
+        }
+      }
+      exit(0);
     }
   }
+  for(i = 0; i < NCHILD; i++){
+    wait(&xstatus);
+    if(xstatus != 0)
+      exit(xstatus);
+  }
+
+  if(read(fd, rec, 1) != 1 || rec[0] != 'a'){
+    printf("%s: pread moved the file offset\n", s);
+    exit(1);
+  }
+  if(pread(fd, rec, RECSZ, NREC * RECSZ) != 0 || pread(fd, rec, 1, -1) != -1){
+    printf("%s: pread past the end or before the start\n", s);
+    exit(1);
+  }
   close(fd);
-  unlink("sharedfd");
-  if(nc == N*SZ && np == N*SZ){
-    exit(0);
-  } else {
-    printf("%s: nc/np test fails\n", s);
+  unlink("prwfile");
+
+  int fds[2];
+  if(pipe(fds) != 0){
+    printf("%s: pipe failed\n", s);
+    exit(1);
+  }
+  if(pwrite(fds[1], "x", 1, 0) != -1 || pread(fds[0], rec, 1, 0) != -1){
+    printf("%s: pread/pwrite on a pipe succeeded\n", s);
     exit(1);
   }
+  close(fds[0]);
+  close(fds[1]);
 }
 
-// four processes write different files at the same
-// time, to test block allocation.
+// getdents() returns every entry once, across calls, with the
+// types and sizes stat() would give.
 void
-fourfiles(char *s)
+getdentstest(char *s)
 {
-  int fd, pid, i, j, n, total, pi;
-  char *names[] = { "f0", "f1", "f2", "f3" };
-  char *fname;
-  enum { N=12, NCHILD=4, SZ=500 };
-
-  for(pi = 0; pi < NCHILD; pi++){
-    fname = names[pi];
-    unlink(fname);
+  enum { N = 20 };
+  struct dent d[3];
+  int fd, i, n, seen[N], dot = 0, dotdot = 0;
+  char name[8];
 
-    pid = fork();
-    if(pid < 0){
-      printf("fork failed\n", s);
+  strcpy(name, "gdd/f?");
+  if(mkdir("gdd") != 0){
+    printf("%s: mkdir failed\n", s);
+    exit(1);
+  }
+  for(i = 0; i < N; i++){
+    name[5] = 'a' + i;
+    if((fd = open(name, O_CREATE | O_RDWR)) < 0){
+      printf("%s: create failed\n", s);
+      exit(1);
+    }
+    if(write(fd, buf, i) != i){
+      printf("%s: write failed\n", s);
       exit(1);
     }
+    close(fd);
+    seen[i] = 0;
+  }
 
-    if(pid == 0){
-      fd = open(fname, O_CREATE | O_RDWR);
-      if(fd < 0){
-        printf("create failed\n", s);
+  if((fd = open("gdd", O_RDONLY)) < 0){
+    printf("%s: open gdd failed\n", s);
+    exit(1);
+  }
+  while((n = getdents(fd, d, 3, GETDENTS_STAT)) > 0){
+    for(i = 0; i < n; i++){
+      if(strcmp(d[i].name, ".") == 0){
+        dot++;
+        continue;
+      }
+      if(strcmp(d[i].name, "..") == 0){
+        dotdot++;
+        continue;
+      }
+      int k = d[i].name[1] - 'a';
+      if(d[i].name[0] != 'f' || k < 0 || k >= N || d[i].name[2] != 0){
+        printf("%s: unexpected entry %s\n", s, d[i].name);
         exit(1);
       }
-
-      memset(buf, '0'+pi, SZ);
-      for(i = 0; i < N; i++){
-        if((n = write(fd, buf, SZ)) != SZ){
-          printf("write failed %d\n", n);
-          exit(1);
-        }
+      if(d[i].type != T_FILE || d[i].size != k){
+        printf("%s: %s has type %d size %d\n", s, d[i].name, d[i].type, (int)d[i].size);
+        exit(1);
       }
-      exit(0);
+      seen[k]++;
+    }
+  }
+  if(n < 0 || dot != 1 || dotdot != 1){
+    printf("%s: getdents failed\n", s);
+    exit(1);
+  }
+  for(i = 0; i < N; i++){
+    if(seen[i] != 1){
+      printf("%s: saw entry %d %d times\n", s, i, seen[i]);
+      exit(1);
     }
   }
+  close(fd);
 
-  int xstatus;
-  for(pi = 0; pi < NCHILD; pi++){
-    wait(&xstatus);
-    if(xstatus != 0)
-      exit(xstatus);
+  // without GETDENTS_STAT only the names and inode numbers are set.
+  fd = open("gdd", O_RDONLY);
+  if(getdents(fd, d, 1, 0) != 1 || d[0].ino == 0 || d[0].type != 0){
+    printf("%s: getdents without stat failed\n", s);
+    exit(1);
   }
+  close(fd);
 
-  for(i = 0; i < NCHILD; i++){
-    fname = names[i];
-    fd = open(fname, 0);
-    total = 0;
-    while((n = read(fd, buf, sizeof(buf))) > 0){
-      for(j = 0; j < n; j++){
-        if(buf[j] != '0'+i){
-          printf("wrong char\n", s);
-          exit(1);
-        }
-      }
-      total += n;
+  for(i = 0; i < N; i++){
+    name[5] = 'a' + i;
+    unlink(name);
+  }
+  if(unlink("gdd") != 0){
+    printf("%s: unlink gdd failed\n", s);
+    exit(1);
+  }
+
+  fd = open("README", O_RDONLY);
+  if(getdents(fd, d, 3, GETDENTS_STAT) != -1){
+    printf("%s: getdents of a file succeeded\n", s);
+    exit(1);
+  }
+  close(fd);
+}
+
+// files in /tmp, which is another file system, in memory.
+void
+tmpfs(char *s)
+{
+  struct stat root, tmp, st;
+  int fd;
+
+  if(stat("/", &root) < 0 || stat("/tmp", &tmp) < 0){
+    printf("%s: stat failed\n", s);
+    exit(1);
+  }
+  if(tmp.type != T_DIR || tmp.dev == root.dev){
+    printf("%s: /tmp is not another file system\n", s);
+    exit(1);
+  }
+  if(stat("/tmp/..", &st) < 0 || st.dev != root.dev || st.ino != root.ino){
+    printf("%s: /tmp/.. is not /\n", s);
+    exit(1);
+  }
+
+  unlink("/tmp/tf");
+  fd = open("/tmp/tf", O_CREATE | O_RDWR);
+  if(fd < 0){
+    printf("%s: create /tmp/tf failed\n", s);
+    exit(1);
+  }
+  memset(buf, 't', BSIZE);
+  for(int i = 0; i < 20; i++){
+    if(write(fd, buf, BSIZE) != BSIZE){
+      printf("%s: write /tmp/tf failed\n", s);
+      exit(1);
+    }
+  }
+  close(fd);
+  if(stat("/tmp/tf", &st) < 0 || st.dev != tmp.dev || st.size != 20*BSIZE){
+    printf("%s: /tmp/tf has the wrong size\n", s);
+    exit(1);
+  }
+  if(link("/tmp/tf", "tmpfslink") == 0){
+    printf("%s: link across file systems succeeded\n", s);
+    exit(1);
+  }
+
+  if(chdir("/tmp") != 0 || mkdir("d") != 0 || chdir("d") != 0){
+    printf("%s: chdir into /tmp failed\n", s);
+    exit(1);
+  }
+  if(stat("../../tmp/tf", &st) < 0 || st.dev != tmp.dev){
+    printf("%s: ../../tmp/tf not found\n", s);
+    exit(1);
+  }
+  if(chdir("/") != 0 || unlink("/tmp/d") != 0 || unlink("/tmp/tf") != 0){
+    printf("%s: unlink in /tmp failed\n", s);
+    exit(1);
+  }
+  if(unlink("/tmp") == 0){
+    printf("%s: unlinked /tmp\n", s);
+    exit(1);
+  }
+}
+
+// look names up again and again while they are created and
+// removed, so that lookups that were remembered go stale.
+void
+dnamecache(char *s)
+{
+  int fd, fd1, i;
+
+  unlink("dc/f");
+  unlink("dc");
+  for(i = 0; i < 4; i++){
+    fd = open("dc/f", O_RDONLY);
+    fd1 = open("dc/f", O_RDONLY);
+    if(fd >= 0 || fd1 >= 0){
+      printf("%s: dc/f exists before create\n", s);
+      close(fd);
+      close(fd1);
+      exit(1);
+    }
+    if(mkdir("dc") != 0){
+      printf("%s: mkdir dc failed\n", s);
+      exit(1);
+    }
+    if((fd = open("dc/f", O_RDONLY)) >= 0){
+      printf("%s: dc/f exists in new dc\n", s);
+      close(fd);
+      exit(1);
+    }
+    if((fd = open("dc/f", O_CREATE | O_RDWR)) < 0){
+      printf("%s: create dc/f failed\n", s);
+      exit(1);
     }
     close(fd);
-    if(total != N*SZ){
-      printf("wrong length %d\n", total);
+    if((fd = open("dc/f", O_RDONLY)) < 0){
+      printf("%s: open dc/f failed\n", s);
+      exit(1);
+    }
+    close(fd);
+    if(link("dc/f", "dc/g") != 0 || (fd = open("dc/g", O_RDONLY)) < 0){
+      printf("%s: link dc/g failed\n", s);
+      exit(1);
+    }
+    close(fd);
+    if(unlink("dc/f") != 0 || unlink("dc/g") != 0){
+      printf("%s: unlink failed\n", s);
+      exit(1);
+    }
+    fd = open("dc/f", O_RDONLY);
+    fd1 = open("dc/g", O_RDONLY);
+    if(fd >= 0 || fd1 >= 0){
+      printf("%s: file exists after unlink\n", s);
+      close(fd);
+      close(fd1);
+      exit(1);
+    }
+    // leave dc/f cached as present, then free dc, whose
+    // inum the next mkdir may reuse.
+    if((fd = open("dc/f", O_CREATE | O_RDWR)) < 0){
+      printf("%s: create dc/f failed\n", s);
+      exit(1);
+    }
+    close(fd);
+    if(unlink("dc/f") != 0 || unlink("dc") != 0){
+      printf("%s: unlink dc failed\n", s);
       exit(1);
     }
-    unlink(fname);
   }
 }
 
@@ -1724,7 +3296,50 @@ bigwrite(char *s)
   }
 }
 
-
+// one write() of many more blocks than MAXOPBLOCKS, at an
+// unaligned offset, must write and read back all of them.
+void
+bigwrite1(char *s)
+{
+  enum { SZ = 300*BSIZE + 77 };
+  int fd, i, n;
+  char *p = sbrk(SZ);
+
+  if(p == (char*)-1){
+    printf("%s: sbrk failed\n", s);
+    exit(1);
+  }
+  for(i = 0; i < SZ; i++)
+    p[i] = i % 251;
+  unlink("bigwrite1");
+  fd = open("bigwrite1", O_CREATE | O_RDWR);
+  if(fd < 0 || write(fd, "x", 1) != 1){
+    printf("%s: cannot create bigwrite1\n", s);
+    exit(1);
+  }
+  if((n = write(fd, p, SZ)) != SZ){
+    printf("%s: write(%d) ret %d\n", s, SZ, n);
+    exit(1);
+  }
+  close(fd);
+
+  memset(p, 0, SZ);
+  fd = open("bigwrite1", O_RDONLY);
+  if(read(fd, buf, 1) != 1 || (n = read(fd, p, SZ)) != SZ){
+    printf("%s: read back %d\n", s, n);
+    exit(1);
+  }
+  close(fd);
+  for(i = 0; i < SZ; i++){
+    if(p[i] != (char)(i % 251)){
+      printf("%s: wrong byte at %d\n", s, i);
+      exit(1);
+    }
+  }
+  unlink("bigwrite1");
+  sbrk(-SZ);
+}
+
 void
 bigfile(char *s)
 {
@@ -2217,11 +3832,14 @@ sbrkfail(char *s)
   if(pid == 0){
     // allocate a lot of memory.
     // this should produce a page fault,
-    // and thus not complete.
+    // and thus not complete. the pages are
+    // written, since reads of untouched heap
+    // all map the one zero page.
     a = sbrk(0);
     sbrk(10*BIG);
     int n = 0;
     for (i = 0; i < 10*BIG; i += PGSIZE) {
+      *(a+i) = 1;
       n += *(a+i);
     }
     // print n so the compiler doesn't optimize away
@@ -2395,163 +4013,549 @@ void argptest(char *s)
   close(fd);
 }
 
-// check that there's an invalid page beneath
-// the user stack, to catch stack overflow.
+// check that there's an invalid page beneath
+// the user stack, to catch stack overflow.
+void
+stacktest(char *s)
+{
+  int pid;
+  int xstatus;
+
+  pid = fork();
+  if(pid == 0) {
+    char *sp = (char *) r_sp();
+    sp -= PGSIZE;
+    // the *sp should cause a trap.
+    printf("%s: stacktest: read below stack %p\n", s, *sp);
+    exit(1);
+  } else if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  wait(&xstatus);
+  if(xstatus == -1)  // kernel killed child?
+    exit(0);
+  else
+    exit(xstatus);
+}
+
+// check that writes to text segment fault
+void
+textwrite(char *s)
+{
+  int pid;
+  int xstatus;
+
+  pid = fork();
+  if(pid == 0) {
+    volatile int *addr = (int *) 0;
+    *addr = 10;
+    exit(1);
+  } else if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  wait(&xstatus);
+  if(xstatus == -1)  // kernel killed child?
+    exit(0);
+  else
+    exit(xstatus);
+}
+
+// regression test. copyin(), copyout(), and copyinstr() used to cast
+// the virtual page address to uint, which (with certain wild system
+// call arguments) resulted in a kernel page faults.
+void *big = (void*) 0xeaeb0b5b00002f5e;
+void
+pgbug(char *s)
+{
+  char *argv[1];
+  argv[0] = 0;
+  exec(big, argv);
+  pipe(big);
+
+  exit(0);
+}
+
+// regression test. does the kernel panic if a process sbrk()s its
+// size to be less than a page, or zero, or reduces the break by an
+// amount too small to cause a page to be freed?
+void
+sbrkbugs(char *s)
+{
+  int pid = fork();
+  if(pid < 0){
+    printf("fork failed\n");
+    exit(1);
+  }
+  if(pid == 0){
+    int sz = (uint64) sbrk(0);
+    // free all user memory; there used to be a bug that
+    // would not adjust p->sz correctly in this case,
+    // causing exit() to panic.
+    sbrk(-sz);
+    // user page fault here.
+    exit(0);
+  }
+  wait(0);
+
+  pid = fork();
+  if(pid < 0){
+    printf("fork failed\n");
+    exit(1);
+  }
+  if(pid == 0){
+    int sz = (uint64) sbrk(0);
+    // set the break to somewhere in the very first
+    // page; there used to be a bug that would incorrectly
+    // free the first page.
+    sbrk(-(sz - 3500));
+    exit(0);
+  }
+  wait(0);
+
+  pid = fork();
+  if(pid < 0){
+    printf("fork failed\n");
+    exit(1);
+  }
+  if(pid == 0){
+    // set the break in the middle of a page.
+    sbrk((10*4096 + 2048) - (uint64)sbrk(0));
+
+    // reduce the break a bit, but not enough to
+    // cause a page to be freed. this used to cause
+    // a panic.
+    sbrk(-10);
+
+    exit(0);
+  }
+  wait(0);
+
+  exit(0);
+}
+
+// if process size was somewhat more than a page boundary, and then
+// shrunk to be somewhat less than that page boundary, can the kernel
+// still copyin() from addresses in the last page?
+void
+sbrklast(char *s)
+{
+  uint64 top = (uint64) sbrk(0);
+  if((top % 4096) != 0)
+    sbrk(4096 - (top % 4096));
+  sbrk(4096);
+  sbrk(10);
+  sbrk(-20);
+  top = (uint64) sbrk(0);
+  char *p = (char *) (top - 64);
+  p[0] = 'x';
+  p[1] = '\0';
+  int fd = open(p, O_RDWR|O_CREATE);
+  write(fd, p, 1);
+  close(fd);
+  fd = open(p, O_RDWR);
+  p[0] = '\0';
+  read(fd, p, 1);
+  if(p[0] != 'x')
+    exit(1);
+}
+
+
+// does sbrk handle signed int32 wrap-around with
+// negative arguments?
+void
+sbrk8000(char *s)
+{
+  sbrk(0x80000004);
+  volatile char *top = sbrk(0);
+  *(top-1) = *(top-1) + 1;
+}
+
+
+// sbrk() only reserves address space, so growing well past the
+// amount of physical memory should work as long as most of the
+// new pages are never touched, and the pages that are touched
+// (directly, by the kernel, or by a child) should read as zero.
+void
+sbrklazy(char *s)
+{
+  enum { BIG=1024*1024*1024 };
+  char *a, *p;
+  int fds[2];
+  int pid, xstatus;
+
+  a = sbrk(BIG);
+  if(a == (char*)0xffffffffffffffffL){
+    printf("%s: sbrk(%d) failed\n", s, BIG);
+    exit(1);
+  }
+
+  for(p = a; p < a + BIG; p += BIG/16){
+    if(*p != 0){
+      printf("%s: lazy page not zero\n", s);
+      exit(1);
+    }
+    *p = 1;
+  }
+
+  // the kernel should fault in untouched pages for copyin and copyout.
+  if(pipe(fds) != 0){
+    printf("%s: pipe() failed\n", s);
+    exit(1);
+  }
+  if(write(fds[1], a + BIG - 64, 8) != 8){
+    printf("%s: write from lazy page failed\n", s);
+    exit(1);
+  }
+  if(read(fds[0], a + BIG/2 + PGSIZE, 8) != 8){
+    printf("%s: read into lazy page failed\n", s);
+    exit(1);
+  }
+  close(fds[0]);
+  close(fds[1]);
+
+  // a child should see the pages that were touched, and be able
+  // to fault in the ones that weren't.
+  pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0){
+    if(a[0] != 1 || a[BIG/16 + PGSIZE] != 0)
+      exit(1);
+    a[BIG/16 + PGSIZE] = 2;
+    exit(0);
+  }
+  wait(&xstatus);
+  if(xstatus != 0){
+    printf("%s: child saw wrong lazy sbrk contents\n", s);
+    exit(1);
+  }
+  if(a[BIG/16 + PGSIZE] != 0){
+    printf("%s: child's write leaked into parent\n", s);
+    exit(1);
+  }
+
+  if(sbrk(-BIG) == (char*)0xffffffffffffffffL){
+    printf("%s: sbrk(-%d) failed\n", s, BIG);
+    exit(1);
+  }
+}
+
+// reading heap pages that were never written shouldn't use up
+// memory, since they all map the same page of zeros, and writing
+// one should give it a page of its own.
+void
+sbrkzero(char *s)
+{
+  enum { NPAGES=1024 };
+  struct sysinfo si0, si1;
+  char *a;
+  int sum = 0;
+
+  a = sbrk(NPAGES*PGSIZE);
+  if(a == (char*)0xffffffffffffffffL){
+    printf("%s: sbrk failed\n", s);
+    exit(1);
+  }
+
+  sysinfo(&si0);
+  for(int i = 0; i < NPAGES; i++)
+    sum += a[i*PGSIZE + i % PGSIZE];
+  sysinfo(&si1);
+  if(sum != 0){
+    printf("%s: untouched page not zero\n", s);
+    exit(1);
+  }
+  // allow for the page-table pages.
+  if(si0.freemem - si1.freemem > 64*PGSIZE){
+    printf("%s: reading %d pages used %d bytes\n", s, NPAGES,
+           (int)(si0.freemem - si1.freemem));
+    exit(1);
+  }
+
+  for(int i = 0; i < NPAGES; i += 2)
+    a[i*PGSIZE] = 1;
+  for(int i = 0; i < NPAGES; i++){
+    if(a[i*PGSIZE] != (i % 2 == 0) || a[i*PGSIZE + 1] != 0){
+      printf("%s: page %d wrong after writes\n", s, i);
+      exit(1);
+    }
+  }
+}
+
+// with hugepages() on, 2MB-aligned parts of the heap are backed
+// by megapages, which fork, copy-on-write, and shrinking the
+// heap part way through a megapage all have to cope with.
+void
+hugeheap(char *s)
+{
+  enum { MEGA=2*1024*1024 };
+  char *top, *a;
+  int i, pid, xstatus;
+
+  hugepages(1);
+
+  top = sbrk(0);
+  a = (char*)(((uint64)top + MEGA - 1) & ~(uint64)(MEGA - 1));
+  if(sbrk(a - top + 2*MEGA) == (char*)0xffffffffffffffffL){
+    printf("%s: sbrk failed\n", s);
+    exit(1);
+  }
+
+  for(i = 0; i < 2*MEGA; i += PGSIZE){
+    if(a[i] != 0){
+      printf("%s: megapage not zero\n", s);
+      exit(1);
+    }
+    a[i] = i / PGSIZE;
+  }
+
+  pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0){
+    for(i = 0; i < 2*MEGA; i += PGSIZE){
+      if(a[i] != (char)(i / PGSIZE))
+        exit(1);
+    }
+    a[PGSIZE] = 'x';
+    if(a[0] != 0 || a[2*PGSIZE] != 2)
+      exit(1);
+    exit(0);
+  }
+  wait(&xstatus);
+  if(xstatus != 0){
+    printf("%s: child saw wrong megapage contents\n", s);
+    exit(1);
+  }
+  if(a[PGSIZE] != 1){
+    printf("%s: child's write leaked into parent\n", s);
+    exit(1);
+  }
+
+  // shrink to the middle of the first megapage, which unmaps all
+  // of the second one and splits the first.
+  sbrk(-(MEGA + MEGA/2));
+  for(i = 0; i < MEGA/2; i += PGSIZE){
+    if(a[i] != (char)(i / PGSIZE)){
+      printf("%s: shrinking lost megapage contents\n", s);
+      exit(1);
+    }
+  }
+
+  sbrk(-(sbrk(0) - top));
+  hugepages(0);
+}
+
+// fork() shares level-0 page-table pages between parent and child
+// until one of them changes a PTE in one. check that writes, faults
+// of untouched pages, and shrinking the heap in one process don't
+// show through in the other.
 void
-stacktest(char *s)
+forkptshare(char *s)
 {
-  int pid;
-  int xstatus;
+  enum { MEGA=2*1024*1024 };
+  char *top, *a;
+  int i, pid, xstatus;
 
-  pid = fork();
-  if(pid == 0) {
-    char *sp = (char *) r_sp();
-    sp -= PGSIZE;
-    // the *sp should cause a trap.
-    printf("%s: stacktest: read below stack %p\n", s, *sp);
+  top = sbrk(0);
+  a = (char*)(((uint64)top + MEGA - 1) & ~(uint64)(MEGA - 1));
+  if(sbrk(a - top + 2*MEGA) == (char*)0xffffffffffffffffL){
+    printf("%s: sbrk failed\n", s);
     exit(1);
-  } else if(pid < 0){
+  }
+
+  // touch every other page, leaving holes for lazy faults.
+  for(i = 0; i < 2*MEGA; i += 2*PGSIZE)
+    a[i] = i / PGSIZE;
+
+  pid = fork();
+  if(pid < 0){
     printf("%s: fork failed\n", s);
     exit(1);
   }
-  wait(&xstatus);
-  if(xstatus == -1)  // kernel killed child?
+  if(pid == 0){
+    for(i = 0; i < 2*MEGA; i += 2*PGSIZE){
+      if(a[i] != (char)(i / PGSIZE))
+        exit(1);
+    }
+    a[0] = 'c';
+    a[PGSIZE] = 'c';
+    a[MEGA + PGSIZE] = 'c';
+    sbrk(-MEGA/2);
     exit(0);
-  else
-    exit(xstatus);
+  }
+
+  // race the child with writes of our own.
+  a[2*PGSIZE] = 'p';
+  a[3*PGSIZE] = 'p';
+  wait(&xstatus);
+  if(xstatus != 0){
+    printf("%s: child saw wrong contents\n", s);
+    exit(1);
+  }
+  if(a[0] != 0 || a[PGSIZE] != 0 || a[MEGA + PGSIZE] != 0){
+    printf("%s: child's write leaked into parent\n", s);
+    exit(1);
+  }
+  if(a[2*PGSIZE] != 'p' || a[3*PGSIZE] != 'p' || a[2*MEGA - 2*PGSIZE] != (char)(MEGA/PGSIZE*2 - 2)){
+    printf("%s: parent lost its own contents\n", s);
+    exit(1);
+  }
+
+  sbrk(-(sbrk(0) - top));
 }
 
-// check that writes to text segment fault
+// exec() maps initialized data from the program's file, to be read
+// in by page faults. only this test touches initdata.
+char initdata[4*PGSIZE] = { 'a', [PGSIZE] = 'b', [2*PGSIZE] = 'c', [3*PGSIZE] = 'd' };
+
 void
-textwrite(char *s)
+execdemand(char *s)
 {
-  int pid;
-  int xstatus;
+  int fds[2];
 
-  pid = fork();
-  if(pid == 0) {
-    volatile int *addr = (int *) 0;
-    *addr = 10;
+  // the kernel must fault in the untouched page for read().
+  if(pipe(fds) != 0){
+    printf("%s: pipe() failed\n", s);
     exit(1);
-  } else if(pid < 0){
-    printf("%s: fork failed\n", s);
+  }
+  if(write(fds[1], "xy", 2) != 2 || read(fds[0], initdata + 2*PGSIZE + 1, 2) != 2){
+    printf("%s: read into untouched data page failed\n", s);
+    exit(1);
+  }
+  close(fds[0]);
+  close(fds[1]);
+  if(initdata[2*PGSIZE] != 'c' || initdata[2*PGSIZE + 1] != 'x'){
+    printf("%s: wrong data after read\n", s);
     exit(1);
   }
-  wait(&xstatus);
-  if(xstatus == -1)  // kernel killed child?
-    exit(0);
-  else
-    exit(xstatus);
-}
 
-// regression test. copyin(), copyout(), and copyinstr() used to cast
-// the virtual page address to uint, which (with certain wild system
-// call arguments) resulted in a kernel page faults.
-void *big = (void*) 0xeaeb0b5b00002f5e;
-void
-pgbug(char *s)
-{
-  char *argv[1];
-  argv[0] = 0;
-  exec(big, argv);
-  pipe(big);
+  // and for write(), from a page nothing has touched.
+  if(pipe(fds) != 0 || write(fds[1], initdata + 3*PGSIZE, 1) != 1){
+    printf("%s: write from untouched data page failed\n", s);
+    exit(1);
+  }
+  char c = 0;
+  read(fds[0], &c, 1);
+  close(fds[0]);
+  close(fds[1]);
+  if(c != 'd' || initdata[0] != 'a' || initdata[PGSIZE] != 'b'){
+    printf("%s: wrong initialized data\n", s);
+    exit(1);
+  }
 
-  exit(0);
+  // a write must not change the file, which the next test's exec
+  // would see.
+  initdata[PGSIZE] = 'B';
 }
 
-// regression test. does the kernel panic if a process sbrk()s its
-// size to be less than a page, or zero, or reduces the break by an
-// amount too small to cause a page to be freed?
+// exec() keeps recently run programs in the page cache, and maps
+// their text from it. a write to the text must kill the writer
+// instead of changing the cached page, text that hasn't run must
+// not be resident, and running a program again must not see stale
+// pages after the file is rewritten.
 void
-sbrkbugs(char *s)
+exectext(char *s)
 {
-  int pid = fork();
-  if(pid < 0){
-    printf("fork failed\n");
+  char buf[512];
+  int fd, fd1, n, pid, xstatus;
+  char *args[] = { "textcp", 0 };
+  char *targs[] = { "usertests", "-t", 0 };
+  volatile char *text = (volatile char *)(uint64)exectext;
+  char c = *text;
+
+  fd = open("echo", O_RDONLY);
+  fd1 = open("textcp", O_CREATE|O_WRONLY);
+  if(fd < 0 || fd1 < 0){
+    printf("%s: open failed\n", s);
     exit(1);
   }
-  if(pid == 0){
-    int sz = (uint64) sbrk(0);
-    // free all user memory; there used to be a bug that
-    // would not adjust p->sz correctly in this case,
-    // causing exit() to panic.
-    sbrk(-sz);
-    // user page fault here.
-    exit(0);
+  while((n = read(fd, buf, sizeof(buf))) > 0){
+    if(write(fd1, buf, n) != n){
+      printf("%s: write failed\n", s);
+      exit(1);
+    }
+  }
+  close(fd);
+  close(fd1);
+
+  for(int i = 0; i < 4; i++){
+    pid = fork();
+    if(pid < 0){
+      printf("%s: fork failed\n", s);
+      exit(1);
+    }
+    if(pid == 0){
+      exec("textcp", args);
+      exit(1);
+    }
+    wait(&xstatus);
+    if(xstatus != 0){
+      printf("%s: exec of copied program failed\n", s);
+      exit(1);
+    }
   }
-  wait(0);
 
   pid = fork();
   if(pid < 0){
-    printf("fork failed\n");
+    printf("%s: fork failed\n", s);
     exit(1);
   }
   if(pid == 0){
-    int sz = (uint64) sbrk(0);
-    // set the break to somewhere in the very first
-    // page; there used to be a bug that would incorrectly
-    // free the first page.
-    sbrk(-(sz - 3500));
+    *text = ~c;
     exit(0);
   }
-  wait(0);
+  wait(&xstatus);
+  if(xstatus != -1 || *text != c){
+    printf("%s: write to text wasn't stopped\n", s);
+    exit(1);
+  }
 
+  // a fresh usertests checks that reading its text takes faults.
   pid = fork();
   if(pid < 0){
-    printf("fork failed\n");
+    printf("%s: fork failed\n", s);
     exit(1);
   }
   if(pid == 0){
-    // set the break in the middle of a page.
-    sbrk((10*4096 + 2048) - (uint64)sbrk(0));
-
-    // reduce the break a bit, but not enough to
-    // cause a page to be freed. this used to cause
-    // a panic.
-    sbrk(-10);
-
-    exit(0);
+    exec("usertests", targs);
+    exit(2);
   }
-  wait(0);
-
-  exit(0);
-}
-
-// if process size was somewhat more than a page boundary, and then
-// shrunk to be somewhat less than that page boundary, can the kernel
-// still copyin() from addresses in the last page?
-void
-sbrklast(char *s)
-{
-  uint64 top = (uint64) sbrk(0);
-  if((top % 4096) != 0)
-    sbrk(4096 - (top % 4096));
-  sbrk(4096);
-  sbrk(10);
-  sbrk(-20);
-  top = (uint64) sbrk(0);
-  char *p = (char *) (top - 64);
-  p[0] = 'x';
-  p[1] = '\0';
-  int fd = open(p, O_RDWR|O_CREATE);
-  write(fd, p, 1);
-  close(fd);
-  fd = open(p, O_RDWR);
-  p[0] = '\0';
-  read(fd, p, 1);
-  if(p[0] != 'x')
+  wait(&xstatus);
+  if(xstatus != 0){
+    printf("%s: text was resident before it ran\n", s);
     exit(1);
-}
+  }
 
+  // truncate and rewrite the program; it is no longer an ELF file.
+  fd = open("textcp", O_WRONLY|O_TRUNC);
+  if(fd < 0){
+    printf("%s: open for truncate failed\n", s);
+    exit(1);
+  }
+  memset(buf, 'x', sizeof(buf));
+  for(int i = 0; i < 8; i++)
+    write(fd, buf, sizeof(buf));
+  close(fd);
 
-// does sbrk handle signed int32 wrap-around with
-// negative arguments?
-void
-sbrk8000(char *s)
-{
-  sbrk(0x80000004);
-  volatile char *top = sbrk(0);
-  *(top-1) = *(top-1) + 1;
+  // echo exits with 0, so only a failed exec gives 2.
+  pid = fork();
+  if(pid == 0){
+    exec("textcp", args);
+    exit(2);
+  }
+  wait(&xstatus);
+  if(xstatus != 2){
+    printf("%s: exec of rewritten program succeeded\n", s);
+    exit(1);
+  }
+  unlink("textcp");
 }
 
 
@@ -2599,11 +4603,40 @@ struct test {
   {reparent, "reparent" },
   {twochildren, "twochildren"},
   {forkfork, "forkfork"},
+  {runqueues, "runqueues"},
+  {priorities, "priorities"},
+  {affinity, "affinity"},
+  {idlewakeup, "idlewakeup"},
+  {clonetest, "clonetest"},
+  {futextest, "futextest"},
+  {uuptimetest, "uuptimetest"},
+  {usyscalltest, "usyscalltest"},
+  {ringtest, "ringtest"},
+  {sysproftest, "sysproftest"},
+  {usleeptest, "usleeptest"},
+  {ualarmtest, "ualarmtest"},
+  {uproftest, "uproftest"},
+  {kproftest, "kproftest"},
+  {spawntest, "spawntest"},
+  {rusagetest, "rusagetest"},
+  {pipesizetest, "pipesizetest"},
+  {polltest, "polltest"},
+  {malloctest, "malloctest"},
+  {printfbuf, "printfbuf"},
   {forkforkfork, "forkforkfork"},
   {reparent2, "reparent2"},
   {mem, "mem"},
   {sharedfd, "sharedfd"},
+  {manyfds, "manyfds"},
   {fourfiles, "fourfiles"},
+  {interleave, "interleave"},
+  {dnamecache, "dnamecache"},
+  {tmpfs, "tmpfs"},
+  {getdentstest, "getdents"},
+  {preadwrite, "preadwrite"},
+  {statfstest, "statfs"},
+  {sendfiletest, "sendfile"},
+  {fastsymlink, "fastsymlink"},
   {createdelete, "createdelete"},
   {unlinkread, "unlinkread"},
   {linktest, "linktest"},
@@ -2611,6 +4644,7 @@ struct test {
   {linkunlink, "linkunlink"},
   {subdir, "subdir"},
   {bigwrite, "bigwrite"},
+  {bigwrite1, "bigwrite1"},
   {bigfile, "bigfile"},
   {fourteen, "fourteen"},
   {rmdot, "rmdot"},
@@ -2633,6 +4667,12 @@ struct test {
   {sbrkbugs, "sbrkbugs" },
   {sbrklast, "sbrklast"},
   {sbrk8000, "sbrk8000"},
+  {sbrklazy, "sbrklazy"},
+  {sbrkzero, "sbrkzero"},
+  {hugeheap, "hugeheap"},
+  {forkptshare, "forkptshare"},
+  {execdemand, "execdemand"},
+  {exectext, "exectext"},
   {badarg, "badarg" },
 
   { 0, 0},
@@ -2683,6 +4723,76 @@ bigdir(char *s)
   }
 }
 
+// fill a directory with enough links that its entries no longer
+// fit in one block, and check that they can all be found, read
+// back as a list, and removed.
+void
+dirindex(char *s)
+{
+  enum { N = 600 };
+  int i, fd, n;
+  char name[10];
+  struct dirent de;
+
+  if(mkdir("di") != 0 || (fd = open("di/x", O_CREATE | O_RDWR)) < 0){
+    printf("%s: create di/x failed\n", s);
+    exit(1);
+  }
+  close(fd);
+  name[0] = 'd';
+  name[1] = 'i';
+  name[2] = '/';
+  name[6] = '\0';
+  for(i = 0; i < N; i++){
+    name[3] = 'a' + i / 100;
+    name[4] = '0' + (i / 10) % 10;
+    name[5] = '0' + i % 10;
+    if(link("di/x", name) != 0){
+      printf("%s: link %s failed\n", s, name);
+      exit(1);
+    }
+  }
+
+  for(i = 0; i < N; i++){
+    name[3] = 'a' + i / 100;
+    name[4] = '0' + (i / 10) % 10;
+    name[5] = '0' + i % 10;
+    if((fd = open(name, O_RDONLY)) < 0){
+      printf("%s: open %s failed\n", s, name);
+      exit(1);
+    }
+    close(fd);
+  }
+
+  if((fd = open("di", O_RDONLY)) < 0){
+    printf("%s: open di failed\n", s);
+    exit(1);
+  }
+  n = 0;
+  while(read(fd, &de, sizeof(de)) == sizeof(de))
+    if(de.inum != 0)
+      n++;
+  close(fd);
+  if(n != N + 3){
+    printf("%s: di has %d entries, not %d\n", s, n, N + 3);
+    exit(1);
+  }
+
+  for(i = 0; i < N; i++){
+    name[3] = 'a' + i / 100;
+    name[4] = '0' + (i / 10) % 10;
+    name[5] = '0' + i % 10;
+    if(unlink(name) != 0){
+      printf("%s: unlink %s failed\n", s, name);
+      exit(1);
+    }
+  }
+  if(unlink("di/x") != 0 || unlink("di") != 0){
+    printf("%s: unlink di failed\n", s);
+    exit(1);
+  }
+}
+
 // concurrent writes to try to provoke deadlock in the virtio disk
 // driver.
 void
@@ -2892,6 +5002,62 @@ diskfull(char *s)
   }
 }
 
+// use more memory than the machine has, so that some of it has to
+// be swapped out, and check that it all comes back, also in a child
+// that shares it copy-on-write.
+void
+swapheap(char *s)
+{
+  struct sysinfo si;
+  int npages, pid, xstatus;
+  uint64 *a;
+
+  if(sysinfo(&si) < 0){
+    printf("%s: sysinfo failed\n", s);
+    exit(1);
+  }
+  npages = si.freemem / PGSIZE + 1024;
+  a = (uint64 *) sbrk(npages * PGSIZE);
+  if(a == (uint64 *) 0xffffffffffffffffL){
+    printf("%s: sbrk failed\n", s);
+    exit(1);
+  }
+
+  for(int i = 0; i < npages; i++)
+    a[i * PGSIZE / sizeof(uint64)] = i;
+  for(int i = 0; i < npages; i++){
+    if(a[i * PGSIZE / sizeof(uint64)] != i){
+      printf("%s: page %d lost\n", s, i);
+      exit(1);
+    }
+  }
+
+  pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0){
+    for(int i = 0; i < npages; i++){
+      if(a[i * PGSIZE / sizeof(uint64)] != i){
+        printf("%s: page %d lost in child\n", s, i);
+        exit(1);
+      }
+      a[i * PGSIZE / sizeof(uint64)] = -i;
+    }
+    exit(0);
+  }
+  wait(&xstatus);
+  if(xstatus != 0)
+    exit(xstatus);
+  for(int i = 0; i < npages; i++){
+    if(a[i * PGSIZE / sizeof(uint64)] != i){
+      printf("%s: page %d changed by child\n", s, i);
+      exit(1);
+    }
+  }
+}
+
 void
 outofinodes(char *s)
 {
@@ -2925,12 +5091,14 @@ outofinodes(char *s)
 
 struct test slowtests[] = {
   {bigdir, "bigdir"},
+  {dirindex, "dirindex"},
   {writebig, "writebig"},
   {manywrites, "manywrites"},
   {badwrite, "badwrite" },
   {execout, "execout"},
   {diskfull, "diskfull"},
   {outofinodes, "outofinodes"},
+  {swapheap, "swapheap"},
 
   { 0, 0},
 };
@@ -3076,6 +5244,22 @@ drivetests(int quick, int continuous, char *justone) {
   return 0;
 }
 
+// Run as "usertests -t" by exectext, just after exec(). Reads a byte
+// of each page of text before this function, and returns 0 if any of
+// them had to be faulted in, since exec() maps text lazily and very
+// little of it has run yet.
+int
+textuntouched(void)
+{
+  struct rusage r0, r1;
+
+  getrusage(RUSAGE_SELF, &r0);
+  for(uint64 a = PGSIZE; a < PGROUNDDOWN((uint64)textuntouched); a += PGSIZE)
+    (void)*(volatile char *)a;
+  getrusage(RUSAGE_SELF, &r1);
+  return r1.minflt > r0.minflt ? 0 : 1;
+}
+
 int
 main(int argc, char *argv[])
 {
@@ -3089,6 +5273,8 @@ main(int argc, char *argv[])
     continuous = 1;
   } else if(argc == 2 && strcmp(argv[1], "-C") == 0){
     continuous = 2;
+  } else if(argc == 2 && strcmp(argv[1], "-t") == 0){
+    exit(textuntouched());
   } else if(argc == 2 && argv[1][0] != '-'){
     justone = argv[1];
   } else if(argc > 1){
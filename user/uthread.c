@@ -1,14 +1,41 @@
 #include "kernel/types.h"
 #include "kernel/stat.h"
+#include "kernel/param.h"
+#include "kernel/fcntl.h"
+#include "kernel/riscv.h"
+#include "kernel/sysinfo.h"
 #include "user/user.h"
 
+// User-level threads, run M:N: any number of threads on up to NWORKER
+// workers, kernel threads made with clone(). Until thread_workers() is
+// called the process's own kernel thread is the only worker.
+//
+// Each worker has a run queue; a thread yielding goes to the back of
+// its worker's queue, and a worker whose queue is empty steals half of
+// another's. Threads switch with thread_switch(), without a trap, so a
+// thread is put on a queue only once the switch away from it is done:
+// the thread switched to calls finish_switch() first thing, which puts
+// the one before it wherever it's going.
+//
+// Each thread's stack comes from sbrk(), STACK_SIZE-aligned, with a
+// guard page at the bottom and the struct thread at the top, so that
+// mythread() finds the running thread from sp. main() is the one
+// thread that runs on the process's own stack, which lies below the
+// heap. Stacks of threads that have exited are kept for the next
+// thread_create(), since sbrk() can only give memory back from the end
+// of the heap.
+
 /* Possible states of a thread: */
 #define FREE        0x0
 #define RUNNING     0x1
 #define RUNNABLE    0x2
+#define SLEEPING    0x3
+#define BLOCKED     0x4
+#define IDLE        0x5     // a worker's idle loop
 
-#define STACK_SIZE  8192
-#define MAX_THREAD  4
+#define STACK_SIZE  (4*PGSIZE)
+#define NSTACKS     8       // stacks to sbrk() at once
+#define NWORKER     (NCPU+1)
 
 // from kernel/proc.h
 struct context {
@@ -31,82 +58,672 @@ struct context {
 };
 
 struct thread {
-  int            state;             // FREE, RUNNING, RUNNABLE
+  int            state;             // FREE, RUNNING, RUNNABLE, SLEEPING, BLOCKED or IDLE
   struct context ctx;               // the thread's saved registers
-  char           stack[STACK_SIZE]; // the thread's stack
+  void           (*func)();         // what the thread runs
+  struct thread  *next;             // next on a run, sleep, wait or free list
+  uint           wakeup;            // uptime() to wake at, if SLEEPING
+  struct thread_queue *waitq;       // what it's blocking on, if BLOCKED
+  struct worker  *worker;           // the worker running it, or that last did
+  int            nopreempt;         // preemption is off while this is nonzero
+  int            preempt_pending;   // an alarm came while it was
+  char           *stack;            // lowest address of the stack, 0 for main()
+};
+
+// A FIFO list of threads, for the run queues and for blocking.
+struct thread_queue {
+  int           lock;
+  int           n;
+  struct thread *head;
+  struct thread *tail;
+};
+
+struct worker {
+  struct thread_queue runq;         // RUNNABLE threads, in order
+  struct thread       *idle;        // the idle loop, run when runq is empty
+  struct thread       *prev;        // for finish_switch()
+  int                 alarm;        // preemption ticks asked of sigalarm()
+  int                 pid;
 };
 
-struct thread all_thread[MAX_THREAD];
-struct thread *current_thread;
+struct thread main_thread;
+
+static struct worker workers[NWORKER];
+static int nworker = 1;               // workers[0] is the process itself
+
+// sched_lock protects sleepers, free_threads and nactive.
+static int sched_lock;
+static struct thread *sleepers;       // SLEEPING threads, soonest wakeup first
+static struct thread *free_threads;   // FREE threads, whose stacks can be reused
+static char *stack_lo;                // the lowest thread stack
+static int nactive = 1;               // workers that run threads
+static int nidle;                     // of which how many are idle
+static int idle_seq;                  // futex for idle workers, bumped when work turns up
+static volatile int preempt_ticks;    // thread_preempt()'s setting
 
 extern void thread_switch(struct context *old, struct context *new);
+extern void thread_alarm(void);
+
+void thread_yield(void);
+void thread_exit(void);
 
+static void
+spin_lock(int *l)
+{
+  while (__sync_lock_test_and_set(l, 1) != 0)
+    ;
+}
+
+static void
+spin_unlock(int *l)
+{
+  __sync_lock_release(l);
+}
+
+// The running thread, found from sp.
+static struct thread *
+mythread(void)
+{
+  uint64 sp;
+
+  asm volatile("mv %0, sp" : "=r" (sp));
+  if (stack_lo == 0 || sp < (uint64)stack_lo)
+    return &main_thread;
+  return (struct thread *)((sp | (STACK_SIZE - 1)) + 1) - 1;
+}
+
+// Preemption is per thread, like the kernel's push_off(): it is off
+// while the thread changes queues, holds a spin lock, or switches. An
+// alarm that finds it off sets preempt_pending, and thread_preempt_on()
+// yields once it comes back on. A thread with preemption off stays on
+// its worker.
 void
-thread_init(void)
+thread_preempt_off(void)
 {
-  // main() is thread 0, which will make the first invocation to
-  // thread_schedule(). It needs a stack so that the first thread_switch() can
-  // save thread 0's state.
-  current_thread        = &all_thread[0];
-  current_thread->state = RUNNING;
+  mythread()->nopreempt++;
+  __atomic_signal_fence(__ATOMIC_SEQ_CST);
 }
 
 void
-thread_schedule(void)
+thread_preempt_on(void)
+{
+  struct thread *t = mythread();
+
+  __atomic_signal_fence(__ATOMIC_SEQ_CST);
+  if (--t->nopreempt == 0 && t->preempt_pending) {
+    t->preempt_pending = 0;
+    thread_yield();
+  }
+}
+
+static void
+enqueue(struct thread_queue *q, struct thread *t)
+{
+  t->next = 0;
+  if (q->tail)
+    q->tail->next = t;
+  else
+    q->head = t;
+  q->tail = t;
+  q->n++;
+}
+
+static struct thread *
+dequeue(struct thread_queue *q)
+{
+  struct thread *t = q->head;
+
+  if (t) {
+    q->head = t->next;
+    if (q->head == 0)
+      q->tail = 0;
+    q->n--;
+  }
+  return t;
+}
+
+// Put t on w's run queue, and wake an idle worker to steal it.
+static void
+runq_push(struct worker *w, struct thread *t)
+{
+  t->state = RUNNABLE;
+  spin_lock(&w->runq.lock);
+  enqueue(&w->runq, t);
+  spin_unlock(&w->runq.lock);
+
+  if (__atomic_load_n(&nidle, __ATOMIC_SEQ_CST) > 0) {
+    __atomic_fetch_add(&idle_seq, 1, __ATOMIC_SEQ_CST);
+    futex_wake(&idle_seq, 1);
+  }
+}
+
+static struct thread *
+runq_pop(struct worker *w)
+{
+  struct thread *t;
+
+  if (__atomic_load_n(&w->runq.head, __ATOMIC_RELAXED) == 0)
+    return 0;
+  spin_lock(&w->runq.lock);
+  t = dequeue(&w->runq);
+  spin_unlock(&w->runq.lock);
+  return t;
+}
+
+// Take the older half of another worker's run queue, keeping the first
+// of them to run now. Only one run queue lock is held at a time, so that
+// two workers stealing from each other can't deadlock.
+static struct thread *
+steal(struct worker *w)
 {
-  struct thread *t, *next_thread;
-
-  /* Find another runnable thread. */
-  next_thread = 0;
-  t = current_thread + 1;
-  for(int i = 0; i < MAX_THREAD; i++){
-    if(t >= all_thread + MAX_THREAD)
-      t = all_thread;
-    if(t->state == RUNNABLE) {
-      next_thread = t;
-      break;
+  struct thread_queue batch = { 0 };
+  struct thread *t;
+
+  for (struct worker *v = workers; v < workers + nworker; v++) {
+    if (v == w || __atomic_load_n(&v->runq.head, __ATOMIC_RELAXED) == 0)
+      continue;
+    spin_lock(&v->runq.lock);
+    for (int n = (v->runq.n + 1) / 2; n > 0; n--)
+      enqueue(&batch, dequeue(&v->runq));
+    spin_unlock(&v->runq.lock);
+    if ((t = dequeue(&batch)) == 0)
+      continue;
+
+    if (batch.head) {
+      spin_lock(&w->runq.lock);
+      while (batch.head)
+        enqueue(&w->runq, dequeue(&batch));
+      spin_unlock(&w->runq.lock);
     }
-    t = t + 1;
+    return t;
   }
+  return 0;
+}
 
-  if (next_thread == 0) {
-    printf("thread_schedule: no runnable threads\n");
-    exit(-1);
+// Whether any run queue has a thread on it.
+static int
+queued(void)
+{
+  for (struct worker *v = workers; v < workers + nworker; v++)
+    if (__atomic_load_n(&v->runq.head, __ATOMIC_SEQ_CST))
+      return 1;
+  return 0;
+}
+
+// move the sleepers whose time has come to w's run queue.
+static void
+wake_sleepers(struct worker *w)
+{
+  struct thread *t;
+  uint now = uuptime();
+
+  if (__atomic_load_n(&sleepers, __ATOMIC_RELAXED) == 0)
+    return;
+  spin_lock(&sched_lock);
+  while ((t = sleepers) && (int)(t->wakeup - now) <= 0) {
+    sleepers = t->next;
+    runq_push(w, t);
   }
+  spin_unlock(&sched_lock);
+}
+
+// Bring w's alarm up to date with thread_preempt(); it belongs to the
+// worker's kernel thread.
+static void
+set_alarm(struct worker *w)
+{
+  if (w->alarm != preempt_ticks) {
+    w->alarm = preempt_ticks;
+    sigalarm(w->alarm, w->alarm ? thread_alarm : 0);
+  }
+}
 
-  if (current_thread != next_thread) {         /* switch threads?  */
-    next_thread->state = RUNNING;
-    t = current_thread;
-    current_thread = next_thread;
+// The next thread for w to run, if any.
+static struct thread *
+find_work(struct worker *w)
+{
+  struct thread *t;
+
+  set_alarm(w);
+  wake_sleepers(w);
+  if ((t = runq_pop(w)) == 0)
+    t = steal(w);
+  return t;
+}
+
+// Put the thread just switched away from where it belongs, now that
+// nothing runs on its stack.
+static void
+finish_switch(void)
+{
+  struct worker *w = mythread()->worker;
+  struct thread *prev = w->prev;
+  struct thread **tp;
+
+  w->prev = 0;
+  if (prev == 0)
+    return;
+
+  switch (prev->state) {
+  case RUNNABLE:
+    runq_push(w, prev);
+    break;
+  case SLEEPING:
+    spin_lock(&sched_lock);
+    for (tp = &sleepers; *tp && (int)((*tp)->wakeup - prev->wakeup) <= 0; tp = &(*tp)->next)
+      ;
+    prev->next = *tp;
+    *tp = prev;
+    spin_unlock(&sched_lock);
+    break;
+  case BLOCKED:
+    enqueue(prev->waitq, prev);
+    spin_unlock(&prev->waitq->lock);
+    break;
+  case FREE:
+    if (prev->stack) {
+      spin_lock(&sched_lock);
+      prev->next = free_threads;
+      free_threads = prev;
+      spin_unlock(&sched_lock);
+    }
+    break;
+  }
+}
 
-    thread_switch(&t->ctx, &current_thread->ctx);
-  } else
-    next_thread = 0;
+static void
+switch_to(struct worker *w, struct thread *t, struct thread *next)
+{
+  w->prev = t;
+  next->worker = w;
+  if (next->state != IDLE)
+    next->state = RUNNING;
+  thread_switch(&t->ctx, &next->ctx);
+  finish_switch();
 }
 
+// Leave the running thread, whose state says where it's going, and run
+// the next one, with preemption off. A thread that is only yielding
+// keeps running if there's nothing else to. If there's nothing at all,
+// the worker switches to its idle loop.
 void
-thread_create(void (*func)())
+thread_schedule(void)
+{
+  struct thread *t = mythread(), *next_thread;
+  struct worker *w = t->worker;
+
+  // the thread switched to turns preemption back on, so it must be off just once
+  if (t->nopreempt != 1) {
+    printf("thread_schedule: preemption not off once\n");
+    exit(-1);
+  }
+
+  if ((next_thread = find_work(w)) == 0) {
+    if (t->state == RUNNABLE) {
+      t->state = RUNNING;
+      return;
+    }
+    next_thread = w->idle;
+  }
+
+  switch_to(w, t, next_thread);
+}
+
+// A worker's idle loop, which runs threads as work turns up, or waits
+// for it. If no worker has anything to run and no thread is asleep,
+// every thread has exited or is blocked for good: the program is over.
+static void
+worker_idle(void)
+{
+  struct thread *idle = mythread();
+  struct worker *w = idle->worker;
+  struct thread *t;
+
+  for (;;) {
+    finish_switch();
+    if ((t = find_work(w)) != 0) {
+      switch_to(w, idle, t);
+      continue;
+    }
+
+    // look again, now that runq_push() will see this worker is idle. a
+    // worker counts as idle only while it holds no thread, so if all are
+    // idle and nothing is queued or asleep, nothing can become runnable.
+    int seq = __atomic_load_n(&idle_seq, __ATOMIC_SEQ_CST);
+    __atomic_fetch_add(&nidle, 1, __ATOMIC_SEQ_CST);
+    if ((t = find_work(w)) != 0) {
+      __atomic_fetch_sub(&nidle, 1, __ATOMIC_SEQ_CST);
+      switch_to(w, idle, t);
+      continue;
+    }
+
+    spin_lock(&sched_lock);
+    int done   = __atomic_load_n(&nidle, __ATOMIC_SEQ_CST) == nactive && sleepers == 0 && !queued();
+    int asleep = sleepers != 0;
+    spin_unlock(&sched_lock);
+
+    if (done) {
+      printf("thread_schedule: no runnable threads\n");
+      exit(-1);
+    }
+
+    // a sleeping worker misses futex_wake()s, so sleep a tick at a time
+    if (asleep)
+      sleep(1);
+    else
+      futex_wait(&idle_seq, seq);
+    __atomic_fetch_sub(&nidle, 1, __ATOMIC_SEQ_CST);
+  }
+}
+
+// Get a stack for a thread, with sched_lock held.
+static struct thread *
+thread_alloc(void)
 {
   struct thread *t;
+  char *p, *stack;
 
-  for (t = all_thread; t < all_thread + MAX_THREAD; t++) {
-    if (t->state == FREE) break;
+  if ((t = free_threads) != 0) {
+    free_threads = t->next;
+    return t;
   }
 
-  t->state = RUNNABLE;
+  // other workers' malloc() may sbrk() too, so align what was got
+  if ((p = sbrk((NSTACKS + 1) * STACK_SIZE)) == (char *)-1)
+    return 0;
+  p = (char *)(((uint64)p + STACK_SIZE - 1) & ~(uint64)(STACK_SIZE - 1));
+  if (stack_lo == 0)
+    stack_lo = p;
+
+  for (int i = 0; i < NSTACKS; i++) {
+    stack = p + i * STACK_SIZE;
+    if (madvise(stack, PGSIZE, MADV_GUARD) != 0)
+      return 0;
+    t = (struct thread *)(stack + STACK_SIZE) - 1;
+    t->stack = stack + PGSIZE;
+    if (i < NSTACKS - 1) {
+      t->next = free_threads;
+      free_threads = t;
+    }
+  }
+  return t;
+}
+
+// A thread that will first run func().
+static struct thread *
+thread_new(void (*func)())
+{
+  struct thread *t;
+
+  spin_lock(&sched_lock);
+  t = thread_alloc();
+  spin_unlock(&sched_lock);
+  if (t == 0)
+    return 0;
+
+  t->func = func;
+  memset(&t->ctx, 0, sizeof(t->ctx));
+  t->nopreempt = 1;
+  t->preempt_pending = 0;
 
-  // the stack pointer points at the bottom, and grows upwards
-  t->ctx.sp = (uint64)&t->stack[STACK_SIZE];
-  t->ctx.ra = (uint64)func;
+  // the stack grows down from just below the struct thread
+  t->ctx.sp = (uint64)t & ~0xfL;
+  return t;
+}
+
+// where a new thread starts, from thread_schedule() with preemption off.
+static void
+thread_start(void)
+{
+  finish_switch();
+  thread_preempt_on();
+  mythread()->func();
+  thread_exit();
+}
+
+static void
+idle_start(void)
+{
+  worker_idle();
+}
+
+void
+thread_init(void)
+{
+  // main() is thread 0. It needs a struct thread so that the first
+  // thread_switch() can save thread 0's state; it runs on the process's
+  // own stack.
+  main_thread.state  = RUNNING;
+  main_thread.worker = &workers[0];
+
+  if ((workers[0].idle = thread_new(0)) == 0) {
+    printf("thread_init: out of memory\n");
+    exit(-1);
+  }
+  workers[0].idle->state  = IDLE;
+  workers[0].idle->worker = &workers[0];
+  workers[0].idle->ctx.ra = (uint64)idle_start;
+  workers[0].pid = getpid();
+}
+
+// Start a thread running func(), after the threads already runnable on
+// this worker. Returns 0 if out of memory.
+struct thread *
+thread_create(void (*func)())
+{
+  struct thread *t;
+
+  if ((t = thread_new(func)) == 0)
+    return 0;
+  t->ctx.ra = (uint64)thread_start;
+
+  thread_preempt_off();
+  runq_push(mythread()->worker, t);
+  thread_preempt_on();
+  return t;
 }
 
 void
 thread_yield(void)
 {
-  current_thread->state = RUNNABLE;
+  thread_preempt_off();
+  mythread()->state = RUNNABLE;
+  thread_schedule();
+  thread_preempt_on();
+}
+
+// Give up the CPU for at least ticks clock ticks.
+void
+thread_sleep(int ticks)
+{
+  struct thread *t = mythread();
+
+  thread_preempt_off();
+  t->state  = SLEEPING;
+  t->wakeup = uuptime() + ticks;
+  thread_schedule();
+  thread_preempt_on();
+}
+
+// Lock q, to check whatever is waited for on it. Turns preemption off
+// until thread_qunlock().
+void
+thread_qlock(struct thread_queue *q)
+{
+  thread_preempt_off();
+  spin_lock(&q->lock);
+}
+
+void
+thread_qunlock(struct thread_queue *q)
+{
+  spin_unlock(&q->lock);
+  thread_preempt_on();
+}
+
+// Block on q, which the caller has locked, until thread_wake() or
+// thread_wakeall() is called on it; q stays locked until the thread has
+// been switched away from, so no wakeup is lost, and is locked again on
+// return.
+void
+thread_wait(struct thread_queue *q)
+{
+  struct thread *t = mythread();
+
+  t->state = BLOCKED;
+  t->waitq = q;
+  thread_schedule();
+  spin_lock(&q->lock);
+}
+
+// Make the thread that has waited longest on q runnable.
+void
+thread_wake(struct thread_queue *q)
+{
+  struct thread *t;
+
+  thread_qlock(q);
+  if ((t = dequeue(q)) != 0)
+    runq_push(mythread()->worker, t);
+  thread_qunlock(q);
+}
+
+// Make every thread waiting on q runnable.
+void
+thread_wakeall(struct thread_queue *q)
+{
+  struct thread *t;
+
+  thread_qlock(q);
+  while ((t = dequeue(q)) != 0)
+    runq_push(mythread()->worker, t);
+  thread_qunlock(q);
+}
+
+void
+thread_exit(void)
+{
+  thread_preempt_off();
+  mythread()->state = FREE;
   thread_schedule();
 }
 
+// Called by thread_alarm() with the registers of the thread the alarm
+// interrupted, regs[0] being its pc and regs[n] xn. Returns 0 to go back
+// to it with sigreturn(), or 1 once the thread, preempted, has been
+// scheduled again and thread_alarm() should restore regs itself.
+int
+thread_tick(uint64 *regs)
+{
+  struct thread *t = mythread();
+  struct worker *w = t->worker;
+
+  if (t->nopreempt) {
+    t->preempt_pending = 1;
+    return 0;
+  }
+
+  // no other alarm comes until sigdone(), so t stays on w until then
+  if (w->runq.head == 0 && (sleepers == 0 || (int)(sleepers->wakeup - uuptime()) > 0))
+    return 0;
+
+  thread_preempt_off();
+  regs[0] = sigdone();
+  t->state = RUNNABLE;
+  thread_schedule();
+  thread_preempt_on();
+  return 1;
+}
+
+// Preempt the running thread every ticks clock ticks of CPU time, or
+// stop preempting if ticks is 0. Each worker takes up the setting the
+// next time it looks for work. Code that mustn't be interrupted by
+// another thread on the same worker, such as malloc(), whose caches are
+// per kernel thread, should run with preemption off.
+void
+thread_preempt(int ticks)
+{
+  thread_preempt_off();
+  preempt_ticks = ticks;
+  set_alarm(mythread()->worker);
+  thread_preempt_on();
+}
+
+// A worker's kernel thread starts here, in its idle loop.
+static void
+worker_start(void *arg)
+{
+  struct worker *w = arg;
+
+  w->pid = getpid();
+  worker_idle();
+}
+
+// The process's own kernel thread, once thread_workers() has handed its
+// threads to the workers: wait until one of them exits, which a thread
+// calling exit() makes happen, and exit the same way once the rest are
+// gone too.
+static void
+supervise(void)
+{
+  int status, pid;
+
+  finish_switch();
+  spin_lock(&sched_lock);
+  nactive--;
+  spin_unlock(&sched_lock);
+
+  if ((pid = wait(&status)) < 0)
+    exit(-1);
+  for (struct worker *w = workers + 1; w < workers + nworker; w++)
+    if (w->pid != pid)
+      kill(w->pid);
+  while (wait(0) >= 0)
+    ;
+  exit(status);
+}
+
+// Run threads on n workers, one per CPU if n is 0, each a kernel thread
+// bound to a CPU; the process's own kernel thread stops running threads
+// and only waits for the program to end. Called once, by main(), after
+// thread_init(). Returns 0, or -1 if the workers couldn't be started.
+int
+thread_workers(int n)
+{
+  struct sysinfo si;
+  struct thread *t = mythread();
+
+  if (sysinfo(&si) < 0 || si.ncpu == 0)
+    si.ncpu = 1;
+  if (n <= 0)
+    n = si.ncpu;
+  if (n > NWORKER - 1)
+    n = NWORKER - 1;
+
+  // until supervise() runs, the process's own kernel thread still counts
+  nactive = n + 1;
+  for (int i = 1; i <= n; i++) {
+    struct worker *w = &workers[i];
+
+    if ((w->idle = thread_new(0)) == 0)
+      return -1;
+    w->idle->state  = IDLE;
+    w->idle->worker = w;
+    nworker = i + 1;
+    if ((w->pid = clone(worker_start, w, (void *)w->idle->ctx.sp)) < 0)
+      return -1;
+    sched_setaffinity(w->pid, 1L << ((i - 1) % si.ncpu));
+  }
+
+  // hand main() to the workers, by way of finish_switch() in supervise()
+  thread_preempt_off();
+  workers[0].idle->ctx.ra = (uint64)supervise;
+  t->state = RUNNABLE;
+  switch_to(&workers[0], t, workers[0].idle);
+  thread_preempt_on();
+  return 0;
+}
+
 volatile int a_started, b_started, c_started;
 volatile int a_n, b_n, c_n;
 
@@ -126,8 +743,7 @@ thread_a(void)
   }
   printf("thread_a: exit after %d\n", a_n);
 
-  current_thread->state = FREE;
-  thread_schedule();
+  thread_exit();
 }
 
 void
@@ -146,8 +762,7 @@ thread_b(void)
   }
   printf("thread_b: exit after %d\n", b_n);
 
-  current_thread->state = FREE;
-  thread_schedule();
+  thread_exit();
 }
 
 void
@@ -166,8 +781,108 @@ thread_c(void)
   }
   printf("thread_c: exit after %d\n", c_n);
 
-  current_thread->state = FREE;
-  thread_schedule();
+  thread_exit();
+}
+
+// uthread -p: CPU-bound threads that never yield must all get to run.
+#define NSPIN 8
+
+volatile int spin_stop, spin_started, spin_done;
+volatile uint64 spin_n[NSPIN];
+
+void
+thread_spin(void)
+{
+  int me;
+
+  me = __sync_fetch_and_add(&spin_started, 1);
+  while (!spin_stop)
+    spin_n[me]++;
+  __sync_fetch_and_add(&spin_done, 1);
+}
+
+void
+preempt_test(void)
+{
+  int i;
+
+  for (i = 0; i < NSPIN; i++) {
+    if (thread_create(thread_spin) == 0) {
+      printf("uthread: thread_create failed\n");
+      exit(1);
+    }
+  }
+
+  thread_preempt(1);
+  thread_sleep(10);
+  spin_stop = 1;
+  while (spin_done < NSPIN)
+    thread_yield();
+  thread_preempt(0);
+
+  for (i = 0; i < NSPIN; i++) {
+    if (spin_n[i] == 0) {
+      printf("uthread: thread %d starved\n", i);
+      exit(1);
+    }
+  }
+  printf("uthread: preemption ok\n");
+  exit(0);
+}
+
+// uthread -m: threads that yield as they go, spread over one worker per
+// CPU, while main() blocks until they are all done.
+#define NTASK 32
+
+volatile int task_started, task_done;
+volatile int task_pid[NTASK];
+struct thread_queue task_q;
+
+void
+thread_task(void)
+{
+  int me = __sync_fetch_and_add(&task_started, 1);
+
+  for (int i = 0; i < 100; i++) {
+    for (volatile int j = 0; j < 10000; j++)
+      ;
+    thread_yield();
+  }
+  task_pid[me] = getpid();
+  if (__sync_add_and_fetch(&task_done, 1) == NTASK)
+    thread_wake(&task_q);
+}
+
+void
+workers_test(void)
+{
+  int i, j, n = 0;
+
+  if (thread_workers(0) < 0) {
+    printf("uthread: thread_workers failed\n");
+    exit(1);
+  }
+  for (i = 0; i < NTASK; i++) {
+    if (thread_create(thread_task) == 0) {
+      printf("uthread: thread_create failed\n");
+      exit(1);
+    }
+  }
+
+  thread_qlock(&task_q);
+  while (task_done < NTASK)
+    thread_wait(&task_q);
+  thread_qunlock(&task_q);
+
+  // count the workers that finished a task
+  for (i = 0; i < NTASK; i++) {
+    for (j = 0; j < i && task_pid[j] != task_pid[i]; j++)
+      ;
+    if (j == i)
+      n++;
+  }
+  printf("uthread: %d threads finished on %d workers\n", NTASK, n);
+  exit(0);
 }
 
 int
@@ -176,10 +891,13 @@ main(int argc, char *argv[])
   a_started = b_started = c_started = 0;
   a_n = b_n = c_n = 0;
   thread_init();
+  if (argc > 1 && strcmp(argv[1], "-p") == 0)
+    preempt_test();
+  if (argc > 1 && strcmp(argv[1], "-m") == 0)
+    workers_test();
   thread_create(thread_a);
   thread_create(thread_b);
   thread_create(thread_c);
-  current_thread->state = FREE;
-  thread_schedule();
+  thread_exit();
   exit(0);
 }
@@ -3,22 +3,26 @@
 #include "kernel/fcntl.h"
 #include "user/user.h"
 
-char buf[512];
-
 void
 wc(int fd, char *name)
 {
+  struct stream *s;
   int i, n;
   int l, w, c, inword;
+  char *p;
 
+  if((s = sopen(fd)) == 0){
+    printf("wc: out of memory\n");
+    exit(1);
+  }
   l = w = c = 0;
   inword = 0;
-  while((n = read(fd, buf, sizeof(buf))) > 0){
+  while((n = sread(s, &p)) > 0){
     for(i=0; i<n; i++){
       c++;
-      if(buf[i] == '\n')
+      if(p[i] == '\n')
         l++;
-      if(strchr(" \r\t\n\v", buf[i]))
+      if(strchr(" \r\t\n\v", p[i]))
         inword = 0;
       else if(!inword){
         w++;
@@ -30,6 +34,7 @@ wc(int fd, char *name)
     printf("wc: read error\n");
     exit(1);
   }
+  sclose(s);
   printf("%d %d %d %s\n", l, w, c, name);
 }
 
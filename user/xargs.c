@@ -4,15 +4,17 @@
 #include "kernel/param.h"
 #include "user/user.h"
 
+// Read a line from fd into buf, without its newline, through fgetc()'s buffer rather than a read()
+// per character. Returns the bytes read including the newline, 0 at EOF, or -1 if the line is
+// too long.
 int
 read_line(int fd, char *buf, int buf_len)
 {
   int bytes_read = 0;
 
-  int last_read;
-  char last_char;
+  int c;
 
-  while ((last_read = read(fd, &last_char, sizeof last_char)) > 0) {
+  while ((c = fgetc(fd)) >= 0) {
     bytes_read++;
 
     if (bytes_read > buf_len) {
@@ -20,105 +22,167 @@ read_line(int fd, char *buf, int buf_len)
       return -1;
     }
 
-    if (last_char == '\n') {
+    if (c == '\n') {
       *buf++ = '\0';
 
       return bytes_read;
     }
 
-    *buf++ = last_char;
+    *buf++ = c;
   }
 
   *buf = '\0';
 
-  if (last_read < 0) {
-    fprintf(2, "error: could not read fd '%d'", fd);
-    return -1;
-  }
-
   // EOF
   return 0;
 }
 
-int
-main(int argc, char *argv[])
+// the number of children still running
+int running;
+
+// Start the command with args, first waiting for a child to finish if
+// max_procs of them are already running.
+void
+run(char **args, int max_procs)
 {
-  if (argc < 2) {
-    fprintf(2, "Usage: xargs <command> [arguments]\n");
-    exit(-1);
+  if (running == max_procs) {
+    wait(0);
+    running--;
   }
 
-  char buf[512];
+  // spawn() starts the command without copying xargs first
+  if (spawn(args[0], args, 0, 0) < 0) {
+    fprintf(2, "error: could not exec");
+    exit(-1);
+  }
 
-  // the arguments we will pass to the exec() call in the child process
-  char *child_argv[MAXARG] = {0};
+  running++;
+}
 
-  // the number of arguments we are passing to the child process
-  int child_argc;
+// Split line at spaces, adding the words to args from args[*argc] on. Returns -1, leaving line
+// and *argc alone, if there isn't room for them all.
+int
+split(char *line, char **args, int *argc)
+{
+  int n = *argc;
 
-  // first, use all but the first argument to this process as arguments for
-  // the child process
-  for (child_argc = 0; child_argc < argc - 1; child_argc++) {
-    child_argv[child_argc] = argv[child_argc + 1];
+  for (char *c = line; *c != '\0'; c++) {
+    if (*c != ' ' && (c == line || c[-1] == ' ') && n++ == MAXARG - 1) {
+      return -1;
+    }
   }
 
-  // the starting point for reading arguments from stdin into child_argv
-  int child_argv_start = child_argc;
+  for (char *c = line; *c != '\0'; c++) {
+    if (*c != ' ' && (c == line || c[-1] == '\0')) {
+      // we've found the start of an argument
+      args[(*argc)++] = c;
+    }
 
-  int readline_rv;
+    if (*c == ' ') {
+      *c = '\0';
+    }
+  }
 
-  while ((readline_rv = read_line(0, buf, sizeof buf)) >= 0) {
-    // reset the child_argc count to the arguments passed to xargs
-    child_argc = child_argv_start;
+  return 0;
+}
 
-    // reset the last child_argv to NULL
-    child_argv[child_argc] = 0;
+void
+usage(void)
+{
+  fprintf(2, "Usage: xargs [-P procs] [-n lines] <command> [arguments]\n");
+  exit(-1);
+}
 
-    for (char *c = buf; *c != '\0'; c++) {
-      // skip whitespace until we've found the start of the argument
-      if (*c == ' ' && child_argv[child_argc] == 0) {
-        continue;
-      }
+int
+main(int argc, char *argv[])
+{
+  // the most children to run at once, and the most input lines to give each one
+  int max_procs = 1;
+  int max_lines = 1;
 
-      if (*c != ' ' && child_argv[child_argc] == 0) {
-        // we've found the start of the argument
-        child_argv[child_argc] = c;
+  int i;
 
-        continue;
-      }
+  for (i = 1; i + 1 < argc && argv[i][0] == '-'; i += 2) {
+    if (strcmp(argv[i], "-P") == 0) {
+      max_procs = atoi(argv[i + 1]);
+    } else if (strcmp(argv[i], "-n") == 0) {
+      max_lines = atoi(argv[i + 1]);
+    } else {
+      usage();
+    }
+  }
 
-      if (*c == ' ') {
-        // we've found the end of the argument
-        *c = '\0';
-        child_argc++;
+  if (i == argc || max_procs < 1 || max_lines < 1) {
+    usage();
+  }
 
-        continue;
-      }
-    }
+  // a batch holds at least one word per line
+  if (max_lines > MAXARG) {
+    max_lines = MAXARG;
+  }
 
-    // we saw at least one non-whitespace character, but did not see a ' ', so
-    // terminate the current argument
-    if (child_argv[child_argc] != 0) {
-      child_argc++;
-    }
+  // each line of a batch gets its own buffer, since its words are pointed to until the batch runs
+  static char bufs[MAXARG][512];
 
-    // signify the end of the arguments
-    child_argv[child_argc] = 0;
+  // the arguments we will pass to the child processes
+  char *child_argv[MAXARG] = {0};
 
-    int child_pid = fork();
+  // first, use the arguments to this process after its options as arguments for each child
+  int child_argv_start = 0;
 
-    if (child_pid < 0) {
-      fprintf(2, "error: could not fork");
+  for (; i < argc; i++) {
+    if (child_argv_start == MAXARG - 1) {
+      fprintf(2, "error: too many arguments");
       exit(-1);
     }
 
-    if (child_pid == 0) {
-      if (exec(argv[1], child_argv) < 0) {
-        fprintf(2, "error: could not exec");
-        exit(-1);
+    child_argv[child_argv_start++] = argv[i];
+  }
+
+  // the arguments and lines in the batch so far
+  int child_argc = child_argv_start;
+  int nlines = 0;
+
+  // whether any command has been run, since one runs even when there is no input
+  int ran = 0;
+
+  int readline_rv;
+
+  while ((readline_rv = read_line(0, bufs[nlines], sizeof bufs[0])) >= 0) {
+    // a last line with no newline still counts, but an empty one doesn't
+    if (readline_rv > 0 || bufs[nlines][0] != '\0') {
+      if (split(bufs[nlines], child_argv, &child_argc) < 0) {
+        if (nlines == 0) {
+          fprintf(2, "error: too many arguments");
+          exit(-1);
+        }
+
+        // start a new batch with this line, moving it to the first buffer
+        child_argv[child_argc] = 0;
+        run(child_argv, max_procs);
+        ran = 1;
+
+        memmove(bufs[0], bufs[nlines], sizeof bufs[0]);
+        nlines = 0;
+        child_argc = child_argv_start;
+
+        if (split(bufs[0], child_argv, &child_argc) < 0) {
+          fprintf(2, "error: too many arguments");
+          exit(-1);
+        }
       }
-    } else {
-      wait(0);
+
+      nlines++;
+    }
+
+    if (nlines == max_lines || (readline_rv == 0 && (nlines > 0 || !ran))) {
+      // signify the end of the arguments
+      child_argv[child_argc] = 0;
+      run(child_argv, max_procs);
+      ran = 1;
+
+      nlines = 0;
+      child_argc = child_argv_start;
     }
 
     // if we saw an EOF, there will be no more lines
@@ -127,5 +191,10 @@ main(int argc, char *argv[])
     }
   }
 
+  while (running > 0) {
+    wait(0);
+    running--;
+  }
+
   exit(0);
 }